@@ -0,0 +1,74 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Minimal timing harness shared by the guest side benchmarks
+ * These are ordinary Linux programs, built by build.sh and run by run.sh, either natively
+ * to get a baseline or under flinux.
+ *
+ * Each benchmark body runs a given number of operations. The harness doubles the count
+ * until one run takes at least BENCH_MIN_NS, then reports the best of BENCH_RUNS runs
+ * as one line on stdout:
+ *   <name>\t<ns/op>\t<ops>
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_MIN_NS	200000000LL /* 200ms */
+#define BENCH_RUNS		5
+
+/* Keep the compiler from optimizing away a value or caching memory across it */
+#define bench_use(x)	__asm__ __volatile__("" : : "r"(x) : "memory")
+#define bench_barrier()	__asm__ __volatile__("" : : : "memory")
+
+static inline int64_t bench_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t bench_time(void (*fn)(long ops), long ops)
+{
+	int64_t start = bench_now();
+	fn(ops);
+	return bench_now() - start;
+}
+
+static void bench_run(const char *name, void (*fn)(long ops))
+{
+	long ops = 1;
+	/* Warm up and calibrate, this also gets the code translated */
+	while (bench_time(fn, ops) < BENCH_MIN_NS && ops < (1L << 30))
+		ops *= 2;
+	int64_t best = INT64_MAX;
+	for (int i = 0; i < BENCH_RUNS; i++)
+	{
+		int64_t t = bench_time(fn, ops);
+		if (t < best)
+			best = t;
+	}
+	printf("%s\t%.2f\t%ld\n", name, (double)best / ops, ops);
+	fflush(stdout);
+}
@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# This file is part of Foreign Linux.
+#
+# Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+
+# Build the guest benchmarks as static Linux binaries into bench/out
+#   dbt/  translator microbenchmarks
+#   sys/  emulated kernel benchmarks
+# Run on a Linux box or inside a flinux environment with gcc installed.
+#   CC      compiler, default gcc
+#   CFLAGS  default "-m32 -O2", use "-O2" for x86-64 guests
+#   OUT     output directory, default bench/out
+
+set -e
+cd "$(dirname "$0")"
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--m32 -O2}
+OUT=${OUT:-out}
+
+mkdir -p "$OUT"
+for src in dbt/*.c sys/*.c; do
+	name=$(basename "$(dirname "$src")")_$(basename "$src" .c)
+	echo "CC $src"
+	$CC $CFLAGS -static -pthread -o "$OUT/$name" "$src"
+done
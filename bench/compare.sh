@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# This file is part of Foreign Linux.
+#
+# Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+
+# Compare two results files written by "run.sh -o"
+# Usage: compare.sh OLD NEW
+# Prints ns/op of both and new/old ratio, ratios above 1 are slowdowns.
+
+if [ $# -ne 2 ]; then
+	echo "Usage: $0 OLD NEW" >&2
+	exit 1
+fi
+
+awk -F '\t' '
+	/^#/ || $1 == "benchmark" { next }
+	FNR == NR { old[$1] = $2; next }
+	{
+		if ($1 in old && old[$1] > 0)
+			printf "%-24s %12s %12s %8.2f\n", $1, old[$1], $2, $2 / old[$1]
+		else
+			printf "%-24s %12s %12s %8s\n", $1, "-", $2, "-"
+	}
+	BEGIN { printf "%-24s %12s %12s %8s\n", "benchmark", "old", "new", "ratio" }
+' "$1" "$2"
@@ -0,0 +1,57 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Direct branches: a counted loop with a data dependent forward branch inside
+ * Measures block chaining of direct jumps and conditional branches.
+ */
+
+#include "../bench.h"
+
+static void loop(long ops)
+{
+	unsigned int x = 1, acc = 0;
+	for (long i = 0; i < ops; i++)
+	{
+		x = x * 1103515245 + 12345;
+		if (x & 0x10000)
+			acc += x;
+		else
+			acc ^= x;
+		bench_barrier();
+	}
+	bench_use(acc);
+}
+
+static __attribute__((noinline)) void empty(void)
+{
+	bench_barrier();
+}
+
+static void direct_call(long ops)
+{
+	for (long i = 0; i < ops; i++)
+		empty();
+}
+
+int main()
+{
+	bench_run("branch_loop", loop);
+	bench_run("direct_call", direct_call);
+	return 0;
+}
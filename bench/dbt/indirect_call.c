@@ -0,0 +1,79 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Indirect calls through a table of function pointers, like C++ virtual calls
+ * A single target is what the inline cache handles best, rotating among several targets
+ * exercises the sieve and return address prediction.
+ */
+
+#include "../bench.h"
+
+struct object
+{
+	int (*method)(struct object *obj, int x);
+	int value;
+};
+
+static __attribute__((noinline)) int method_add(struct object *obj, int x) { return x + obj->value; }
+static __attribute__((noinline)) int method_sub(struct object *obj, int x) { return x - obj->value; }
+static __attribute__((noinline)) int method_xor(struct object *obj, int x) { return x ^ obj->value; }
+static __attribute__((noinline)) int method_mul(struct object *obj, int x) { return x * obj->value; }
+static __attribute__((noinline)) int method_shl(struct object *obj, int x) { return x << (obj->value & 7); }
+static __attribute__((noinline)) int method_shr(struct object *obj, int x) { return x >> (obj->value & 7); }
+static __attribute__((noinline)) int method_or(struct object *obj, int x) { return x | obj->value; }
+static __attribute__((noinline)) int method_and(struct object *obj, int x) { return x & obj->value; }
+
+#define OBJECT_COUNT	64
+static struct object objects[OBJECT_COUNT];
+
+static void init_objects(int targets)
+{
+	static int (*const methods[8])(struct object *, int) =
+	{
+		method_add, method_sub, method_xor, method_mul, method_shl, method_shr, method_or, method_and,
+	};
+	for (int i = 0; i < OBJECT_COUNT; i++)
+	{
+		/* Shuffle a bit so the pattern is not trivially periodic */
+		objects[i].method = methods[(i * 5 + i / 8) % targets];
+		objects[i].value = i + 1;
+	}
+}
+
+static void dispatch(long ops)
+{
+	int x = 0;
+	for (long i = 0; i < ops; i++)
+	{
+		struct object *obj = &objects[i & (OBJECT_COUNT - 1)];
+		x = obj->method(obj, x);
+	}
+	bench_use(x);
+}
+
+int main()
+{
+	init_objects(1);
+	bench_run("indirect_call_1", dispatch);
+	init_objects(2);
+	bench_run("indirect_call_2", dispatch);
+	init_objects(8);
+	bench_run("indirect_call_8", dispatch);
+	return 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Deep recursion: calls nest deeper than any return prediction structure before unwinding
+ * Reports time per call/return pair.
+ */
+
+#include "../bench.h"
+
+static __attribute__((noinline)) int recurse(int depth)
+{
+	if (depth == 0)
+		return 0;
+	int r = recurse(depth - 1) + 1;
+	bench_barrier();
+	return r;
+}
+
+static void recursion(long ops, int depth)
+{
+	int x = 0;
+	for (long i = 0; i < ops; i += depth)
+		x += recurse(depth);
+	bench_use(x);
+}
+
+static void recursion_16(long ops) { recursion(ops, 16); }
+static void recursion_1k(long ops) { recursion(ops, 1024); }
+static void recursion_8k(long ops) { recursion(ops, 8192); }
+
+int main()
+{
+	bench_run("recursion_16", recursion_16);
+	bench_run("recursion_1k", recursion_1k);
+	bench_run("recursion_8k", recursion_8k);
+	return 0;
+}
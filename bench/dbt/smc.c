@@ -0,0 +1,81 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Self modifying code: rewrite the immediate of "mov eax, imm32; ret" and call it
+ * Every operation invalidates the translation of the stub. A separate page with code
+ * that is never written gives the cost of a write to a page containing translated code.
+ */
+
+#include "../bench.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+typedef int (*stub_t)(void);
+
+static uint8_t *code_page;
+
+static void gen_stub(uint8_t *p, int value)
+{
+	p[0] = 0xB8; /* mov eax, imm32 */
+	memcpy(p + 1, &value, 4);
+	p[5] = 0xC3; /* ret */
+}
+
+static void smc_rewrite(long ops)
+{
+	stub_t stub = (stub_t)code_page;
+	int x = 0;
+	for (long i = 0; i < ops; i++)
+	{
+		memcpy(code_page + 1, &i, 4);
+		bench_barrier();
+		x += stub();
+	}
+	bench_use(x);
+}
+
+static void smc_same_page(long ops)
+{
+	/* Call a stub and write data into the other half of the same page */
+	stub_t stub = (stub_t)code_page;
+	volatile int *data = (volatile int *)(code_page + 2048);
+	int x = 0;
+	for (long i = 0; i < ops; i++)
+	{
+		*data = (int)i;
+		x += stub();
+	}
+	bench_use(x);
+}
+
+int main()
+{
+	code_page = mmap(NULL, 4096, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code_page == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+	gen_stub(code_page, 0);
+	bench_run("smc_rewrite", smc_rewrite);
+	gen_stub(code_page, 1);
+	bench_run("smc_same_page", smc_same_page);
+	return 0;
+}
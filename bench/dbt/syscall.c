@@ -0,0 +1,62 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* System call round trips
+ * getpid is issued with syscall() as glibc may cache it. clock_gettime goes through
+ * whatever path libc picks (vDSO if available) as well as the raw system call.
+ */
+
+#include "../bench.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static void getpid_raw(long ops)
+{
+	for (long i = 0; i < ops; i++)
+		bench_use(syscall(SYS_getpid));
+}
+
+static void clock_gettime_libc(long ops)
+{
+	struct timespec ts;
+	for (long i = 0; i < ops; i++)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		bench_use(ts.tv_nsec);
+	}
+}
+
+static void clock_gettime_raw(long ops)
+{
+	struct timespec ts;
+	for (long i = 0; i < ops; i++)
+	{
+		syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+		bench_use(ts.tv_nsec);
+	}
+}
+
+int main()
+{
+	bench_run("getpid", getpid_raw);
+	bench_run("clock_gettime", clock_gettime_libc);
+	bench_run("clock_gettime_raw", clock_gettime_raw);
+	return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Thread local storage access, which goes through the gs segment on i386 */
+
+#include "../bench.h"
+
+static __thread int tls_counter;
+static __thread int tls_array[16];
+
+static void tls_increment(long ops)
+{
+	for (long i = 0; i < ops; i++)
+	{
+		tls_counter++;
+		bench_barrier();
+	}
+	bench_use(tls_counter);
+}
+
+static void tls_indexed(long ops)
+{
+	int x = 0;
+	for (long i = 0; i < ops; i++)
+	{
+		x += tls_array[i & 15];
+		tls_array[(i + 1) & 15] = x;
+		bench_barrier();
+	}
+	bench_use(x);
+}
+
+int main()
+{
+	bench_run("tls_increment", tls_increment);
+	bench_run("tls_indexed", tls_indexed);
+	return 0;
+}
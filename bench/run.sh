@@ -0,0 +1,62 @@
+#!/bin/sh
+#
+# This file is part of Foreign Linux.
+#
+# Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+
+# Run the benchmarks built by build.sh and print one "<name> <ns/op> <ops>" line each
+# Usage: run.sh [-o FILE] [benchmark...]
+#   -o FILE also write the results to FILE as tab separated values, see compare.sh
+#   RUNNER  command prefix to run each binary with, e.g. "flinux" to start them from a
+#           native Linux shell, leave empty when this script itself runs under flinux
+#   LABEL   free form build description recorded in the results file
+#   OUT     directory holding the binaries, default bench/out
+
+RESULTS=
+if [ "$1" = "-o" ]; then
+	RESULTS=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+	shift 2
+fi
+cd "$(dirname "$0")"
+OUT=${OUT:-out}
+
+if [ $# -eq 0 ]; then
+	set -- $(ls "$OUT" | grep -v '\.log$')
+fi
+
+if [ -n "$RESULTS" ]; then
+	{
+		printf '# label\t%s\n' "$LABEL"
+		printf '# date\t%s\n' "$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+		printf '# uname\t%s\n' "$(uname -a)"
+		printf 'benchmark\tns_per_op\tops\n'
+	} > "$RESULTS"
+fi
+
+printf '%-24s %12s %12s\n' benchmark ns/op ops
+status=0
+for name in "$@"; do
+	if ! $RUNNER "$OUT/$name" > "$OUT/$name.log" 2>&1; then
+		echo "$name: failed, see $OUT/$name.log" >&2
+		status=1
+	fi
+	while IFS="	" read -r bench ns ops; do
+		printf '%-24s %12s %12s\n' "$bench" "$ns" "$ops"
+		[ -n "$RESULTS" ] && printf '%s\t%s\t%s\n' "$bench" "$ns" "$ops" >> "$RESULTS"
+	done < "$OUT/$name.log"
+done
+exit $status
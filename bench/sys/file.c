@@ -0,0 +1,124 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* File system paths on warm caches: open/close, stat, and listing a 10k entry directory
+ * Files are created in a scratch directory under BENCH_TMPDIR (default /tmp) and removed
+ * afterwards.
+ */
+
+#include "../bench.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define DIR_ENTRIES		10000
+
+static char base[256], file_path[300], dir_path[300];
+
+static void open_close(long ops)
+{
+	for (long i = 0; i < ops; i++)
+	{
+		int fd = open(file_path, O_RDONLY);
+		close(fd);
+	}
+}
+
+static void stat_file(long ops)
+{
+	struct stat st;
+	for (long i = 0; i < ops; i++)
+		stat(file_path, &st);
+}
+
+static void stat_missing(long ops)
+{
+	char path[320];
+	snprintf(path, sizeof(path), "%s/missing", base);
+	struct stat st;
+	for (long i = 0; i < ops; i++)
+		stat(path, &st);
+}
+
+/* One operation is a full listing of the directory */
+static void getdents_dir(long ops)
+{
+	static char buf[32768];
+	for (long i = 0; i < ops; i++)
+	{
+		int fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+		int entries = 0;
+		long n;
+		while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0)
+			entries += n;
+		close(fd);
+		bench_use(entries);
+	}
+}
+
+static void for_each_entry(void (*fn)(const char *path))
+{
+	char path[320];
+	for (int i = 0; i < DIR_ENTRIES; i++)
+	{
+		snprintf(path, sizeof(path), "%s/f%05d", dir_path, i);
+		fn(path);
+	}
+}
+
+static void create_entry(const char *path)
+{
+	close(open(path, O_WRONLY | O_CREAT, 0644));
+}
+
+static void remove_entry(const char *path)
+{
+	unlink(path);
+}
+
+int main()
+{
+	const char *tmpdir = getenv("BENCH_TMPDIR");
+	snprintf(base, sizeof(base), "%s/flinux-bench-XXXXXX", tmpdir ? tmpdir : "/tmp");
+	if (!mkdtemp(base))
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(file_path, sizeof(file_path), "%s/file", base);
+	snprintf(dir_path, sizeof(dir_path), "%s/dir", base);
+	create_entry(file_path);
+	mkdir(dir_path, 0755);
+	for_each_entry(create_entry);
+
+	bench_run("open_close", open_close);
+	bench_run("stat", stat_file);
+	bench_run("stat_enoent", stat_missing);
+	bench_run("getdents_10k", getdents_dir);
+
+	for_each_entry(remove_entry);
+	rmdir(dir_path);
+	unlink(file_path);
+	rmdir(base);
+	return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Process creation: fork + _exit + waitpid, and fork + execve of /bin/true */
+
+#include "../bench.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+static void fork_exit(long ops)
+{
+	for (long i = 0; i < ops; i++)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+			_exit(0);
+		waitpid(pid, NULL, 0);
+	}
+}
+
+static void fork_exec(long ops)
+{
+	for (long i = 0; i < ops; i++)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			char *argv[] = { "/bin/true", NULL };
+			char *envp[] = { NULL };
+			execve(argv[0], argv, envp);
+			_exit(127);
+		}
+		waitpid(pid, NULL, 0);
+	}
+}
+
+int main()
+{
+	bench_run("fork_exit", fork_exit);
+	bench_run("fork_exec_true", fork_exec);
+	return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Futex: uncontended wake system calls and a mutex contended by several threads
+ * For the contended case one operation is one lock/unlock pair in any thread.
+ */
+
+#include "../bench.h"
+
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define THREADS		4
+
+static int futex_word;
+
+static void futex_wake(long ops)
+{
+	for (long i = 0; i < ops; i++)
+		syscall(SYS_futex, &futex_word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile long counter;
+
+static void *contend_thread(void *arg)
+{
+	long ops = (long)arg;
+	for (long i = 0; i < ops; i++)
+	{
+		pthread_mutex_lock(&mutex);
+		counter++;
+		pthread_mutex_unlock(&mutex);
+	}
+	return NULL;
+}
+
+static void mutex_contended(long ops)
+{
+	pthread_t threads[THREADS];
+	for (int i = 0; i < THREADS; i++)
+		pthread_create(&threads[i], NULL, contend_thread, (void *)(ops / THREADS + 1));
+	for (int i = 0; i < THREADS; i++)
+		pthread_join(threads[i], NULL);
+}
+
+int main()
+{
+	bench_run("futex_wake", futex_wake);
+	bench_run("mutex_contended_4", mutex_contended);
+	return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Memory management: mmap/munmap churn and demand paging faults */
+
+#include "../bench.h"
+
+#include <sys/mman.h>
+
+#define PAGE_SIZE		4096
+#define REGION_PAGES	256 /* 1MB */
+
+static void mmap_munmap(long ops)
+{
+	for (long i = 0; i < ops; i++)
+	{
+		void *p = mmap(NULL, 16 * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+		{
+			perror("mmap");
+			exit(1);
+		}
+		munmap(p, 16 * PAGE_SIZE);
+	}
+}
+
+/* One operation is the first write to a fresh anonymous page */
+static void page_fault(long ops)
+{
+	for (long done = 0; done < ops; done += REGION_PAGES)
+	{
+		char *p = mmap(NULL, REGION_PAGES * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+		{
+			perror("mmap");
+			exit(1);
+		}
+		for (int i = 0; i < REGION_PAGES; i++)
+			p[i * PAGE_SIZE] = 1;
+		munmap(p, REGION_PAGES * PAGE_SIZE);
+	}
+}
+
+int main()
+{
+	bench_run("mmap_munmap_64k", mmap_munmap);
+	bench_run("page_fault", page_fault);
+	return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Pipe throughput: a child writes 64KB chunks which the parent reads
+ * One operation is one 64KB chunk. The fork is included but negligible at the calibrated
+ * run length.
+ */
+
+#include "../bench.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define CHUNK_SIZE	65536
+
+static char buf[CHUNK_SIZE];
+
+static int read_full(int fd, char *p, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t r = read(fd, p, size);
+		if (r <= 0)
+			return -1;
+		p += r;
+		size -= r;
+	}
+	return 0;
+}
+
+static void pipe_throughput(long ops)
+{
+	int fds[2];
+	if (pipe(fds) < 0)
+	{
+		perror("pipe");
+		exit(1);
+	}
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		close(fds[0]);
+		for (long i = 0; i < ops; i++)
+		{
+			size_t done = 0;
+			while (done < CHUNK_SIZE)
+			{
+				ssize_t r = write(fds[1], buf + done, CHUNK_SIZE - done);
+				if (r <= 0)
+					_exit(1);
+				done += r;
+			}
+		}
+		_exit(0);
+	}
+	close(fds[1]);
+	for (long i = 0; i < ops; i++)
+		if (read_full(fds[0], buf, CHUNK_SIZE) < 0)
+			break;
+	close(fds[0]);
+	waitpid(pid, NULL, 0);
+}
+
+int main()
+{
+	bench_run("pipe_64k", pipe_throughput);
+	return 0;
+}
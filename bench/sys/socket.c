@@ -0,0 +1,103 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Socket round trip latency: a child echoes one byte back for each byte received
+ * One operation is a full round trip over AF_UNIX (socketpair) or AF_INET (TCP loopback).
+ */
+
+#include "../bench.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static void ping_pong(int fd, int peer_fd, long ops)
+{
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		close(fd);
+		char c;
+		while (read(peer_fd, &c, 1) == 1)
+			if (write(peer_fd, &c, 1) != 1)
+				break;
+		_exit(0);
+	}
+	close(peer_fd);
+	char c = 0;
+	for (long i = 0; i < ops; i++)
+	{
+		if (write(fd, &c, 1) != 1 || read(fd, &c, 1) != 1)
+		{
+			perror("ping_pong");
+			break;
+		}
+	}
+	close(fd);
+	waitpid(pid, NULL, 0);
+}
+
+static void unix_ping_pong(long ops)
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+	{
+		perror("socketpair");
+		exit(1);
+	}
+	ping_pong(fds[0], fds[1], ops);
+}
+
+static void inet_ping_pong(long ops)
+{
+	int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr = { 0 };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addrlen = sizeof(addr);
+	if (listen_fd < 0
+		|| bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+		|| listen(listen_fd, 1) < 0
+		|| getsockname(listen_fd, (struct sockaddr *)&addr, &addrlen) < 0)
+	{
+		perror("inet listen");
+		exit(1);
+	}
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		perror("connect");
+		exit(1);
+	}
+	int peer_fd = accept(listen_fd, NULL, NULL);
+	close(listen_fd);
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(peer_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	ping_pong(fd, peer_fd, ops);
+}
+
+int main()
+{
+	bench_run("unix_ping_pong", unix_ping_pong);
+	bench_run("inet_ping_pong", inet_ping_pong);
+	return 0;
+}
@@ -35,6 +35,7 @@ LogServer::~LogServer()
 void LogServer::Start(HWND hMainWnd)
 {
 	m_hMainWnd = hMainWnd;
+	m_hCommandEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
 	m_hWorker = CreateThread(NULL, 0, ThreadProc, this, 0, NULL);
 	m_started = true;
 }
@@ -45,9 +46,31 @@ void LogServer::Stop()
 	{
 		PostQueuedCompletionStatus(m_hCompletionPort, 0, NULL, NULL);
 		WaitForSingleObject(m_hWorker, INFINITE);
+		CloseHandle(m_hCommandEvent);
 	}
 }
 
+void LogServer::SetLevel(uint32_t pid, uint32_t category, uint32_t level)
+{
+	LogCommand command;
+	command.command = LOG_COMMAND_SET_LEVEL;
+	command.category = category;
+	command.level = level;
+	std::lock_guard<std::mutex> lock(m_clientsMutex);
+	/* Levels are per process, every thread connection of the process accepts the command */
+	for (auto const &client : m_clients)
+		if (client->op == OP_READ && client->pid == pid)
+		{
+			OVERLAPPED overlapped;
+			memset(&overlapped, 0, sizeof(overlapped));
+			/* Setting the low order bit of the event keeps the completion out of the IOCP */
+			overlapped.hEvent = (HANDLE)((ULONG_PTR)m_hCommandEvent | 1);
+			DWORD written;
+			if (!WriteFile(client->hPipe, &command, sizeof(command), NULL, &overlapped) && GetLastError() == ERROR_IO_PENDING)
+				GetOverlappedResult(client->hPipe, &overlapped, &written, TRUE);
+		}
+}
+
 void LogServer::AddClient()
 {
 	/* Create named pipe instance */
@@ -66,11 +89,13 @@ void LogServer::AddClient()
 		/* Post a connection notification */
 		PostQueuedCompletionStatus(m_hCompletionPort, 0, (ULONG_PTR)client.get(), &client->overlapped);
 	}
+	std::lock_guard<std::mutex> lock(m_clientsMutex);
 	m_clients.push_back(std::move(client));
 }
 
 void LogServer::RemoveClient(Client *client)
 {
+	std::lock_guard<std::mutex> lock(m_clientsMutex);
 	CloseHandle(client->hPipe);
 	for (auto i = m_clients.begin(); i != m_clients.end(); ++i)
 		if (i->get() == client)
@@ -87,11 +112,12 @@ void LogServer::RemoveClient(Client *client)
  *                  Disconnect if request version mismatches
  * (execution)
  * Log data     ->
+ *             <-   Commands
  * (execution)
  * Disconnect
  */
 
-#define PROTOCOL_VERSION	2
+#define PROTOCOL_VERSION	3
 #define PROTOCOL_MAGIC		'flog'
 struct Request
 {
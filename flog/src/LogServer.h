@@ -36,6 +36,12 @@ struct LogMessage
 #define LOG_INFO		1
 #define LOG_WARNING		2
 #define LOG_ERROR		3
+/* Packet kinds, combined with the log level in the type field */
+#define LOG_PACKET_TEXT		0x000
+#define LOG_PACKET_FORMAT	0x100
+#define LOG_PACKET_RECORD	0x200
+#define LOG_PACKET_KIND(type)	((type) & 0xFF00)
+#define LOG_PACKET_LEVEL(type)	((type) & 0x00FF)
 struct LogPacket
 {
 	uint32_t packetSize;
@@ -44,6 +50,45 @@ struct LogPacket
 	char text[1];
 };
 
+/* Defines a format string used by following records of the client */
+struct LogFormatPacket
+{
+	uint32_t packetSize;
+	uint32_t type;
+	uint32_t pointerSize;
+	uint32_t len;
+	uint64_t id;
+	char text[1];
+};
+
+/* A log record to be formatted by us, the arguments are encoded as described in log.c */
+struct LogRecordPacket
+{
+	uint32_t packetSize;
+	uint32_t type;
+	uint64_t id;
+	uint64_t time;
+	char args[1];
+};
+
+/* Commands sent to clients */
+#define LOG_COMMAND_SET_LEVEL	1
+struct LogCommand
+{
+	uint32_t command;
+	uint32_t category;
+	uint32_t level;
+};
+
+/* Log categories, in the same order as flinux */
+#define LOG_CATEGORY_COUNT	9
+static const wchar_t *const LOG_CATEGORY_NAMES[LOG_CATEGORY_COUNT] = {
+	L"generic", L"dbt", L"mm", L"vfs", L"socket", L"signal", L"futex", L"process", L"timer",
+};
+static const wchar_t *const LOG_LEVEL_NAMES[] = { L"Debug", L"Info", L"Warning", L"Error", L"None" };
+#define LOG_PACKET_CATEGORY(type)	(((type) >> 16) & 0xFF)
+#define LOG_LEVEL_NONE		4
+
 class LogServer
 {
 public:
@@ -51,6 +96,8 @@ public:
 
 	void Start(HWND hMainWnd);
 	void Stop();
+	/* Set minimum log level of a category (LOG_CATEGORY_COUNT for all) of a process */
+	void SetLevel(uint32_t pid, uint32_t category, uint32_t level);
 
 private:
 	enum ClientOp
@@ -76,6 +123,8 @@ private:
 	bool m_started;
 	HWND m_hMainWnd;
 	HANDLE m_hCompletionPort;
+	HANDLE m_hCommandEvent;
+	std::mutex m_clientsMutex;
 	std::vector<std::unique_ptr<Client>> m_clients;
 
 	friend DWORD WINAPI ThreadProc(LPVOID lpParameter);
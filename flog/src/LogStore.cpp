@@ -0,0 +1,189 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pch.h"
+#include "LogStore.h"
+
+LogStore::LogStore()
+	: m_levelMask(UINT32_MAX), m_categoryMask(UINT32_MAX), m_firstMemoryChunk(0), m_spillSize(0), m_useCounter(0)
+{
+	WCHAR path[MAX_PATH], filename[MAX_PATH];
+	m_hSpillFile = INVALID_HANDLE_VALUE;
+	if (GetTempPathW(MAX_PATH, path) && GetTempFileNameW(path, L"flg", 0, filename))
+		m_hSpillFile = CreateFileW(filename, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+			FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+	for (int i = 0; i < CHUNK_CACHE_SIZE; i++)
+	{
+		m_cache[i].chunk = UINT32_MAX;
+		m_cache[i].lastUse = 0;
+	}
+}
+
+LogStore::~LogStore()
+{
+	if (m_hSpillFile != INVALID_HANDLE_VALUE)
+		CloseHandle(m_hSpillFile);
+}
+
+bool LogStore::IsVisible(const LineEntry &entry) const
+{
+	return (m_levelMask & (1U << entry.type)) && (m_categoryMask & (1U << entry.category));
+}
+
+void LogStore::AddLine(int type, int category, const char *text, int len)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (len > (int)CHUNK_SIZE)
+		len = CHUNK_SIZE;
+	if (m_chunks.empty() || m_chunks.back().size + len > CHUNK_SIZE)
+	{
+		Chunk chunk;
+		chunk.data.reset(new char[CHUNK_SIZE]);
+		chunk.size = 0;
+		chunk.fileOffset = 0;
+		chunk.spilled = false;
+		m_chunks.push_back(std::move(chunk));
+		if (m_chunks.size() - m_firstMemoryChunk > MAX_MEMORY_CHUNKS)
+			EvictChunk();
+	}
+	Chunk &chunk = m_chunks.back();
+	memcpy(chunk.data.get() + chunk.size, text, len);
+	LineEntry entry;
+	entry.chunk = (uint32_t)(m_chunks.size() - 1);
+	entry.offset = chunk.size;
+	entry.length = len;
+	entry.type = (uint16_t)type;
+	entry.category = (uint16_t)category;
+	m_index.push_back(entry);
+	if (IsVisible(entry))
+		m_visible.push_back((uint32_t)(m_index.size() - 1));
+	chunk.size += len;
+}
+
+void LogStore::SetFilter(uint32_t levelMask, uint32_t categoryMask)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_levelMask = levelMask;
+	m_categoryMask = categoryMask;
+	m_visible.clear();
+	for (size_t i = 0; i < m_index.size(); i++)
+		if (IsVisible(m_index[i]))
+			m_visible.push_back((uint32_t)i);
+}
+
+int LogStore::GetLineCount()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return (int)m_visible.size();
+}
+
+int LogStore::GetLineType(int line)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_index[m_visible[line]].type;
+}
+
+/* Move the oldest in memory chunk to the spill file, it is discarded if it can not be written */
+void LogStore::EvictChunk()
+{
+	Chunk &chunk = m_chunks[m_firstMemoryChunk++];
+	if (m_hSpillFile != INVALID_HANDLE_VALUE)
+	{
+		LARGE_INTEGER offset;
+		offset.QuadPart = m_spillSize;
+		DWORD written;
+		if (SetFilePointerEx(m_hSpillFile, offset, nullptr, FILE_BEGIN)
+			&& WriteFile(m_hSpillFile, chunk.data.get(), chunk.size, &written, nullptr) && written == chunk.size)
+		{
+			chunk.fileOffset = m_spillSize;
+			chunk.spilled = true;
+			m_spillSize += chunk.size;
+		}
+	}
+	chunk.data.reset();
+}
+
+const char *LogStore::GetChunkData(uint32_t chunk)
+{
+	Chunk &c = m_chunks[chunk];
+	if (c.data)
+		return c.data.get();
+	if (!c.spilled)
+		return nullptr;
+	/* Find the chunk in cache, or replace the least recently used entry */
+	CachedChunk *victim = &m_cache[0];
+	for (int i = 0; i < CHUNK_CACHE_SIZE; i++)
+	{
+		if (m_cache[i].chunk == chunk)
+		{
+			m_cache[i].lastUse = ++m_useCounter;
+			return m_cache[i].data.get();
+		}
+		if (m_cache[i].lastUse < victim->lastUse)
+			victim = &m_cache[i];
+	}
+	if (!victim->data)
+		victim->data.reset(new char[CHUNK_SIZE]);
+	LARGE_INTEGER offset;
+	offset.QuadPart = c.fileOffset;
+	DWORD read;
+	if (!SetFilePointerEx(m_hSpillFile, offset, nullptr, FILE_BEGIN)
+		|| !ReadFile(m_hSpillFile, victim->data.get(), c.size, &read, nullptr) || read != c.size)
+	{
+		victim->chunk = UINT32_MAX;
+		return nullptr;
+	}
+	victim->chunk = chunk;
+	victim->lastUse = ++m_useCounter;
+	return victim->data.get();
+}
+
+/* Caller holds the lock, the returned data is valid until the lock is released */
+const char *LogStore::GetLineData(int line, uint32_t *length)
+{
+	const LineEntry &entry = m_index[m_visible[line]];
+	const char *data = GetChunkData(entry.chunk);
+	*length = entry.length;
+	return data ? data + entry.offset : nullptr;
+}
+
+std::wstring LogStore::GetLine(int line)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	uint32_t length;
+	const char *data = GetLineData(line, &length);
+	if (!data)
+		return L"(Discarded)";
+	if (length == 0)
+		return std::wstring();
+	int len = MultiByteToWideChar(CP_UTF8, 0, data, length, nullptr, 0);
+	std::wstring result(len, L'\0');
+	MultiByteToWideChar(CP_UTF8, 0, data, length, &result[0], len);
+	return result;
+}
+
+std::string LogStore::GetLineUtf8(int line)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	uint32_t length;
+	const char *data = GetLineData(line, &length);
+	if (!data)
+		return "(Discarded)";
+	return std::string(data, length);
+}
@@ -0,0 +1,87 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* Storage of log lines of a log viewer
+ * Lines are stored as UTF-8 in append only chunks, indexed by a line table. Only the most recent
+ * chunks are kept in memory, older chunks are spilled to a temporary file and loaded on demand
+ * when the lines are displayed.
+ * Line numbers used by the accessors refer to the lines passing the current level and category
+ * filter. All methods are thread safe, the search worker of the log viewer reads lines concurrently.
+ */
+class LogStore
+{
+public:
+	LogStore();
+	~LogStore();
+
+	void AddLine(int type, int category, const char *text, int len);
+	int GetLineCount();
+	int GetLineType(int line);
+	std::wstring GetLine(int line);
+	std::string GetLineUtf8(int line);
+	/* Show only lines whose level and category bits are set in the masks */
+	void SetFilter(uint32_t levelMask, uint32_t categoryMask);
+	uint32_t GetLevelMask() const { return m_levelMask; }
+	uint32_t GetCategoryMask() const { return m_categoryMask; }
+
+private:
+	static constexpr uint32_t CHUNK_SIZE = 1048576;
+	static constexpr size_t MAX_MEMORY_CHUNKS = 64;
+	static constexpr int CHUNK_CACHE_SIZE = 4; /* Number of spilled chunks kept loaded */
+
+	struct LineEntry
+	{
+		uint32_t chunk;
+		uint32_t offset;
+		uint32_t length;
+		uint16_t type;
+		uint16_t category;
+	};
+	struct Chunk
+	{
+		std::unique_ptr<char[]> data; /* nullptr if spilled or discarded */
+		uint32_t size;
+		uint64_t fileOffset;
+		bool spilled;
+	};
+	struct CachedChunk
+	{
+		uint32_t chunk;
+		uint64_t lastUse;
+		std::unique_ptr<char[]> data;
+	};
+
+	const char *GetChunkData(uint32_t chunk);
+	void EvictChunk();
+	bool IsVisible(const LineEntry &entry) const;
+	const char *GetLineData(int line, uint32_t *length);
+
+	std::mutex m_mutex;
+	std::vector<LineEntry> m_index;
+	std::vector<uint32_t> m_visible; /* Index of lines passing the filter */
+	uint32_t m_levelMask, m_categoryMask;
+	std::vector<Chunk> m_chunks;
+	size_t m_firstMemoryChunk; /* Chunks before this are not in memory */
+	HANDLE m_hSpillFile;
+	uint64_t m_spillSize;
+	uint64_t m_useCounter;
+	CachedChunk m_cache[CHUNK_CACHE_SIZE];
+};
@@ -21,6 +21,27 @@
 #include "LogViewer.h"
 
 constexpr int FONT_SIZE = 18;
+constexpr int SEARCH_WIDTH = 320;
+
+/* Context menu command ids */
+enum
+{
+	ID_LEVEL_FIRST = 100, /* + level */
+	ID_CATEGORY_FIRST = 200, /* + category */
+	ID_FIND = 300,
+	ID_EXPORT_ALL,
+	ID_EXPORT_SELECTION,
+};
+
+LogViewer::LogViewer()
+	: m_searchEdit(this, 1), m_searchCancel(false)
+{
+}
+
+LogViewer::~LogViewer()
+{
+	CancelSearch();
+}
 
 HWND LogViewer::Create(HWND hWndParent, ATL::_U_RECT rect, LPCTSTR szWindowName)
 {
@@ -36,9 +57,24 @@ HWND LogViewer::Create(HWND hWndParent, ATL::_U_RECT rect, LPCTSTR szWindowName)
 	m_selEnd = std::make_pair(0, 0);
 	m_savedX = 0;
 	SetScrollSize(1, 1, FALSE);
+	m_searchEdit.Create(hWnd, rcDefault, NULL, WS_CHILD | WS_BORDER | ES_AUTOHSCROLL);
+	m_searchEdit.SetFont(m_font);
 	return hWnd;
 }
 
+void LogViewer::OnDestroy()
+{
+	CancelSearch();
+	SetMsgHandled(FALSE);
+}
+
+LRESULT LogViewer::OnSize(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL &bHandled)
+{
+	LayoutSearch();
+	bHandled = FALSE;
+	return 0;
+}
+
 void LogViewer::DoPaint(CDCHandle dc)
 {
 	POINT offset;
@@ -54,24 +90,27 @@ void LogViewer::DoPaint(CDCHandle dc)
 	selEnd = max(m_selStart, m_selEnd);
 	dc.SelectFont(m_font);
 	dc.SetBkMode(TRANSPARENT);
-	for (int i = offset.y / GetPhysicalY(FONT_SIZE); i < (int)m_lines.size(); i++)
+	/* Only lines in the visible range are fetched from the store */
+	for (int i = offset.y / GetPhysicalY(FONT_SIZE); i < m_store.GetLineCount(); i++)
 	{
 		int y = clientRect.top + GetPhysicalY(i * FONT_SIZE) - offset.y;
 		if (y > clientRect.bottom)
 			break;
+		std::wstring line = m_store.GetLine(i);
+		int type = m_store.GetLineType(i);
 		RECT rect = clientRect; /* In physical coordinates */
 		rect.top = y;
 		rect.bottom = y + GetPhysicalY(FONT_SIZE);
-		if (m_types[i] == LOG_DEBUG)
+		if (type == LOG_DEBUG)
 			dc.FillSolidRect(&rect, RGB(0xE0, 0xF0, 0xFF));
-		if (m_types[i] == LOG_WARNING)
+		if (type == LOG_WARNING)
 			dc.FillSolidRect(&rect, RGB(0xFF, 0xDD, 0x44));
-		if (m_types[i] == LOG_ERROR)
+		if (type == LOG_ERROR)
 			dc.FillSolidRect(&rect, RGB(0xFF, 0x88, 0x88));
 		if (i < selStart.first || i > selEnd.first)
 		{
 			/* Draw ordinary line */
-			dc.ExtTextOutW(0, y, 0, NULL, m_lines[i].c_str(), -1, 0);
+			dc.ExtTextOutW(0, y, 0, NULL, line.c_str(), -1, 0);
 		}
 		else
 		{
@@ -85,22 +124,22 @@ void LogViewer::DoPaint(CDCHandle dc)
 			if (i == selEnd.first)
 				end = selEnd.second;
 			else
-				end = m_lines[i].size();
+				end = line.size();
 			int x = 0;
 			SIZE size; /* In physical coordinates */
 			/* Draw text before selection */
-			GetTextExtentPoint32W(dc, m_lines[i].c_str(), start, &size);
-			dc.ExtTextOutW(x, y, 0, NULL, m_lines[i].c_str(), start, 0);
+			GetTextExtentPoint32W(dc, line.c_str(), start, &size);
+			dc.ExtTextOutW(x, y, 0, NULL, line.c_str(), start, 0);
 			x += size.cx;
 			/* Draw selection */
 			dc.SetTextColor(RGB(0xFF, 0xFF, 0xFF));
-			GetTextExtentPoint32W(dc, m_lines[i].c_str() + start, end - start, &size);
+			GetTextExtentPoint32W(dc, line.c_str() + start, end - start, &size);
 			dc.FillSolidRect(x, y, size.cx, GetPhysicalY(FONT_SIZE), RGB(0x00, 0xAA, 0xFF));
-			dc.ExtTextOutW(x, y, 0, NULL, m_lines[i].c_str() + start, end - start, 0);
+			dc.ExtTextOutW(x, y, 0, NULL, line.c_str() + start, end - start, 0);
 			x += size.cx;
 			/* Draw text after selection */
 			dc.SetTextColor(RGB(0, 0, 0));
-			dc.ExtTextOutW(x, y, 0, NULL, m_lines[i].c_str() + end, -1, 0);
+			dc.ExtTextOutW(x, y, 0, NULL, line.c_str() + end, -1, 0);
 		}
 	}
 }
@@ -112,7 +151,7 @@ void LogViewer::OnTimer(UINT_PTR id)
 	bool atBottom = false;
 	if (offset.y >= m_sizeAll.cy - m_sizeClient.cy - 1)
 		atBottom = true;
-	SetScrollSize(1, m_lines.size() * GetPhysicalY(FONT_SIZE), TRUE, FALSE);
+	SetScrollSize(1, m_store.GetLineCount() * GetPhysicalY(FONT_SIZE), TRUE, FALSE);
 	SetScrollLine(0, FONT_SIZE);
 	if (atBottom)
 	{
@@ -173,6 +212,8 @@ void LogViewer::OnMouseMove(UINT nFlags, CPoint point)
 void LogViewer::OnRButtonDown(UINT nFlags, CPoint point)
 {
 	SetFocus();
+	ClientToScreen(&point);
+	ShowContextMenu(point);
 }
 
 void LogViewer::OnMButtonDown(UINT nFlags, CPoint point)
@@ -182,10 +223,20 @@ void LogViewer::OnMButtonDown(UINT nFlags, CPoint point)
 
 void LogViewer::OnKeyDown(UINT nChar, UINT nRepCnt, UINT nFlags)
 {
-	if (m_lines.empty())
+	if (m_store.GetLineCount() == 0)
 		return;
 	bool shift = (GetKeyState(VK_SHIFT) & 0x8000) > 0;
 	bool ctrl = (GetKeyState(VK_CONTROL) & 0x8000) > 0;
+	if (nChar == 'F' && ctrl)
+	{
+		ShowSearch(true);
+		return;
+	}
+	if (nChar == VK_F3)
+	{
+		StartSearch(m_selEnd.first + 1);
+		return;
+	}
 	int pageSize = m_sizeClient.cy / FONT_SIZE;
 	switch (nChar)
 	{
@@ -202,7 +253,7 @@ void LogViewer::OnKeyDown(UINT nChar, UINT nRepCnt, UINT nFlags)
 		break;
 
 	case VK_DOWN:
-		if (m_selEnd.first + 1 < (int)m_lines.size())
+		if (m_selEnd.first + 1 < m_store.GetLineCount())
 		{
 			CPoint point = TranslateCharPosToClientPoint(m_selEnd);
 			m_savedX = max(m_savedX, point.x);
@@ -226,11 +277,11 @@ void LogViewer::OnKeyDown(UINT nChar, UINT nRepCnt, UINT nFlags)
 		break;
 
 	case VK_NEXT: /* Page down */
-		if (m_selEnd.first < (int)m_lines.size())
+		if (m_selEnd.first < m_store.GetLineCount())
 		{
 			CPoint point = TranslateCharPosToClientPoint(m_selEnd);
 			m_savedX = max(m_savedX, point.x);
-			int y = min((int)m_lines.size() - 1, m_selEnd.first + pageSize) * GetPhysicalY(FONT_SIZE);
+			int y = min(m_store.GetLineCount() - 1, m_selEnd.first + pageSize) * GetPhysicalY(FONT_SIZE);
 			m_selEnd = TranslateClientPointToCharPos(CPoint(m_savedX, y));
 		}
 		if (!shift)
@@ -241,7 +292,7 @@ void LogViewer::OnKeyDown(UINT nChar, UINT nRepCnt, UINT nFlags)
 		if (m_selEnd.second == 0 && m_selEnd.first > 0)
 		{
 			m_selEnd.first--;
-			m_selEnd.second = (int)m_lines[m_selEnd.first].size();
+			m_selEnd.second = (int)m_store.GetLine(m_selEnd.first).size();
 		}
 		else if (m_selEnd.second > 0)
 			m_selEnd.second--;
@@ -251,12 +302,12 @@ void LogViewer::OnKeyDown(UINT nChar, UINT nRepCnt, UINT nFlags)
 		break;
 
 	case VK_RIGHT:
-		if (m_selEnd.second == (int)m_lines[m_selEnd.first].size() && m_selEnd.first + 1 < (int)m_lines.size())
+		if (m_selEnd.second == (int)m_store.GetLine(m_selEnd.first).size() && m_selEnd.first + 1 < m_store.GetLineCount())
 		{
 			m_selEnd.first++;
 			m_selEnd.second = 0;
 		}
-		else if (m_selEnd.second < (int)m_lines[m_selEnd.first].size())
+		else if (m_selEnd.second < (int)m_store.GetLine(m_selEnd.first).size())
 			m_selEnd.second++;
 		if (!shift)
 			m_selStart = m_selEnd;
@@ -271,7 +322,7 @@ void LogViewer::OnKeyDown(UINT nChar, UINT nRepCnt, UINT nFlags)
 		break;
 
 	case VK_END:
-		m_selEnd.second = (int)m_lines[m_selEnd.first].size();
+		m_selEnd.second = (int)m_store.GetLine(m_selEnd.first).size();
 		if (!shift)
 			m_selStart = m_selEnd;
 		m_savedX = 0;
@@ -281,7 +332,7 @@ void LogViewer::OnKeyDown(UINT nChar, UINT nRepCnt, UINT nFlags)
 		if (ctrl)
 		{
 			m_selStart = std::make_pair(0, 0);
-			m_selEnd = std::make_pair((int)m_lines.size() - 1, (int)m_lines.back().size());
+			m_selEnd = std::make_pair(m_store.GetLineCount() - 1, (int)m_store.GetLine(m_store.GetLineCount() - 1).size());
 			m_savedX = 0;
 		}
 		break;
@@ -298,10 +349,9 @@ void LogViewer::OnKeyDown(UINT nChar, UINT nRepCnt, UINT nFlags)
 	UpdateCaret();
 }
 
-void LogViewer::AddLine(int type, const std::wstring &line)
+void LogViewer::AddLine(int type, int category, const char *text, int len)
 {
-	m_types.push_back(type);
-	m_lines.push_back(line);
+	m_store.AddLine(type, category, text, len);
 	if (!m_timerShot)
 	{
 		SetTimer(1, 33); /* 30 FPS is enough */
@@ -311,7 +361,7 @@ void LogViewer::AddLine(int type, const std::wstring &line)
 
 std::pair<int, int> LogViewer::TranslateMousePoint(CPoint mousePoint)
 {
-	if (m_lines.empty())
+	if (m_store.GetLineCount() == 0)
 		return std::make_pair(0, 0);
 
 	POINT offset;
@@ -328,29 +378,30 @@ std::pair<int, int> LogViewer::TranslateClientPointToCharPos(CPoint clientPoint)
 	int y = clientPoint.y / GetPhysicalY(FONT_SIZE);
 	if (y < 0)
 		y = 0;
-	if (y >= (int)m_lines.size())
-		y = (int)m_lines.size() - 1;
+	if (y >= m_store.GetLineCount())
+		y = m_store.GetLineCount() - 1;
+	std::wstring line = m_store.GetLine(y);
 	CDCHandle dc = GetDC();
 	dc.SelectFont(m_font);
-	int x = (int)m_lines[y].size();
+	int x = (int)line.size();
 	float totalX = 0;
-	for (int i = 0; i < (int)m_lines[y].size();)
+	for (int i = 0; i < (int)line.size();)
 	{
 		int j = i;
 		ABCFLOAT abc;
 		UINT ch;
 		/* UTF-16 surrogate pair handling */
-		if (IS_HIGH_SURROGATE(m_lines[y][i]))
+		if (IS_HIGH_SURROGATE(line[i]))
 		{
-			UINT high = m_lines[y][i] - 0xD800;
-			UINT low = m_lines[y][i + 1] - 0xDC00;
+			UINT high = line[i] - 0xD800;
+			UINT low = line[i + 1] - 0xDC00;
 			ch = (high << 10) + low + 0x10000;
 			i += 2;
 		}
 		else
-			ch = m_lines[y][i++];
+			ch = line[i++];
 		float cur = 0;
-		if (GetCharABCWidthsFloatW(dc, m_lines[y][i], m_lines[y][i], &abc))
+		if (GetCharABCWidthsFloatW(dc, line[i], line[i], &abc))
 		{
 			cur = abc.abcfA + abc.abcfB + abc.abcfC;
 			totalX += cur;
@@ -371,7 +422,7 @@ CPoint LogViewer::TranslateCharPosToClientPoint(std::pair<int, int> pos)
 	CDCHandle dc = GetDC();
 	dc.SelectFont(m_font);
 	SIZE size;
-	GetTextExtentPoint32W(dc, m_lines[pos.first].c_str(), pos.second, &size);
+	GetTextExtentPoint32W(dc, m_store.GetLine(pos.first).c_str(), pos.second, &size);
 	ReleaseDC(dc);
 	return CPoint(size.cx, pos.first * GetPhysicalY(FONT_SIZE));
 }
@@ -380,12 +431,12 @@ void LogViewer::UpdateCaret(bool scrollToCaret)
 {
 	int y = m_selEnd.first * GetPhysicalY(FONT_SIZE);
 	int x = 0;
-	if (!m_lines.empty())
+	if (m_store.GetLineCount() > 0)
 	{
 		SIZE size;
 		CDCHandle dc = GetDC();
 		dc.SelectFont(m_font);
-		GetTextExtentPoint32W(dc, m_lines[m_selEnd.first].c_str(), m_selEnd.second, &size);
+		GetTextExtentPoint32W(dc, m_store.GetLine(m_selEnd.first).c_str(), m_selEnd.second, &size);
 		x = size.cx;
 		ReleaseDC(dc);
 	}
@@ -414,16 +465,16 @@ void LogViewer::CopySelectionToClipboard()
 	start = min(m_selStart, m_selEnd);
 	end = max(m_selStart, m_selEnd);
 	/* First line */
-	data += m_lines[start.first].substr(start.second);
+	data += m_store.GetLine(start.first).substr(start.second);
 	/* Middle lines */
 	for (int i = start.first + 1; i < end.first; i++)
 	{
 		data += L"\r\n";
-		data += m_lines[i];
+		data += m_store.GetLine(i);
 	}
 	/* Last line */
 	data += L"\r\n";
-	data += m_lines[end.first].substr(0, end.second);
+	data += m_store.GetLine(end.first).substr(0, end.second);
 	/* Copy data to clipboard */
 	if (!OpenClipboard())
 		return;
@@ -445,3 +496,217 @@ void LogViewer::CopySelectionToClipboard()
 	SetClipboardData(CF_UNICODETEXT, memory);
 	CloseClipboard();
 }
+
+void LogViewer::ShowContextMenu(CPoint screenPoint)
+{
+	uint32_t levelMask = m_store.GetLevelMask();
+	uint32_t categoryMask = m_store.GetCategoryMask();
+	CMenu menu;
+	menu.CreatePopupMenu();
+	CMenuHandle levelMenu;
+	levelMenu.CreatePopupMenu();
+	for (int i = LOG_DEBUG; i <= LOG_ERROR; i++)
+		levelMenu.AppendMenuW(MF_STRING | ((levelMask & (1U << i)) ? MF_CHECKED : 0), ID_LEVEL_FIRST + i, LOG_LEVEL_NAMES[i]);
+	menu.AppendMenuW(MF_POPUP, levelMenu, L"Show levels");
+	CMenuHandle categoryMenu;
+	categoryMenu.CreatePopupMenu();
+	for (int i = 0; i < LOG_CATEGORY_COUNT; i++)
+		categoryMenu.AppendMenuW(MF_STRING | ((categoryMask & (1U << i)) ? MF_CHECKED : 0), ID_CATEGORY_FIRST + i, LOG_CATEGORY_NAMES[i]);
+	menu.AppendMenuW(MF_POPUP, categoryMenu, L"Show categories");
+	menu.AppendMenuW(MF_SEPARATOR);
+	menu.AppendMenuW(MF_STRING, ID_FIND, L"Find...\tCtrl+F");
+	menu.AppendMenuW(MF_STRING, ID_EXPORT_ALL, L"Export shown lines...");
+	menu.AppendMenuW(MF_STRING | (m_selStart == m_selEnd ? MF_GRAYED : 0), ID_EXPORT_SELECTION, L"Export selected lines...");
+	int id = menu.TrackPopupMenu(TPM_RETURNCMD | TPM_RIGHTBUTTON, screenPoint.x, screenPoint.y, *this);
+	if (id >= ID_LEVEL_FIRST && id <= ID_LEVEL_FIRST + LOG_ERROR)
+		SetFilter(levelMask ^ (1U << (id - ID_LEVEL_FIRST)), categoryMask);
+	else if (id >= ID_CATEGORY_FIRST && id < ID_CATEGORY_FIRST + LOG_CATEGORY_COUNT)
+		SetFilter(levelMask, categoryMask ^ (1U << (id - ID_CATEGORY_FIRST)));
+	else if (id == ID_FIND)
+		ShowSearch(true);
+	else if (id == ID_EXPORT_ALL)
+		ExportLines(false);
+	else if (id == ID_EXPORT_SELECTION)
+		ExportLines(true);
+}
+
+void LogViewer::SetFilter(uint32_t levelMask, uint32_t categoryMask)
+{
+	/* Line numbers change with the filter, a running search would report a wrong line */
+	CancelSearch();
+	m_store.SetFilter(levelMask, categoryMask);
+	m_selStart = m_selEnd = std::make_pair(0, 0);
+	m_savedX = 0;
+	SetScrollSize(1, max(1, m_store.GetLineCount() * GetPhysicalY(FONT_SIZE)), TRUE, FALSE);
+	Invalidate();
+	UpdateCaret();
+}
+
+void LogViewer::ExportLines(bool selectionOnly)
+{
+	int first = 0, last = m_store.GetLineCount() - 1;
+	if (selectionOnly)
+	{
+		first = min(m_selStart, m_selEnd).first;
+		last = max(m_selStart, m_selEnd).first;
+	}
+	if (last < first)
+		return;
+	WCHAR filename[MAX_PATH] = L"flog.txt";
+	OPENFILENAMEW ofn;
+	memset(&ofn, 0, sizeof(ofn));
+	ofn.lStructSize = sizeof(ofn);
+	ofn.hwndOwner = m_hWnd;
+	ofn.lpstrFilter = L"Text files (*.txt)\0*.txt\0All files (*.*)\0*.*\0";
+	ofn.lpstrFile = filename;
+	ofn.nMaxFile = MAX_PATH;
+	ofn.lpstrDefExt = L"txt";
+	ofn.Flags = OFN_OVERWRITEPROMPT | OFN_PATHMUSTEXIST;
+	if (!GetSaveFileNameW(&ofn))
+		return;
+	HANDLE hFile = CreateFileW(filename, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		MessageBoxW(L"Cannot create the export file.", L"flog", MB_ICONERROR);
+		return;
+	}
+	/* Write in large pieces, lines are UTF-8 in the store */
+	std::string data;
+	for (int i = first; i <= last; i++)
+	{
+		data += m_store.GetLineUtf8(i);
+		data += "\r\n";
+		if (data.size() >= 1048576 || i == last)
+		{
+			DWORD written;
+			if (!WriteFile(hFile, data.c_str(), (DWORD)data.size(), &written, nullptr))
+			{
+				MessageBoxW(L"Writing the export file failed.", L"flog", MB_ICONERROR);
+				break;
+			}
+			data.clear();
+		}
+	}
+	CloseHandle(hFile);
+}
+
+void LogViewer::LayoutSearch()
+{
+	if (!m_searchEdit.IsWindow())
+		return;
+	RECT clientRect;
+	GetClientRect(&clientRect);
+	int width = min(GetPhysicalX(SEARCH_WIDTH), (int)clientRect.right);
+	m_searchEdit.MoveWindow(clientRect.right - width, 0, width, GetPhysicalY(FONT_SIZE + 6));
+}
+
+void LogViewer::ShowSearch(bool show)
+{
+	if (show)
+	{
+		LayoutSearch();
+		m_searchEdit.ShowWindow(SW_SHOW);
+		m_searchEdit.SetFocus();
+		m_searchEdit.SetSelAll();
+	}
+	else
+	{
+		CancelSearch();
+		m_searchEdit.ShowWindow(SW_HIDE);
+		SetFocus();
+	}
+}
+
+void LogViewer::CancelSearch()
+{
+	if (m_searchThread.joinable())
+	{
+		m_searchCancel = true;
+		m_searchThread.join();
+	}
+	m_searchCancel = false;
+}
+
+void LogViewer::StartSearch(int fromLine)
+{
+	CancelSearch();
+	int len = m_searchEdit.GetWindowTextLengthW();
+	if (len == 0)
+		return;
+	std::wstring pattern(len + 1, L'\0');
+	m_searchEdit.GetWindowTextW(&pattern[0], len + 1);
+	pattern.resize(len);
+	std::wregex regex;
+	try
+	{
+		regex.assign(pattern, std::regex_constants::icase);
+	}
+	catch (const std::regex_error &)
+	{
+		/* Incomplete pattern while typing */
+		return;
+	}
+	int count = m_store.GetLineCount();
+	HWND hWnd = m_hWnd;
+	m_searchThread = std::thread([this, regex, fromLine, count, hWnd]()
+	{
+		for (int i = max(fromLine, 0); i < count; i++)
+		{
+			if (m_searchCancel)
+				return;
+			if (std::regex_search(m_store.GetLine(i), regex))
+			{
+				::PostMessageW(hWnd, WM_SEARCHRESULT, (WPARAM)i, 0);
+				return;
+			}
+		}
+		::PostMessageW(hWnd, WM_SEARCHRESULT, (WPARAM)-1, 0);
+	});
+}
+
+LRESULT LogViewer::OnSearchResult(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL &bHandled)
+{
+	int line = (int)wParam;
+	if (line < 0 || line >= m_store.GetLineCount())
+	{
+		MessageBeep(MB_OK);
+		return 0;
+	}
+	m_selStart = std::make_pair(line, 0);
+	m_selEnd = std::make_pair(line, (int)m_store.GetLine(line).size());
+	m_savedX = 0;
+	Invalidate();
+	UpdateCaret();
+	return 0;
+}
+
+LRESULT LogViewer::OnSearchChange(WORD wNotifyCode, WORD wID, HWND hWndCtl, BOOL &bHandled)
+{
+	if (hWndCtl != m_searchEdit)
+	{
+		bHandled = FALSE;
+		return 0;
+	}
+	/* Incremental search: look for the new pattern from the current match */
+	StartSearch(min(m_selStart, m_selEnd).first);
+	return 0;
+}
+
+LRESULT LogViewer::OnSearchKeyDown(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL &bHandled)
+{
+	if (wParam == VK_RETURN || wParam == VK_F3)
+		StartSearch(m_selEnd.first + 1);
+	else if (wParam == VK_ESCAPE)
+		ShowSearch(false);
+	else
+		bHandled = FALSE;
+	return 0;
+}
+
+LRESULT LogViewer::OnSearchChar(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL &bHandled)
+{
+	/* Avoid the beep of single line edit controls */
+	if (wParam != VK_RETURN && wParam != VK_ESCAPE)
+		bHandled = FALSE;
+	return 0;
+}
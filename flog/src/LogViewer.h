@@ -21,6 +21,9 @@
 
 #include "DPIAware.h"
 #include "LogServer.h"
+#include "LogStore.h"
+
+#define WM_SEARCHRESULT	WM_USER + 3
 
 class LogViewer: public CWindowImpl<LogViewer>, public CScrollImpl<LogViewer>, public CDoubleBufferImpl<LogViewer>, public DPIAware
 {
@@ -38,7 +41,14 @@ public:
 		return wc;
 	}
 
+	LogViewer();
+	~LogViewer();
+
 	BEGIN_MSG_MAP(LogViewer)
+		MSG_WM_DESTROY(OnDestroy)
+		MESSAGE_HANDLER(WM_SIZE, OnSize)
+		MESSAGE_HANDLER(WM_SEARCHRESULT, OnSearchResult)
+		COMMAND_CODE_HANDLER(EN_CHANGE, OnSearchChange)
 		MSG_WM_TIMER(OnTimer)
 		MSG_WM_SETFOCUS(OnSetFocus)
 		MSG_WM_KILLFOCUS(OnKillFocus)
@@ -50,10 +60,19 @@ public:
 		MSG_WM_KEYDOWN(OnKeyDown)
 		CHAIN_MSG_MAP(CDoubleBufferImpl<LogViewer>)
 		CHAIN_MSG_MAP(CScrollImpl<LogViewer>)
+	ALT_MSG_MAP(1) /* Search box */
+		MESSAGE_HANDLER(WM_KEYDOWN, OnSearchKeyDown)
+		MESSAGE_HANDLER(WM_CHAR, OnSearchChar)
 	END_MSG_MAP()
 
 	HWND Create(HWND hWndParent, ATL::_U_RECT rect = NULL, LPCTSTR szWindowName = NULL);
 	void DoPaint(CDCHandle dc);
+	void OnDestroy();
+	LRESULT OnSize(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL &bHandled);
+	LRESULT OnSearchResult(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL &bHandled);
+	LRESULT OnSearchChange(WORD wNotifyCode, WORD wID, HWND hWndCtl, BOOL &bHandled);
+	LRESULT OnSearchKeyDown(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL &bHandled);
+	LRESULT OnSearchChar(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL &bHandled);
 	void OnTimer(UINT_PTR id);
 	void OnSetFocus(CWindow wndOld);
 	void OnKillFocus(CWindow wndFocus);
@@ -63,7 +82,7 @@ public:
 	void OnRButtonDown(UINT nFlags, CPoint point);
 	void OnMButtonDown(UINT nFlags, CPoint point);
 	void OnKeyDown(UINT nChar, UINT nRepCnt, UINT nFlags);
-	void AddLine(int type, const std::wstring &msg);
+	void AddLine(int type, int category, const char *text, int len);
 
 private:
 	std::pair<int, int> TranslateMousePoint(CPoint mousePoint);
@@ -71,11 +90,21 @@ private:
 	CPoint TranslateCharPosToClientPoint(std::pair<int, int> pos);
 	void UpdateCaret(bool scrollToCaret = true);
 	void CopySelectionToClipboard();
+	void ShowContextMenu(CPoint screenPoint);
+	void SetFilter(uint32_t levelMask, uint32_t categoryMask);
+	void ExportLines(bool selectionOnly);
+	void ShowSearch(bool show);
+	void LayoutSearch();
+	void StartSearch(int fromLine);
+	void CancelSearch();
 
 	CFont m_font;
 	bool m_timerShot, m_mouseDown;
 	std::pair<int, int> m_selStart, m_selEnd;
 	int m_savedX;
-	std::vector<int> m_types;
-	std::vector<std::wstring> m_lines;
+	LogStore m_store;
+	/* Regex search runs in a worker thread, results are posted as WM_SEARCHRESULT */
+	CContainedWindowT<CEdit> m_searchEdit;
+	std::thread m_searchThread;
+	std::atomic<bool> m_searchCancel;
 };
@@ -152,16 +152,204 @@ LRESULT MainWindow::OnTreeItemChange(LPNMHDR pnmh)
 	return 0;
 }
 
+static void AppendNumber(std::string &out, uint64_t value, bool negative, int base, bool upper, int width, char fillchar)
+{
+	const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	char nbuf[128];
+	int len = 0;
+	if (value == 0)
+		nbuf[len++] = '0';
+	while (value > 0)
+	{
+		nbuf[len++] = digits[value % base];
+		value /= base;
+	}
+	if (negative)
+		nbuf[len++] = '-';
+	for (int w = width - len; w > 0; w--)
+		out += fillchar;
+	while (len--)
+		out += nbuf[len];
+}
+
+/* Format a log record the same way as kvsprintf() in flinux would */
+static std::string FormatRecord(const std::string &format, int pointerSize, const char *args, const char *end)
+{
+	std::string out;
+	auto nextInt = [&]() -> uint64_t
+	{
+		uint64_t value = 0;
+		if (args + sizeof(uint64_t) <= end)
+		{
+			memcpy(&value, args, sizeof(uint64_t));
+			args += sizeof(uint64_t);
+		}
+		else
+			args = end;
+		return value;
+	};
+	auto appendSigned = [&](int64_t value, int width, char fillchar)
+	{
+		if (value < 0)
+			AppendNumber(out, (uint64_t)-value, true, 10, false, width, fillchar);
+		else
+			AppendNumber(out, (uint64_t)value, false, 10, false, width, fillchar);
+	};
+	const char *f = format.c_str();
+	while (*f)
+	{
+		if (*f == '%')
+		{
+			const char *p = f + 1;
+			char fillchar = ' ';
+			if (*p == '0')
+			{
+				fillchar = '0';
+				p++;
+			}
+			int width = 0;
+			while (*p >= '0' && *p <= '9')
+				width = width * 10 + (*p++ - '0');
+			bool handled = true;
+			switch (*p++)
+			{
+			case '%': out += '%'; break;
+			case 'c': out += (char)nextInt(); break;
+			case 's':
+			case 'S':
+			{
+				uint32_t len = 0;
+				if (args + sizeof(uint32_t) <= end)
+				{
+					memcpy(&len, args, sizeof(uint32_t));
+					args += sizeof(uint32_t);
+				}
+				if (len > (uint32_t)(end - args))
+					len = (uint32_t)(end - args);
+				out.append(args, len);
+				args += len;
+				break;
+			}
+			case 'd': appendSigned((int64_t)nextInt(), width, fillchar); break;
+			case 'u': AppendNumber(out, nextInt(), false, 10, false, width, fillchar); break;
+			case 'o': AppendNumber(out, nextInt(), false, 8, false, width, fillchar); break;
+			case 'x': AppendNumber(out, nextInt(), false, 16, false, width, fillchar); break;
+			case 'X': AppendNumber(out, nextInt(), false, 16, true, width, fillchar); break;
+			case 'l':
+				if (p[0] == 'd' || (p[0] == 'l' && p[1] == 'd'))
+				{
+					p += (p[0] == 'l') ? 2 : 1;
+					appendSigned((int64_t)nextInt(), width, fillchar);
+				}
+				else if (p[0] == 'u' || (p[0] == 'l' && p[1] == 'u'))
+				{
+					p += (p[0] == 'l') ? 2 : 1;
+					AppendNumber(out, nextInt(), false, 10, false, width, fillchar);
+				}
+				else if (p[0] == 'l' && p[1] == 'x')
+				{
+					p += 2;
+					AppendNumber(out, nextInt(), false, 16, false, width, fillchar);
+				}
+				else /* Printed as %p */
+					AppendNumber(out, nextInt(), false, 16, false, pointerSize * 2, '0');
+				break;
+			case 'p': AppendNumber(out, nextInt(), false, 16, false, pointerSize * 2, '0'); break;
+			default: handled = false; break;
+			}
+			if (handled)
+			{
+				f = p;
+				continue;
+			}
+		}
+		else if (*f == '\n')
+			out += '\r';
+		out += *f++;
+	}
+	return out;
+}
+
+LRESULT MainWindow::OnTreeRightClick(LPNMHDR pnmh)
+{
+	if (pnmh->hwndFrom != m_processTree)
+		return 0;
+	CPoint pt;
+	GetCursorPos(&pt);
+	CPoint clientPt = pt;
+	m_processTree.ScreenToClient(&clientPt);
+	UINT flags;
+	HTREEITEM hItem = m_processTree.HitTest(clientPt, &flags);
+	if (!hItem || !(flags & TVHT_ONITEM))
+		return 0;
+	Client *client = (Client *)m_processTree.GetItemData(hItem);
+
+	/* Menu command ids: 1 + category * 8 + level, category LOG_CATEGORY_COUNT is all categories */
+	CMenu menu;
+	menu.CreatePopupMenu();
+	for (int k = 0; k <= LOG_CATEGORY_COUNT; k++)
+	{
+		/* All categories first */
+		int i = (k == 0) ? LOG_CATEGORY_COUNT : k - 1;
+		CMenuHandle levelMenu;
+		levelMenu.CreatePopupMenu();
+		for (int j = 0; j <= LOG_LEVEL_NONE; j++)
+			levelMenu.AppendMenuW(MF_STRING, 1 + i * 8 + j, LOG_LEVEL_NAMES[j]);
+		menu.AppendMenuW(MF_POPUP, levelMenu, i == LOG_CATEGORY_COUNT ? L"All categories" : LOG_CATEGORY_NAMES[i]);
+		if (k == 0)
+			menu.AppendMenuW(MF_SEPARATOR);
+	}
+	int id = menu.TrackPopupMenu(TPM_RETURNCMD | TPM_RIGHTBUTTON, pt.x, pt.y, *this);
+	if (id > 0)
+		m_logServer.SetLevel(client->pid, (id - 1) / 8, (id - 1) % 8);
+	return 0;
+}
+
+void MainWindow::AddClientLine(Client *client, uint32_t type, const char *text, int len)
+{
+	/* Lines are stored as UTF-8, they are converted when displayed */
+	client->logViewer.AddLine(LOG_PACKET_LEVEL(type), LOG_PACKET_CATEGORY(type), text, len);
+	if (m_splitter.GetSplitterPane(SPLIT_PANE_RIGHT) != client->logViewer)
+		m_processTree.SetItemState(client->item, TVIS_BOLD, TVIS_BOLD);
+}
+
 void MainWindow::ProcessClientLog(Client *client, LogPacket *packet)
 {
-	WCHAR *wbuffer = (WCHAR*)alloca(sizeof(WCHAR) * (packet->packetSize + 1));
-	int len = MultiByteToWideChar(CP_UTF8, 0, packet->text, packet->len, wbuffer, packet->packetSize);
-	if (len)
+	int level = LOG_PACKET_LEVEL(packet->type);
+	switch (LOG_PACKET_KIND(packet->type))
+	{
+	case LOG_PACKET_TEXT:
+		AddClientLine(client, packet->type, packet->text, packet->len);
+		break;
+
+	case LOG_PACKET_FORMAT:
 	{
-		wbuffer[len] = 0;
-		client->logViewer.AddLine(packet->type, wbuffer);
-		if (m_splitter.GetSplitterPane(SPLIT_PANE_RIGHT) != client->logViewer)
-			m_processTree.SetItemState(client->item, TVIS_BOLD, TVIS_BOLD);
+		LogFormatPacket *format = (LogFormatPacket *)packet;
+		LogFormat &entry = client->formats[format->id];
+		entry.text.assign(format->text, format->len);
+		entry.pointerSize = format->pointerSize;
+		break;
+	}
+
+	case LOG_PACKET_RECORD:
+	{
+		LogRecordPacket *record = (LogRecordPacket *)packet;
+		auto it = client->formats.find(record->id);
+		if (it == client->formats.end())
+			break;
+		/* FILETIME is in 100-nanosecond units */
+		uint64_t seconds = record->time / 10000000ULL;
+		static const char typech[] = { 'D', 'I', 'W', 'E' };
+		char ch = level < 4 ? typech[level] : '?';
+		char header[64];
+		sprintf_s(header, "[%02u:%02u:%02u.%07u] (%c%c) ",
+			(int)((seconds / 3600) % 24), (int)((seconds / 60) % 60), (int)(seconds % 60),
+			(int)(record->time % 10000000ULL), ch, ch);
+		const char *args = (const char *)record + offsetof(LogRecordPacket, args);
+		std::string line = header + FormatRecord(it->second.text, it->second.pointerSize, args, (const char *)record + record->packetSize);
+		AddClientLine(client, record->type, line.c_str(), (int)line.size());
+		break;
+	}
 	}
 }
 
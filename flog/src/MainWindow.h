@@ -33,6 +33,7 @@ public:
 		MESSAGE_HANDLER(WM_NEWCLIENT, OnNewClient)
 		MESSAGE_HANDLER(WM_LOGRECEIVE, OnLogReceive)
 		NOTIFY_CODE_HANDLER_EX(TVN_ITEMCHANGED, OnTreeItemChange)
+		NOTIFY_CODE_HANDLER_EX(NM_RCLICK, OnTreeRightClick)
 		CHAIN_MSG_MAP(CFrameWindowImpl<MainWindow>)
 	END_MSG_MAP()
 
@@ -42,8 +43,14 @@ public:
 	LRESULT OnNewClient(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL &bHandled);
 	LRESULT OnLogReceive(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL &bHandled);
 	LRESULT OnTreeItemChange(LPNMHDR pnmh);
+	LRESULT OnTreeRightClick(LPNMHDR pnmh);
 	
 private:
+	struct LogFormat
+	{
+		std::string text;
+		int pointerSize;
+	};
 	struct Client
 	{
 		uint32_t pid;
@@ -51,8 +58,10 @@ private:
 		HTREEITEM item;
 		LogViewer logViewer;
 		std::string msgpart;
+		std::unordered_map<uint64_t, LogFormat> formats;
 	};
 	void ProcessClientLog(Client *client, LogPacket *packet);
+	void AddClientLine(Client *client, uint32_t type, const char *text, int len);
 	void InitLogViewer(LogViewer &logViewer);
 	void SetCurrentLogViewer(LogViewer &logViewer);
 
@@ -32,7 +32,10 @@
 
 #include <atomic>
 #include <mutex>
+#include <regex>
+#include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <concurrent_queue.h>
@@ -0,0 +1,141 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cache.h>
+#include <fs/virtual.h>
+#include <fs/winfs.h>
+#include <syscall/vfs.h>
+#include <heap.h>
+#include <log.h>
+#include <shared.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <stdint.h>
+
+#define CACHE_CHECK_INTERVAL			1000
+#define CACHE_DEFAULT_BUDGET_KBYTES		8192
+#define CACHE_DEFAULT_MIN_FREE_KBYTES	4096
+
+struct cache_shrinker
+{
+	const char *name;
+	/* Bytes currently held by the cache */
+	size_t (*size)();
+	/* Release memory until the cache holds at most target bytes, as far as it can */
+	void (*shrink)(size_t target);
+};
+
+/* The interpreter cache of execve() has no shrinker: it holds at most four open files, whose
+ * pages belong to section views shared with the running processes and are not freed by closing. */
+static const struct cache_shrinker cache_shrinkers[] =
+{
+	{ "heap", heap_cache_size, heap_cache_shrink },
+	{ "virtualfs", virtualfs_cache_size, virtualfs_cache_shrink },
+	{ "dcache", vfs_dcache_size, vfs_dcache_shrink },
+	{ "dirplus", winfs_dirplus_cache_size, winfs_dirplus_cache_shrink },
+};
+#define CACHE_SHRINKER_COUNT	((int)(sizeof(cache_shrinkers) / sizeof(cache_shrinkers[0])))
+
+struct cache_shared_data
+{
+	/* 0 for the defaults */
+	volatile unsigned int budget_kbytes;
+	volatile unsigned int min_free_kbytes;
+};
+
+static struct cache_shared_data *cache_shared;
+static HANDLE cache_low_memory; /* Memory resource notification */
+static HANDLE cache_timer;
+static bool cache_low; /* Whether the last check found memory low, only used by the timer */
+
+static bool cache_is_memory_low()
+{
+	BOOL low;
+	if (cache_low_memory && QueryMemoryResourceNotification(cache_low_memory, &low) && low)
+		return true;
+	MEMORYSTATUSEX status;
+	status.dwLength = sizeof(status);
+	return GlobalMemoryStatusEx(&status) && status.ullAvailPhys < (DWORDLONG)cache_get_min_free_kbytes() * 1024;
+}
+
+static VOID CALLBACK cache_check(PVOID parameter, BOOLEAN timer_or_wait_fired)
+{
+	size_t sizes[CACHE_SHRINKER_COUNT], total = 0;
+	for (int i = 0; i < CACHE_SHRINKER_COUNT; i++)
+		total += (sizes[i] = cache_shrinkers[i].size());
+	bool low = cache_is_memory_low();
+	if (low != cache_low)
+	{
+		if (low)
+			log_warning("Low memory, dropping caches of %u kB.", (unsigned int)(total / 1024));
+		cache_low = low;
+	}
+	size_t budget = low ? 0 : (size_t)cache_get_budget_kbytes() * 1024;
+	if (total <= budget)
+		return;
+	if (!low)
+		log_info("Caches hold %u kB, more than the budget of %u kB.", (unsigned int)(total / 1024), (unsigned int)(budget / 1024));
+	for (int i = 0; i < CACHE_SHRINKER_COUNT; i++)
+		if (sizes[i])
+			cache_shrinkers[i].shrink((size_t)((uint64_t)sizes[i] * budget / total));
+}
+
+static void cache_start()
+{
+	if (!(cache_low_memory = CreateMemoryResourceNotification(LowMemoryResourceNotification)))
+		log_warning("CreateMemoryResourceNotification() failed, error code: %d", GetLastError());
+	if (!CreateTimerQueueTimer(&cache_timer, NULL, cache_check, NULL, CACHE_CHECK_INTERVAL, CACHE_CHECK_INTERVAL, WT_EXECUTEDEFAULT))
+		log_error("CreateTimerQueueTimer() failed, error code: %d", GetLastError());
+}
+
+void cache_init()
+{
+	cache_shared = (struct cache_shared_data *)shared_alloc(sizeof(struct cache_shared_data));
+	cache_start();
+}
+
+void cache_afterfork_child()
+{
+	/* The timer and the notification handle are not inherited */
+	cache_shared = (struct cache_shared_data *)shared_alloc(sizeof(struct cache_shared_data));
+	cache_start();
+}
+
+unsigned int cache_get_budget_kbytes()
+{
+	unsigned int kbytes = cache_shared->budget_kbytes;
+	return kbytes ? kbytes : CACHE_DEFAULT_BUDGET_KBYTES;
+}
+
+void cache_set_budget_kbytes(unsigned int kbytes)
+{
+	cache_shared->budget_kbytes = kbytes;
+}
+
+unsigned int cache_get_min_free_kbytes()
+{
+	unsigned int kbytes = cache_shared->min_free_kbytes;
+	return kbytes ? kbytes : CACHE_DEFAULT_MIN_FREE_KBYTES;
+}
+
+void cache_set_min_free_kbytes(unsigned int kbytes)
+{
+	cache_shared->min_free_kbytes = kbytes;
+}
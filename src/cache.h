@@ -0,0 +1,41 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/* Memory pressure handling of caches
+ * Caches which keep memory around only to save work later have a shrinker listed in cache.c.
+ * Every CACHE_CHECK_INTERVAL milliseconds a thread pool timer checks the memory state:
+ * 1. If Windows reports low physical memory, or less than /proc/sys/vm/min_free_kbytes is
+ *    available, all caches are emptied.
+ * 2. Otherwise, if the caches of the process hold more than /proc/sys/vm/flinux_cache_budget_kbytes
+ *    together, each of them is shrunk by the same proportion to fit in the budget.
+ * Both limits are session wide. Shrinkers run on the timer thread and take the locks of their cache.
+ */
+
+void cache_init();
+void cache_afterfork_child();
+
+/* Session wide limits, 0 written to a limit restores its default */
+unsigned int cache_get_budget_kbytes();
+void cache_set_budget_kbytes(unsigned int kbytes);
+unsigned int cache_get_min_free_kbytes();
+void cache_set_min_free_kbytes(unsigned int kbytes);
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <common/types.h>
+
+typedef uintptr_t aio_context_t;
+
+/* Values of iocb.aio_lio_opcode */
+#define IOCB_CMD_PREAD		0
+#define IOCB_CMD_PWRITE		1
+#define IOCB_CMD_FSYNC		2
+#define IOCB_CMD_FDSYNC		3
+#define IOCB_CMD_POLL		5
+#define IOCB_CMD_NOOP		6
+#define IOCB_CMD_PREADV		7
+#define IOCB_CMD_PWRITEV	8
+
+/* Flags for iocb.aio_flags */
+#define IOCB_FLAG_RESFD		(1 << 0)
+
+struct io_event
+{
+	uint64_t data; /* the data field from the iocb */
+	uint64_t obj; /* what iocb this event came from */
+	int64_t res; /* result code for this event */
+	int64_t res2; /* secondary result */
+};
+
+/* The layout is the same on x86 and x64, all pointers are stored in 64 bit fields */
+struct iocb
+{
+	uint64_t aio_data; /* data to be returned in event's data */
+	uint32_t aio_key; /* the kernel sets aio_key to the req # */
+	int32_t aio_rw_flags; /* RWF_* flags */
+	uint16_t aio_lio_opcode; /* see IOCB_CMD_ above */
+	int16_t aio_reqprio;
+	uint32_t aio_fildes;
+	uint64_t aio_buf;
+	uint64_t aio_nbytes;
+	int64_t aio_offset;
+	uint64_t aio_reserved2;
+	uint32_t aio_flags; /* flags for the "struct iocb" */
+	uint32_t aio_resfd; /* if the IOCB_FLAG_RESFD flag of "aio_flags" is set, this is an eventfd to signal AIO readiness to */
+};
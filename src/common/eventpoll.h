@@ -15,8 +15,11 @@
 #define EPOLLONESHOT	(1 << 30)
 #define EPOLLET			(1 << 31)
 
+/* Packed to 12 bytes on both x86 and x64 like Linux */
+#pragma pack(push, 4)
 struct epoll_event
 {
 	uint32_t events; /* Epoll events */
-	uint32_t data; /* User data variable */
+	uint64_t data; /* User data variable */
 };
+#pragma pack(pop)
@@ -0,0 +1,8 @@
+#pragma once
+
+#define FALLOC_FL_KEEP_SIZE			0x01 /* Default is extend size */
+#define FALLOC_FL_PUNCH_HOLE		0x02 /* De-allocates range */
+#define FALLOC_FL_NO_HIDE_STALE		0x04 /* Reserved codepoint */
+#define FALLOC_FL_COLLAPSE_RANGE	0x08 /* Remove a range of a file without leaving a hole */
+#define FALLOC_FL_ZERO_RANGE		0x10 /* Convert a range of a file to zeros */
+#define FALLOC_FL_INSERT_RANGE		0x20 /* Insert space within the file size without overwriting existing data */
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <common/types.h>
+
 #define O_ACCMODE		00000003
 #define O_RDONLY		00000000
 #define O_WRONLY		00000001
@@ -58,5 +60,48 @@
 #define F_GETOWN_EX		16
 #define F_GETOWNER_UIDS	17
 
+#define F_OFD_GETLK		36
+#define F_OFD_SETLK		37
+#define F_OFD_SETLKW	38
+
+#define F_LINUX_SPECIFIC_BASE	1024
+#define F_SETPIPE_SZ	(F_LINUX_SPECIFIC_BASE + 7)
+#define F_GETPIPE_SZ	(F_LINUX_SPECIFIC_BASE + 8)
+
 /* for F_[GET|SET]FL */
 #define FD_CLOEXEC		1		/* actually anything with low bit set goes */
+
+/* for posix fcntl() and lockf() */
+#define F_RDLCK			0
+#define F_WRLCK			1
+#define F_UNLCK			2
+
+/* operations for bsd flock() */
+#define LOCK_SH			1		/* shared lock */
+#define LOCK_EX			2		/* exclusive lock */
+#define LOCK_NB			4		/* or'd with one of the above to prevent blocking */
+#define LOCK_UN			8		/* remove lock */
+
+struct flock
+{
+	int16_t l_type;
+	int16_t l_whence;
+	off_t l_start;
+	off_t l_len;
+	pid_t l_pid;
+};
+
+#ifndef _WIN64
+#pragma pack(push, 4)
+#endif
+struct flock64
+{
+	int16_t l_type;
+	int16_t l_whence;
+	loff_t l_start;
+	loff_t l_len;
+	pid_t l_pid;
+};
+#ifndef _WIN64
+#pragma pack(pop)
+#endif
@@ -29,6 +29,7 @@ struct inotify_event {
 #define IN_CREATE			0x00000100	/* Subfile was created */
 #define IN_DELETE			0x00000200	/* Subfile was deleted */
 #define IN_DELETE_SELF		0x00000400	/* Self was deleted */
+#define IN_MOVE_SELF		0x00000800	/* Self was moved */
 
 /* the following are legal events.  they are sent as needed to any watch */
 #define IN_UNMOUNT			0x00002000	/* Backing fs was unmounted */
@@ -40,9 +41,15 @@ struct inotify_event {
 #define IN_MOVE				(IN_MOVED_FROM | IN_MOVED_TO) /* moves */
 
 /* special flags */
+#define IN_ONLYDIR			0x01000000	/* only watch the path if it is a directory */
+#define IN_DONT_FOLLOW		0x02000000	/* don't follow a sym link */
+#define IN_EXCL_UNLINK		0x04000000	/* exclude events on unlinked objects */
+#define IN_MASK_ADD			0x20000000	/* add to the mask of an already existing watch */
 #define IN_ISDIR			0x40000000	/* event occurred against dir */
 #define IN_ONESHOT			0x80000000	/* only send event once */
 
+#define IN_ALL_EVENTS		0x00000FFF
+
 /* Flags for sys_inotify_init1.  */
 #define IN_CLOEXEC			O_CLOEXEC
 #define IN_NONBLOCK			O_NONBLOCK
@@ -31,12 +31,17 @@
 #define MS_INVALIDATE	2	 /* invalidate the caches */
 #define MS_SYNC			4	 /* synchronous memory sync */
 
+/* Flags for mremap. */
+#define MREMAP_MAYMOVE	1
+#define MREMAP_FIXED	2
+
 /* Flags for madvise. */
 #define MADV_NORMAL			0		/* no further special treatment */
 #define MADV_RANDOM			1		/* expect random page references */
 #define MADV_SEQUENTIAL		2		/* expect sequential page references */
 #define MADV_WILLNEED		3		/* will need these pages */
 #define MADV_DONTNEED		4		/* don't need these pages */
+#define MADV_FREE			8		/* free pages only if memory pressure */
 #define MADV_REMOVE			9		/* remove these pages & resources */
 #define MADV_DONTFORK		10		/* don't inherit across fork */
 #define MADV_DOFORK			11		/* do inherit across fork */
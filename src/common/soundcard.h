@@ -47,3 +47,18 @@
 #		define AFMT_U16_BE				0x00000100		/* Big endian U16 */
 #		define AFMT_MPEG				0x00000200		/* MPEG (2) audio */
 #		define AFMT_AC3					0x00000400		/* Dolby Digital AC3 */
+
+/*
+ * Buffer status queries
+ */
+typedef struct audio_buf_info
+{
+	int fragments;	/* # of available fragments (partially used ones not counted) */
+	int fragstotal;	/* Total # of fragments allocated */
+	int fragsize;	/* Size of a fragment in bytes */
+	int bytes;		/* Available space in bytes (includes partially used fragments) */
+} audio_buf_info;
+
+#define SNDCTL_DSP_GETOSPACE			_SIOR('P', 12, audio_buf_info)
+#define SNDCTL_DSP_GETISPACE			_SIOR('P', 13, audio_buf_info)
+#define SNDCTL_DSP_GETODELAY			_SIOR('P', 23, int)
@@ -1,17 +1,21 @@
 #pragma once
 
+#include <common/types.h>
+
+#define SI_LOAD_SHIFT	16
+
 struct sysinfo {
 	intptr_t uptime;			/* Seconds since boot */
-	unsigned long loads[3];		/* 1, 5, and 15 minute load averages */
-	unsigned long totalram;		/* Total usable main memory size */
-	unsigned long freeram;		/* Available memory size */
-	unsigned long sharedram;	/* Amount of shared memory */
-	unsigned long bufferram;	/* Memory used by buffers */
-	unsigned long totalswap;	/* Total swap space size */
-	unsigned long freeswap;		/* swap space still available */
+	uintptr_t loads[3];			/* 1, 5, and 15 minute load averages */
+	uintptr_t totalram;			/* Total usable main memory size */
+	uintptr_t freeram;			/* Available memory size */
+	uintptr_t sharedram;		/* Amount of shared memory */
+	uintptr_t bufferram;		/* Memory used by buffers */
+	uintptr_t totalswap;		/* Total swap space size */
+	uintptr_t freeswap;			/* swap space still available */
 	unsigned short procs;		/* Number of current processes */
-	unsigned long totalhigh;	/* Total high memory size */
-	unsigned long freehigh;		/* Available high memory size */
+	uintptr_t totalhigh;		/* Total high memory size */
+	uintptr_t freehigh;			/* Available high memory size */
 	unsigned int mem_unit;		/* Memory unit size in bytes */
 	char _f[20 - 2 * sizeof(intptr_t) - sizeof(int)];	/* Padding to 64 bytes */
 };
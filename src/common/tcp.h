@@ -1,5 +1,7 @@
 #pragma once
 
+#include <common/types.h>
+
 /* TCP socket options */
 #define LINUX_TCP_NODELAY				1		/* Turn off Nagle's algorithm. */
 #define LINUX_TCP_MAXSEG				2		/* Limit MSS */
@@ -25,3 +27,63 @@
 #define LINUX_TCP_FASTOPEN				23		/* Enable FastOpen on listeners */
 #define LINUX_TCP_TIMESTAMP				24
 #define LINUX_TCP_NOTSENT_LOWAT			25		/* limit number of unsent bytes in write queue */
+
+/* TCP states, for tcp_info.tcpi_state */
+#define LINUX_TCP_ESTABLISHED			1
+#define LINUX_TCP_SYN_SENT				2
+#define LINUX_TCP_SYN_RECV				3
+#define LINUX_TCP_FIN_WAIT1				4
+#define LINUX_TCP_FIN_WAIT2				5
+#define LINUX_TCP_TIME_WAIT				6
+#define LINUX_TCP_CLOSE					7
+#define LINUX_TCP_CLOSE_WAIT			8
+#define LINUX_TCP_LAST_ACK				9
+#define LINUX_TCP_LISTEN				10
+#define LINUX_TCP_CLOSING				11
+
+#define LINUX_TCPI_OPT_TIMESTAMPS		1
+#define LINUX_TCPI_OPT_SACK				2
+#define LINUX_TCPI_OPT_WSCALE			4
+
+struct tcp_info
+{
+	uint8_t tcpi_state;
+	uint8_t tcpi_ca_state;
+	uint8_t tcpi_retransmits;
+	uint8_t tcpi_probes;
+	uint8_t tcpi_backoff;
+	uint8_t tcpi_options;
+	uint8_t tcpi_snd_wscale : 4, tcpi_rcv_wscale : 4;
+
+	uint32_t tcpi_rto;
+	uint32_t tcpi_ato;
+	uint32_t tcpi_snd_mss;
+	uint32_t tcpi_rcv_mss;
+
+	uint32_t tcpi_unacked;
+	uint32_t tcpi_sacked;
+	uint32_t tcpi_lost;
+	uint32_t tcpi_retrans;
+	uint32_t tcpi_fackets;
+
+	/* Times. */
+	uint32_t tcpi_last_data_sent;
+	uint32_t tcpi_last_ack_sent;
+	uint32_t tcpi_last_data_recv;
+	uint32_t tcpi_last_ack_recv;
+
+	/* Metrics. */
+	uint32_t tcpi_pmtu;
+	uint32_t tcpi_rcv_ssthresh;
+	uint32_t tcpi_rtt;
+	uint32_t tcpi_rttvar;
+	uint32_t tcpi_snd_ssthresh;
+	uint32_t tcpi_snd_cwnd;
+	uint32_t tcpi_advmss;
+	uint32_t tcpi_reordering;
+
+	uint32_t tcpi_rcv_rtt;
+	uint32_t tcpi_rcv_space;
+
+	uint32_t tcpi_total_retrans;
+};
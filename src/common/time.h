@@ -28,6 +28,12 @@ struct itimerval
 	struct linux_timeval it_value;		/* current value */
 };
 
+struct itimerspec
+{
+	struct timespec it_interval;	/* timer period */
+	struct timespec it_value;		/* timer expiration */
+};
+
 typedef int clockid_t;
 typedef int timer_t;
 
@@ -47,3 +53,6 @@ typedef int timer_t;
 #define MAX_CLOCKS					16
 #define CLOCKS_MASK					(CLOCK_REALTIME | CLOCK_MONOTONIC)
 #define CLOCKS_MONO					CLOCK_MONOTONIC
+
+/* Flags for clock_nanosleep() */
+#define TIMER_ABSTIME				0x01
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <common/fcntl.h>
+
+/* Flags for timerfd_create() */
+#define TFD_CLOEXEC					O_CLOEXEC
+#define TFD_NONBLOCK				O_NONBLOCK
+
+/* Flags for timerfd_settime() */
+#define TFD_TIMER_ABSTIME			(1 << 0)
+#define TFD_TIMER_CANCEL_ON_SET		(1 << 1)
@@ -1,5 +1,7 @@
 #pragma once
 
+#define IOV_MAX		1024 /* Maximum number of segments in a vector, UIO_MAXIOV in Linux */
+
 struct iovec
 {
 	void *iov_base; /* Starting address */
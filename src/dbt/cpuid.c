@@ -294,7 +294,11 @@ void dbt_cpuid(int eax, int ecx, struct cpuid_t *cpuid)
 	cpuid->ebx = cpuinfo[1];
 	cpuid->ecx = cpuinfo[2];
 	cpuid->edx = cpuinfo[3];
-	/* Mangle cpu feature bits, omit unsupported features  */
+	/* Mangle cpu feature bits, omit unsupported features
+	 * Host features are passed through only when the translator can decode them. VEX encoded
+	 * AVX, AVX2, FMA, F16C and BMI instructions are copied verbatim, the host OSXSAVE bit tells
+	 * whether the OS has enabled AVX state, and XGETBV is executed natively.
+	 */
 	if (eax == 0x01)
 	{
 		/* Feature information */
@@ -342,7 +346,7 @@ void dbt_cpuid(int eax, int ecx, struct cpuid_t *cpuid)
 			| FEATURE_TM2
 			| FEATURE_SSSE3
 			| FEATURE_CNXT_ID
-			//| FEATURE_FMA
+			| FEATURE_FMA
 			//| FEATURE_CMPXCHG16B
 			| FEATURE_XTPR
 			| FEATURE_PDCM
@@ -355,10 +359,10 @@ void dbt_cpuid(int eax, int ecx, struct cpuid_t *cpuid)
 			| FEATURE_POPCNT
 			| FEATURE_TSC_DEADLINE
 			//| FEATURE_AES
-			//| FEATURE_XSAVE
-			//| FEATURE_OSXSAVE
-			//| FEATURE_AVX
-			//| FEATURE_F16C
+			| FEATURE_XSAVE
+			| FEATURE_OSXSAVE
+			| FEATURE_AVX
+			| FEATURE_F16C
 			//| FEATURE_RDRAND
 			| FEATURE_HYPERVISOR
 			);
@@ -384,7 +388,7 @@ void dbt_cpuid(int eax, int ecx, struct cpuid_t *cpuid)
 			//| FEATURE_SVM
 			//| FEATURE_EXTAPIC
 			//| FEATURE_CR8_LEGACY
-			//| FEATURE_ABM
+			| FEATURE_ABM
 			//| FEATURE_SSE4A
 			//| FEATURE_MISALIGNSSE
 			//| FEATURE_3DNOWPREFETCH
@@ -414,11 +418,11 @@ void dbt_cpuid(int eax, int ecx, struct cpuid_t *cpuid)
 			cpuid->ebx &= (0
 				//| FEATURE_FSGSBASE
 				| FEATURE_TSC_ADJUST
-				//| FEATURE_BMI1
+				| FEATURE_BMI1
 				//| FEATURE_HLE
-				//| FEATURE_AVX2
+				| FEATURE_AVX2
 				| FEATURE_SMEP
-				//| FEATURE_BMI2
+				| FEATURE_BMI2
 				| FEATURE_ERMS
 				//| FEATURE_INVPCID
 				//| FEATURE_RTM
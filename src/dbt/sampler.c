@@ -0,0 +1,183 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define LOG_CATEGORY LOG_CAT_DBT
+
+
+#include <dbt/sampler.h>
+#include <dbt/x86.h>
+#include <syscall/process_info.h>
+#include <flags.h>
+#include <log.h>
+#include <str.h>
+
+#include <stdint.h>
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#define SAMPLER_TABLE_SIZE		65536 /* Must be a power of 2 */
+#define SAMPLER_BUFFER_SIZE		4096
+
+struct sampler_entry
+{
+	size_t pc;
+	int kind;
+	uint32_t count; /* 0 for an empty slot */
+};
+
+struct sampler_data
+{
+	HANDLE thread;
+	HANDLE stop_event; /* Signaled to let the sampler thread exit */
+	struct sampler_entry *table;
+	uint32_t dropped; /* Samples lost due to a full table */
+};
+
+static struct sampler_data _sampler;
+static struct sampler_data *const sampler = &_sampler;
+
+static void sampler_record(int kind, size_t pc)
+{
+	int mask = SAMPLER_TABLE_SIZE - 1;
+	uint32_t h = (uint32_t)pc * 0x9E3779B1U + kind;
+	h ^= h >> 15;
+	for (int i = 0; i < SAMPLER_TABLE_SIZE; i++)
+	{
+		struct sampler_entry *entry = &sampler->table[(h + i) & mask];
+		if (entry->count == 0)
+		{
+			entry->pc = pc;
+			entry->kind = kind;
+			entry->count = 1;
+			return;
+		}
+		if (entry->pc == pc && entry->kind == kind)
+		{
+			entry->count++;
+			return;
+		}
+	}
+	sampler->dropped++;
+}
+
+static DWORD WINAPI sampler_thread(LPVOID parameter)
+{
+	/* The stop request is only checked between rounds, so no guest thread is left suspended */
+	while (WaitForSingleObject(sampler->stop_event, cmdline_flags->dbt_sample_interval) == WAIT_TIMEOUT)
+	{
+		AcquireSRWLockShared(&process->rw_lock);
+		struct list_node *cur;
+		list_iterate(&process->thread_list, cur)
+		{
+			struct thread *thread = list_entry(cur, struct thread, list);
+			/* Do not call anything which may take a lock while the thread is suspended */
+			CONTEXT context;
+			context.ContextFlags = CONTEXT_CONTROL;
+			if (SuspendThread(thread->handle) == (DWORD)-1)
+				continue;
+			size_t pc = 0;
+			int kind = DBT_SAMPLE_KERNEL;
+			if (GetThreadContext(thread->handle, &context))
+				kind = dbt_sample_thread(thread->handle, &context, &pc);
+			ResumeThread(thread->handle);
+			sampler_record(kind, pc);
+		}
+		ReleaseSRWLockShared(&process->rw_lock);
+	}
+	return 0;
+}
+
+void sampler_init()
+{
+	if (!cmdline_flags->dbt_sample_interval)
+		return;
+	sampler->table = VirtualAlloc(NULL, SAMPLER_TABLE_SIZE * sizeof(struct sampler_entry), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!sampler->table)
+	{
+		log_error("sampler: Allocating sample table failed, error code: %d", GetLastError());
+		return;
+	}
+	sampler->dropped = 0;
+	sampler->stop_event = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (!sampler->stop_event)
+	{
+		log_error("sampler: Creating stop event failed, error code: %d", GetLastError());
+		return;
+	}
+	sampler->thread = CreateThread(NULL, 0, sampler_thread, NULL, 0, NULL);
+	if (!sampler->thread)
+		log_error("sampler: Sampler thread creation failed, error code: %d", GetLastError());
+}
+
+static void sampler_write(HANDLE file, char *buf, int *len, bool force)
+{
+	if (*len > 0 && (force || *len > SAMPLER_BUFFER_SIZE - 128))
+	{
+		DWORD written;
+		WriteFile(file, buf, *len, &written, NULL);
+		*len = 0;
+	}
+}
+
+void sampler_shutdown()
+{
+	if (!sampler->thread)
+		return;
+	/* Stop sampling so the table does not change during output
+	 * The caller must not hold process->rw_lock, the sampler may be waiting for it */
+	SetEvent(sampler->stop_event);
+	WaitForSingleObject(sampler->thread, INFINITE);
+	CloseHandle(sampler->thread);
+	sampler->thread = NULL;
+	char filename[64];
+	ksprintf(filename, "flinux-%d.folded", process->pid);
+	HANDLE file = CreateFileA(filename, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		log_error("sampler: Cannot create %s, error code: %d", filename, GetLastError());
+		return;
+	}
+	char buf[SAMPLER_BUFFER_SIZE];
+	int len = 0;
+	for (int i = 0; i < SAMPLER_TABLE_SIZE; i++)
+	{
+		struct sampler_entry *entry = &sampler->table[i];
+		if (entry->count == 0)
+			continue;
+		switch (entry->kind)
+		{
+		case DBT_SAMPLE_TRANSLATED:
+			len += ksprintf(buf + len, "flinux;translated;%p %u\n", entry->pc, entry->count);
+			break;
+		case DBT_SAMPLE_DISPATCH:
+			len += ksprintf(buf + len, "flinux;dispatch %u\n", entry->count);
+			break;
+		case DBT_SAMPLE_TRANSLATOR:
+			len += ksprintf(buf + len, "flinux;translator %u\n", entry->count);
+			break;
+		default:
+			len += ksprintf(buf + len, "flinux;kernel %u\n", entry->count);
+			break;
+		}
+		sampler_write(file, buf, &len, false);
+	}
+	sampler_write(file, buf, &len, true);
+	CloseHandle(file);
+	log_info("sampler: Profile written to %s, %u samples dropped.", filename, sampler->dropped);
+}
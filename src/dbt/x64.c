@@ -0,0 +1,2135 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define LOG_CATEGORY LOG_CAT_DBT
+
+#include <dbt/cpuid.h>
+#include <dbt/x86.h>
+#include <dbt/x86_inst.h>
+#include <lib/btree.h>
+#include <syscall/mm.h>
+#include <syscall/syscall_dispatch.h>
+#include <syscall/tls.h>
+#include <etw.h>
+#include <flags.h>
+#include <log.h>
+#include <str.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <ntdll.h>
+#include <intrin.h>
+
+/* x86-64 translation backend
+ * This follows the design of the i386 backend in x86.c: guest code runs on the host
+ * registers and stack, basic blocks are translated into a per thread code cache, found
+ * through the block map and linked with patched direct jumps, indirect branches go through
+ * the sieve. The differences forced by the 64-bit mode:
+ * 1. The System V ABI lets leaf functions use 128 bytes below rsp (the red zone), generated
+ *    code which needs stack space moves rsp below it first.
+ * 2. RIP relative operands are rebased to the translated location, or rewritten to use an
+ *    absolute address in a temporary register when the code cache is out of reach.
+ * 3. Linux uses fs for TLS while gs points to the Windows TEB and fs can not be set from
+ *    user mode. fs: operands are rewritten to add the fs base kept in a TLS slot.
+ * 4. `syscall' is translated inline into a call to dbt_syscall(), there is no exception
+ *    on the way. Syscalls which do not need a context and whose number is loaded right
+ *    before are called directly through dbt_syscall_fast_internal.
+ * Translated code calls into C through dbt_helper_internal (x64_trampoline.asm), which
+ * saves all guest registers in a struct dbt_frame on the guest stack.
+ * Not supported yet: signal delivery, fork(), the return caches and block profiling.
+ */
+
+#define GET_MODRM_MOD(c)	(((c) >> 6) & 7)
+#define GET_MODRM_R(c)		(((c) >> 3) & 7)
+#define GET_MODRM_RM(c)		((c) & 7)
+#define GET_MODRM_CODE(c)	GET_MODRM_R(c)
+
+#define GET_SIB_SCALE(s)	((s) >> 6)
+#define GET_SIB_INDEX(s)	(((s) >> 3) & 7)
+#define GET_SIB_BASE(s)		((s) & 7)
+
+#define GET_REX_W(r)		(((r) >> 3) & 1)
+#define GET_REX_R(r)		(((r) >> 2) & 1)
+#define GET_REX_X(r)		(((r) >> 1) & 1)
+#define GET_REX_B(r)		(r & 1)
+
+#define RAX		0
+#define RCX		1
+#define RDX		2
+#define RBX		3
+#define RSP		4
+#define RBP		5
+#define RSI		6
+#define RDI		7
+#define R8		8
+#define R9		9
+#define R10		10
+#define R11		11
+#define R12		12
+#define R13		13
+#define R14		14
+#define R15		15
+
+/* ModR/M flags */
+#define MODRM_PURE_REGISTER	1
+#define MODRM_RIP_RELATIVE	2
+
+struct modrm_rm_t
+{
+	int base, index, scale, flags;
+	int32_t disp;
+	size_t target; /* Absolute address of a RIP relative operand */
+};
+
+/* Helpers for constructing modrm_rm_t structure */
+static struct modrm_rm_t __forceinline modrm_rm_reg(int r)
+{
+	struct modrm_rm_t rm;
+	rm.base = r;
+	rm.index = -1;
+	rm.scale = 0;
+	rm.disp = 0;
+	rm.flags = MODRM_PURE_REGISTER;
+	return rm;
+}
+
+static struct modrm_rm_t __forceinline modrm_rm_disp(int32_t disp)
+{
+	struct modrm_rm_t rm;
+	rm.base = -1;
+	rm.index = -1;
+	rm.scale = 0;
+	rm.disp = disp;
+	rm.flags = 0;
+	return rm;
+}
+
+static struct modrm_rm_t __forceinline modrm_rm_mreg(int base, int32_t disp)
+{
+	struct modrm_rm_t rm;
+	rm.base = base;
+	rm.index = -1;
+	rm.scale = 0;
+	rm.disp = disp;
+	rm.flags = 0;
+	return rm;
+}
+
+static struct modrm_rm_t __forceinline modrm_rm_mscale(int base, int index, int scale, int32_t disp)
+{
+	struct modrm_rm_t rm;
+	rm.base = base;
+	rm.index = index;
+	rm.scale = scale;
+	rm.disp = disp;
+	rm.flags = 0;
+	return rm;
+}
+
+static int __forceinline modrm_rm_is_r(struct modrm_rm_t rm)
+{
+	return rm.flags & MODRM_PURE_REGISTER;
+}
+
+static int __forceinline modrm_rm_is_m(struct modrm_rm_t rm)
+{
+	return (rm.flags & MODRM_PURE_REGISTER) == 0;
+}
+
+static uint8_t __forceinline parse_byte(uint8_t **code)
+{
+	return *(*code)++;
+}
+
+static uint16_t __forceinline parse_word(uint8_t **code)
+{
+	return *((uint16_t*)*code)++;
+}
+
+static uint32_t __forceinline parse_dword(uint8_t **code)
+{
+	return *((uint32_t*)*code)++;
+}
+
+static uint64_t __forceinline parse_qword(uint8_t **code)
+{
+	return *((uint64_t*)*code)++;
+}
+
+static int32_t __forceinline parse_rel(uint8_t **code, int rel_bytes)
+{
+	if (rel_bytes == 1)
+		return (int8_t)parse_byte(code);
+	else if (rel_bytes == 2)
+		return (int16_t)parse_word(code);
+	else
+		return (int32_t)parse_dword(code);
+}
+
+static void parse_modrm(uint8_t **code, int rex, int *r, struct modrm_rm_t *rm)
+{
+	uint8_t modrm = parse_byte(code);
+	*r = GET_MODRM_R(modrm) + (GET_REX_R(rex) << 3);
+	int mod = GET_MODRM_MOD(modrm);
+	if (mod == 3)
+	{
+		rm->flags = MODRM_PURE_REGISTER;
+		rm->base = GET_MODRM_RM(modrm) + (GET_REX_B(rex) << 3);
+		rm->index = -1;
+		return;
+	}
+	rm->flags = 0;
+	int modrm_rm = GET_MODRM_RM(modrm);
+	if (modrm_rm == 4)
+	{
+		/* ModR/M with SIB byte */
+		int sib = parse_byte(code);
+		rm->scale = GET_SIB_SCALE(sib);
+		/* rsp can not be an index, r12 can */
+		if ((rm->index = GET_SIB_INDEX(sib) + (GET_REX_X(rex) << 3)) == RSP)
+			rm->index = -1;
+		if (GET_SIB_BASE(sib) == 5 && mod == 0)
+		{
+			rm->base = -1;
+			mod = 2; /* For use later to correctly extract disp32 */
+		}
+		else
+			rm->base = GET_SIB_BASE(sib) + (GET_REX_B(rex) << 3);
+	}
+	else
+	{
+		/* ModR/M without SIB byte */
+		rm->index = -1;
+		rm->scale = 0;
+		if (mod == 0 && modrm_rm == 5) /* RIP relative, target is filled in after immediates are known */
+		{
+			rm->base = -1;
+			rm->flags = MODRM_RIP_RELATIVE;
+			rm->disp = (int32_t)parse_dword(code);
+			return;
+		}
+		rm->base = modrm_rm + (GET_REX_B(rex) << 3);
+	}
+	/* Displacement */
+	if (mod == 1) /* disp8 */
+		rm->disp = (int8_t)parse_byte(code);
+	else if (mod == 2) /* disp32 */
+		rm->disp = (int32_t)parse_dword(code);
+	else /* no disp */
+		rm->disp = 0;
+}
+
+static __forceinline void gen_byte(uint8_t **out, uint8_t x)
+{
+	*(*out)++ = x;
+}
+
+static __forceinline void gen_word(uint8_t **out, uint16_t x)
+{
+	*(uint16_t *)(*out) = x;
+	*out += 2;
+}
+
+static __forceinline void gen_dword(uint8_t **out, uint32_t x)
+{
+	*(uint32_t *)(*out) = x;
+	*out += 4;
+}
+
+static __forceinline void gen_qword(uint8_t **out, uint64_t x)
+{
+	*(uint64_t *)(*out) = x;
+	*out += 8;
+}
+
+static __forceinline void gen_copy(uint8_t **out, uint8_t *code, int count)
+{
+	for (int i = 0; i < count; i++)
+		gen_byte(out, *code++);
+}
+
+/* Generate REX prefix for the given operands, force is used to keep byte registers spl/bpl/sil/dil */
+static __forceinline void gen_rex(uint8_t **out, bool force, int w, int r, struct modrm_rm_t rm)
+{
+	int rex = (w << 3) | (((r >> 3) & 1) << 2);
+	if (rm.index != -1)
+		rex |= ((rm.index >> 3) & 1) << 1;
+	if (rm.base != -1)
+		rex |= (rm.base >> 3) & 1;
+	if (rex || force)
+		gen_byte(out, 0x40 | rex);
+}
+
+static __forceinline void gen_modrm(uint8_t **out, int mod, int r, int rm)
+{
+	gen_byte(out, (mod << 6) + ((r & 7) << 3) + (rm & 7));
+}
+
+static __forceinline void gen_sib(uint8_t **out, int base, int index, int scale)
+{
+	gen_byte(out, (scale << 6) + ((index & 7) << 3) + (base & 7));
+}
+
+/* RIP relative operands are not handled here, see dbt_copy_instruction() */
+static __forceinline void gen_modrm_sib(uint8_t **out, int r, struct modrm_rm_t rm)
+{
+	if (rm.flags == MODRM_PURE_REGISTER)
+	{
+		gen_modrm(out, 3, r, rm.base);
+		return;
+	}
+	if (rm.index == RSP)
+	{
+		log_error("gen_modrm(): rsp cannot be used as an index register.");
+		return;
+	}
+	int is_disp8 = (((int8_t)rm.disp) == rm.disp);
+	if (rm.base == -1) /* [scaled index] + disp32, or disp32 which needs SIB in 64-bit mode */
+	{
+		gen_modrm(out, 0, r, 4);
+		gen_sib(out, 5, rm.index == -1? RSP: rm.index, rm.scale);
+		gen_dword(out, rm.disp);
+	}
+	else if ((rm.base & 7) == RSP || rm.index != -1) /* SIB required */
+	{
+		gen_modrm(out, is_disp8? 1: 2, r, 4);
+		gen_sib(out, rm.base, rm.index == -1? RSP: rm.index, rm.scale);
+		if (is_disp8)
+			gen_byte(out, (int8_t)rm.disp);
+		else
+			gen_dword(out, rm.disp);
+	}
+	else /* [base] + disp */
+	{
+		if (is_disp8)
+		{
+			gen_modrm(out, 1, r, rm.base);
+			gen_byte(out, (int8_t)rm.disp);
+		}
+		else
+		{
+			gen_modrm(out, 2, r, rm.base);
+			gen_dword(out, rm.disp);
+		}
+	}
+}
+
+static __forceinline void gen_gs_prefix(uint8_t **out)
+{
+	gen_byte(out, 0x65);
+}
+
+static __forceinline void gen_mov_r_rm_64(uint8_t **out, int r, struct modrm_rm_t rm)
+{
+	gen_rex(out, false, 1, r, rm);
+	gen_byte(out, 0x8B);
+	gen_modrm_sib(out, r, rm);
+}
+
+static __forceinline void gen_mov_rm_r_64(uint8_t **out, struct modrm_rm_t rm, int r)
+{
+	gen_rex(out, false, 1, r, rm);
+	gen_byte(out, 0x89);
+	gen_modrm_sib(out, r, rm);
+}
+
+static __forceinline void gen_mov_r_imm64(uint8_t **out, int r, uint64_t imm64)
+{
+	gen_rex(out, false, 1, 0, modrm_rm_reg(r));
+	gen_byte(out, 0xB8 + (r & 7));
+	gen_qword(out, imm64);
+}
+
+static __forceinline void gen_mov_r_imm32(uint8_t **out, int r, uint32_t imm32)
+{
+	gen_rex(out, false, 0, 0, modrm_rm_reg(r));
+	gen_byte(out, 0xB8 + (r & 7));
+	gen_dword(out, imm32);
+}
+
+static __forceinline void gen_lea_64(uint8_t **out, int r, struct modrm_rm_t rm)
+{
+	gen_rex(out, false, 1, r, rm);
+	gen_byte(out, 0x8D);
+	gen_modrm_sib(out, r, rm);
+}
+
+static __forceinline void gen_push_r(uint8_t **out, int r)
+{
+	gen_rex(out, false, 0, 0, modrm_rm_reg(r));
+	gen_byte(out, 0x50 + (r & 7));
+}
+
+static __forceinline void gen_pop_r(uint8_t **out, int r)
+{
+	gen_rex(out, false, 0, 0, modrm_rm_reg(r));
+	gen_byte(out, 0x58 + (r & 7));
+}
+
+static __forceinline void gen_push_imm32(uint8_t **out, uint32_t imm)
+{
+	gen_byte(out, 0x68);
+	gen_dword(out, imm);
+}
+
+static __forceinline void gen_jmp(uint8_t **out, void *dest)
+{
+	int32_t rel = (int32_t)((size_t)dest - (((size_t)*out) + 5));
+	gen_byte(out, 0xE9);
+	gen_dword(out, rel);
+}
+
+static __forceinline void gen_jcc(uint8_t **out, int cond, size_t dest)
+{
+	int32_t rel = (int32_t)(dest - (((size_t)*out) + 6));
+	gen_byte(out, 0x0F);
+	gen_byte(out, 0x80 + cond);
+	gen_dword(out, rel);
+}
+
+struct dbt_block
+{
+	size_t pc;
+	size_t end_pc; /* Upper bound of source address covered by this block (exclusive) */
+	uint8_t *start;
+	int size; /* Size of translated code */
+};
+
+#define DBT_OUT_ALIGN			16
+#define DBT_TRAMPOLINE_ALIGN	64
+#define DBT_BLOCK_MAP_INITIAL_SIZE	4096 /* Must be a power of 2 */
+#define DBT_BLOCK_MAXSIZE		1024 /* Maximum size of a translated basic block */
+#define DBT_CACHE_SIZE			0x01000000U /* Default size of code cache and blocks table */
+#define DBT_RED_ZONE_SIZE		128 /* Stack area below rsp leaf functions may use */
+
+/* Superblock formation, see x86.c */
+#define DBT_TRACE_MAX_EXITS		8 /* Maximum number of followed branches in a superblock */
+#define DBT_TRACE_MAX_SPAN		0x1000 /* Maximum source code span of a superblock */
+#define DBT_MAX_INSTRUCTION_SIZE	15 /* Maximum length of an x86 instruction */
+
+/* Direct block chaining, see x86.c */
+#define DBT_LINK_MAP_SIZE		4096 /* Must be a power of 2 */
+
+/* Cross thread code invalidation, see x86.c */
+#define DBT_CODE_CHANGE_QUEUE_SIZE	256 /* Must be a power of 2 */
+
+struct dbt_code_change
+{
+	size_t pc;
+	size_t len;
+};
+
+struct dbt_global_data
+{
+	/* Cached offsets for accessing thread local storage in gs:[.] */
+	int tls_dbt_offset; /* dbt thread local pointer */
+	int tls_scratch_offset; /* scratch variable */
+	int tls_fs_base_offset; /* fs base address */
+	int tls_pc_offset; /* target of current indirect branch */
+	/* Code cache sizes, can be tuned by --dbt-cache-size */
+	size_t cache_size;
+	size_t blocks_table_size;
+	int max_blocks;
+	/* Recently changed code ranges, see dbt_code_changed() */
+	SRWLOCK code_change_lock;
+	volatile long code_change_generation; /* Number of ranges ever published */
+	struct dbt_code_change code_changes[DBT_CODE_CHANGE_QUEUE_SIZE];
+	/* Process wide statistics, shown in /proc/[pid]/flinux/dbt */
+	struct
+	{
+		volatile long threads;
+		volatile long blocks; /* Blocks currently in all code caches */
+		volatile long cache_used; /* Bytes currently used in all code caches */
+		volatile long translations;
+		volatile long flushes;
+		volatile long invalidations;
+		volatile long sieve_misses;
+		volatile long direct_patches;
+		volatile LONG64 translate_cycles;
+	} stats;
+} static _dbt_global;
+
+static struct dbt_global_data *const dbt_global = &_dbt_global;
+
+/* Do not modify these unless you know what you are doing */
+#define DBT_SIEVE_ENTRIES			65536
+#define SIEVE_HASH(x)				((x) & 0xFFFF)
+
+/* Open addressing hash map from source address to block, using linear probing */
+struct dbt_block_map_entry
+{
+	size_t pc; /* 0 for an empty slot */
+	struct dbt_block *block;
+};
+
+/* Open addressing hash map from target address to waiting direct trampolines */
+struct dbt_link_map_entry
+{
+	size_t target; /* 0 for an empty slot */
+	struct dbt_helper_data *head; /* Argument block of the first waiting trampoline, NULL if none */
+};
+
+/* Per thread dbt data, see x86.c for why translations are not shared */
+struct dbt_data
+{
+	struct dbt_block_map_entry *block_map;
+	int block_map_size;
+	int block_map_count;
+	struct dbt_link_map_entry *link_map;
+	int link_map_count;
+	struct dbt_block *blocks;
+	struct btree tree; /* Blocks by source address */
+	struct btree cache_tree; /* Blocks by translated code cache address */
+	int blocks_count;
+	int flush_count; /* Number of full flushes due to exhaustion or code change */
+	int invalidate_count; /* Number of blocks invalidated individually */
+	uint8_t *code_cache;
+	uint8_t *internal_trampoline_end;
+	uint8_t *out, *end;
+	/* Sieve */
+	uint8_t **sieve_table;
+	uint8_t *sieve_dispatch_trampoline;
+	uint8_t *sieve_fallback_trampoline;
+	/* Whether the thread is inside the translator, read by the sampling profiler */
+	volatile bool translating;
+	/* Block currently generated by dbt_translate(), not yet in the block map */
+	struct dbt_block *translating_block;
+	/* Values of this thread last accounted in dbt_global->stats */
+	int stats_blocks;
+	int stats_cache_used;
+	/* Value of dbt_global->code_change_generation last processed by this thread */
+	long code_change_seen;
+};
+
+/* Saved guest registers of a call into C, on the guest stack */
+struct dbt_frame
+{
+	/* DO NOT REORDER, see dbt_helper_internal */
+	uint64_t rflags;
+	uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+	uint64_t rdi, rsi, rbp, rbx, rdx, rcx;
+	uint64_t rax;
+};
+/* The frame is below the red zone of the guest stack */
+#define DBT_FRAME_RSP(frame)	((size_t)((frame) + 1) + DBT_RED_ZONE_SIZE)
+
+/* Returns the translated address to continue at */
+typedef uint8_t *dbt_helper_fn(size_t arg0, size_t arg1, struct dbt_frame *frame);
+
+/* Arguments of a call into C, placed in the code cache after the calling stub */
+struct dbt_helper_data
+{
+	/* DO NOT REORDER, see dbt_helper_internal */
+	void *entry; /* dbt_helper_internal */
+	dbt_helper_fn *fn;
+	size_t arg0, arg1;
+};
+
+extern void dbt_helper_internal();
+extern void dbt_syscall_fast_internal();
+extern __declspec(noreturn) void goto_entrypoint(const char *stack, void *entrypoint);
+
+static __declspec(thread) struct dbt_data *dbt;
+/* A helper flag which will be set to true in dbt_flush().
+ * User can first set this to true, and read it after some operations
+ * to determine if dbt code cache is flushed during the operations.
+ */
+static __declspec(thread) bool dbt_flushed;
+
+/* Generate a call to fn(arg0, arg1, frame), returns the argument block
+ * The guest state is preserved except what fn changes in frame. Unlike the i386 backend
+ * C code is always entered through dbt_helper_internal, which saves x87 and SSE states.
+ */
+static struct dbt_helper_data *dbt_gen_helper_call(uint8_t **out, dbt_helper_fn *fn, size_t arg0, size_t arg1)
+{
+	/* lea rsp, [rsp - 128] (5 bytes) */
+	gen_lea_64(out, RSP, modrm_rm_mreg(RSP, -DBT_RED_ZONE_SIZE));
+	/* push rax (1 byte) */
+	gen_push_r(out, RAX);
+	/* lea rax, [rip + data] (7 bytes) */
+	uint8_t *data = (uint8_t *)ALIGN_TO(*out + 9, sizeof(size_t));
+	gen_byte(out, 0x48); gen_byte(out, 0x8D); gen_byte(out, 0x05);
+	gen_dword(out, (uint32_t)(data - (*out + 4)));
+	/* jmp qword ptr [rax] (2 bytes) */
+	gen_byte(out, 0xFF); gen_byte(out, 0x20);
+	while (*out < data)
+		gen_byte(out, 0xCC);
+	struct dbt_helper_data *helper = (struct dbt_helper_data *)data;
+	helper->entry = (void *)&dbt_helper_internal;
+	helper->fn = fn;
+	helper->arg0 = arg0;
+	helper->arg1 = arg1;
+	*out += sizeof(struct dbt_helper_data);
+	return helper;
+}
+
+int dbt_sample_thread(HANDLE thread, const CONTEXT *context, size_t *pc)
+{
+	THREAD_BASIC_INFORMATION info;
+	NtQueryInformationThread(thread, ThreadBasicInformation, &info, sizeof(info), NULL);
+	struct dbt_data *dbt = *(struct dbt_data **)((uint8_t*)info.TebBaseAddress + dbt_global->tls_dbt_offset);
+	*pc = 0;
+	if (!dbt)
+		return DBT_SAMPLE_KERNEL;
+	uint8_t *rip = (uint8_t *)context->Rip;
+	if (rip >= dbt->internal_trampoline_end && rip < dbt->out)
+	{
+		/* Inside translated code, the thread cannot be modifying its block trees now */
+		struct btree_iter iter;
+		if (btree_upper_bound(&dbt->cache_tree, (size_t)rip, &iter))
+			*pc = ((struct dbt_block *)btree_iter_value(&iter))->pc;
+		return DBT_SAMPLE_TRANSLATED;
+	}
+	if (rip >= dbt->code_cache && rip < dbt->code_cache + dbt_global->cache_size)
+		return DBT_SAMPLE_DISPATCH;
+	if (dbt->translating)
+		return DBT_SAMPLE_TRANSLATOR;
+	return DBT_SAMPLE_KERNEL;
+}
+
+static uint8_t *dbt_find_next_sieve(size_t arg0, size_t arg1, struct dbt_frame *frame);
+static void dbt_gen_sieve_dispatch()
+{
+	uint8_t *out;
+	out = (uint8_t*)ALIGN_TO(dbt->out, DBT_OUT_ALIGN);
+	dbt->sieve_dispatch_trampoline = out;
+
+	/* The destination address is in rax, guest rax is saved at [rsp], rsp = guest rsp - 136 */
+	/* push rcx (1 byte) */
+	gen_push_r(&out, RCX);
+	/* push rdx (1 byte) */
+	gen_push_r(&out, RDX);
+	/* movzx ecx, ax (3 bytes) */
+	gen_byte(&out, 0x0F); gen_byte(&out, 0xB7); gen_byte(&out, 0xC8);
+	/* lea rdx, [rip + sieve_table] (7 bytes) */
+	gen_byte(&out, 0x48); gen_byte(&out, 0x8D); gen_byte(&out, 0x15);
+	gen_dword(&out, (uint32_t)((uint8_t *)dbt->sieve_table - (out + 4)));
+	/* jmp qword ptr [rdx + rcx*8] (3 bytes) */
+	gen_byte(&out, 0xFF); gen_byte(&out, 0x24); gen_byte(&out, 0xCA);
+
+	out = (uint8_t*)ALIGN_TO(out, DBT_OUT_ALIGN);
+	dbt->sieve_fallback_trampoline = out;
+
+	/* pop rdx (1 byte) */
+	gen_pop_r(&out, RDX);
+	/* pop rcx (1 byte) */
+	gen_pop_r(&out, RCX);
+	/* mov gs:[pc], rax */
+	gen_gs_prefix(&out);
+	gen_mov_rm_r_64(&out, modrm_rm_disp(dbt_global->tls_pc_offset), RAX);
+	/* The red zone is already skipped and rax saved, enter the helper directly */
+	/* lea rax, [rip + data] (7 bytes) */
+	uint8_t *data = (uint8_t *)ALIGN_TO(out + 9, sizeof(size_t));
+	gen_byte(&out, 0x48); gen_byte(&out, 0x8D); gen_byte(&out, 0x05);
+	gen_dword(&out, (uint32_t)(data - (out + 4)));
+	/* jmp qword ptr [rax] (2 bytes) */
+	gen_byte(&out, 0xFF); gen_byte(&out, 0x20);
+	out = data;
+	struct dbt_helper_data *helper = (struct dbt_helper_data *)out;
+	helper->entry = (void *)&dbt_helper_internal;
+	helper->fn = dbt_find_next_sieve;
+	helper->arg0 = 0;
+	helper->arg1 = 0;
+	out += sizeof(struct dbt_helper_data);
+
+	dbt->out = out;
+
+	/* Fill out sieve_table */
+	for (int i = 0; i < DBT_SIEVE_ENTRIES; i++)
+		dbt->sieve_table[i] = dbt->sieve_fallback_trampoline;
+}
+
+static void dbt_gen_tables()
+{
+	/* Initialize block cache */
+	btree_clear(&dbt->tree);
+	btree_clear(&dbt->cache_tree);
+	dbt->blocks_count = 0;
+	dbt->out = dbt->code_cache;
+	dbt->end = dbt->code_cache + dbt_global->cache_size;
+
+	/* Allocate ancillary data structure, it is addressed RIP relative by the dispatcher */
+	dbt->sieve_table = (uint8_t**)dbt->out;
+	dbt->out += sizeof(uint8_t*) * DBT_SIEVE_ENTRIES;
+
+	/* Trampolines */
+	dbt->internal_trampoline_end = dbt->out;
+	dbt_gen_sieve_dispatch();
+}
+
+void dbt_init_thread()
+{
+	dbt = VirtualAlloc(NULL, sizeof(struct dbt_data), MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_READWRITE);
+	dbt->block_map_size = DBT_BLOCK_MAP_INITIAL_SIZE;
+	if (!(dbt->block_map = VirtualAlloc(NULL, sizeof(struct dbt_block_map_entry) * DBT_BLOCK_MAP_INITIAL_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_READWRITE)))
+		log_error("VirtualAlloc() for dbt_block_map failed.");
+	if (!(dbt->link_map = VirtualAlloc(NULL, sizeof(struct dbt_link_map_entry) * DBT_LINK_MAP_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_READWRITE)))
+		log_error("VirtualAlloc() for dbt_link_map failed.");
+	if (!(dbt->blocks = VirtualAlloc(NULL, dbt_global->blocks_table_size, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_READWRITE)))
+		log_error("VirtualAlloc() for dbt_blocks failed.");
+	if (!(dbt->code_cache = VirtualAlloc(NULL, dbt_global->cache_size, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_EXECUTE_READWRITE)))
+		log_error("VirtualAlloc() for dbt_cache failed.");
+	dbt_gen_tables();
+	AcquireSRWLockShared(&dbt_global->code_change_lock);
+	dbt->code_change_seen = dbt_global->code_change_generation;
+	ReleaseSRWLockShared(&dbt_global->code_change_lock);
+	__writegsqword(dbt_global->tls_dbt_offset, (DWORD64)dbt);
+	InterlockedIncrement(&dbt_global->stats.threads);
+}
+
+void dbt_init()
+{
+	log_info("Initializing dbt subsystem...");
+	/* Initialize TLS offsets */
+	dbt_global->tls_dbt_offset = tls_kernel_entry_to_offset(TLS_ENTRY_DBT);
+	dbt_global->tls_scratch_offset = tls_kernel_entry_to_offset(TLS_ENTRY_SCRATCH);
+	/* The guest TLS base lives in the slot of the i386 gs base */
+	dbt_global->tls_fs_base_offset = tls_kernel_entry_to_offset(TLS_ENTRY_GS_ADDR);
+	dbt_global->tls_pc_offset = tls_kernel_entry_to_offset(TLS_ENTRY_EIP);
+	x86_inst_init();
+	/* Initialize code cache sizes */
+	if (cmdline_flags->dbt_cache_size)
+		dbt_global->cache_size = (size_t)cmdline_flags->dbt_cache_size * 0x00100000U;
+	else
+		dbt_global->cache_size = DBT_CACHE_SIZE;
+	dbt_global->blocks_table_size = dbt_global->cache_size;
+	dbt_global->max_blocks = (int)(dbt_global->blocks_table_size / sizeof(struct dbt_block));
+	/* Initialize dbt thread local data for main thread */
+	dbt_init_thread();
+	log_info("dbt subsystem initialized.");
+}
+
+void dbt_shutdown()
+{
+	/* TODO */
+}
+
+/* Account changes of the current thread's code cache usage in process wide statistics */
+static void dbt_stats_update()
+{
+	int cache_used = (int)((dbt->out - dbt->code_cache) + (dbt->code_cache + dbt_global->cache_size - dbt->end));
+	InterlockedExchangeAdd(&dbt_global->stats.blocks, dbt->blocks_count - dbt->stats_blocks);
+	InterlockedExchangeAdd(&dbt_global->stats.cache_used, cache_used - dbt->stats_cache_used);
+	dbt->stats_blocks = dbt->blocks_count;
+	dbt->stats_cache_used = cache_used;
+}
+
+void dbt_shutdown_thread()
+{
+	if (!dbt)
+		return;
+	InterlockedExchangeAdd(&dbt_global->stats.blocks, -dbt->stats_blocks);
+	InterlockedExchangeAdd(&dbt_global->stats.cache_used, -dbt->stats_cache_used);
+	InterlockedDecrement(&dbt_global->stats.threads);
+	dbt->stats_blocks = 0;
+	dbt->stats_cache_used = 0;
+}
+
+/* Sieve hits are resolved inside translated code and are not counted */
+int dbt_get_stats(char *buf)
+{
+	return ksprintf(buf,
+		"threads:          %d\n"
+		"blocks:           %d (max %d per thread)\n"
+		"cache_used:       %d bytes (%d bytes per thread)\n"
+		"translations:     %d\n"
+		"translate_cycles: %llu\n"
+		"flushes:          %d\n"
+		"invalidations:    %d\n"
+		"sieve_misses:     %d\n"
+		"direct_patches:   %d\n",
+		dbt_global->stats.threads,
+		dbt_global->stats.blocks, dbt_global->max_blocks,
+		dbt_global->stats.cache_used, (int)dbt_global->cache_size,
+		dbt_global->stats.translations,
+		(uint64_t)dbt_global->stats.translate_cycles,
+		dbt_global->stats.flushes,
+		dbt_global->stats.invalidations,
+		dbt_global->stats.sieve_misses,
+		dbt_global->stats.direct_patches);
+}
+
+void dbt_profile_report()
+{
+	if (!dbt || !cmdline_flags->dbt_profile)
+		return;
+	log_info("dbt profile: %d blocks, block execution counters are not supported on x86-64.", dbt->blocks_count);
+}
+
+static void dbt_flush()
+{
+	for (int i = 0; i < dbt->block_map_size; i++)
+		dbt->block_map[i].pc = 0;
+	dbt->block_map_count = 0;
+	for (int i = 0; i < DBT_LINK_MAP_SIZE; i++)
+		dbt->link_map[i].target = 0;
+	dbt->link_map_count = 0;
+	dbt->flush_count++;
+	InterlockedIncrement(&dbt_global->stats.flushes);
+	if (etw_enabled(ETW_KEYWORD_DBT))
+		etw_dbt_flush(dbt->blocks_count, dbt->flush_count);
+	log_info("dbt code cache flushed. (blocks: %d, code: %d bytes, trampolines: %d bytes, flushes: %d)",
+		dbt->blocks_count, dbt->out - dbt->internal_trampoline_end, dbt->code_cache + dbt_global->cache_size - dbt->end,
+		dbt->flush_count);
+	dbt_gen_tables();
+	dbt_stats_update();
+	dbt_flushed = true;
+}
+
+static bool dbt_invalidate_block(struct dbt_block *block);
+
+void dbt_reset()
+{
+	/* Keep blocks inside executable file mappings the new image may map again, see mm_reset() */
+	int kept = 0;
+	size_t next_pc = 0;
+	struct btree_iter iter;
+	while (btree_lower_bound(&dbt->tree, next_pc, &iter))
+	{
+		struct dbt_block *block = (struct dbt_block *)btree_iter_value(&iter);
+		/* Invalidation removes the block from the tree, continue the search by key */
+		next_pc = block->pc + 1;
+		if (mm_is_code_retained(block->pc, block->end_pc))
+			kept++;
+		else if (!dbt_invalidate_block(block))
+		{
+			dbt_flush();
+			return;
+		}
+		else
+			dbt->invalidate_count++;
+	}
+	if (!kept)
+	{
+		dbt_flush();
+		return;
+	}
+	log_info("dbt: %d blocks kept across execve().", kept);
+}
+
+static __forceinline int hash_block_pc(size_t pc)
+{
+	uint32_t h = (uint32_t)(pc ^ (pc >> 32)) * 0x9E3779B1U;
+	return (int)(h ^ (h >> 15)) & (dbt->block_map_size - 1);
+}
+
+static struct dbt_block *alloc_block()
+{
+	if (dbt->blocks_count == dbt_global->max_blocks || dbt->end - dbt->out < DBT_BLOCK_MAXSIZE)
+		return NULL;
+	return &dbt->blocks[dbt->blocks_count++];
+}
+
+static struct dbt_block *find_block(size_t pc)
+{
+	int mask = dbt->block_map_size - 1;
+	for (int i = hash_block_pc(pc);; i = (i + 1) & mask)
+	{
+		struct dbt_block_map_entry *entry = &dbt->block_map[i];
+		if (entry->pc == pc)
+			return entry->block;
+		if (entry->pc == 0)
+			return NULL;
+	}
+}
+
+static void block_map_add_unsafe(struct dbt_block *block)
+{
+	int mask = dbt->block_map_size - 1;
+	int i = hash_block_pc(block->pc);
+	while (dbt->block_map[i].pc)
+		i = (i + 1) & mask;
+	dbt->block_map[i].pc = block->pc;
+	dbt->block_map[i].block = block;
+	dbt->block_map_count++;
+}
+
+/* Double the size of the block map, return false on failure */
+static bool block_map_grow()
+{
+	struct dbt_block_map_entry *old_map = dbt->block_map;
+	int old_size = dbt->block_map_size;
+	struct dbt_block_map_entry *new_map = VirtualAlloc(NULL, sizeof(struct dbt_block_map_entry) * old_size * 2,
+		MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_READWRITE);
+	if (!new_map)
+		return false;
+	dbt->block_map = new_map;
+	dbt->block_map_size = old_size * 2;
+	dbt->block_map_count = 0;
+	for (int i = 0; i < old_size; i++)
+		if (old_map[i].pc)
+			block_map_add_unsafe(old_map[i].block);
+	VirtualFree(old_map, 0, MEM_RELEASE);
+	return true;
+}
+
+static void block_map_add(struct dbt_block *block)
+{
+	/* Keep load factor under 1/2 */
+	if ((dbt->block_map_count + 1) * 2 > dbt->block_map_size && !block_map_grow())
+	{
+		log_error("Growing dbt block map failed.");
+		if (dbt->block_map_count + 1 == dbt->block_map_size)
+		{
+			log_error("dbt block map is full.");
+			__debugbreak();
+		}
+	}
+	block_map_add_unsafe(block);
+}
+
+static void block_map_remove(struct dbt_block *block)
+{
+	int mask = dbt->block_map_size - 1;
+	int i = hash_block_pc(block->pc);
+	while (dbt->block_map[i].pc != block->pc)
+	{
+		if (dbt->block_map[i].pc == 0)
+			return;
+		i = (i + 1) & mask;
+	}
+	/* Backward shift deletion: move following entries of the cluster to fill the hole */
+	for (int j = (i + 1) & mask; dbt->block_map[j].pc; j = (j + 1) & mask)
+	{
+		int k = hash_block_pc(dbt->block_map[j].pc);
+		/* Entry j can stay if its home slot k lies cyclically in (i, j] */
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		dbt->block_map[i] = dbt->block_map[j];
+		i = j;
+	}
+	dbt->block_map[i].pc = 0;
+	dbt->block_map_count--;
+}
+
+/* Find the link map entry of target, add an empty one if add is true and there is space */
+static struct dbt_link_map_entry *link_map_find(size_t target, bool add)
+{
+	int mask = DBT_LINK_MAP_SIZE - 1;
+	uint32_t h = (uint32_t)(target ^ (target >> 32)) * 0x9E3779B1U;
+	for (int i = (int)(h ^ (h >> 15)) & mask;; i = (i + 1) & mask)
+	{
+		struct dbt_link_map_entry *entry = &dbt->link_map[i];
+		if (entry->target == target)
+			return entry;
+		if (entry->target == 0)
+		{
+			/* Keep load factor under 1/2, a missing entry only means lazy patching */
+			if (!add || (dbt->link_map_count + 1) * 2 > DBT_LINK_MAP_SIZE)
+				return NULL;
+			entry->target = target;
+			entry->head = NULL;
+			dbt->link_map_count++;
+			return entry;
+		}
+	}
+}
+
+#define DBT_SIEVE_NEXT_BUCKET_OFFSET		18
+static uint8_t *dbt_gen_sieve(size_t original_pc, uint8_t *target)
+{
+	/* The destination address is in rax, guest rax, rcx and rdx are pushed on the stack */
+	/* Caution: we must ensure that this stub fits in DBT_TRAMPOLINE_ALIGN bytes */
+	dbt->end -= DBT_TRAMPOLINE_ALIGN;
+	uint8_t *out = dbt->end;
+	/* mov rcx, -original_pc (10 bytes) */
+	gen_mov_r_imm64(&out, RCX, -(int64_t)original_pc);
+	/* lea rcx, [rcx + rax + 0] (5 bytes) */
+	gen_lea_64(&out, RCX, modrm_rm_mscale(RCX, RAX, 0, 0));
+	/* jrcxz match (2 bytes) */
+	gen_byte(&out, 0xE3); gen_byte(&out, 0x05);
+	/* jmp sieve_fallback_trampoline (5 bytes) */
+	gen_jmp(&out, dbt->sieve_fallback_trampoline);
+	/* patch offset: 10+5+2+1=18 bytes */
+
+	/* match: */
+	/* pop rdx (1 byte) */
+	gen_pop_r(&out, RDX);
+	/* pop rcx (1 byte) */
+	gen_pop_r(&out, RCX);
+	/* pop rax (1 byte) */
+	gen_pop_r(&out, RAX);
+	/* lea rsp, [rsp + 128] (8 bytes) */
+	gen_lea_64(&out, RSP, modrm_rm_mreg(RSP, DBT_RED_ZONE_SIZE));
+	/* jmp target (5 bytes) */
+	gen_jmp(&out, target);
+
+	return dbt->end;
+}
+
+static uint8_t *dbt_find_direct(size_t pc, size_t patch_addr, struct dbt_frame *frame);
+static uint8_t *dbt_get_direct_trampoline(size_t target, size_t patch_addr)
+{
+	struct dbt_block *cached_block = find_block(target);
+	if (cached_block)
+		return cached_block->start;
+	if (dbt->translating_block && dbt->translating_block->pc == target)
+		return dbt->translating_block->start;
+
+	/* Not found in cache, create a stub */
+	/* Caution: we must ensure that this stub fits in DBT_TRAMPOLINE_ALIGN(64) bytes */
+	dbt->end -= DBT_TRAMPOLINE_ALIGN;
+	uint8_t *out = dbt->end;
+	struct dbt_helper_data *helper = dbt_gen_helper_call(&out, dbt_find_direct, target, patch_addr);
+	struct dbt_link_map_entry *link = link_map_find(target, true);
+	if (link)
+	{
+		/* The next waiting trampoline is stored after the argument block */
+		*(struct dbt_helper_data **)out = link->head;
+		link->head = helper;
+	}
+	return dbt->end;
+}
+
+/* Unlink a block whose source code has changed, see x86.c */
+static bool dbt_invalidate_block(struct dbt_block *block)
+{
+	if (dbt->end - dbt->out < DBT_BLOCK_MAXSIZE + DBT_TRAMPOLINE_ALIGN)
+		return false;
+	block_map_remove(block);
+	btree_remove(&dbt->tree, block->pc);
+	/* Blocks are DBT_OUT_ALIGN aligned and non-empty, so there is always space for the jmp */
+	uint8_t *out = block->start;
+	size_t patch_addr = (size_t)out + 1;
+	gen_jmp(&out, dbt_get_direct_trampoline(block->pc, patch_addr));
+	return true;
+}
+
+/* Invalidate translations of [pc, pc + len) in the code cache of the calling thread
+ * Returns the number of blocks invalidated, or -1 if the code cache is flushed instead */
+static int dbt_invalidate_range(size_t pc, size_t len)
+{
+	/* A superblock could start at most DBT_TRACE_MAX_SPAN bytes before the changed range */
+	size_t probe = pc > DBT_TRACE_MAX_SPAN? pc - DBT_TRACE_MAX_SPAN: 0;
+	int invalidated_count = 0;
+	struct btree_iter iter;
+	while (btree_lower_bound(&dbt->tree, probe, &iter))
+	{
+		struct dbt_block *block = (struct dbt_block *)btree_iter_value(&iter);
+		if (block->pc > pc + len)
+			break;
+		probe = block->pc + 1;
+		if (block->end_pc < pc)
+			continue;
+		if (!dbt_invalidate_block(block))
+		{
+			dbt_flush();
+			return -1;
+		}
+		invalidated_count++;
+		dbt->invalidate_count++;
+		InterlockedIncrement(&dbt_global->stats.invalidations);
+	}
+	return invalidated_count;
+}
+
+/* Invalidate the ranges other threads published since this thread last looked
+ * The caller must hold code_change_lock, returns the number of ranges processed */
+static int dbt_process_code_changes_locked()
+{
+	long generation = dbt_global->code_change_generation;
+	int count = generation - dbt->code_change_seen;
+	if (count > DBT_CODE_CHANGE_QUEUE_SIZE)
+		dbt_flush();
+	else
+	{
+		for (long i = dbt->code_change_seen; i != generation; i++)
+		{
+			struct dbt_code_change *change = &dbt_global->code_changes[i & (DBT_CODE_CHANGE_QUEUE_SIZE - 1)];
+			if (dbt_invalidate_range(change->pc, change->len) < 0)
+				break;
+		}
+	}
+	dbt->code_change_seen = generation;
+	return count;
+}
+
+/* Called on translator entry, see x86.c */
+static __forceinline void dbt_check_code_changes()
+{
+	if (dbt->code_change_seen == dbt_global->code_change_generation)
+		return;
+	AcquireSRWLockShared(&dbt_global->code_change_lock);
+	int count = dbt_process_code_changes_locked();
+	ReleaseSRWLockShared(&dbt_global->code_change_lock);
+	if (count > 0)
+		log_info("dbt: %d code ranges changed by other threads processed.", count);
+}
+
+void dbt_code_changed(size_t pc, size_t len)
+{
+	AcquireSRWLockExclusive(&dbt_global->code_change_lock);
+	/* Catch up first, so the range published here is the only one this thread has not seen */
+	dbt_process_code_changes_locked();
+	struct dbt_code_change *change = &dbt_global->code_changes[dbt_global->code_change_generation & (DBT_CODE_CHANGE_QUEUE_SIZE - 1)];
+	change->pc = pc;
+	change->len = len;
+	InterlockedIncrement(&dbt_global->code_change_generation);
+	dbt->code_change_seen = dbt_global->code_change_generation;
+	ReleaseSRWLockExclusive(&dbt_global->code_change_lock);
+	int invalidated_count = dbt_invalidate_range(pc, len);
+	if (invalidated_count < 0)
+		log_info("DBT block at [%p, %p) changed. Code cache flushed.", pc, pc + len);
+	else if (invalidated_count > 0)
+		log_info("DBT code at [%p, %p) changed. %d blocks invalidated.", pc, pc + len, invalidated_count);
+}
+
+#define PREFIX_CS		0x2E
+#define PREFIX_SS		0x36
+#define PREFIX_DS		0x3E
+#define PREFIX_ES		0x26
+#define PREFIX_FS		0x64
+#define PREFIX_GS		0x65
+struct instruction_t
+{
+	uint8_t opcode;
+	uint8_t rep_prefix, segment_prefix;
+	uint8_t rex; /* 0 if not present, for VEX encoded instructions holds VEX.R/X/B/W */
+	bool opsize_prefix;
+	bool lock_prefix;
+	bool escape_0x0f;
+	uint8_t escape_byte2; /* 0x38 or 0x3A */
+	bool vex; /* Whether a VEX prefix is present */
+	int vex_map; /* Opcode map in VEX.mmmmm */
+	int vex_vvvv; /* Register in VEX.vvvv */
+	int vex_l; /* Vector length in VEX.L */
+	int vex_pp; /* Implied mandatory prefix in VEX.pp */
+	int r;
+	bool has_modrm;
+	struct modrm_rm_t rm;
+	int imm_bytes;
+	const struct instruction_desc *desc;
+};
+
+/* Find and return an unused register in an instruction, which can be used to hold temporary values */
+static int find_unused_register(struct instruction_t *ins)
+{
+	/* Calculate used registers in this instruction, implicit usages only tell the low 8 registers */
+	int used_regs = 0;
+	used_regs |= get_implicit_register_usage(ins->desc->op1, ins->opcode);
+	used_regs |= get_implicit_register_usage(ins->desc->op2, ins->opcode);
+	used_regs |= get_implicit_register_usage(ins->desc->op3, ins->opcode);
+	if ((ins->desc->handler_type & HANDLER_NORMAL) == HANDLER_NORMAL)
+	{
+		/* Additional register usage */
+		used_regs |= ins->desc->handler_type;
+	}
+	if (ins->rep_prefix)
+		used_regs |= REG_CX;
+	used_regs |= used_regs << 8;
+	if (ins->vex) /* Not necessarily a general register, but be conservative */
+		used_regs |= REG_MASK(ins->vex_vvvv);
+	if (ins->has_modrm)
+	{
+		if (ins->r != -1)
+			used_regs |= REG_MASK(ins->r);
+		if (ins->rm.base != -1)
+			used_regs |= REG_MASK(ins->rm.base);
+		if (ins->rm.index != -1)
+			used_regs |= REG_MASK(ins->rm.index);
+	}
+#define TEST_REG(r) do { if ((used_regs & REG_MASK(r)) == 0) return r; } while (0)
+	/* We really don't want to use rsp or rbp as a temporary register */
+	TEST_REG(RAX);
+	TEST_REG(RCX);
+	TEST_REG(RDX);
+	TEST_REG(RBX);
+	TEST_REG(RSI);
+	TEST_REG(RDI);
+	TEST_REG(R8);
+	TEST_REG(R9);
+	TEST_REG(R10);
+	TEST_REG(R11);
+#undef TEST_REG
+	log_error("find_unused_register: No usable register found. There must be a bug in our implementation.");
+	__debugbreak();
+	return 0;
+}
+
+/* Whether a RIP relative operand at target can be encoded in code generated around out */
+static bool dbt_rip_reachable(uint8_t *out, size_t target)
+{
+	int64_t distance = (int64_t)(target - (size_t)out);
+	return distance > INT32_MIN + 64 && distance < INT32_MAX - 64;
+}
+
+/* Parse a VEX prefix and the opcode following it, ins->opcode is the leading 0xC4 or 0xC5 byte
+ * VEX.R/X/B/W are translated to ins->rex so ModR/M parsing works unchanged.
+ */
+static void parse_vex(uint8_t **code, struct instruction_t *ins)
+{
+	if (ins->opsize_prefix || ins->rep_prefix || ins->lock_prefix || ins->rex)
+	{
+		log_error("Invalid prefix before VEX prefix.");
+		__debugbreak();
+	}
+	uint8_t byte1 = parse_byte(code), last;
+	if (ins->opcode == 0xC4)
+	{
+		/* 3 byte form: RXBmmmmm WvvvvLpp */
+		last = parse_byte(code);
+		ins->vex_map = byte1 & 0x1F;
+		ins->rex = 0x40 | ((last >> 4) & 8) | ((~byte1 >> 5) & 7);
+	}
+	else
+	{
+		/* 2 byte form: RvvvvLpp, implies 0F map */
+		last = byte1;
+		ins->vex_map = 1;
+		ins->rex = 0x40 | ((~byte1 >> 5) & 4);
+	}
+	ins->vex = true;
+	ins->vex_vvvv = (~last >> 3) & 15; /* Stored in 1's complement */
+	ins->vex_l = (last >> 2) & 1;
+	ins->vex_pp = last & 3;
+	ins->escape_0x0f = true;
+	ins->opcode = parse_byte(code);
+	switch (ins->vex_map)
+	{
+	case 1: ins->desc = &vex_inst_0x0F[ins->opcode]; break;
+	case 2: ins->escape_byte2 = 0x38; ins->desc = &vex_inst_0x0F38[ins->opcode]; break;
+	case 3: ins->escape_byte2 = 0x3A; ins->desc = &vex_inst_0x0F3A[ins->opcode]; break;
+	default:
+		log_error("Unknown VEX opcode map: %d", ins->vex_map);
+		__debugbreak();
+	}
+}
+
+/* Generate VEX prefix for the given instruction, operand registers could have changed so
+ * VEX.R/X/B are recomputed. The 2 byte form is used whenever possible.
+ */
+static void gen_vex(uint8_t **out, struct instruction_t *ins)
+{
+	int r = 0, x = 0, b = 0;
+	if (ins->has_modrm)
+	{
+		r = (ins->r >> 3) & 1;
+		if (ins->rm.index != -1)
+			x = (ins->rm.index >> 3) & 1;
+		if (ins->rm.base != -1)
+			b = (ins->rm.base >> 3) & 1;
+	}
+	int w = GET_REX_W(ins->rex);
+	uint8_t last = (w << 7) | ((~ins->vex_vvvv & 15) << 3) | (ins->vex_l << 2) | ins->vex_pp;
+	if (ins->vex_map == 1 && !x && !b && !w)
+	{
+		gen_byte(out, 0xC5);
+		gen_byte(out, (!r << 7) | last);
+	}
+	else
+	{
+		gen_byte(out, 0xC4);
+		gen_byte(out, (!r << 7) | (!x << 6) | (!b << 5) | ins->vex_map);
+		gen_byte(out, last);
+	}
+}
+
+static void dbt_copy_instruction(uint8_t **out, uint8_t **code, struct instruction_t *ins)
+{
+	uint8_t *imm_start = *code;
+	*code += ins->imm_bytes;
+	if (ins->lock_prefix)
+		gen_byte(out, 0xF0);
+	if (ins->opsize_prefix)
+		gen_byte(out, 0x66);
+	if (ins->rep_prefix)
+		gen_byte(out, ins->rep_prefix);
+	if (ins->segment_prefix && ins->segment_prefix != PREFIX_FS && ins->segment_prefix != PREFIX_GS)
+		gen_byte(out, ins->segment_prefix);
+	if (ins->vex)
+		gen_vex(out, ins);
+	else if (ins->has_modrm) /* Operand registers could have changed, recompute REX.R/X/B */
+		gen_rex(out, ins->rex != 0, GET_REX_W(ins->rex), ins->r, ins->rm);
+	else if (ins->rex)
+		gen_byte(out, ins->rex);
+	if (ins->escape_0x0f && !ins->vex)
+	{
+		gen_byte(out, 0x0f);
+		if (ins->escape_byte2)
+			gen_byte(out, ins->escape_byte2);
+	}
+	gen_byte(out, ins->opcode);
+	if (ins->has_modrm)
+	{
+		if (ins->rm.flags & MODRM_RIP_RELATIVE)
+		{
+			/* Rebase to the translated location, caller ensures it is reachable */
+			gen_modrm(out, 0, ins->r, 5);
+			gen_dword(out, (uint32_t)(ins->rm.target - ((size_t)*out + 4 + ins->imm_bytes)));
+		}
+		else
+			gen_modrm_sib(out, ins->r, ins->rm);
+	}
+	gen_copy(out, imm_start, ins->imm_bytes);
+}
+
+/* Copy an instruction whose memory operand needs a computed base address: an fs segment
+ * override, or a RIP relative operand out of reach of the code cache.
+ * The base is loaded into a temporary register which is saved in the scratch TLS slot.
+ */
+static void dbt_copy_instruction_temp_base(uint8_t **out, uint8_t **code, struct instruction_t *ins)
+{
+	int temp_reg;
+	bool spill = true;
+	if (ins->segment_prefix == PREFIX_FS && !ins->escape_0x0f && ins->opcode == 0x8B
+		&& ins->rm.base == -1 && ins->rm.index == -1 && !(ins->rm.flags & MODRM_RIP_RELATIVE))
+	{
+		/* mov r, fs:[disp], e.g. the stack protector: the destination can hold the base */
+		temp_reg = ins->r;
+		spill = false;
+	}
+	else
+		temp_reg = find_unused_register(ins);
+	if (spill)
+	{
+		/* mov gs:[scratch], temp_reg */
+		gen_gs_prefix(out);
+		gen_mov_rm_r_64(out, modrm_rm_disp(dbt_global->tls_scratch_offset), temp_reg);
+	}
+	if (ins->segment_prefix == PREFIX_FS)
+	{
+		if (ins->rm.flags & MODRM_RIP_RELATIVE)
+		{
+			log_error("RIP relative addressing with fs segment override not supported.");
+			__debugbreak();
+		}
+		/* mov temp_reg, gs:[fs_base] */
+		gen_gs_prefix(out);
+		gen_mov_r_rm_64(out, temp_reg, modrm_rm_disp(dbt_global->tls_fs_base_offset));
+		if (ins->rm.base != -1)
+		{
+			/* lea temp_reg, [temp_reg + rm.base], rsp can only be a base */
+			if (ins->rm.base == RSP)
+				gen_lea_64(out, temp_reg, modrm_rm_mscale(RSP, temp_reg, 0, 0));
+			else
+				gen_lea_64(out, temp_reg, modrm_rm_mscale(temp_reg, ins->rm.base, 0, 0));
+		}
+	}
+	else
+	{
+		/* mov temp_reg, target */
+		gen_mov_r_imm64(out, temp_reg, ins->rm.target);
+		ins->rm.flags = 0;
+		ins->rm.disp = 0;
+	}
+	ins->rm.base = temp_reg;
+	ins->segment_prefix = 0;
+	dbt_copy_instruction(out, code, ins);
+	if (spill)
+	{
+		/* mov temp_reg, gs:[scratch] */
+		gen_gs_prefix(out);
+		gen_mov_r_rm_64(out, temp_reg, modrm_rm_disp(dbt_global->tls_scratch_offset));
+	}
+}
+
+/* Push a 64-bit immediate without touching guest registers */
+static void dbt_gen_push_imm64(uint8_t **out, uint64_t imm)
+{
+	if ((int64_t)(int32_t)imm == (int64_t)imm)
+	{
+		/* push imm32, sign extended */
+		gen_push_imm32(out, (uint32_t)imm);
+		return;
+	}
+	/* lea rsp, [rsp - 8] */
+	gen_lea_64(out, RSP, modrm_rm_mreg(RSP, -8));
+	/* push rax */
+	gen_push_r(out, RAX);
+	/* mov rax, imm */
+	gen_mov_r_imm64(out, RAX, imm);
+	/* mov [rsp + 8], rax */
+	gen_mov_rm_r_64(out, modrm_rm_mreg(RSP, 8), RAX);
+	/* pop rax */
+	gen_pop_r(out, RAX);
+}
+
+/* Load the target of an indirect call or jump into rax
+ * rsp is adjust bytes below the guest stack pointer and the guest rax is saved at [rsp]
+ */
+static void dbt_gen_load_target(uint8_t **out, struct instruction_t *ins, int adjust)
+{
+	struct modrm_rm_t rm = ins->rm;
+	if (modrm_rm_is_r(rm))
+	{
+		if (rm.base == RSP) /* lea rax, [rsp + adjust] */
+			gen_lea_64(out, RAX, modrm_rm_mreg(RSP, adjust));
+		else if (rm.base != RAX) /* mov rax, r */
+			gen_mov_r_rm_64(out, RAX, rm);
+		return;
+	}
+	if (rm.base == RSP) /* rsp related address */
+		rm.disp += adjust;
+	if (ins->segment_prefix == PREFIX_FS)
+	{
+		if (rm.base == RAX || rm.index == RAX || (rm.base != -1 && rm.index != -1) || (rm.flags & MODRM_RIP_RELATIVE))
+		{
+			log_error("Unsupported fs segment override on indirect branch.");
+			__debugbreak();
+		}
+		/* mov rax, gs:[fs_base] */
+		gen_gs_prefix(out);
+		gen_mov_r_rm_64(out, RAX, modrm_rm_disp(dbt_global->tls_fs_base_offset));
+		if (rm.base == -1)
+			rm.base = RAX;
+		else
+		{
+			rm.index = RAX;
+			rm.scale = 0;
+		}
+	}
+	else if (rm.flags & MODRM_RIP_RELATIVE)
+	{
+		/* mov rax, target */
+		gen_mov_r_imm64(out, RAX, rm.target);
+		rm = modrm_rm_mreg(RAX, 0);
+	}
+	/* mov rax, r/m */
+	gen_mov_r_rm_64(out, RAX, rm);
+}
+
+static bool dbt_extend_trace(int *trace_exits, size_t block_pc, size_t current_pc, size_t dest)
+{
+	if (cmdline_flags->dbt_trace_all) /* Do not do any optimizations */
+		return false;
+	if (*trace_exits >= DBT_TRACE_MAX_EXITS)
+		return false;
+	if (dest <= current_pc || dest - block_pc >= DBT_TRACE_MAX_SPAN)
+		return false;
+	(*trace_exits)++;
+	return true;
+}
+
+static void dbt_log_opcode(struct instruction_t *ins)
+{
+	log_info("Opcode: 0x%02x", ins->opcode);
+	log_info("Escape_0F: %d", ins->escape_0x0f);
+	log_info("Escape byte2: 0x%02x", ins->escape_byte2);
+	log_info("REX: 0x%02x", ins->rex);
+	if (ins->vex)
+		log_info("VEX: map %d vvvv %d L %d pp %d", ins->vex_map, ins->vex_vvvv, ins->vex_l, ins->vex_pp);
+	log_info("R: %d", ins->r);
+	log_info("Lock: %d", ins->lock_prefix);
+	log_info("rep: %d", ins->rep_prefix);
+	log_info("segment: 0x%02x", ins->segment_prefix);
+}
+
+static uint8_t *dbt_syscall(size_t next_pc, size_t arg1, struct dbt_frame *frame);
+static uint8_t *dbt_cpuid_helper(size_t arg0, size_t resume_addr, struct dbt_frame *frame);
+
+/* Translate a new basic block at pc
+ * Translated code only enters C through dbt_helper_internal which saves x87 and SSE
+ * states, so unlike the i386 backend the translator is free to call Windows functions.
+ */
+static struct dbt_block *dbt_translate(size_t pc)
+{
+	struct dbt_block *block = alloc_block();
+	if (!block) /* The cache is full */
+	{
+		if (cmdline_flags->dbt_trace)
+			log_debug("dbt cache is full, flushing code cache... (current pc = %p)", pc);
+		dbt_flush();
+		block = alloc_block(); /* We won't fail again */
+	}
+	block->pc = pc;
+	block->start = (uint8_t *)ALIGN_TO(dbt->out, DBT_OUT_ALIGN);
+	dbt->translating_block = block;
+	btree_insert(&dbt->tree, block->pc, block);
+	btree_insert(&dbt->cache_tree, (size_t)block->start, block);
+
+	if (cmdline_flags->dbt_trace)
+		log_debug("dbt_translate: id: %d, pc: %p, translated pc: %p, end: %p", dbt->blocks_count, block->pc, block->start, dbt->end);
+
+	uint8_t *code = (uint8_t *)pc;
+	uint8_t *out = block->start;
+	int trace_exits = 0;
+	size_t last_ip = 0;
+	for (;;)
+	{
+		size_t current_ip = (size_t)code;
+		size_t prev_ip = last_ip;
+		last_ip = current_ip;
+		if (dbt->end - out < DBT_BLOCK_MAXSIZE)
+		{
+			/* No enough space for code generation, emit a temporary trampoline and give up */
+			size_t patch_addr = (size_t)out + 1;
+			gen_jmp(&out, dbt_get_direct_trampoline((size_t)code, patch_addr));
+			goto end_block;
+		}
+		if (current_ip + DBT_MAX_INSTRUCTION_SIZE > pc + DBT_TRACE_MAX_SPAN)
+		{
+			/* Keep the block within the span checked by dbt_invalidate_range() */
+			size_t patch_addr = (size_t)out + 1;
+			gen_jmp(&out, dbt_get_direct_trampoline((size_t)code, patch_addr));
+			goto end_block;
+		}
+		struct instruction_t ins;
+		ins.rep_prefix = 0;
+		ins.segment_prefix = 0;
+		ins.rex = 0;
+		ins.opsize_prefix = false;
+		ins.lock_prefix = false;
+		/* Handle prefixes. REX is only effective immediately before the opcode */
+		for (;;)
+		{
+			ins.opcode = parse_byte(&code);
+			if ((ins.opcode & 0xF0) == 0x40)
+			{
+				ins.rex = ins.opcode;
+				continue;
+			}
+			switch (ins.opcode)
+			{
+			case 0xF0: /* LOCK */
+				ins.lock_prefix = true;
+				break;
+
+			case 0xF2: /* REPNE/REPNZ */
+				ins.rep_prefix = 0xF2;
+				break;
+
+			case 0xF3: /* REP/REPE/REPZ */
+				ins.rep_prefix = 0xF3;
+				break;
+
+			case 0x2E: /* CS segment override, ignored in 64-bit mode */
+			case 0x36: /* SS segment override, ignored in 64-bit mode */
+			case 0x3E: /* DS segment override, ignored in 64-bit mode */
+			case 0x26: /* ES segment override, ignored in 64-bit mode */
+				ins.segment_prefix = ins.opcode;
+				break;
+
+			case 0x64: /* FS segment override */
+				ins.segment_prefix = 0x64;
+				break;
+
+			case 0x65: /* GS segment override */
+				log_error("GS segment override not supported.");
+				__debugbreak();
+				break;
+
+			case 0x66: /* Operand size prefix */
+				ins.opsize_prefix = true;
+				break;
+
+			case 0x67: /* Address size prefix */
+				log_error("Address size prefix not supported.");
+				__debugbreak();
+				break;
+
+			default:
+				goto done_prefix;
+			}
+			ins.rex = 0;
+		}
+
+done_prefix:
+
+		/* Extract instruction descriptor */
+		ins.escape_0x0f = false;
+		ins.escape_byte2 = 0;
+		ins.vex = false;
+		ins.has_modrm = false;
+
+		if (ins.opcode == 0xC4 || ins.opcode == 0xC5) /* LES and LDS are invalid in 64-bit mode */
+			parse_vex(&code, &ins);
+		else if (ins.opcode != 0x0F && (one_byte_decode[ins.opcode].flags & DECODE_DIRECT))
+		{
+			/* Fast path: most common one byte opcodes, use precomputed decoding information */
+			const struct instruction_decode *decode = &one_byte_decode[ins.opcode];
+			ins.desc = &one_byte_inst[ins.opcode];
+			if (decode->flags & DECODE_MODRM)
+			{
+				parse_modrm(&code, ins.rex, &ins.r, &ins.rm);
+				ins.has_modrm = true;
+			}
+			ins.imm_bytes = decode->imm_bytes[ins.opsize_prefix];
+			goto done_decode;
+		}
+		else if (ins.opcode == 0x0F)
+		{
+			ins.escape_0x0f = true;
+			ins.opcode = parse_byte(&code);
+			if (ins.opcode == 0x38)
+			{
+				ins.escape_byte2 = 0x38;
+				ins.opcode = parse_byte(&code);
+				ins.desc = &three_byte_inst_0x38[ins.opcode];
+			}
+			else if (ins.opcode == 0x3A)
+			{
+				ins.escape_byte2 = 0x3A;
+				ins.opcode = parse_byte(&code);
+				ins.desc = &three_byte_inst_0x3A[ins.opcode];
+			}
+			else
+				ins.desc = &two_byte_inst[ins.opcode];
+		}
+		else
+			ins.desc = &one_byte_inst[ins.opcode];
+
+		/* Follow extension tables */
+		while (ins.desc->type <= INST_TYPE_MAX)
+		{
+			switch (ins.desc->type)
+			{
+			case INST_TYPE_UNKNOWN: log_error("Unknown opcode."); dbt_log_opcode(&ins); __debugbreak(); break;
+			case INST_TYPE_INVALID: log_error("Invalid opcode."); dbt_log_opcode(&ins); __debugbreak(); break;
+			case INST_TYPE_UNSUPPORTED: log_error("Unsupported opcode."); dbt_log_opcode(&ins); __debugbreak(); break;
+
+			case INST_TYPE_MANDATORY:
+			{
+				if (!ins.escape_0x0f)
+				{
+					log_error("Invalid opcode.");
+					__debugbreak();
+				}
+				if (ins.vex) /* VEX.pp values match the table indices */
+					ins.desc = &ins.desc->extension_table[ins.vex_pp];
+				else if (ins.opsize_prefix)
+					ins.desc = &ins.desc->extension_table[MANDATORY_0x66];
+				else if (ins.rep_prefix == 0xF3)
+					ins.desc = &ins.desc->extension_table[MANDATORY_0xF3];
+				else if (ins.rep_prefix == 0xF2)
+					ins.desc = &ins.desc->extension_table[MANDATORY_0xF2];
+				else
+					ins.desc = &ins.desc->extension_table[MANDATORY_NONE];
+				break;
+			}
+
+			case INST_TYPE_EXTENSION:
+			{
+				if (!ins.has_modrm)
+				{
+					parse_modrm(&code, ins.rex, &ins.r, &ins.rm);
+					ins.has_modrm = true;
+				}
+				ins.desc = &ins.desc->extension_table[ins.r & 7];
+				break;
+			}
+
+			case INST_TYPE_MODRM_MOD:
+			{
+				if (!ins.has_modrm)
+				{
+					parse_modrm(&code, ins.rex, &ins.r, &ins.rm);
+					ins.has_modrm = true;
+				}
+				if (modrm_rm_is_r(ins.rm))
+					ins.desc = &ins.desc->extension_table[MODRM_MOD_R];
+				else
+					ins.desc = &ins.desc->extension_table[MODRM_MOD_M];
+				break;
+			}
+			}
+		}
+
+		/* ins.desc now points to the correct instruction description */
+		if (!ins.has_modrm)
+		{
+			/* Do we need modrm? */
+			if (FROM_MODRM(ins.desc->op1) || FROM_MODRM(ins.desc->op2) || FROM_MODRM(ins.desc->op3))
+			{
+				parse_modrm(&code, ins.rex, &ins.r, &ins.rm);
+				ins.has_modrm = true;
+			}
+		}
+
+		/* Calculate number of immediate bytes */
+		ins.imm_bytes = get_imm_bytes(ins.desc->op1, ins.opsize_prefix, false)
+			+ get_imm_bytes(ins.desc->op2, ins.opsize_prefix, false)
+			+ get_imm_bytes(ins.desc->op3, ins.opsize_prefix, false);
+
+done_decode:
+		/* mov r64, imm64 is the only instruction with a 64-bit immediate */
+		if (GET_REX_W(ins.rex) && ins.desc->op2 == IMM16_32_64)
+			ins.imm_bytes = 8;
+		if (ins.has_modrm && (ins.rm.flags & MODRM_RIP_RELATIVE))
+			ins.rm.target = (size_t)code + ins.imm_bytes + ins.rm.disp;
+
+		if (!cmdline_flags->dbt_trace_all && !ins.rep_prefix && !ins.lock_prefix
+			&& ((!ins.escape_0x0f && ins.opcode == 0x90 && !GET_REX_B(ins.rex)) || (ins.escape_0x0f && !ins.escape_byte2 && ins.opcode == 0x1F)))
+		{
+			/* Single and multi byte nop used as padding, drop it from the translation.
+			 * ModR/M of the multi byte form is already consumed above and it has no immediate. */
+			continue;
+		}
+
+		uint8_t handler_type = ins.desc->handler_type;
+		if ((handler_type & HANDLER_NORMAL) == HANDLER_NORMAL)
+			handler_type = HANDLER_NORMAL;
+
+		/* Translate instruction */
+		switch (handler_type)
+		{
+		case HANDLER_X87:
+		{
+			/* A very simplistic way to handle x87 escape opcode */
+			uint8_t modrm = *code; /* Peek potential ModR/M byte */
+			if (GET_MODRM_MOD(modrm) == 3) /* A non-operand opcode */
+			{
+				code++;
+				gen_byte(&out, ins.opcode);
+				gen_byte(&out, modrm);
+				break;
+			}
+			/* An escape opcode with ModR/M, properly parse ModR/M */
+			ins.has_modrm = true;
+			parse_modrm(&code, ins.rex, &ins.r, &ins.rm);
+			if (ins.rm.flags & MODRM_RIP_RELATIVE)
+				ins.rm.target = (size_t)code + ins.rm.disp;
+			/* Fall through */
+		}
+		case HANDLER_NORMAL:
+		{
+			if (ins.has_modrm && modrm_rm_is_m(ins.rm))
+			{
+				bool is_lea = !ins.escape_0x0f && ins.opcode == 0x8D;
+				if (ins.segment_prefix == PREFIX_FS && !is_lea)
+				{
+					/* Instruction with effective fs segment override */
+					dbt_copy_instruction_temp_base(&out, &code, &ins);
+					break;
+				}
+				if ((ins.rm.flags & MODRM_RIP_RELATIVE) && !dbt_rip_reachable(out, ins.rm.target))
+				{
+					if (is_lea)
+					{
+						/* lea r, [rip + disp] is a constant */
+						if (GET_REX_W(ins.rex))
+							gen_mov_r_imm64(&out, ins.r, ins.rm.target);
+						else
+							gen_mov_r_imm32(&out, ins.r, (uint32_t)ins.rm.target);
+					}
+					else
+						dbt_copy_instruction_temp_base(&out, &code, &ins);
+					break;
+				}
+			}
+			dbt_copy_instruction(&out, &code, &ins);
+			break;
+		}
+
+		case HANDLER_PRIVILEGED:
+		{
+			/* We have to support translate privileged opcodes because e.g. glibc uses HLT as
+			 * a backup program terminator. */
+			dbt_copy_instruction(&out, &code, &ins);
+			/* The instructions following it won't be executed and could be crap so we stop here */
+			goto end_block;
+		}
+
+		case HANDLER_MOV_MOFFSET:
+		{
+			/* The offset is always 64-bit, rewrite to the ModR/M form: mov r, r/m or mov r/m, r */
+			static const uint8_t modrm_opcode[4] = { 0x8A, 0x8B, 0x88, 0x89 };
+			size_t moffset = parse_qword(&code);
+			ins.opcode = modrm_opcode[ins.opcode - 0xA0];
+			ins.imm_bytes = 0;
+			ins.has_modrm = true;
+			ins.r = RAX;
+			if (ins.segment_prefix == PREFIX_FS)
+			{
+				ins.rm = modrm_rm_disp((int32_t)moffset);
+				dbt_copy_instruction_temp_base(&out, &code, &ins);
+				break;
+			}
+			ins.rm = modrm_rm_disp(0);
+			ins.rm.flags = MODRM_RIP_RELATIVE;
+			ins.rm.target = moffset;
+			if (dbt_rip_reachable(out, moffset))
+				dbt_copy_instruction(&out, &code, &ins);
+			else
+				dbt_copy_instruction_temp_base(&out, &code, &ins);
+			break;
+		}
+
+		case HANDLER_CALL_DIRECT:
+		{
+			int32_t rel = parse_rel(&code, ins.imm_bytes);
+			size_t dest = (size_t)code + rel;
+			dbt_gen_push_imm64(&out, (size_t)code);
+			size_t patch_addr = (size_t)out + 1;
+			gen_jmp(&out, dbt_get_direct_trampoline(dest, patch_addr));
+			goto end_block;
+		}
+
+		case HANDLER_CALL_INDIRECT:
+		{
+			/* lea rsp, [rsp - 136] */
+			gen_lea_64(&out, RSP, modrm_rm_mreg(RSP, -(DBT_RED_ZONE_SIZE + 8)));
+			/* push rax */
+			gen_push_r(&out, RAX);
+			/* mov rax, return address */
+			gen_mov_r_imm64(&out, RAX, (size_t)code);
+			/* mov [rsp + 136], rax */
+			gen_mov_rm_r_64(&out, modrm_rm_mreg(RSP, DBT_RED_ZONE_SIZE + 8), RAX);
+			/* mov rax, [rsp] */
+			gen_mov_r_rm_64(&out, RAX, modrm_rm_mreg(RSP, 0));
+			/* The operand is evaluated with the guest rsp before pushing the return address */
+			dbt_gen_load_target(&out, &ins, DBT_RED_ZONE_SIZE + 16);
+			gen_jmp(&out, dbt->sieve_dispatch_trampoline);
+			goto end_block;
+		}
+
+		case HANDLER_RET:
+		{
+			/* lea rsp, [rsp - 120] */
+			gen_lea_64(&out, RSP, modrm_rm_mreg(RSP, -(DBT_RED_ZONE_SIZE - 8)));
+			/* push rax */
+			gen_push_r(&out, RAX);
+			/* mov rax, [rsp + 128] */
+			gen_mov_r_rm_64(&out, RAX, modrm_rm_mreg(RSP, DBT_RED_ZONE_SIZE));
+			gen_jmp(&out, dbt->sieve_dispatch_trampoline);
+			goto end_block;
+		}
+
+		case HANDLER_RETN:
+		{
+			int count = parse_word(&code);
+			/* The return address could be overwritten when rsp is adjusted, stash it first */
+			/* lea rsp, [rsp - 128] */
+			gen_lea_64(&out, RSP, modrm_rm_mreg(RSP, -DBT_RED_ZONE_SIZE));
+			/* push rax */
+			gen_push_r(&out, RAX);
+			/* mov rax, [rsp + 136] */
+			gen_mov_r_rm_64(&out, RAX, modrm_rm_mreg(RSP, DBT_RED_ZONE_SIZE + 8));
+			/* mov gs:[scratch], rax */
+			gen_gs_prefix(&out);
+			gen_mov_rm_r_64(&out, modrm_rm_disp(dbt_global->tls_scratch_offset), RAX);
+			/* pop rax */
+			gen_pop_r(&out, RAX);
+			/* lea rsp, [rsp + 8 + count] */
+			gen_lea_64(&out, RSP, modrm_rm_mreg(RSP, 8 + count));
+			/* push rax */
+			gen_push_r(&out, RAX);
+			/* mov rax, gs:[scratch] */
+			gen_gs_prefix(&out);
+			gen_mov_r_rm_64(&out, RAX, modrm_rm_disp(dbt_global->tls_scratch_offset));
+			gen_jmp(&out, dbt->sieve_dispatch_trampoline);
+			goto end_block;
+		}
+
+		case HANDLER_JMP_DIRECT:
+		{
+			int32_t rel = parse_rel(&code, ins.imm_bytes);
+			size_t dest = (size_t)code + rel;
+			if (dbt_extend_trace(&trace_exits, pc, current_ip, dest))
+			{
+				/* Continue translation at jump target */
+				code = (uint8_t *)dest;
+				break;
+			}
+			size_t patch_addr = (size_t)out + 1;
+			gen_jmp(&out, dbt_get_direct_trampoline(dest, patch_addr));
+			goto end_block;
+		}
+
+		case HANDLER_JMP_INDIRECT:
+		{
+			/* lea rsp, [rsp - 128] */
+			gen_lea_64(&out, RSP, modrm_rm_mreg(RSP, -DBT_RED_ZONE_SIZE));
+			/* push rax */
+			gen_push_r(&out, RAX);
+			dbt_gen_load_target(&out, &ins, DBT_RED_ZONE_SIZE + 8);
+			gen_jmp(&out, dbt->sieve_dispatch_trampoline);
+			goto end_block;
+		}
+
+		case HANDLER_JCC:
+		{
+			int cond = ins.opcode & 0x0F;
+			int32_t rel = parse_rel(&code, ins.imm_bytes);
+			size_t dest0 = (size_t)code + rel; /* Branch taken */
+			size_t dest1 = (size_t)code; /* Branch not taken */
+			size_t patch_addr0 = (size_t)out + 2;
+			gen_jcc(&out, cond, (size_t)dbt_get_direct_trampoline(dest0, patch_addr0));
+			if (dbt_extend_trace(&trace_exits, pc, current_ip, dest1))
+				break; /* Branch taken is a side exit, continue translating fall through path */
+			size_t patch_addr1 = (size_t)out + 1;
+			gen_jmp(&out, dbt_get_direct_trampoline(dest1, patch_addr1));
+			goto end_block;
+		}
+
+		case HANDLER_JCC_REL8:
+		{
+			int32_t rel = parse_rel(&code, ins.imm_bytes);
+			size_t dest0 = (size_t)code + rel; /* Branch taken */
+			size_t dest1 = (size_t)code; /* Branch not taken */
+			/* LOOP, LOOPE, LOOPNE, JRCXZ */
+			/* op $+2 */
+			gen_byte(&out, ins.opcode);
+			gen_byte(&out, 2); /* sizeof(jmp rel8) */
+			/* jmp $+5 */
+			gen_byte(&out, 0xEB);
+			gen_byte(&out, 5); /* sizeof(jmp rel32) */
+			size_t patch_addr0 = (size_t)out + 1;
+			gen_jmp(&out, dbt_get_direct_trampoline(dest0, patch_addr0));
+			if (dbt_extend_trace(&trace_exits, pc, current_ip, dest1))
+				break; /* Continue translating fall through path */
+			size_t patch_addr1 = (size_t)out + 1;
+			gen_jmp(&out, dbt_get_direct_trampoline(dest1, patch_addr1));
+			goto end_block;
+		}
+
+		case HANDLER_SYSCALL:
+		{
+			if (!cmdline_flags->dbt_trace_all && prev_ip && current_ip - prev_ip == 5 && *(uint8_t *)prev_ip == 0xB8)
+			{
+				/* mov eax, imm32; syscall: the syscall number is known now */
+				void *handler = syscall_get_fast_handler(*(int32_t *)(prev_ip + 1));
+				if (handler)
+				{
+					/* Call the handler directly and continue in this block
+					 * syscall clobbers rcx and r11, they are free to use here */
+					/* lea rsp, [rsp - 128] */
+					gen_lea_64(&out, RSP, modrm_rm_mreg(RSP, -DBT_RED_ZONE_SIZE));
+					/* mov rcx, handler */
+					gen_mov_r_imm64(&out, RCX, (size_t)handler);
+					/* mov r11, dbt_syscall_fast_internal */
+					gen_mov_r_imm64(&out, R11, (size_t)&dbt_syscall_fast_internal);
+					/* call r11 */
+					gen_byte(&out, 0x41); gen_byte(&out, 0xFF); gen_byte(&out, 0xD3);
+					/* lea rsp, [rsp + 128] */
+					gen_lea_64(&out, RSP, modrm_rm_mreg(RSP, DBT_RED_ZONE_SIZE));
+					/* mov rcx, next_pc */
+					gen_mov_r_imm64(&out, RCX, (size_t)code);
+					break;
+				}
+			}
+			/* Hand over to dbt_syscall(), which continues at the next instruction */
+			dbt_gen_helper_call(&out, dbt_syscall, (size_t)code, 0);
+			goto end_block;
+		}
+
+		case HANDLER_CPUID:
+		{
+			struct dbt_helper_data *helper = dbt_gen_helper_call(&out, dbt_cpuid_helper, 0, 0);
+			helper->arg1 = (size_t)out; /* Resume after the argument block */
+			break;
+		}
+
+		case HANDLER_INT:
+		{
+			uint8_t id = parse_byte(&code);
+			log_error("INT 0x%x not supported on x86-64.", id);
+			__debugbreak();
+			break;
+		}
+
+		case HANDLER_MOV_FROM_SEG:
+		case HANDLER_MOV_TO_SEG:
+		{
+			log_error("Segment register move not supported on x86-64.");
+			__debugbreak();
+			break;
+		}
+		}
+		continue;
+
+	end_block:
+		break;
+	}
+	block->end_pc = (size_t)code;
+	block->size = (int)(out - block->start);
+	dbt->out = out;
+	dbt->translating_block = NULL;
+	mm_protect_code(block->pc, block->end_pc);
+	InterlockedIncrement(&dbt_global->stats.translations);
+	if (etw_enabled(ETW_KEYWORD_DBT))
+		etw_dbt_translate(block->pc, block->end_pc, block->size, false);
+	return block;
+}
+
+/* Patch all direct jumps waiting for a newly translated block */
+static void dbt_resolve_links(struct dbt_block *block)
+{
+	if (cmdline_flags->dbt_trace_all) /* Do not do any optimizations */
+		return;
+	struct dbt_link_map_entry *link = link_map_find(block->pc, false);
+	if (!link)
+		return;
+	for (struct dbt_helper_data *helper = link->head; helper; helper = *(struct dbt_helper_data **)(helper + 1))
+	{
+		size_t patch_addr = helper->arg1;
+		*(int32_t *)patch_addr = (int32_t)((size_t)block->start - (patch_addr + 4));
+		InterlockedIncrement(&dbt_global->stats.direct_patches);
+	}
+	link->head = NULL;
+}
+
+static uint8_t *dbt_find(size_t pc)
+{
+	dbt_check_code_changes();
+	struct dbt_block *block = find_block(pc);
+	if (block)
+	{
+		if (cmdline_flags->dbt_trace_all)
+			log_debug("dbt_find: block pc: %p, translated pc: %p, end: %p", block->pc, block->start, dbt->end);
+		return block->start;
+	}
+
+	/* Block not found, translate it now */
+	dbt->translating = true;
+	uint64_t start_cycles = __rdtsc();
+	block = dbt_translate(pc);
+	block_map_add(block);
+	dbt_resolve_links(block);
+	InterlockedExchangeAdd64(&dbt_global->stats.translate_cycles, __rdtsc() - start_cycles);
+	dbt_stats_update();
+	dbt->translating = false;
+	return block->start;
+}
+
+/* Called by the sieve fallback trampoline, the target is in the pc TLS slot */
+static uint8_t *dbt_find_next_sieve(size_t arg0, size_t arg1, struct dbt_frame *frame)
+{
+	size_t pc = __readgsqword(dbt_global->tls_pc_offset);
+	uint8_t *target = dbt_find(pc);
+	InterlockedIncrement(&dbt_global->stats.sieve_misses);
+	if (cmdline_flags->dbt_trace_all) /* Do not do any optimizations */
+		return target;
+	uint8_t *sieve = dbt_gen_sieve(pc, target);
+	/* Patch sieve table */
+	int hash = SIEVE_HASH(pc);
+	if (dbt->sieve_table[hash] == dbt->sieve_fallback_trampoline)
+		dbt->sieve_table[hash] = sieve;
+	else
+	{
+		uint8_t *current = dbt->sieve_table[hash];
+		for (;;)
+		{
+			int32_t next_bucket_rel = *(int32_t *)&current[DBT_SIEVE_NEXT_BUCKET_OFFSET];
+			uint8_t *next_bucket = current + DBT_SIEVE_NEXT_BUCKET_OFFSET + sizeof(int32_t) + next_bucket_rel;
+			if (next_bucket == dbt->sieve_fallback_trampoline)
+				break;
+			current = next_bucket;
+		}
+		*(int32_t *)&current[DBT_SIEVE_NEXT_BUCKET_OFFSET] = (int32_t)(sieve - (current + DBT_SIEVE_NEXT_BUCKET_OFFSET + sizeof(int32_t)));
+	}
+	return target;
+}
+
+/* Called by direct trampolines */
+static uint8_t *dbt_find_direct(size_t pc, size_t patch_addr, struct dbt_frame *frame)
+{
+	/* Translate or generate the block */
+	dbt_flushed = false;
+	uint8_t *block_start = dbt_find(pc);
+	if (!dbt_flushed && !cmdline_flags->dbt_trace_all)
+	{
+		/* Patch the jmp/jcc address so we don't need to repeat work again */
+		*(int32_t *)patch_addr = (int32_t)((size_t)block_start - (patch_addr + 4)); /* Relative address */
+		InterlockedIncrement(&dbt_global->stats.direct_patches);
+	}
+	return block_start;
+}
+
+static uint8_t *dbt_syscall(size_t next_pc, size_t arg1, struct dbt_frame *frame)
+{
+	CONTEXT context;
+	context.Rax = frame->rax;
+	context.Rcx = frame->rcx;
+	context.Rdx = frame->rdx;
+	context.Rbx = frame->rbx;
+	context.Rsp = DBT_FRAME_RSP(frame);
+	context.Rbp = frame->rbp;
+	context.Rsi = frame->rsi;
+	context.Rdi = frame->rdi;
+	context.R8 = frame->r8;
+	context.R9 = frame->r9;
+	context.R10 = frame->r10;
+	context.R11 = frame->r11;
+	context.R12 = frame->r12;
+	context.R13 = frame->r13;
+	context.R14 = frame->r14;
+	context.R15 = frame->r15;
+	context.Rip = next_pc;
+	context.EFlags = (DWORD)frame->rflags;
+	dispatch_syscall(&context);
+	frame->rax = context.Rax;
+	/* syscall saves the return address in rcx and rflags in r11 */
+	frame->rcx = next_pc;
+	frame->r11 = frame->rflags;
+	return dbt_find(next_pc);
+}
+
+static uint8_t *dbt_cpuid_helper(size_t arg0, size_t resume_addr, struct dbt_frame *frame)
+{
+	struct cpuid_t cpuid;
+	dbt_cpuid((int)frame->rax, (int)frame->rcx, &cpuid);
+	frame->rax = cpuid.eax;
+	frame->rbx = cpuid.ebx;
+	frame->rcx = cpuid.ecx;
+	frame->rdx = cpuid.edx;
+	return (uint8_t *)resume_addr;
+}
+
+void __declspec(noreturn) dbt_run(size_t pc, size_t sp)
+{
+	uint8_t *entrypoint = dbt_find(pc);
+	log_info("dbt: Calling into application code generated at %p, (original: pc: %p, sp: %p)", entrypoint, pc, sp);
+	goto_entrypoint((const char *)sp, entrypoint);
+}
+
+void __declspec(noreturn) dbt_restore_fork_context(struct syscall_context *ctx)
+{
+	log_error("dbt: fork() is not supported on x86-64.");
+	__debugbreak();
+	ExitProcess(1);
+}
+
+/* gs is not used by x86-64 guests */
+int dbt_get_gs()
+{
+	return 0;
+}
+
+void dbt_update_tls(int gs)
+{
+}
+
+void dbt_set_fs_base(size_t base)
+{
+	__writegsqword(dbt_global->tls_fs_base_offset, base);
+}
+
+size_t dbt_get_fs_base()
+{
+	return __readgsqword(dbt_global->tls_fs_base_offset);
+}
+
+void dbt_deliver_signal(void *teb, CONTEXT *context)
+{
+	log_error("dbt: Signal delivery is not supported on x86-64.");
+}
+
+void dbt_deliver_signal_current()
+{
+	log_error("dbt: Signal delivery is not supported on x86-64.");
+}
+
+void __declspec(noreturn) dbt_sigreturn(struct sigcontext *context)
+{
+	log_error("dbt: sigreturn() is not supported on x86-64.");
+	__debugbreak();
+	ExitProcess(1);
+}
@@ -0,0 +1,134 @@
+;
+; This file is part of Foreign Linux.
+;
+; Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+;
+; This program is free software: you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation, either version 3 of the License, or
+; (at your option) any later version.
+;
+; This program is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+;
+; You should have received a copy of the GNU General Public License
+; along with this program. If not, see <http://www.gnu.org/licenses/>.
+;
+
+.code
+
+; Calls from translated code into C, see dbt_gen_helper_call() in x64.c
+; On entry:
+;   rsp: guest stack pointer - 136, below the red zone
+;   [rsp]: guest rax
+;   rax: struct dbt_helper_data *
+; Calls fn(arg0, arg1, frame), where frame points to the saved guest registers.
+; fn returns the translated address to continue at.
+dbt_helper_internal PROC
+	; save context (struct dbt_frame)
+	push rcx
+	push rdx
+	push rbx
+	push rbp
+	push rsi
+	push rdi
+	push r8
+	push r9
+	push r10
+	push r11
+	push r12
+	push r13
+	push r14
+	push r15
+	pushfq
+	cld
+	mov rbx, rsp ; frame
+	and rsp, -16
+	sub rsp, 512
+	fxsave [rsp]
+	sub rsp, 32 ; shadow space
+	mov rcx, [rax + 16] ; arg0
+	mov rdx, [rax + 24] ; arg1
+	mov r8, rbx
+	call qword ptr [rax + 8]
+	add rsp, 32
+	fxrstor [rsp]
+	; restore context
+	mov rsp, rbx
+	popfq
+	pop r15
+	pop r14
+	pop r13
+	pop r12
+	pop r11
+	pop r10
+	pop r9
+	pop r8
+	pop rdi
+	pop rsi
+	pop rbp
+	pop rbx
+	pop rdx
+	pop rcx
+	; restore guest rax and jump to the returned address
+	xchg rax, [rsp]
+	ret 128
+dbt_helper_internal ENDP
+
+; Direct call of a syscall handler which does not need syscall context
+; On entry:
+;   rsp: guest stack pointer - 136, [rsp]: return address
+;   rcx: syscall handler
+;   rdi, rsi, rdx, r10, r8, r9: syscall arguments
+; Returns result in rax and guest rflags in r11, like syscall. rcx is clobbered.
+dbt_syscall_fast_internal PROC
+	push rbp
+	mov rbp, rsp
+	; save registers volatile in Windows ABI but preserved by Linux syscalls
+	push rdx
+	push r8
+	push r9
+	push r10
+	pushfq
+	cld
+	and rsp, -16
+	sub rsp, 96
+	movdqa [rsp], xmm0
+	movdqa [rsp + 16], xmm1
+	movdqa [rsp + 32], xmm2
+	movdqa [rsp + 48], xmm3
+	movdqa [rsp + 64], xmm4
+	movdqa [rsp + 80], xmm5
+	; shadow space and stack arguments
+	sub rsp, 64
+	mov [rsp + 32], r8
+	mov [rsp + 40], r9
+	mov qword ptr [rsp + 48], 0 ; context
+	mov rax, rcx
+	mov rcx, rdi
+	mov r9, r10
+	mov r8, rdx
+	mov rdx, rsi
+	call rax
+	add rsp, 64
+	movdqa xmm0, [rsp]
+	movdqa xmm1, [rsp + 16]
+	movdqa xmm2, [rsp + 32]
+	movdqa xmm3, [rsp + 48]
+	movdqa xmm4, [rsp + 64]
+	movdqa xmm5, [rsp + 80]
+	; restore context
+	lea rsp, [rbp - 40]
+	mov r11, [rsp]
+	popfq
+	pop r10
+	pop r9
+	pop r8
+	pop rdx
+	pop rbp
+	ret
+dbt_syscall_fast_internal ENDP
+
+END
@@ -17,21 +17,26 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_DBT
+
 #include <dbt/x86.h>
 #include <dbt/x86_inst.h>
-#include <lib/rbtree.h>
-#include <lib/slist.h>
+#include <lib/btree.h>
 #include <syscall/mm.h>
 #include <syscall/sig.h>
+#include <syscall/syscall_dispatch.h>
 #include <syscall/tls.h>
+#include <etw.h>
 #include <flags.h>
 #include <log.h>
+#include <str.h>
 
 #include <stdbool.h>
 #include <stdint.h>
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 #include <ntdll.h>
+#include <intrin.h>
 #include <immintrin.h>
 
 #define GET_MODRM_MOD(c)	(((c) >> 6) & 7)
@@ -442,44 +447,79 @@ static __forceinline void gen_jecxz_rel(uint8_t **out, int8_t rel)
 
 struct dbt_block
 {
-	struct slist list;
-	struct rb_node tree; /* RB tree organized by source address */
-	struct rb_node cache_tree; /* RB tree organized by translated code cache address */
 	size_t pc;
+	size_t end_pc; /* Upper bound of source address covered by this block (exclusive) */
 	uint8_t *start;
+	int size; /* Size of translated code */
+	/* Profiling counters, only updated with --dbt-profile */
+	uint32_t exec_count;
+	uint32_t sieve_miss_count;
+	/* Loop tiering, see DBT_HOT_THRESHOLD */
+	int32_t hot_count; /* Remaining taken loop back edges before retranslation */
+	bool hot; /* Retranslated as a hot loop */
 };
 
-static int tree_cmp(const struct rb_node *left, const struct rb_node *right)
-{
-	struct dbt_block *l = rb_entry(left, struct dbt_block, tree);
-	struct dbt_block *r = rb_entry(right, struct dbt_block, tree);
-	if (l->pc < r->pc)
-		return -1;
-	else if (l->pc > r->pc)
-		return 1;
-	else
-		return 0;
-}
-
-static int cache_tree_cmp(const struct rb_node *left, const struct rb_node *right)
-{
-	struct dbt_block *l = rb_entry(left, struct dbt_block, cache_tree);
-	struct dbt_block *r = rb_entry(right, struct dbt_block, cache_tree);
-	if (l->start < r->start)
-		return -1;
-	else if (l->start > r->start)
-		return 1;
-	else
-		return 0;
-}
-
 #define DBT_OUT_ALIGN			16
 #define DBT_TRAMPOLINE_ALIGN	32
-#define DBT_BLOCK_HASH_BUCKETS	4096
+#define DBT_BLOCK_MAP_INITIAL_SIZE	4096 /* Must be a power of 2 */
 #define DBT_BLOCK_MAXSIZE		1024 /* Maximum size of a translated basic block */
-#define DBT_BLOCKS_TABLE_SIZE	0x00800000U
-#define DBT_CACHE_SIZE			0x00800000U
-#define MAX_DBT_BLOCKS			(DBT_BLOCKS_TABLE_SIZE / sizeof(struct dbt_block))
+#define DBT_CACHE_SIZE			0x00800000U /* Default size of code cache and blocks table */
+#define DBT_THREAD_CACHE_SIZE	0x00200000U /* Initial code cache size of a thread */
+
+/* Superblock formation
+ * A translated block does not stop at unconditional forward direct jumps and the fall
+ * through path of conditional branches, the taken branches become side exits instead.
+ * The trace is only extended forward, so a block always covers [pc, end_pc). A block is cut
+ * with a jump before an instruction which may end beyond DBT_TRACE_MAX_SPAN bytes of the
+ * block's starting address, so code modification checks only need to look back a bounded
+ * distance.
+ */
+#define DBT_TRACE_MAX_EXITS		8 /* Maximum number of followed branches in a superblock */
+#define DBT_TRACE_MAX_SPAN		0x1000 /* Maximum source code span of a superblock */
+#define DBT_PRETRANSLATE_MAX_BLOCKS	16 /* Maximum number of blocks speculatively translated on a miss */
+#define DBT_PRETRANSLATE_MAX_LINKS	32 /* Maximum number of pending direct links recorded per block */
+#define DBT_MAX_INSTRUCTION_SIZE	15 /* Maximum length of an x86 instruction */
+#define DBT_PROFILE_REPORT_ENTRIES	32 /* Number of hottest blocks shown in profile report */
+
+/* Direct block chaining
+ * A direct branch to an already translated block jumps to it at translation time, this
+ * includes the block being translated itself, which covers most tight loops. Otherwise it
+ * jumps to a direct trampoline which translates the target on first execution. All
+ * trampolines waiting for the same target are chained in the link map, and when the target
+ * gets translated every one of their jumps is patched at once, not only the one executed.
+ */
+#define DBT_LINK_MAP_SIZE		4096 /* Must be a power of 2 */
+#define DBT_TRAMPOLINE_NEXT_OFFSET	16 /* Next trampoline with the same target, after the stub code */
+
+/* Hot loop tier
+ * A branch from a block back to its own start is a loop. In a normal block it goes through
+ * a hot trampoline counting the iterations, after DBT_HOT_THRESHOLD of them the block is
+ * retranslated as a hot loop and the old block is redirected to it. A hot block does not
+ * count anymore, has a larger side exit budget, and the loop body is unrolled by inverting
+ * the back edge branch and continuing translation at the loop head.
+ * The counting costs a pushfd/popfd pair per iteration, but only for DBT_HOT_THRESHOLD
+ * iterations of each loop.
+ */
+#define DBT_HOT_THRESHOLD		4096 /* Taken back edges before a block is retranslated */
+#define DBT_HOT_TRACE_MAX_EXITS	32 /* DBT_TRACE_MAX_EXITS of hot blocks */
+#define DBT_HOT_UNROLL			4 /* Copies of the loop body in a hot block */
+
+/* Cross thread code invalidation
+ * Every thread has its own code cache, but guest code pages are shared by all of them. A
+ * changed range is invalidated in the code cache of the calling thread at once, and is
+ * published in a process wide queue indexed by a generation counter. Other threads compare
+ * the generation they have seen whenever they enter the translator, which includes every
+ * full syscall and every miss of the direct, sieve and return dispatchers, and invalidate
+ * the ranges queued since. A thread falling more than DBT_CODE_CHANGE_QUEUE_SIZE ranges
+ * behind flushes its whole cache instead.
+ */
+#define DBT_CODE_CHANGE_QUEUE_SIZE	256 /* Must be a power of 2 */
+
+struct dbt_code_change
+{
+	size_t pc;
+	size_t len;
+};
 
 struct dbt_global_data
 {
@@ -492,6 +532,33 @@ struct dbt_global_data
 	int tls_kernel_esp_offset; /* saved kernel stack pointer */
 	int tls_esp_offset; /* saved user stack pointer */
 	int tls_eip_offset; /* saved instruction pointer */
+	/* Maximum code cache sizes, can be tuned by --dbt-cache-size */
+	size_t cache_size;
+	size_t blocks_table_size;
+	int max_blocks;
+	/* Initial code cache size of threads other than the main thread */
+	size_t thread_cache_size;
+	/* Whether xsaveopt is usable for saving SIMD state */
+	bool use_xsaveopt;
+	/* Recently changed code ranges, see dbt_code_changed() */
+	SRWLOCK code_change_lock;
+	volatile long code_change_generation; /* Number of ranges ever published */
+	struct dbt_code_change code_changes[DBT_CODE_CHANGE_QUEUE_SIZE];
+	/* Process wide statistics, shown in /proc/[pid]/flinux/dbt */
+	struct
+	{
+		volatile long threads;
+		volatile long blocks; /* Blocks currently in all code caches */
+		volatile long cache_used; /* Bytes currently used in all code caches */
+		volatile long translations;
+		volatile long flushes;
+		volatile long invalidations;
+		volatile long sieve_misses;
+		volatile long ibtc_misses;
+		volatile long direct_patches;
+		volatile long hot_translations;
+		volatile LONG64 translate_cycles;
+	} stats;
 } static _dbt_global;
 
 static struct dbt_global_data *const dbt_global = &_dbt_global;
@@ -501,14 +568,60 @@ static struct dbt_global_data *const dbt_global = &_dbt_global;
 #define SIEVE_HASH(x)				((x) & 0xFFFF)
 #define DBT_RETURN_CACHE_ENTRIES	65536
 #define RETURN_CACHE_HASH(x)		((x) & 0xFFFF)
+#define DBT_SHADOW_STACK_SIZE		0x10000 /* In bytes, indexed by a 16-bit offset so it wraps without touching flags */
+/* Per thread dbt data
+ * Every thread owns a private code cache. Sharing translations among threads is not
+ * supported yet for two reasons:
+ * 1. Translated code refers to return_cache slots and the sieve dispatch trampolines of
+ *    the owning thread by absolute address.
+ * 2. dbt_flush() and dbt_invalidate_block() rewrite the cache in place, which is only safe
+ *    when no other thread can be executing inside it. A shared cache needs all threads to
+ *    be brought out of the code cache first.
+ * To keep many threads from exhausting the 32-bit address space, the code cache and blocks
+ * table of every thread, the main thread included, start at DBT_THREAD_CACHE_SIZE. Each time
+ * the cache fills up both are reallocated at double the size, until they reach
+ * dbt_global->cache_size, which is at most MAX_DBT_CACHE_SIZE megabytes.
+ */
+/* Open addressing hash map from source address to block, using linear probing */
+struct dbt_block_map_entry
+{
+	size_t pc; /* 0 for an empty slot */
+	struct dbt_block *block;
+};
+
+/* Open addressing hash map from target address to waiting direct trampolines
+ * Entries are never removed before a flush, a resolved target just has an empty chain */
+struct dbt_link_map_entry
+{
+	size_t target; /* 0 for an empty slot */
+	uint8_t *head; /* First waiting trampoline, NULL if none */
+};
+
+/* An unresolved direct branch waiting for speculative translation */
+struct dbt_pending_link
+{
+	size_t target;
+	size_t patch_addr;
+	size_t page_end; /* End of the pages of the source block, see dbt_collect_pending_links() */
+};
+
 struct dbt_data
 {
-	struct slist block_hash[DBT_BLOCK_HASH_BUCKETS];
+	struct dbt_block_map_entry *block_map;
+	int block_map_size;
+	int block_map_count;
+	struct dbt_link_map_entry *link_map;
+	int link_map_count;
 	struct dbt_block *blocks;
-	struct rb_tree tree;
-	struct rb_tree cache_tree;
+	struct btree tree; /* Blocks by source address */
+	struct btree cache_tree; /* Blocks by translated code cache address */
+	struct btree_node *free_nodes; /* Free list of tree nodes, linked by next */
 	int blocks_count;
+	int flush_count; /* Number of full flushes due to exhaustion or code change */
+	int invalidate_count; /* Number of blocks invalidated individually */
 	uint8_t *code_cache;
+	size_t cache_size; /* Current size of code_cache and blocks */
+	int max_blocks;
 	uint8_t *internal_trampoline_end;
 	uint8_t *out, *end;
 	/* Trampolines */
@@ -523,28 +636,68 @@ struct dbt_data
 	/* Return cache */
 	uint8_t **return_cache;
 	uint8_t *return_fallback_trampoline;
+	uint8_t *return_cache_dispatch_trampoline;
+	/* Shadow return stack */
+	uint8_t **shadow_stack;
+	uint16_t shadow_stack_top; /* Byte offset of the top entry */
+	/* Whether any translated code has the current gs base embedded */
+	bool gs_base_embedded;
+	/* Whether the gs base of this thread was seen changing under translated code
+	 * Translated code then loads it from fs:[gs_addr] instead of embedding it */
+	bool gs_base_dynamic;
+	/* Direct branch stubs generated by the last translated block */
+	struct dbt_pending_link pending_links[DBT_PRETRANSLATE_MAX_LINKS];
+	int pending_links_count;
+	/* End of source code a speculative translation may read, 0 if not speculating */
+	size_t speculate_end;
+	/* Whether the thread is inside the translator, read by the sampling profiler */
+	volatile bool translating;
+	/* Block currently generated by dbt_translate(), not yet in the block map */
+	struct dbt_block *translating_block;
+	/* Values of this thread last accounted in dbt_global->stats */
+	int stats_blocks;
+	int stats_cache_used;
+	/* Value of dbt_global->code_change_generation last processed by this thread */
+	long code_change_seen;
 	/* Information of current signal to be delivered */
 	bool signal_pending;
 	bool signal_need_fixup;
 };
 
 extern void dbt_find_direct_internal();
+extern void dbt_find_hot_internal();
 extern void dbt_find_indirect_internal();
 extern void dbt_sieve_fallback();
+extern void dbt_ibtc_fallback();
 
 extern void dbt_cpuid_internal();
+extern void dbt_mov_to_gs_internal();
+extern void dbt_mov_to_gs_nf_internal();
+extern void dbt_syscall_fast_internal();
 extern void syscall_handler();
 
-static __declspec(thread, align(16)) char dbt_simd_state[512];
+/* Save area for x87 and SSE states: legacy fxsave region followed by xsave header.
+ * C code only touches these, AVX upper halves are left alone by legacy SSE instructions.
+ * When available, xsaveopt skips components which are in initial state or unmodified
+ * since the last restore from the same area.
+ */
+#define DBT_SIMD_STATE_MASK		3 /* x87 | SSE */
+static __declspec(thread, align(64)) char dbt_simd_state[576];
 
 static void dbt_save_simd_state()
 {
-	_fxsave(dbt_simd_state);
+	if (dbt_global->use_xsaveopt)
+		_xsaveopt(dbt_simd_state, DBT_SIMD_STATE_MASK);
+	else
+		_fxsave(dbt_simd_state);
 }
 
 static void dbt_restore_simd_state()
 {
-	_fxrstor(dbt_simd_state);
+	if (dbt_global->use_xsaveopt)
+		_xrstor(dbt_simd_state, DBT_SIMD_STATE_MASK);
+	else
+		_fxrstor(dbt_simd_state);
 }
 
 static __declspec(thread) struct dbt_data *dbt;
@@ -554,6 +707,36 @@ static __declspec(thread) struct dbt_data *dbt;
  */
 static __declspec(thread) bool dbt_flushed;
 
+/* Tree nodes are allocated from per thread chunks, not kmalloc() which could clobber SIMD registers */
+#define DBT_TREE_NODE_CHUNK_SIZE	65536
+static struct btree_node *dbt_alloc_tree_node()
+{
+	if (!dbt->free_nodes)
+	{
+		struct btree_node *chunk = VirtualAlloc(NULL, DBT_TREE_NODE_CHUNK_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_READWRITE);
+		if (!chunk)
+		{
+			dbt_save_simd_state();
+			log_error("VirtualAlloc() for dbt tree nodes failed.");
+			__debugbreak();
+		}
+		for (int i = 0; i < DBT_TREE_NODE_CHUNK_SIZE / sizeof(struct btree_node); i++)
+		{
+			chunk[i].next = dbt->free_nodes;
+			dbt->free_nodes = &chunk[i];
+		}
+	}
+	struct btree_node *node = dbt->free_nodes;
+	dbt->free_nodes = node->next;
+	return node;
+}
+
+static void dbt_free_tree_node(struct btree_node *node)
+{
+	node->next = dbt->free_nodes;
+	dbt->free_nodes = node;
+}
+
 /* We use a return trampoline for returning to user code from kernel code
  * The return address is stored in TLS and set up in kernel code
  * This enables us to do efficient return address patching on receipt of signals
@@ -633,6 +816,37 @@ static void dbt_gen_restore_fork_trampoline()
 	dbt->out = out;
 }
 
+int dbt_sample_thread(HANDLE thread, const CONTEXT *context, size_t *pc)
+{
+	THREAD_BASIC_INFORMATION info;
+	NtQueryInformationThread(thread, ThreadBasicInformation, &info, sizeof(info), NULL);
+	struct dbt_data *dbt = *(struct dbt_data **)((uint8_t*)info.TebBaseAddress + dbt_global->tls_dbt_offset);
+	*pc = 0;
+	if (!dbt)
+		return DBT_SAMPLE_KERNEL;
+	uint8_t *eip = (uint8_t *)context->Eip;
+	if (eip >= dbt->internal_trampoline_end && eip < dbt->out)
+	{
+		/* Inside translated code, the thread cannot be modifying its block trees now */
+		struct btree_iter iter;
+		if (btree_upper_bound(&dbt->cache_tree, (size_t)eip, &iter))
+			*pc = ((struct dbt_block *)btree_iter_value(&iter))->pc;
+		return DBT_SAMPLE_TRANSLATED;
+	}
+	if (eip >= dbt->code_cache && eip < dbt->code_cache + dbt->cache_size)
+		return DBT_SAMPLE_DISPATCH;
+	if (dbt->translating)
+		return DBT_SAMPLE_TRANSLATOR;
+	return DBT_SAMPLE_KERNEL;
+}
+
+void dbt_deliver_signal_current()
+{
+	dbt->signal_need_fixup = false;
+	dbt->signal_pending = true;
+	__writefsdword(dbt_global->tls_return_addr_offset, (DWORD)dbt->signal_trampoline);
+}
+
 static void dbt_setup_signal_handler(struct syscall_context *context);
 static void dbt_gen_signal_trampoline()
 {
@@ -737,17 +951,21 @@ static void dbt_gen_sieve_dispatch();
 static void dbt_gen_tables()
 {
 	/* Initialize block cache */
-	rb_init(&dbt->tree);
-	rb_init(&dbt->cache_tree);
+	btree_clear(&dbt->tree);
+	btree_clear(&dbt->cache_tree);
+	btree_init_allocator(&dbt->tree, dbt_alloc_tree_node, dbt_free_tree_node);
+	btree_init_allocator(&dbt->cache_tree, dbt_alloc_tree_node, dbt_free_tree_node);
 	dbt->blocks_count = 0;
 	dbt->out = dbt->code_cache;
-	dbt->end = dbt->code_cache + DBT_CACHE_SIZE;
+	dbt->end = dbt->code_cache + dbt->cache_size;
 
 	/* Allocate ancillary data structure */
 	dbt->sieve_table = (uint8_t**)dbt->out;
 	dbt->out += sizeof(uint8_t*) * DBT_SIEVE_ENTRIES;
 	dbt->return_cache = (uint8_t**)dbt->out;
 	dbt->out += sizeof(uint8_t*) * DBT_RETURN_CACHE_ENTRIES;
+	dbt->shadow_stack = (uint8_t**)dbt->out;
+	dbt->out += DBT_SHADOW_STACK_SIZE;
 
 	/* Trampolines */
 	dbt_gen_run_trampoline();
@@ -758,17 +976,55 @@ static void dbt_gen_tables()
 	dbt_gen_sieve_dispatch();
 	for (int i = 0; i < DBT_RETURN_CACHE_ENTRIES; i++)
 		dbt->return_cache[i] = dbt->return_fallback_trampoline;
+	/* Empty shadow stack entries fall back to return cache */
+	for (int i = 0; i < DBT_SHADOW_STACK_SIZE / sizeof(uint8_t*); i++)
+		dbt->shadow_stack[i] = dbt->return_cache_dispatch_trampoline;
+	dbt->shadow_stack_top = 0;
+	dbt->gs_base_embedded = false;
 }
 
-void dbt_init_thread()
+/* Allocate code cache and blocks table of the given size */
+static bool dbt_alloc_cache(size_t cache_size)
+{
+	size_t blocks_table_size = cache_size;
+	uint8_t *code_cache;
+	struct dbt_block *blocks;
+	if (!(blocks = VirtualAlloc(NULL, blocks_table_size, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_READWRITE)))
+		return false;
+	if (!(code_cache = VirtualAlloc(NULL, cache_size, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_EXECUTE_READWRITE)))
+	{
+		VirtualFree(blocks, 0, MEM_RELEASE);
+		return false;
+	}
+	dbt->blocks = blocks;
+	dbt->code_cache = code_cache;
+	dbt->cache_size = cache_size;
+	dbt->max_blocks = (int)(blocks_table_size / sizeof(struct dbt_block));
+	return true;
+}
+
+static void dbt_init_thread_cache(size_t cache_size)
 {
 	dbt = VirtualAlloc(NULL, sizeof(struct dbt_data), MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_READWRITE);
-	if (!(dbt->blocks = VirtualAlloc(NULL, DBT_BLOCKS_TABLE_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_READWRITE)))
-		log_error("VirtualAlloc() for dbt_blocks failed.");
-	if (!(dbt->code_cache = VirtualAlloc(NULL, DBT_CACHE_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_EXECUTE_READWRITE)))
+	dbt->block_map_size = DBT_BLOCK_MAP_INITIAL_SIZE;
+	if (!(dbt->block_map = VirtualAlloc(NULL, sizeof(struct dbt_block_map_entry) * DBT_BLOCK_MAP_INITIAL_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_READWRITE)))
+		log_error("VirtualAlloc() for dbt_block_map failed.");
+	if (!(dbt->link_map = VirtualAlloc(NULL, sizeof(struct dbt_link_map_entry) * DBT_LINK_MAP_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_READWRITE)))
+		log_error("VirtualAlloc() for dbt_link_map failed.");
+	if (!dbt_alloc_cache(cache_size))
 		log_error("VirtualAlloc() for dbt_cache failed.");
 	dbt_gen_tables();
+	dbt->gs_base_dynamic = false;
+	AcquireSRWLockShared(&dbt_global->code_change_lock);
+	dbt->code_change_seen = dbt_global->code_change_generation;
+	ReleaseSRWLockShared(&dbt_global->code_change_lock);
 	__writefsdword(dbt_global->tls_dbt_offset, (DWORD)dbt);
+	InterlockedIncrement(&dbt_global->stats.threads);
+}
+
+void dbt_init_thread()
+{
+	dbt_init_thread_cache(dbt_global->thread_cache_size);
 }
 
 void dbt_init()
@@ -782,11 +1038,31 @@ void dbt_init()
 	dbt_global->tls_return_addr_offset = tls_kernel_entry_to_offset(TLS_ENTRY_RETURN_ADDR);
 	dbt_global->tls_kernel_esp_offset = tls_kernel_entry_to_offset(TLS_ENTRY_KERNEL_ESP);
 	dbt_global->tls_esp_offset = tls_kernel_entry_to_offset(TLS_ENTRY_ESP);
+	x86_inst_init();
+	/* Detect xsaveopt: CPUID.1:ECX.OSXSAVE[bit 27] and CPUID.(EAX=0DH,ECX=1):EAX[bit 0] */
+	int cpuid_info[4];
+	__cpuid(cpuid_info, 0);
+	int max_leaf = cpuid_info[0];
+	__cpuid(cpuid_info, 1);
+	dbt_global->use_xsaveopt = false;
+	if (max_leaf >= 0x0D && (cpuid_info[2] & (1 << 27)))
+	{
+		__cpuidex(cpuid_info, 0x0D, 1);
+		dbt_global->use_xsaveopt = (cpuid_info[0] & 1) != 0;
+	}
+	/* Initialize code cache sizes */
+	if (cmdline_flags->dbt_cache_size)
+		dbt_global->cache_size = (size_t)cmdline_flags->dbt_cache_size * 0x00100000U;
+	else
+		dbt_global->cache_size = DBT_CACHE_SIZE;
+	dbt_global->blocks_table_size = dbt_global->cache_size;
+	dbt_global->max_blocks = (int)(dbt_global->blocks_table_size / sizeof(struct dbt_block));
+	dbt_global->thread_cache_size = min(DBT_THREAD_CACHE_SIZE, dbt_global->cache_size);
 	/* Generate return trampoline */
 	void *buffer = VirtualAlloc(NULL, PAGE_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_EXECUTE_READWRITE);
 	dbt_gen_return_trampoline(buffer);
 	/* Initialize dbt thread local data for main thread */
-	dbt_init_thread();
+	dbt_init_thread_cache(dbt_global->thread_cache_size);
 	log_info("dbt subsystem initialized.");
 }
 
@@ -795,59 +1071,296 @@ void dbt_shutdown()
 	/* TODO */
 }
 
-static void dbt_flush()
+/* Account changes of the current thread's code cache usage in process wide statistics */
+static void dbt_stats_update()
 {
-	for (int i = 0; i < DBT_BLOCK_HASH_BUCKETS; i++)
-		slist_init(&dbt->block_hash[i]);
-	dbt_gen_tables();
-	dbt_flushed = true;
-	log_info("dbt code cache flushed.");
+	int cache_used = (int)((dbt->out - dbt->code_cache) + (dbt->code_cache + dbt->cache_size - dbt->end));
+	InterlockedExchangeAdd(&dbt_global->stats.blocks, dbt->blocks_count - dbt->stats_blocks);
+	InterlockedExchangeAdd(&dbt_global->stats.cache_used, cache_used - dbt->stats_cache_used);
+	dbt->stats_blocks = dbt->blocks_count;
+	dbt->stats_cache_used = cache_used;
 }
 
-void dbt_reset()
+void dbt_shutdown_thread()
+{
+	if (!dbt)
+		return;
+	InterlockedExchangeAdd(&dbt_global->stats.blocks, -dbt->stats_blocks);
+	InterlockedExchangeAdd(&dbt_global->stats.cache_used, -dbt->stats_cache_used);
+	InterlockedDecrement(&dbt_global->stats.threads);
+	dbt->stats_blocks = 0;
+	dbt->stats_cache_used = 0;
+}
+
+/* Sieve and return cache hits are resolved inside translated code and are not counted */
+int dbt_get_stats(char *buf)
+{
+	return ksprintf(buf,
+		"threads:          %d\n"
+		"blocks:           %d (max %d per thread)\n"
+		"cache_used:       %d bytes (%d bytes per thread)\n"
+		"translations:     %d\n"
+		"translate_cycles: %llu\n"
+		"flushes:          %d\n"
+		"invalidations:    %d\n"
+		"sieve_misses:     %d\n"
+		"ibtc_misses:      %d\n"
+		"direct_patches:   %d\n"
+		"hot_translations: %d\n",
+		dbt_global->stats.threads,
+		dbt_global->stats.blocks, dbt_global->max_blocks,
+		dbt_global->stats.cache_used, (int)dbt_global->cache_size,
+		dbt_global->stats.translations,
+		(uint64_t)dbt_global->stats.translate_cycles,
+		dbt_global->stats.flushes,
+		dbt_global->stats.invalidations,
+		dbt_global->stats.sieve_misses,
+		dbt_global->stats.ibtc_misses,
+		dbt_global->stats.direct_patches,
+		dbt_global->stats.hot_translations);
+}
+
+/* Log the hottest blocks of current thread, sorted by execution count */
+void dbt_profile_report()
+{
+	if (!dbt || !cmdline_flags->dbt_profile)
+		return;
+	struct dbt_block *top[DBT_PROFILE_REPORT_ENTRIES];
+	int top_count = 0;
+	uint64_t total = 0;
+	for (int i = 0; i < dbt->blocks_count; i++)
+	{
+		struct dbt_block *block = &dbt->blocks[i];
+		total += block->exec_count;
+		if (top_count == DBT_PROFILE_REPORT_ENTRIES && block->exec_count <= top[top_count - 1]->exec_count)
+			continue;
+		/* Insertion sort into top list */
+		int j = (top_count < DBT_PROFILE_REPORT_ENTRIES)? top_count++: top_count - 1;
+		for (; j > 0 && top[j - 1]->exec_count < block->exec_count; j--)
+			top[j] = top[j - 1];
+		top[j] = block;
+	}
+	log_info("dbt profile: %d blocks, %llu block executions.", dbt->blocks_count, total);
+	for (int i = 0; i < top_count; i++)
+		log_info("  pc: %p, hits: %u, size: %d, sieve misses: %u",
+			top[i]->pc, top[i]->exec_count, top[i]->size, top[i]->sieve_miss_count);
+}
+
+static void dbt_flush()
 {
-	dbt_flush();
+	/* Do not use memset() here, it could clobber SIMD registers */
+	for (int i = 0; i < dbt->block_map_size; i++)
+		dbt->block_map[i].pc = 0;
+	dbt->block_map_count = 0;
+	for (int i = 0; i < DBT_LINK_MAP_SIZE; i++)
+		dbt->link_map[i].target = 0;
+	dbt->link_map_count = 0;
+	dbt->flush_count++;
+	InterlockedIncrement(&dbt_global->stats.flushes);
+	dbt_save_simd_state();
+	if (etw_enabled(ETW_KEYWORD_DBT))
+		etw_dbt_flush(dbt->blocks_count, dbt->flush_count);
+	dbt_profile_report();
+	log_info("dbt code cache flushed. (blocks: %d, code: %d bytes, trampolines: %d bytes, flushes: %d)",
+		dbt->blocks_count, dbt->out - dbt->internal_trampoline_end, dbt->code_cache + dbt->cache_size - dbt->end,
+		dbt->flush_count);
+	dbt_restore_simd_state();
+	dbt_gen_tables();
+	dbt_stats_update();
+	dbt_flushed = true;
 }
 
-void dbt_code_changed(size_t pc, size_t len)
+/* Called after dbt_flush() when the cache was full, moves the thread to a larger cache
+ * Nothing may refer to the old cache afterwards: we only get here from the translator, which
+ * is entered by jumps and returns to translated code through dbt_return_trampoline */
+static void dbt_grow_cache()
 {
-	struct dbt_block probe;
-	probe.pc = pc;
-	struct rb_node *node = rb_lower_bound(&dbt->tree, &probe.tree, tree_cmp);
-	if (node == NULL) /* Nothing to do */
+	if (dbt->cache_size >= dbt_global->cache_size)
 		return;
-	struct dbt_block *block = rb_entry(node, struct dbt_block, tree);
-	if (block->pc <= pc + len)
+	struct dbt_block *old_blocks = dbt->blocks;
+	uint8_t *old_cache = dbt->code_cache;
+	if (!dbt_alloc_cache(min(dbt->cache_size * 2, dbt_global->cache_size)))
+		return;
+	VirtualFree(old_blocks, 0, MEM_RELEASE);
+	VirtualFree(old_cache, 0, MEM_RELEASE);
+	dbt_save_simd_state();
+	log_info("dbt code cache grown to %d bytes.", (int)dbt->cache_size);
+	dbt_restore_simd_state();
+	dbt_gen_tables();
+	dbt_stats_update();
+}
+
+static bool dbt_invalidate_block(struct dbt_block *block);
+
+/* Note on persisting translations
+ * It is tempting to save translated blocks of file backed executable mappings to disk
+ * and load them back on the next execve(). This does not work with the current code
+ * generator: translated code refers to per-thread data by absolute addresses (sieve table,
+ * return cache slots, trampolines allocated from the end of the code cache) and direct
+ * jumps between blocks are patched in place. A persistent cache requires the generator
+ * to emit these references as relocations against a fixed per-process layout first.
+ * Sharing translations between running processes of the same binary through a session wide
+ * mapping has the same problem, and even threads of one process cannot share a code cache:
+ * the embedded addresses differ for every thread. Such a region would need the relocated
+ * layout above, plus per-process patching of block links, which defeats read only mapping.
+ */
+void dbt_reset()
+{
+	/* Keep blocks inside executable file mappings the new image may map again, see mm_reset() */
+	int kept = 0;
+	size_t next_pc = 0;
+	struct btree_iter iter;
+	while (btree_lower_bound(&dbt->tree, next_pc, &iter))
+	{
+		struct dbt_block *block = (struct dbt_block *)btree_iter_value(&iter);
+		/* Invalidation removes the block from the tree, continue the search by key */
+		next_pc = block->pc + 1;
+		if (mm_is_code_retained(block->pc, block->end_pc))
+			kept++;
+		else if (!dbt_invalidate_block(block))
+		{
+			dbt_flush();
+			return;
+		}
+		else
+			dbt->invalidate_count++;
+	}
+	if (!kept)
 	{
-		/* Bad, cached code changed. Flush all code cache for safety. */
-		/* TODO: Take care of signal/thread safety */
-		log_info("DBT block at [%p, %p) changed. Code cache flushed.", pc, pc + len);
 		dbt_flush();
+		return;
 	}
+	/* The return address caches refer to the old image */
+	for (int i = 0; i < DBT_RETURN_CACHE_ENTRIES; i++)
+		dbt->return_cache[i] = dbt->return_fallback_trampoline;
+	for (int i = 0; i < DBT_SHADOW_STACK_SIZE / sizeof(uint8_t*); i++)
+		dbt->shadow_stack[i] = dbt->return_cache_dispatch_trampoline;
+	dbt->shadow_stack_top = 0;
+	log_info("dbt: %d blocks kept across execve().", kept);
 }
 
-static int hash_block_pc(size_t pc)
+static __forceinline int hash_block_pc(size_t pc)
 {
-	return (pc + (pc << 3) + (pc << 9)) % DBT_BLOCK_HASH_BUCKETS;
+	uint32_t h = (uint32_t)pc * 0x9E3779B1U;
+	return (int)(h ^ (h >> 15)) & (dbt->block_map_size - 1);
 }
 
 static struct dbt_block *alloc_block()
 {
-	if (dbt->blocks_count == MAX_DBT_BLOCKS || dbt->end - dbt->out < DBT_BLOCK_MAXSIZE)
+	if (dbt->blocks_count == dbt->max_blocks || dbt->end - dbt->out < DBT_BLOCK_MAXSIZE)
 		return NULL;
 	return &dbt->blocks[dbt->blocks_count++];
 }
 
 static struct dbt_block *find_block(size_t pc)
 {
-	int bucket = hash_block_pc(pc);
-	slist_iterate(&dbt->block_hash[bucket], prev, cur)
+	int mask = dbt->block_map_size - 1;
+	for (int i = hash_block_pc(pc);; i = (i + 1) & mask)
+	{
+		struct dbt_block_map_entry *entry = &dbt->block_map[i];
+		if (entry->pc == pc)
+			return entry->block;
+		if (entry->pc == 0)
+			return NULL;
+	}
+}
+
+static void block_map_add_unsafe(struct dbt_block *block)
+{
+	int mask = dbt->block_map_size - 1;
+	int i = hash_block_pc(block->pc);
+	while (dbt->block_map[i].pc)
+		i = (i + 1) & mask;
+	dbt->block_map[i].pc = block->pc;
+	dbt->block_map[i].block = block;
+	dbt->block_map_count++;
+}
+
+/* Double the size of the block map, return false on failure */
+static bool block_map_grow()
+{
+	struct dbt_block_map_entry *old_map = dbt->block_map;
+	int old_size = dbt->block_map_size;
+	dbt_save_simd_state();
+	struct dbt_block_map_entry *new_map = VirtualAlloc(NULL, sizeof(struct dbt_block_map_entry) * old_size * 2,
+		MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_READWRITE);
+	dbt_restore_simd_state();
+	if (!new_map)
+		return false;
+	dbt->block_map = new_map;
+	dbt->block_map_size = old_size * 2;
+	dbt->block_map_count = 0;
+	for (int i = 0; i < old_size; i++)
+		if (old_map[i].pc)
+			block_map_add_unsafe(old_map[i].block);
+	dbt_save_simd_state();
+	VirtualFree(old_map, 0, MEM_RELEASE);
+	dbt_restore_simd_state();
+	return true;
+}
+
+static void block_map_add(struct dbt_block *block)
+{
+	/* Keep load factor under 1/2 */
+	if ((dbt->block_map_count + 1) * 2 > dbt->block_map_size && !block_map_grow())
+	{
+		dbt_save_simd_state();
+		log_error("Growing dbt block map failed.");
+		dbt_restore_simd_state();
+		if (dbt->block_map_count + 1 == dbt->block_map_size)
+		{
+			log_error("dbt block map is full.");
+			__debugbreak();
+		}
+	}
+	block_map_add_unsafe(block);
+}
+
+static void block_map_remove(struct dbt_block *block)
+{
+	int mask = dbt->block_map_size - 1;
+	int i = hash_block_pc(block->pc);
+	while (dbt->block_map[i].pc != block->pc)
+	{
+		if (dbt->block_map[i].pc == 0)
+			return;
+		i = (i + 1) & mask;
+	}
+	/* Backward shift deletion: move following entries of the cluster to fill the hole */
+	for (int j = (i + 1) & mask; dbt->block_map[j].pc; j = (j + 1) & mask)
+	{
+		int k = hash_block_pc(dbt->block_map[j].pc);
+		/* Entry j can stay if its home slot k lies cyclically in (i, j] */
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		dbt->block_map[i] = dbt->block_map[j];
+		i = j;
+	}
+	dbt->block_map[i].pc = 0;
+	dbt->block_map_count--;
+}
+
+/* Find the link map entry of target, add an empty one if add is true and there is space */
+static struct dbt_link_map_entry *link_map_find(size_t target, bool add)
+{
+	int mask = DBT_LINK_MAP_SIZE - 1;
+	uint32_t h = (uint32_t)target * 0x9E3779B1U;
+	for (int i = (int)(h ^ (h >> 15)) & mask;; i = (i + 1) & mask)
 	{
-		struct dbt_block *block = slist_entry(cur, struct dbt_block, list);
-		if (block->pc == pc)
-			return block;
+		struct dbt_link_map_entry *entry = &dbt->link_map[i];
+		if (entry->target == target)
+			return entry;
+		if (entry->target == 0)
+		{
+			/* Keep load factor under 1/2, a missing entry only means lazy patching */
+			if (!add || (dbt->link_map_count + 1) * 2 > DBT_LINK_MAP_SIZE)
+				return NULL;
+			entry->target = target;
+			entry->head = NULL;
+			dbt->link_map_count++;
+			return entry;
+		}
 	}
-	return NULL;
 }
 
 static void dbt_gen_sieve_dispatch()
@@ -887,6 +1400,20 @@ static void dbt_gen_sieve_dispatch()
 
 	dbt->out = out;
 
+	out = (uint8_t*)ALIGN_TO(dbt->out, DBT_OUT_ALIGN);
+	dbt->return_cache_dispatch_trampoline = out;
+
+	/* Return address and original value of ECX should be pushed on the stack */
+	/* movzx ecx, word ptr [esp+4] (5 bytes) */
+	gen_byte(&out, 0x0F); gen_byte(&out, 0xB7); gen_byte(&out, 0x4C);
+	gen_byte(&out, 0x24); gen_byte(&out, 0x04);
+	/* jmp dword ptr [ecx*4+return_cache] (7 bytes) */
+	gen_byte(&out, 0xFF); gen_byte(&out, 0x24); gen_byte(&out, 0x8D);
+	gen_dword(&out, (uint32_t)dbt->return_cache);
+	/* Total: 12 bytes */
+
+	dbt->out = out;
+
 	/* Fill out sieve_table */
 	for (int i = 0; i < DBT_SIEVE_ENTRIES; i++)
 		dbt->sieve_table[i] = (uint8_t*)&dbt_sieve_fallback;
@@ -923,6 +1450,15 @@ static bool dbt_sieve_dispatch_fixup(struct syscall_context *context)
 		context->esp += 8;
 		return true;
 	}
+	/* Test return_cache_dispatch_trampoline */
+	if (context->eip >= (DWORD)dbt->return_cache_dispatch_trampoline &&
+		context->eip < (DWORD)dbt->return_cache_dispatch_trampoline + 12)
+	{
+		context->ecx = *(DWORD *)context->esp;
+		context->eip = *(DWORD *)(context->esp + 4);
+		context->esp += 8;
+		return true;
+	}
 	return false;
 }
 
@@ -980,10 +1516,102 @@ static bool dbt_sieve_fixup(struct syscall_context *context)
 		else if (offset == 18) /* Finish the jumping */
 		{
 			context->esp += 4;
-			context->eip = *(DWORD *)(t + 23);
+			context->eip = -*(DWORD *)(t + 6);
 		}
 		else if (offset == 22) /* Finish the jumping */
-			context->eip = *(DWORD *)(t + 23);
+			context->eip = -*(DWORD *)(t + 6);
+		return true;
+	}
+	return false;
+}
+
+/* Inline indirect branch target cache
+ * Each indirect jmp/call site gets its own stub, which has the same layout as a sieve
+ * stub thus shares the signature and the fixup code. The stub starts empty, the first
+ * miss calls dbt_ibtc_fallback() to fill in the target of the site; after then the
+ * call is patched to a jump to the sieve dispatcher for polymorphic sites.
+ */
+#define DBT_IBTC_PC_OFFSET			6
+#define DBT_IBTC_MISS_OFFSET		12
+#define DBT_IBTC_MATCH_OFFSET		17
+#define DBT_IBTC_TARGET_OFFSET		23
+static uint8_t *dbt_gen_ibtc()
+{
+	/* The destination address and original value of ECX should be pushed on the stack */
+	dbt->end -= DBT_TRAMPOLINE_ALIGN;
+	uint8_t *out = dbt->end;
+	/* mov ecx, dword ptr [esp + 4] (4 bytes) */
+	gen_byte(&out, 0x8B); gen_byte(&out, 0x4C); gen_byte(&out, 0x24);
+	gen_byte(&out, 0x04);
+	/* lea ecx, dword ptr [ecx - cached_pc] (6 bytes) */
+	gen_byte(&out, 0x8D); gen_byte(&out, 0x89);
+	gen_dword(&out, 0);
+	/* jecxz match (2 bytes) */
+	gen_byte(&out, 0xE3); gen_byte(&out, 0x05);
+	/* call dbt_ibtc_fallback (5 bytes) */
+	gen_call(&out, &dbt_ibtc_fallback);
+
+	/* match: */
+	/* pop ecx (1 byte) */
+	gen_byte(&out, 0x59);
+	/* lea esp, dword ptr [esp+4] (4 bytes) */
+	gen_byte(&out, 0x8D); gen_byte(&out, 0x64); gen_byte(&out, 0x24);
+	gen_byte(&out, 0x04);
+	/* jmp cached_target (5 bytes), nothing is cached yet */
+	gen_jmp(&out, NULL);
+
+	return dbt->end;
+}
+
+/* Generate a hot trampoline for a loop back edge of block, see DBT_HOT_THRESHOLD */
+static uint8_t *dbt_gen_hot_trampoline(struct dbt_block *block, size_t patch_addr)
+{
+	/* Caution: we must ensure that this stub fits in DBT_TRAMPOLINE_ALIGN(32) bytes */
+	dbt->end -= DBT_TRAMPOLINE_ALIGN;
+	uint8_t *out = dbt->end;
+	/* pushfd (1 byte) */
+	gen_pushfd(&out);
+	/* sub dword ptr [&block->hot_count], 1 (7 bytes) */
+	gen_byte(&out, 0x83);
+	gen_modrm_sib(&out, 5, modrm_rm_disp((int32_t)&block->hot_count));
+	gen_byte(&out, 1);
+	/* jz hot (2 bytes) */
+	gen_byte(&out, 0x74);
+	gen_byte(&out, 6); /* sizeof(popfd) + sizeof(jmp rel32) */
+	/* popfd (1 byte) */
+	gen_popfd(&out);
+	/* jmp block->start (5 bytes) */
+	gen_jmp(&out, block->start);
+	/* hot: popfd (1 byte) */
+	gen_popfd(&out);
+	/* push patch_addr (5 bytes) */
+	gen_byte(&out, 0x68);
+	gen_dword(&out, patch_addr);
+	/* push pc (5 bytes) */
+	gen_byte(&out, 0x68);
+	gen_dword(&out, block->pc);
+	/* jmp dbt_find_hot_internal (5 bytes) */
+	gen_jmp(&out, &dbt_find_hot_internal);
+	return dbt->end;
+}
+
+static bool dbt_hot_trampoline_fixup(struct syscall_context *context)
+{
+	DWORD t = context->eip & -DBT_TRAMPOLINE_ALIGN;
+	if (*(uint8_t *)t == 0x9C)
+	{
+		DWORD offset = context->eip - t;
+		/* The back edge is taken, finish jumping to the loop head */
+		if (offset == 1 || offset == 8 || offset == 10 || offset == 16) /* Flags are pushed */
+		{
+			context->eflags = *(DWORD *)context->esp;
+			context->esp += 4;
+		}
+		else if (offset == 22)
+			context->esp += 4;
+		else if (offset == 27)
+			context->esp += 8;
+		context->eip = *(DWORD *)(t + 23);
 		return true;
 	}
 	return false;
@@ -994,6 +1622,13 @@ static uint8_t *dbt_get_direct_trampoline(size_t target, size_t patch_addr)
 	struct dbt_block *cached_block = find_block(target);
 	if (cached_block)
 		return cached_block->start;
+	if (dbt->translating_block && dbt->translating_block->pc == target)
+	{
+		/* A loop back edge */
+		if (dbt->translating_block->hot || cmdline_flags->dbt_trace_all)
+			return dbt->translating_block->start;
+		return dbt_gen_hot_trampoline(dbt->translating_block, patch_addr);
+	}
 
 	/* Not found in cache, create a stub */
 	/* Caution: we must ensure that this stub fits in DBT_TRAMPOLINE_ALIGN(32) bytes */
@@ -1008,6 +1643,19 @@ static uint8_t *dbt_get_direct_trampoline(size_t target, size_t patch_addr)
 	/* jmp dbt_find_direct_internal (5 bytes) */
 	gen_jmp(&out, &dbt_find_direct_internal);
 
+	struct dbt_link_map_entry *link = link_map_find(target, true);
+	if (link)
+	{
+		*(uint8_t **)(dbt->end + DBT_TRAMPOLINE_NEXT_OFFSET) = link->head;
+		link->head = dbt->end;
+	}
+
+	if (cmdline_flags->dbt_pretranslate && dbt->pending_links_count < DBT_PRETRANSLATE_MAX_LINKS)
+	{
+		struct dbt_pending_link *link = &dbt->pending_links[dbt->pending_links_count++];
+		link->target = target;
+		link->patch_addr = patch_addr;
+	}
 	return dbt->end;
 }
 
@@ -1058,6 +1706,132 @@ static bool dbt_direct_call_trampoline_fixup(struct syscall_context *context)
 	return false;
 }
 
+/* Unlink a block whose source code has changed
+ * The block is removed from the lookup structures and its entry is overwritten with a
+ * jump to a direct trampoline, so existing patched jumps and sieve entries pointing to it
+ * go through dbt_find_direct() and get redirected to the retranslated block.
+ * The block is kept in cache_tree for context fixup.
+ * Return false if there is no space for the trampoline.
+ */
+static bool dbt_invalidate_block(struct dbt_block *block)
+{
+	if (dbt->end - dbt->out < DBT_BLOCK_MAXSIZE + DBT_TRAMPOLINE_ALIGN)
+		return false;
+	block_map_remove(block);
+	btree_remove(&dbt->tree, block->pc);
+	/* Blocks are DBT_OUT_ALIGN aligned and non-empty, so there is always space for the jmp */
+	uint8_t *out = block->start;
+	size_t patch_addr = (size_t)out + 1;
+	gen_jmp(&out, dbt_get_direct_trampoline(block->pc, patch_addr));
+	return true;
+}
+
+/* Invalidate translations of [pc, pc + len) in the code cache of the calling thread
+ * Returns the number of blocks invalidated, or -1 if the code cache is flushed instead.
+ * Nothing is logged, this is also called from the translator without saving SIMD state.
+ */
+static int dbt_invalidate_range(size_t pc, size_t len)
+{
+	/* A superblock could start at most DBT_TRACE_MAX_SPAN bytes before the changed range */
+	size_t probe = pc > DBT_TRACE_MAX_SPAN? pc - DBT_TRACE_MAX_SPAN: 0;
+	uint8_t *invalidated_start = NULL, *invalidated_end = NULL;
+	int invalidated_count = 0;
+	struct btree_iter iter;
+	while (btree_lower_bound(&dbt->tree, probe, &iter))
+	{
+		struct dbt_block *block = (struct dbt_block *)btree_iter_value(&iter);
+		if (block->pc > pc + len)
+			break;
+		/* Invalidation removes the block from the tree, continue the search by key */
+		probe = block->pc + 1;
+		if (block->end_pc < pc)
+			continue;
+		/* Translated code of the block ends at the start of the next block */
+		struct btree_iter next_cache_iter;
+		uint8_t *block_end = dbt->out;
+		if (btree_lower_bound(&dbt->cache_tree, (size_t)block->start + 1, &next_cache_iter))
+			block_end = ((struct dbt_block *)btree_iter_value(&next_cache_iter))->start;
+		if (!dbt_invalidate_block(block))
+		{
+			/* TODO: Take care of signal/thread safety */
+			dbt_flush();
+			return -1;
+		}
+		if (invalidated_start == NULL || block->start < invalidated_start)
+			invalidated_start = block->start;
+		if (block_end > invalidated_end)
+			invalidated_end = block_end;
+		invalidated_count++;
+		dbt->invalidate_count++;
+		InterlockedIncrement(&dbt_global->stats.invalidations);
+	}
+	if (invalidated_count == 0) /* Nothing to do */
+		return 0;
+	/* Return cache entries point to the middle of blocks, drop those inside invalidated blocks */
+	for (int i = 0; i < DBT_RETURN_CACHE_ENTRIES; i++)
+		if (dbt->return_cache[i] >= invalidated_start && dbt->return_cache[i] < invalidated_end)
+			dbt->return_cache[i] = dbt->return_fallback_trampoline;
+	for (int i = 0; i < DBT_SHADOW_STACK_SIZE / sizeof(uint8_t*); i++)
+		if (dbt->shadow_stack[i] >= invalidated_start && dbt->shadow_stack[i] < invalidated_end)
+			dbt->shadow_stack[i] = dbt->return_cache_dispatch_trampoline;
+	return invalidated_count;
+}
+
+/* Invalidate the ranges other threads published since this thread last looked
+ * The caller must hold code_change_lock, returns the number of ranges processed */
+static int dbt_process_code_changes_locked()
+{
+	long generation = dbt_global->code_change_generation;
+	int count = generation - dbt->code_change_seen;
+	if (count > DBT_CODE_CHANGE_QUEUE_SIZE)
+		dbt_flush();
+	else
+	{
+		for (long i = dbt->code_change_seen; i != generation; i++)
+		{
+			struct dbt_code_change *change = &dbt_global->code_changes[i & (DBT_CODE_CHANGE_QUEUE_SIZE - 1)];
+			if (dbt_invalidate_range(change->pc, change->len) < 0)
+				break;
+		}
+	}
+	dbt->code_change_seen = generation;
+	return count;
+}
+
+/* Called on translator entry, see DBT_CODE_CHANGE_QUEUE_SIZE */
+static __forceinline void dbt_check_code_changes()
+{
+	if (dbt->code_change_seen == dbt_global->code_change_generation)
+		return;
+	AcquireSRWLockShared(&dbt_global->code_change_lock);
+	int count = dbt_process_code_changes_locked();
+	ReleaseSRWLockShared(&dbt_global->code_change_lock);
+	if (count > 0)
+	{
+		dbt_save_simd_state();
+		log_info("dbt: %d code ranges changed by other threads processed.", count);
+		dbt_restore_simd_state();
+	}
+}
+
+void dbt_code_changed(size_t pc, size_t len)
+{
+	AcquireSRWLockExclusive(&dbt_global->code_change_lock);
+	/* Catch up first, so the range published here is the only one this thread has not seen */
+	dbt_process_code_changes_locked();
+	struct dbt_code_change *change = &dbt_global->code_changes[dbt_global->code_change_generation & (DBT_CODE_CHANGE_QUEUE_SIZE - 1)];
+	change->pc = pc;
+	change->len = len;
+	InterlockedIncrement(&dbt_global->code_change_generation);
+	dbt->code_change_seen = dbt_global->code_change_generation;
+	ReleaseSRWLockExclusive(&dbt_global->code_change_lock);
+	int invalidated_count = dbt_invalidate_range(pc, len);
+	if (invalidated_count < 0)
+		log_info("DBT block at [%p, %p) changed. Code cache flushed.", pc, pc + len);
+	else if (invalidated_count > 0)
+		log_info("DBT code at [%p, %p) changed. %d blocks invalidated.", pc, pc + len, invalidated_count);
+}
+
 #define PREFIX_CS		0x2E
 #define PREFIX_SS		0x36
 #define PREFIX_DS		0x3E
@@ -1072,6 +1846,10 @@ struct instruction_t
 	bool lock_prefix;
 	bool escape_0x0f;
 	uint8_t escape_byte2; /* 0x38 or 0x3A */
+	int vex_bytes; /* Length of VEX prefix, 0 if not present */
+	uint8_t vex[3]; /* Raw VEX prefix */
+	int vex_vvvv; /* Register in VEX.vvvv */
+	int vex_pp; /* Implied mandatory prefix in VEX.pp */
 	int r;
 	bool has_modrm;
 	struct modrm_rm_t rm;
@@ -1103,6 +1881,8 @@ static int find_unused_register(struct instruction_t *ins)
 	}
 	if (ins->rep_prefix)
 		used_regs |= REG_CX;
+	if (ins->vex_bytes) /* Not necessarily a general register, but be conservative */
+		used_regs |= REG_MASK(ins->vex_vvvv);
 #define TEST_REG(r) do { if ((used_regs & REG_MASK(r)) == 0) return r; } while (0)
 	/* We really don't want to use esp or ebp as a temporary register */
 	TEST_REG(EAX);
@@ -1133,22 +1913,147 @@ static void set_context_register(struct syscall_context *context, int reg, DWORD
 	}
 }
 
-static void dbt_copy_instruction(uint8_t **out, uint8_t **code, struct instruction_t *ins)
+/* Get the gs base address of the current thread for embedding into translated code */
+static size_t dbt_get_gs_base()
 {
-	uint8_t *imm_start = *code;
-	*code += ins->imm_bytes;
-	if (ins->lock_prefix)
-		gen_byte(out, 0xF0);
-	if (ins->opsize_prefix)
-		gen_byte(out, 0x66);
-	if (ins->rep_prefix)
-		gen_byte(out, ins->rep_prefix);
-	if (ins->segment_prefix && ins->segment_prefix != PREFIX_GS)
-		gen_byte(out, ins->segment_prefix);
-	if (ins->escape_0x0f)
-	{
-		gen_byte(out, 0x0f);
-		if (ins->escape_byte2)
+	dbt->gs_base_embedded = true;
+	return __readfsdword(dbt_global->tls_gs_addr_offset);
+}
+
+/* Test whether arithmetic flags are dead before executing the instruction at code, that is,
+ * the instruction overwrites all of them without reading any.
+ * Only common instructions are recognized, return false when unsure.
+ */
+static bool dbt_flags_dead(const uint8_t *code)
+{
+	uint8_t opcode = code[0];
+	if (opcode <= 0x3D && (opcode & 7) <= 5)
+	{
+		switch (opcode >> 3)
+		{
+		case 0: /* ADD */
+		case 1: /* OR */
+		case 4: /* AND */
+		case 5: /* SUB */
+		case 6: /* XOR */
+		case 7: /* CMP */
+			return true;
+		default: /* ADC, SBB read CF */
+			return false;
+		}
+	}
+	if (opcode == 0x84 || opcode == 0x85 || opcode == 0xA8 || opcode == 0xA9) /* TEST */
+		return true;
+	if (opcode == 0x80 || opcode == 0x81 || opcode == 0x83) /* Group 1 */
+	{
+		int r = GET_MODRM_R(code[1]);
+		return r != 2 && r != 3; /* ADC, SBB */
+	}
+	return false;
+}
+
+/* Test whether a register is dead before executing the instruction at code, that is,
+ * the instruction overwrites it without reading it.
+ * Only common instructions are recognized, return false when unsure.
+ */
+static bool dbt_register_dead(const uint8_t *code, int reg)
+{
+	uint8_t opcode = code[0];
+	if (opcode >= 0xB8 && opcode <= 0xBF) /* mov r32, imm32 */
+		return opcode - 0xB8 == reg;
+	if (opcode >= 0x58 && opcode <= 0x5F) /* pop r32 */
+		return opcode - 0x58 == reg && reg != ESP;
+	if (opcode == 0x8B || opcode == 0x8D) /* mov r32, r/m32; lea r32, m */
+	{
+		uint8_t modrm = code[1];
+		if (GET_MODRM_R(modrm) != reg)
+			return false;
+		int mod = GET_MODRM_MOD(modrm), rm = GET_MODRM_RM(modrm);
+		if (mod == 3)
+			return opcode == 0x8B && rm != reg;
+		if (rm == 4)
+		{
+			uint8_t sib = code[2];
+			int base = GET_SIB_BASE(sib), index = GET_SIB_INDEX(sib);
+			if (!(mod == 0 && base == 5) && base == reg)
+				return false;
+			if (index != 4 && index == reg)
+				return false;
+			return true;
+		}
+		if (mod == 0 && rm == 5) /* disp32 */
+			return true;
+		return rm != reg;
+	}
+	if (opcode == 0x29 || opcode == 0x2B || opcode == 0x31 || opcode == 0x33) /* sub r, r; xor r, r */
+	{
+		uint8_t modrm = code[1];
+		return GET_MODRM_MOD(modrm) == 3 && GET_MODRM_R(modrm) == reg && GET_MODRM_RM(modrm) == reg;
+	}
+	return false;
+}
+
+/* Parse a VEX prefix and the opcode following it, ins->opcode is the leading 0xC4 or 0xC5 byte
+ * In 32-bit mode they are LES and LDS unless the next byte has the top two bits set, which is
+ * an invalid register form ModR/M for these instructions.
+ */
+static void parse_vex(uint8_t **code, struct instruction_t *ins)
+{
+	if (ins->opsize_prefix || ins->rep_prefix || ins->lock_prefix)
+	{
+		log_error("Invalid prefix before VEX prefix.");
+		__debugbreak();
+	}
+	int map;
+	ins->vex[0] = ins->opcode;
+	ins->vex[1] = parse_byte(code);
+	if (ins->opcode == 0xC4)
+	{
+		/* 3 byte form: RXBmmmmm WvvvvLpp */
+		ins->vex[2] = parse_byte(code);
+		ins->vex_bytes = 3;
+		map = ins->vex[1] & 0x1F;
+	}
+	else
+	{
+		/* 2 byte form: RvvvvLpp, implies 0F map */
+		ins->vex_bytes = 2;
+		map = 1;
+	}
+	uint8_t last = ins->vex[ins->vex_bytes - 1];
+	ins->vex_vvvv = (~last >> 3) & 7; /* Stored in 1's complement, high bit is ignored in 32-bit mode */
+	ins->vex_pp = last & 3;
+	ins->escape_0x0f = true;
+	ins->opcode = parse_byte(code);
+	switch (map)
+	{
+	case 1: ins->desc = &vex_inst_0x0F[ins->opcode]; break;
+	case 2: ins->escape_byte2 = 0x38; ins->desc = &vex_inst_0x0F38[ins->opcode]; break;
+	case 3: ins->escape_byte2 = 0x3A; ins->desc = &vex_inst_0x0F3A[ins->opcode]; break;
+	default:
+		log_error("Unknown VEX opcode map: %d", map);
+		__debugbreak();
+	}
+}
+
+static void dbt_copy_instruction(uint8_t **out, uint8_t **code, struct instruction_t *ins)
+{
+	uint8_t *imm_start = *code;
+	*code += ins->imm_bytes;
+	if (ins->lock_prefix)
+		gen_byte(out, 0xF0);
+	if (ins->opsize_prefix)
+		gen_byte(out, 0x66);
+	if (ins->rep_prefix)
+		gen_byte(out, ins->rep_prefix);
+	if (ins->segment_prefix && ins->segment_prefix != PREFIX_GS)
+		gen_byte(out, ins->segment_prefix);
+	if (ins->vex_bytes) /* VEX.R/X/B are always 1 in 32-bit mode, the prefix can be reused as is */
+		gen_copy(out, ins->vex, ins->vex_bytes);
+	else if (ins->escape_0x0f)
+	{
+		gen_byte(out, 0x0f);
+		if (ins->escape_byte2)
 			gen_byte(out, ins->escape_byte2);
 	}
 	gen_byte(out, ins->opcode);
@@ -1157,38 +2062,66 @@ static void dbt_copy_instruction(uint8_t **out, uint8_t **code, struct instructi
 	gen_copy(out, imm_start, ins->imm_bytes);
 }
 
-static bool dbt_gen_push_gs_rm(uint8_t **out, int temp_reg, struct modrm_rm_t rm, DWORD current_ip, struct syscall_context *context)
+/* Load the gs base into temp_reg and add rm.base to it, used when the gs base is dynamic
+ * Returns true if context is inside the generated code, in which case it is rolled back
+ */
+static bool dbt_gen_gs_base(uint8_t **out, int temp_reg, bool spill, struct modrm_rm_t *rm, DWORD current_ip, struct syscall_context *context)
 {
-	if (context && context->eip == (DWORD)*out)
+	if (spill)
 	{
-		context->eip = current_ip;
-		return true;
+		/* mov fs:[scratch], temp_reg */
+		gen_fs_prefix(out);
+		gen_mov_rm_r_32(out, modrm_rm_disp(dbt_global->tls_scratch_offset), temp_reg);
 	}
-	/* mov fs:[scratch], temp_reg */
-	gen_fs_prefix(out);
-	gen_mov_rm_r_32(out, modrm_rm_disp(dbt_global->tls_scratch_offset), temp_reg);
-
 	/* mov temp_reg, fs:[gs_addr] */
 	gen_fs_prefix(out);
 	gen_mov_r_rm_32(out, temp_reg, modrm_rm_disp(dbt_global->tls_gs_addr_offset));
-
-	if (rm.base != -1)
+	if (rm->base != -1)
 	{
 		/* lea temp_reg, [temp_reg + rm.base] */
-		gen_lea(out, temp_reg, modrm_rm_mscale(temp_reg, rm.base, 0, 0));
+		gen_lea(out, temp_reg, modrm_rm_mscale(temp_reg, rm->base, 0, 0));
 	}
+	/* Replace rm.base with temp_reg */
+	rm->base = temp_reg;
 	if (context && context->eip <= (DWORD)*out)
 	{
+		/* The instruction is not yet executed, rollback */
+		if (spill)
+			set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
 		context->eip = current_ip;
-		set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
 		return true;
 	}
+	return false;
+}
 
-	/* Replace rm.base with temp_reg */
-	rm.base = temp_reg;
+/* Restore temp_reg after the instruction using the gs base generated by dbt_gen_gs_base()
+ * Returns true if context is inside the generated code, in which case it is committed
+ */
+static bool dbt_gen_gs_base_done(uint8_t **out, int temp_reg, bool spill, DWORD next_ip, struct syscall_context *context)
+{
+	if (context && context->eip == (DWORD)*out)
+	{
+		/* The instruction is already executed, commit */
+		if (spill)
+			set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
+		context->eip = next_ip;
+		return true;
+	}
+	if (spill)
+	{
+		/* mov temp_reg, fs:[scratch] */
+		gen_fs_prefix(out);
+		gen_mov_r_rm_32(out, temp_reg, modrm_rm_disp(dbt_global->tls_scratch_offset));
+	}
+	return false;
+}
 
+/* push gs:|rm| when the gs base is dynamic, returns true if context is inside the generated code */
+static bool dbt_gen_push_gs_rm(uint8_t **out, int temp_reg, struct modrm_rm_t rm, DWORD current_ip, struct syscall_context *context)
+{
+	if (dbt_gen_gs_base(out, temp_reg, true, &rm, current_ip, context))
+		return true;
 	gen_push_rm(out, rm);
-
 	/* mov temp_reg, fs:[scratch] */
 	gen_fs_prefix(out);
 	gen_mov_r_rm_32(out, temp_reg, modrm_rm_disp(dbt_global->tls_scratch_offset));
@@ -1199,10 +2132,47 @@ static bool dbt_gen_push_gs_rm(uint8_t **out, int temp_reg, struct modrm_rm_t rm
 		context->esp += 4;
 		return true;
 	}
-
 	return false;
 }
 
+/* Shadow return stack
+ * Translated calls push the address of their postamble on a per thread shadow stack, which
+ * translated returns pop and jump to. The postamble verifies the guest return address, so
+ * a stale prediction (longjmp(), stack switching) only costs a sieve lookup. Popped entries
+ * are reset to return_cache_dispatch_trampoline, which makes an underflowed or overwritten
+ * shadow stack fall back to return cache lookup.
+ */
+static size_t *dbt_gen_shadow_push(uint8_t **out, uint8_t **ecx_saved)
+{
+	/* mov fs:[scratch], ecx */
+	gen_fs_prefix(out);
+	gen_mov_rm_r_32(out, modrm_rm_disp(dbt_global->tls_scratch_offset), ECX);
+	*ecx_saved = *out;
+	/* movzx ecx, word ptr [shadow_stack_top] */
+	gen_movzx_r32_rm16(out, ECX, modrm_rm_disp((int32_t)&dbt->shadow_stack_top));
+	/* lea ecx, [ecx + 4] */
+	gen_lea(out, ECX, modrm_rm_mreg(ECX, sizeof(uint8_t*)));
+	/* mov word ptr [shadow_stack_top], cx */
+	gen_mov_rm_r_16(out, modrm_rm_disp((int32_t)&dbt->shadow_stack_top), ECX);
+	/* mov dword ptr [ecx + shadow_stack], translated return address (patched by caller) */
+	gen_mov_rm_imm32(out, modrm_rm_mreg(ECX, (int32_t)dbt->shadow_stack), 0);
+	size_t *entry_patch = (size_t*)(*out - 4);
+	/* mov ecx, fs:[scratch] */
+	gen_fs_prefix(out);
+	gen_mov_r_rm_32(out, ECX, modrm_rm_disp(dbt_global->tls_scratch_offset));
+	return entry_patch;
+}
+
+/* Rollback a call interrupted before the actual control transfer, a partially pushed
+ * shadow stack entry does no harm */
+static void dbt_rollback_call(struct syscall_context *context, uint8_t *ecx_saved, uint8_t *call_start, DWORD current_ip, int esp_adjust)
+{
+	if (ecx_saved && context->eip >= (DWORD)ecx_saved && context->eip < (DWORD)call_start)
+		context->ecx = __readfsdword(dbt_global->tls_scratch_offset);
+	context->esp += esp_adjust;
+	context->eip = current_ip;
+}
+
 static bool dbt_gen_call_postamble(uint8_t **out, size_t source_pc, struct syscall_context *context)
 {
 	/* stack: addr */
@@ -1210,7 +2180,7 @@ static bool dbt_gen_call_postamble(uint8_t **out, size_t source_pc, struct sysca
 	gen_mov_r_rm_32(out, ECX, modrm_rm_mreg(ESP, 4));
 	gen_lea(out, ECX, modrm_rm_mreg(ECX, -source_pc));
 	gen_jecxz_rel(out, 5);
-	gen_jmp(out, &dbt_sieve_fallback);
+	gen_jmp(out, dbt->return_fallback_trampoline);
 	if (context && context->eip <= (DWORD)*out)
 	{
 		context->eip = *(DWORD *)(context->esp + 4);
@@ -1240,16 +2210,26 @@ static bool dbt_gen_ret_trampoline(uint8_t **out, struct syscall_context *contex
 		return true;
 	}
 	gen_push_rm(out, modrm_rm_reg(ECX));
-	gen_movzx_r32_rm16(out, ECX, modrm_rm_mreg(ESP, 4));
+	/* movzx ecx, word ptr [shadow_stack_top] */
+	gen_movzx_r32_rm16(out, ECX, modrm_rm_disp((int32_t)&dbt->shadow_stack_top));
 	if (context && context->eip <= (DWORD)*out)
 	{
+		context->ecx = *(DWORD *)context->esp;
 		context->eip = *(DWORD *)(context->esp + 4);
 		context->esp += 8;
 		return true;
 	}
-	gen_push_rm(out, modrm_rm_mscale(-1, ECX, MODRM_SCALE_4, (int32_t)dbt->return_cache));
+	/* push dword ptr [ecx + shadow_stack] */
+	gen_push_rm(out, modrm_rm_mreg(ECX, (int32_t)dbt->shadow_stack));
+	/* mov dword ptr [ecx + shadow_stack], return_cache_dispatch_trampoline */
+	gen_mov_rm_imm32(out, modrm_rm_mreg(ECX, (int32_t)dbt->shadow_stack), (uint32_t)dbt->return_cache_dispatch_trampoline);
+	/* lea ecx, [ecx - 4] */
+	gen_lea(out, ECX, modrm_rm_mreg(ECX, -(int32_t)sizeof(uint8_t*)));
+	/* mov word ptr [shadow_stack_top], cx */
+	gen_mov_rm_r_16(out, modrm_rm_disp((int32_t)&dbt->shadow_stack_top), ECX);
 	if (context && context->eip <= (DWORD)*out)
 	{
+		context->ecx = *(DWORD *)(context->esp + 4);
 		context->eip = *(DWORD *)(context->esp + 8);
 		context->esp += 12;
 		return true;
@@ -1258,17 +2238,56 @@ static bool dbt_gen_ret_trampoline(uint8_t **out, struct syscall_context *contex
 	return false;
 }
 
+/* Test whether the current block can be extended to dest instead of jumping out.
+ * The decision only depends on the source code being translated, this is required
+ * as dbt_translate() must generate identical code when fixing up a context.
+ */
+static bool dbt_extend_trace(int *trace_exits, bool hot, size_t block_pc, size_t current_pc, size_t dest)
+{
+	if (cmdline_flags->dbt_trace_all) /* Do not do any optimizations */
+		return false;
+	if (*trace_exits >= (hot? DBT_HOT_TRACE_MAX_EXITS: DBT_TRACE_MAX_EXITS))
+		return false;
+	if (dest <= current_pc || dest - block_pc >= DBT_TRACE_MAX_SPAN)
+		return false;
+	(*trace_exits)++;
+	return true;
+}
+
+/* Test whether a hot block can unroll its loop once more at a back edge to dest */
+static bool dbt_unroll_loop(int *unroll_count, bool hot, size_t block_pc, size_t dest)
+{
+	if (!hot || dest != block_pc || *unroll_count >= DBT_HOT_UNROLL - 1)
+		return false;
+	(*unroll_count)++;
+	return true;
+}
+
 static void dbt_log_opcode(struct instruction_t *ins)
 {
 	log_info("Opcode: 0x%02x", ins->opcode);
 	log_info("Escape_0F: %d", ins->escape_0x0f);
 	log_info("Escape byte2: 0x%02x", ins->escape_byte2);
+	if (ins->vex_bytes)
+		log_info("VEX: 0x%02x 0x%02x 0x%02x", ins->vex[0], ins->vex[1], ins->vex_bytes == 3 ? ins->vex[2] : 0);
 	log_info("R: %d", ins->r);
 	log_info("Lock: %d", ins->lock_prefix);
 	log_info("rep: %d", ins->rep_prefix);
 	log_info("segment: 0x%02x", ins->segment_prefix);
 }
 
+/* Whether a decoded instruction can be translated without hitting an unsupported case */
+static bool dbt_speculation_supported(uint8_t handler_type, const struct instruction_t *ins, const uint8_t *code)
+{
+	switch (handler_type)
+	{
+	case HANDLER_INT: return *code == 0x80;
+	case HANDLER_MOV_FROM_SEG:
+	case HANDLER_MOV_TO_SEG: return ins->r == 5; /* GS */
+	default: return true;
+	}
+}
+
 /* CAUTION
  * We do not save x87/MMX/SSE/AVX states across a translation request
  * Thus we have to ensure these get unchanged during the translation
@@ -1280,7 +2299,7 @@ static void dbt_log_opcode(struct instruction_t *ins)
  * Otherwise, it translates a new basic block at pc and returns NULL
  * Caller ensures EIP is inside dbt code cache
  */
-static struct dbt_block *dbt_translate(size_t pc, struct syscall_context *context)
+static struct dbt_block *dbt_translate(size_t pc, bool hot, struct syscall_context *context)
 {
 	struct dbt_block *block;
 	if (context)
@@ -1295,20 +2314,21 @@ static struct dbt_block *dbt_translate(size_t pc, struct syscall_context *contex
 				return NULL;
 			if (dbt_direct_call_trampoline_fixup(context))
 				return NULL;
+			if (dbt_hot_trampoline_fixup(context))
+				return NULL;
 			log_error("Address %p: Unknown trampoline type.", pc);
 			__debugbreak();
 		}
 		/* Not in a trampoline */
-		struct dbt_block probe;
-		probe.start = (uint8_t *)context->eip;
-		struct rb_node *node = rb_upper_bound(&dbt->cache_tree, &probe.cache_tree, cache_tree_cmp);
-		if (node == NULL)
+		struct btree_iter iter;
+		if (!btree_upper_bound(&dbt->cache_tree, (size_t)context->eip, &iter))
 		{
 			log_error("Address %p: Block not found.", pc);
 			__debugbreak();
 		}
-		block = rb_entry(node, struct dbt_block, cache_tree);
+		block = (struct dbt_block *)btree_iter_value(&iter);
 		pc = block->pc;
+		hot = block->hot;
 	}
 	else
 	{
@@ -1322,12 +2342,19 @@ static struct dbt_block *dbt_translate(size_t pc, struct syscall_context *contex
 				dbt_restore_simd_state();
 			}
 			dbt_flush();
+			dbt_grow_cache();
 			block = alloc_block(); /* We won't fail again */
 		}
 		block->pc = pc;
 		block->start = (uint8_t *)ALIGN_TO(dbt->out, DBT_OUT_ALIGN);
-		rb_add(&dbt->tree, &block->tree, tree_cmp);
-		rb_add(&dbt->cache_tree, &block->cache_tree, cache_tree_cmp);
+		block->exec_count = 0;
+		block->sieve_miss_count = 0;
+		block->hot_count = DBT_HOT_THRESHOLD;
+		block->hot = hot;
+		dbt->pending_links_count = 0;
+		dbt->translating_block = block;
+		btree_insert(&dbt->tree, block->pc, block);
+		btree_insert(&dbt->cache_tree, (size_t)block->start, block);
 	}
 	
 	if (cmdline_flags->dbt_trace)
@@ -1339,9 +2366,36 @@ static struct dbt_block *dbt_translate(size_t pc, struct syscall_context *contex
 
 	uint8_t *code = (uint8_t *)pc;
 	uint8_t *out = block->start;
+	int trace_exits = 0;
+	int unroll_count = 0;
+	DWORD last_ip = 0; /* Source address of previous instruction */
+	if (cmdline_flags->dbt_profile)
+	{
+		/* Block entry counter */
+		gen_pushfd(&out);
+		if (context && context->eip == (DWORD)out)
+		{
+			context->esp += 4;
+			context->eip = pc;
+			goto end_block;
+		}
+		/* inc dword ptr [&block->exec_count] */
+		gen_byte(&out, 0xFF);
+		gen_modrm_sib(&out, 0, modrm_rm_disp((int32_t)&block->exec_count));
+		if (context && context->eip == (DWORD)out)
+		{
+			context->eflags = *(DWORD *)context->esp;
+			context->esp += 4;
+			context->eip = pc;
+			goto end_block;
+		}
+		gen_popfd(&out);
+	}
 	for (;;)
 	{
 		DWORD current_ip = (DWORD)code;
+		DWORD prev_ip = last_ip;
+		last_ip = current_ip;
 		if (context && context->eip == (DWORD)out)
 		{
 			/* The best case: we're at the begin of an instruction */
@@ -1355,6 +2409,16 @@ static struct dbt_block *dbt_translate(size_t pc, struct syscall_context *contex
 			gen_jmp(&out, dbt_get_direct_trampoline((size_t)code, patch_addr));
 			goto end_block;
 		}
+		if (current_ip + DBT_MAX_INSTRUCTION_SIZE > pc + DBT_TRACE_MAX_SPAN)
+		{
+			/* Keep the block within the span checked by dbt_invalidate_range() */
+			size_t patch_addr = (size_t)out + 1;
+			gen_jmp(&out, dbt_get_direct_trampoline((size_t)code, patch_addr));
+			goto end_block;
+		}
+		/* The instruction may extend to pages not known to be mapped */
+		if (dbt->speculate_end && current_ip + DBT_MAX_INSTRUCTION_SIZE > dbt->speculate_end)
+			goto end_speculation;
 		struct instruction_t ins;
 		ins.rep_prefix = 0;
 		ins.segment_prefix = 0;
@@ -1397,6 +2461,8 @@ static struct dbt_block *dbt_translate(size_t pc, struct syscall_context *contex
 				break;
 
 			case 0x64: /* FS segment override */
+				if (dbt->speculate_end)
+					goto end_speculation;
 				log_error("FS segment override not supported.");
 				__debugbreak();
 				break;
@@ -1410,6 +2476,8 @@ static struct dbt_block *dbt_translate(size_t pc, struct syscall_context *contex
 				break;
 
 			case 0x67: /* Address size prefix */
+				if (dbt->speculate_end)
+					goto end_speculation;
 				log_error("Address size prefix not supported.");
 				__debugbreak();
 				break;
@@ -1424,8 +2492,25 @@ done_prefix:
 		/* Extract instruction descriptor */
 		ins.escape_0x0f = false;
 		ins.escape_byte2 = 0;
+		ins.vex_bytes = 0;
+		ins.has_modrm = false;
 
-		if (ins.opcode == 0x0F)
+		if ((ins.opcode == 0xC4 || ins.opcode == 0xC5) && (*code & 0xC0) == 0xC0)
+			parse_vex(&code, &ins);
+		else if (ins.opcode != 0x0F && (one_byte_decode[ins.opcode].flags & DECODE_DIRECT))
+		{
+			/* Fast path: most common one byte opcodes, use precomputed decoding information */
+			const struct instruction_decode *decode = &one_byte_decode[ins.opcode];
+			ins.desc = &one_byte_inst[ins.opcode];
+			if (decode->flags & DECODE_MODRM)
+			{
+				parse_modrm(&code, &ins.r, &ins.rm);
+				ins.has_modrm = true;
+			}
+			ins.imm_bytes = decode->imm_bytes[ins.opsize_prefix];
+			goto done_decode;
+		}
+		else if (ins.opcode == 0x0F)
 		{
 			ins.escape_0x0f = true;
 			ins.opcode = parse_byte(&code);
@@ -1448,9 +2533,12 @@ done_prefix:
 			ins.desc = &one_byte_inst[ins.opcode];
 
 		/* Follow extension tables */
-		ins.has_modrm = false;
 		while (ins.desc->type <= INST_TYPE_MAX)
 		{
+			/* Speculation may hit data, do not complain about it */
+			if (dbt->speculate_end && (ins.desc->type <= INST_TYPE_INVALID
+				|| (ins.desc->type == INST_TYPE_MANDATORY && !ins.escape_0x0f)))
+				goto end_speculation;
 			switch (ins.desc->type)
 			{
 			case INST_TYPE_UNKNOWN: log_error("Unknown opcode."); dbt_log_opcode(&ins); __debugbreak(); break;
@@ -1464,7 +2552,9 @@ done_prefix:
 					log_error("Invalid opcode.");
 					__debugbreak();
 				}
-				if (ins.opsize_prefix)
+				if (ins.vex_bytes) /* VEX.pp values match the table indices */
+					ins.desc = &ins.desc->extension_table[ins.vex_pp];
+				else if (ins.opsize_prefix)
 					ins.desc = &ins.desc->extension_table[MANDATORY_0x66];
 				else if (ins.rep_prefix == 0xF3)
 					ins.desc = &ins.desc->extension_table[MANDATORY_0xF3];
@@ -1518,9 +2608,20 @@ done_prefix:
 			+ get_imm_bytes(ins.desc->op2, ins.opsize_prefix, false)
 			+ get_imm_bytes(ins.desc->op3, ins.opsize_prefix, false);
 
+done_decode:
+		if (!cmdline_flags->dbt_trace_all && !ins.rep_prefix && !ins.lock_prefix
+			&& ((!ins.escape_0x0f && ins.opcode == 0x90) || (ins.escape_0x0f && !ins.escape_byte2 && ins.opcode == 0x1F)))
+		{
+			/* Single and multi byte nop used as padding, drop it from the translation.
+			 * ModR/M of the multi byte form is already consumed above and it has no immediate. */
+			continue;
+		}
+
 		uint8_t handler_type = ins.desc->handler_type;
 		if ((handler_type & HANDLER_NORMAL) == HANDLER_NORMAL)
 			handler_type = HANDLER_NORMAL;
+		if (dbt->speculate_end && !dbt_speculation_supported(handler_type, &ins, code))
+			goto end_speculation;
 
 		/* Translate instruction */
 		switch (handler_type)
@@ -1548,45 +2649,23 @@ done_prefix:
 				&& !(!ins.escape_0x0f && ins.opcode == 0x8D)) /* LEA */
 			{
 				/* Instruction with effective gs segment override */
-				int temp_reg = find_unused_register(&ins);
-				/* mov fs:[scratch], temp_reg */
-				gen_fs_prefix(&out);
-				gen_mov_rm_r_32(&out, modrm_rm_disp(dbt_global->tls_scratch_offset), temp_reg);
-
-				/* mov temp_reg, fs:[gs_addr] */
-				gen_fs_prefix(&out);
-				gen_mov_r_rm_32(&out, temp_reg, modrm_rm_disp(dbt_global->tls_gs_addr_offset));
-				if (ins.rm.base != -1)
-				{
-					/* lea temp_reg, [temp_reg + rm.base] */
-					gen_lea(&out, temp_reg, modrm_rm_mscale(temp_reg, ins.rm.base, 0, 0));
-				}
-				/* Replace rm.base with temp_reg */
-				ins.rm.base = temp_reg;
-				if (context && context->eip <= (DWORD)out)
+				if (dbt->gs_base_dynamic)
 				{
-					/* The instruction is not yet executed, rollback */
-					set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
-					context->eip = current_ip;
-					goto end_block;
+					int temp_reg = find_unused_register(&ins);
+					/* No need to preserve temp_reg if the next instruction overwrites it */
+					bool spill = !dbt_register_dead(code + ins.imm_bytes, temp_reg);
+					if (dbt_gen_gs_base(&out, temp_reg, spill, &ins.rm, current_ip, context))
+						goto end_block;
+					dbt_copy_instruction(&out, &code, &ins);
+					if (dbt_gen_gs_base_done(&out, temp_reg, spill, (DWORD)code, context))
+						goto end_block;
+					break;
 				}
-
-				/* Copy instruction */
-				dbt_copy_instruction(&out, &code, &ins);
-				if (context && context->eip == (DWORD)out)
-				{
-					/* The instruction is already executed, commit */
-					set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
-					context->eip = (DWORD)code;
-					goto end_block;
-				}
-
-				/* mov temp_reg, fs:[scratch] */
-				gen_fs_prefix(&out);
-				gen_mov_r_rm_32(&out, temp_reg, modrm_rm_disp(dbt_global->tls_scratch_offset));
+				/* The gs base is fixed for a thread until dbt_update_tls() changes it, in which
+				 * case the code cache is flushed. Fold it into the displacement. */
+				ins.rm.disp += dbt_get_gs_base();
 			}
-			else /* If nothing special, directly copy instruction */
-				dbt_copy_instruction(&out, &code, &ins);
+			dbt_copy_instruction(&out, &code, &ins);
 			break;
 		}
 
@@ -1604,22 +2683,17 @@ done_prefix:
 			if (ins.segment_prefix == PREFIX_GS)
 			{
 				/* mov moffs with effective gs segment override */
-				int temp_reg = find_unused_register(&ins);
-				/* mov fs:[scratch], temp_reg */
-				gen_fs_prefix(&out);
-				gen_mov_rm_r_32(&out, modrm_rm_disp(dbt_global->tls_scratch_offset), temp_reg);
-
-				/* mov temp_reg, fs:[gs_addr] */
-				gen_fs_prefix(&out);
-				gen_mov_r_rm_32(&out, temp_reg, modrm_rm_disp(dbt_global->tls_gs_addr_offset));
-				if (context && context->eip <= (DWORD)out)
+				int temp_reg = -1;
+				bool spill = false;
+				struct modrm_rm_t rm = modrm_rm_disp(0);
+				if (dbt->gs_base_dynamic)
 				{
-					set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
-					context->eip = current_ip;
-					goto end_block;
+					temp_reg = find_unused_register(&ins);
+					spill = !dbt_register_dead(code + ins.imm_bytes, temp_reg);
+					if (dbt_gen_gs_base(&out, temp_reg, spill, &rm, current_ip, context))
+						goto end_block;
 				}
-
-				/* Generate patched instruction */
+				/* Generate patched instruction with absolute address */
 				if (ins.lock_prefix)
 					gen_byte(&out, 0xF0);
 				if (ins.opsize_prefix)
@@ -1633,17 +2707,15 @@ done_prefix:
 				else /* if (ins.opcode ==0xA3) mov moffs?, ?ax */
 					gen_byte(&out, 0x89);
 				uint32_t disp = parse_moffset(&code, ins.imm_bytes);
-				gen_modrm_sib(&out, 0, modrm_rm_mreg(temp_reg, disp));
-				if (context && context->eip == (DWORD)out)
+				if (dbt->gs_base_dynamic)
 				{
-					set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
-					context->eip = (DWORD)code;
-					goto end_block;
+					rm.disp = disp;
+					gen_modrm_sib(&out, 0, rm);
+					if (dbt_gen_gs_base_done(&out, temp_reg, spill, (DWORD)code, context))
+						goto end_block;
 				}
-
-				/* mov temp_reg, fs:[scratch] */
-				gen_fs_prefix(&out);
-				gen_mov_r_rm_32(&out, temp_reg, modrm_rm_disp(dbt_global->tls_scratch_offset));
+				else
+					gen_modrm_sib(&out, 0, modrm_rm_disp(disp + dbt_get_gs_base()));
 				break;
 			}
 
@@ -1658,14 +2730,20 @@ done_prefix:
 			size_t dest = (size_t)code + rel;
 			gen_push_imm32(&out, (size_t)code);
 			gen_mov_rm_imm32(&out, modrm_rm_disp((int32_t)&dbt->return_cache[RETURN_CACHE_HASH((size_t)code)]), 0);
+			size_t *return_cache_patch = (size_t*)(out - 4);
+			uint8_t *ecx_saved = NULL;
 			if (cmdline_flags->dbt_trace_all) /* Do not do any optimizations */
-				*(size_t*)(out - 4) = (size_t)dbt->return_fallback_trampoline;
+				*return_cache_patch = (size_t)dbt->return_fallback_trampoline;
 			else
-				*(size_t*)(out - 4) = (size_t)out + 5;
+			{
+				size_t *shadow_patch = dbt_gen_shadow_push(&out, &ecx_saved);
+				/* The postamble follows the 5 bytes call */
+				*return_cache_patch = (size_t)out + 5;
+				*shadow_patch = (size_t)out + 5;
+			}
 			if (context && context->eip <= (DWORD)out)
 			{
-				context->esp += 4;
-				context->eip = current_ip;
+				dbt_rollback_call(context, ecx_saved, out, current_ip, 4);
 				goto end_block;
 			}
 			if (context)
@@ -1690,11 +2768,10 @@ done_prefix:
 			if (ins.rm.base == ESP) /* ESP-related address */
 				ins.rm.disp += ESP;
 
-			if (ins.segment_prefix == PREFIX_GS && ins.has_modrm && modrm_rm_is_m(ins.rm))
+			if (ins.segment_prefix == PREFIX_GS && ins.has_modrm && modrm_rm_is_m(ins.rm) && dbt->gs_base_dynamic)
 			{
-				/* call with effective gs segment override */
-				int temp_reg = find_unused_register(&ins);
-				if (dbt_gen_push_gs_rm(&out, temp_reg, ins.rm, current_ip, context))
+				/* call with effective gs segment override, the gs base is loaded at runtime */
+				if (dbt_gen_push_gs_rm(&out, find_unused_register(&ins), ins.rm, current_ip, context))
 				{
 					context->esp += 4;
 					goto end_block;
@@ -1702,22 +2779,48 @@ done_prefix:
 			}
 			else
 			{
-				if (ins.segment_prefix && ins.segment_prefix != PREFIX_GS)
+				if (ins.segment_prefix == PREFIX_GS && ins.has_modrm && modrm_rm_is_m(ins.rm))
+				{
+					/* call with effective gs segment override */
+					ins.rm.disp += dbt_get_gs_base();
+				}
+				else if (ins.segment_prefix && ins.segment_prefix != PREFIX_GS)
 					gen_byte(&out, ins.segment_prefix);
 				gen_push_rm(&out, ins.rm);
 			}
 			gen_mov_rm_imm32(&out, modrm_rm_disp((int32_t)&dbt->return_cache[RETURN_CACHE_HASH((size_t)code)]), 0);
+			size_t *return_cache_patch = (size_t*)(out - 4);
+			uint8_t *ecx_saved = NULL;
 			if (cmdline_flags->dbt_trace_all) /* Do not do any optimizations */
-				*(size_t*)(out - 4) = (size_t)dbt->return_fallback_trampoline;
+				*return_cache_patch = (size_t)dbt->return_fallback_trampoline;
 			else
-				*(size_t*)(out - 4) = (size_t)out + 5;
+			{
+				size_t *shadow_patch = dbt_gen_shadow_push(&out, &ecx_saved);
+				/* The postamble follows push ecx; jmp ibtc (6 bytes) */
+				*return_cache_patch = (size_t)out + 6;
+				*shadow_patch = (size_t)out + 6;
+			}
 			if (context && context->eip <= (DWORD)out)
 			{
-				context->esp += 8;
-				context->eip = current_ip;
+				dbt_rollback_call(context, ecx_saved, out, current_ip, 8);
 				goto end_block;
 			}
-			gen_call(&out, dbt->sieve_indirect_call_dispatch_trampoline);
+			if (cmdline_flags->dbt_trace_all)
+				gen_call(&out, dbt->sieve_indirect_call_dispatch_trampoline);
+			else
+			{
+				gen_push_rm(&out, modrm_rm_reg(ECX));
+				if (context && context->eip == (DWORD)out)
+				{
+					context->esp += 12;
+					context->eip = current_ip;
+					goto end_block;
+				}
+				if (context)
+					out += 5;
+				else
+					gen_jmp(&out, dbt_gen_ibtc());
+			}
 			if (dbt_gen_call_postamble(&out, (size_t)code, context))
 				goto end_block;
 			break;
@@ -1752,6 +2855,12 @@ done_prefix:
 		{
 			int32_t rel = parse_rel(&code, ins.imm_bytes);
 			size_t dest = (size_t)code + rel;
+			if (dbt_extend_trace(&trace_exits, hot, pc, current_ip, dest) || dbt_unroll_loop(&unroll_count, hot, pc, dest))
+			{
+				/* Continue translation at jump target */
+				code = (uint8_t *)dest;
+				break;
+			}
 			if (context)
 				out += 5;
 			else
@@ -1764,16 +2873,20 @@ done_prefix:
 
 		case HANDLER_JMP_INDIRECT:
 		{
-			if (ins.segment_prefix == PREFIX_GS && ins.has_modrm && modrm_rm_is_m(ins.rm))
+			if (ins.segment_prefix == PREFIX_GS && ins.has_modrm && modrm_rm_is_m(ins.rm) && dbt->gs_base_dynamic)
 			{
-				/* jmp with effective gs segment override */
-				int temp_reg = find_unused_register(&ins);
-				if (dbt_gen_push_gs_rm(&out, temp_reg, ins.rm, current_ip, context))
+				/* jmp with effective gs segment override, the gs base is loaded at runtime */
+				if (dbt_gen_push_gs_rm(&out, find_unused_register(&ins), ins.rm, current_ip, context))
 					goto end_block;
 			}
 			else
 			{
-				if (ins.segment_prefix && ins.segment_prefix != PREFIX_GS)
+				if (ins.segment_prefix == PREFIX_GS && ins.has_modrm && modrm_rm_is_m(ins.rm))
+				{
+					/* jmp with effective gs segment override */
+					ins.rm.disp += dbt_get_gs_base();
+				}
+				else if (ins.segment_prefix && ins.segment_prefix != PREFIX_GS)
 					gen_byte(&out, ins.segment_prefix);
 				gen_push_rm(&out, ins.rm);
 			}
@@ -1783,7 +2896,22 @@ done_prefix:
 				context->esp += 4;
 				goto end_block;
 			}
-			gen_jmp(&out, dbt->sieve_dispatch_trampoline);
+			if (cmdline_flags->dbt_trace_all) /* Do not do any optimizations */
+				gen_jmp(&out, dbt->sieve_dispatch_trampoline);
+			else
+			{
+				gen_push_rm(&out, modrm_rm_reg(ECX));
+				if (context && context->eip == (DWORD)out)
+				{
+					context->eip = current_ip;
+					context->esp += 8;
+					goto end_block;
+				}
+				if (context)
+					out += 5;
+				else
+					gen_jmp(&out, dbt_gen_ibtc());
+			}
 			goto end_block;
 		}
 
@@ -1793,6 +2921,19 @@ done_prefix:
 			int32_t rel = parse_rel(&code, ins.imm_bytes);
 			size_t dest0 = (size_t)code + rel; /* Branch taken */
 			size_t dest1 = (size_t)code; /* Branch not taken */
+			if (dbt_unroll_loop(&unroll_count, hot, pc, dest0))
+			{
+				/* Loop back edge of a hot block: the loop exit becomes the side exit */
+				if (context)
+					out += 6;
+				else
+				{
+					size_t patch_addr1 = (size_t)out + 2;
+					gen_jcc(&out, cond ^ 1, (size_t)dbt_get_direct_trampoline(dest1, patch_addr1));
+				}
+				code = (uint8_t *)dest0;
+				break;
+			}
 			if (context)
 				out += 6;
 			else
@@ -1800,6 +2941,8 @@ done_prefix:
 				size_t patch_addr0 = (size_t)out + 2;
 				gen_jcc(&out, cond, (size_t)dbt_get_direct_trampoline(dest0, patch_addr0));
 			}
+			if (dbt_extend_trace(&trace_exits, hot, pc, current_ip, dest1))
+				break; /* Branch taken is a side exit, continue translating fall through path */
 			if (context && context->eip == (DWORD)out)
 			{
 				context->eip = current_ip;
@@ -1834,7 +2977,14 @@ done_prefix:
 				size_t patch_addr0 = (size_t)out + 1;
 				gen_jmp(&out, dbt_get_direct_trampoline(dest0, patch_addr0));
 			}
-			if (context && context->eip <= (DWORD)out)
+			if (context && context->eip < (DWORD)out)
+			{
+				context->eip = current_ip;
+				goto end_block;
+			}
+			if (dbt_extend_trace(&trace_exits, hot, pc, current_ip, dest1))
+				break; /* Continue translating fall through path */
+			if (context && context->eip == (DWORD)out)
 			{
 				context->eip = current_ip;
 				goto end_block;
@@ -1857,6 +3007,31 @@ done_prefix:
 				log_error("INT 0x%x not supported.", id);
 				__debugbreak();
 			}
+			if (!cmdline_flags->dbt_trace_all && prev_ip && current_ip - prev_ip == 5 && *(uint8_t *)prev_ip == 0xB8)
+			{
+				/* mov eax, imm32; int 0x80: the syscall number is known now */
+				void *handler = syscall_get_fast_handler(*(int32_t *)(prev_ip + 1));
+				if (handler)
+				{
+					/* Call the handler directly and continue in this block */
+					gen_push_imm32(&out, (size_t)code);
+					if (context && context->eip == (DWORD)out)
+					{
+						context->esp += 4;
+						context->eip = current_ip;
+						goto end_block;
+					}
+					gen_push_imm32(&out, (size_t)handler);
+					if (context && context->eip == (DWORD)out)
+					{
+						context->esp += 8;
+						context->eip = current_ip;
+						goto end_block;
+					}
+					gen_call(&out, &dbt_syscall_fast_internal);
+					break;
+				}
+			}
 			gen_push_imm32(&out, (size_t)code);
 			if (context && context->eip == (DWORD)out)
 			{
@@ -1876,9 +3051,13 @@ done_prefix:
 				__debugbreak();
 			}
 			int temp_reg = find_unused_register(&ins);
-			/* mov fs:[scratch], temp_reg */
-			gen_fs_prefix(&out);
-			gen_mov_rm_r_32(&out, modrm_rm_disp(dbt_global->tls_scratch_offset), temp_reg);
+			bool spill = !dbt_register_dead(code, temp_reg);
+			if (spill)
+			{
+				/* mov fs:[scratch], temp_reg */
+				gen_fs_prefix(&out);
+				gen_mov_rm_r_32(&out, modrm_rm_disp(dbt_global->tls_scratch_offset), temp_reg);
+			}
 
 			/* mov temp_reg, fs:[gs] */
 			gen_fs_prefix(&out);
@@ -1887,7 +3066,8 @@ done_prefix:
 			{
 				/* The instruction is not yet executed, rollback */
 				context->eip = current_ip;
-				set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
+				if (spill)
+					set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
 				goto end_block;
 			}
 
@@ -1897,66 +3077,51 @@ done_prefix:
 			{
 				/* The instruction is already executed, commit */
 				context->eip = (DWORD)code;
-				set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
+				if (spill)
+					set_context_register(context, temp_reg, __readfsdword(dbt_global->tls_scratch_offset));
 				goto end_block;
 			}
 
-			/* mov temp_reg, fs:[scratch] */
-			gen_fs_prefix(&out);
-			gen_mov_r_rm_32(&out, temp_reg, modrm_rm_disp(dbt_global->tls_scratch_offset));
+			if (spill)
+			{
+				/* mov temp_reg, fs:[scratch] */
+				gen_fs_prefix(&out);
+				gen_mov_r_rm_32(&out, temp_reg, modrm_rm_disp(dbt_global->tls_scratch_offset));
+			}
 			break;
 		}
 
 		case HANDLER_MOV_TO_SEG:
 		{
-			/* TODO: Fix context */
 			if (ins.r != 5) /* GS */
 			{
 				log_error("mov to segment selector other than GS not supported.");
 				__debugbreak();
 			}
-			int temp_reg = find_unused_register(&ins);
-			/* mov fs:[scratch], temp_reg */
-			gen_fs_prefix(&out);
-			gen_mov_rm_r_32(&out, modrm_rm_disp(dbt_global->tls_scratch_offset), temp_reg);
-
-			/* mov temp_reg, |rm| */
-			gen_mov_r_rm_32(&out, temp_reg, ins.rm);
-
-			/* This is very ugly and inefficient, but anyway this instruction should not be used very often */
-			gen_pushfd(&out);
-
-			/* mov fs:[gs], temp_reg */
-			gen_fs_prefix(&out);
-			gen_mov_rm_r_32(&out, modrm_rm_disp(dbt_global->tls_gs_offset), temp_reg);
-
-			/* call tls_user_entry_to_offset() to get the offset */
-			gen_shr_rm_32(&out, modrm_rm_reg(temp_reg), 3);
-			gen_push_rm(&out, modrm_rm_reg(0));
-			gen_push_rm(&out, modrm_rm_reg(1));
-			gen_push_rm(&out, modrm_rm_reg(2));
-			gen_push_rm(&out, modrm_rm_reg(temp_reg));
-			gen_call(&out, &tls_user_entry_to_offset);
-
-			/* mov temp_reg, fs:eax */
-			gen_fs_prefix(&out);
-			gen_mov_r_rm_32(&out, temp_reg, modrm_rm_mreg(0, 0));
-			/* mov fs:[gs_addr], temp_reg */
-			gen_fs_prefix(&out);
-			gen_mov_rm_r_32(&out, modrm_rm_disp(dbt_global->tls_gs_addr_offset), temp_reg);
-
-			/* Clean up */
-			gen_lea(&out, 4, modrm_rm_mreg(4, 4));
-			gen_pop_rm(&out, modrm_rm_reg(2));
-			gen_pop_rm(&out, modrm_rm_reg(1));
-			gen_pop_rm(&out, modrm_rm_reg(0));
-
-			gen_popfd(&out);
-
-			/* mov temp_reg, fs:[scratch] */
-			gen_fs_prefix(&out);
-			gen_mov_r_rm_32(&out, temp_reg, modrm_rm_disp(dbt_global->tls_scratch_offset));
-			break;
+			/* Translated code embeds the gs base, the cache could be flushed when it changes.
+			 * Hand over to dbt_mov_to_gs() and continue through the indirect dispatcher. */
+			gen_push_imm32(&out, (size_t)code);
+			if (context && context->eip == (DWORD)out)
+			{
+				context->esp += 4;
+				context->eip = current_ip;
+				goto end_block;
+			}
+			if (ins.rm.base == ESP) /* ESP-related address */
+				ins.rm.disp += 4;
+			gen_push_rm(&out, ins.rm);
+			if (context && context->eip == (DWORD)out)
+			{
+				context->esp += 8;
+				context->eip = current_ip;
+				goto end_block;
+			}
+			/* dbt_mov_to_gs() clobbers flags, they need not be saved if the next instruction overwrites them */
+			if (dbt_flags_dead(code))
+				gen_jmp(&out, &dbt_mov_to_gs_nf_internal);
+			else
+				gen_jmp(&out, &dbt_mov_to_gs_internal);
+			goto end_block;
 		}
 
 		case HANDLER_CPUID:
@@ -1968,35 +3133,142 @@ done_prefix:
 		}
 		continue;
 
+	end_speculation:
+		/* Leave the instruction to a real translation if it is ever executed */
+		code = (uint8_t *)current_ip;
+		if (current_ip == pc)
+		{
+			/* Nothing is translated yet, discard the block */
+			dbt->blocks_count--;
+			btree_remove(&dbt->tree, block->pc);
+			btree_remove(&dbt->cache_tree, (size_t)block->start);
+			dbt->translating_block = NULL;
+			return NULL;
+		}
+		gen_jmp(&out, dbt_get_direct_trampoline(current_ip, (size_t)out + 1));
+
 	end_block:
 		break;
 	}
 	if (!context)
+	{
+		block->end_pc = (size_t)code;
+		block->size = (int)(out - block->start);
 		dbt->out = out;
+		dbt->translating_block = NULL;
+		mm_protect_code(block->pc, block->end_pc);
+		InterlockedIncrement(&dbt_global->stats.translations);
+		if (etw_enabled(ETW_KEYWORD_DBT))
+		{
+			dbt_save_simd_state();
+			etw_dbt_translate(block->pc, block->end_pc, block->size, block->hot);
+			dbt_restore_simd_state();
+		}
+	}
 	return block;
 }
 
+/* Patch all direct jumps waiting for a newly translated block, see DBT_LINK_MAP_SIZE */
+static void dbt_resolve_links(struct dbt_block *block)
+{
+	if (cmdline_flags->dbt_trace_all) /* Do not do any optimizations */
+		return;
+	struct dbt_link_map_entry *link = link_map_find(block->pc, false);
+	if (!link)
+		return;
+	for (uint8_t *t = link->head; t; t = *(uint8_t **)(t + DBT_TRAMPOLINE_NEXT_OFFSET))
+	{
+		size_t patch_addr = *(DWORD *)(t + 1); /* push patch_addr */
+		*(size_t*)patch_addr = (intptr_t)(block->start - (patch_addr + 4));
+		InterlockedIncrement(&dbt_global->stats.direct_patches);
+	}
+	link->head = NULL;
+}
+
+/* Speculative translation
+ * Direct branch targets of a newly translated block are translated ahead of time and linked
+ * in place, saving a later round trip through dbt_find_direct_internal. Only targets in the
+ * pages the source block was translated from are considered, those are known to be mapped
+ * and most likely contain real code.
+ * As the target may as well be data, a speculative translation stops at the end of these pages
+ * and before the first instruction it cannot translate, instead of failing. The remainder is
+ * left to a normal translation if it is ever executed.
+ * The work is done on the guest thread: translation writes to the per-thread code cache
+ * which is executed concurrently, there is no way to hand it to another thread safely.
+ */
+static int dbt_collect_pending_links(struct dbt_block *block, struct dbt_pending_link *links, int count)
+{
+	size_t page_begin = block->pc & -PAGE_SIZE;
+	size_t page_end = ((block->end_pc - 1) & -PAGE_SIZE) + PAGE_SIZE;
+	for (int i = 0; i < dbt->pending_links_count && count < DBT_PRETRANSLATE_MAX_LINKS; i++)
+	{
+		size_t target = dbt->pending_links[i].target;
+		if (target >= page_begin && target < page_end)
+		{
+			links[count] = dbt->pending_links[i];
+			links[count++].page_end = page_end;
+		}
+	}
+	dbt->pending_links_count = 0;
+	return count;
+}
+
+static void dbt_pretranslate(struct dbt_block *block)
+{
+	struct dbt_pending_link links[DBT_PRETRANSLATE_MAX_LINKS];
+	int count = dbt_collect_pending_links(block, links, 0);
+	int translated = 0;
+	for (int i = 0; i < count; i++)
+	{
+		struct dbt_block *target = find_block(links[i].target);
+		if (!target)
+		{
+			/* Never let speculative translation flush the cache */
+			if (translated == DBT_PRETRANSLATE_MAX_BLOCKS || dbt->blocks_count + 1 >= dbt->max_blocks
+				|| dbt->end - dbt->out < 2 * DBT_BLOCK_MAXSIZE)
+				break;
+			dbt->speculate_end = links[i].page_end;
+			target = dbt_translate(links[i].target, false, NULL);
+			dbt->speculate_end = 0;
+			if (!target)
+				continue;
+			block_map_add(target);
+			dbt_resolve_links(target);
+			translated++;
+			count = dbt_collect_pending_links(target, links, count);
+		}
+		/* Patch the jmp/jcc address */
+		*(size_t*)links[i].patch_addr = (intptr_t)(target->start - (links[i].patch_addr + 4));
+		InterlockedIncrement(&dbt_global->stats.direct_patches);
+	}
+}
+
 static uint8_t *dbt_find(size_t pc)
 {
-	int bucket = hash_block_pc(pc);
-	slist_iterate(&dbt->block_hash[bucket], prev, cur)
+	dbt_check_code_changes();
+	struct dbt_block *block = find_block(pc);
+	if (block)
 	{
-		struct dbt_block *block = slist_entry(cur, struct dbt_block, list);
-		if (block->pc == pc)
+		if (cmdline_flags->dbt_trace_all)
 		{
-			if (cmdline_flags->dbt_trace_all)
-			{
-				dbt_save_simd_state();
-				log_debug("dbt_find: block pc: %p, translated pc: %p, end: %p", block->pc, block->start, dbt->end);
-				dbt_restore_simd_state();
-			}
-			return block->start;
+			dbt_save_simd_state();
+			log_debug("dbt_find: block pc: %p, translated pc: %p, end: %p", block->pc, block->start, dbt->end);
+			dbt_restore_simd_state();
 		}
+		return block->start;
 	}
 
 	/* Block not found, translate it now */
-	struct dbt_block *block = dbt_translate(pc, NULL);
-	slist_add(&dbt->block_hash[bucket], &block->list);
+	dbt->translating = true;
+	uint64_t start_cycles = __rdtsc();
+	block = dbt_translate(pc, false, NULL);
+	block_map_add(block);
+	dbt_resolve_links(block);
+	if (cmdline_flags->dbt_pretranslate && !cmdline_flags->dbt_trace_all)
+		dbt_pretranslate(block);
+	InterlockedExchangeAdd64(&dbt_global->stats.translate_cycles, __rdtsc() - start_cycles);
+	dbt_stats_update();
+	dbt->translating = false;
 	return block->start;
 }
 
@@ -2008,6 +3280,9 @@ void dbt_find_next(size_t pc)
 void dbt_find_next_sieve(size_t pc)
 {
 	uint8_t *target = dbt_find(pc);
+	InterlockedIncrement(&dbt_global->stats.sieve_misses);
+	if (cmdline_flags->dbt_profile)
+		find_block(pc)->sieve_miss_count++;
 	if (cmdline_flags->dbt_trace_all)
 	{
 		/* Do not do any optimizations */
@@ -2036,6 +3311,24 @@ void dbt_find_next_sieve(size_t pc)
 	dbt_set_return_addr(pc, (size_t)target);
 }
 
+void dbt_find_next_ibtc(size_t pc, size_t return_addr)
+{
+	dbt_flushed = false;
+	uint8_t *target = dbt_find(pc);
+	InterlockedIncrement(&dbt_global->stats.ibtc_misses);
+	if (!dbt_flushed)
+	{
+		uint8_t *stub = (uint8_t *)(return_addr - DBT_IBTC_MATCH_OFFSET);
+		/* Fill in cached target */
+		*(size_t*)&stub[DBT_IBTC_PC_OFFSET] = -pc;
+		*(size_t*)&stub[DBT_IBTC_TARGET_OFFSET] = (size_t)(target - (stub + DBT_IBTC_TARGET_OFFSET + sizeof(size_t)));
+		/* Further misses use sieve: jmp return_fallback_trampoline */
+		stub[DBT_IBTC_MISS_OFFSET] = 0xE9;
+		*(size_t*)&stub[DBT_IBTC_MISS_OFFSET + 1] = (size_t)(dbt->return_fallback_trampoline - (stub + DBT_IBTC_MATCH_OFFSET));
+	}
+	dbt_set_return_addr(pc, (size_t)target);
+}
+
 void dbt_find_direct(size_t pc, size_t patch_addr)
 {
 	/* Translate or generate the block */
@@ -2045,10 +3338,44 @@ void dbt_find_direct(size_t pc, size_t patch_addr)
 	{
 		/* Patch the jmp/call address so we don't need to repeat work again */
 		*(size_t*)patch_addr = (intptr_t)(block_start - (patch_addr + 4)); /* Relative address */
+		InterlockedIncrement(&dbt_global->stats.direct_patches);
 	}
 	dbt_set_return_addr(pc, block_start);
 }
 
+/* Called by hot trampolines when a loop gets hot, see DBT_HOT_THRESHOLD */
+void dbt_find_hot(size_t pc, size_t patch_addr)
+{
+	dbt_flushed = false;
+	struct dbt_block *block = find_block(pc);
+	if (!block || block->hot || cmdline_flags->dbt_trace_all)
+	{
+		/* Already retranslated, or invalidated since */
+		dbt_find_direct(pc, patch_addr);
+		return;
+	}
+	/* Replace the block by a hot one, the old one stays in the code cache */
+	dbt->translating = true;
+	uint64_t start_cycles = __rdtsc();
+	block_map_remove(block);
+	btree_remove(&dbt->tree, block->pc);
+	struct dbt_block *hot_block = dbt_translate(pc, true, NULL);
+	block_map_add(hot_block);
+	dbt_resolve_links(hot_block);
+	if (!dbt_flushed)
+	{
+		/* Redirect the old block and the back edge taken */
+		uint8_t *out = block->start;
+		gen_jmp(&out, hot_block->start);
+		*(size_t*)patch_addr = (intptr_t)(hot_block->start - (patch_addr + 4));
+	}
+	InterlockedIncrement(&dbt_global->stats.hot_translations);
+	InterlockedExchangeAdd64(&dbt_global->stats.translate_cycles, __rdtsc() - start_cycles);
+	dbt_stats_update();
+	dbt->translating = false;
+	dbt_set_return_addr(pc, (size_t)hot_block->start);
+}
+
 void __declspec(noreturn) dbt_run(size_t pc, size_t sp)
 {
 	size_t entrypoint = (size_t)dbt_find(pc);
@@ -2071,27 +3398,48 @@ int dbt_get_gs()
 void dbt_update_tls(int gs)
 {
 	DWORD gs_addr = __readfsdword(tls_user_entry_to_offset(gs >> 3));
+	/* Translated code has the old gs base embedded
+	 * The thread switches its gs base at runtime (e.g. green threads), flush once and stop embedding
+	 * it so later changes are only the stores below */
+	if (dbt->gs_base_embedded && gs_addr != __readfsdword(dbt_global->tls_gs_addr_offset))
+	{
+		dbt_save_simd_state();
+		log_info("dbt: gs base changed to %p, flushing code cache and loading gs base dynamically.", gs_addr);
+		dbt_restore_simd_state();
+		dbt->gs_base_dynamic = true;
+		dbt_flush();
+	}
 	__writefsdword(dbt_global->tls_gs_offset, gs);
 	__writefsdword(dbt_global->tls_gs_addr_offset, gs_addr);
 }
 
-void dbt_deliver_signal(HANDLE thread, CONTEXT *context)
+/* Called by dbt_syscall_fast_internal after a fast syscall handler returns */
+void dbt_syscall_fast_return(size_t pc, size_t return_addr)
 {
-	THREAD_BASIC_INFORMATION info;
-	NtQueryInformationThread(thread, ThreadBasicInformation, &info, sizeof(info), NULL);
-	struct dbt_data *dbt = *(struct dbt_data **)((uint8_t*)info.TebBaseAddress + dbt_global->tls_dbt_offset);
+	dbt_set_return_addr(pc, return_addr);
+}
+
+/* Called by dbt_mov_to_gs_internal on mov gs, r/m */
+void dbt_mov_to_gs(int gs)
+{
+	dbt_update_tls(gs & 0xFFFF);
+}
+
+void dbt_deliver_signal(void *teb, CONTEXT *context)
+{
+	struct dbt_data *dbt = *(struct dbt_data **)((uint8_t*)teb + dbt_global->tls_dbt_offset);
 	/* Are we inside code cache? */
-	if (context->Eip >= (DWORD)dbt->internal_trampoline_end && context->Eip < (DWORD)dbt->code_cache + DBT_CACHE_SIZE)
+	if (context->Eip >= (DWORD)dbt->internal_trampoline_end && context->Eip < (DWORD)dbt->code_cache + dbt->cache_size)
 	{
 		dbt->signal_need_fixup = true;
-		*(DWORD *)((uint8_t*)info.TebBaseAddress + dbt_global->tls_eip_offset) = context->Eip;
+		*(DWORD *)((uint8_t*)teb + dbt_global->tls_eip_offset) = context->Eip;
 		context->Eip = (DWORD)dbt->signal_trampoline;
 	}
 	else
 	{
 		dbt->signal_need_fixup = false;
 		dbt->signal_pending = true;
-		*(DWORD *)((uint8_t*)info.TebBaseAddress + dbt_global->tls_return_addr_offset) = (DWORD)dbt->signal_trampoline;
+		*(DWORD *)((uint8_t*)teb + dbt_global->tls_return_addr_offset) = (DWORD)dbt->signal_trampoline;
 	}
 }
 
@@ -2100,7 +3448,7 @@ static void dbt_setup_signal_handler(struct syscall_context *context)
 	dbt->signal_pending = false;
 	/* Fix up context if needed */
 	if (dbt->signal_need_fixup)
-		dbt_translate(0, context);
+		dbt_translate(0, false, context);
 	signal_setup_handler(context);
 }
 
@@ -48,6 +48,12 @@ void dbt_init_thread();
 void dbt_init();
 void dbt_reset();
 void dbt_shutdown();
+void dbt_shutdown_thread();
+
+/* Log execution counters of the hottest blocks, only effective with --dbt-profile */
+void dbt_profile_report();
+/* Print process wide dbt statistics to buf, returns length */
+int dbt_get_stats(char *buf);
 
 void __declspec(noreturn) dbt_run(size_t pc, size_t sp);
 void __declspec(noreturn) dbt_restore_fork_context(struct syscall_context *context);
@@ -58,12 +64,31 @@ int dbt_get_gs();
 /* Reload TLS information at thread entry */
 void dbt_update_tls(int gs);
 
-/* Called when an executable code region changes, determines whether we need to flush code cache */
+#ifdef _WIN64
+/* Get/set guest fs base address, used for TLS on x86-64 */
+void dbt_set_fs_base(size_t base);
+size_t dbt_get_fs_base();
+#endif
+
+/* Sampling profiler support: classify where a suspended thread is executing */
+enum
+{
+	DBT_SAMPLE_TRANSLATED, /* Translated code, guest pc available */
+	DBT_SAMPLE_DISPATCH, /* Dispatch trampolines and stubs inside code cache */
+	DBT_SAMPLE_TRANSLATOR, /* Translating guest code */
+	DBT_SAMPLE_KERNEL, /* Anything else, usually syscalls */
+};
+int dbt_sample_thread(HANDLE thread, const CONTEXT *context, size_t *pc);
+
+/* Called when an executable code region changes, determines whether we need to flush code cache
+ * Translations of the calling thread are dropped at once, other threads drop theirs on next translator entry */
 void dbt_code_changed(size_t pc, size_t len);
 
 /* Deliver the signal to the main thread's context
- * This function can only called from the signal thread */
-void dbt_deliver_signal(HANDLE thread, CONTEXT *context);
+ * The thread must be suspended and can not be the calling thread, teb is its thread environment block */
+void dbt_deliver_signal(void *teb, CONTEXT *context);
+/* Deliver the signal to the calling thread, which is in a syscall */
+void dbt_deliver_signal_current();
 
 /* Return from signal */
 void __declspec(noreturn) dbt_sigreturn(struct sigcontext *context);
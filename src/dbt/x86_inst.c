@@ -19,6 +19,25 @@
 
 #include <dbt/x86_inst.h>
 
+void x86_inst_init()
+{
+	for (int i = 0; i < 256; i++)
+	{
+		const struct instruction_desc *desc = &one_byte_inst[i];
+		struct instruction_decode *decode = &one_byte_decode[i];
+		decode->flags = 0;
+		if (desc->type <= INST_TYPE_MAX)
+			continue;
+		decode->flags = DECODE_DIRECT;
+		if (FROM_MODRM(desc->op1) || FROM_MODRM(desc->op2) || FROM_MODRM(desc->op3))
+			decode->flags |= DECODE_MODRM;
+		for (int opsize = 0; opsize < 2; opsize++)
+			decode->imm_bytes[opsize] = get_imm_bytes(desc->op1, opsize, false)
+				+ get_imm_bytes(desc->op2, opsize, false)
+				+ get_imm_bytes(desc->op3, opsize, false);
+	}
+}
+
 int get_imm_bytes(uint8_t op, bool opsize_prefix_present, bool addrsize_prefix_present)
 {
 	if (op == IMM8 || op == REL8)
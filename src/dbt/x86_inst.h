@@ -109,6 +109,7 @@
 #define RM_R16_32_64	(RM_Rxx | REGULAR | xx16 | xx32 | xx64)
 #define RM_R16_64		(RM_Rxx | REGULAR | xx16 | xx64)
 #define RM_R32_64		(RM_Rxx | REGULAR | xx32 | xx64)
+#define RM_R64			(RM_Rxx | REGULAR | xx64)
 
 /* Register or memory (via ModR/M rm field and SIB) */
 #define RM8			(RMxx | REGULAR | xx8)
@@ -132,23 +133,30 @@
 #define M128		(Mxx | VECTOR | vv128)
 #define M256		(Mxx | VECTOR | vv256)
 #define M512		(Mxx | VECTOR | vv512)
+#define M128_256	(Mxx | VECTOR | vv128 | vv256)
 
 /* Vector registers */
 #define MM				(Rxx | VECTOR | vv64)
 #define XMM				(Rxx | VECTOR | vv128)
 #define MM_XMM			(Rxx | VECTOR | vv64 | vv128)
+#define YMM				(Rxx | VECTOR | vv256)
+#define XMM_YMM			(Rxx | VECTOR | vv128 | vv256)
 
 #define RM_MM			(RM_Rxx | VECTOR | vv64)
 #define RM_XMM			(RM_Rxx | VECTOR | vv128)
 #define RM_MM_XMM		(RM_Rxx | VECTOR | vv64 | vv128)
+#define RM_XMM_YMM		(RM_Rxx | VECTOR | vv128 | vv256)
 
 /* Vector register/memory */
 #define MMM64			(RMxx | VECTOR | vv64)
 #define XMMM128			(RMxx | VECTOR | vv128)
 #define MMM64_XMMM128	(RMxx | VECTOR | vv64 | vv128)
+#define YMMM256			(RMxx | VECTOR | vv256)
+#define XMMM128_YMMM256	(RMxx | VECTOR | vv128 | vv256)
 
 /* Special r/m of vector registers */
 #define MMM32		(RMxx | MMMxx | xx32)
+#define XMMM8		(RMxx | XMMMxx | xx8)
 #define XMMM16		(RMxx | XMMMxx | xx16)
 #define XMMM32		(RMxx | XMMMxx | xx32)
 #define XMMM64		(RMxx | XMMMxx | xx64)
@@ -289,11 +297,27 @@ struct instruction_desc
 #define HANDLER_MOV_TO_SEG		0x0C
 #define HANDLER_CPUID			0x0D
 #define HANDLER_X87				0x0E /* TODO */
+#define HANDLER_SYSCALL			0x0F /* x86-64 only */
 
 const struct instruction_desc one_byte_inst[256];
 const struct instruction_desc two_byte_inst[256];
 const struct instruction_desc three_byte_inst_0x38[256];
 const struct instruction_desc three_byte_inst_0x3A[256];
+/* VEX encoded instructions, indexed by VEX.mmmmm opcode map */
+const struct instruction_desc vex_inst_0x0F[256];
+const struct instruction_desc vex_inst_0x0F38[256];
+const struct instruction_desc vex_inst_0x0F3A[256];
+
+/* Precomputed decoding information of one byte opcodes, built by x86_inst_init() */
+#define DECODE_DIRECT			0x01 /* The descriptor is final, no extension table lookup needed */
+#define DECODE_MODRM			0x02 /* The instruction has a ModR/M byte */
+struct instruction_decode
+{
+	uint8_t flags;
+	uint8_t imm_bytes[2]; /* Number of immediate bytes without and with operand size prefix */
+};
+struct instruction_decode one_byte_decode[256];
 
+void x86_inst_init();
 int get_imm_bytes(uint8_t op, bool opsize_prefix_present, bool addrsize_prefix_present);
 uint8_t get_implicit_register_usage(uint8_t op, uint8_t opcode);
@@ -159,8 +159,8 @@ const struct instruction_desc one_byte_inst[256] =
 	/* 0x1C */ NORMAL("sbb", AL, IMM8, __)
 	/* 0x1D */ NORMAL("sbb", AX_EAX_RAX, IMM16_32, __)
 #ifdef _WIN64
-	/* 0x1E: INVALID */
-	/* 0x1F: INVALID */
+	/* 0x1E */ INVALID()
+	/* 0x1F */ INVALID()
 #else
 	/* 0x1E */ UNSUPPORTED() /* PUSH DS */
 	/* 0x1F */ UNSUPPORTED() /* POP DS */
@@ -494,6 +494,24 @@ const struct instruction_desc one_byte_inst[256] =
 	/* 0xFF */ EXTENSION(FF)
 };
 
+static const struct instruction_desc modrm_mod_0F01_2[2] =
+{
+	/* R */ NORMAL_MOREREG("xgetbv", __, __, __, REG_AX | REG_CX | REG_DX) /* Or XSETBV, XEND, XTEST */
+	/* M */ PRIVILEGED("lgdt", M, __, __)
+};
+
+static const struct instruction_desc extension_0F01[8] =
+{
+	/* 0 */ UNSUPPORTED() /* SGDT m; VMX instructions */
+	/* 1 */ UNSUPPORTED() /* SIDT m; MONITOR; MWAIT */
+	/* 2 */ MODRM_MOD(0F01_2)
+	/* 3 */ UNSUPPORTED() /* LIDT m; SVM instructions */
+	/* 4 */ UNSUPPORTED() /* SMSW r/m16 */
+	/* 5 */ UNKNOWN()
+	/* 6 */ UNSUPPORTED() /* LMSW r/m16 */
+	/* 7 */ UNSUPPORTED() /* INVLPG m; SWAPGS; RDTSCP */
+};
+
 static const struct instruction_desc extension_0F0D[8] =
 {
 	/* 0 */ NORMAL("nop", RM16_32, __, __)
@@ -960,7 +978,7 @@ static const struct instruction_desc extension_0FC7[8] =
 	/* 1 */ NORMAL_MOREREG("cmpxchg8b", M32_64, __, __, REG_AX | REG_CX | REG_DX | REG_BX) /* Actually M64_M128 */
 	/* 2 */ UNKNOWN()
 	/* 3 */ UNKNOWN()
-	/* 4 */ UNKNOWN()
+	/* 4 */ NORMAL_MOREREG("xsavec", M, __, __, REG_AX | REG_DX)
 	/* 5 */ UNKNOWN()
 	/* 6 */ UNSUPPORTED() /* vmx instructions */
 	/* 7 */ UNSUPPORTED() /* vmx instructions */
@@ -1031,11 +1049,15 @@ const struct instruction_desc two_byte_inst[256] =
 	3: LIDT m16&32; LIDT m16&64
 	4: SMSW r/m16; SMSW r32/m16
 	6: LMSW r/m16
-	7: INVLPG */ UNSUPPORTED()
+	7: INVLPG */ EXTENSION(0F01)
 	/* 0x02 */ UNSUPPORTED() /* LAR r16, r16/m16; LAR reg, r32/m16 */
 	/* 0x03 */ UNSUPPORTED() /* LSL r?, r?/m16 */
 	/* 0x04 */ UNKNOWN()
+#ifdef _WIN64
+	/* 0x05 */ SPECIAL("syscall", __, __, __, HANDLER_SYSCALL)
+#else
 	/* 0x05 */ UNSUPPORTED() /* SYSCALL */
+#endif
 	/* 0x06 */ PRIVILEGED("clts", __, __, __)
 	/* 0x07 */ UNSUPPORTED() /* SYSRET */
 	/* 0x08 */ PRIVILEGED("invd", __, __, __)
@@ -1857,3 +1879,875 @@ const struct instruction_desc three_byte_inst_0x3A[256] =
 	/* 0xFE */ UNKNOWN()
 	/* 0xFF */ UNKNOWN()
 };
+
+/* VEX encoded instructions
+ * The operand lists only describe ModR/M and immediate operands, the extra source operand
+ * in VEX.vvvv is implicit. The ModR/M layout does not depend on VEX.pp, VEX.L or VEX.W,
+ * so instructions sharing an opcode are listed together unless the operand forms differ.
+ */
+static const struct instruction_desc mandatory_VEX_0F12[4] =
+{
+	/* 00 */ NORMAL("vmov(h)lps", XMM, XMMM64, __) /* VMOVLPS xmm1, xmm2, m64; VMOVHLPS xmm1, xmm2, xmm3 */
+	/* 66 */ NORMAL("vmovlpd", XMM, M64, __)
+	/* F3 */ NORMAL("vmovsldup", XMM_YMM, XMMM128_YMMM256, __)
+	/* F2 */ NORMAL("vmovddup", XMM_YMM, XMMM128_YMMM256, __)
+};
+
+static const struct instruction_desc mandatory_VEX_0F16[4] =
+{
+	/* 00 */ NORMAL("vmov(l)hps", XMM, XMMM64, __) /* VMOVHPS xmm1, xmm2, m64; VMOVLHPS xmm1, xmm2, xmm3 */
+	/* 66 */ NORMAL("vmovhpd", XMM, M64, __)
+	/* F3 */ NORMAL("vmovshdup", XMM_YMM, XMMM128_YMMM256, __)
+	/* F2 */ UNKNOWN()
+};
+
+static const struct instruction_desc extension_VEX_0F71[8] =
+{
+	/* 0 */ UNKNOWN()
+	/* 1 */ UNKNOWN()
+	/* 2 */ NORMAL("vpsrlw", RM_XMM_YMM, IMM8, __)
+	/* 3 */ UNKNOWN()
+	/* 4 */ NORMAL("vpsraw", RM_XMM_YMM, IMM8, __)
+	/* 5 */ UNKNOWN()
+	/* 6 */ NORMAL("vpsllw", RM_XMM_YMM, IMM8, __)
+	/* 7 */ UNKNOWN()
+};
+
+static const struct instruction_desc extension_VEX_0F72[8] =
+{
+	/* 0 */ UNKNOWN()
+	/* 1 */ UNKNOWN()
+	/* 2 */ NORMAL("vpsrld", RM_XMM_YMM, IMM8, __)
+	/* 3 */ UNKNOWN()
+	/* 4 */ NORMAL("vpsrad", RM_XMM_YMM, IMM8, __)
+	/* 5 */ UNKNOWN()
+	/* 6 */ NORMAL("vpslld", RM_XMM_YMM, IMM8, __)
+	/* 7 */ UNKNOWN()
+};
+
+static const struct instruction_desc extension_VEX_0F73[8] =
+{
+	/* 0 */ UNKNOWN()
+	/* 1 */ UNKNOWN()
+	/* 2 */ NORMAL("vpsrlq", RM_XMM_YMM, IMM8, __)
+	/* 3 */ NORMAL("vpsrldq", RM_XMM_YMM, IMM8, __)
+	/* 4 */ UNKNOWN()
+	/* 5 */ UNKNOWN()
+	/* 6 */ NORMAL("vpsllq", RM_XMM_YMM, IMM8, __)
+	/* 7 */ NORMAL("vpslldq", RM_XMM_YMM, IMM8, __)
+};
+
+static const struct instruction_desc mandatory_VEX_0F7E[4] =
+{
+	/* 00 */ UNKNOWN()
+	/* 66 */ NORMAL("vmovd", RM32_64, XMM, __) /* vmovq for r/m64 */
+	/* F3 */ NORMAL("vmovq", XMM, XMMM64, __)
+	/* F2 */ UNKNOWN()
+};
+
+static const struct instruction_desc extension_VEX_0FAE[8] =
+{
+	/* 0 */ UNKNOWN()
+	/* 1 */ UNKNOWN()
+	/* 2 */ NORMAL("vldmxcsr", M32, __, __)
+	/* 3 */ NORMAL("vstmxcsr", M32, __, __)
+	/* 4 */ UNKNOWN()
+	/* 5 */ UNKNOWN()
+	/* 6 */ UNKNOWN()
+	/* 7 */ UNKNOWN()
+};
+
+/* VEX encoded instructions in 0F map */
+const struct instruction_desc vex_inst_0x0F[256] =
+{
+	/* 0x00 */ UNKNOWN()
+	/* 0x01 */ UNKNOWN()
+	/* 0x02 */ UNKNOWN()
+	/* 0x03 */ UNKNOWN()
+	/* 0x04 */ UNKNOWN()
+	/* 0x05 */ UNKNOWN()
+	/* 0x06 */ UNKNOWN()
+	/* 0x07 */ UNKNOWN()
+	/* 0x08 */ UNKNOWN()
+	/* 0x09 */ UNKNOWN()
+	/* 0x0A */ UNKNOWN()
+	/* 0x0B */ UNKNOWN()
+	/* 0x0C */ UNKNOWN()
+	/* 0x0D */ UNKNOWN()
+	/* 0x0E */ UNKNOWN()
+	/* 0x0F */ UNKNOWN()
+	/* 0x10 */ NORMAL("vmovups/vmovupd/vmovss/vmovsd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x11 */ NORMAL("vmovups/vmovupd/vmovss/vmovsd", XMMM128_YMMM256, XMM_YMM, __)
+	/* 0x12 */ MANDATORY(VEX_0F12)
+	/* 0x13 */ NORMAL("vmovlps/vmovlpd", M64, XMM, __)
+	/* 0x14 */ NORMAL("vunpcklps/vunpcklpd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x15 */ NORMAL("vunpckhps/vunpckhpd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x16 */ MANDATORY(VEX_0F16)
+	/* 0x17 */ NORMAL("vmovhps/vmovhpd", M64, XMM, __)
+	/* 0x18 */ UNKNOWN()
+	/* 0x19 */ UNKNOWN()
+	/* 0x1A */ UNKNOWN()
+	/* 0x1B */ UNKNOWN()
+	/* 0x1C */ UNKNOWN()
+	/* 0x1D */ UNKNOWN()
+	/* 0x1E */ UNKNOWN()
+	/* 0x1F */ UNKNOWN()
+	/* 0x20 */ UNKNOWN()
+	/* 0x21 */ UNKNOWN()
+	/* 0x22 */ UNKNOWN()
+	/* 0x23 */ UNKNOWN()
+	/* 0x24 */ UNKNOWN()
+	/* 0x25 */ UNKNOWN()
+	/* 0x26 */ UNKNOWN()
+	/* 0x27 */ UNKNOWN()
+	/* 0x28 */ NORMAL("vmovaps/vmovapd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x29 */ NORMAL("vmovaps/vmovapd", XMMM128_YMMM256, XMM_YMM, __)
+	/* 0x2A */ NORMAL("vcvtsi2ss/vcvtsi2sd", XMM, RM32_64, __)
+	/* 0x2B */ NORMAL("vmovntps/vmovntpd", M128_256, XMM_YMM, __)
+	/* 0x2C */ NORMAL("vcvttss2si/vcvttsd2si", R32_64, XMMM64, __)
+	/* 0x2D */ NORMAL("vcvtss2si/vcvtsd2si", R32_64, XMMM64, __)
+	/* 0x2E */ NORMAL("vucomiss/vucomisd", XMM, XMMM64, __)
+	/* 0x2F */ NORMAL("vcomiss/vcomisd", XMM, XMMM64, __)
+	/* 0x30 */ UNKNOWN()
+	/* 0x31 */ UNKNOWN()
+	/* 0x32 */ UNKNOWN()
+	/* 0x33 */ UNKNOWN()
+	/* 0x34 */ UNKNOWN()
+	/* 0x35 */ UNKNOWN()
+	/* 0x36 */ UNKNOWN()
+	/* 0x37 */ UNKNOWN()
+	/* 0x38 */ UNKNOWN()
+	/* 0x39 */ UNKNOWN()
+	/* 0x3A */ UNKNOWN()
+	/* 0x3B */ UNKNOWN()
+	/* 0x3C */ UNKNOWN()
+	/* 0x3D */ UNKNOWN()
+	/* 0x3E */ UNKNOWN()
+	/* 0x3F */ UNKNOWN()
+	/* 0x40 */ UNKNOWN()
+	/* 0x41 */ UNKNOWN()
+	/* 0x42 */ UNKNOWN()
+	/* 0x43 */ UNKNOWN()
+	/* 0x44 */ UNKNOWN()
+	/* 0x45 */ UNKNOWN()
+	/* 0x46 */ UNKNOWN()
+	/* 0x47 */ UNKNOWN()
+	/* 0x48 */ UNKNOWN()
+	/* 0x49 */ UNKNOWN()
+	/* 0x4A */ UNKNOWN()
+	/* 0x4B */ UNKNOWN()
+	/* 0x4C */ UNKNOWN()
+	/* 0x4D */ UNKNOWN()
+	/* 0x4E */ UNKNOWN()
+	/* 0x4F */ UNKNOWN()
+	/* 0x50 */ NORMAL("vmovmskps/vmovmskpd", R32_64, RM_XMM_YMM, __)
+	/* 0x51 */ NORMAL("vsqrtps/vsqrtpd/vsqrtss/vsqrtsd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x52 */ NORMAL("vrsqrtps/vrsqrtss", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x53 */ NORMAL("vrcpps/vrcpss", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x54 */ NORMAL("vandps/vandpd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x55 */ NORMAL("vandnps/vandnpd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x56 */ NORMAL("vorps/vorpd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x57 */ NORMAL("vxorps/vxorpd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x58 */ NORMAL("vaddps/vaddpd/vaddss/vaddsd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x59 */ NORMAL("vmulps/vmulpd/vmulss/vmulsd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x5A */ NORMAL("vcvtps2pd/vcvtpd2ps/vcvtss2sd/vcvtsd2ss", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x5B */ NORMAL("vcvtdq2ps/vcvtps2dq/vcvttps2dq", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x5C */ NORMAL("vsubps/vsubpd/vsubss/vsubsd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x5D */ NORMAL("vminps/vminpd/vminss/vminsd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x5E */ NORMAL("vdivps/vdivpd/vdivss/vdivsd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x5F */ NORMAL("vmaxps/vmaxpd/vmaxss/vmaxsd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x60 */ NORMAL("vpunpcklbw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x61 */ NORMAL("vpunpcklwd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x62 */ NORMAL("vpunpckldq", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x63 */ NORMAL("vpacksswb", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x64 */ NORMAL("vpcmpgtb", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x65 */ NORMAL("vpcmpgtw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x66 */ NORMAL("vpcmpgtd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x67 */ NORMAL("vpackuswb", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x68 */ NORMAL("vpunpckhbw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x69 */ NORMAL("vpunpckhwd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x6A */ NORMAL("vpunpckhdq", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x6B */ NORMAL("vpackssdw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x6C */ NORMAL("vpunpcklqdq", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x6D */ NORMAL("vpunpckhqdq", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x6E */ NORMAL("vmovd", XMM, RM32_64, __) /* Or vmovq */
+	/* 0x6F */ NORMAL("vmovdqa/vmovdqu", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x70 */ NORMAL("vpshufd/vpshufhw/vpshuflw", XMM_YMM, XMMM128_YMMM256, IMM8)
+	/* 0x71 */ EXTENSION(VEX_0F71)
+	/* 0x72 */ EXTENSION(VEX_0F72)
+	/* 0x73 */ EXTENSION(VEX_0F73)
+	/* 0x74 */ NORMAL("vpcmpeqb", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x75 */ NORMAL("vpcmpeqw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x76 */ NORMAL("vpcmpeqd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x77 */ NORMAL("vzeroupper/vzeroall", __, __, __)
+	/* 0x78 */ UNKNOWN()
+	/* 0x79 */ UNKNOWN()
+	/* 0x7A */ UNKNOWN()
+	/* 0x7B */ UNKNOWN()
+	/* 0x7C */ NORMAL("vhaddpd/vhaddps", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x7D */ NORMAL("vhsubpd/vhsubps", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x7E */ MANDATORY(VEX_0F7E)
+	/* 0x7F */ NORMAL("vmovdqa/vmovdqu", XMMM128_YMMM256, XMM_YMM, __)
+	/* 0x80 */ UNKNOWN()
+	/* 0x81 */ UNKNOWN()
+	/* 0x82 */ UNKNOWN()
+	/* 0x83 */ UNKNOWN()
+	/* 0x84 */ UNKNOWN()
+	/* 0x85 */ UNKNOWN()
+	/* 0x86 */ UNKNOWN()
+	/* 0x87 */ UNKNOWN()
+	/* 0x88 */ UNKNOWN()
+	/* 0x89 */ UNKNOWN()
+	/* 0x8A */ UNKNOWN()
+	/* 0x8B */ UNKNOWN()
+	/* 0x8C */ UNKNOWN()
+	/* 0x8D */ UNKNOWN()
+	/* 0x8E */ UNKNOWN()
+	/* 0x8F */ UNKNOWN()
+	/* 0x90 */ UNKNOWN()
+	/* 0x91 */ UNKNOWN()
+	/* 0x92 */ UNKNOWN()
+	/* 0x93 */ UNKNOWN()
+	/* 0x94 */ UNKNOWN()
+	/* 0x95 */ UNKNOWN()
+	/* 0x96 */ UNKNOWN()
+	/* 0x97 */ UNKNOWN()
+	/* 0x98 */ UNKNOWN()
+	/* 0x99 */ UNKNOWN()
+	/* 0x9A */ UNKNOWN()
+	/* 0x9B */ UNKNOWN()
+	/* 0x9C */ UNKNOWN()
+	/* 0x9D */ UNKNOWN()
+	/* 0x9E */ UNKNOWN()
+	/* 0x9F */ UNKNOWN()
+	/* 0xA0 */ UNKNOWN()
+	/* 0xA1 */ UNKNOWN()
+	/* 0xA2 */ UNKNOWN()
+	/* 0xA3 */ UNKNOWN()
+	/* 0xA4 */ UNKNOWN()
+	/* 0xA5 */ UNKNOWN()
+	/* 0xA6 */ UNKNOWN()
+	/* 0xA7 */ UNKNOWN()
+	/* 0xA8 */ UNKNOWN()
+	/* 0xA9 */ UNKNOWN()
+	/* 0xAA */ UNKNOWN()
+	/* 0xAB */ UNKNOWN()
+	/* 0xAC */ UNKNOWN()
+	/* 0xAD */ UNKNOWN()
+	/* 0xAE */ EXTENSION(VEX_0FAE)
+	/* 0xAF */ UNKNOWN()
+	/* 0xB0 */ UNKNOWN()
+	/* 0xB1 */ UNKNOWN()
+	/* 0xB2 */ UNKNOWN()
+	/* 0xB3 */ UNKNOWN()
+	/* 0xB4 */ UNKNOWN()
+	/* 0xB5 */ UNKNOWN()
+	/* 0xB6 */ UNKNOWN()
+	/* 0xB7 */ UNKNOWN()
+	/* 0xB8 */ UNKNOWN()
+	/* 0xB9 */ UNKNOWN()
+	/* 0xBA */ UNKNOWN()
+	/* 0xBB */ UNKNOWN()
+	/* 0xBC */ UNKNOWN()
+	/* 0xBD */ UNKNOWN()
+	/* 0xBE */ UNKNOWN()
+	/* 0xBF */ UNKNOWN()
+	/* 0xC0 */ UNKNOWN()
+	/* 0xC1 */ UNKNOWN()
+	/* 0xC2 */ NORMAL("vcmpps/vcmppd/vcmpss/vcmpsd", XMM_YMM, XMMM128_YMMM256, IMM8)
+	/* 0xC3 */ UNKNOWN()
+	/* 0xC4 */ NORMAL("vpinsrw", XMM, RM32, IMM8) /* r32/m16 */
+	/* 0xC5 */ NORMAL("vpextrw", R32_64, RM_XMM, IMM8)
+	/* 0xC6 */ NORMAL("vshufps/vshufpd", XMM_YMM, XMMM128_YMMM256, IMM8)
+	/* 0xC7 */ UNKNOWN()
+	/* 0xC8 */ UNKNOWN()
+	/* 0xC9 */ UNKNOWN()
+	/* 0xCA */ UNKNOWN()
+	/* 0xCB */ UNKNOWN()
+	/* 0xCC */ UNKNOWN()
+	/* 0xCD */ UNKNOWN()
+	/* 0xCE */ UNKNOWN()
+	/* 0xCF */ UNKNOWN()
+	/* 0xD0 */ NORMAL("vaddsubpd/vaddsubps", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xD1 */ NORMAL("vpsrlw", XMM_YMM, XMMM128, __)
+	/* 0xD2 */ NORMAL("vpsrld", XMM_YMM, XMMM128, __)
+	/* 0xD3 */ NORMAL("vpsrlq", XMM_YMM, XMMM128, __)
+	/* 0xD4 */ NORMAL("vpaddq", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xD5 */ NORMAL("vpmullw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xD6 */ NORMAL("vmovq", XMMM64, XMM, __)
+	/* 0xD7 */ NORMAL("vpmovmskb", R32_64, RM_XMM_YMM, __)
+	/* 0xD8 */ NORMAL("vpsubusb", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xD9 */ NORMAL("vpsubusw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xDA */ NORMAL("vpminub", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xDB */ NORMAL("vpand", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xDC */ NORMAL("vpaddusb", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xDD */ NORMAL("vpaddusw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xDE */ NORMAL("vpmaxub", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xDF */ NORMAL("vpandn", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xE0 */ NORMAL("vpavgb", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xE1 */ NORMAL("vpsraw", XMM_YMM, XMMM128, __)
+	/* 0xE2 */ NORMAL("vpsrad", XMM_YMM, XMMM128, __)
+	/* 0xE3 */ NORMAL("vpavgw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xE4 */ NORMAL("vpmulhuw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xE5 */ NORMAL("vpmulhw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xE6 */ NORMAL("vcvttpd2dq/vcvtdq2pd/vcvtpd2dq", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xE7 */ NORMAL("vmovntdq", M128_256, XMM_YMM, __)
+	/* 0xE8 */ NORMAL("vpsubsb", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xE9 */ NORMAL("vpsubsw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xEA */ NORMAL("vpminsw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xEB */ NORMAL("vpor", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xEC */ NORMAL("vpaddsb", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xED */ NORMAL("vpaddsw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xEE */ NORMAL("vpmaxsw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xEF */ NORMAL("vpxor", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xF0 */ NORMAL("vlddqu", XMM_YMM, M128_256, __)
+	/* 0xF1 */ NORMAL("vpsllw", XMM_YMM, XMMM128, __)
+	/* 0xF2 */ NORMAL("vpslld", XMM_YMM, XMMM128, __)
+	/* 0xF3 */ NORMAL("vpsllq", XMM_YMM, XMMM128, __)
+	/* 0xF4 */ NORMAL("vpmuludq", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xF5 */ NORMAL("vpmaddwd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xF6 */ NORMAL("vpsadbw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xF7 */ NORMAL_MOREREG("vmaskmovdqu", XMM, RM_XMM, __, REG_DI)
+	/* 0xF8 */ NORMAL("vpsubb", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xF9 */ NORMAL("vpsubw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xFA */ NORMAL("vpsubd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xFB */ NORMAL("vpsubq", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xFC */ NORMAL("vpaddb", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xFD */ NORMAL("vpaddw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xFE */ NORMAL("vpaddd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xFF */ UNKNOWN()
+};
+
+static const struct instruction_desc extension_VEX_0F38F3[8] =
+{
+	/* 0 */ UNKNOWN()
+	/* 1 */ NORMAL("blsr", RM32_64, __, __)
+	/* 2 */ NORMAL("blsmsk", RM32_64, __, __)
+	/* 3 */ NORMAL("blsi", RM32_64, __, __)
+	/* 4 */ UNKNOWN()
+	/* 5 */ UNKNOWN()
+	/* 6 */ UNKNOWN()
+	/* 7 */ UNKNOWN()
+};
+
+/* VEX encoded instructions in 0F 38 map */
+const struct instruction_desc vex_inst_0x0F38[256] =
+{
+	/* 0x00 */ NORMAL("vpshufb", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x01 */ NORMAL("vphaddw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x02 */ NORMAL("vphaddd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x03 */ NORMAL("vphaddsw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x04 */ NORMAL("vpmaddubsw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x05 */ NORMAL("vphsubw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x06 */ NORMAL("vphsubd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x07 */ NORMAL("vphsubsw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x08 */ NORMAL("vpsignb", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x09 */ NORMAL("vpsignw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x0A */ NORMAL("vpsignd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x0B */ NORMAL("vpmulhrsw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x0C */ NORMAL("vpermilps", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x0D */ NORMAL("vpermilpd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x0E */ NORMAL("vtestps", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x0F */ NORMAL("vtestpd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x10 */ UNKNOWN()
+	/* 0x11 */ UNKNOWN()
+	/* 0x12 */ UNKNOWN()
+	/* 0x13 */ NORMAL("vcvtph2ps", XMM_YMM, XMMM128, __)
+	/* 0x14 */ UNKNOWN()
+	/* 0x15 */ UNKNOWN()
+	/* 0x16 */ NORMAL("vpermps", YMM, YMMM256, __)
+	/* 0x17 */ NORMAL("vptest", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x18 */ NORMAL("vbroadcastss", XMM_YMM, XMMM32, __)
+	/* 0x19 */ NORMAL("vbroadcastsd", YMM, XMMM64, __)
+	/* 0x1A */ NORMAL("vbroadcastf128", YMM, M128, __)
+	/* 0x1B */ UNKNOWN()
+	/* 0x1C */ NORMAL("vpabsb", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x1D */ NORMAL("vpabsw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x1E */ NORMAL("vpabsd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x1F */ UNKNOWN()
+	/* 0x20 */ NORMAL("vpmovsxbw", XMM_YMM, XMMM128, __)
+	/* 0x21 */ NORMAL("vpmovsxbd", XMM_YMM, XMMM64, __)
+	/* 0x22 */ NORMAL("vpmovsxbq", XMM_YMM, XMMM32, __)
+	/* 0x23 */ NORMAL("vpmovsxwd", XMM_YMM, XMMM128, __)
+	/* 0x24 */ NORMAL("vpmovsxwq", XMM_YMM, XMMM64, __)
+	/* 0x25 */ NORMAL("vpmovsxdq", XMM_YMM, XMMM128, __)
+	/* 0x26 */ UNKNOWN()
+	/* 0x27 */ UNKNOWN()
+	/* 0x28 */ NORMAL("vpmuldq", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x29 */ NORMAL("vpcmpeqq", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x2A */ NORMAL("vmovntdqa", XMM_YMM, M128_256, __)
+	/* 0x2B */ NORMAL("vpackusdw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x2C */ NORMAL("vmaskmovps", XMM_YMM, M128_256, __)
+	/* 0x2D */ NORMAL("vmaskmovpd", XMM_YMM, M128_256, __)
+	/* 0x2E */ NORMAL("vmaskmovps", M128_256, XMM_YMM, __)
+	/* 0x2F */ NORMAL("vmaskmovpd", M128_256, XMM_YMM, __)
+	/* 0x30 */ NORMAL("vpmovzxbw", XMM_YMM, XMMM128, __)
+	/* 0x31 */ NORMAL("vpmovzxbd", XMM_YMM, XMMM64, __)
+	/* 0x32 */ NORMAL("vpmovzxbq", XMM_YMM, XMMM32, __)
+	/* 0x33 */ NORMAL("vpmovzxwd", XMM_YMM, XMMM128, __)
+	/* 0x34 */ NORMAL("vpmovzxwq", XMM_YMM, XMMM64, __)
+	/* 0x35 */ NORMAL("vpmovzxdq", XMM_YMM, XMMM128, __)
+	/* 0x36 */ NORMAL("vpermd", YMM, YMMM256, __)
+	/* 0x37 */ NORMAL("vpcmpgtq", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x38 */ NORMAL("vpminsb", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x39 */ NORMAL("vpminsd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x3A */ NORMAL("vpminuw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x3B */ NORMAL("vpminud", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x3C */ NORMAL("vpmaxsb", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x3D */ NORMAL("vpmaxsd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x3E */ NORMAL("vpmaxuw", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x3F */ NORMAL("vpmaxud", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x40 */ NORMAL("vpmulld", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x41 */ NORMAL("vphminposuw", XMM, XMMM128, __)
+	/* 0x42 */ UNKNOWN()
+	/* 0x43 */ UNKNOWN()
+	/* 0x44 */ UNKNOWN()
+	/* 0x45 */ NORMAL("vpsrlvd/vpsrlvq", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x46 */ NORMAL("vpsravd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x47 */ NORMAL("vpsllvd/vpsllvq", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x48 */ UNKNOWN()
+	/* 0x49 */ UNKNOWN()
+	/* 0x4A */ UNKNOWN()
+	/* 0x4B */ UNKNOWN()
+	/* 0x4C */ UNKNOWN()
+	/* 0x4D */ UNKNOWN()
+	/* 0x4E */ UNKNOWN()
+	/* 0x4F */ UNKNOWN()
+	/* 0x50 */ UNKNOWN()
+	/* 0x51 */ UNKNOWN()
+	/* 0x52 */ UNKNOWN()
+	/* 0x53 */ UNKNOWN()
+	/* 0x54 */ UNKNOWN()
+	/* 0x55 */ UNKNOWN()
+	/* 0x56 */ UNKNOWN()
+	/* 0x57 */ UNKNOWN()
+	/* 0x58 */ NORMAL("vpbroadcastd", XMM_YMM, XMMM32, __)
+	/* 0x59 */ NORMAL("vpbroadcastq", XMM_YMM, XMMM64, __)
+	/* 0x5A */ NORMAL("vbroadcasti128", YMM, M128, __)
+	/* 0x5B */ UNKNOWN()
+	/* 0x5C */ UNKNOWN()
+	/* 0x5D */ UNKNOWN()
+	/* 0x5E */ UNKNOWN()
+	/* 0x5F */ UNKNOWN()
+	/* 0x60 */ UNKNOWN()
+	/* 0x61 */ UNKNOWN()
+	/* 0x62 */ UNKNOWN()
+	/* 0x63 */ UNKNOWN()
+	/* 0x64 */ UNKNOWN()
+	/* 0x65 */ UNKNOWN()
+	/* 0x66 */ UNKNOWN()
+	/* 0x67 */ UNKNOWN()
+	/* 0x68 */ UNKNOWN()
+	/* 0x69 */ UNKNOWN()
+	/* 0x6A */ UNKNOWN()
+	/* 0x6B */ UNKNOWN()
+	/* 0x6C */ UNKNOWN()
+	/* 0x6D */ UNKNOWN()
+	/* 0x6E */ UNKNOWN()
+	/* 0x6F */ UNKNOWN()
+	/* 0x70 */ UNKNOWN()
+	/* 0x71 */ UNKNOWN()
+	/* 0x72 */ UNKNOWN()
+	/* 0x73 */ UNKNOWN()
+	/* 0x74 */ UNKNOWN()
+	/* 0x75 */ UNKNOWN()
+	/* 0x76 */ UNKNOWN()
+	/* 0x77 */ UNKNOWN()
+	/* 0x78 */ NORMAL("vpbroadcastb", XMM_YMM, XMMM8, __)
+	/* 0x79 */ NORMAL("vpbroadcastw", XMM_YMM, XMMM16, __)
+	/* 0x7A */ UNKNOWN()
+	/* 0x7B */ UNKNOWN()
+	/* 0x7C */ UNKNOWN()
+	/* 0x7D */ UNKNOWN()
+	/* 0x7E */ UNKNOWN()
+	/* 0x7F */ UNKNOWN()
+	/* 0x80 */ UNKNOWN()
+	/* 0x81 */ UNKNOWN()
+	/* 0x82 */ UNKNOWN()
+	/* 0x83 */ UNKNOWN()
+	/* 0x84 */ UNKNOWN()
+	/* 0x85 */ UNKNOWN()
+	/* 0x86 */ UNKNOWN()
+	/* 0x87 */ UNKNOWN()
+	/* 0x88 */ UNKNOWN()
+	/* 0x89 */ UNKNOWN()
+	/* 0x8A */ UNKNOWN()
+	/* 0x8B */ UNKNOWN()
+	/* 0x8C */ NORMAL("vpmaskmovd/vpmaskmovq", XMM_YMM, M128_256, __)
+	/* 0x8D */ UNKNOWN()
+	/* 0x8E */ NORMAL("vpmaskmovd/vpmaskmovq", M128_256, XMM_YMM, __)
+	/* 0x8F */ UNKNOWN()
+	/* 0x90 */ NORMAL("vpgatherdd/vpgatherdq", XMM_YMM, M, __) /* VSIB */
+	/* 0x91 */ NORMAL("vpgatherqd/vpgatherqq", XMM_YMM, M, __) /* VSIB */
+	/* 0x92 */ NORMAL("vgatherdps/vgatherdpd", XMM_YMM, M, __) /* VSIB */
+	/* 0x93 */ NORMAL("vgatherqps/vgatherqpd", XMM_YMM, M, __) /* VSIB */
+	/* 0x94 */ UNKNOWN()
+	/* 0x95 */ UNKNOWN()
+	/* 0x96 */ NORMAL("vfmaddsub132ps/vfmaddsub132pd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x97 */ NORMAL("vfmsubadd132ps/vfmsubadd132pd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x98 */ NORMAL("vfmadd132ps/vfmadd132pd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x99 */ NORMAL("vfmadd132ss/vfmadd132sd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x9A */ NORMAL("vfmsub132ps/vfmsub132pd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x9B */ NORMAL("vfmsub132ss/vfmsub132sd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x9C */ NORMAL("vfnmadd132ps/vfnmadd132pd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x9D */ NORMAL("vfnmadd132ss/vfnmadd132sd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x9E */ NORMAL("vfnmsub132ps/vfnmsub132pd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0x9F */ NORMAL("vfnmsub132ss/vfnmsub132sd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xA0 */ UNKNOWN()
+	/* 0xA1 */ UNKNOWN()
+	/* 0xA2 */ UNKNOWN()
+	/* 0xA3 */ UNKNOWN()
+	/* 0xA4 */ UNKNOWN()
+	/* 0xA5 */ UNKNOWN()
+	/* 0xA6 */ NORMAL("vfmaddsub213ps/vfmaddsub213pd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xA7 */ NORMAL("vfmsubadd213ps/vfmsubadd213pd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xA8 */ NORMAL("vfmadd213ps/vfmadd213pd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xA9 */ NORMAL("vfmadd213ss/vfmadd213sd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xAA */ NORMAL("vfmsub213ps/vfmsub213pd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xAB */ NORMAL("vfmsub213ss/vfmsub213sd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xAC */ NORMAL("vfnmadd213ps/vfnmadd213pd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xAD */ NORMAL("vfnmadd213ss/vfnmadd213sd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xAE */ NORMAL("vfnmsub213ps/vfnmsub213pd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xAF */ NORMAL("vfnmsub213ss/vfnmsub213sd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xB0 */ UNKNOWN()
+	/* 0xB1 */ UNKNOWN()
+	/* 0xB2 */ UNKNOWN()
+	/* 0xB3 */ UNKNOWN()
+	/* 0xB4 */ UNKNOWN()
+	/* 0xB5 */ UNKNOWN()
+	/* 0xB6 */ NORMAL("vfmaddsub231ps/vfmaddsub231pd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xB7 */ NORMAL("vfmsubadd231ps/vfmsubadd231pd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xB8 */ NORMAL("vfmadd231ps/vfmadd231pd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xB9 */ NORMAL("vfmadd231ss/vfmadd231sd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xBA */ NORMAL("vfmsub231ps/vfmsub231pd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xBB */ NORMAL("vfmsub231ss/vfmsub231sd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xBC */ NORMAL("vfnmadd231ps/vfnmadd231pd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xBD */ NORMAL("vfnmadd231ss/vfnmadd231sd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xBE */ NORMAL("vfnmsub231ps/vfnmsub231pd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xBF */ NORMAL("vfnmsub231ss/vfnmsub231sd", XMM_YMM, XMMM128_YMMM256, __)
+	/* 0xC0 */ UNKNOWN()
+	/* 0xC1 */ UNKNOWN()
+	/* 0xC2 */ UNKNOWN()
+	/* 0xC3 */ UNKNOWN()
+	/* 0xC4 */ UNKNOWN()
+	/* 0xC5 */ UNKNOWN()
+	/* 0xC6 */ UNKNOWN()
+	/* 0xC7 */ UNKNOWN()
+	/* 0xC8 */ UNKNOWN()
+	/* 0xC9 */ UNKNOWN()
+	/* 0xCA */ UNKNOWN()
+	/* 0xCB */ UNKNOWN()
+	/* 0xCC */ UNKNOWN()
+	/* 0xCD */ UNKNOWN()
+	/* 0xCE */ UNKNOWN()
+	/* 0xCF */ UNKNOWN()
+	/* 0xD0 */ UNKNOWN()
+	/* 0xD1 */ UNKNOWN()
+	/* 0xD2 */ UNKNOWN()
+	/* 0xD3 */ UNKNOWN()
+	/* 0xD4 */ UNKNOWN()
+	/* 0xD5 */ UNKNOWN()
+	/* 0xD6 */ UNKNOWN()
+	/* 0xD7 */ UNKNOWN()
+	/* 0xD8 */ UNKNOWN()
+	/* 0xD9 */ UNKNOWN()
+	/* 0xDA */ UNKNOWN()
+	/* 0xDB */ NORMAL("vaesimc", XMM, XMMM128, __)
+	/* 0xDC */ NORMAL("vaesenc", XMM, XMMM128, __)
+	/* 0xDD */ NORMAL("vaesenclast", XMM, XMMM128, __)
+	/* 0xDE */ NORMAL("vaesdec", XMM, XMMM128, __)
+	/* 0xDF */ NORMAL("vaesdeclast", XMM, XMMM128, __)
+	/* 0xE0 */ UNKNOWN()
+	/* 0xE1 */ UNKNOWN()
+	/* 0xE2 */ UNKNOWN()
+	/* 0xE3 */ UNKNOWN()
+	/* 0xE4 */ UNKNOWN()
+	/* 0xE5 */ UNKNOWN()
+	/* 0xE6 */ UNKNOWN()
+	/* 0xE7 */ UNKNOWN()
+	/* 0xE8 */ UNKNOWN()
+	/* 0xE9 */ UNKNOWN()
+	/* 0xEA */ UNKNOWN()
+	/* 0xEB */ UNKNOWN()
+	/* 0xEC */ UNKNOWN()
+	/* 0xED */ UNKNOWN()
+	/* 0xEE */ UNKNOWN()
+	/* 0xEF */ UNKNOWN()
+	/* 0xF0 */ UNKNOWN()
+	/* 0xF1 */ UNKNOWN()
+	/* 0xF2 */ NORMAL("andn", R32_64, RM32_64, __)
+	/* 0xF3 */ EXTENSION(VEX_0F38F3)
+	/* 0xF4 */ UNKNOWN()
+	/* 0xF5 */ NORMAL("bzhi/pext/pdep", R32_64, RM32_64, __)
+	/* 0xF6 */ NORMAL_MOREREG("mulx", R32_64, RM32_64, __, REG_DX)
+	/* 0xF7 */ NORMAL("bextr/shlx/sarx/shrx", R32_64, RM32_64, __)
+	/* 0xF8 */ UNKNOWN()
+	/* 0xF9 */ UNKNOWN()
+	/* 0xFA */ UNKNOWN()
+	/* 0xFB */ UNKNOWN()
+	/* 0xFC */ UNKNOWN()
+	/* 0xFD */ UNKNOWN()
+	/* 0xFE */ UNKNOWN()
+	/* 0xFF */ UNKNOWN()
+};
+
+/* VEX encoded instructions in 0F 3A map */
+const struct instruction_desc vex_inst_0x0F3A[256] =
+{
+	/* 0x00 */ NORMAL("vpermq", YMM, YMMM256, IMM8)
+	/* 0x01 */ NORMAL("vpermpd", YMM, YMMM256, IMM8)
+	/* 0x02 */ NORMAL("vpblendd", XMM_YMM, XMMM128_YMMM256, IMM8)
+	/* 0x03 */ UNKNOWN()
+	/* 0x04 */ NORMAL("vpermilps", XMM_YMM, XMMM128_YMMM256, IMM8)
+	/* 0x05 */ NORMAL("vpermilpd", XMM_YMM, XMMM128_YMMM256, IMM8)
+	/* 0x06 */ NORMAL("vperm2f128", YMM, YMMM256, IMM8)
+	/* 0x07 */ UNKNOWN()
+	/* 0x08 */ NORMAL("vroundps", XMM_YMM, XMMM128_YMMM256, IMM8)
+	/* 0x09 */ NORMAL("vroundpd", XMM_YMM, XMMM128_YMMM256, IMM8)
+	/* 0x0A */ NORMAL("vroundss", XMM_YMM, XMMM128_YMMM256, IMM8)
+	/* 0x0B */ NORMAL("vroundsd", XMM_YMM, XMMM128_YMMM256, IMM8)
+	/* 0x0C */ NORMAL("vblendps", XMM_YMM, XMMM128_YMMM256, IMM8)
+	/* 0x0D */ NORMAL("vblendpd", XMM_YMM, XMMM128_YMMM256, IMM8)
+	/* 0x0E */ NORMAL("vpblendw", XMM_YMM, XMMM128_YMMM256, IMM8)
+	/* 0x0F */ NORMAL("vpalignr", XMM_YMM, XMMM128_YMMM256, IMM8)
+	/* 0x10 */ UNKNOWN()
+	/* 0x11 */ UNKNOWN()
+	/* 0x12 */ UNKNOWN()
+	/* 0x13 */ UNKNOWN()
+	/* 0x14 */ NORMAL("vpextrb", RM32, XMM, IMM8) /* r32/m8 */
+	/* 0x15 */ NORMAL("vpextrw", RM32, XMM, IMM8) /* r32/m16 */
+	/* 0x16 */ NORMAL("vpextrd", RM32_64, XMM, IMM8) /* VPEXTRQ */
+	/* 0x17 */ NORMAL("vextractps", RM32, XMM, IMM8)
+	/* 0x18 */ NORMAL("vinsertf128", YMM, XMMM128, IMM8)
+	/* 0x19 */ NORMAL("vextractf128", XMMM128, YMM, IMM8)
+	/* 0x1A */ UNKNOWN()
+	/* 0x1B */ UNKNOWN()
+	/* 0x1C */ UNKNOWN()
+	/* 0x1D */ NORMAL("vcvtps2ph", XMMM128, XMM_YMM, IMM8)
+	/* 0x1E */ UNKNOWN()
+	/* 0x1F */ UNKNOWN()
+	/* 0x20 */ NORMAL("vpinsrb", XMM, RM32, IMM8) /* r32/m8 */
+	/* 0x21 */ NORMAL("vinsertps", XMM, XMMM32, IMM8)
+	/* 0x22 */ NORMAL("vpinsrd", XMM, RM32_64, IMM8) /* VPINSRQ */
+	/* 0x23 */ UNKNOWN()
+	/* 0x24 */ UNKNOWN()
+	/* 0x25 */ UNKNOWN()
+	/* 0x26 */ UNKNOWN()
+	/* 0x27 */ UNKNOWN()
+	/* 0x28 */ UNKNOWN()
+	/* 0x29 */ UNKNOWN()
+	/* 0x2A */ UNKNOWN()
+	/* 0x2B */ UNKNOWN()
+	/* 0x2C */ UNKNOWN()
+	/* 0x2D */ UNKNOWN()
+	/* 0x2E */ UNKNOWN()
+	/* 0x2F */ UNKNOWN()
+	/* 0x30 */ UNKNOWN()
+	/* 0x31 */ UNKNOWN()
+	/* 0x32 */ UNKNOWN()
+	/* 0x33 */ UNKNOWN()
+	/* 0x34 */ UNKNOWN()
+	/* 0x35 */ UNKNOWN()
+	/* 0x36 */ UNKNOWN()
+	/* 0x37 */ UNKNOWN()
+	/* 0x38 */ NORMAL("vinserti128", YMM, XMMM128, IMM8)
+	/* 0x39 */ NORMAL("vextracti128", XMMM128, YMM, IMM8)
+	/* 0x3A */ UNKNOWN()
+	/* 0x3B */ UNKNOWN()
+	/* 0x3C */ UNKNOWN()
+	/* 0x3D */ UNKNOWN()
+	/* 0x3E */ UNKNOWN()
+	/* 0x3F */ UNKNOWN()
+	/* 0x40 */ NORMAL("vdpps", XMM_YMM, XMMM128_YMMM256, IMM8)
+	/* 0x41 */ NORMAL("vdppd", XMM, XMMM128, IMM8)
+	/* 0x42 */ NORMAL("vmpsadbw", XMM_YMM, XMMM128_YMMM256, IMM8)
+	/* 0x43 */ UNKNOWN()
+	/* 0x44 */ NORMAL("vpclmulqdq", XMM, XMMM128, IMM8)
+	/* 0x45 */ UNKNOWN()
+	/* 0x46 */ NORMAL("vperm2i128", YMM, YMMM256, IMM8)
+	/* 0x47 */ UNKNOWN()
+	/* 0x48 */ UNKNOWN()
+	/* 0x49 */ UNKNOWN()
+	/* 0x4A */ NORMAL("vblendvps", XMM_YMM, XMMM128_YMMM256, IMM8) /* is4 */
+	/* 0x4B */ NORMAL("vblendvpd", XMM_YMM, XMMM128_YMMM256, IMM8) /* is4 */
+	/* 0x4C */ NORMAL("vpblendvb", XMM_YMM, XMMM128_YMMM256, IMM8) /* is4 */
+	/* 0x4D */ UNKNOWN()
+	/* 0x4E */ UNKNOWN()
+	/* 0x4F */ UNKNOWN()
+	/* 0x50 */ UNKNOWN()
+	/* 0x51 */ UNKNOWN()
+	/* 0x52 */ UNKNOWN()
+	/* 0x53 */ UNKNOWN()
+	/* 0x54 */ UNKNOWN()
+	/* 0x55 */ UNKNOWN()
+	/* 0x56 */ UNKNOWN()
+	/* 0x57 */ UNKNOWN()
+	/* 0x58 */ UNKNOWN()
+	/* 0x59 */ UNKNOWN()
+	/* 0x5A */ UNKNOWN()
+	/* 0x5B */ UNKNOWN()
+	/* 0x5C */ UNKNOWN()
+	/* 0x5D */ UNKNOWN()
+	/* 0x5E */ UNKNOWN()
+	/* 0x5F */ UNKNOWN()
+	/* 0x60 */ NORMAL("vpcmpestrm", XMM, XMMM128, IMM8)
+	/* 0x61 */ NORMAL("vpcmpestri", XMM, XMMM128, IMM8)
+	/* 0x62 */ NORMAL("vpcmpistrm", XMM, XMMM128, IMM8)
+	/* 0x63 */ NORMAL("vpcmpistri", XMM, XMMM128, IMM8)
+	/* 0x64 */ UNKNOWN()
+	/* 0x65 */ UNKNOWN()
+	/* 0x66 */ UNKNOWN()
+	/* 0x67 */ UNKNOWN()
+	/* 0x68 */ UNKNOWN()
+	/* 0x69 */ UNKNOWN()
+	/* 0x6A */ UNKNOWN()
+	/* 0x6B */ UNKNOWN()
+	/* 0x6C */ UNKNOWN()
+	/* 0x6D */ UNKNOWN()
+	/* 0x6E */ UNKNOWN()
+	/* 0x6F */ UNKNOWN()
+	/* 0x70 */ UNKNOWN()
+	/* 0x71 */ UNKNOWN()
+	/* 0x72 */ UNKNOWN()
+	/* 0x73 */ UNKNOWN()
+	/* 0x74 */ UNKNOWN()
+	/* 0x75 */ UNKNOWN()
+	/* 0x76 */ UNKNOWN()
+	/* 0x77 */ UNKNOWN()
+	/* 0x78 */ UNKNOWN()
+	/* 0x79 */ UNKNOWN()
+	/* 0x7A */ UNKNOWN()
+	/* 0x7B */ UNKNOWN()
+	/* 0x7C */ UNKNOWN()
+	/* 0x7D */ UNKNOWN()
+	/* 0x7E */ UNKNOWN()
+	/* 0x7F */ UNKNOWN()
+	/* 0x80 */ UNKNOWN()
+	/* 0x81 */ UNKNOWN()
+	/* 0x82 */ UNKNOWN()
+	/* 0x83 */ UNKNOWN()
+	/* 0x84 */ UNKNOWN()
+	/* 0x85 */ UNKNOWN()
+	/* 0x86 */ UNKNOWN()
+	/* 0x87 */ UNKNOWN()
+	/* 0x88 */ UNKNOWN()
+	/* 0x89 */ UNKNOWN()
+	/* 0x8A */ UNKNOWN()
+	/* 0x8B */ UNKNOWN()
+	/* 0x8C */ UNKNOWN()
+	/* 0x8D */ UNKNOWN()
+	/* 0x8E */ UNKNOWN()
+	/* 0x8F */ UNKNOWN()
+	/* 0x90 */ UNKNOWN()
+	/* 0x91 */ UNKNOWN()
+	/* 0x92 */ UNKNOWN()
+	/* 0x93 */ UNKNOWN()
+	/* 0x94 */ UNKNOWN()
+	/* 0x95 */ UNKNOWN()
+	/* 0x96 */ UNKNOWN()
+	/* 0x97 */ UNKNOWN()
+	/* 0x98 */ UNKNOWN()
+	/* 0x99 */ UNKNOWN()
+	/* 0x9A */ UNKNOWN()
+	/* 0x9B */ UNKNOWN()
+	/* 0x9C */ UNKNOWN()
+	/* 0x9D */ UNKNOWN()
+	/* 0x9E */ UNKNOWN()
+	/* 0x9F */ UNKNOWN()
+	/* 0xA0 */ UNKNOWN()
+	/* 0xA1 */ UNKNOWN()
+	/* 0xA2 */ UNKNOWN()
+	/* 0xA3 */ UNKNOWN()
+	/* 0xA4 */ UNKNOWN()
+	/* 0xA5 */ UNKNOWN()
+	/* 0xA6 */ UNKNOWN()
+	/* 0xA7 */ UNKNOWN()
+	/* 0xA8 */ UNKNOWN()
+	/* 0xA9 */ UNKNOWN()
+	/* 0xAA */ UNKNOWN()
+	/* 0xAB */ UNKNOWN()
+	/* 0xAC */ UNKNOWN()
+	/* 0xAD */ UNKNOWN()
+	/* 0xAE */ UNKNOWN()
+	/* 0xAF */ UNKNOWN()
+	/* 0xB0 */ UNKNOWN()
+	/* 0xB1 */ UNKNOWN()
+	/* 0xB2 */ UNKNOWN()
+	/* 0xB3 */ UNKNOWN()
+	/* 0xB4 */ UNKNOWN()
+	/* 0xB5 */ UNKNOWN()
+	/* 0xB6 */ UNKNOWN()
+	/* 0xB7 */ UNKNOWN()
+	/* 0xB8 */ UNKNOWN()
+	/* 0xB9 */ UNKNOWN()
+	/* 0xBA */ UNKNOWN()
+	/* 0xBB */ UNKNOWN()
+	/* 0xBC */ UNKNOWN()
+	/* 0xBD */ UNKNOWN()
+	/* 0xBE */ UNKNOWN()
+	/* 0xBF */ UNKNOWN()
+	/* 0xC0 */ UNKNOWN()
+	/* 0xC1 */ UNKNOWN()
+	/* 0xC2 */ UNKNOWN()
+	/* 0xC3 */ UNKNOWN()
+	/* 0xC4 */ UNKNOWN()
+	/* 0xC5 */ UNKNOWN()
+	/* 0xC6 */ UNKNOWN()
+	/* 0xC7 */ UNKNOWN()
+	/* 0xC8 */ UNKNOWN()
+	/* 0xC9 */ UNKNOWN()
+	/* 0xCA */ UNKNOWN()
+	/* 0xCB */ UNKNOWN()
+	/* 0xCC */ UNKNOWN()
+	/* 0xCD */ UNKNOWN()
+	/* 0xCE */ UNKNOWN()
+	/* 0xCF */ UNKNOWN()
+	/* 0xD0 */ UNKNOWN()
+	/* 0xD1 */ UNKNOWN()
+	/* 0xD2 */ UNKNOWN()
+	/* 0xD3 */ UNKNOWN()
+	/* 0xD4 */ UNKNOWN()
+	/* 0xD5 */ UNKNOWN()
+	/* 0xD6 */ UNKNOWN()
+	/* 0xD7 */ UNKNOWN()
+	/* 0xD8 */ UNKNOWN()
+	/* 0xD9 */ UNKNOWN()
+	/* 0xDA */ UNKNOWN()
+	/* 0xDB */ UNKNOWN()
+	/* 0xDC */ UNKNOWN()
+	/* 0xDD */ UNKNOWN()
+	/* 0xDE */ UNKNOWN()
+	/* 0xDF */ NORMAL("vaeskeygenassist", XMM, XMMM128, IMM8)
+	/* 0xE0 */ UNKNOWN()
+	/* 0xE1 */ UNKNOWN()
+	/* 0xE2 */ UNKNOWN()
+	/* 0xE3 */ UNKNOWN()
+	/* 0xE4 */ UNKNOWN()
+	/* 0xE5 */ UNKNOWN()
+	/* 0xE6 */ UNKNOWN()
+	/* 0xE7 */ UNKNOWN()
+	/* 0xE8 */ UNKNOWN()
+	/* 0xE9 */ UNKNOWN()
+	/* 0xEA */ UNKNOWN()
+	/* 0xEB */ UNKNOWN()
+	/* 0xEC */ UNKNOWN()
+	/* 0xED */ UNKNOWN()
+	/* 0xEE */ UNKNOWN()
+	/* 0xEF */ UNKNOWN()
+	/* 0xF0 */ NORMAL("rorx", R32_64, RM32_64, IMM8)
+	/* 0xF1 */ UNKNOWN()
+	/* 0xF2 */ UNKNOWN()
+	/* 0xF3 */ UNKNOWN()
+	/* 0xF4 */ UNKNOWN()
+	/* 0xF5 */ UNKNOWN()
+	/* 0xF6 */ UNKNOWN()
+	/* 0xF7 */ UNKNOWN()
+	/* 0xF8 */ UNKNOWN()
+	/* 0xF9 */ UNKNOWN()
+	/* 0xFA */ UNKNOWN()
+	/* 0xFB */ UNKNOWN()
+	/* 0xFC */ UNKNOWN()
+	/* 0xFD */ UNKNOWN()
+	/* 0xFE */ UNKNOWN()
+	/* 0xFF */ UNKNOWN()
+};
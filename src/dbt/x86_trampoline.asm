@@ -46,6 +46,29 @@ dbt_find_direct_internal PROC ; pc, patch_addr
 	jmp dword ptr [dbt_return_trampoline]
 dbt_find_direct_internal ENDP
 
+EXTERN dbt_find_hot:NEAR
+dbt_find_hot_internal PROC ; pc, patch_addr
+	; save context
+	push eax
+	push ecx
+	push edx
+	pushfd
+	; copy pc and patch_addr
+	mov ecx, [esp+20]
+	mov edx, [esp+16]
+	push ecx
+	push edx
+	call dbt_find_hot
+	lea esp, [esp+8]
+	; restore context
+	popfd
+	pop edx
+	pop ecx
+	pop eax
+	lea esp, [esp+8] ; we have two extra argument garbage at the stack
+	jmp dword ptr [dbt_return_trampoline]
+dbt_find_hot_internal ENDP
+
 EXTERN dbt_find_next:NEAR
 dbt_find_indirect_internal PROC
 	; save context
@@ -86,6 +109,102 @@ dbt_sieve_fallback PROC
 	jmp dword ptr [dbt_return_trampoline]
 dbt_sieve_fallback ENDP
 
+EXTERN dbt_find_next_ibtc:NEAR
+dbt_ibtc_fallback PROC
+	; stack: address
+	; stack: ecx
+	; stack: return address (inside ibtc stub)
+	push eax
+	push edx
+	pushfd
+	mov ecx, [esp+3*4] ; return address
+	mov eax, [esp+5*4] ; original address
+	push ecx
+	push eax
+	call dbt_find_next_ibtc
+	lea esp, [esp+8]
+	; restore context
+	popfd
+	pop edx
+	pop eax
+	lea esp, [esp+4]
+	pop ecx
+	lea esp, [esp+4]
+	jmp dword ptr [dbt_return_trampoline]
+dbt_ibtc_fallback ENDP
+
+EXTERN dbt_mov_to_gs:NEAR
+dbt_mov_to_gs_internal PROC
+	; stack: new gs value
+	; stack: next address
+	push eax
+	push ecx
+	push edx
+	pushfd
+	mov ecx, [esp+16] ; new gs value
+	push ecx
+	call dbt_mov_to_gs
+	lea esp, [esp+4]
+	; restore context
+	popfd
+	pop edx
+	pop ecx
+	pop eax
+	lea esp, [esp+4]
+	jmp dbt_find_indirect_internal
+dbt_mov_to_gs_internal ENDP
+
+; Same as dbt_mov_to_gs_internal, used when the next instruction overwrites the flags
+dbt_mov_to_gs_nf_internal PROC
+	; stack: new gs value
+	; stack: next address
+	push eax
+	push ecx
+	push edx
+	mov ecx, [esp+12] ; new gs value
+	push ecx
+	call dbt_mov_to_gs
+	lea esp, [esp+4]
+	; restore context
+	pop edx
+	pop ecx
+	pop eax
+	lea esp, [esp+4]
+	jmp dbt_find_indirect_internal
+dbt_mov_to_gs_nf_internal ENDP
+
+EXTERN dbt_syscall_fast_return:NEAR
+dbt_syscall_fast_internal PROC
+	; stack: return address
+	; stack: syscall handler
+	; stack: next address
+	pushfd
+	push ecx
+	push edx
+	; push arguments
+	push ebp
+	push edi
+	push esi
+	push edx
+	push ecx
+	push ebx
+	call dword ptr [esp + 40]
+	lea esp, [esp + 24]
+	push eax
+	; set up return address, this also checks for pending signals
+	push [esp + 16] ; return address
+	push [esp + 28] ; next address
+	call dbt_syscall_fast_return
+	lea esp, [esp + 8]
+	; restore context
+	pop eax
+	pop edx
+	pop ecx
+	popfd
+	lea esp, [esp + 12]
+	jmp dword ptr [dbt_return_trampoline]
+dbt_syscall_fast_internal ENDP
+
 ; TODO: Return through return trampoline
 EXTERN dbt_cpuid:NEAR
 dbt_cpuid_internal PROC
@@ -143,13 +262,22 @@ sys_clone PROC
 sys_clone ENDP
 
 EXTERN syscall_table: DWORD
+EXTERN syscall_stats_begin: NEAR
+EXTERN syscall_stats_end: NEAR
 syscall_handler PROC
 	; save context
 	push ecx
 	push edx
 	; test validity
-	cmp eax, 359
+	cmp eax, 378
 	jae out_of_range
+	; record syscall start time, ecx and edx are clobbered
+	push eax
+	push eax
+	call syscall_stats_begin
+	lea esp, [esp + 4]
+	pop eax
+	mov ecx, [esp + 4]
 
 	; push esp and eip context in case of fork()
 	push [esp + 8]
@@ -167,6 +295,10 @@ syscall_handler PROC
 	call [syscall_table + eax * 4]
 syscall_done::
 	lea esp, [esp + 32]
+	; record syscall result and latency
+	push eax
+	call syscall_stats_end
+	pop eax
 	; restore context
 	pop edx
 	pop ecx
@@ -0,0 +1,322 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <etw.h>
+#include <log.h>
+
+#include <string.h>
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <evntprov.h>
+
+/* TraceLogging event layout
+ * A TraceLogging event is a classic ETW event on channel 11 whose first data descriptors
+ * carry its schema: provider metadata (UINT16 size, name) and event metadata (UINT16 size,
+ * tags byte, event name, then a name and an input type byte for each field). The payload
+ * fields follow in the same order. The TraceLogging headers of recent SDKs produce exactly
+ * this, it is written by hand here to keep building with older SDKs.
+ *
+ * The ntdll exports are used instead of advapi32, which is delay loaded and kept out of
+ * startup. Windows 10 takes the provider metadata from its own descriptor after the provider
+ * opted in with EventProviderUseDescriptorType, earlier versions get it once as provider
+ * traits and only see the event metadata, as the first payload item.
+ */
+
+#define ETW_CHANNEL_TRACELOGGING	11
+
+/* Input types, values of the _tlgIn enumeration */
+#define ETW_IN_ANSISTRING	2
+#define ETW_IN_INT32		7
+#define ETW_IN_UINT32		8
+#define ETW_IN_UINT64		10
+#define ETW_IN_BOOL32		13
+#define ETW_IN_HEXINT64		21
+
+/* EVENT_INFO_CLASS and descriptor types, not declared by older SDKs */
+#define ETW_INFO_PROVIDER_SET_TRAITS			2
+#define ETW_INFO_PROVIDER_USE_DESCRIPTOR_TYPE	3
+#define ETW_DESCRIPTOR_TYPE_EVENT_METADATA		1
+#define ETW_DESCRIPTOR_TYPE_PROVIDER_METADATA	2
+
+#define ETW_MAX_FIELDS		6
+#define ETW_METADATA_SIZE	128
+
+typedef ULONG (NTAPI EtwEventRegister_t)(LPCGUID ProviderId, PENABLECALLBACK EnableCallback, PVOID CallbackContext, PREGHANDLE RegHandle);
+typedef ULONG (NTAPI EtwEventWriteTransfer_t)(REGHANDLE RegHandle, PCEVENT_DESCRIPTOR EventDescriptor, LPCGUID ActivityId,
+	LPCGUID RelatedActivityId, ULONG UserDataCount, PEVENT_DATA_DESCRIPTOR UserData);
+typedef BOOLEAN (NTAPI EtwEventEnabled_t)(REGHANDLE RegHandle, PCEVENT_DESCRIPTOR EventDescriptor);
+typedef ULONG (NTAPI EtwEventSetInformation_t)(REGHANDLE RegHandle, int InformationClass, PVOID EventInformation, ULONG InformationLength);
+
+/* {1c5436c7-1172-50d3-4fec-92194bb50c1f}, hash of "Flinux" */
+static const GUID etw_provider_guid = { 0x1c5436c7, 0x1172, 0x50d3, { 0x4f, 0xec, 0x92, 0x19, 0x4b, 0xb5, 0x0c, 0x1f } };
+static const char etw_provider_name[] = "Flinux";
+
+struct etw_event
+{
+	EVENT_DESCRIPTOR descriptor;
+	uint16_t metadata_size;
+	char metadata[ETW_METADATA_SIZE];
+};
+
+enum
+{
+	ETW_EVENT_SYSCALL_ENTER,
+	ETW_EVENT_SYSCALL_EXIT,
+	ETW_EVENT_PAGE_FAULT,
+	ETW_EVENT_FORK_PHASE,
+	ETW_EVENT_EXEC_PHASE,
+	ETW_EVENT_DBT_TRANSLATE,
+	ETW_EVENT_DBT_FLUSH,
+	ETW_EVENT_SIGNAL_DELIVERY,
+	ETW_EVENT_COUNT
+};
+
+struct etw_field
+{
+	uint8_t type;
+	const char *name;
+};
+
+static const struct
+{
+	const char *name;
+	uint32_t keyword;
+	UCHAR level;
+	struct etw_field fields[ETW_MAX_FIELDS];
+} etw_event_types[ETW_EVENT_COUNT] =
+{
+	{ "SyscallEnter", ETW_KEYWORD_SYSCALL, TRACE_LEVEL_VERBOSE,
+		{ { ETW_IN_UINT32, "Number" }, { ETW_IN_ANSISTRING, "Name" } } },
+	{ "SyscallExit", ETW_KEYWORD_SYSCALL, TRACE_LEVEL_VERBOSE,
+		{ { ETW_IN_UINT32, "Number" }, { ETW_IN_ANSISTRING, "Name" }, { ETW_IN_INT32, "Result" }, { ETW_IN_UINT64, "DurationNs" } } },
+	{ "PageFault", ETW_KEYWORD_PAGE_FAULT, TRACE_LEVEL_VERBOSE,
+		{ { ETW_IN_HEXINT64, "Address" }, { ETW_IN_UINT32, "Access" }, { ETW_IN_ANSISTRING, "Type" } } },
+	{ "ForkPhase", ETW_KEYWORD_PROCESS, TRACE_LEVEL_INFORMATION,
+		{ { ETW_IN_INT32, "ChildPid" }, { ETW_IN_ANSISTRING, "Phase" }, { ETW_IN_UINT64, "DurationNs" } } },
+	{ "ExecPhase", ETW_KEYWORD_PROCESS, TRACE_LEVEL_INFORMATION,
+		{ { ETW_IN_ANSISTRING, "Filename" }, { ETW_IN_ANSISTRING, "Phase" }, { ETW_IN_UINT64, "DurationNs" } } },
+	{ "DbtTranslate", ETW_KEYWORD_DBT, TRACE_LEVEL_VERBOSE,
+		{ { ETW_IN_HEXINT64, "Pc" }, { ETW_IN_HEXINT64, "EndPc" }, { ETW_IN_UINT32, "Size" }, { ETW_IN_BOOL32, "Hot" } } },
+	{ "DbtFlush", ETW_KEYWORD_DBT, TRACE_LEVEL_INFORMATION,
+		{ { ETW_IN_UINT32, "Blocks" }, { ETW_IN_UINT32, "FlushCount" } } },
+	{ "SignalDelivery", ETW_KEYWORD_SIGNAL, TRACE_LEVEL_INFORMATION,
+		{ { ETW_IN_INT32, "Signal" }, { ETW_IN_INT32, "Code" }, { ETW_IN_HEXINT64, "Handler" } } },
+};
+
+struct etw_data
+{
+	EtwEventWriteTransfer_t *write_transfer;
+	EtwEventEnabled_t *event_enabled;
+	REGHANDLE handle;
+	bool use_descriptor_type;
+	uint16_t provider_metadata_size;
+	char provider_metadata[32];
+	struct etw_event events[ETW_EVENT_COUNT];
+};
+
+static struct etw_data _etw;
+static struct etw_data *const etw = &_etw;
+
+volatile uint32_t etw_keywords;
+
+static void etw_build_metadata(int id)
+{
+	struct etw_event *event = &etw->events[id];
+	char *p = event->metadata + sizeof(uint16_t);
+	*p++ = 0; /* No tags */
+	int len = strlen(etw_event_types[id].name) + 1;
+	memcpy(p, etw_event_types[id].name, len);
+	p += len;
+	for (int i = 0; i < ETW_MAX_FIELDS && etw_event_types[id].fields[i].name; i++)
+	{
+		const struct etw_field *field = &etw_event_types[id].fields[i];
+		len = strlen(field->name) + 1;
+		memcpy(p, field->name, len);
+		p += len;
+		*p++ = field->type;
+	}
+	event->metadata_size = (uint16_t)(p - event->metadata);
+	memcpy(event->metadata, &event->metadata_size, sizeof(uint16_t));
+	EventDescCreate(&event->descriptor, 0, 0, ETW_CHANNEL_TRACELOGGING, etw_event_types[id].level, 0, 0,
+		etw_event_types[id].keyword);
+}
+
+/* Recompute etw_keywords from all sessions, the callback parameters only describe one */
+static void etw_update_keywords()
+{
+	uint32_t keywords = 0;
+	if (etw->handle)
+	{
+		for (int i = 0; i < ETW_EVENT_COUNT; i++)
+			if (etw->event_enabled(etw->handle, &etw->events[i].descriptor))
+				keywords |= etw_event_types[i].keyword;
+	}
+	etw_keywords = keywords;
+}
+
+static void NTAPI etw_enable_callback(LPCGUID SourceId, ULONG IsEnabled, UCHAR Level, ULONGLONG MatchAnyKeyword,
+	ULONGLONG MatchAllKeyword, PEVENT_FILTER_DESCRIPTOR FilterData, PVOID CallbackContext)
+{
+	/* May be called inside EtwEventRegister() before the handle is known, etw_init() updates again */
+	etw_update_keywords();
+}
+
+void etw_init()
+{
+	etw_keywords = 0;
+	HMODULE ntdll = GetModuleHandleW(L"ntdll.dll");
+	EtwEventRegister_t *event_register = (EtwEventRegister_t *)GetProcAddress(ntdll, "EtwEventRegister");
+	EtwEventSetInformation_t *set_information = (EtwEventSetInformation_t *)GetProcAddress(ntdll, "EtwEventSetInformation");
+	etw->write_transfer = (EtwEventWriteTransfer_t *)GetProcAddress(ntdll, "EtwEventWriteTransfer");
+	etw->event_enabled = (EtwEventEnabled_t *)GetProcAddress(ntdll, "EtwEventEnabled");
+	if (!event_register || !etw->write_transfer || !etw->event_enabled)
+	{
+		log_warning("ETW functions not available, tracing disabled.");
+		return;
+	}
+
+	int len = sizeof(etw_provider_name);
+	etw->provider_metadata_size = (uint16_t)(sizeof(uint16_t) + len);
+	memcpy(etw->provider_metadata, &etw->provider_metadata_size, sizeof(uint16_t));
+	memcpy(etw->provider_metadata + sizeof(uint16_t), etw_provider_name, len);
+	for (int i = 0; i < ETW_EVENT_COUNT; i++)
+		etw_build_metadata(i);
+
+	REGHANDLE handle;
+	ULONG status = event_register(&etw_provider_guid, etw_enable_callback, NULL, &handle);
+	if (status != ERROR_SUCCESS)
+	{
+		log_warning("EtwEventRegister() failed, status: %x", status);
+		return;
+	}
+	etw->use_descriptor_type = false;
+	if (set_information)
+	{
+		set_information(handle, ETW_INFO_PROVIDER_SET_TRAITS, etw->provider_metadata, etw->provider_metadata_size);
+		ULONG use = TRUE;
+		etw->use_descriptor_type = set_information(handle, ETW_INFO_PROVIDER_USE_DESCRIPTOR_TYPE, &use, sizeof(use)) == ERROR_SUCCESS;
+	}
+	etw->handle = handle;
+	etw_update_keywords();
+}
+
+static void etw_write(int id, EVENT_DATA_DESCRIPTOR *data, int count)
+{
+	/* data[0] and data[1] are reserved for metadata */
+	struct etw_event *event = &etw->events[id];
+	EventDataDescCreate(&data[1], event->metadata, event->metadata_size);
+	data[1].Reserved = ETW_DESCRIPTOR_TYPE_EVENT_METADATA;
+	if (etw->use_descriptor_type)
+	{
+		EventDataDescCreate(&data[0], etw->provider_metadata, etw->provider_metadata_size);
+		data[0].Reserved = ETW_DESCRIPTOR_TYPE_PROVIDER_METADATA;
+		etw->write_transfer(etw->handle, &event->descriptor, NULL, NULL, count, data);
+	}
+	else
+		etw->write_transfer(etw->handle, &event->descriptor, NULL, NULL, count - 1, data + 1);
+}
+
+static void etw_string(EVENT_DATA_DESCRIPTOR *data, const char *str)
+{
+	EventDataDescCreate(data, str, strlen(str) + 1);
+}
+
+void etw_syscall_enter(int nr, const char *name)
+{
+	EVENT_DATA_DESCRIPTOR data[4];
+	uint32_t number = nr;
+	EventDataDescCreate(&data[2], &number, sizeof(number));
+	etw_string(&data[3], name);
+	etw_write(ETW_EVENT_SYSCALL_ENTER, data, 4);
+}
+
+void etw_syscall_exit(int nr, const char *name, intptr_t result, uint64_t ns)
+{
+	EVENT_DATA_DESCRIPTOR data[6];
+	uint32_t number = nr;
+	int32_t result32 = (int32_t)result;
+	EventDataDescCreate(&data[2], &number, sizeof(number));
+	etw_string(&data[3], name);
+	EventDataDescCreate(&data[4], &result32, sizeof(result32));
+	EventDataDescCreate(&data[5], &ns, sizeof(ns));
+	etw_write(ETW_EVENT_SYSCALL_EXIT, data, 6);
+}
+
+void etw_page_fault(void *addr, int access, const char *type)
+{
+	EVENT_DATA_DESCRIPTOR data[5];
+	uint64_t address = (uintptr_t)addr;
+	uint32_t access32 = access;
+	EventDataDescCreate(&data[2], &address, sizeof(address));
+	EventDataDescCreate(&data[3], &access32, sizeof(access32));
+	etw_string(&data[4], type);
+	etw_write(ETW_EVENT_PAGE_FAULT, data, 5);
+}
+
+void etw_fork_phase(int pid, const char *phase, uint64_t ns)
+{
+	EVENT_DATA_DESCRIPTOR data[5];
+	int32_t pid32 = pid;
+	EventDataDescCreate(&data[2], &pid32, sizeof(pid32));
+	etw_string(&data[3], phase);
+	EventDataDescCreate(&data[4], &ns, sizeof(ns));
+	etw_write(ETW_EVENT_FORK_PHASE, data, 5);
+}
+
+void etw_exec_phase(const char *filename, const char *phase, uint64_t ns)
+{
+	EVENT_DATA_DESCRIPTOR data[5];
+	etw_string(&data[2], filename);
+	etw_string(&data[3], phase);
+	EventDataDescCreate(&data[4], &ns, sizeof(ns));
+	etw_write(ETW_EVENT_EXEC_PHASE, data, 5);
+}
+
+void etw_dbt_translate(size_t pc, size_t end_pc, int size, bool hot)
+{
+	EVENT_DATA_DESCRIPTOR data[6];
+	uint64_t pc64 = pc, end_pc64 = end_pc;
+	uint32_t size32 = size;
+	BOOL hot32 = hot;
+	EventDataDescCreate(&data[2], &pc64, sizeof(pc64));
+	EventDataDescCreate(&data[3], &end_pc64, sizeof(end_pc64));
+	EventDataDescCreate(&data[4], &size32, sizeof(size32));
+	EventDataDescCreate(&data[5], &hot32, sizeof(hot32));
+	etw_write(ETW_EVENT_DBT_TRANSLATE, data, 6);
+}
+
+void etw_dbt_flush(int blocks, int flush_count)
+{
+	EVENT_DATA_DESCRIPTOR data[4];
+	uint32_t blocks32 = blocks, flush_count32 = flush_count;
+	EventDataDescCreate(&data[2], &blocks32, sizeof(blocks32));
+	EventDataDescCreate(&data[3], &flush_count32, sizeof(flush_count32));
+	etw_write(ETW_EVENT_DBT_FLUSH, data, 4);
+}
+
+void etw_signal_delivery(int sig, int code, size_t handler)
+{
+	EVENT_DATA_DESCRIPTOR data[5];
+	int32_t sig32 = sig, code32 = code;
+	uint64_t handler64 = handler;
+	EventDataDescCreate(&data[2], &sig32, sizeof(sig32));
+	EventDataDescCreate(&data[3], &code32, sizeof(code32));
+	EventDataDescCreate(&data[4], &handler64, sizeof(handler64));
+	etw_write(ETW_EVENT_SIGNAL_DELIVERY, data, 5);
+}
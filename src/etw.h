@@ -0,0 +1,55 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Event Tracing for Windows provider "Flinux"
+ * Events are self describing in the TraceLogging format, WPA and tracerpt decode them
+ * without a manifest. The provider guid is derived from the name the same way TraceLogging
+ * does, so sessions can enable it by guid or as "*Flinux", e.g.
+ *   xperf -start flinux -on 1c5436c7-1172-50d3-4fec-92194bb50c1f:0x1f -f flinux.etl
+ * Each event group is a keyword, combine them to select what to record.
+ *
+ * No session enabled: every hook is a test of etw_keywords, which is only written
+ * by the enable callback.
+ */
+#define ETW_KEYWORD_SYSCALL		0x01 /* SyscallEnter/SyscallExit, verbose */
+#define ETW_KEYWORD_PAGE_FAULT	0x02 /* PageFault, verbose */
+#define ETW_KEYWORD_PROCESS		0x04 /* ForkPhase/ExecPhase */
+#define ETW_KEYWORD_DBT			0x08 /* DbtTranslate (verbose) and DbtFlush */
+#define ETW_KEYWORD_SIGNAL		0x10 /* SignalDelivery */
+
+/* Keywords which have at least one session listening at the level of their events */
+extern volatile uint32_t etw_keywords;
+#define etw_enabled(keyword)	((etw_keywords & (keyword)) != 0)
+
+void etw_init();
+
+/* Only call these when etw_enabled() of their keyword is true */
+void etw_syscall_enter(int nr, const char *name);
+void etw_syscall_exit(int nr, const char *name, intptr_t result, uint64_t ns);
+void etw_page_fault(void *addr, int access, const char *type);
+void etw_fork_phase(int pid, const char *phase, uint64_t ns);
+void etw_exec_phase(const char *filename, const char *phase, uint64_t ns);
+void etw_dbt_translate(size_t pc, size_t end_pc, int size, bool hot);
+void etw_dbt_flush(int blocks, int flush_count);
+void etw_signal_delivery(int sig, int code, size_t handler);
@@ -19,17 +19,45 @@
 
 #pragma once
 
+#include <log.h>
+
 #include <stdbool.h>
 
 #define MAX_SESSION_ID_LEN	8
 #define DEFAULT_SESSION_ID	"default"
 
+/* Largest --dbt-cache-size in MB. Every thread may grow its code cache and blocks table to it,
+ * so on x86 it is kept small enough for a few dozen threads to fit in the 32-bit address space.
+ */
+#ifdef _WIN64
+#define MAX_DBT_CACHE_SIZE	256
+#else
+#define MAX_DBT_CACHE_SIZE	32
+#endif
+
 struct _flags
 {
 	char global_session_id[MAX_SESSION_ID_LEN];
 	/* DBT flags */
 	bool dbt_trace;
 	bool dbt_trace_all;
+	int dbt_cache_size; /* Code cache size in MB, 0 for default */
+	bool dbt_pretranslate; /* Eagerly translate direct branch targets */
+	bool dbt_profile; /* Count block executions and report hot blocks */
+	int dbt_sample_interval; /* Sampling profiler interval in milliseconds, 0 to disable */
+	/* MM flags */
+	int mm_fault_around; /* Blocks loaded around a detached block page fault, 0 for default, -1 to disable */
+	bool mm_large_pages; /* Back large anonymous mappings with large pages */
+	/* Timer flags */
+	bool timer_high_res; /* Raise system timer resolution while short sleeps are pending */
+	/* Syscall flags */
+	bool syscall_stats; /* Log a summary of syscall counts and time on exit */
+	/* VFS flags */
+	bool tmpfs_tmp; /* Mount an in-memory tmpfs at /tmp */
+	/* Exec flags */
+	bool exec_prefetch; /* Record files used at startup and prefetch them on the next execve() of the same executable */
+	/* Log flags */
+	unsigned char log_levels[LOG_CAT_COUNT]; /* Minimum level of each log category, updated before fork() */
 };
 
 extern struct _flags *cmdline_flags;
@@ -17,12 +17,15 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_VFS
+
 #include <common/errno.h>
 #include <common/fcntl.h>
 #include <common/ioctls.h>
 #include <common/poll.h>
 #include <common/termios.h>
 #include <fs/console.h>
+#include <fs/tty.h>
 #include <fs/virtual.h>
 #include <syscall/mm.h>
 #include <syscall/process.h>
@@ -35,6 +38,8 @@
 #include <Windows.h>
 #include <ntdll.h>
 #include <malloc.h>
+#include <intrin.h>
+#include <emmintrin.h>
 
 /* xterm like VT terminal emulation on Win32 console
  *
@@ -45,13 +50,35 @@
  * The basic assumption is that no other Win32 console applications are writing
  * to the same console simultaneously. The only thing we need to take care of is
  * when user changes the size of the window during application operation.
+ *
+ * Output does not go to the console directly. While the console lock is held,
+ * the cells of the window are kept in a per process back buffer, and escape
+ * sequences and text only update the buffer and a dirty rectangle. Pending
+ * changes are written with a single WriteConsoleOutputW() when the lock is
+ * released or before waiting for input.
+ *
+ * On consoles supporting ENABLE_VIRTUAL_TERMINAL_PROCESSING (Windows 10+), none
+ * of the above is used. Output is converted to UTF-16 in bulk and handed to the
+ * console host, only the few sequences it does not implement are intercepted.
  */
 
 #define CONSOLE_MAX_PARAMS	16
-#define MAX_INPUT			256
-#define MAX_CANON			256
 #define MAX_STRING			256
 #define DEFAULT_ATTRIBUTE	0
+#define MAX_VT_OUTPUT		4096
+#define INPUT_EVENT_BATCH	256
+
+#ifndef ENABLE_VIRTUAL_TERMINAL_PROCESSING
+#define ENABLE_VIRTUAL_TERMINAL_PROCESSING	0x0004
+#endif
+#ifndef DISABLE_NEWLINE_AUTO_RETURN
+#define DISABLE_NEWLINE_AUTO_RETURN			0x0008
+#endif
+
+/* States of the passthrough mode escape sequence scanner */
+#define VT_STATE_NORMAL		0
+#define VT_STATE_ESCAPE		1 /* After "ESC" */
+#define VT_STATE_CSI		2 /* After "ESC [" */
 
 typedef uint32_t (*charset_func)(uint32_t ch);
 struct console_cursor /* DECSC */
@@ -100,14 +127,43 @@ struct console_data
 	int param_count;
 	int string_len;
 	char string_buffer[MAX_STRING];
-	char input_buffer[MAX_INPUT];
-	size_t input_buffer_head, input_buffer_tail;
 	char csi_prefix; /* prefix after CSI, e.g. '?', '>' */
 	void (*processor)(char ch);
+
+	/* native VT passthrough mode */
+	int vt_passthrough; /* whether the console host processes escape sequences by itself */
+	int vt_state;
+	int vt_seq_len;
+	char vt_seq[MAX_STRING]; /* the escape sequence being scanned */
+
+	/* input ring buffer, see tty_input */
+	WCHAR input_surrogate; /* high surrogate waiting for the low surrogate in the next key event */
+	struct tty_input input;
 };
 
 static struct console_data *console;
 
+/* Maximum bytes of cells transferred in one ReadConsoleOutputW()/WriteConsoleOutputW() call,
+ * older conhost fails on large requests */
+#define BACKBUF_MAX_TRANSFER	0x8000
+struct console_backbuf
+{
+	CHAR_INFO *cells;
+	size_t size; /* allocated size of cells in bytes */
+	int valid; /* whether the cells contain the content of the window */
+	int in_frame; /* whether the console state is retrieved in current lock duration */
+	int width, rows, capacity; /* number of columns, loaded rows, and maximum rows */
+	int top; /* the row number of the first row in buffer coordinate */
+	int scroll; /* pending number of lines to scroll the whole screen buffer up */
+	int dirty_left, dirty_top, dirty_right, dirty_bottom; /* dirty rectangle in grid coordinate */
+	COORD cursor; /* cursor position of the console, in buffer coordinate */
+	SMALL_RECT window; /* window rectangle of the console, in buffer coordinate */
+	int window_top; /* the emulated top line when the window rectangle is retrieved */
+};
+
+/* Only valid when the console lock is held, thus not shared */
+static struct console_backbuf backbuf;
+
 static uint32_t default_charset(uint32_t ch)
 {
 	return ch;
@@ -240,11 +296,25 @@ void console_init()
 
 	save_cursor();
 
-	console->input_buffer_head = console->input_buffer_tail = 0;
+	tty_input_init(&console->input);
+	console->input_surrogate = 0;
 	console->processor = NULL;
 
+	console->vt_state = VT_STATE_NORMAL;
+	console->vt_seq_len = 0;
+
 	SetConsoleMode(in, ENABLE_PROCESSED_INPUT | ENABLE_WINDOW_INPUT);
-	SetConsoleMode(out, ENABLE_PROCESSED_OUTPUT);
+	/* Line feeds are translated by ourselves according to termios */
+	if (SetConsoleMode(out, ENABLE_PROCESSED_OUTPUT | ENABLE_VIRTUAL_TERMINAL_PROCESSING | DISABLE_NEWLINE_AUTO_RETURN))
+	{
+		log_info("Console supports virtual terminal sequences, using passthrough mode.");
+		console->vt_passthrough = 1;
+	}
+	else
+	{
+		SetConsoleMode(out, ENABLE_PROCESSED_OUTPUT);
+		console->vt_passthrough = 0;
+	}
 	SetConsoleCtrlHandler(console_ctrlc_handler, TRUE);
 
 	log_info("Console shared memory region successfully initialized.");
@@ -281,8 +351,12 @@ static void console_lock()
 	WaitForSingleObject(console->mutex, INFINITE);
 }
 
+static void console_flush();
 static void console_unlock()
 {
+	console_flush();
+	backbuf.valid = 0;
+	backbuf.in_frame = 0;
 	ReleaseMutex(console->mutex);
 }
 
@@ -366,8 +440,213 @@ static WORD get_text_attribute()
 	return attr;
 }
 
+static void backbuf_clean()
+{
+	backbuf.dirty_left = backbuf.width;
+	backbuf.dirty_right = -1;
+	backbuf.dirty_top = backbuf.capacity;
+	backbuf.dirty_bottom = -1;
+}
+
+/* Read or write grid rows [first, first + count), columns [left, right] from/to the console */
+static void backbuf_transfer(int first, int count, int left, int right, BOOL write)
+{
+	int chunk = max(1, BACKBUF_MAX_TRANSFER / (backbuf.width * (int)sizeof(CHAR_INFO)));
+	for (int row = first; row < first + count; row += chunk)
+	{
+		int rows = min(chunk, first + count - row);
+		COORD size;
+		size.X = backbuf.width;
+		size.Y = rows;
+		COORD coord;
+		coord.X = left;
+		coord.Y = 0;
+		SMALL_RECT rect;
+		rect.Left = left;
+		rect.Right = right;
+		rect.Top = backbuf.top + row;
+		rect.Bottom = backbuf.top + row + rows - 1;
+		CHAR_INFO *cells = backbuf.cells + row * backbuf.width;
+		if (write)
+			WriteConsoleOutputW(console->out, cells, size, coord, &rect);
+		else
+			ReadConsoleOutputW(console->out, cells, size, coord, &rect);
+	}
+}
+
+/* Load the content of current window into the back buffer */
+static void backbuf_load()
+{
+	/* Reserve the same number of rows below the window to make most scrolling cheap */
+	int capacity = 2 * console->height;
+	size_t size = (size_t)console->width * capacity * sizeof(CHAR_INFO);
+	if (size > backbuf.size)
+	{
+		if (backbuf.cells)
+			VirtualFree(backbuf.cells, 0, MEM_RELEASE);
+		backbuf.cells = (CHAR_INFO *)VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		if (!backbuf.cells)
+			log_error("VirtualAlloc() failed, error code: %d", GetLastError());
+		backbuf.size = size;
+	}
+	backbuf.width = console->width;
+	backbuf.capacity = capacity;
+	backbuf.top = console->top;
+	backbuf.rows = console->height;
+	backbuf.scroll = 0;
+	backbuf_clean();
+	backbuf_transfer(0, backbuf.rows, 0, backbuf.width - 1, FALSE);
+	backbuf.valid = 1;
+}
+
+static void console_flush()
+{
+	if (!backbuf.in_frame || console->vt_passthrough)
+		return;
+	if (backbuf.scroll)
+	{
+		/* Lines were pushed out at the bottom of the screen buffer */
+		SMALL_RECT rect;
+		rect.Left = 0;
+		rect.Right = backbuf.width - 1;
+		rect.Top = backbuf.scroll;
+		rect.Bottom = console->buffer_height - 1;
+		COORD origin;
+		origin.X = 0;
+		origin.Y = 0;
+		CHAR_INFO fill_char;
+		fill_char.Attributes = get_text_attribute();
+		fill_char.Char.UnicodeChar = L' ';
+		ScrollConsoleScreenBufferW(console->out, &rect, NULL, origin, &fill_char);
+		backbuf.scroll = 0;
+	}
+	if (backbuf.dirty_top <= backbuf.dirty_bottom)
+	{
+		backbuf_transfer(backbuf.dirty_top, backbuf.dirty_bottom - backbuf.dirty_top + 1, backbuf.dirty_left, backbuf.dirty_right, TRUE);
+		backbuf_clean();
+	}
+	if (console->top != backbuf.window_top)
+	{
+		/* The window is moved down by line feeds, let the console follow */
+		backbuf.window.Top = console->top;
+		backbuf.window.Bottom = console->top + console->height - 1;
+		SetConsoleWindowInfo(console->out, TRUE, &backbuf.window);
+		backbuf.window_top = console->top;
+	}
+	if (backbuf.cursor.X != console->x || backbuf.cursor.Y != console->y + console->top)
+	{
+		backbuf.cursor.X = console->x;
+		backbuf.cursor.Y = console->y + console->top;
+		SetConsoleCursorPosition(console->out, backbuf.cursor);
+	}
+}
+
+/* Make sure the back buffer covers current window */
+static void backbuf_ensure()
+{
+	if (backbuf.valid && console->top >= backbuf.top)
+	{
+		int rows = console->top + console->height - backbuf.top;
+		if (rows <= backbuf.rows)
+			return;
+		if (rows <= backbuf.capacity)
+		{
+			/* The window is moved down, load all following rows we can hold in one go */
+			if (backbuf.scroll)
+				console_flush();
+			int count = min(backbuf.capacity, console->buffer_height - backbuf.top) - backbuf.rows;
+			backbuf_transfer(backbuf.rows, count, 0, backbuf.width - 1, FALSE);
+			backbuf.rows += count;
+			return;
+		}
+	}
+	console_flush();
+	backbuf_load();
+}
+
+/* Get the back buffer cell at given window coordinate */
+static CHAR_INFO *backbuf_cell(int x, int y)
+{
+	backbuf_ensure();
+	return &backbuf.cells[(console->top - backbuf.top + y) * backbuf.width + x];
+}
+
+/* Mark a rectangle in window coordinate as dirty */
+static void backbuf_mark(int left, int top, int right, int bottom)
+{
+	int offset = console->top - backbuf.top;
+	backbuf.dirty_left = min(backbuf.dirty_left, left);
+	backbuf.dirty_right = max(backbuf.dirty_right, right);
+	backbuf.dirty_top = min(backbuf.dirty_top, top + offset);
+	backbuf.dirty_bottom = max(backbuf.dirty_bottom, bottom + offset);
+}
+
+/* Fill count cells starting at given window coordinate, wrapping at line end */
+static void backbuf_fill(int x, int y, int count, WCHAR ch, WORD attr)
+{
+	CHAR_INFO *cell = backbuf_cell(x, y);
+	count = min(count, (console->height - y) * console->width - x);
+	if (count <= 0)
+		return;
+	for (int i = 0; i < count; i++)
+	{
+		cell[i].Char.UnicodeChar = ch;
+		cell[i].Attributes = attr;
+	}
+	int end = x + count - 1;
+	if (end < console->width)
+		backbuf_mark(x, y, end, y);
+	else
+		backbuf_mark(0, y, console->width - 1, y + end / console->width);
+}
+
+/* The cursor is at the bottom of a full screen scrolling region, scroll the entire screen */
+static void scroll_screen()
+{
+	if (console->top < console->buffer_height - console->height)
+	{
+		/* Move the window down, following rows are loaded on demand */
+		console->top++;
+		return;
+	}
+	/* The window is at the bottom, the whole screen buffer is scrolled up */
+	backbuf_ensure();
+	if (backbuf.rows == backbuf.capacity || backbuf.scroll + 1 >= console->buffer_height)
+	{
+		console_flush();
+		backbuf_load();
+	}
+	backbuf.scroll++;
+	if (backbuf.top > 0)
+		backbuf.top--;
+	else
+	{
+		/* The first row is scrolled out */
+		memmove(backbuf.cells, backbuf.cells + backbuf.width, (backbuf.rows - 1) * backbuf.width * sizeof(CHAR_INFO));
+		backbuf.rows--;
+		if (backbuf.dirty_top <= backbuf.dirty_bottom)
+		{
+			backbuf.dirty_top = max(backbuf.dirty_top - 1, 0);
+			backbuf.dirty_bottom--;
+		}
+	}
+	/* Append the new line */
+	CHAR_INFO *cell = backbuf.cells + backbuf.rows * backbuf.width;
+	WORD attr = get_text_attribute();
+	for (int i = 0; i < backbuf.width; i++)
+	{
+		cell[i].Char.UnicodeChar = L' ';
+		cell[i].Attributes = attr;
+	}
+	backbuf.rows++;
+	backbuf_mark(0, console->height - 1, console->width - 1, console->height - 1);
+}
+
 static void console_retrieve_state()
 {
+	/* Write pending output and reload the back buffer on next access */
+	console_flush();
+	backbuf.valid = 0;
 	CONSOLE_SCREEN_BUFFER_INFO info;
 	GetConsoleScreenBufferInfo(console->out, &info);
 	int new_width = info.dwSize.X;
@@ -411,6 +690,10 @@ static void console_retrieve_state()
 		console->scroll_top = 0;
 		console->scroll_bottom = console->height - 1;
 	}
+	backbuf.cursor = info.dwCursorPosition;
+	backbuf.window = info.srWindow;
+	backbuf.window_top = console->top;
+	backbuf.in_frame = 1;
 }
 
 static void backspace(BOOL erase)
@@ -419,24 +702,17 @@ static void backspace(BOOL erase)
 	{
 		console->at_right_margin = 0;
 		console->x--;
-		COORD pos;
-		pos.X = console->x;
-		pos.Y = console->y + console->top;
 		if (erase && console->x)
 		{
-			DWORD bytes_written;
-			WriteConsoleOutputCharacterA(console->out, " ", 1, pos, &bytes_written);
+			backbuf_cell(console->x, console->y)->Char.UnicodeChar = L' ';
+			backbuf_mark(console->x, console->y, console->x, console->y);
 		}
-		SetConsoleCursorPosition(console->out, pos);
 	}
 }
 
 static void set_pos(int x, int y)
 {
-	COORD pos;
-	pos.X = x;
-	pos.Y = y + console->top;
-	SetConsoleCursorPosition(console->out, pos);
+	/* The console cursor is updated in console_flush() */
 	console->x = x;
 	console->y = y;
 	console->at_right_margin = 0;
@@ -444,6 +720,8 @@ static void set_pos(int x, int y)
 
 static void console_set_size(int width, int height)
 {
+	console_flush();
+	backbuf.valid = 0;
 	console->top = min(console->top, console->buffer_height - height);
 	COORD size;
 	size.X = width;
@@ -466,6 +744,8 @@ static void console_set_size(int width, int height)
 		SetConsoleWindowInfo(console->out, TRUE, &rect);
 		SetConsoleScreenBufferSize(console->out, size);
 	}
+	backbuf.window = rect;
+	backbuf.window_top = console->top;
 	set_pos(console->x, console->y);
 	console->width = width;
 	console->height = height;
@@ -507,12 +787,18 @@ static void restore_cursor()
 
 static void switch_to_normal_buffer()
 {
+	console_flush();
+	backbuf.valid = 0;
+	backbuf.cursor.X = -1;
 	console->out = console->normal_buffer;
 	SetConsoleActiveScreenBuffer(console->out);
 }
 
 static void switch_to_alternate_buffer()
 {
+	console_flush();
+	backbuf.valid = 0;
+	backbuf.cursor.X = -1;
 	console->out = console->alternate_buffer;
 	SetConsoleActiveScreenBuffer(console->out);
 }
@@ -540,27 +826,44 @@ static void move_down(int count)
 static void erase_screen_lines(int top, int bottom)
 {
 	int len = (bottom - top + 1) * console->width;
-	COORD pos;
-	pos.X = 0;
-	pos.Y = console->top + top;
-	DWORD written;
-	FillConsoleOutputAttribute(console->out, DEFAULT_ATTRIBUTE, len, pos, &written);
+	CHAR_INFO *cell = backbuf_cell(0, top);
+	for (int i = 0; i < len; i++)
+		cell[i].Attributes = DEFAULT_ATTRIBUTE;
+	backbuf_mark(0, top, console->width - 1, bottom);
 }
 
+/* Move the content of the rectangle by the given offset, clipped by the rectangle itself */
 static void scroll(int left, int right, int top, int bottom, int xoffset, int yoffset)
 {
 	CHAR_INFO fill_char;
 	fill_char.Attributes = DEFAULT_ATTRIBUTE;
 	fill_char.Char.UnicodeChar = L' ';
-	SMALL_RECT rect;
-	rect.Left = left;
-	rect.Right = right;
-	rect.Top = console->top + top;
-	rect.Bottom = console->top + bottom;
-	COORD origin;
-	origin.X = left + xoffset;
-	origin.Y = console->top + top + yoffset;
-	ScrollConsoleScreenBufferW(console->out, &rect, &rect, origin, &fill_char);
+	int width = right - left + 1;
+	for (int i = 0; i <= bottom - top; i++)
+	{
+		/* Process rows in the direction of moving to not overwrite source rows */
+		int y = yoffset > 0 ? bottom - i : top + i;
+		int src_y = y - yoffset;
+		CHAR_INFO *dst = backbuf_cell(left, y);
+		int start = 0, end = width; /* cells [start, end) are filled */
+		if (src_y >= top && src_y <= bottom && xoffset < width && xoffset > -width)
+		{
+			CHAR_INFO *src = backbuf_cell(left, src_y);
+			if (xoffset >= 0)
+			{
+				memmove(dst + xoffset, src, (width - xoffset) * sizeof(CHAR_INFO));
+				end = xoffset;
+			}
+			else
+			{
+				memmove(dst, src - xoffset, (width + xoffset) * sizeof(CHAR_INFO));
+				start = width + xoffset;
+			}
+		}
+		for (int j = start; j < end; j++)
+			dst[j] = fill_char;
+	}
+	backbuf_mark(left, top, right, bottom);
 }
 
 static BOOL is_inside_scroll_area()
@@ -580,8 +883,6 @@ static void scroll_down(int count)
 
 static void cr()
 {
-	DWORD bytes_written;
-	WriteConsoleA(console->out, "\r", 1, &bytes_written, NULL);
 	console->x = 0;
 	console->at_right_margin = 0;
 }
@@ -590,13 +891,8 @@ static void nl()
 {
 	if (console->scroll_full_screen || console->y < console->scroll_bottom)
 	{
-		DWORD bytes_written;
-		WriteConsoleA(console->out, "\n", 1, &bytes_written, NULL);
 		if (console->y == console->height - 1)
-		{
-			/* The entire screen is scrolled */
-			console->top = min(console->top + 1, console->buffer_height - console->height);
-		}
+			scroll_screen();
 		else
 			console->y++;
 	}
@@ -611,14 +907,97 @@ static void crnl()
 	nl();
 }
 
-static void console_add_input(char *str, size_t size)
+/* Console input
+ * Key events are read from the console in batches and translated into the tty input ring
+ * buffer in the console shared memory region.
+ */
+
+static size_t input_available()
+{
+	return tty_input_available(&console->input);
+}
+
+static size_t input_free()
+{
+	return tty_input_free(&console->input);
+}
+
+static void input_put(const char *str, size_t size)
 {
-	/* TODO: Detect input buffer overflow */
-	for (size_t i = 0; i < size; i++)
+	tty_input_put(&console->input, str, size);
+}
+
+/* Add bytes generated by the terminal itself, e.g. replies to status requests */
+static void console_add_input(const char *str, size_t size)
+{
+	if (input_free() < size)
+		return;
+	input_put(str, size);
+	tty_input_update_termios(&console->input, &console->termios);
+}
+
+/* Get the number of leading bytes which are not control characters (< 0x20), 16 bytes at a time */
+static size_t scan_text(const char *buf, size_t count)
+{
+	const __m128i limit = _mm_set1_epi8(0x1F);
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
 	{
-		console->input_buffer[console->input_buffer_head] = str[i];
-		console->input_buffer_head = (console->input_buffer_head + 1) % MAX_INPUT;
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		/* max(v, 0x1F) == 0x1F iff v <= 0x1F (unsigned) */
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, limit), limit));
+		if (mask)
+		{
+			unsigned long index;
+			_BitScanForward(&index, mask);
+			return i + index;
+		}
+	}
+	for (; i < count; i++)
+		if ((unsigned char)buf[i] < 0x20)
+			break;
+	return i;
+}
+
+/* Get the number of leading printable ASCII characters (0x20 - 0x7E), 16 bytes at a time */
+static size_t scan_ascii(const char *buf, size_t count)
+{
+	const __m128i low = _mm_set1_epi8(0x1F);
+	const __m128i high = _mm_set1_epi8(0x7F);
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		__m128i bad = _mm_or_si128(
+			_mm_cmpeq_epi8(_mm_max_epu8(v, low), low), /* v <= 0x1F */
+			_mm_cmpeq_epi8(_mm_max_epu8(v, high), v)); /* v >= 0x7F */
+		int mask = _mm_movemask_epi8(bad);
+		if (mask)
+		{
+			unsigned long index;
+			_BitScanForward(&index, mask);
+			return i + index;
+		}
 	}
+	for (; i < count; i++)
+		if ((unsigned char)buf[i] < 0x20 || (unsigned char)buf[i] >= 0x7F)
+			break;
+	return i;
+}
+
+/* Zero extend ASCII characters to UTF-16, 16 characters at a time */
+static void widen_ascii(const char *buf, WCHAR *data, size_t count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		_mm_storeu_si128((__m128i *)(data + i), _mm_unpacklo_epi8(v, zero));
+		_mm_storeu_si128((__m128i *)(data + i + 8), _mm_unpackhi_epi8(v, zero));
+	}
+	for (; i < count; i++)
+		data[i] = (unsigned char)buf[i];
 }
 
 static void write_normal(const char *buf, int size)
@@ -627,7 +1006,9 @@ static void write_normal(const char *buf, int size)
 		return;
 
 	charset_func charset = console->charset == 0? console->g0_charset: console->g1_charset;
+	WORD attr = get_text_attribute();
 	WCHAR data[1024];
+	char data_width[1024];
 	int len = 0, displen = 0;
 	int i = 0;
 	while (i < size)
@@ -641,6 +1022,20 @@ static void write_normal(const char *buf, int size)
 		int seqlen = -1;
 		while (displen < line_remain && i < size)
 		{
+			if (console->utf8_buf_size == 0 && charset == default_charset)
+			{
+				/* Fast path for printable ASCII runs: one cell per byte, no wcwidth() needed */
+				int n = (int)scan_ascii(buf + i, min(size - i, line_remain - displen));
+				if (n > 0)
+				{
+					widen_ascii(buf + i, data + len, n);
+					memset(data_width + len, 1, n);
+					len += n;
+					displen += n;
+					i += n;
+					continue;
+				}
+			}
 			console->utf8_buf[console->utf8_buf_size++] = buf[i++];
 			if (console->utf8_buf_size == 1)
 				seqlen = utf8_get_sequence_len(console->utf8_buf[0]);
@@ -662,6 +1057,7 @@ static void write_normal(const char *buf, int size)
 							break;
 						}
 						displen += l;
+						data_width[len] = l;
 						data[len++] = charset(codepoint);
 					}
 				}
@@ -672,8 +1068,30 @@ static void write_normal(const char *buf, int size)
 		if (console->insert_mode && console->x + displen < console->width)
 			scroll(console->x, console->width - 1, console->y, console->y, displen, 0);
 		
-		DWORD chars_written;
-		WriteConsoleW(console->out, data, len, &chars_written, NULL);
+		if (displen > 0)
+		{
+			CHAR_INFO *cell = backbuf_cell(console->x, console->y);
+			int x = console->x;
+			for (int j = 0; j < len && x < console->width; j++)
+			{
+				cell->Char.UnicodeChar = data[j];
+				if (data_width[j] == 2)
+				{
+					/* Wide character occupies two cells */
+					cell->Attributes = attr | COMMON_LVB_LEADING_BYTE;
+					cell++;
+					if (++x == console->width)
+						break;
+					cell->Char.UnicodeChar = data[j];
+					cell->Attributes = attr | COMMON_LVB_TRAILING_BYTE;
+				}
+				else
+					cell->Attributes = attr;
+				cell++;
+				x++;
+			}
+			backbuf_mark(console->x, console->y, x - 1, console->y);
+		}
 		console->x += displen;
 		if (console->x == console->width)
 		{
@@ -694,21 +1112,21 @@ static void erase_screen(int mode)
 	{
 		/* Erase current line to bottom */
 		start.X = console->x;
-		start.Y = console->y + console->top;
-		count = (console->width - console->x + 1) + (console->height - console->y - 1) * console->width;
+		start.Y = console->y;
+		count = (console->width - console->x) + (console->height - console->y - 1) * console->width;
 	}
 	else if (mode == 1)
 	{
 		/* Erase top to current line */
 		start.X = 0;
-		start.Y = console->top;
+		start.Y = 0;
 		count = console->y * console->width + console->x + 1;
 	}
 	else if (mode == 2)
 	{
 		/* Erase entire screen */
 		start.X = 0;
-		start.Y = console->top;
+		start.Y = 0;
 		count = console->width * console->height;
 	}
 	else
@@ -716,9 +1134,7 @@ static void erase_screen(int mode)
 		log_error("erase_screen(): Invalid mode %d", mode);
 		return;
 	}
-	DWORD num_written;
-	FillConsoleOutputAttribute(console->out, get_text_attribute(console), count, start, &num_written);
-	FillConsoleOutputCharacterW(console->out, L' ', count, start, &num_written);
+	backbuf_fill(start.X, start.Y, count, L' ', get_text_attribute());
 }
 
 #define ERASE_LINE_CUR_TO_END		0
@@ -727,7 +1143,7 @@ static void erase_screen(int mode)
 static void erase_line(int mode)
 {
 	COORD start;
-	start.Y = console->y + console->top;
+	start.Y = console->y;
 	int count;
 	if (mode == 0)
 	{
@@ -752,9 +1168,7 @@ static void erase_line(int mode)
 		log_error("erase_line(): Invalid mode %d", mode);
 		return;
 	}
-	DWORD num_written;
-	FillConsoleOutputAttribute(console->out, get_text_attribute(console), count, start, &num_written);
-	FillConsoleOutputCharacterW(console->out, L' ', count, start, &num_written);
+	backbuf_fill(start.X, start.Y, count, L' ', get_text_attribute());
 }
 
 static void insert_line(int count)
@@ -883,6 +1297,24 @@ static void change_private_mode(int mode, int set)
 	}
 }
 
+static void report_device_attributes(char prefix, int param)
+{
+	if (prefix == '>') /* DA2 */
+	{
+		if (param == 0)
+			console_add_input("\x1B[>61;95;0c", 11);
+		else
+			log_warning("DA2 parameter is not zero.");
+	}
+	else /* DA1 */
+	{
+		if (param == 0)
+			log_error("DA1 not supported.");
+		else
+			log_warning("DA1 parameter is not zero.");
+	}
+}
+
 /* Handler for control sequencie introducer, "ESC [" */
 static void control_escape_csi(char ch)
 {
@@ -1016,20 +1448,7 @@ static void control_escape_csi(char ch)
 		break;
 
 	case 'c':
-		if (console->csi_prefix == '>') /* DA2 */
-		{
-			if (console->params[0] == 0)
-				console_add_input("\x1B[>61;95;0c", 11);
-			else
-				log_warning("DA2 parameter is not zero.");
-		}
-		else /* DA1 */
-		{
-			if (console->params[0] == 0)
-				log_error("DA1 not supported.");
-			else
-				log_warning("DA1 parameter is not zero.");
-		}
+		report_device_attributes(console->csi_prefix, console->params[0]);
 		console->processor = NULL;
 		break;
 
@@ -1179,12 +1598,7 @@ static void control_escape_sharp(char ch)
 	{
 		/* DECALN: DEC screen alignment test */
 		/* Fill screen with 'E' */
-		COORD start;
-		start.X = 0;
-		start.Y = 0;
-		DWORD bytes_written;
-		FillConsoleOutputAttribute(console->out, get_text_attribute(), console->width * console->height, start, &bytes_written);
-		FillConsoleOutputCharacterW(console->out, L'E', console->width * console->height, start, &bytes_written);
+		backbuf_fill(0, 0, console->width * console->height, L'E', get_text_attribute());
 		console->processor = NULL;
 	}
 
@@ -1278,45 +1692,221 @@ static void control_escape(char ch)
 	}
 }
 
-static void console_buffer_add_string(char *buf, size_t *bytes_read, size_t *count, char *str, size_t size)
+static size_t input_take(char *buf, size_t count)
 {
-	while (*count > 0 && size > 0)
+	return tty_input_take(&console->input, buf, count);
+}
+
+static void console_passthrough_write(const char *buf, size_t count);
+
+static void echo_crnl()
+{
+	if (console->vt_passthrough)
+		console_passthrough_write("\r\n", 2);
+	else
+		crnl();
+}
+
+static void echo_backspace()
+{
+	if (console->vt_passthrough)
+		console_passthrough_write("\b \b", 3);
+	else
+		backspace(TRUE);
+}
+
+static void echo_string(const char *str, size_t size)
+{
+	if (!console->vt_passthrough)
+		write_normal(str, (int)size);
+	else if ((unsigned char)str[0] >= 0x20)
+		console_passthrough_write(str, size);
+}
+
+/* Escape sequence of a special key, NULL if the key is not special */
+static const char *input_key_sequence(WORD vk)
+{
+	switch (vk)
 	{
-		buf[(*bytes_read)++] = *str;
-		(*count)--;
-		str++;
-		size--;
+	case VK_UP: return console->cursor_key_mode ? "\x1BOA" : "\x1B[A";
+	case VK_DOWN: return console->cursor_key_mode ? "\x1BOB" : "\x1B[B";
+	case VK_RIGHT: return console->cursor_key_mode ? "\x1BOC" : "\x1B[C";
+	case VK_LEFT: return console->cursor_key_mode ? "\x1BOD" : "\x1B[D";
+	case VK_HOME: return console->cursor_key_mode ? "\x1BOH" : "\x1B[H";
+	case VK_END: return console->cursor_key_mode ? "\x1BOF" : "\x1B[F";
+
+	case VK_INSERT: return "\x1B[2~";
+	case VK_DELETE: return "\x1B[3~";
+	case VK_PRIOR: return "\x1B[5~";
+	case VK_NEXT: return "\x1B[6~";
+
+	case VK_F1: return "\x1BOP";
+	case VK_F2: return "\x1BOQ";
+	case VK_F3: return "\x1BOR";
+	case VK_F4: return "\x1BOS";
+	case VK_F5: return "\x1B[15~";
+	case VK_F6: return "\x1B[17~";
+	case VK_F7: return "\x1B[18~";
+	case VK_F8: return "\x1B[19~";
+	case VK_F9: return "\x1B[20~";
+	case VK_F10: return "\x1B[21~";
+	case VK_F11: return "\x1B[23~";
+	case VK_F12: return "\x1B[24~";
+	case VK_F13: return "\x1B[25~";
+	case VK_F14: return "\x1B[26~";
+	case VK_F15: return "\x1B[28~";
+	case VK_F16: return "\x1B[29~";
+	case VK_F17: return "\x1B[31~";
+	case VK_F18: return "\x1B[32~";
+	case VK_F19: return "\x1B[33~";
+	case VK_F20: return "\x1B[34~";
+
+	default: return NULL;
 	}
-	if (size > 0)
-		console_add_input(str, size);
 }
 
-static int console_get_poll_status(struct file *f)
+/* Convert the character of a key event to UTF-8, returns the number of bytes */
+static int input_key_char(const KEY_EVENT_RECORD *key, char *out)
 {
-	/* Writing is always ready */
-	struct console_file *console_file = (struct console_file *) f;
-	if (console->input_buffer_head != console->input_buffer_tail)
-		return LINUX_POLLIN | LINUX_POLLOUT;
+	uint16_t data[2];
+	int len = 0;
+	WCHAR ch = key->uChar.UnicodeChar;
+	if (ch == 0)
+		return 0;
+	if (IS_HIGH_SURROGATE(ch))
+	{
+		/* The low surrogate comes in the next key event */
+		console->input_surrogate = ch;
+		return 0;
+	}
+	if (IS_LOW_SURROGATE(ch))
+	{
+		if (!console->input_surrogate)
+			return 0;
+		data[len++] = console->input_surrogate;
+	}
+	console->input_surrogate = 0;
+	data[len++] = ch;
+	int r = utf16_to_utf8(data, len, out, 4);
+	return r < 0 ? 0 : r;
+}
 
-	console_lock();
-	INPUT_RECORD ir;
-	DWORD num_read;
-	while (PeekConsoleInputW(console->in, &ir, 1, &num_read) && num_read > 0)
+static void input_canonical_key(const KEY_EVENT_RECORD *key)
+{
+	char ch[4];
+	int len;
+	switch (key->wVirtualKeyCode)
 	{
-		/* Test if the event will be discarded */
-		if (ir.EventType == KEY_EVENT && ir.Event.KeyEvent.bKeyDown)
+	case VK_RETURN:
+	{
+		/* A byte is always reserved for the line delimiter */
+		if (!(console->termios.c_iflag & IGNCR) && input_free() > 0)
+			input_put(console->termios.c_iflag & ICRNL ? "\n" : "\r", 1);
+		tty_input_commit(&console->input);
+		if (console->termios.c_lflag & ECHO)
+			echo_crnl();
+		break;
+	}
+
+	case VK_BACK:
+	{
+		if (tty_input_erase(&console->input) && (console->termios.c_lflag & ECHO))
+			echo_backspace();
+		break;
+	}
+
+	default:
+	{
+		len = input_key_char(key, ch);
+		if (len > 0 && (unsigned char)ch[0] >= 0x20 && input_free() > (size_t)len)
 		{
-			console_unlock();
-			return LINUX_POLLIN | LINUX_POLLOUT;
+			input_put(ch, len);
+			if (console->termios.c_lflag & ECHO)
+				echo_string(ch, len);
 		}
-		else if (ir.EventType == WINDOW_BUFFER_SIZE_EVENT)
+	}
+	}
+}
+
+static void input_raw_key(const KEY_EVENT_RECORD *key)
+{
+	const char *seq = input_key_sequence(key->wVirtualKeyCode);
+	if (seq)
+	{
+		size_t len = strlen(seq);
+		if (input_free() >= len)
+			input_put(seq, len);
+	}
+	else
+	{
+		char ch[4];
+		int len = input_key_char(key, ch);
+		if (len == 0)
+			return;
+		if (ch[0] == '\r' && console->termios.c_iflag & IGNCR)
+			return;
+		if (ch[0] == '\r' && console->termios.c_iflag & ICRNL)
+			ch[0] = '\n';
+		else if (ch[0] == '\n' && console->termios.c_iflag & ICRNL)
+			ch[0] = '\r';
+		if (input_free() >= (size_t)len)
+		{
+			input_put(ch, len);
+			if (console->termios.c_lflag & ECHO)
+				echo_string(ch, len);
+		}
+	}
+	tty_input_commit(&console->input);
+}
+
+/* Move all pending console input events into the input buffer, input not fitting is dropped */
+static void input_fill()
+{
+	DWORD pending;
+	while (GetNumberOfConsoleInputEvents(console->in, &pending) && pending > 0)
+	{
+		INPUT_RECORD ir[INPUT_EVENT_BATCH];
+		DWORD read;
+		if (!ReadConsoleInputW(console->in, ir, min(pending, INPUT_EVENT_BATCH), &read) || read == 0)
+			break;
+		if (!backbuf.in_frame)
 			console_retrieve_state();
-		/* Discard the event */
-		ReadConsoleInputW(console->in, &ir, 1, &num_read);
+		for (DWORD i = 0; i < read; i++)
+		{
+			if (ir[i].EventType == KEY_EVENT && ir[i].Event.KeyEvent.bKeyDown)
+			{
+				const KEY_EVENT_RECORD *key = &ir[i].Event.KeyEvent;
+				for (WORD repeat = max(key->wRepeatCount, 1); repeat > 0; repeat--)
+				{
+					if (console->termios.c_lflag & ICANON)
+						input_canonical_key(key);
+					else
+						input_raw_key(key);
+				}
+			}
+			else if (ir[i].EventType == WINDOW_BUFFER_SIZE_EVENT)
+				console_retrieve_state();
+			else
+			{
+				/* TODO: Other types of input */
+			}
+		}
 	}
-	/* We don't find any readable events */
+}
+
+static int console_get_poll_status(struct file *f)
+{
+	/* Writing is always ready */
+	struct console_file *console_file = (struct console_file *) f;
+	if (input_available())
+		return LINUX_POLLIN | LINUX_POLLOUT;
+
+	/* The console handle is signaled by any pending event, translate them to see if any bytes are ready */
+	console_lock();
+	input_fill();
+	int r = input_available() ? LINUX_POLLIN | LINUX_POLLOUT : LINUX_POLLOUT;
 	console_unlock();
-	return LINUX_POLLOUT;
+	return r;
 }
 
 static HANDLE console_get_poll_handle(struct file *f, int *poll_events)
@@ -1339,85 +1929,36 @@ static size_t console_file_read(struct file *f, void *b, size_t count)
 	console_retrieve_state();
 
 	size_t bytes_read = 0;
-	while (console->input_buffer_head != console->input_buffer_tail && count > 0)
-	{
-		count--;
-		buf[bytes_read++] = console->input_buffer[console->input_buffer_tail];
-		console->input_buffer_tail = (console->input_buffer_tail + 1) % MAX_INPUT;
-	}
 	if (console->termios.c_lflag & ICANON)
 	{
-		char line[MAX_CANON + 1]; /* One more for storing CR or LF */
-		size_t len = 0;
-		while (count > 0)
+		/* Wait until a complete line is available */
+		input_fill();
+		while (!input_available())
 		{
-			INPUT_RECORD ir;
-			DWORD read;
+			/* Make echoed characters visible before waiting */
+			console_flush();
 			if (signal_wait(1, &console->in, INFINITE) == WAIT_INTERRUPTED)
 			{
-				if (bytes_read == 0)
-					bytes_read = -L_EINTR;
-				break;
+				bytes_read = -L_EINTR;
+				goto read_done;
 			}
-			ReadConsoleInputA(console->in, &ir, 1, &read);
-			if (ir.EventType == KEY_EVENT && ir.Event.KeyEvent.bKeyDown)
-			{
-				switch (ir.Event.KeyEvent.wVirtualKeyCode)
-				{
-				case VK_RETURN:
-				{
-					if (!(console->termios.c_iflag & IGNCR))
-						line[len++] = console->termios.c_iflag & ICRNL ? '\n' : '\r';
-					size_t r = min(count, len);
-					memcpy(buf + bytes_read, line, r);
-					bytes_read += r;
-					count -= r;
-					if (r < len)
-					{
-						/* Some bytes not fit, add to input buffer */
-						console_add_input(line + r, len - r);
-					}
-					if (console->termios.c_lflag & ECHO)
-						crnl();
-					goto read_done;
-				}
-
-				case VK_BACK:
-				{
-					if (len > 0)
-					{
-						len--;
-						if (console->termios.c_lflag & ECHO)
-							backspace(TRUE);
-					}
-				}
-				default:
-				{
-					char ch = ir.Event.KeyEvent.uChar.AsciiChar;
-					if (ch >= 0x20)
-					{
-						if (len < MAX_CANON)
-						{
-							line[len++] = ch;
-							if (console->termios.c_lflag & ECHO)
-								write_normal(&ch, 1);
-						}
-					}
-				}
-				}
-			}
-			else if (ir.EventType == WINDOW_BUFFER_SIZE_EVENT)
-				console_retrieve_state();
+			input_fill();
 		}
+		bytes_read = input_take(buf, count);
 	}
 	else /* Non canonical mode */
 	{
 		int vtime = console->termios.c_cc[VTIME];
 		int vmin = console->termios.c_cc[VMIN];
+		input_fill();
 		while (count > 0)
 		{
-			if (bytes_read > 0 && bytes_read >= vmin)
+			size_t taken = input_take(buf + bytes_read, count);
+			bytes_read += taken;
+			count -= taken;
+			if (count == 0 || (bytes_read > 0 && bytes_read >= vmin))
 				break;
+			console_flush();
 			if ((vmin == 0 && vtime == 0)			/* Polling read */
 				|| (vtime > 0 && bytes_read > 0))	/* Read with interbyte timeout. Apply after reading first character */
 			{
@@ -1441,93 +1982,10 @@ static size_t console_file_read(struct file *f, void *b, size_t count)
 					break;
 				}
 			}
-			INPUT_RECORD ir;
-			DWORD read;
-			ReadConsoleInputA(console->in, &ir, 1, &read);
-			if (ir.EventType == KEY_EVENT && ir.Event.KeyEvent.bKeyDown)
-			{
-				switch (ir.Event.KeyEvent.wVirtualKeyCode)
-				{
-				case VK_UP:
-					console_buffer_add_string(buf, &bytes_read, &count, console->cursor_key_mode ? "\x1BOA" : "\x1B[A", 3);
-					break;
-
-				case VK_DOWN:
-					console_buffer_add_string(buf, &bytes_read, &count, console->cursor_key_mode ? "\x1BOB" : "\x1B[B", 3);
-					break;
-
-				case VK_RIGHT:
-					console_buffer_add_string(buf, &bytes_read, &count, console->cursor_key_mode ? "\x1BOC" : "\x1B[C", 3);
-					break;
-
-				case VK_LEFT:
-					console_buffer_add_string(buf, &bytes_read, &count, console->cursor_key_mode ? "\x1BOD" : "\x1B[D", 3);
-					break;
-
-				case VK_HOME:
-					console_buffer_add_string(buf, &bytes_read, &count, console->cursor_key_mode ? "\x1BOH" : "\x1B[H", 3);
-					break;
-
-				case VK_END:
-					console_buffer_add_string(buf, &bytes_read, &count, console->cursor_key_mode ? "\x1BOF" : "\x1B[F", 3);
-					break;
-
-				case VK_INSERT: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[2~", 4); break;
-				case VK_DELETE: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[3~", 4); break;
-				case VK_PRIOR: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[5~", 4); break;
-				case VK_NEXT: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[6~", 4); break;
-
-				case VK_F1: console_buffer_add_string(buf, &bytes_read, &count, "\x1BOP", 3); break;
-				case VK_F2: console_buffer_add_string(buf, &bytes_read, &count, "\x1BOQ", 3); break;
-				case VK_F3: console_buffer_add_string(buf, &bytes_read, &count, "\x1BOR", 3); break;
-				case VK_F4: console_buffer_add_string(buf, &bytes_read, &count, "\x1BOS", 3); break;
-				case VK_F5: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[15~", 5); break;
-				case VK_F6: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[17~", 5); break;
-				case VK_F7: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[18~", 5); break;
-				case VK_F8: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[19~", 5); break;
-				case VK_F9: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[20~", 5); break;
-				case VK_F10: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[21~", 5); break;
-				case VK_F11: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[23~", 5); break;
-				case VK_F12: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[24~", 5); break;
-				case VK_F13: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[25~", 5); break;
-				case VK_F14: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[26~", 5); break;
-				case VK_F15: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[28~", 5); break;
-				case VK_F16: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[29~", 5); break;
-				case VK_F17: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[31~", 5); break;
-				case VK_F18: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[32~", 5); break;
-				case VK_F19: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[33~", 5); break;
-				case VK_F20: console_buffer_add_string(buf, &bytes_read, &count, "\x1B[34~", 5); break;
-
-				default:
-				{
-					char ch = ir.Event.KeyEvent.uChar.AsciiChar;
-					if (ch == '\r' && console->termios.c_iflag & IGNCR)
-						break;
-					if (ch == '\r' && console->termios.c_iflag & ICRNL)
-						ch = '\n';
-					else if (ch == '\n' && console->termios.c_iflag & ICRNL)
-						ch = '\r';
-					if (ch > 0)
-					{
-						count--;
-						buf[bytes_read++] = ch;
-						if (console->termios.c_lflag & ECHO)
-							write_normal(&ch, 1);
-					}
-				}
-				}
-			}
-			else if (ir.EventType == WINDOW_BUFFER_SIZE_EVENT)
-				console_retrieve_state();
-			else
-			{
-				/* TODO: Other types of input */
-			}
+			input_fill();
 		}
 	}
 read_done:
-	/* This will make the caret immediately visible */
-	set_pos(console->x, console->y);
 	console_unlock();
 	return bytes_read;
 }
@@ -1537,11 +1995,125 @@ size_t console_read(void *b, size_t count)
 	return console_file_read(NULL, b, count);
 }
 
-static size_t console_file_write(struct file *f, const void *b, size_t count)
+/* Hand buffered output to the console host, an unfinished UTF-8 sequence at the end is kept */
+static void vt_output(char *out, int *len)
+{
+	int end = *len;
+	for (int i = end - 1; i >= 0 && i >= end - 3; i--)
+	{
+		if ((out[i] & 0xC0) != 0x80)
+		{
+			if (i + utf8_get_sequence_len(out[i]) > end)
+				end = i;
+			break;
+		}
+	}
+	WCHAR data[MAX_VT_OUTPUT];
+	int r = MultiByteToWideChar(CP_UTF8, 0, out, end, data, MAX_VT_OUTPUT);
+	DWORD chars_written;
+	WriteConsoleW(console->out, data, r, &chars_written, NULL);
+	memmove(out, out + end, *len - end);
+	*len -= end;
+}
+
+/* Returns true if the complete escape sequence in vt_seq is handled locally */
+static bool vt_intercept()
+{
+	if (console->vt_state != VT_STATE_CSI)
+		return false;
+	char final = console->vt_seq[console->vt_seq_len - 1];
+	if (final != 'c') /* Device attributes reports are not generated by the console host */
+		return false;
+	char prefix = 0;
+	int param = 0;
+	for (int i = 2; i < console->vt_seq_len - 1; i++)
+	{
+		char ch = console->vt_seq[i];
+		if (ch >= '0' && ch <= '9')
+			param = 10 * param + (ch - '0');
+		else if (ch == ';')
+			break;
+		else
+			prefix = ch;
+	}
+	report_device_attributes(prefix, param);
+	return true;
+}
+
+static void console_passthrough_write(const char *buf, size_t count)
+{
+	char out[MAX_VT_OUTPUT];
+	int len = 0;
+	/* Prepend the unfinished UTF-8 sequence from last write */
+	memcpy(out, console->utf8_buf, console->utf8_buf_size);
+	len = console->utf8_buf_size;
+	#define EMIT(ch) \
+		do { \
+			if (len == MAX_VT_OUTPUT) \
+				vt_output(out, &len); \
+			out[len++] = (ch); \
+		} while (0)
+	for (size_t i = 0; i < count; i++)
+	{
+		char ch = buf[i];
+		if (console->vt_state == VT_STATE_NORMAL)
+		{
+			if (ch == 0x1B)
+			{
+				console->vt_state = VT_STATE_ESCAPE;
+				console->vt_seq[0] = ch;
+				console->vt_seq_len = 1;
+			}
+			else if (ch == '\n' && (console->termios.c_oflag & ONLCR))
+			{
+				EMIT('\r');
+				EMIT('\n');
+			}
+			else if (ch == '\r' && (console->termios.c_oflag & OCRNL))
+				EMIT('\n');
+			else if ((unsigned char)ch >= 0x20)
+			{
+				/* Copy the whole text run */
+				size_t n = 1 + scan_text(buf + i + 1, count - i - 1);
+				while (n > 0)
+				{
+					if (len == MAX_VT_OUTPUT)
+						vt_output(out, &len);
+					size_t c = min(n, (size_t)(MAX_VT_OUTPUT - len));
+					memcpy(out + len, buf + i, c);
+					len += (int)c;
+					i += c;
+					n -= c;
+				}
+				i--;
+			}
+			else
+				EMIT(ch);
+			continue;
+		}
+		console->vt_seq[console->vt_seq_len++] = ch;
+		if (console->vt_state == VT_STATE_ESCAPE && ch == '[')
+		{
+			console->vt_state = VT_STATE_CSI;
+			continue;
+		}
+		/* Sequences other than CSI are passed as is, a CSI ends with a final byte in 0x40-0x7E */
+		if (console->vt_state == VT_STATE_ESCAPE || (ch >= 0x40 && ch <= 0x7E) || console->vt_seq_len == MAX_STRING)
+		{
+			if (!vt_intercept())
+				for (int j = 0; j < console->vt_seq_len; j++)
+					EMIT(console->vt_seq[j]);
+			console->vt_state = VT_STATE_NORMAL;
+		}
+	}
+	#undef EMIT
+	vt_output(out, &len);
+	memcpy(console->utf8_buf, out, len);
+	console->utf8_buf_size = len;
+}
+
+static void console_emulated_write(const char *buf, size_t count)
 {
-	const char *buf = (const char *)b;
-	console_lock();
-	console_retrieve_state();
 	#define OUTPUT() \
 		if (last != -1) \
 		{ \
@@ -1607,12 +2179,33 @@ static size_t console_file_write(struct file *f, const void *b, size_t count)
 			OUTPUT();
 			log_error("Unhandled control character '\\x%x'", ch);
 		}
-		else if (last == -1)
-			last = i;
+		else
+		{
+			if (last == -1)
+				last = i;
+			/* Skip the rest of the text run in one go */
+			i += scan_text(buf + i + 1, count - i - 1);
+		}
 	}
 	OUTPUT();
-	/* This will make the caret immediately visible */
-	set_pos(console->x, console->y);
+	#undef OUTPUT
+}
+
+static void console_do_write(const char *buf, size_t count)
+{
+	if (console->vt_passthrough)
+		console_passthrough_write(buf, count);
+	else
+		console_emulated_write(buf, count);
+}
+
+static size_t console_file_write(struct file *f, const void *b, size_t count)
+{
+	const char *buf = (const char *)b;
+	console_lock();
+	console_retrieve_state();
+	console_do_write(buf, count);
+	/* Pending output and the caret are written to the console here */
 	console_unlock();
 #if 0
 	char str[1024];
@@ -1628,11 +2221,6 @@ size_t console_write(const void *buf, size_t b)
 	return console_file_write(NULL, buf, b);
 }
 
-static void console_update_termios()
-{
-	/* Nothing to do for now */
-}
-
 static int console_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 {
 	console_lock();
@@ -1655,7 +2243,9 @@ static int console_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 	{
 		struct termios *t = (struct termios *)arg;
 		memcpy(&console->termios, t, sizeof(struct termios));
-		console_update_termios();
+		if (cmd == L_TCSETSF)
+			tty_input_flush(&console->input);
+		tty_input_update_termios(&console->input, &console->termios);
 		r = 0;
 		break;
 	}
@@ -1692,6 +2282,7 @@ static int console_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 	case L_TIOCSWINSZ:
 	{
 		const struct winsize *win = (const struct winsize *)arg;
+		console_retrieve_state();
 		console_set_size(win->ws_col, win->ws_row);
 		r = 0;
 		break;
@@ -17,10 +17,13 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_VFS
+
 #include <fs/console.h>
 #include <fs/devfs.h>
 #include <fs/dsp.h>
 #include <fs/null.h>
+#include <fs/pty.h>
 #include <fs/random.h>
 #include <fs/virtual.h>
 #include <fs/zero.h>
@@ -36,6 +39,8 @@ static const struct virtualfs_directory_desc devfs =
 		VIRTUALFS_ENTRY("urandom", urandom_desc)
 		VIRTUALFS_ENTRY("console", console_desc)
 		VIRTUALFS_ENTRY("tty", console_desc)
+		VIRTUALFS_ENTRY("ptmx", ptmx_desc)
+		VIRTUALFS_ENTRY("pts", pts_desc)
 		VIRTUALFS_ENTRY_END()
 	}
 };
@@ -17,12 +17,15 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_VFS
+
 #include <common/errno.h>
 #include <common/fcntl.h>
 #include <common/soundcard.h>
 #include <fs/dsp.h>
 #include <fs/file.h>
 #include <syscall/mm.h>
+#include <syscall/sig.h>
 #include <heap.h>
 #include <log.h>
 
@@ -31,12 +34,44 @@
 #include <Windows.h>
 #include <mmreg.h>
 #include <mmsystem.h>
+#define COBJMACROS
+#include <objbase.h>
+#include <mmdeviceapi.h>
+#include <audioclient.h>
 
 #pragma comment(lib, "winmm.lib")
+#pragma comment(lib, "ole32.lib")
+
+/* /dev/dsp output
+ * The default backend is a WASAPI shared mode stream on the default render endpoint. The
+ * stream runs in event driven mode and write() copies samples straight into the endpoint
+ * buffer, blocking on the buffer event when it is full. The shared audio engine converts
+ * the OSS sample format to the mix format (AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM).
+ *
+ * If the WASAPI stream cannot be created, the legacy waveOut API is used with a fixed set
+ * of buffers instead.
+ */
+
+#ifndef AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM
+#define AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM		0x80000000
+#endif
+#ifndef AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY
+#define AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY	0x08000000
+#endif
+
+/* Requested duration of the WASAPI endpoint buffer, in 100ns units (50ms) */
+#define DSP_WASAPI_BUFFER_DURATION	500000
+/* Number of fragments the endpoint buffer is reported as */
+#define DSP_WASAPI_FRAGMENTS		4
 
 /* Each buffer should be capable of storing about 0.125 second of samples */
 #define DSP_BUFFER_COUNT	16
 
+static const CLSID dsp_clsid_device_enumerator = { 0xBCDE0395, 0xE52F, 0x467C, { 0x8E, 0x3D, 0xC4, 0x57, 0x92, 0x91, 0x69, 0x2E } };
+static const IID dsp_iid_device_enumerator = { 0xA95664D2, 0x9614, 0x4F35, { 0xA7, 0x46, 0xDE, 0x8D, 0xB6, 0x36, 0x17, 0xE6 } };
+static const IID dsp_iid_audio_client = { 0x1CB9AD4C, 0xDBFA, 0x4C32, { 0xB1, 0x78, 0xC2, 0xF5, 0x68, 0xA7, 0x03, 0xB2 } };
+static const IID dsp_iid_audio_render_client = { 0xF294ACFC, 0x3146, 0x4483, { 0xA7, 0xBF, 0xAD, 0xDC, 0xA7, 0xC2, 0x60, 0xE2 } };
+
 struct dsp_buffer
 {
 	WAVEHDR hdr;
@@ -47,11 +82,22 @@ struct dsp_buffer
 struct dsp_file
 {
 	struct virtualfs_custom custom_file;
-	HWAVEOUT waveout;
 	WAVEFORMATEX format;
+	bool opened;
+	/* WASAPI backend */
+	IAudioClient *client;
+	IAudioRenderClient *render;
+	HANDLE event; /* Signaled by the audio engine when buffer space becomes available */
+	UINT32 buffer_frames; /* Size of the endpoint buffer in frames */
+	bool started;
+	char partial[8]; /* Bytes of an unfinished frame */
+	int partial_size;
+	/* waveOut backend */
+	HWAVEOUT waveout;
 	struct dsp_buffer buffer[DSP_BUFFER_COUNT];
 	int buffer_size;
 	int current_buffer;
+	volatile LONG queued; /* Number of buffers sent but not yet played */
 };
 
 static bool dsp_test_format(WAVEFORMATEX *format)
@@ -60,6 +106,182 @@ static bool dsp_test_format(WAVEFORMATEX *format)
 	return waveOutOpen(&waveout, 0, format, 0, 0, WAVE_FORMAT_QUERY | CALLBACK_NULL) == MMSYSERR_NOERROR;
 }
 
+static void dsp_wasapi_close(struct dsp_file *dsp)
+{
+	if (dsp->render)
+	{
+		IAudioRenderClient_Release(dsp->render);
+		dsp->render = NULL;
+	}
+	if (dsp->client)
+	{
+		IAudioClient_Stop(dsp->client);
+		IAudioClient_Release(dsp->client);
+		dsp->client = NULL;
+	}
+	dsp->started = false;
+	dsp->partial_size = 0;
+}
+
+static bool dsp_wasapi_open(struct dsp_file *dsp)
+{
+	HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+	if (FAILED(hr) && hr != RPC_E_CHANGED_MODE)
+	{
+		log_warning("CoInitializeEx() failed, hr: %x", hr);
+		return false;
+	}
+	IMMDeviceEnumerator *enumerator = NULL;
+	IMMDevice *device = NULL;
+	hr = CoCreateInstance(&dsp_clsid_device_enumerator, NULL, CLSCTX_ALL, &dsp_iid_device_enumerator, (void **)&enumerator);
+	if (FAILED(hr))
+	{
+		log_warning("Creating MMDeviceEnumerator failed, hr: %x", hr);
+		goto fail;
+	}
+	hr = IMMDeviceEnumerator_GetDefaultAudioEndpoint(enumerator, eRender, eConsole, &device);
+	if (FAILED(hr))
+	{
+		log_warning("GetDefaultAudioEndpoint() failed, hr: %x", hr);
+		goto fail;
+	}
+	hr = IMMDevice_Activate(device, &dsp_iid_audio_client, CLSCTX_ALL, NULL, (void **)&dsp->client);
+	if (FAILED(hr))
+	{
+		log_warning("Activating IAudioClient failed, hr: %x", hr);
+		goto fail;
+	}
+	hr = IAudioClient_Initialize(dsp->client, AUDCLNT_SHAREMODE_SHARED,
+		AUDCLNT_STREAMFLAGS_EVENTCALLBACK | AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM | AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY,
+		DSP_WASAPI_BUFFER_DURATION, 0, &dsp->format, NULL);
+	if (FAILED(hr))
+	{
+		log_warning("IAudioClient::Initialize() failed, hr: %x", hr);
+		goto fail;
+	}
+	if (FAILED(hr = IAudioClient_SetEventHandle(dsp->client, dsp->event))
+		|| FAILED(hr = IAudioClient_GetBufferSize(dsp->client, &dsp->buffer_frames))
+		|| FAILED(hr = IAudioClient_GetService(dsp->client, &dsp_iid_audio_render_client, (void **)&dsp->render)))
+	{
+		log_warning("Setting up WASAPI stream failed, hr: %x", hr);
+		goto fail;
+	}
+	log_info("WASAPI buffer size: %d frames", dsp->buffer_frames);
+	IMMDevice_Release(device);
+	IMMDeviceEnumerator_Release(enumerator);
+	return true;
+
+fail:
+	dsp_wasapi_close(dsp);
+	if (device)
+		IMMDevice_Release(device);
+	if (enumerator)
+		IMMDeviceEnumerator_Release(enumerator);
+	return false;
+}
+
+static UINT32 dsp_wasapi_padding(struct dsp_file *dsp)
+{
+	UINT32 padding;
+	if (FAILED(IAudioClient_GetCurrentPadding(dsp->client, &padding)))
+		return 0;
+	return padding;
+}
+
+static void dsp_wasapi_start(struct dsp_file *dsp)
+{
+	if (!dsp->started)
+	{
+		HRESULT hr = IAudioClient_Start(dsp->client);
+		if (FAILED(hr))
+			log_error("IAudioClient::Start() failed, hr: %x", hr);
+		dsp->started = true;
+	}
+}
+
+/* Copy frames into the endpoint buffer, returns the number of frames written */
+static int dsp_wasapi_put(struct dsp_file *dsp, const char *data, int frames)
+{
+	int written = 0;
+	while (written < frames)
+	{
+		UINT32 padding;
+		HRESULT hr = IAudioClient_GetCurrentPadding(dsp->client, &padding);
+		if (FAILED(hr))
+		{
+			log_error("IAudioClient::GetCurrentPadding() failed, hr: %x", hr);
+			break;
+		}
+		UINT32 current = min(dsp->buffer_frames - padding, (UINT32)(frames - written));
+		if (current == 0)
+		{
+			/* The buffer is full, the audio engine signals the event after consuming a period */
+			dsp_wasapi_start(dsp);
+			if (signal_wait(1, &dsp->event, INFINITE) == WAIT_INTERRUPTED)
+				break;
+			continue;
+		}
+		BYTE *buffer;
+		hr = IAudioRenderClient_GetBuffer(dsp->render, current, &buffer);
+		if (FAILED(hr))
+		{
+			log_error("IAudioRenderClient::GetBuffer() failed, hr: %x", hr);
+			break;
+		}
+		memcpy(buffer, data + written * dsp->format.nBlockAlign, current * dsp->format.nBlockAlign);
+		IAudioRenderClient_ReleaseBuffer(dsp->render, current, 0);
+		written += current;
+	}
+	return written;
+}
+
+static void dsp_wasapi_drain(struct dsp_file *dsp)
+{
+	if (dsp->partial_size > 0)
+	{
+		/* Pad the unfinished frame with silence */
+		memset(dsp->partial + dsp->partial_size, dsp->format.wBitsPerSample == 8 ? 0x80 : 0, dsp->format.nBlockAlign - dsp->partial_size);
+		dsp_wasapi_put(dsp, dsp->partial, 1);
+		dsp->partial_size = 0;
+	}
+	dsp_wasapi_start(dsp);
+	while (dsp_wasapi_padding(dsp) > 0)
+		if (signal_wait(1, &dsp->event, INFINITE) == WAIT_INTERRUPTED)
+			break;
+}
+
+static ssize_t dsp_wasapi_write(struct dsp_file *dsp, const char *buf, size_t count)
+{
+	size_t written = 0;
+	int block = dsp->format.nBlockAlign;
+	if (dsp->partial_size > 0)
+	{
+		size_t current = min(count, (size_t)(block - dsp->partial_size));
+		memcpy(dsp->partial + dsp->partial_size, buf, current);
+		dsp->partial_size += current;
+		if (dsp->partial_size < block)
+			return current;
+		if (dsp_wasapi_put(dsp, dsp->partial, 1) == 0)
+		{
+			dsp->partial_size -= current;
+			return -L_EINTR;
+		}
+		dsp->partial_size = 0;
+		written = current;
+	}
+	int frames = (int)((count - written) / block);
+	int r = dsp_wasapi_put(dsp, buf + written, frames);
+	written += r * block;
+	if (r < frames)
+		return written > 0 ? (ssize_t)written : -L_EINTR;
+	/* Keep the trailing bytes of an unfinished frame */
+	dsp->partial_size = (int)(count - written);
+	memcpy(dsp->partial, buf + written, dsp->partial_size);
+	/* Playback starts on the first write */
+	dsp_wasapi_start(dsp);
+	return count;
+}
+
 static void CALLBACK dsp_callback(HWAVEOUT hwo, UINT uMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2)
 {
 	if (uMsg == WOM_DONE)
@@ -69,17 +291,20 @@ static void CALLBACK dsp_callback(HWAVEOUT hwo, UINT uMsg, DWORD_PTR dwInstance,
 		for (int i = 0; i < DSP_BUFFER_COUNT; i++)
 			if (&dsp->buffer[i].hdr == hdr)
 			{
+				InterlockedDecrement(&dsp->queued);
 				SetEvent(dsp->buffer[i].event);
 				break;
 			}
 	}
 }
 
-static bool dsp_send_buffer(HWAVEOUT waveout, struct dsp_buffer *buffer)
+static bool dsp_send_buffer(struct dsp_file *dsp, struct dsp_buffer *buffer)
 {
-	int r = waveOutWrite(waveout, &buffer->hdr, sizeof(WAVEHDR));
+	InterlockedIncrement(&dsp->queued);
+	int r = waveOutWrite(dsp->waveout, &buffer->hdr, sizeof(WAVEHDR));
 	if (r != MMSYSERR_NOERROR)
 	{
+		InterlockedDecrement(&dsp->queued);
 		log_error("waveOutWrite() failed, error code: %d", r);
 		return false;
 	}
@@ -87,10 +312,122 @@ static bool dsp_send_buffer(HWAVEOUT waveout, struct dsp_buffer *buffer)
 		return true;
 }
 
+static bool dsp_waveout_open(struct dsp_file *dsp)
+{
+	int r = waveOutOpen(&dsp->waveout, 0, &dsp->format, (DWORD_PTR)dsp_callback, (DWORD_PTR)dsp, CALLBACK_FUNCTION);
+	if (r != MMSYSERR_NOERROR)
+	{
+		dsp->waveout = NULL;
+		log_error("waveOutOpen() failed, error code: %d", r);
+		return false;
+	}
+	/* Buffer should be capable of storing 0.125 seconds of sample */
+	dsp->buffer_size = dsp->format.nAvgBytesPerSec / 8;
+
+	log_info("DSP buffer size: %d", dsp->buffer_size);
+	dsp->current_buffer = 0;
+	dsp->queued = 0;
+	for (int i = 0; i < DSP_BUFFER_COUNT; i++)
+	{
+		dsp->buffer[i].hdr.lpData = VirtualAlloc(NULL, dsp->buffer_size, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_READWRITE);
+		dsp->buffer[i].hdr.dwBufferLength = dsp->buffer_size;
+		dsp->buffer[i].hdr.dwBytesRecorded = 0;
+		dsp->buffer[i].hdr.dwUser = 0;
+		dsp->buffer[i].hdr.dwFlags = 0;
+		dsp->buffer[i].hdr.dwLoops = 0;
+		dsp->buffer[i].hdr.lpNext = NULL;
+		dsp->buffer[i].hdr.reserved = 0;
+		dsp->buffer[i].buffer_pos = dsp->buffer_size;
+		int r = waveOutPrepareHeader(dsp->waveout, &dsp->buffer[i].hdr, sizeof(WAVEHDR));
+		if (r != MMSYSERR_NOERROR)
+		{
+			for (int j = 0; j < i; j++)
+				waveOutUnprepareHeader(dsp->waveout, &dsp->buffer[j].hdr, sizeof(WAVEHDR));
+			waveOutClose(dsp->waveout);
+			dsp->waveout = NULL;
+			log_error("waveOutPrepareHeader() failed, error code: %d", r);
+			return false;
+		}
+	}
+	return true;
+}
+
+static void dsp_waveout_drain(struct dsp_file *dsp)
+{
+	/* Send remaining buffer */
+	struct dsp_buffer *buffer = &dsp->buffer[dsp->current_buffer];
+	if (buffer->buffer_pos < dsp->buffer_size)
+	{
+		buffer->hdr.dwBufferLength = buffer->buffer_pos;
+		dsp_send_buffer(dsp, buffer);
+		/* Wait for playback */
+		WaitForSingleObject(buffer->event, INFINITE);
+		buffer->hdr.dwBufferLength = dsp->buffer_size;
+		/* Make the buffer available again */
+		buffer->buffer_pos = dsp->buffer_size;
+		SetEvent(buffer->event);
+		dsp->current_buffer = (dsp->current_buffer + 1) % DSP_BUFFER_COUNT;
+	}
+	while (dsp->queued > 0)
+		Sleep(1);
+}
+
+static ssize_t dsp_waveout_write(struct dsp_file *dsp, const char *buf, size_t count)
+{
+	size_t written = 0;
+	while (count > 0)
+	{
+		if (dsp->buffer[dsp->current_buffer].buffer_pos == dsp->buffer_size)
+		{
+			WaitForSingleObject(dsp->buffer[dsp->current_buffer].event, INFINITE);
+			dsp->buffer[dsp->current_buffer].buffer_pos = 0;
+		}
+		size_t current = min(count, (size_t)(dsp->buffer_size - dsp->buffer[dsp->current_buffer].buffer_pos));
+
+		memcpy(dsp->buffer[dsp->current_buffer].hdr.lpData + dsp->buffer[dsp->current_buffer].buffer_pos,
+			buf + written, current);
+		dsp->buffer[dsp->current_buffer].buffer_pos += current;
+		if (dsp->buffer[dsp->current_buffer].buffer_pos == dsp->buffer_size)
+		{
+			bool ok = dsp_send_buffer(dsp, &dsp->buffer[dsp->current_buffer]);
+			dsp->current_buffer = (dsp->current_buffer + 1) % DSP_BUFFER_COUNT;
+			if (!ok)
+				return written;
+		}
+		written += current;
+		count -= current;
+	}
+	return written;
+}
+
+static bool dsp_open(struct dsp_file *dsp)
+{
+	dsp->format.nBlockAlign = dsp->format.nChannels * dsp->format.wBitsPerSample / 8;
+	dsp->format.nAvgBytesPerSec = dsp->format.nSamplesPerSec * dsp->format.nBlockAlign;
+	if (dsp_wasapi_open(dsp))
+		dsp->opened = true;
+	else
+	{
+		log_warning("WASAPI not available, falling back to waveOut.");
+		dsp->opened = dsp_waveout_open(dsp);
+	}
+	return dsp->opened;
+}
+
+static void dsp_drain(struct dsp_file *dsp)
+{
+	if (dsp->client)
+		dsp_wasapi_drain(dsp);
+	else if (dsp->waveout)
+		dsp_waveout_drain(dsp);
+}
+
 static void dsp_reset(struct dsp_file *dsp)
 {
+	dsp_wasapi_close(dsp);
 	if (dsp->waveout)
 	{
+		waveOutReset(dsp->waveout);
 		for (int i = 0; i < DSP_BUFFER_COUNT; i++)
 		{
 			waveOutUnprepareHeader(dsp->waveout, &dsp->buffer[i].hdr, sizeof(WAVEHDR));
@@ -100,6 +437,7 @@ static void dsp_reset(struct dsp_file *dsp)
 		waveOutClose(dsp->waveout);
 		dsp->waveout = NULL;
 	}
+	dsp->opened = false;
 	dsp->format.wFormatTag = WAVE_FORMAT_PCM;
 	dsp->format.nChannels = 1;
 	dsp->format.nSamplesPerSec = 8000;
@@ -110,15 +448,11 @@ static void dsp_reset(struct dsp_file *dsp)
 static int dsp_close(struct file *f)
 {
 	struct dsp_file *dsp = (struct dsp_file *)f;
-	/* Send remaining buffer */
-	if (dsp->buffer[dsp->current_buffer].buffer_pos < dsp->buffer_size)
-	{
-		dsp->buffer[dsp->current_buffer].hdr.dwBufferLength = dsp->buffer[dsp->current_buffer].buffer_pos;
-		dsp_send_buffer(dsp->waveout, &dsp->buffer[dsp->current_buffer]);
-		/* Wait for playback */
-		WaitForSingleObject(dsp->buffer[dsp->current_buffer].event, INFINITE);
-	}
+	dsp_drain(dsp);
 	dsp_reset(dsp);
+	for (int i = 0; i < DSP_BUFFER_COUNT; i++)
+		CloseHandle(dsp->buffer[i].event);
+	CloseHandle(dsp->event);
 	kfree(dsp, sizeof(struct dsp_file));
 	return 0;
 }
@@ -135,77 +469,50 @@ static int dsp_write(struct file *f, const void *buf, size_t count)
 	ssize_t r = 0;
 	AcquireSRWLockExclusive(&f->rw_lock);
 	struct dsp_file *dsp = (struct dsp_file *)f;
-	if (dsp->waveout == NULL)
-	{
-		dsp->format.nBlockAlign = dsp->format.nChannels * dsp->format.wBitsPerSample / 8;
-		dsp->format.nAvgBytesPerSec = dsp->format.nSamplesPerSec * dsp->format.nBlockAlign;
-		int r = waveOutOpen(&dsp->waveout, 0, &dsp->format, (DWORD_PTR)dsp_callback, (DWORD_PTR)dsp, CALLBACK_FUNCTION);
-		if (r != MMSYSERR_NOERROR)
-		{
-			dsp->waveout = NULL;
-			log_error("waveOutOpen() failed, error code: %d", r);
-			r = 0;
-			goto out;
-		}
-		/* Buffer should be capable of storing 0.125 seconds of sample */
-		dsp->buffer_size = dsp->format.nAvgBytesPerSec / 8;
+	if (!dsp->opened && !dsp_open(dsp))
+		goto out;
+	if (dsp->client)
+		r = dsp_wasapi_write(dsp, (const char *)buf, count);
+	else
+		r = dsp_waveout_write(dsp, (const char *)buf, count);
+out:
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return r;
+}
 
-		log_info("DSP buffer size: %d", dsp->buffer_size);
-		dsp->current_buffer = 0;
-		for (int i = 0; i < DSP_BUFFER_COUNT; i++)
-		{
-			dsp->buffer[i].hdr.lpData = VirtualAlloc(NULL, dsp->buffer_size, MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_READWRITE);
-			dsp->buffer[i].hdr.dwBufferLength = dsp->buffer_size;
-			dsp->buffer[i].hdr.dwBytesRecorded = 0;
-			dsp->buffer[i].hdr.dwUser = 0;
-			dsp->buffer[i].hdr.dwFlags = 0;
-			dsp->buffer[i].hdr.dwLoops = 0;
-			dsp->buffer[i].hdr.lpNext = NULL;
-			dsp->buffer[i].hdr.reserved = 0;
-			dsp->buffer[i].buffer_pos = dsp->buffer_size;
-			int r = waveOutPrepareHeader(dsp->waveout, &dsp->buffer[i].hdr, sizeof(WAVEHDR));
-			if (r != MMSYSERR_NOERROR)
-			{
-				for (int j = 0; j < i; j++)
-					waveOutUnprepareHeader(dsp->waveout, &dsp->buffer[j].hdr, sizeof(WAVEHDR));
-				waveOutClose(dsp->waveout);
-				dsp->waveout = NULL;
-				log_error("waveOutPrepareHeader() failed, error code: %d", r);
-				r = 0;
-				goto out;
-			}
-		}
+/* Get output buffer status: free space and fragment layout, and bytes queued for playback */
+static void dsp_get_output_status(struct dsp_file *dsp, audio_buf_info *info, int *delay)
+{
+	if (dsp->client)
+	{
+		int block = dsp->format.nBlockAlign;
+		int total = dsp->buffer_frames * block;
+		int queued = dsp_wasapi_padding(dsp) * block + dsp->partial_size;
+		info->fragstotal = DSP_WASAPI_FRAGMENTS;
+		info->fragsize = total / DSP_WASAPI_FRAGMENTS / block * block;
+		info->bytes = max(total - queued, 0);
+		*delay = queued;
 	}
-	size_t written = 0;
-	while (count > 0)
+	else if (dsp->waveout)
 	{
-		if (dsp->buffer[dsp->current_buffer].buffer_pos == dsp->buffer_size)
-		{
-			WaitForSingleObject(dsp->buffer[dsp->current_buffer].event, INFINITE);
-			dsp->buffer[dsp->current_buffer].buffer_pos = 0;
-		}
-		size_t current = min(count, (size_t)(dsp->buffer_size - dsp->buffer[dsp->current_buffer].buffer_pos));
-
-		memcpy(dsp->buffer[dsp->current_buffer].hdr.lpData + dsp->buffer[dsp->current_buffer].buffer_pos,
-			(char *)buf + written, current);
-		dsp->buffer[dsp->current_buffer].buffer_pos += current;
-		if (dsp->buffer[dsp->current_buffer].buffer_pos == dsp->buffer_size)
-		{
-			bool ok = dsp_send_buffer(dsp->waveout, &dsp->buffer[dsp->current_buffer]);
-			dsp->current_buffer = (dsp->current_buffer + 1) % DSP_BUFFER_COUNT;
-			if (!ok)
-			{
-				r = written;
-				goto out;
-			}
-		}
-		written += current;
-		count -= current;
+		int partial = dsp->buffer[dsp->current_buffer].buffer_pos < dsp->buffer_size ? dsp->buffer[dsp->current_buffer].buffer_pos : 0;
+		int queued = dsp->queued * dsp->buffer_size + partial;
+		info->fragstotal = DSP_BUFFER_COUNT;
+		info->fragsize = dsp->buffer_size;
+		info->bytes = max(DSP_BUFFER_COUNT * dsp->buffer_size - queued, 0);
+		*delay = queued;
 	}
-	r = written;
-out:
-	ReleaseSRWLockExclusive(&f->rw_lock);
-	return r;
+	else
+	{
+		/* Not opened yet, report the buffer the WASAPI stream would get */
+		int bytes = (int)((LONGLONG)dsp->format.nSamplesPerSec * DSP_WASAPI_BUFFER_DURATION / 10000000)
+			* dsp->format.nChannels * dsp->format.wBitsPerSample / 8;
+		info->fragstotal = DSP_WASAPI_FRAGMENTS;
+		info->fragsize = bytes / DSP_WASAPI_FRAGMENTS;
+		info->bytes = bytes;
+		*delay = 0;
+	}
+	info->fragments = info->fragsize > 0 ? info->bytes / info->fragsize : 0;
 }
 
 static int dsp_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
@@ -221,6 +528,12 @@ static int dsp_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 		dsp_reset(dsp);
 		break;
 	}
+	case SNDCTL_DSP_SYNC:
+	{
+		log_info("SNDCTL_DSP_SYNC.");
+		dsp_drain(dsp);
+		break;
+	}
 	case SNDCTL_DSP_SPEED:
 	{
 		if (!mm_check_read((int *)arg, sizeof(int)))
@@ -291,6 +604,28 @@ static int dsp_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 		*(int *)arg = AFMT_U8 | AFMT_S16_LE;
 		break;
 	}
+	case SNDCTL_DSP_GETOSPACE:
+	{
+		if (!mm_check_write((audio_buf_info *)arg, sizeof(audio_buf_info)))
+		{
+			r = -L_EFAULT;
+			break;
+		}
+		int delay;
+		dsp_get_output_status(dsp, (audio_buf_info *)arg, &delay);
+		break;
+	}
+	case SNDCTL_DSP_GETODELAY:
+	{
+		if (!mm_check_write((int *)arg, sizeof(int)))
+		{
+			r = -L_EFAULT;
+			break;
+		}
+		audio_buf_info info;
+		dsp_get_output_status(dsp, &info, (int *)arg);
+		break;
+	}
 	}
 	ReleaseSRWLockExclusive(&f->rw_lock);
 	return r;
@@ -313,6 +648,11 @@ static struct file *dsp_alloc()
 	struct dsp_file *f = (struct dsp_file *)kmalloc(sizeof(struct dsp_file));
 	file_init(&f->custom_file.base_file, &dsp_ops, O_LARGEFILE | O_RDWR);
 	virtualfs_init_custom(f, &dsp_desc);
+	f->opened = false;
+	f->client = NULL;
+	f->render = NULL;
+	f->started = false;
+	f->partial_size = 0;
 	f->waveout = NULL;
 	SECURITY_ATTRIBUTES attr;
 	attr.nLength = sizeof(SECURITY_ATTRIBUTES);
@@ -320,6 +660,7 @@ static struct file *dsp_alloc()
 	attr.lpSecurityDescriptor = NULL;
 	for (int i = 0; i < DSP_BUFFER_COUNT; i++)
 		f->buffer[i].event = CreateEventW(&attr, FALSE, TRUE, NULL);
+	f->event = CreateEventW(&attr, FALSE, FALSE, NULL);
 	dsp_reset(f);
 	return (struct file *)f;
 }
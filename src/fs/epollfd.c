@@ -17,144 +17,509 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_VFS
+
 #include <common/errno.h>
 #include <common/poll.h>
 #include <fs/epollfd.h>
+#include <lib/list.h>
 #include <syscall/mm.h>
+#include <syscall/sig.h>
 #include <syscall/syscall.h>
+#include <syscall/timer.h>
+#include <syscall/vfs.h>
 #include <heap.h>
 #include <log.h>
 
-#define MAX_EPOLLFD_COUNT	128
+/* Readiness based epoll
+ * Registered files are kept in an interest list hashed by fd. An item is in one of these states:
+ * ARMED: a thread pool wait is registered on (a duplicate of) the file's poll handle, when it is
+ *        signaled the callback moves the item to the ready list and wakes up epoll_wait().
+ * READY: the item is on the ready list and its status is checked by the next epoll_wait(). Level
+ *        triggered items stay on the ready list as long as they are reported, otherwise they are
+ *        armed again. Edge triggered (EPOLLET) items are armed again right after being reported,
+ *        so they only come back when the poll handle is signaled again. Socket events are reset
+ *        by get_poll_status(), pipe events follow the level and may report early, never late.
+ * POLLED: the file has no poll handle, its status is checked by every epoll_wait(). There is no
+ *        way to see edges on these files, EPOLLET items among them behave as level triggered.
+ * IDLE: an EPOLLONESHOT item which has fired, or an item without interesting events.
+ * Thus epoll_wait() only does work proportional to the number of ready items.
+ * The file lock protects everything, waits are always unregistered without holding it.
+ */
+
+#define EPOLL_HASH_BUCKETS	128
+/* Interval to recheck files without poll handles when blocking */
+#define EPOLL_POLLED_INTERVAL	10
 
-struct epoll_fd
+#define EPOLL_ITEM_IDLE		0
+#define EPOLL_ITEM_ARMED	1
+#define EPOLL_ITEM_READY	2
+#define EPOLL_ITEM_POLLED	3
+#define EPOLL_ITEM_DEAD		4
+
+struct epollfd_file;
+struct epoll_item
 {
+	struct epollfd_file *epollfd;
+	struct list_node hash_node;
+	struct list_node node; /* In ready_list or polled_list depending on state */
 	int fd;
+	struct file *file; /* Identity of the registered file, not referenced */
 	struct epoll_event event;
+	bool disabled; /* An EPOLLONESHOT item which has fired */
+	int state;
+	HANDLE handle; /* Duplicated poll handle, only valid when wait is not NULL */
+	HANDLE wait;
 };
 
 struct epollfd_file
 {
 	struct file base_file;
-	int fd_count;
-	struct epoll_fd fds[MAX_EPOLLFD_COUNT];
+	HANDLE ready_event; /* Signaled when the ready list is not empty */
+	struct list ready_list;
+	struct list polled_list;
+	struct list hash[EPOLL_HASH_BUCKETS];
 };
 
+static struct epoll_item *epollfd_find(struct epollfd_file *epollfd, int fd)
+{
+	struct list_node *cur;
+	list_iterate(&epollfd->hash[fd % EPOLL_HASH_BUCKETS], cur)
+	{
+		struct epoll_item *item = list_entry(cur, struct epoll_item, hash_node);
+		if (item->fd == fd)
+			return item;
+	}
+	return NULL;
+}
+
+/* Remove the item from its current list, the caller holds the lock */
+static void epollfd_unlink(struct epollfd_file *epollfd, struct epoll_item *item)
+{
+	if (item->state == EPOLL_ITEM_READY)
+		list_remove(&epollfd->ready_list, &item->node);
+	else if (item->state == EPOLL_ITEM_POLLED)
+		list_remove(&epollfd->polled_list, &item->node);
+	item->state = EPOLL_ITEM_IDLE;
+}
+
+static void epollfd_make_ready(struct epollfd_file *epollfd, struct epoll_item *item)
+{
+	item->state = EPOLL_ITEM_READY;
+	list_add(&epollfd->ready_list, &item->node);
+	SetEvent(epollfd->ready_event);
+}
+
+static VOID CALLBACK epollfd_wait_callback(PVOID parameter, BOOLEAN timer_or_wait_fired)
+{
+	struct epoll_item *item = (struct epoll_item *)parameter;
+	struct epollfd_file *epollfd = item->epollfd;
+	AcquireSRWLockExclusive(&epollfd->base_file.rw_lock);
+	if (item->state == EPOLL_ITEM_ARMED)
+		epollfd_make_ready(epollfd, item);
+	ReleaseSRWLockExclusive(&epollfd->base_file.rw_lock);
+}
+
+/* Release the wait of an item which has already fired or was never registered */
+static void epollfd_disarm(struct epoll_item *item)
+{
+	if (item->wait)
+	{
+		UnregisterWaitEx(item->wait, NULL);
+		CloseHandle(item->handle);
+		item->wait = NULL;
+		item->handle = NULL;
+	}
+}
+
+/* Release a wait which may still fire, must be called without holding the lock */
+static void epollfd_disarm_sync(HANDLE wait, HANDLE handle)
+{
+	if (wait)
+	{
+		UnregisterWaitEx(wait, INVALID_HANDLE_VALUE);
+		CloseHandle(handle);
+	}
+}
+
+static int epollfd_interest(struct epoll_item *item)
+{
+	if (item->disabled)
+		return 0;
+	return (item->event.events & (LINUX_POLLIN | LINUX_POLLOUT)) | LINUX_POLLERR | LINUX_POLLHUP;
+}
+
+/* Wait for the file to become ready, the item must not be on any list */
+static void epollfd_arm(struct epollfd_file *epollfd, struct epoll_item *item, struct file *f)
+{
+	epollfd_disarm(item);
+	if (!f->op_vtable->get_poll_handle)
+	{
+		if (f->op_vtable->get_poll_status)
+		{
+			item->state = EPOLL_ITEM_POLLED;
+			list_add(&epollfd->polled_list, &item->node);
+		}
+		else
+			item->state = EPOLL_ITEM_IDLE;
+		return;
+	}
+	int e;
+	HANDLE handle = f->op_vtable->get_poll_handle(f, &e);
+	if (!(e & epollfd_interest(item)))
+	{
+		item->state = EPOLL_ITEM_IDLE;
+		return;
+	}
+	/* The duplicate keeps the wait valid even if the file is closed while armed */
+	if (!DuplicateHandle(GetCurrentProcess(), handle, GetCurrentProcess(), &item->handle, SYNCHRONIZE, FALSE, 0))
+	{
+		log_error("DuplicateHandle() failed, error code: %d", GetLastError());
+		item->state = EPOLL_ITEM_POLLED;
+		list_add(&epollfd->polled_list, &item->node);
+		return;
+	}
+	item->state = EPOLL_ITEM_ARMED;
+	if (!RegisterWaitForSingleObject(&item->wait, item->handle, epollfd_wait_callback, item, INFINITE, WT_EXECUTEONLYONCE))
+	{
+		log_error("RegisterWaitForSingleObject() failed, error code: %d", GetLastError());
+		CloseHandle(item->handle);
+		item->handle = NULL;
+		item->wait = NULL;
+		item->state = EPOLL_ITEM_POLLED;
+		list_add(&epollfd->polled_list, &item->node);
+	}
+}
+
+/* Query events of a file, with a poll handle but no get_poll_status() the handle state is used */
+static int epollfd_get_events(struct file *f)
+{
+	if (f->op_vtable->get_poll_status)
+		return f->op_vtable->get_poll_status(f);
+	if (f->op_vtable->get_poll_handle)
+	{
+		int e;
+		HANDLE handle = f->op_vtable->get_poll_handle(f, &e);
+		if (WaitForSingleObject(handle, 0) == WAIT_OBJECT_0)
+			return e;
+	}
+	return 0;
+}
+
+static void epollfd_free_item(struct epoll_item *item)
+{
+	kfree(item, sizeof(struct epoll_item));
+}
+
 static int epollfd_close(struct file *f)
 {
 	struct epollfd_file *epollfd = (struct epollfd_file *)f;
+	/* Keep pending callbacks away from the lists before the items are freed */
+	AcquireSRWLockExclusive(&f->rw_lock);
+	for (int i = 0; i < EPOLL_HASH_BUCKETS; i++)
+	{
+		struct list_node *cur;
+		list_iterate(&epollfd->hash[i], cur)
+			list_entry(cur, struct epoll_item, hash_node)->state = EPOLL_ITEM_DEAD;
+	}
+	list_init(&epollfd->ready_list);
+	list_init(&epollfd->polled_list);
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	for (int i = 0; i < EPOLL_HASH_BUCKETS; i++)
+	{
+		struct list_node *cur = list_head(&epollfd->hash[i]);
+		while (cur)
+		{
+			struct epoll_item *item = list_entry(cur, struct epoll_item, hash_node);
+			cur = list_next(cur);
+			epollfd_disarm_sync(item->wait, item->handle);
+			epollfd_free_item(item);
+		}
+	}
+	CloseHandle(epollfd->ready_event);
 	kfree(epollfd, sizeof(struct epollfd_file));
 	return 0;
 }
 
-int epollfd_ctl_add(struct file *f, int fd, struct epoll_event *event)
+static void epollfd_after_fork_child(struct file *f)
 {
+	/* Handles and thread pool waits are not inherited, recheck every item */
 	struct epollfd_file *epollfd = (struct epollfd_file *)f;
-	AcquireSRWLockExclusive(&epollfd->base_file.rw_lock);
-	int r = 0;
-	/* Ensure the monitoring file is not registered before */
-	for (int i = 0; i < epollfd->fd_count; i++)
-		if (epollfd->fds[i].fd == fd)
+	epollfd->ready_event = CreateEventW(NULL, TRUE, FALSE, NULL);
+	list_init(&epollfd->ready_list);
+	list_init(&epollfd->polled_list);
+	for (int i = 0; i < EPOLL_HASH_BUCKETS; i++)
+	{
+		struct list_node *cur;
+		list_iterate(&epollfd->hash[i], cur)
 		{
-			r = -L_EEXIST;
-			goto out;
+			struct epoll_item *item = list_entry(cur, struct epoll_item, hash_node);
+			item->wait = NULL;
+			item->handle = NULL;
+			if (epollfd_interest(item))
+				epollfd_make_ready(epollfd, item);
+			else
+				item->state = EPOLL_ITEM_IDLE;
 		}
-	/* Add the file */
-	epollfd->fds[epollfd->fd_count].fd = fd;
-	epollfd->fds[epollfd->fd_count].event = *event;
-	epollfd->fd_count++;
-out:
+	}
+}
+
+/* Remove an item and free it, the caller holds the lock, which is released */
+static void epollfd_remove_unlock(struct epollfd_file *epollfd, struct epoll_item *item)
+{
+	list_remove(&epollfd->hash[item->fd % EPOLL_HASH_BUCKETS], &item->hash_node);
+	epollfd_unlink(epollfd, item);
+	item->state = EPOLL_ITEM_DEAD;
+	HANDLE wait = item->wait, handle = item->handle;
 	ReleaseSRWLockExclusive(&epollfd->base_file.rw_lock);
-	return r;
+	epollfd_disarm_sync(wait, handle);
+	epollfd_free_item(item);
 }
 
-int epollfd_ctl_del(struct file *f, int fd)
+/* An item whose file is not the one currently at its descriptor was left behind by a closed file,
+ * the descriptor was then reused. Linux removes the registration on the last close(), so such an
+ * item is treated as not registered by epoll_ctl() and dropped.
+ */
+int epollfd_ctl_add(struct file *f, int fd, struct file *mf, struct epoll_event *event)
 {
 	struct epollfd_file *epollfd = (struct epollfd_file *)f;
 	AcquireSRWLockExclusive(&epollfd->base_file.rw_lock);
 	int r = 0;
-	/* Find and delete the monitoring file */
-	for (int i = 0; i < epollfd->fd_count; i++)
-		if (epollfd->fds[i].fd == fd)
+	HANDLE wait = NULL, handle = NULL;
+	/* Like regular files on Linux, files which cannot be polled are rejected */
+	if (!mf->op_vtable->get_poll_status && !mf->op_vtable->get_poll_handle)
+	{
+		r = -L_EPERM;
+		goto out;
+	}
+	/* Ensure the monitoring file is not registered before */
+	struct epoll_item *item = epollfd_find(epollfd, fd);
+	if (item && item->file == mf)
+	{
+		r = -L_EEXIST;
+		goto out;
+	}
+	if (item)
+	{
+		/* Stale item, reuse it for the new file and take over the old wait */
+		wait = item->wait;
+		handle = item->handle;
+		epollfd_unlink(epollfd, item);
+	}
+	else
+	{
+		item = (struct epoll_item *)kmalloc(sizeof(struct epoll_item));
+		if (!item)
 		{
-			for (int j = i; j + 1 < epollfd->fd_count; j++)
-				epollfd->fds[j] = epollfd->fds[j + 1];
-			epollfd->fd_count--;
+			r = -L_ENOMEM;
 			goto out;
 		}
-	r = -L_ENOENT;
+		item->epollfd = epollfd;
+		item->fd = fd;
+		list_add(&epollfd->hash[fd % EPOLL_HASH_BUCKETS], &item->hash_node);
+	}
+	/* Add the file, its status is checked by the next epoll_wait() */
+	item->file = mf;
+	item->event = *event;
+	item->disabled = false;
+	item->handle = NULL;
+	item->wait = NULL;
+	epollfd_make_ready(epollfd, item);
 out:
 	ReleaseSRWLockExclusive(&epollfd->base_file.rw_lock);
+	epollfd_disarm_sync(wait, handle);
 	return r;
 }
 
-int epollfd_ctl_mod(struct file *f, int fd, struct epoll_event *event)
+int epollfd_ctl_del(struct file *f, int fd, struct file *mf)
 {
 	struct epollfd_file *epollfd = (struct epollfd_file *)f;
 	AcquireSRWLockExclusive(&epollfd->base_file.rw_lock);
-	int r = 0;
-	/* Find and modify the monitoring file */
-	for (int i = 0; i < epollfd->fd_count; i++)
-		if (epollfd->fds[i].fd == fd)
-		{
-			epollfd->fds[i].event = *event;
-			goto out;
-		}
-	r = -L_ENOENT;
-out:
-	ReleaseSRWLockExclusive(&epollfd->base_file.rw_lock);
+	/* Find and delete the monitoring file */
+	struct epoll_item *item = epollfd_find(epollfd, fd);
+	if (!item)
+	{
+		ReleaseSRWLockExclusive(&epollfd->base_file.rw_lock);
+		return -L_ENOENT;
+	}
+	/* A stale item is dropped all the same */
+	int r = item->file == mf? 0: -L_ENOENT;
+	epollfd_remove_unlock(epollfd, item);
 	return r;
 }
 
-static const struct file_ops epollfd_ops = {
-	.close = epollfd_close,
-};
-
-int epollfd_alloc(struct file **f)
+int epollfd_ctl_mod(struct file *f, int fd, struct file *mf, struct epoll_event *event)
 {
-	struct epollfd_file *epollfd = (struct epollfd_file *)kmalloc(sizeof(struct epollfd_file));
-	file_init(&epollfd->base_file, &epollfd_ops, 0);
-	epollfd->fd_count = 0;
-	*f = (struct file *)epollfd;
+	struct epollfd_file *epollfd = (struct epollfd_file *)f;
+	AcquireSRWLockExclusive(&epollfd->base_file.rw_lock);
+	/* Find and modify the monitoring file */
+	struct epoll_item *item = epollfd_find(epollfd, fd);
+	if (!item)
+	{
+		ReleaseSRWLockExclusive(&epollfd->base_file.rw_lock);
+		return -L_ENOENT;
+	}
+	if (item->file != mf)
+	{
+		epollfd_remove_unlock(epollfd, item);
+		return -L_ENOENT;
+	}
+	item->event = *event;
+	item->disabled = false;
+	/* Take over the old wait and let the next epoll_wait() check the file with the new events */
+	HANDLE wait = item->wait, handle = item->handle;
+	item->wait = NULL;
+	item->handle = NULL;
+	epollfd_unlink(epollfd, item);
+	epollfd_make_ready(epollfd, item);
+	ReleaseSRWLockExclusive(&epollfd->base_file.rw_lock);
+	epollfd_disarm_sync(wait, handle);
 	return 0;
 }
 
-bool epollfd_is_epollfd(struct file *f)
-{
-	return f->op_vtable == &epollfd_ops;
-}
-
-int epollfd_get_nfds(struct file *f)
+/* Check an item on the ready or polled list, returns the events to report */
+static int epollfd_check(struct epollfd_file *epollfd, struct epoll_item *item)
 {
-	struct epollfd_file *epollfd = (struct epollfd_file *)f;
-	return epollfd->fd_count;
+	struct file *f = vfs_get(item->fd);
+	if (f != item->file)
+	{
+		/* The file was closed, remove it like Linux does on the last close() */
+		if (f)
+			vfs_release(f);
+		epollfd_unlink(epollfd, item);
+		list_remove(&epollfd->hash[item->fd % EPOLL_HASH_BUCKETS], &item->hash_node);
+		epollfd_disarm(item);
+		epollfd_free_item(item);
+		return 0;
+	}
+	int revents = epollfd_get_events(f) & epollfd_interest(item);
+	if (item->state == EPOLL_ITEM_READY)
+	{
+		list_remove(&epollfd->ready_list, &item->node);
+		if (revents && !(item->event.events & (EPOLLONESHOT | EPOLLET)))
+		{
+			/* Level triggered: check it again next time, at the tail for fairness */
+			epollfd_disarm(item);
+			list_add(&epollfd->ready_list, &item->node);
+		}
+		else
+		{
+			item->state = EPOLL_ITEM_IDLE;
+			if (revents && (item->event.events & EPOLLONESHOT))
+			{
+				epollfd_disarm(item);
+				item->disabled = true;
+			}
+			else
+				epollfd_arm(epollfd, item, f);
+		}
+	}
+	else if (revents && (item->event.events & EPOLLONESHOT))
+	{
+		list_remove(&epollfd->polled_list, &item->node);
+		item->state = EPOLL_ITEM_IDLE;
+		item->disabled = true;
+	}
+	vfs_release(f);
+	return revents;
 }
 
-void epollfd_to_pollfds(struct file *f, struct linux_pollfd *fds)
+/* Collect ready events, returns the count, the caller holds the lock */
+static int epollfd_collect(struct epollfd_file *epollfd, struct epoll_event *events, int maxevents)
 {
-	struct epollfd_file *epollfd = (struct epollfd_file *)f;
-	for (int i = 0; i < epollfd->fd_count; i++)
+	int r = 0;
+	struct list *lists[2] = { &epollfd->ready_list, &epollfd->polled_list };
+	for (int l = 0; l < 2; l++)
 	{
-		fds[i].fd = epollfd->fds[i].fd;
-		fds[i].events = epollfd->fds[i].event.events & (POLLIN | POLLOUT | POLLERR);
-		fds[i].revents = 0;
+		/* Items reported by this call are appended to the tail again, only visit the current ones */
+		struct list_node *tail = list_tail(lists[l]);
+		struct list_node *cur = list_head(lists[l]);
+		while (cur && r < maxevents)
+		{
+			struct list_node *next = list_next(cur);
+			bool last = (cur == tail);
+			struct epoll_item *item = list_entry(cur, struct epoll_item, node);
+			struct epoll_event event = item->event;
+			int revents = epollfd_check(epollfd, item);
+			if (revents)
+			{
+				events[r].events = revents;
+				events[r].data = event.data;
+				r++;
+			}
+			if (last)
+				break;
+			cur = next;
+		}
 	}
+	if (list_empty(&epollfd->ready_list))
+		ResetEvent(epollfd->ready_event);
+	return r;
 }
 
-int epollfd_to_events(struct file *f, const struct linux_pollfd *fds, struct epoll_event *events, int maxevents)
+int epollfd_wait(struct file *f, struct epoll_event *events, int maxevents, int timeout, const sigset_t *sigmask)
 {
 	struct epollfd_file *epollfd = (struct epollfd_file *)f;
-	int r = 0;
-	for (int i = 0; i < epollfd->fd_count; i++)
+	sigset_t oldmask;
+	if (sigmask)
+		signal_before_pwait(sigmask, &oldmask);
+	uint64_t end = timer_monotonic_ms() + timeout;
+	int r;
+	for (;;)
 	{
-		if (r >= maxevents)
-			return r;
-		if (fds[i].revents)
+		AcquireSRWLockExclusive(&f->rw_lock);
+		r = epollfd_collect(epollfd, events, maxevents);
+		bool polled = !list_empty(&epollfd->polled_list);
+		ReleaseSRWLockExclusive(&f->rw_lock);
+		if (r > 0 || timeout == 0)
+			break;
+		DWORD wait_ms = INFINITE;
+		if (timeout > 0)
+		{
+			uint64_t now = timer_monotonic_ms();
+			if (now >= end)
+				break;
+			wait_ms = (DWORD)(end - now);
+		}
+		if (polled)
+			wait_ms = min(wait_ms, EPOLL_POLLED_INTERVAL);
+		if (signal_wait(1, &epollfd->ready_event, wait_ms) == WAIT_INTERRUPTED)
 		{
-			events[r].events = fds[i].revents;
-			events[r].data = epollfd->fds[i].event.data;
-			r++;
+			r = -L_EINTR;
+			break;
 		}
 	}
+	if (sigmask)
+		signal_after_pwait(&oldmask);
 	return r;
 }
+
+static const struct file_ops epollfd_ops = {
+	.after_fork_child = epollfd_after_fork_child,
+	.close = epollfd_close,
+};
+
+int epollfd_alloc(struct file **f)
+{
+	struct epollfd_file *epollfd = (struct epollfd_file *)kmalloc(sizeof(struct epollfd_file));
+	HANDLE ready_event = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (!ready_event)
+	{
+		log_error("CreateEventW() failed, error code: %d", GetLastError());
+		kfree(epollfd, sizeof(struct epollfd_file));
+		return -L_ENOMEM;
+	}
+	file_init(&epollfd->base_file, &epollfd_ops, 0);
+	epollfd->ready_event = ready_event;
+	list_init(&epollfd->ready_list);
+	list_init(&epollfd->polled_list);
+	for (int i = 0; i < EPOLL_HASH_BUCKETS; i++)
+		list_init(&epollfd->hash[i]);
+	*f = (struct file *)epollfd;
+	return 0;
+}
+
+bool epollfd_is_epollfd(struct file *f)
+{
+	return f->op_vtable == &epollfd_ops;
+}
@@ -20,6 +20,7 @@
 #pragma once
 
 #include <common/eventpoll.h>
+#include <common/signal.h>
 #include <fs/file.h>
 
 #include <stdbool.h>
@@ -27,9 +28,8 @@
 int epollfd_alloc(struct file **epollfd);
 bool epollfd_is_epollfd(struct file *f);
 
-int epollfd_ctl_add(struct file *f, int fd, struct epoll_event *event);
-int epollfd_ctl_del(struct file *f, int fd);
-int epollfd_ctl_mod(struct file *f, int fd, struct epoll_event *event);
-int epollfd_get_nfds(struct file *f);
-void epollfd_to_pollfds(struct file *f, struct linux_pollfd *fds);
-int epollfd_to_events(struct file *f, const struct linux_pollfd *fds, struct epoll_event *events, int maxevents);
+/* mf is the file currently referred to by fd, it is automatically removed when fd no longer refers to it */
+int epollfd_ctl_add(struct file *f, int fd, struct file *mf, struct epoll_event *event);
+int epollfd_ctl_del(struct file *f, int fd, struct file *mf);
+int epollfd_ctl_mod(struct file *f, int fd, struct file *mf, struct epoll_event *event);
+int epollfd_wait(struct file *f, struct epoll_event *events, int maxevents, int timeout, const sigset_t *sigmask);
@@ -18,11 +18,14 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_VFS
+
 #include <common/errno.h>
 #include <common/fcntl.h>
 #include <common/poll.h>
 #include <fs/eventfd.h>
 #include <syscall/mm.h>
+#include <syscall/sig.h>
 #include <heap.h>
 #include <log.h>
 
@@ -35,14 +38,25 @@
 #define EFD_CLOEXEC O_CLOEXEC
 #define EFD_NONBLOCK O_NONBLOCK
 
+/* The counter lives in a shared page and is only changed with interlocked operations.
+ * The event is only signaled when somebody may be waiting for the change: a blocked
+ * reader or writer registered in efd_waiters, or a poller once the file has been polled.
+ * Readers only wait for the counter to become non zero, so writers only signal on that
+ * transition.
+ */
+struct eventfd_shared
+{
+	volatile uint64_t value;
+	volatile LONG waiters;
+	volatile LONG polled;
+};
+
 struct eventfd_file
 {
 	struct file efd_base_file;
-	uint64_t *efd_value;
+	struct eventfd_shared *efd_shared;
 	HANDLE efd_handle;
-	HANDLE efd_mutex;
-	HANDLE efd_sem_canread;
-	HANDLE efd_sem_canwrite;
+	HANDLE efd_event;
 	int efd_flags;
 };
 
@@ -64,25 +78,25 @@ int eventfd_alloc(struct file **eventfdfile, uint64_t count, int flags)
 	attrs.lpSecurityDescriptor = NULL;
 	attrs.bInheritHandle = TRUE;
 
-	efd->efd_handle = CreateFileMapping(NULL, &attrs, PAGE_READWRITE, 0, 8, NULL);
+	efd->efd_handle = CreateFileMapping(NULL, &attrs, PAGE_READWRITE, 0, sizeof(struct eventfd_shared), NULL);
 	if (efd->efd_handle == NULL)
 	{
 		log_error("eventfd: Can't create handle: %u", GetLastError());
 		return -L_ENOMEM;
 	}
 
-	efd->efd_value = MapViewOfFile(efd->efd_handle, FILE_MAP_ALL_ACCESS, 0, 0, 8);
-	if (efd->efd_value == NULL)
+	efd->efd_shared = MapViewOfFile(efd->efd_handle, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(struct eventfd_shared));
+	if (efd->efd_shared == NULL)
 	{
 		log_error("eventfd: Can't map handle: %u", GetLastError());
 		return -L_ENOMEM;
 	}
 
-	efd->efd_mutex = CreateMutex(&attrs, FALSE, NULL);
-	efd->efd_sem_canread = CreateSemaphore(&attrs, 0, 1, NULL);
-	efd->efd_sem_canwrite = CreateSemaphore(&attrs, 1, 1, NULL);
+	efd->efd_event = CreateEvent(&attrs, TRUE, FALSE, NULL);
 
-	*efd->efd_value = count;
+	efd->efd_shared->value = count;
+	efd->efd_shared->waiters = 0;
+	efd->efd_shared->polled = 0;
 	efd->efd_flags = flags;
 
 	*eventfdfile = (struct file *)efd;
@@ -96,37 +110,49 @@ static int eventfd_close(struct file *f)
 
 	log_info("eventfd: close(%p)", f);
 
-	BOOL rv = UnmapViewOfFile(efd->efd_value);
-	if (rv)
+	BOOL rv = UnmapViewOfFile(efd->efd_shared);
+	if (!rv)
 	{
 		log_error("eventfd: can't unmap handle during close");
 	}
 
 	rv = CloseHandle(efd->efd_handle);
-	if (rv)
+	if (!rv)
 	{
 		log_error("eventfd: can't close handle during close");
 	}
 
-	CloseHandle(efd->efd_mutex);
-	CloseHandle(efd->efd_sem_canread);
-	CloseHandle(efd->efd_sem_canwrite);
+	CloseHandle(efd->efd_event);
 
 	kfree(efd, sizeof(struct eventfd_file));
 	return 0;
 }
 
+/* 64-bit loads are not atomic on x86 */
+static uint64_t eventfd_get_value(struct eventfd_file *efd)
+{
+	return InterlockedCompareExchange64((volatile LONGLONG *)&efd->efd_shared->value, 0, 0);
+}
+
 static int eventfd_get_poll_status(struct file *f)
 {
 	struct eventfd_file *efd = (struct eventfd_file *)f;
 	int events = 0;
 
-	if (*efd->efd_value < EVENTFD_VALUE_MAX)
+	uint64_t value = eventfd_get_value(efd);
+	if (value == 0)
+	{
+		/* The caller may wait on the event, reset it before looking again so a write is not missed */
+		ResetEvent(efd->efd_event);
+		value = eventfd_get_value(efd);
+	}
+
+	if (value < EVENTFD_VALUE_MAX)
 	{
 		events |= LINUX_POLLOUT;
 	}
 
-	if (*efd->efd_value > 0)
+	if (value > 0)
 	{
 		events |= LINUX_POLLIN;
 	}
@@ -134,13 +160,47 @@ static int eventfd_get_poll_status(struct file *f)
 	return events;
 }
 
+static HANDLE eventfd_get_poll_handle(struct file *f, int *poll_events)
+{
+	struct eventfd_file *efd = (struct eventfd_file *)f;
+
+	if (!efd->efd_shared->polled)
+	{
+		InterlockedExchange(&efd->efd_shared->polled, 1);
+	}
+	*poll_events = LINUX_POLLIN | LINUX_POLLOUT;
+	return efd->efd_event;
+}
+
 static void eventfd_after_fork_child(struct file *f)
 {
 	struct eventfd_file *efd = (struct eventfd_file *)f;
 
 	log_info("eventfd: after_fork_child");
 
-	efd->efd_value = MapViewOfFile(efd->efd_handle, FILE_MAP_ALL_ACCESS, 0, 0, 8);
+	efd->efd_shared = MapViewOfFile(efd->efd_handle, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(struct eventfd_shared));
+}
+
+/* Block until the counter may have changed, returns 0 if it should be checked again */
+static int eventfd_wait(struct eventfd_file *efd, uint64_t old_value)
+{
+	if ((efd->efd_flags & EFD_NONBLOCK) || (efd->efd_base_file.flags & O_NONBLOCK))
+	{
+		return -L_EAGAIN;
+	}
+
+	InterlockedIncrement(&efd->efd_shared->waiters);
+	ResetEvent(efd->efd_event);
+	int r = 0;
+	if (eventfd_get_value(efd) == old_value)
+	{
+		if (signal_wait(1, &efd->efd_event, INFINITE) == WAIT_INTERRUPTED)
+		{
+			r = -L_EINTR;
+		}
+	}
+	InterlockedDecrement(&efd->efd_shared->waiters);
+	return r;
 }
 
 static size_t eventfd_read(struct file *f, void *buf, size_t count)
@@ -154,31 +214,33 @@ static size_t eventfd_read(struct file *f, void *buf, size_t count)
 		return -L_EINVAL;
 	}
 
-	WaitForSingleObject(efd->efd_mutex, INFINITE);
-
-	while (*efd->efd_value == 0)
+	uint64_t value;
+	for (;;)
 	{
-		ReleaseMutex(efd->efd_mutex);
-
-		if (efd->efd_flags & EFD_NONBLOCK)
+		value = eventfd_get_value(efd);
+		if (value == 0)
 		{
-			return -L_EAGAIN;
+			int r = eventfd_wait(efd, value);
+			if (r < 0)
+			{
+				return r;
+			}
+			continue;
 		}
-		else
+		if ((uint64_t)InterlockedCompareExchange64((volatile LONGLONG *)&efd->efd_shared->value, 0, value) == value)
 		{
-			WaitForSingleObject(efd->efd_sem_canread, INFINITE);
+			break;
 		}
+	}
 
-		WaitForSingleObject(efd->efd_mutex, INFINITE);
+	/* Only blocked writers and pollers waiting for POLLOUT care about the counter going down */
+	if (efd->efd_shared->waiters || (value == EVENTFD_VALUE_MAX && efd->efd_shared->polled))
+	{
+		SetEvent(efd->efd_event);
 	}
 
 	uint64_t* output = (uint64_t *)buf;
-
-	*output = *efd->efd_value;
-	*efd->efd_value = 0;
-
-	ReleaseSemaphore(efd->efd_sem_canwrite, 1, NULL);
-	ReleaseMutex(efd->efd_mutex);
+	*output = value;
 
 	return 8;
 }
@@ -194,35 +256,42 @@ static size_t eventfd_write(struct file *f, const void *buf, size_t count)
 		return -L_EINVAL;
 	}
 
-	WaitForSingleObject(efd->efd_mutex, INFINITE);
-
-	const uint64_t* input = (const uint64_t *)buf;
-	while (*efd->efd_value + *input > EVENTFD_VALUE_MAX)
+	uint64_t input = *(const uint64_t *)buf;
+	if (input == 0xffffffffffffffffLLU)
 	{
-		ReleaseMutex(efd->efd_mutex);
+		return -L_EINVAL;
+	}
 
-		if (efd->efd_flags & EFD_NONBLOCK)
+	uint64_t value;
+	for (;;)
+	{
+		value = eventfd_get_value(efd);
+		if (input > EVENTFD_VALUE_MAX - value)
 		{
-			return -L_EAGAIN;
+			int r = eventfd_wait(efd, value);
+			if (r < 0)
+			{
+				return r;
+			}
+			continue;
 		}
-		else
+		if ((uint64_t)InterlockedCompareExchange64((volatile LONGLONG *)&efd->efd_shared->value, value + input, value) == value)
 		{
-			WaitForSingleObject(efd->efd_sem_canwrite, INFINITE);
+			break;
 		}
-
-		WaitForSingleObject(efd->efd_mutex, INFINITE);
 	}
 
-	*efd->efd_value += *input;
-
-	ReleaseSemaphore(efd->efd_sem_canread, 1, NULL);
-	ReleaseMutex(efd->efd_mutex);
+	if (value == 0 && input > 0 && (efd->efd_shared->waiters || efd->efd_shared->polled))
+	{
+		SetEvent(efd->efd_event);
+	}
 
 	return 8;
 }
 
 static const struct file_ops eventfd_ops = {
 	.get_poll_status = eventfd_get_poll_status,
+	.get_poll_handle = eventfd_get_poll_handle,
 	.after_fork_child = eventfd_after_fork_child,
 	.close = eventfd_close,
 	.read = eventfd_read,
@@ -20,9 +20,11 @@
 #pragma once
 
 #include <common/dirent.h>
+#include <common/fcntl.h>
 #include <common/stat.h>
 #include <common/statfs.h>
 #include <common/types.h>
+#include <common/uio.h>
 #include <common/utime.h>
 
 #include <stdbool.h>
@@ -55,17 +57,39 @@ struct file_ops
 	int (*getpath)(struct file *f, char *buf);
 	size_t (*read)(struct file *f, void *buf, size_t count);
 	size_t (*write)(struct file *f, const void *buf, size_t count);
+	/* Optional: returns -L_ENOSYS to fall back to read() or write() per segment */
+	size_t (*readv)(struct file *f, const struct iovec *iov, int iovcnt);
+	size_t (*writev)(struct file *f, const struct iovec *iov, int iovcnt);
 	size_t (*pread)(struct file *f, void *buf, size_t count, loff_t offset);
 	size_t (*pwrite)(struct file *f, const void *buf, size_t count, loff_t offset);
+	/* Optional: returns -L_ENOSYS to fall back to pread() or pwrite() per segment */
+	size_t (*preadv)(struct file *f, const struct iovec *iov, int iovcnt, loff_t offset);
+	size_t (*pwritev)(struct file *f, const struct iovec *iov, int iovcnt, loff_t offset);
 	size_t (*readlink)(struct file *f, char *buf, size_t bufsize);
 	int (*truncate)(struct file *f, loff_t length);
+	/* Optional: allocate or deallocate file space, see fallocate() */
+	int (*fallocate)(struct file *f, int mode, loff_t offset, loff_t len);
 	int (*fsync)(struct file *f);
+	/* Optional: act on a validated posix_fadvise() advice, len 0 means up to the end of file */
+	int (*fadvise)(struct file *f, loff_t offset, loff_t len, int advice);
+	/* Optional: advisory locks. For lock(), cmd is F_GETLK, F_SETLK or F_SETLKW and lock->l_start is
+	 * relative to the beginning of the file. Both return -L_EINTR if a blocking wait is interrupted by a signal.
+	 */
+	int (*flock)(struct file *f, int operation);
+	int (*lock)(struct file *f, int cmd, struct flock64 *lock);
 	int (*llseek)(struct file *f, loff_t offset, loff_t *newoffset, int whence);
 	int (*stat)(struct file *f, struct newstat *buf);
+	/* Optional: identity of the underlying object, the same through every handle in every process */
+	int (*get_identity)(struct file *f, uint64_t *volume, uint64_t *file_id);
 	int (*utimens)(struct file *f, const struct timespec *times);
 	int (*getdents)(struct file *f, void *dirent, size_t count, getdents_callback *fill_callback);
 	int (*ioctl)(struct file *f, unsigned int cmd, unsigned long arg);
 	int (*statfs)(struct file *f, struct statfs64 *buf);
+	/* Memory mapping: open a section holding the file data at offset
+	 * The section holds file data [*section_start, *section_end). *section_start is the file offset of the
+	 * beginning of the section, it must be block aligned and is negative if the section starts before the file.
+	 */
+	HANDLE (*create_section)(struct file *f, bool writable, loff_t offset, loff_t *section_start, loff_t *section_end);
 	/* Socket functions */
 	int (*bind)(struct file *f, const struct sockaddr *addr, int addrlen);
 	int (*connect)(struct file *f, const struct sockaddr *addr, size_t addrlen);
@@ -103,6 +127,8 @@ static void file_init(struct file *f, const struct file_ops *op_vtable, int flag
 struct file_system
 {
 	int (*open)(struct mount_point *mp, const char *path, int flags, int internal_flags, int mode, struct file **fp, char *target, int buflen);
+	/* Optional: stat a file without opening it, returns -L_ENOSYS to fall back to open() */
+	int (*stat)(struct mount_point *mp, const char *path, struct newstat *buf);
 	int (*symlink)(struct mount_point *mp, const char *target, const char *linkpath);
 	int (*link)(struct mount_point *mp, struct file *f, const char *newpath);
 	int (*unlink)(struct mount_point *mp, const char *pathname);
@@ -0,0 +1,738 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define LOG_CATEGORY LOG_CAT_VFS
+
+#include <common/errno.h>
+#include <common/fcntl.h>
+#include <common/fs.h>
+#include <fs/imgfs.h>
+#include <syscall/mm.h>
+#include <syscall/vfs.h>
+#include <heap.h>
+#include <log.h>
+#include <ntdll.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <limits.h>
+
+/* Read-only image file system
+ *
+ * A whole directory tree packed into one image file, built by tools/mkimgfs.py. Looking up a path
+ * in a tree of thousands of small files on NTFS costs a few NtCreateFile() calls per component,
+ * an image needs none: the metadata is mapped into memory on first use and searched in place.
+ *
+ * Image layout, all integers are little endian:
+ *   struct imgfs_header
+ *   Inode table: struct imgfs_inode[inode_count], inode 0 is the root directory
+ *   Directory entry table: struct imgfs_dirent[dirent_count], the entries of a directory are
+ *     contiguous and sorted by name, compared bytewise with shorter names first on a tie
+ *   String table: file names and symlink targets, not NUL terminated
+ *   File data, from offset `data' to the end of the image
+ * Everything before the file data is metadata. File data of at least BLOCK_SIZE bytes starts at
+ * a block aligned offset, so it can be mapped straight from the image by mm as a file view.
+ * Smaller files are packed together and are read into memory when mapped.
+ *
+ * The image file is opened lazily in each process which accesses the mount, the handles are
+ * inherited on fork and the metadata view is mapped again in the child.
+ */
+
+#define IMGFS_MAGIC			0x53464D49 /* "IMFS" */
+#define IMGFS_VERSION		1
+#define IMGFS_MAX_IMAGES	8
+
+struct imgfs_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t inode_count;
+	uint32_t dirent_count;
+	uint64_t inode_table; /* Image offset of the inode table */
+	uint64_t dirent_table; /* Image offset of the directory entry table */
+	uint64_t string_table; /* Image offset of the string table */
+	uint64_t string_size; /* Size of the string table */
+	uint64_t data; /* Image offset of file data, end of metadata */
+};
+
+struct imgfs_inode
+{
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t nlink;
+	int64_t mtime;
+	uint32_t mtime_nsec;
+	uint32_t parent; /* Directory: inode of the parent directory */
+	uint64_t size; /* Regular file: file size; symlink: target length; directory: entry count */
+	uint64_t offset; /* Regular file: image offset of data; symlink: string offset of target; directory: first entry */
+};
+
+struct imgfs_dirent
+{
+	uint32_t inode;
+	uint32_t name; /* String offset of name */
+	uint32_t namelen;
+};
+
+struct imgfs_image
+{
+	int mp_key;
+	HANDLE file;
+	HANDLE section;
+	char *base; /* View of the metadata, NULL if not mapped in this process */
+	uint64_t image_size;
+	struct imgfs_header header; /* Validated copy of the header */
+};
+
+struct imgfs_file
+{
+	struct file base_file;
+	struct imgfs_image *image;
+	uint32_t ino;
+	loff_t offset; /* File offset, or directory entry index for getdents() */
+	int pathlen;
+	char path[]; /* Path relative to mount point */
+};
+
+struct imgfs
+{
+	struct file_system base_fs;
+	SRWLOCK rw_lock;
+	int image_count;
+	struct imgfs_image images[IMGFS_MAX_IMAGES];
+};
+
+static struct imgfs *imgfs;
+
+static const struct imgfs_inode *imgfs_get_inode(struct imgfs_image *image, uint32_t ino)
+{
+	if (ino >= image->header.inode_count)
+		return NULL;
+	return (const struct imgfs_inode *)(image->base + image->header.inode_table) + ino;
+}
+
+static const char *imgfs_get_string(struct imgfs_image *image, uint64_t offset, uint64_t len)
+{
+	if (offset > image->header.string_size || len > image->header.string_size - offset)
+		return NULL;
+	return image->base + image->header.string_table + offset;
+}
+
+/* Get the entries of a directory inode, returns NULL for a corrupted inode */
+static const struct imgfs_dirent *imgfs_get_dirents(struct imgfs_image *image, const struct imgfs_inode *inode)
+{
+	if (inode->offset > image->header.dirent_count || inode->size > image->header.dirent_count - inode->offset)
+		return NULL;
+	return (const struct imgfs_dirent *)(image->base + image->header.dirent_table) + inode->offset;
+}
+
+static bool imgfs_check_table(const struct imgfs_header *header, uint64_t offset, uint64_t count, uint64_t size)
+{
+	return offset >= sizeof(struct imgfs_header) && offset <= header->data && count <= (header->data - offset) / size;
+}
+
+static int imgfs_map(struct imgfs_image *image);
+
+/* Open the image of a mount point and map its metadata, caller holds imgfs->rw_lock exclusively */
+static int imgfs_load(struct imgfs_image *image, struct mount_point *mp)
+{
+	if (!image->file)
+	{
+		UNICODE_STRING name;
+		name.Buffer = mp->win_path;
+		name.Length = name.MaximumLength = mp->win_path_len * sizeof(WCHAR);
+		OBJECT_ATTRIBUTES oa;
+		InitializeObjectAttributes(&oa, &name, OBJ_INHERIT, NULL, NULL);
+		IO_STATUS_BLOCK status_block;
+		NTSTATUS status = NtOpenFile(&image->file, GENERIC_READ | GENERIC_EXECUTE | SYNCHRONIZE, &oa, &status_block,
+			FILE_SHARE_READ | FILE_SHARE_DELETE, FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE);
+		if (!NT_SUCCESS(status))
+		{
+			log_error("imgfs: Opening image \"%S\" failed, status: %x", mp->win_path, status);
+			image->file = NULL;
+			return -L_EIO;
+		}
+		LARGE_INTEGER offset;
+		offset.QuadPart = 0;
+		status = NtReadFile(image->file, NULL, NULL, NULL, &status_block, &image->header, sizeof(struct imgfs_header), &offset, NULL);
+		LARGE_INTEGER size;
+		struct imgfs_header *header = &image->header;
+		if (!NT_SUCCESS(status) || status_block.Information != sizeof(struct imgfs_header) || !GetFileSizeEx(image->file, &size)
+			|| header->magic != IMGFS_MAGIC || header->version != IMGFS_VERSION || header->inode_count == 0
+			|| header->data > (uint64_t)size.QuadPart
+			|| !imgfs_check_table(header, header->inode_table, header->inode_count, sizeof(struct imgfs_inode))
+			|| !imgfs_check_table(header, header->dirent_table, header->dirent_count, sizeof(struct imgfs_dirent))
+			|| !imgfs_check_table(header, header->string_table, header->string_size, 1))
+		{
+			log_error("imgfs: \"%S\" is not a valid image.", mp->win_path);
+			NtClose(image->file);
+			image->file = NULL;
+			return -L_EIO;
+		}
+		image->image_size = size.QuadPart;
+		oa.ObjectName = NULL;
+		status = NtCreateSection(&image->section, SECTION_MAP_READ | SECTION_MAP_EXECUTE | SECTION_QUERY, &oa, NULL,
+			PAGE_EXECUTE_WRITECOPY, SEC_COMMIT, image->file);
+		if (!NT_SUCCESS(status))
+		{
+			log_error("imgfs: NtCreateSection() failed, status: %x", status);
+			NtClose(image->file);
+			image->file = NULL;
+			return -L_EIO;
+		}
+	}
+	return imgfs_map(image);
+}
+
+/* Map the metadata of an opened image */
+static int imgfs_map(struct imgfs_image *image)
+{
+	PVOID base_addr = NULL;
+	SIZE_T view_size = (SIZE_T)image->header.data;
+	NTSTATUS status = NtMapViewOfSection(image->section, NtCurrentProcess(), &base_addr, 0, 0, NULL, &view_size, ViewUnmap, 0, PAGE_READONLY);
+	if (!NT_SUCCESS(status))
+	{
+		log_error("imgfs: Mapping image metadata failed, status: %x", status);
+		return -L_ENOMEM;
+	}
+	image->base = (char *)base_addr;
+	return 0;
+}
+
+/* Get the loaded image of a mount point */
+static struct imgfs_image *imgfs_get_image(struct mount_point *mp, int *err)
+{
+	AcquireSRWLockShared(&imgfs->rw_lock);
+	for (int i = 0; i < imgfs->image_count; i++)
+		if (imgfs->images[i].mp_key == mp->key && imgfs->images[i].base)
+		{
+			ReleaseSRWLockShared(&imgfs->rw_lock);
+			return &imgfs->images[i];
+		}
+	ReleaseSRWLockShared(&imgfs->rw_lock);
+	AcquireSRWLockExclusive(&imgfs->rw_lock);
+	struct imgfs_image *image = NULL;
+	for (int i = 0; i < imgfs->image_count; i++)
+		if (imgfs->images[i].mp_key == mp->key)
+			image = &imgfs->images[i];
+	if (!image)
+	{
+		if (imgfs->image_count == IMGFS_MAX_IMAGES)
+		{
+			log_error("imgfs: Too many images.");
+			*err = -L_ENOMEM;
+			goto out;
+		}
+		image = &imgfs->images[imgfs->image_count++];
+		image->mp_key = mp->key;
+		image->file = NULL;
+		image->section = NULL;
+		image->base = NULL;
+	}
+	if (!image->base && (*err = imgfs_load(image, mp)) < 0)
+		image = NULL;
+out:
+	ReleaseSRWLockExclusive(&imgfs->rw_lock);
+	return image;
+}
+
+/* Find the directory entry of a name, the entries are sorted */
+static const struct imgfs_dirent *imgfs_find_dirent(struct imgfs_image *image, const struct imgfs_inode *dir, const char *name, int namelen)
+{
+	const struct imgfs_dirent *dirents = imgfs_get_dirents(image, dir);
+	if (!dirents)
+		return NULL;
+	size_t low = 0, high = (size_t)dir->size;
+	while (low < high)
+	{
+		size_t mid = low + (high - low) / 2;
+		const char *entry = imgfs_get_string(image, dirents[mid].name, dirents[mid].namelen);
+		if (!entry)
+			return NULL;
+		int r = memcmp(entry, name, min((uint32_t)namelen, dirents[mid].namelen));
+		if (r == 0)
+			r = (int)dirents[mid].namelen - namelen;
+		if (r == 0)
+			return &dirents[mid];
+		if (r < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return NULL;
+}
+
+/* Find the inode of a path relative to the root of the image */
+static int imgfs_lookup(struct imgfs_image *image, const char *path, uint32_t *ino)
+{
+	uint32_t cur = 0;
+	for (;;)
+	{
+		while (*path == '/')
+			path++;
+		if (!*path)
+		{
+			*ino = cur;
+			return 0;
+		}
+		const char *end = path;
+		while (*end && *end != '/')
+			end++;
+		int len = (int)(end - path);
+		if (!(len == 1 && path[0] == '.'))
+		{
+			const struct imgfs_inode *inode = imgfs_get_inode(image, cur);
+			if (!inode)
+				return -L_EIO;
+			if (!S_ISDIR(inode->mode))
+				return -L_ENOTDIR;
+			const struct imgfs_dirent *dirent = imgfs_find_dirent(image, inode, path, len);
+			if (!dirent)
+				return -L_ENOENT;
+			cur = dirent->inode;
+		}
+		path = end;
+	}
+}
+
+static int imgfs_close(struct file *f)
+{
+	struct imgfs_file *file = (struct imgfs_file *)f;
+	kfree(file, sizeof(struct imgfs_file) + file->pathlen + 1);
+	return 0;
+}
+
+static int imgfs_getpath(struct file *f, char *buf)
+{
+	struct imgfs_file *file = (struct imgfs_file *)f;
+	const struct mount_point *mp = vfs_get_mountpoint(file->image->mp_key);
+	int len = mp->mountpoint_len;
+	memcpy(buf, mp->mountpoint, len);
+	if (file->pathlen)
+	{
+		buf[len++] = '/';
+		memcpy(buf + len, file->path, file->pathlen);
+		len += file->pathlen;
+	}
+	buf[len] = 0;
+	return len;
+}
+
+static size_t imgfs_pread_unsafe(struct imgfs_file *file, void *buf, size_t count, loff_t offset)
+{
+	const struct imgfs_inode *inode = imgfs_get_inode(file->image, file->ino);
+	if (S_ISDIR(inode->mode))
+		return -L_EISDIR;
+	if (offset < 0)
+		return -L_EINVAL;
+	if ((uint64_t)offset >= inode->size)
+		return 0;
+	count = (size_t)min((uint64_t)count, inode->size - offset);
+	size_t num_read = 0;
+	while (count > 0)
+	{
+		LARGE_INTEGER byte_offset;
+		byte_offset.QuadPart = inode->offset + offset;
+		ULONG count_ulong = (ULONG)min(count, (size_t)UINT_MAX);
+		IO_STATUS_BLOCK status_block;
+		NTSTATUS status = NtReadFile(file->image->file, NULL, NULL, NULL, &status_block, buf, count_ulong, &byte_offset, NULL);
+		if (status == STATUS_END_OF_FILE)
+			break;
+		if (!NT_SUCCESS(status))
+		{
+			log_warning("NtReadFile() failed, status: %x", status);
+			return -L_EIO;
+		}
+		if (status_block.Information == 0)
+			break;
+		num_read += status_block.Information;
+		buf = (char *)buf + status_block.Information;
+		offset += status_block.Information;
+		count -= status_block.Information;
+	}
+	return num_read;
+}
+
+static size_t imgfs_read(struct file *f, void *buf, size_t count)
+{
+	AcquireSRWLockExclusive(&f->rw_lock);
+	struct imgfs_file *file = (struct imgfs_file *)f;
+	size_t r = imgfs_pread_unsafe(file, buf, count, file->offset);
+	if ((intptr_t)r > 0)
+		file->offset += r;
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return r;
+}
+
+static size_t imgfs_write(struct file *f, const void *buf, size_t count)
+{
+	return -L_EBADF;
+}
+
+static size_t imgfs_pread(struct file *f, void *buf, size_t count, loff_t offset)
+{
+	return imgfs_pread_unsafe((struct imgfs_file *)f, buf, count, offset);
+}
+
+static size_t imgfs_pwrite(struct file *f, const void *buf, size_t count, loff_t offset)
+{
+	return -L_EBADF;
+}
+
+static size_t imgfs_readlink(struct file *f, char *buf, size_t bufsize)
+{
+	struct imgfs_file *file = (struct imgfs_file *)f;
+	const struct imgfs_inode *inode = imgfs_get_inode(file->image, file->ino);
+	if (!S_ISLNK(inode->mode))
+		return -L_EINVAL;
+	const char *target = imgfs_get_string(file->image, inode->offset, inode->size);
+	if (!target)
+		return -L_EIO;
+	size_t r = min(bufsize, (size_t)inode->size);
+	memcpy(buf, target, r);
+	return r;
+}
+
+static int imgfs_truncate(struct file *f, loff_t length)
+{
+	return -L_EROFS;
+}
+
+static int imgfs_fsync(struct file *f)
+{
+	return 0;
+}
+
+static int imgfs_llseek(struct file *f, loff_t offset, loff_t *newoffset, int whence)
+{
+	struct imgfs_file *file = (struct imgfs_file *)f;
+	AcquireSRWLockExclusive(&f->rw_lock);
+	int r = 0;
+	loff_t target;
+	if (whence == SEEK_SET)
+		target = offset;
+	else if (whence == SEEK_CUR)
+		target = file->offset + offset;
+	else if (whence == SEEK_END)
+		target = imgfs_get_inode(file->image, file->ino)->size + offset;
+	else
+		r = -L_EINVAL;
+	if (r == 0 && target < 0)
+		r = -L_EINVAL;
+	if (r == 0)
+		*newoffset = file->offset = target;
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return r;
+}
+
+static void imgfs_fill_stat(struct imgfs_image *image, uint32_t ino, struct newstat *buf)
+{
+	const struct imgfs_inode *inode = imgfs_get_inode(image, ino);
+	INIT_STRUCT_NEWSTAT_PADDING(buf);
+	buf->st_dev = mkdev(7, image->mp_key);
+	buf->st_ino = ino + 1;
+	buf->st_mode = inode->mode;
+	buf->st_nlink = inode->nlink;
+	buf->st_uid = inode->uid;
+	buf->st_gid = inode->gid;
+	buf->st_rdev = 0;
+	buf->st_size = S_ISDIR(inode->mode)? 0: inode->size;
+	buf->st_blksize = PAGE_SIZE;
+	buf->st_blocks = (buf->st_size + 511) / 512;
+	buf->st_atime = buf->st_mtime = buf->st_ctime = inode->mtime;
+	buf->st_atime_nsec = buf->st_mtime_nsec = buf->st_ctime_nsec = inode->mtime_nsec;
+}
+
+static int imgfs_stat(struct file *f, struct newstat *buf)
+{
+	struct imgfs_file *file = (struct imgfs_file *)f;
+	imgfs_fill_stat(file->image, file->ino, buf);
+	return 0;
+}
+
+static int imgfs_utimens(struct file *f, const struct timespec *times)
+{
+	return -L_EROFS;
+}
+
+static int imgfs_getdents(struct file *f, void *dirent, size_t count, getdents_callback *fill_callback)
+{
+	struct imgfs_file *file = (struct imgfs_file *)f;
+	struct imgfs_image *image = file->image;
+	const struct imgfs_inode *inode = imgfs_get_inode(image, file->ino);
+	if (!S_ISDIR(inode->mode))
+		return -L_ENOTDIR;
+	const struct imgfs_dirent *dirents = imgfs_get_dirents(image, inode);
+	if (!dirents)
+		return -L_EIO;
+	AcquireSRWLockExclusive(&f->rw_lock);
+	intptr_t r = 0;
+	size_t size = 0;
+	char *buf = (char *)dirent;
+	/* The offset is the index of the next entry, "." and ".." come first */
+	while ((uint64_t)file->offset < inode->size + 2)
+	{
+		const char *name;
+		int namelen;
+		uint32_t ino;
+		if (file->offset == 0)
+		{
+			name = ".";
+			namelen = 1;
+			ino = file->ino;
+		}
+		else if (file->offset == 1)
+		{
+			name = "..";
+			namelen = 2;
+			ino = inode->parent;
+		}
+		else
+		{
+			const struct imgfs_dirent *entry = &dirents[file->offset - 2];
+			name = imgfs_get_string(image, entry->name, entry->namelen);
+			namelen = entry->namelen;
+			ino = entry->inode;
+			if (!name || !imgfs_get_inode(image, ino))
+			{
+				r = -L_EIO;
+				break;
+			}
+		}
+		int mode = imgfs_get_inode(image, ino)->mode;
+		char type = S_ISDIR(mode)? DT_DIR: S_ISLNK(mode)? DT_LNK: S_ISREG(mode)? DT_REG: DT_UNKNOWN;
+		/* Names in the image are not NUL terminated */
+		char namebuf[256];
+		if (namelen >= sizeof(namebuf))
+		{
+			r = -L_EIO;
+			break;
+		}
+		memcpy(namebuf, name, namelen);
+		namebuf[namelen] = 0;
+		r = (*fill_callback)(buf, ino + 1, namebuf, namelen, type, count, GETDENTS_UTF8);
+		if (r < 0)
+			break;
+		count -= r;
+		size += r;
+		buf += r;
+		file->offset++;
+	}
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	if (r < 0 && r != GETDENTS_ERR_BUFFER_OVERFLOW)
+		return (int)r;
+	return (int)size;
+}
+
+static int imgfs_statfs(struct file *f, struct statfs64 *buf)
+{
+	struct imgfs_file *file = (struct imgfs_file *)f;
+	buf->f_type = IMGFS_MAGIC;
+	buf->f_bsize = PAGE_SIZE;
+	buf->f_blocks = (file->image->image_size + PAGE_SIZE - 1) / PAGE_SIZE;
+	buf->f_bfree = 0;
+	buf->f_bavail = 0;
+	buf->f_files = file->image->header.inode_count;
+	buf->f_ffree = 0;
+	buf->f_fsid.val[0] = 0;
+	buf->f_fsid.val[1] = 0;
+	buf->f_namelen = 255;
+	buf->f_frsize = 0;
+	buf->f_flags = 1; /* ST_RDONLY */
+	buf->f_spare[0] = 0;
+	buf->f_spare[1] = 0;
+	buf->f_spare[2] = 0;
+	buf->f_spare[3] = 0;
+	return 0;
+}
+
+/* Large files are block aligned in the image and can be mapped directly */
+static HANDLE imgfs_create_section(struct file *f, bool writable, loff_t offset, loff_t *section_start, loff_t *section_end)
+{
+	struct imgfs_file *file = (struct imgfs_file *)f;
+	const struct imgfs_inode *inode = imgfs_get_inode(file->image, file->ino);
+	if (writable || !S_ISREG(inode->mode) || inode->size < BLOCK_SIZE || inode->offset % BLOCK_SIZE != 0
+		|| inode->offset + inode->size > file->image->image_size)
+		return NULL;
+	HANDLE section;
+	NTSTATUS status = NtDuplicateObject(NtCurrentProcess(), file->image->section, NtCurrentProcess(), &section, 0, 0, DUPLICATE_SAME_ACCESS);
+	if (!NT_SUCCESS(status))
+	{
+		log_warning("NtDuplicateObject() failed, status: %x", status);
+		return NULL;
+	}
+	*section_start = -(loff_t)inode->offset;
+	*section_end = inode->size;
+	return section;
+}
+
+static const struct file_ops imgfs_ops =
+{
+	.close = imgfs_close,
+	.getpath = imgfs_getpath,
+	.read = imgfs_read,
+	.write = imgfs_write,
+	.pread = imgfs_pread,
+	.pwrite = imgfs_pwrite,
+	.readlink = imgfs_readlink,
+	.truncate = imgfs_truncate,
+	.fsync = imgfs_fsync,
+	.llseek = imgfs_llseek,
+	.stat = imgfs_stat,
+	.utimens = imgfs_utimens,
+	.getdents = imgfs_getdents,
+	.statfs = imgfs_statfs,
+	.create_section = imgfs_create_section,
+};
+
+static int imgfs_open(struct mount_point *mp, const char *path, int flags, int internal_flags, int mode, struct file **fp, char *target, int buflen)
+{
+	int r = 0;
+	struct imgfs_image *image = imgfs_get_image(mp, &r);
+	if (!image)
+		return r;
+	uint32_t ino;
+	r = imgfs_lookup(image, path, &ino);
+	if (r == -L_ENOENT && (flags & O_CREAT))
+		return -L_EROFS;
+	if (r < 0)
+		return r;
+	if ((flags & O_CREAT) && (flags & O_EXCL))
+		return -L_EEXIST;
+	const struct imgfs_inode *inode = imgfs_get_inode(image, ino);
+	if (!inode)
+		return -L_EIO;
+	if (S_ISLNK(inode->mode))
+	{
+		if (!(flags & O_NOFOLLOW))
+		{
+			const char *link = imgfs_get_string(image, inode->offset, inode->size);
+			if (!link)
+				return -L_EIO;
+			if (inode->size >= (uint64_t)buflen)
+				return -L_ENAMETOOLONG;
+			memcpy(target, link, (size_t)inode->size);
+			target[inode->size] = 0;
+			return 1;
+		}
+		if (!(flags & O_PATH))
+		{
+			log_info("Specified O_NOFOLLOW but not O_PATH, returning ELOOP.");
+			return -L_ELOOP;
+		}
+	}
+	else if (!S_ISDIR(inode->mode) && (flags & O_DIRECTORY))
+		return -L_ENOTDIR;
+	if (!(flags & O_PATH) && ((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC)))
+		return S_ISDIR(inode->mode)? -L_EISDIR: -L_EROFS;
+	if ((internal_flags & (INTERNAL_O_TMP | INTERNAL_O_SPECIAL | INTERNAL_O_DELETE)))
+		return -L_EROFS;
+	if (fp)
+	{
+		int pathlen = strlen(path);
+		struct imgfs_file *file = (struct imgfs_file *)kmalloc(sizeof(struct imgfs_file) + pathlen + 1);
+		file_init(&file->base_file, &imgfs_ops, flags);
+		file->image = image;
+		file->ino = ino;
+		file->offset = 0;
+		file->pathlen = pathlen;
+		memcpy(file->path, path, pathlen + 1);
+		*fp = (struct file *)file;
+	}
+	return 0;
+}
+
+static int imgfs_stat_path(struct mount_point *mp, const char *pathname, struct newstat *buf)
+{
+	int r = 0;
+	struct imgfs_image *image = imgfs_get_image(mp, &r);
+	if (!image)
+		return r;
+	uint32_t ino;
+	r = imgfs_lookup(image, pathname, &ino);
+	if (r < 0)
+		return r;
+	const struct imgfs_inode *inode = imgfs_get_inode(image, ino);
+	if (!inode)
+		return -L_EIO;
+	if (S_ISLNK(inode->mode))
+		return -L_ENOSYS; /* Let vfs follow the symlink */
+	imgfs_fill_stat(image, ino, buf);
+	return 0;
+}
+
+static int imgfs_symlink(struct mount_point *mp, const char *target, const char *linkpath)
+{
+	return -L_EROFS;
+}
+
+static int imgfs_unlink(struct mount_point *mp, const char *pathname)
+{
+	return -L_EROFS;
+}
+
+static int imgfs_rename(struct mount_point *mp, struct file *f, const char *newpath)
+{
+	return -L_EROFS;
+}
+
+static int imgfs_mkdir(struct mount_point *mp, const char *pathname, int mode)
+{
+	return -L_EROFS;
+}
+
+static int imgfs_rmdir(struct mount_point *mp, const char *pathname)
+{
+	return -L_EROFS;
+}
+
+struct file_system *imgfs_alloc()
+{
+	imgfs = (struct imgfs *)kmalloc(sizeof(struct imgfs));
+	imgfs->base_fs.open = imgfs_open;
+	imgfs->base_fs.stat = imgfs_stat_path;
+	imgfs->base_fs.symlink = imgfs_symlink;
+	imgfs->base_fs.link = NULL;
+	imgfs->base_fs.unlink = imgfs_unlink;
+	imgfs->base_fs.rename = imgfs_rename;
+	imgfs->base_fs.mkdir = imgfs_mkdir;
+	imgfs->base_fs.rmdir = imgfs_rmdir;
+	InitializeSRWLock(&imgfs->rw_lock);
+	imgfs->image_count = 0;
+	return (struct file_system *)imgfs;
+}
+
+int imgfs_is_imgfile(struct file *f)
+{
+	return f->op_vtable == &imgfs_ops;
+}
+
+void imgfs_afterfork_child(struct file_system *fs)
+{
+	imgfs = (struct imgfs *)fs;
+	InitializeSRWLock(&imgfs->rw_lock);
+	/* Handles are inherited, views are not. Open files refer to the images, so map them now */
+	for (int i = 0; i < imgfs->image_count; i++)
+	{
+		imgfs->images[i].base = NULL;
+		if (imgfs->images[i].section)
+			imgfs_map(&imgfs->images[i]);
+	}
+}
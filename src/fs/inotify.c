@@ -17,29 +17,344 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_VFS
+
+#include <common/errno.h>
 #include <common/inotify.h>
+#include <common/poll.h>
 #include <fs/file.h>
+#include <fs/winfs.h>
 #include <syscall/mm.h>
+#include <syscall/sig.h>
 #include <syscall/syscall.h>
 #include <syscall/vfs.h>
 #include <heap.h>
 #include <log.h>
+#include <str.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+/* inotify
+ * Every watch owns an overlapped ReadDirectoryChangesW() on a handle to the watched directory,
+ * or to the parent directory for a watch on a non directory file. The handles of an inotify
+ * file are associated with one I/O completion port, the completion key is the watch descriptor.
+ * All requests also signal the same manual reset event, which is the poll handle.
+ *
+ * Completions are processed on read() and poll, translated into inotify_event records and
+ * appended to the event queue. The same records are fed to vfs_notify_change(), which drops the
+ * path component cache and the directory entry cache entries they affect.
+ *
+ * Windows does not report opens, closes or accesses, so IN_OPEN, IN_CLOSE_* and IN_ACCESS are
+ * never generated. A modification is reported as IN_MODIFY, or as IN_ATTRIB if only that is watched.
+ */
+
+#define INOTIFY_MAX_WATCHES		1024
+#define INOTIFY_NAME_MAX		255
+#define INOTIFY_NOTIFY_BUFFER	16384 /* Size of the ReadDirectoryChangesW() buffer of a watch */
+#define INOTIFY_QUEUE_SIZE		65536 /* Maximum bytes of queued events */
+
+struct inotify_watch
+{
+	int wd;
+	uint32_t mask;
+	HANDLE handle; /* INVALID_HANDLE_VALUE if the file is not on winfs, such watches never get events */
+	OVERLAPPED overlapped;
+	char path[PATH_MAX]; /* Path of the watched directory, or the parent directory of the watched file */
+	char name[INOTIFY_NAME_MAX + 1]; /* Name of the watched file in its parent, empty for directory watches */
+	DWORD buffer[INOTIFY_NOTIFY_BUFFER / sizeof(DWORD)]; /* FILE_NOTIFY_INFORMATION must be DWORD aligned */
+};
 
 struct inotify_file
 {
 	struct file base_file;
+	HANDLE port;
+	HANDLE event;
+	int next_wd;
+	uint32_t next_cookie, rename_cookie;
+	int watch_count;
+	struct inotify_watch *watches[INOTIFY_MAX_WATCHES];
+	int queue_size;
+	int last_event; /* Offset of the last queued event, for merging identical events */
+	char queue[INOTIFY_QUEUE_SIZE];
 };
 
+static struct inotify_watch *inotify_find_watch(struct inotify_file *inotify, int wd, int *index)
+{
+	for (int i = 0; i < inotify->watch_count; i++)
+		if (inotify->watches[i]->wd == wd)
+		{
+			if (index)
+				*index = i;
+			return inotify->watches[i];
+		}
+	return NULL;
+}
+
+static void inotify_queue_event(struct inotify_file *inotify, int wd, uint32_t mask, uint32_t cookie, const char *name)
+{
+	int name_len = name && name[0] ? (int)ALIGN_TO(strlen(name) + 1, sizeof(struct inotify_event)) : 0;
+	int size = sizeof(struct inotify_event) + name_len;
+	if (inotify->queue_size > 0)
+	{
+		/* Identical to the last event, merge them */
+		struct inotify_event *last = (struct inotify_event *)&inotify->queue[inotify->last_event];
+		if (last->wd == wd && last->mask == mask && last->cookie == cookie && (int)last->len == name_len
+			&& (name_len == 0 || !strcmp(last->name, name)))
+			return;
+		if (last->mask == IN_Q_OVERFLOW)
+			return;
+	}
+	/* Space for an overflow event is always reserved */
+	if (inotify->queue_size + size > INOTIFY_QUEUE_SIZE - (int)sizeof(struct inotify_event))
+	{
+		wd = -1;
+		mask = IN_Q_OVERFLOW;
+		cookie = 0;
+		name_len = 0;
+		size = sizeof(struct inotify_event);
+	}
+	struct inotify_event *e = (struct inotify_event *)&inotify->queue[inotify->queue_size];
+	e->wd = wd;
+	e->mask = mask;
+	e->cookie = cookie;
+	e->len = name_len;
+	if (name_len)
+	{
+		memset(e->name, 0, name_len);
+		strcpy(e->name, name);
+	}
+	inotify->last_event = inotify->queue_size;
+	inotify->queue_size += size;
+}
+
+static void inotify_remove_watch(struct inotify_file *inotify, int index)
+{
+	struct inotify_watch *watch = inotify->watches[index];
+	if (watch->handle != INVALID_HANDLE_VALUE)
+	{
+		/* The buffer must stay valid until the request is finished, its completion packet is
+		 * ignored later as the watch descriptor is not found */
+		CancelIoEx(watch->handle, &watch->overlapped);
+		while (!HasOverlappedIoCompleted(&watch->overlapped))
+			SwitchToThread();
+		CloseHandle(watch->handle);
+	}
+	kfree(watch, sizeof(struct inotify_watch));
+	inotify->watches[index] = inotify->watches[--inotify->watch_count];
+}
+
+static bool inotify_issue(struct inotify_file *inotify, struct inotify_watch *watch)
+{
+	DWORD filter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME;
+	if (watch->mask & IN_MODIFY)
+		filter |= FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+	if (watch->mask & IN_ATTRIB)
+		filter |= FILE_NOTIFY_CHANGE_ATTRIBUTES | FILE_NOTIFY_CHANGE_SECURITY | FILE_NOTIFY_CHANGE_CREATION;
+	memset(&watch->overlapped, 0, sizeof(OVERLAPPED));
+	watch->overlapped.hEvent = inotify->event;
+	if (!ReadDirectoryChangesW(watch->handle, watch->buffer, sizeof(watch->buffer), FALSE, filter, NULL, &watch->overlapped, NULL))
+	{
+		log_warning("ReadDirectoryChangesW() failed, error code: %d", GetLastError());
+		return false;
+	}
+	return true;
+}
+
+/* Translate one change record, returns whether an event is queued */
+static bool inotify_translate(struct inotify_file *inotify, struct inotify_watch *watch, const FILE_NOTIFY_INFORMATION *info)
+{
+	char name[INOTIFY_NAME_MAX + 1];
+	int name_len = utf16_to_utf8_filename((const uint16_t *)info->FileName, info->FileNameLength / sizeof(WCHAR), name, INOTIFY_NAME_MAX);
+	if (name_len < 0)
+		return false;
+	name[name_len] = 0;
+
+	char path[PATH_MAX + INOTIFY_NAME_MAX + 2];
+	ksprintf(path, "%s/%s", strcmp(watch->path, "/") ? watch->path : "", name);
+	uint32_t mask, cookie = 0;
+	switch (info->Action)
+	{
+	case FILE_ACTION_ADDED: mask = IN_CREATE; vfs_notify_change(path, VFS_CHANGE_CREATED); break;
+	case FILE_ACTION_REMOVED: mask = IN_DELETE; vfs_notify_change(path, VFS_CHANGE_REMOVED); break;
+	case FILE_ACTION_MODIFIED: mask = (watch->mask & IN_MODIFY) ? IN_MODIFY : IN_ATTRIB; vfs_notify_change(path, VFS_CHANGE_MODIFIED); break;
+	case FILE_ACTION_RENAMED_OLD_NAME:
+		mask = IN_MOVED_FROM;
+		cookie = inotify->rename_cookie = ++inotify->next_cookie;
+		vfs_notify_change(path, VFS_CHANGE_REMOVED);
+		break;
+	case FILE_ACTION_RENAMED_NEW_NAME:
+		mask = IN_MOVED_TO;
+		cookie = inotify->rename_cookie;
+		vfs_notify_change(path, VFS_CHANGE_CREATED);
+		break;
+	default: return false;
+	}
+
+	if (watch->name[0])
+	{
+		/* Watching a single file, only changes to itself are interesting */
+		if (strcmp(name, watch->name))
+			return false;
+		if (mask == IN_DELETE)
+			mask = IN_DELETE_SELF;
+		else if (mask == IN_MOVED_FROM)
+			mask = IN_MOVE_SELF;
+		else if (mask != IN_MODIFY && mask != IN_ATTRIB)
+			return false; /* A new file under the same name is not the watched one */
+		if (!(watch->mask & mask))
+			return false;
+		inotify_queue_event(inotify, watch->wd, mask, 0, NULL);
+		return true;
+	}
+	if (!(watch->mask & mask))
+		return false;
+	if (mask != IN_DELETE && mask != IN_MOVED_FROM && winfs_notify_isdir(watch->handle, info->FileName, info->FileNameLength / sizeof(WCHAR)))
+		mask |= IN_ISDIR;
+	inotify_queue_event(inotify, watch->wd, mask, cookie, name);
+	return true;
+}
+
+/* Move finished change notifications into the event queue, must be called with the file lock held */
+static void inotify_process(struct inotify_file *inotify)
+{
+	/* Reset before draining, completions arriving later signal the event again */
+	ResetEvent(inotify->event);
+	for (;;)
+	{
+		DWORD bytes;
+		ULONG_PTR key;
+		OVERLAPPED *overlapped;
+		BOOL ok = GetQueuedCompletionStatus(inotify->port, &bytes, &key, &overlapped, 0);
+		if (!ok && !overlapped)
+			break;
+		int index;
+		struct inotify_watch *watch = inotify_find_watch(inotify, (int)key, &index);
+		if (!watch)
+			continue; /* Removed watch */
+		bool delivered = false;
+		if (!ok && GetLastError() != ERROR_NOTIFY_ENUM_DIR)
+		{
+			/* The directory is gone */
+			if (!watch->name[0] && (watch->mask & IN_DELETE_SELF))
+				inotify_queue_event(inotify, watch->wd, IN_DELETE_SELF, 0, NULL);
+			vfs_notify_change(NULL, VFS_CHANGE_REMOVED);
+			inotify_queue_event(inotify, watch->wd, IN_IGNORED, 0, NULL);
+			inotify_remove_watch(inotify, index);
+			continue;
+		}
+		if (!ok || bytes == 0)
+		{
+			/* Too many changes for the buffer, we do not know what has changed */
+			vfs_notify_change(NULL, VFS_CHANGE_MODIFIED);
+			inotify_queue_event(inotify, -1, IN_Q_OVERFLOW, 0, NULL);
+		}
+		else
+		{
+			const char *buffer = (const char *)watch->buffer;
+			const FILE_NOTIFY_INFORMATION *info;
+			DWORD offset = 0;
+			do
+			{
+				info = (const FILE_NOTIFY_INFORMATION *)&buffer[offset];
+				offset += info->NextEntryOffset;
+				delivered |= inotify_translate(inotify, watch, info);
+			} while (info->NextEntryOffset);
+		}
+		if ((delivered && (watch->mask & IN_ONESHOT)) || !inotify_issue(inotify, watch))
+		{
+			inotify_queue_event(inotify, watch->wd, IN_IGNORED, 0, NULL);
+			inotify_remove_watch(inotify, index);
+		}
+	}
+}
+
 static int inotify_close(struct file *f)
 {
 	struct inotify_file *inotify = (struct inotify_file *)f;
+	while (inotify->watch_count > 0)
+		inotify_remove_watch(inotify, inotify->watch_count - 1);
+	CloseHandle(inotify->port);
+	CloseHandle(inotify->event);
 	kfree(inotify, sizeof(struct inotify_file));
 	return 0;
 }
 
+static void inotify_after_fork_child(struct file *f)
+{
+	/* The completion port and pending requests belong to the parent, the watches are dropped */
+	struct inotify_file *inotify = (struct inotify_file *)f;
+	if (inotify->watch_count > 0)
+		log_warning("inotify watches are not inherited by forked children.");
+	for (int i = 0; i < inotify->watch_count; i++)
+	{
+		inotify_queue_event(inotify, inotify->watches[i]->wd, IN_IGNORED, 0, NULL);
+		kfree(inotify->watches[i], sizeof(struct inotify_watch));
+	}
+	inotify->watch_count = 0;
+	inotify->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+	inotify->event = CreateEventW(NULL, TRUE, FALSE, NULL);
+}
+
 static int inotify_get_poll_status(struct file *f)
 {
-	return 0;
+	struct inotify_file *inotify = (struct inotify_file *)f;
+	AcquireSRWLockExclusive(&f->rw_lock);
+	inotify_process(inotify);
+	int r = inotify->queue_size > 0 ? LINUX_POLLIN : 0;
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return r;
+}
+
+static HANDLE inotify_get_poll_handle(struct file *f, int *poll_events)
+{
+	struct inotify_file *inotify = (struct inotify_file *)f;
+	*poll_events = LINUX_POLLIN;
+	return inotify->event;
+}
+
+static size_t inotify_read(struct file *f, void *buf, size_t count)
+{
+	struct inotify_file *inotify = (struct inotify_file *)f;
+	AcquireSRWLockExclusive(&f->rw_lock);
+	for (;;)
+	{
+		inotify_process(inotify);
+		if (inotify->queue_size > 0)
+			break;
+		if (f->flags & O_NONBLOCK)
+		{
+			ReleaseSRWLockExclusive(&f->rw_lock);
+			return -L_EAGAIN;
+		}
+		ReleaseSRWLockExclusive(&f->rw_lock);
+		if (signal_wait(1, &inotify->event, INFINITE) == WAIT_INTERRUPTED)
+			return -L_EINTR;
+		AcquireSRWLockExclusive(&f->rw_lock);
+	}
+	/* Only whole events are returned */
+	size_t size = 0;
+	while (size < (size_t)inotify->queue_size)
+	{
+		struct inotify_event *e = (struct inotify_event *)&inotify->queue[size];
+		size_t len = sizeof(struct inotify_event) + e->len;
+		if (size + len > count)
+			break;
+		size += len;
+	}
+	size_t r;
+	if (size == 0)
+		r = -L_EINVAL;
+	else
+	{
+		memcpy(buf, inotify->queue, size);
+		memmove(inotify->queue, inotify->queue + size, inotify->queue_size - size);
+		inotify->queue_size -= (int)size;
+		inotify->last_event -= (int)size;
+		r = size;
+	}
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return r;
 }
 
 static int inotify_stat(struct file *f, struct newstat *buf)
@@ -68,23 +383,89 @@ static int inotify_stat(struct file *f, struct newstat *buf)
 static struct file_ops inotify_ops =
 {
 	.get_poll_status = inotify_get_poll_status,
+	.get_poll_handle = inotify_get_poll_handle,
+	.after_fork_child = inotify_after_fork_child,
 	.close = inotify_close,
+	.read = inotify_read,
 	.stat = inotify_stat,
 };
 
 static int inotify_init1(int flags)
 {
+	if (flags & ~(IN_CLOEXEC | IN_NONBLOCK))
+		return -L_EINVAL;
 	struct inotify_file *inotify = (struct inotify_file *)kmalloc(sizeof(struct inotify_file));
 	int fl = 0;
 	if (flags & IN_NONBLOCK)
 		fl |= O_NONBLOCK;
 	file_init(&inotify->base_file, &inotify_ops, fl);
+	inotify->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+	inotify->event = CreateEventW(NULL, TRUE, FALSE, NULL);
+	inotify->next_wd = 1;
+	inotify->next_cookie = 0;
+	inotify->rename_cookie = 0;
+	inotify->watch_count = 0;
+	inotify->queue_size = 0;
+	inotify->last_event = 0;
 	int fd = vfs_store_file((struct file *)inotify, flags & IN_CLOEXEC);
 	if (fd < 0)
 		vfs_release((struct file *)inotify);
 	return fd;
 }
 
+static int inotify_get(int fd, struct inotify_file **inotify)
+{
+	struct file *f = vfs_get(fd);
+	if (!f)
+		return -L_EBADF;
+	if (f->op_vtable != &inotify_ops)
+	{
+		vfs_release(f);
+		return -L_EINVAL;
+	}
+	*inotify = (struct inotify_file *)f;
+	return 0;
+}
+
+/* Set up the directory handle of a new watch, the watched file is closed afterwards */
+static int inotify_open_watch(struct inotify_watch *watch, struct file *f)
+{
+	if (!f->op_vtable->stat || !f->op_vtable->getpath)
+		return -L_EINVAL;
+	struct newstat stat;
+	int r = f->op_vtable->stat(f, &stat);
+	if (r < 0)
+		return r;
+	f->op_vtable->getpath(f, watch->path);
+	struct file *dir = f;
+	watch->name[0] = 0;
+	if (!S_ISDIR(stat.st_mode))
+	{
+		/* Watch the parent directory for changes to this file */
+		char *slash = strrchr(watch->path, '/');
+		if (strlen(slash + 1) > INOTIFY_NAME_MAX)
+			return -L_ENAMETOOLONG;
+		strcpy(watch->name, slash + 1);
+		if (slash == watch->path)
+			slash[1] = 0;
+		else
+			slash[0] = 0;
+		r = vfs_openat(AT_FDCWD, watch->path, O_PATH | O_DIRECTORY, 0, 0, &dir);
+		if (r < 0)
+			return r;
+	}
+	if (winfs_is_winfile(dir))
+		watch->handle = winfs_open_notify(dir);
+	else
+	{
+		log_warning("inotify: %s is not on a Windows file system, no events will be reported.", watch->path);
+		watch->handle = INVALID_HANDLE_VALUE;
+	}
+	if (dir != f)
+		vfs_release(dir);
+	return 0;
+}
+
 DEFINE_SYSCALL(inotify_init)
 {
 	log_info("inotify_init()");
@@ -100,11 +481,96 @@ DEFINE_SYSCALL(inotify_init1, int, flags)
 DEFINE_SYSCALL(inotify_add_watch, int, fd, const char *, pathname, uint32_t, mask)
 {
 	log_info("inotify_add_watch(%d, \"%s\", %x)", fd, pathname, mask);
-	return 0;
+	if (!mm_check_read_string(pathname))
+		return -L_EFAULT;
+	if (!(mask & IN_ALL_EVENTS))
+		return -L_EINVAL;
+	struct inotify_file *inotify;
+	int r = inotify_get(fd, &inotify);
+	if (r < 0)
+		return r;
+	struct file *f;
+	int flags = O_PATH;
+	if (mask & IN_DONT_FOLLOW)
+		flags |= O_NOFOLLOW;
+	if (mask & IN_ONLYDIR)
+		flags |= O_DIRECTORY;
+	r = vfs_openat(AT_FDCWD, pathname, flags, 0, 0, &f);
+	if (r < 0)
+		goto out;
+	struct inotify_watch *watch = (struct inotify_watch *)kmalloc(sizeof(struct inotify_watch));
+	r = inotify_open_watch(watch, f);
+	vfs_release(f);
+	if (r < 0)
+	{
+		kfree(watch, sizeof(struct inotify_watch));
+		goto out;
+	}
+	AcquireSRWLockExclusive(&inotify->base_file.rw_lock);
+	/* Watching the same file again updates the existing watch */
+	for (int i = 0; i < inotify->watch_count; i++)
+	{
+		struct inotify_watch *existing = inotify->watches[i];
+		if (!strcmp(existing->path, watch->path) && !strcmp(existing->name, watch->name))
+		{
+			if (mask & IN_MASK_ADD)
+				existing->mask |= mask;
+			else
+				existing->mask = mask;
+			r = existing->wd;
+			if (watch->handle != INVALID_HANDLE_VALUE)
+				CloseHandle(watch->handle);
+			kfree(watch, sizeof(struct inotify_watch));
+			goto out_unlock;
+		}
+	}
+	if (inotify->watch_count == INOTIFY_MAX_WATCHES)
+	{
+		r = -L_ENOSPC;
+		if (watch->handle != INVALID_HANDLE_VALUE)
+			CloseHandle(watch->handle);
+		kfree(watch, sizeof(struct inotify_watch));
+		goto out_unlock;
+	}
+	watch->wd = inotify->next_wd++;
+	watch->mask = mask;
+	if (watch->handle != INVALID_HANDLE_VALUE)
+	{
+		if (!CreateIoCompletionPort(watch->handle, inotify->port, (ULONG_PTR)watch->wd, 0) || !inotify_issue(inotify, watch))
+		{
+			log_warning("Setting up change notification for %s failed.", watch->path);
+			CloseHandle(watch->handle);
+			watch->handle = INVALID_HANDLE_VALUE;
+		}
+	}
+	inotify->watches[inotify->watch_count++] = watch;
+	r = watch->wd;
+out_unlock:
+	ReleaseSRWLockExclusive(&inotify->base_file.rw_lock);
+out:
+	vfs_release((struct file *)inotify);
+	return r;
 }
 
 DEFINE_SYSCALL(inotify_rm_watch, int, fd, int, wd)
 {
 	log_info("inotify_rm_watch(%d, %d)", fd, wd);
-	return 0;
+	struct inotify_file *inotify;
+	int r = inotify_get(fd, &inotify);
+	if (r < 0)
+		return r;
+	AcquireSRWLockExclusive(&inotify->base_file.rw_lock);
+	int index;
+	if (inotify_find_watch(inotify, wd, &index))
+	{
+		inotify_queue_event(inotify, wd, IN_IGNORED, 0, NULL);
+		inotify_remove_watch(inotify, index);
+		SetEvent(inotify->event);
+		r = 0;
+	}
+	else
+		r = -L_EINVAL;
+	ReleaseSRWLockExclusive(&inotify->base_file.rw_lock);
+	vfs_release((struct file *)inotify);
+	return r;
 }
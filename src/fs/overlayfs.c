@@ -0,0 +1,905 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define LOG_CATEGORY LOG_CAT_VFS
+
+#include <common/errno.h>
+#include <common/fcntl.h>
+#include <common/fs.h>
+#include <fs/overlayfs.h>
+#include <syscall/mm.h>
+#include <syscall/vfs.h>
+#include <heap.h>
+#include <log.h>
+#include <str.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <stdlib.h>
+
+/* Overlay file system
+ *
+ * A writable winfs directory (the upper layer) over a read-only imgfs image (the lower layer). The
+ * mount point's Windows path names the upper directory, the image is the file next to it with ".img"
+ * appended. A packed image can then be used as an ordinary tree, while the changes land in a small
+ * directory of their own.
+ *
+ * Names are looked up in the upper layer first. An image entry is hidden by an upper layer entry of
+ * the same name, or by a whiteout: a winfs symlink with the reserved target OVERLAYFS_WHITEOUT_TARGET,
+ * left behind when an image entry is removed. An upper layer directory on the way does not hide the
+ * image, so upper layer paths mirror the image and a fresh upper layer costs one query per lookup.
+ *
+ * Files are handed out by the layer which holds them, reads and mmap() of image files go to imgfs
+ * directly. Opening an image file for writing copies it up first: the directories leading to it are
+ * created in the upper layer and the data is copied. Only directories present in both layers are
+ * wrapped, getdents() lists the upper layer entries and then the image entries not shadowed by them.
+ *
+ * A directory created over a whiteout gets whiteouts for all entries of the image directory it
+ * replaces, so it starts out empty. Image directories cannot be renamed, rename() returns EXDEV and
+ * callers fall back to copying, like they do across file systems.
+ */
+
+#define OVERLAYFS_WHITEOUT_TARGET	"(overlay whiteout)"
+
+/* Types of a path in a layer */
+#define OVERLAYFS_MISSING	0
+#define OVERLAYFS_DIR		1
+#define OVERLAYFS_FILE		2
+#define OVERLAYFS_SYMLINK	3
+#define OVERLAYFS_WHITEOUT	4 /* Upper layer only */
+
+struct overlayfs
+{
+	struct file_system base_fs;
+	struct file_system *upper;
+	struct file_system *lower;
+};
+
+/* A list of NUL terminated names */
+struct overlayfs_names
+{
+	char *buf;
+	size_t size;
+	size_t capacity;
+};
+
+/* A directory present in both layers */
+struct overlayfs_dir
+{
+	struct file base_file;
+	struct file *upper;
+	struct file *lower;
+	int mp_key;
+	bool reading_lower; /* All upper layer entries have been returned by getdents() */
+	struct overlayfs_names shadowed; /* Upper layer entries which also exist in the image */
+	char **sorted; /* shadowed in sorted order, for walking along the sorted image entries */
+	int sorted_count;
+	int cursor; /* Index into sorted of the next image entry */
+	int pathlen;
+	char path[]; /* Path relative to mount point */
+};
+
+/* getdents() callbacks only receive the output buffer, the rest of their state is passed through here */
+struct overlayfs_getdents_context
+{
+	struct overlayfs_dir *dir;
+	getdents_callback *fill_callback;
+	struct mount_point *mp;
+	struct mount_point lower_mp;
+	struct overlayfs_names *names; /* For overlayfs_list() */
+};
+static __declspec(thread) struct overlayfs_getdents_context *overlayfs_getdents_current;
+
+static void overlayfs_names_add(struct overlayfs_names *names, const char *name, int namelen)
+{
+	if (names->size + namelen + 1 > names->capacity)
+	{
+		size_t capacity = max(max(names->capacity * 2, names->size + namelen + 1), 256);
+		char *buf = (char *)kmalloc(capacity);
+		if (names->buf)
+		{
+			memcpy(buf, names->buf, names->size);
+			kfree(names->buf, names->capacity);
+		}
+		names->buf = buf;
+		names->capacity = capacity;
+	}
+	memcpy(names->buf + names->size, name, namelen);
+	names->buf[names->size + namelen] = 0;
+	names->size += namelen + 1;
+}
+
+static void overlayfs_names_free(struct overlayfs_names *names)
+{
+	if (names->buf)
+		kfree(names->buf, names->capacity);
+	names->buf = NULL;
+	names->size = 0;
+	names->capacity = 0;
+}
+
+#define overlayfs_names_iterate(names, name) \
+	for (const char *name = (names)->buf; name < (names)->buf + (names)->size; name += strlen(name) + 1)
+
+static bool overlayfs_names_contain(const struct overlayfs_names *names, const char *target)
+{
+	overlayfs_names_iterate(names, name)
+		if (!strcmp(name, target))
+			return true;
+	return false;
+}
+
+/* Join a directory path relative to the mount point and a name */
+static int overlayfs_join(const char *dir, const char *name, char *buf)
+{
+	int dirlen = strlen(dir), namelen = strlen(name);
+	if (dirlen + namelen + 2 > PATH_MAX)
+		return -L_ENAMETOOLONG;
+	if (dirlen)
+	{
+		memcpy(buf, dir, dirlen);
+		buf[dirlen++] = '/';
+	}
+	memcpy(buf + dirlen, name, namelen + 1);
+	return 0;
+}
+
+/* Convert a name passed to a getdents() callback to UTF-8, returns its length or 0 for "." and ".." */
+static int overlayfs_get_name(const void *name, int namelen, int flags, char *buf, int buflen)
+{
+	if (flags & GETDENTS_UTF16)
+		namelen = utf16_to_utf8_filename((const uint16_t *)name, namelen, buf, buflen - 1);
+	else if (namelen < buflen)
+		memcpy(buf, name, namelen);
+	else
+		namelen = -1;
+	if (namelen <= 0)
+		return 0;
+	buf[namelen] = 0;
+	if (!strcmp(buf, ".") || !strcmp(buf, ".."))
+		return 0;
+	return namelen;
+}
+
+static void overlayfs_get_lower_mountpoint(const struct mount_point *mp, struct mount_point *lower_mp)
+{
+	lower_mp->fs = ((struct overlayfs *)mp->fs)->lower;
+	lower_mp->key = mp->key;
+	lower_mp->is_system = mp->is_system;
+	lower_mp->win_path_len = mp->win_path_len + 4;
+	memcpy(lower_mp->win_path, mp->win_path, mp->win_path_len * sizeof(WCHAR));
+	wcscpy(lower_mp->win_path + mp->win_path_len, L".img");
+	lower_mp->mountpoint_len = mp->mountpoint_len;
+	strcpy(lower_mp->mountpoint, mp->mountpoint);
+}
+
+/* Get the type of a path in the upper layer, buf receives its stat for OVERLAYFS_DIR and OVERLAYFS_FILE */
+static int overlayfs_upper_type(struct overlayfs *fs, struct mount_point *mp, const char *path, struct newstat *buf)
+{
+	int r = fs->upper->stat(mp, path, buf);
+	if (r == 0)
+		return S_ISDIR(buf->st_mode)? OVERLAYFS_DIR: OVERLAYFS_FILE;
+	if (r == -L_ENOENT || r == -L_ENOTDIR)
+		return OVERLAYFS_MISSING;
+	if (r != -L_ENOSYS)
+		return r;
+	/* A symlink, a special file, or stat by name is not supported */
+	char target[PATH_MAX];
+	struct file *f;
+	r = fs->upper->open(mp, path, O_PATH, INTERNAL_O_NOINHERIT, 0, &f, target, PATH_MAX);
+	if (r == 1)
+		return strcmp(target, OVERLAYFS_WHITEOUT_TARGET)? OVERLAYFS_SYMLINK: OVERLAYFS_WHITEOUT;
+	if (r == -L_ENOENT)
+		return OVERLAYFS_MISSING;
+	if (r < 0)
+		return r;
+	r = f->op_vtable->stat(f, buf);
+	vfs_release(f);
+	if (r < 0)
+		return r;
+	return S_ISDIR(buf->st_mode)? OVERLAYFS_DIR: OVERLAYFS_FILE;
+}
+
+static int overlayfs_lower_type(struct overlayfs *fs, struct mount_point *lower_mp, const char *path)
+{
+	struct newstat buf;
+	int r = fs->lower->stat(lower_mp, path, &buf);
+	if (r == 0)
+		return S_ISDIR(buf.st_mode)? OVERLAYFS_DIR: OVERLAYFS_FILE;
+	if (r == -L_ENOSYS)
+		return OVERLAYFS_SYMLINK;
+	if (r == -L_ENOENT || r == -L_ENOTDIR)
+		return OVERLAYFS_MISSING;
+	return r;
+}
+
+/* Find out what the layers hold at path
+ * *lower receives the type in the image even if it is hidden by a whiteout at path. buf receives the stat of
+ * the upper layer entry if it is a directory or a file.
+ */
+static int overlayfs_lookup(struct overlayfs *fs, struct mount_point *mp, struct mount_point *lower_mp, const char *path,
+	int *upper, int *lower, struct newstat *buf)
+{
+	char prefix[PATH_MAX];
+	int len = strlen(path);
+	if (len >= PATH_MAX)
+		return -L_ENAMETOOLONG;
+	memcpy(prefix, path, len + 1);
+	/* Walk down the upper layer, nothing below the first missing component can be in it */
+	int type;
+	char *p = prefix;
+	for (;;)
+	{
+		char *end = strchr(p, '/');
+		if (end)
+			*end = 0;
+		type = overlayfs_upper_type(fs, mp, prefix, buf);
+		if (type < 0)
+			return type;
+		if (!end || type == OVERLAYFS_MISSING)
+			break;
+		if (type == OVERLAYFS_WHITEOUT)
+			return -L_ENOENT;
+		if (type != OVERLAYFS_DIR)
+			return -L_ENOTDIR;
+		*end = '/';
+		p = end + 1;
+	}
+	*upper = type;
+	int r = overlayfs_lower_type(fs, lower_mp, path);
+	if (r < 0)
+		return r;
+	*lower = r;
+	return 0;
+}
+
+/* Get the type of a path as seen through the overlay */
+static int overlayfs_visible_type(int upper, int lower)
+{
+	if (upper == OVERLAYFS_WHITEOUT)
+		return OVERLAYFS_MISSING;
+	return upper != OVERLAYFS_MISSING? upper: lower;
+}
+
+/* Create the directories leading to path in the upper layer */
+static int overlayfs_copy_up_parents(struct overlayfs *fs, struct mount_point *mp, const char *path)
+{
+	char prefix[PATH_MAX];
+	strcpy(prefix, path);
+	bool missing = false;
+	for (char *p = strchr(prefix, '/'); p; p = strchr(p + 1, '/'))
+	{
+		*p = 0;
+		if (!missing)
+		{
+			struct newstat buf;
+			int type = overlayfs_upper_type(fs, mp, prefix, &buf);
+			if (type < 0)
+				return type;
+			if (type == OVERLAYFS_MISSING)
+				missing = true;
+			else if (type != OVERLAYFS_DIR)
+				return -L_ENOTDIR;
+		}
+		if (missing)
+		{
+			int r = fs->upper->mkdir(mp, prefix, 0755);
+			if (r < 0 && r != -L_EEXIST)
+				return r;
+		}
+		*p = '/';
+	}
+	return 0;
+}
+
+/* Copy a file or symlink of the image to the upper layer, the data is not copied if with_data is false */
+static int overlayfs_copy_up(struct overlayfs *fs, struct mount_point *mp, struct mount_point *lower_mp, const char *path, int type, bool with_data)
+{
+	log_info("overlayfs: Copying up \"%s\".", path);
+	int r = overlayfs_copy_up_parents(fs, mp, path);
+	if (r < 0)
+		return r;
+	char target[PATH_MAX];
+	struct file *src;
+	if (type == OVERLAYFS_SYMLINK)
+	{
+		r = fs->lower->open(lower_mp, path, O_PATH | O_NOFOLLOW, INTERNAL_O_NOINHERIT, 0, &src, target, PATH_MAX);
+		if (r < 0)
+			return r;
+		r = (int)src->op_vtable->readlink(src, target, PATH_MAX - 1);
+		vfs_release(src);
+		if (r < 0)
+			return r;
+		target[r] = 0;
+		r = fs->upper->symlink(mp, target, path);
+		return r == -L_EEXIST? 0: r;
+	}
+	r = fs->lower->open(lower_mp, path, O_RDONLY, INTERNAL_O_NOINHERIT, 0, &src, target, PATH_MAX);
+	if (r < 0)
+		return r;
+	/* If another process is copying up the same file we fail with EEXIST, and its copy is used */
+	struct file *dst;
+	r = fs->upper->open(mp, path, O_WRONLY | O_CREAT | O_EXCL, INTERNAL_O_NOINHERIT, 0, &dst, target, PATH_MAX);
+	if (r < 0)
+	{
+		vfs_release(src);
+		return r == -L_EEXIST? 0: r;
+	}
+	if (with_data)
+	{
+		char *buf = (char *)kmalloc(BLOCK_SIZE);
+		loff_t offset = 0;
+		for (;;)
+		{
+			size_t num_read = src->op_vtable->pread(src, buf, BLOCK_SIZE, offset);
+			if ((intptr_t)num_read <= 0)
+			{
+				r = (int)num_read;
+				break;
+			}
+			size_t num_written = dst->op_vtable->pwrite(dst, buf, num_read, offset);
+			if (num_written != num_read)
+			{
+				r = (intptr_t)num_written < 0? (int)num_written: -L_EIO;
+				break;
+			}
+			offset += num_read;
+		}
+		kfree(buf, BLOCK_SIZE);
+	}
+	if (r == 0)
+	{
+		/* Keep the timestamps of the image, build tools compare them */
+		struct newstat stat;
+		if (src->op_vtable->stat(src, &stat) == 0)
+		{
+			struct timespec times[2];
+			times[0].tv_sec = stat.st_atime;
+			times[0].tv_nsec = stat.st_atime_nsec;
+			times[1].tv_sec = stat.st_mtime;
+			times[1].tv_nsec = stat.st_mtime_nsec;
+			dst->op_vtable->utimens(dst, times);
+		}
+	}
+	vfs_release(dst);
+	vfs_release(src);
+	if (r < 0)
+	{
+		log_warning("overlayfs: Copying up \"%s\" failed, error: %d", path, r);
+		fs->upper->unlink(mp, path);
+	}
+	return r;
+}
+
+static int overlayfs_whiteout(struct overlayfs *fs, struct mount_point *mp, const char *path)
+{
+	return fs->upper->symlink(mp, OVERLAYFS_WHITEOUT_TARGET, path);
+}
+
+/* Make way for a new upper layer entry at a path not visible through the overlay */
+static int overlayfs_prepare_create(struct overlayfs *fs, struct mount_point *mp, const char *path, int upper)
+{
+	int r = overlayfs_copy_up_parents(fs, mp, path);
+	if (r == 0 && upper == OVERLAYFS_WHITEOUT)
+		r = fs->upper->unlink(mp, path);
+	return r;
+}
+
+static intptr_t overlayfs_list_callback(void *buffer, uint64_t inode, const void *name, int namelen, char type, size_t size, int flags)
+{
+	char buf[PATH_MAX];
+	namelen = overlayfs_get_name(name, namelen, flags, buf, PATH_MAX);
+	if (namelen > 0)
+		overlayfs_names_add(overlayfs_getdents_current->names, buf, namelen);
+	/* Nothing is written to the buffer, so the file system goes on until the end of the directory */
+	return 0;
+}
+
+/* Collect the names of all entries of a directory in a layer except "." and ".." */
+static int overlayfs_list(struct file_system *layer, struct mount_point *mp, const char *path, struct overlayfs_names *names)
+{
+	char target[PATH_MAX];
+	struct file *dir;
+	int r = layer->open(mp, path, O_RDONLY | O_DIRECTORY, INTERNAL_O_NOINHERIT, 0, &dir, target, PATH_MAX);
+	if (r != 0)
+		return r < 0? r: -L_ENOTDIR;
+	struct overlayfs_getdents_context context;
+	context.names = names;
+	overlayfs_getdents_current = &context;
+	r = dir->op_vtable->getdents(dir, &context, 2 * 65536, overlayfs_list_callback);
+	overlayfs_getdents_current = NULL;
+	vfs_release(dir);
+	return r < 0? r: 0;
+}
+
+static int overlayfs_dir_close(struct file *f)
+{
+	struct overlayfs_dir *dir = (struct overlayfs_dir *)f;
+	vfs_release(dir->upper);
+	vfs_release(dir->lower);
+	overlayfs_names_free(&dir->shadowed);
+	if (dir->sorted)
+		kfree(dir->sorted, dir->sorted_count * sizeof(char *));
+	kfree(dir, sizeof(struct overlayfs_dir) + dir->pathlen + 1);
+	return 0;
+}
+
+static int overlayfs_dir_getpath(struct file *f, char *buf)
+{
+	struct overlayfs_dir *dir = (struct overlayfs_dir *)f;
+	const struct mount_point *mp = vfs_get_mountpoint(dir->mp_key);
+	int len = mp->mountpoint_len;
+	memcpy(buf, mp->mountpoint, len);
+	if (dir->pathlen)
+	{
+		buf[len++] = '/';
+		memcpy(buf + len, dir->path, dir->pathlen);
+		len += dir->pathlen;
+	}
+	buf[len] = 0;
+	return len;
+}
+
+static int overlayfs_dir_fsync(struct file *f)
+{
+	return 0;
+}
+
+static int overlayfs_dir_llseek(struct file *f, loff_t offset, loff_t *newoffset, int whence)
+{
+	/* The entries of the two layers have no common offsets, only rewinding is supported */
+	if (whence != SEEK_SET || offset != 0)
+		return -L_EINVAL;
+	struct overlayfs_dir *dir = (struct overlayfs_dir *)f;
+	AcquireSRWLockExclusive(&f->rw_lock);
+	loff_t n;
+	dir->upper->op_vtable->llseek(dir->upper, 0, &n, SEEK_SET);
+	dir->lower->op_vtable->llseek(dir->lower, 0, &n, SEEK_SET);
+	dir->reading_lower = false;
+	overlayfs_names_free(&dir->shadowed);
+	if (dir->sorted)
+		kfree(dir->sorted, dir->sorted_count * sizeof(char *));
+	dir->sorted = NULL;
+	dir->sorted_count = 0;
+	dir->cursor = 0;
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	*newoffset = 0;
+	return 0;
+}
+
+static int overlayfs_dir_stat(struct file *f, struct newstat *buf)
+{
+	struct overlayfs_dir *dir = (struct overlayfs_dir *)f;
+	return dir->upper->op_vtable->stat(dir->upper, buf);
+}
+
+static int overlayfs_dir_utimens(struct file *f, const struct timespec *times)
+{
+	struct overlayfs_dir *dir = (struct overlayfs_dir *)f;
+	return dir->upper->op_vtable->utimens(dir->upper, times);
+}
+
+static intptr_t overlayfs_upper_callback(void *buffer, uint64_t inode, const void *name, int namelen, char type, size_t size, int flags)
+{
+	struct overlayfs_getdents_context *context = overlayfs_getdents_current;
+	struct overlayfs_dir *dir = context->dir;
+	struct overlayfs *fs = (struct overlayfs *)context->mp->fs;
+	char buf[PATH_MAX], path[PATH_MAX];
+	int len = overlayfs_get_name(name, namelen, flags, buf, PATH_MAX);
+	if (len > 0 && overlayfs_join(dir->path, buf, path) == 0 && overlayfs_lower_type(fs, &context->lower_mp, path) > 0)
+	{
+		overlayfs_names_add(&dir->shadowed, buf, len);
+		struct newstat stat;
+		if (type != DT_DIR && overlayfs_upper_type(fs, context->mp, path, &stat) == OVERLAYFS_WHITEOUT)
+			return 0;
+	}
+	return context->fill_callback(buffer, inode, name, namelen, type, size, flags);
+}
+
+static intptr_t overlayfs_lower_callback(void *buffer, uint64_t inode, const void *name, int namelen, char type, size_t size, int flags)
+{
+	struct overlayfs_dir *dir = overlayfs_getdents_current->dir;
+	/* Image names are NUL terminated UTF-8, "." and ".." come from the upper layer */
+	if (!strcmp((const char *)name, ".") || !strcmp((const char *)name, ".."))
+		return 0;
+	/* Both lists are sorted, walk along the shadowed names */
+	while (dir->cursor < dir->sorted_count && strcmp(dir->sorted[dir->cursor], (const char *)name) < 0)
+		dir->cursor++;
+	if (dir->cursor < dir->sorted_count && !strcmp(dir->sorted[dir->cursor], (const char *)name))
+		return 0;
+	return overlayfs_getdents_current->fill_callback(buffer, inode, name, namelen, type, size, flags);
+}
+
+static int overlayfs_cmpname(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+static int overlayfs_dir_getdents(struct file *f, void *dirent, size_t count, getdents_callback *fill_callback)
+{
+	struct overlayfs_dir *dir = (struct overlayfs_dir *)f;
+	AcquireSRWLockExclusive(&f->rw_lock);
+	struct overlayfs_getdents_context context;
+	context.dir = dir;
+	context.fill_callback = fill_callback;
+	context.mp = vfs_get_mountpoint(dir->mp_key);
+	overlayfs_get_lower_mountpoint(context.mp, &context.lower_mp);
+	overlayfs_getdents_current = &context;
+	int r = 0;
+	if (!dir->reading_lower)
+	{
+		r = dir->upper->op_vtable->getdents(dir->upper, dirent, count, overlayfs_upper_callback);
+		if (r == 0)
+		{
+			dir->reading_lower = true;
+			int n = 0;
+			overlayfs_names_iterate(&dir->shadowed, name)
+				n++;
+			if (n)
+			{
+				dir->sorted = (char **)kmalloc(n * sizeof(char *));
+				dir->sorted_count = 0;
+				overlayfs_names_iterate(&dir->shadowed, name)
+					dir->sorted[dir->sorted_count++] = (char *)name;
+				qsort(dir->sorted, n, sizeof(char *), overlayfs_cmpname);
+			}
+		}
+	}
+	if (dir->reading_lower)
+		r = dir->lower->op_vtable->getdents(dir->lower, dirent, count, overlayfs_lower_callback);
+	overlayfs_getdents_current = NULL;
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return r;
+}
+
+static int overlayfs_dir_statfs(struct file *f, struct statfs64 *buf)
+{
+	struct overlayfs_dir *dir = (struct overlayfs_dir *)f;
+	return dir->upper->op_vtable->statfs(dir->upper, buf);
+}
+
+static const struct file_ops overlayfs_dir_ops =
+{
+	.close = overlayfs_dir_close,
+	.getpath = overlayfs_dir_getpath,
+	.fsync = overlayfs_dir_fsync,
+	.llseek = overlayfs_dir_llseek,
+	.stat = overlayfs_dir_stat,
+	.utimens = overlayfs_dir_utimens,
+	.getdents = overlayfs_dir_getdents,
+	.statfs = overlayfs_dir_statfs,
+};
+
+static int overlayfs_open_dir(struct overlayfs *fs, struct mount_point *mp, struct mount_point *lower_mp, const char *path,
+	int flags, int internal_flags, int mode, struct file **fp, char *target, int buflen)
+{
+	struct file *upper, *lower;
+	int r = fs->upper->open(mp, path, flags, internal_flags, mode, &upper, target, buflen);
+	if (r != 0)
+		return r;
+	r = fs->lower->open(lower_mp, path, O_RDONLY | O_DIRECTORY, INTERNAL_O_NOINHERIT, 0, &lower, target, buflen);
+	if (r != 0)
+	{
+		vfs_release(upper);
+		return r < 0? r: -L_EIO;
+	}
+	int pathlen = strlen(path);
+	struct overlayfs_dir *dir = (struct overlayfs_dir *)kmalloc(sizeof(struct overlayfs_dir) + pathlen + 1);
+	file_init(&dir->base_file, &overlayfs_dir_ops, flags);
+	dir->upper = upper;
+	dir->lower = lower;
+	dir->mp_key = mp->key;
+	dir->reading_lower = false;
+	dir->shadowed.buf = NULL;
+	dir->shadowed.size = 0;
+	dir->shadowed.capacity = 0;
+	dir->sorted = NULL;
+	dir->sorted_count = 0;
+	dir->cursor = 0;
+	dir->pathlen = pathlen;
+	memcpy(dir->path, path, pathlen + 1);
+	*fp = (struct file *)dir;
+	return 0;
+}
+
+static int overlayfs_open(struct mount_point *mp, const char *path, int flags, int internal_flags, int mode, struct file **fp, char *target, int buflen)
+{
+	struct overlayfs *fs = (struct overlayfs *)mp->fs;
+	struct mount_point lower_mp;
+	overlayfs_get_lower_mountpoint(mp, &lower_mp);
+	int upper, lower;
+	struct newstat buf;
+	int r = overlayfs_lookup(fs, mp, &lower_mp, path, &upper, &lower, &buf);
+	if (r < 0)
+		return r;
+	if (overlayfs_visible_type(upper, lower) == OVERLAYFS_MISSING)
+	{
+		if (!(flags & O_CREAT))
+			return -L_ENOENT;
+		r = overlayfs_prepare_create(fs, mp, path, upper);
+		if (r < 0)
+			return r;
+		return fs->upper->open(mp, path, flags, internal_flags, mode, fp, target, buflen);
+	}
+	if ((flags & O_CREAT) && (flags & O_EXCL))
+		return -L_EEXIST;
+	if (upper != OVERLAYFS_MISSING)
+	{
+		if (upper == OVERLAYFS_DIR && lower == OVERLAYFS_DIR)
+		{
+			if (internal_flags & INTERNAL_O_DELETE)
+				return -L_EXDEV;
+			/* A path only file is not listed, the upper directory does */
+			if (fp && !(flags & O_PATH))
+				return overlayfs_open_dir(fs, mp, &lower_mp, path, flags, internal_flags, mode, fp, target, buflen);
+		}
+		return fs->upper->open(mp, path, flags, internal_flags, mode, fp, target, buflen);
+	}
+	/* Only in the image */
+	bool copy_up;
+	if (lower == OVERLAYFS_FILE)
+		copy_up = (internal_flags & INTERNAL_O_DELETE)
+			|| (!(flags & O_PATH) && ((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC)));
+	else if (lower == OVERLAYFS_SYMLINK)
+		copy_up = (internal_flags & INTERNAL_O_DELETE) && (flags & O_NOFOLLOW);
+	else
+	{
+		if (internal_flags & INTERNAL_O_DELETE)
+			return -L_EXDEV;
+		copy_up = false;
+	}
+	if (copy_up)
+	{
+		r = overlayfs_copy_up(fs, mp, &lower_mp, path, lower, !(flags & O_TRUNC));
+		if (r < 0)
+			return r;
+		return fs->upper->open(mp, path, flags, internal_flags, mode, fp, target, buflen);
+	}
+	return fs->lower->open(&lower_mp, path, flags, internal_flags, mode, fp, target, buflen);
+}
+
+static int overlayfs_stat(struct mount_point *mp, const char *pathname, struct newstat *buf)
+{
+	struct overlayfs *fs = (struct overlayfs *)mp->fs;
+	struct mount_point lower_mp;
+	overlayfs_get_lower_mountpoint(mp, &lower_mp);
+	int upper, lower;
+	int r = overlayfs_lookup(fs, mp, &lower_mp, pathname, &upper, &lower, buf);
+	if (r < 0)
+		return r;
+	switch (overlayfs_visible_type(upper, lower))
+	{
+	case OVERLAYFS_MISSING:
+		return -L_ENOENT;
+	case OVERLAYFS_SYMLINK:
+		return -L_ENOSYS; /* Let vfs follow the symlink */
+	default:
+		/* The upper layer stat is already there */
+		if (upper != OVERLAYFS_MISSING)
+			return 0;
+		return fs->lower->stat(&lower_mp, pathname, buf);
+	}
+}
+
+static int overlayfs_symlink(struct mount_point *mp, const char *target, const char *linkpath)
+{
+	struct overlayfs *fs = (struct overlayfs *)mp->fs;
+	struct mount_point lower_mp;
+	overlayfs_get_lower_mountpoint(mp, &lower_mp);
+	int upper, lower;
+	struct newstat buf;
+	int r = overlayfs_lookup(fs, mp, &lower_mp, linkpath, &upper, &lower, &buf);
+	if (r < 0)
+		return r;
+	if (overlayfs_visible_type(upper, lower) != OVERLAYFS_MISSING)
+		return -L_EEXIST;
+	r = overlayfs_prepare_create(fs, mp, linkpath, upper);
+	if (r < 0)
+		return r;
+	return fs->upper->symlink(mp, target, linkpath);
+}
+
+static int overlayfs_link(struct mount_point *mp, struct file *f, const char *newpath)
+{
+	struct overlayfs *fs = (struct overlayfs *)mp->fs;
+	struct mount_point lower_mp;
+	overlayfs_get_lower_mountpoint(mp, &lower_mp);
+	int upper, lower;
+	struct newstat buf;
+	int r = overlayfs_lookup(fs, mp, &lower_mp, newpath, &upper, &lower, &buf);
+	if (r < 0)
+		return r;
+	if (overlayfs_visible_type(upper, lower) != OVERLAYFS_MISSING)
+		return -L_EEXIST;
+	r = overlayfs_prepare_create(fs, mp, newpath, upper);
+	if (r < 0)
+		return r;
+	return fs->upper->link(mp, f, newpath);
+}
+
+static int overlayfs_unlink(struct mount_point *mp, const char *pathname)
+{
+	struct overlayfs *fs = (struct overlayfs *)mp->fs;
+	struct mount_point lower_mp;
+	overlayfs_get_lower_mountpoint(mp, &lower_mp);
+	int upper, lower;
+	struct newstat buf;
+	int r = overlayfs_lookup(fs, mp, &lower_mp, pathname, &upper, &lower, &buf);
+	if (r < 0)
+		return r;
+	int type = overlayfs_visible_type(upper, lower);
+	if (type == OVERLAYFS_MISSING)
+		return -L_ENOENT;
+	if (type == OVERLAYFS_DIR)
+		return -L_EISDIR;
+	if (upper != OVERLAYFS_MISSING)
+		r = fs->upper->unlink(mp, pathname);
+	else
+		r = overlayfs_copy_up_parents(fs, mp, pathname);
+	if (r == 0 && lower != OVERLAYFS_MISSING)
+		r = overlayfs_whiteout(fs, mp, pathname);
+	return r;
+}
+
+static int overlayfs_rename(struct mount_point *mp, struct file *f, const char *newpath)
+{
+	struct overlayfs *fs = (struct overlayfs *)mp->fs;
+	struct mount_point lower_mp;
+	overlayfs_get_lower_mountpoint(mp, &lower_mp);
+	/* The source is an upper layer file, find out whether it comes from this mount */
+	char oldpath[PATH_MAX];
+	const char *oldsubpath = NULL;
+	f->op_vtable->getpath(f, oldpath);
+	if (!strncmp(oldpath, mp->mountpoint, mp->mountpoint_len))
+	{
+		const char *p = oldpath + mp->mountpoint_len;
+		if (*p == '/')
+			oldsubpath = p + 1;
+		else if (*p == 0)
+			oldsubpath = p;
+		if (oldsubpath && !strcmp(oldsubpath, newpath))
+			return 0;
+	}
+	int upper, lower;
+	struct newstat buf;
+	int r = overlayfs_lookup(fs, mp, &lower_mp, newpath, &upper, &lower, &buf);
+	if (r < 0)
+		return r;
+	if (lower == OVERLAYFS_DIR && overlayfs_visible_type(upper, lower) == OVERLAYFS_DIR)
+		return -L_EXDEV;
+	r = overlayfs_copy_up_parents(fs, mp, newpath);
+	if (r < 0)
+		return r;
+	r = fs->upper->rename(mp, f, newpath);
+	if (r == 0 && oldsubpath)
+	{
+		int type = overlayfs_lower_type(fs, &lower_mp, oldsubpath);
+		if (type > 0)
+			r = overlayfs_whiteout(fs, mp, oldsubpath);
+	}
+	return r;
+}
+
+static int overlayfs_mkdir(struct mount_point *mp, const char *pathname, int mode)
+{
+	struct overlayfs *fs = (struct overlayfs *)mp->fs;
+	struct mount_point lower_mp;
+	overlayfs_get_lower_mountpoint(mp, &lower_mp);
+	int upper, lower;
+	struct newstat buf;
+	int r = overlayfs_lookup(fs, mp, &lower_mp, pathname, &upper, &lower, &buf);
+	if (r < 0)
+		return r;
+	if (overlayfs_visible_type(upper, lower) != OVERLAYFS_MISSING)
+		return -L_EEXIST;
+	r = overlayfs_prepare_create(fs, mp, pathname, upper);
+	if (r < 0)
+		return r;
+	r = fs->upper->mkdir(mp, pathname, mode);
+	if (r == 0 && lower == OVERLAYFS_DIR)
+	{
+		/* Hide the entries of the removed image directory */
+		struct overlayfs_names names = { 0 };
+		r = overlayfs_list(fs->lower, &lower_mp, pathname, &names);
+		char path[PATH_MAX];
+		overlayfs_names_iterate(&names, name)
+		{
+			if (r == 0)
+				r = overlayfs_join(pathname, name, path);
+			if (r == 0)
+				r = overlayfs_whiteout(fs, mp, path);
+		}
+		overlayfs_names_free(&names);
+	}
+	return r;
+}
+
+static int overlayfs_rmdir(struct mount_point *mp, const char *pathname)
+{
+	struct overlayfs *fs = (struct overlayfs *)mp->fs;
+	struct mount_point lower_mp;
+	overlayfs_get_lower_mountpoint(mp, &lower_mp);
+	int upper, lower;
+	struct newstat buf;
+	int r = overlayfs_lookup(fs, mp, &lower_mp, pathname, &upper, &lower, &buf);
+	if (r < 0)
+		return r;
+	int type = overlayfs_visible_type(upper, lower);
+	if (type == OVERLAYFS_MISSING)
+		return -L_ENOENT;
+	if (type != OVERLAYFS_DIR)
+		return -L_ENOTDIR;
+	/* The directory is empty if the upper layer only holds whiteouts for all image entries */
+	struct overlayfs_names upper_names = { 0 }, lower_names = { 0 };
+	if (upper == OVERLAYFS_DIR)
+		r = overlayfs_list(fs->upper, mp, pathname, &upper_names);
+	if (r == 0 && lower == OVERLAYFS_DIR)
+		r = overlayfs_list(fs->lower, &lower_mp, pathname, &lower_names);
+	char path[PATH_MAX];
+	overlayfs_names_iterate(&upper_names, name)
+	{
+		if (r == 0)
+			r = overlayfs_join(pathname, name, path);
+		if (r == 0)
+		{
+			struct newstat stat;
+			int child_type = overlayfs_upper_type(fs, mp, path, &stat);
+			if (child_type != OVERLAYFS_WHITEOUT)
+				r = child_type < 0? child_type: -L_ENOTEMPTY;
+		}
+	}
+	overlayfs_names_iterate(&lower_names, name)
+		if (r == 0 && !overlayfs_names_contain(&upper_names, name))
+			r = -L_ENOTEMPTY;
+	if (r == 0 && upper == OVERLAYFS_DIR)
+	{
+		overlayfs_names_iterate(&upper_names, name)
+		{
+			if (r == 0)
+				r = overlayfs_join(pathname, name, path);
+			if (r == 0)
+				r = fs->upper->unlink(mp, path);
+		}
+		if (r == 0)
+			r = fs->upper->rmdir(mp, pathname);
+	}
+	else if (r == 0)
+		r = overlayfs_copy_up_parents(fs, mp, pathname);
+	if (r == 0 && lower != OVERLAYFS_MISSING)
+		r = overlayfs_whiteout(fs, mp, pathname);
+	overlayfs_names_free(&upper_names);
+	overlayfs_names_free(&lower_names);
+	return r;
+}
+
+struct file_system *overlayfs_alloc(struct file_system *upper, struct file_system *lower)
+{
+	struct overlayfs *fs = (struct overlayfs *)kmalloc(sizeof(struct overlayfs));
+	fs->base_fs.open = overlayfs_open;
+	fs->base_fs.stat = overlayfs_stat;
+	fs->base_fs.symlink = overlayfs_symlink;
+	fs->base_fs.link = overlayfs_link;
+	fs->base_fs.unlink = overlayfs_unlink;
+	fs->base_fs.rename = overlayfs_rename;
+	fs->base_fs.mkdir = overlayfs_mkdir;
+	fs->base_fs.rmdir = overlayfs_rmdir;
+	fs->upper = upper;
+	fs->lower = lower;
+	return (struct file_system *)fs;
+}
@@ -17,13 +17,17 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_VFS
+
 #include <common/errno.h>
 #include <common/fcntl.h>
 #include <common/poll.h>
 #include <fs/pipe.h>
 #include <syscall/mm.h>
+#include <syscall/sig.h>
 #include <heap.h>
 #include <log.h>
+#include <str.h>
 
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
@@ -32,53 +36,130 @@
 /* POSIX.1 says that write(2)s of less than PIPE_BUF bytes must be atomic */
 #define PIPE_BUF	4096
 
+/* Pipe capacity, changeable with F_SETPIPE_SZ */
+#define PIPE_DEFAULT_SIZE	65536
+#define PIPE_MAX_SIZE		1048576
+
+/* Pipe data lives in a ring buffer in a section shared by all processes holding either end.
+ * The reader only advances head and the writer only advances tail, readers and writers of
+ * the same end are serialized by the per end mutex. The waiting flags are set before
+ * sleeping so the other end only signals the events when somebody is actually waiting.
+ * The section reserves room for PIPE_MAX_SIZE bytes of data after the header page, each
+ * process commits its view up to the current size.
+ */
+struct pipe_ring
+{
+	volatile uint32_t head, tail;
+	volatile LONG read_waiting, write_waiting;
+	volatile uint32_t size; /* Current capacity, a power of 2 */
+};
+#define PIPE_RING_DATA(ring)	((char *)(ring) + PAGE_SIZE)
+
 struct pipe_file
 {
 	struct file base_file;
-	HANDLE handle;
+	struct pipe_ring *ring;
+	uint32_t committed; /* Bytes of ring data committed in our view */
+	HANDLE section;
+	HANDLE read_mutex, write_mutex; /* Serialize all users of each end */
 	HANDLE read_event; /* Signaled when there is read data available */
-	HANDLE write_event; /* Signaled when there is write data available */
+	HANDLE write_event; /* Signaled when there is write space available */
+	/* The two ends of a Windows named pipe which never carries data, Windows tells us when
+	 * all handles of the other end are gone, including those of crashed processes.
+	 * A read is kept posted on it which completes when that happens.
+	 */
+	HANDLE link;
+	SRWLOCK watch_lock;
+	OVERLAPPED watch_overlapped;
+	char watch_buf;
+	bool watch_posted, peer_closed;
 	bool is_read;
 };
 
-static int pipe_get_poll_status(struct file *f)
+/* Returns whether the other end is closed, if not make sure the watch read is posted */
+static bool pipe_peer_closed(struct pipe_file *pipe)
 {
-	struct pipe_file *pipe = (struct pipe_file *) f;
-	/* Query current pipe quota */
-	FILE_PIPE_LOCAL_INFORMATION info;
-	IO_STATUS_BLOCK status_block;
-	NTSTATUS status;
-	status = NtQueryInformationFile(pipe->handle, &status_block, &info, sizeof(info), FilePipeLocalInformation);
-	if (!NT_SUCCESS(status))
+	AcquireSRWLockExclusive(&pipe->watch_lock);
+	if (!pipe->peer_closed && pipe->watch_posted && HasOverlappedIoCompleted(&pipe->watch_overlapped))
 	{
-		log_error("NtQueryInformationFile() failed, status: %x", status);
-		return LINUX_POLLERR;
+		/* The read can also be cancelled by its issuing thread exiting, post it again in such case */
+		pipe->watch_posted = false;
+		if (pipe->watch_overlapped.Internal == STATUS_PIPE_BROKEN)
+			pipe->peer_closed = true;
 	}
-	int r = 0;
-	if ((pipe->is_read && info.ReadDataAvailable) || (!pipe->is_read && info.WriteQuotaAvailable < info.OutboundQuota))
+	if (!pipe->peer_closed && !pipe->watch_posted)
 	{
-		NtSetEvent(pipe->read_event, NULL);
-		if (pipe->is_read)
-			r |= LINUX_POLLIN;
+		memset(&pipe->watch_overlapped, 0, sizeof(OVERLAPPED));
+		pipe->watch_overlapped.hEvent = pipe->is_read? pipe->read_event: pipe->write_event;
+		if (ReadFile(pipe->link, &pipe->watch_buf, 1, NULL, &pipe->watch_overlapped) || GetLastError() == ERROR_IO_PENDING)
+			pipe->watch_posted = true;
+		else if (GetLastError() == ERROR_BROKEN_PIPE)
+			pipe->peer_closed = true;
+		else
+			log_error("ReadFile() on pipe link failed, error code: %d", GetLastError());
 	}
-	else
-		NtClearEvent(pipe->read_event);
-	if ((pipe->is_read && info.ReadDataAvailable < info.InboundQuota) || (!pipe->is_read && info.WriteQuotaAvailable))
+	bool r = pipe->peer_closed;
+	ReleaseSRWLockExclusive(&pipe->watch_lock);
+	return r;
+}
+
+static size_t pipe_ring_available(struct pipe_ring *ring)
+{
+	return ring->tail - ring->head;
+}
+
+static size_t pipe_ring_space(struct pipe_ring *ring)
+{
+	return ring->size - (ring->tail - ring->head);
+}
+
+/* Make sure the ring data is accessible in our view, called with one of the end mutexes held */
+static void pipe_commit(struct pipe_file *pipe)
+{
+	uint32_t size = pipe->ring->size;
+	if (pipe->committed >= size)
+		return;
+	if (!VirtualAlloc(PIPE_RING_DATA(pipe->ring), size, MEM_COMMIT, PAGE_READWRITE))
 	{
-		NtSetEvent(pipe->write_event, NULL);
-		if (!pipe->is_read)
-			r |= LINUX_POLLOUT;
+		log_error("VirtualAlloc() failed, error code: %d", GetLastError());
+		return;
+	}
+	pipe->committed = size;
+}
+
+static int pipe_get_poll_status(struct file *f)
+{
+	struct pipe_file *pipe = (struct pipe_file *) f;
+	struct pipe_ring *ring = pipe->ring;
+	if (pipe->is_read)
+	{
+		if (pipe_ring_available(ring))
+			return LINUX_POLLIN;
+		/* Same protocol as a blocking read, the caller is going to wait on read_event */
+		ring->read_waiting = 1;
+		NtClearEvent(pipe->read_event);
+		MemoryBarrier();
+		if (pipe_ring_available(ring))
+			return LINUX_POLLIN;
+		if (pipe_peer_closed(pipe))
+			return pipe_ring_available(ring)? LINUX_POLLIN: LINUX_POLLIN | LINUX_POLLHUP;
+		return 0;
 	}
 	else
-		NtClearEvent(pipe->write_event);
-	if (info.NamedPipeState != FILE_PIPE_CONNECTED_STATE)
 	{
-		log_info("Broken pipe.");
-		NtSetEvent(pipe->read_event, NULL);
-		NtSetEvent(pipe->write_event, NULL);
-		return LINUX_POLLIN | LINUX_POLLOUT && LINUX_POLLHUP;
+		if (pipe_peer_closed(pipe))
+			return LINUX_POLLOUT | LINUX_POLLERR;
+		if (pipe_ring_space(ring) >= PIPE_BUF)
+			return LINUX_POLLOUT;
+		ring->write_waiting = 1;
+		NtClearEvent(pipe->write_event);
+		MemoryBarrier();
+		if (pipe_ring_space(ring) >= PIPE_BUF)
+			return LINUX_POLLOUT;
+		if (pipe_peer_closed(pipe))
+			return LINUX_POLLOUT | LINUX_POLLERR;
+		return 0;
 	}
-	return r;
 }
 
 static HANDLE pipe_get_poll_handle(struct file *f, int *poll_flags)
@@ -96,142 +177,320 @@ static HANDLE pipe_get_poll_handle(struct file *f, int *poll_flags)
 	}
 }
 
+static void pipe_map_ring(struct pipe_file *pipe)
+{
+	PVOID base_addr = NULL;
+	SIZE_T view_size = PAGE_SIZE + PIPE_MAX_SIZE;
+	NTSTATUS status = NtMapViewOfSection(pipe->section, NtCurrentProcess(), &base_addr, 0, 0, NULL, &view_size, ViewUnmap, 0, PAGE_READWRITE);
+	if (!NT_SUCCESS(status))
+	{
+		log_error("NtMapViewOfSection() failed, status: %x", status);
+		pipe->ring = NULL;
+		return;
+	}
+	if (!VirtualAlloc(base_addr, PAGE_SIZE, MEM_COMMIT, PAGE_READWRITE))
+		log_error("VirtualAlloc() failed, error code: %d", GetLastError());
+	pipe->ring = (struct pipe_ring *)base_addr;
+	pipe->committed = 0;
+}
+
+static void pipe_after_fork_child(struct file *f)
+{
+	struct pipe_file *pipe = (struct pipe_file *) f;
+	/* Neither the view nor the parent's watch read is inherited */
+	pipe_map_ring(pipe);
+	InitializeSRWLock(&pipe->watch_lock);
+	pipe->watch_posted = false;
+}
+
 static int pipe_close(struct file *f)
 {
 	struct pipe_file *pipe = (struct pipe_file *)f;
+	if (pipe->watch_posted)
+	{
+		DWORD bytes;
+		CancelIoEx(pipe->link, &pipe->watch_overlapped);
+		GetOverlappedResult(pipe->link, &pipe->watch_overlapped, &bytes, TRUE);
+	}
+	/* Closing the link wakes up the other end */
+	CloseHandle(pipe->link);
+	NtUnmapViewOfSection(NtCurrentProcess(), pipe->ring);
+	NtClose(pipe->section);
+	CloseHandle(pipe->read_mutex);
+	CloseHandle(pipe->write_mutex);
 	NtClose(pipe->read_event);
 	NtClose(pipe->write_event);
-	CloseHandle(pipe->handle);
 	kfree(pipe, sizeof(struct pipe_file));
 	return 0;
 }
 
-static void pipe_update_events(struct pipe_file *pipe)
+static void pipe_copy_in(char *data, uint32_t size, uint32_t pos, const struct iovec *iov, int iovcnt, size_t skip, size_t len)
 {
-	FILE_PIPE_LOCAL_INFORMATION info;
-	IO_STATUS_BLOCK status_block;
-	NTSTATUS status;
-	status = NtQueryInformationFile(pipe->handle, &status_block, &info, sizeof(info), FilePipeLocalInformation);
-	if (!NT_SUCCESS(status))
+	for (int i = 0; i < iovcnt && len > 0; i++)
 	{
-		log_error("NtQueryInformationFile() failed, status: %x", status);
-		return;
+		if (skip >= iov[i].iov_len)
+		{
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		size_t count = min(iov[i].iov_len - skip, len);
+		const char *buf = (const char *)iov[i].iov_base + skip;
+		size_t offset = pos & (size - 1);
+		size_t first = min(count, size - offset);
+		memcpy(data + offset, buf, first);
+		memcpy(data, buf + first, count - first);
+		pos += count;
+		len -= count;
+		skip = 0;
 	}
-	if ((pipe->is_read && info.ReadDataAvailable) || (!pipe->is_read && info.WriteQuotaAvailable < info.OutboundQuota))
-		NtSetEvent(pipe->read_event, NULL);
-	else
-		NtClearEvent(pipe->read_event);
-	if ((pipe->is_read && info.ReadDataAvailable < info.InboundQuota) || (!pipe->is_read && info.WriteQuotaAvailable))
-		NtSetEvent(pipe->write_event, NULL);
-	else
-		NtClearEvent(pipe->write_event);
-	if (info.NamedPipeState != FILE_PIPE_CONNECTED_STATE)
+}
+
+static void pipe_copy_out(const char *data, uint32_t size, uint32_t pos, const struct iovec *iov, int iovcnt, size_t len)
+{
+	for (int i = 0; i < iovcnt && len > 0; i++)
 	{
-		NtSetEvent(pipe->read_event, NULL);
-		NtSetEvent(pipe->write_event, NULL);
+		size_t count = min(iov[i].iov_len, len);
+		char *buf = (char *)iov[i].iov_base;
+		size_t offset = pos & (size - 1);
+		size_t first = min(count, size - offset);
+		memcpy(buf, data + offset, first);
+		memcpy(buf + first, data, count - first);
+		pos += count;
+		len -= count;
 	}
 }
 
-static size_t pipe_read(struct file *f, void *buf, size_t count)
+static size_t pipe_readv(struct file *f, const struct iovec *iov, int iovcnt)
 {
-	AcquireSRWLockShared(&f->rw_lock);
 	struct pipe_file *pipe = (struct pipe_file *)f;
-	ssize_t r;
+	struct pipe_ring *ring = pipe->ring;
 	if (!pipe->is_read)
 	{
 		log_warning("read() on pipe write end.");
-		r = -L_EBADF;
-		goto out;
+		return -L_EBADF;
 	}
-	if (f->flags & O_NONBLOCK)
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (total == 0)
+		return 0;
+	ssize_t r;
+	WaitForSingleObject(pipe->read_mutex, INFINITE);
+	for (;;)
 	{
-		if (WaitForSingleObject(pipe->read_event, 0) == WAIT_TIMEOUT)
+		pipe_commit(pipe);
+		uint32_t head = ring->head;
+		size_t available = ring->tail - head;
+		if (available > 0)
 		{
-			r = -L_EAGAIN;
-			goto out;
+			size_t count = min(available, total);
+			pipe_copy_out(PIPE_RING_DATA(ring), ring->size, head, iov, iovcnt, count);
+			ring->head = head + count;
+			MemoryBarrier();
+			if (ring->write_waiting)
+			{
+				ring->write_waiting = 0;
+				NtSetEvent(pipe->write_event, NULL);
+			}
+			r = count;
+			break;
 		}
-	}
-	size_t num_read;
-	if (!ReadFile(pipe->handle, buf, count, &num_read, NULL))
-	{
-		if (GetLastError() == ERROR_BROKEN_PIPE)
+		if (!(f->flags & O_NONBLOCK))
+		{
+			ring->read_waiting = 1;
+			NtClearEvent(pipe->read_event);
+			MemoryBarrier();
+			if (pipe_ring_available(ring))
+				continue;
+		}
+		if (pipe_peer_closed(pipe))
 		{
+			/* Data may have been written right before the writer went away */
+			if (pipe_ring_available(ring))
+				continue;
 			log_info("Pipe closed. Read returns 0.");
 			r = 0;
-			goto out;
+			break;
+		}
+		if (f->flags & O_NONBLOCK)
+		{
+			r = -L_EAGAIN;
+			break;
+		}
+		ReleaseMutex(pipe->read_mutex);
+		DWORD result = signal_wait(1, &pipe->read_event, INFINITE);
+		WaitForSingleObject(pipe->read_mutex, INFINITE);
+		if (result == WAIT_INTERRUPTED)
+		{
+			r = -L_EINTR;
+			break;
 		}
-		r = -L_EIO;
-		goto out;
 	}
-	r = num_read;
-out:
-	pipe_update_events(pipe);
-	ReleaseSRWLockShared(&f->rw_lock);
+	ReleaseMutex(pipe->read_mutex);
 	return r;
 }
 
-static size_t pipe_write(struct file *f, const void *buf, size_t count)
+static size_t pipe_writev(struct file *f, const struct iovec *iov, int iovcnt)
 {
-	AcquireSRWLockShared(&f->rw_lock);
 	struct pipe_file *pipe = (struct pipe_file *)f;
-	ssize_t r;
+	struct pipe_ring *ring = pipe->ring;
 	if (pipe->is_read)
 	{
 		log_warning("write() on pipe read end.");
-		r = -L_EBADF;
+		return -L_EBADF;
 	}
-	if (f->flags & O_NONBLOCK)
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (total == 0)
+		return 0;
+	/* Writes of up to PIPE_BUF bytes are never split */
+	size_t needed = total <= PIPE_BUF? total: 1;
+	size_t written = 0;
+	ssize_t r;
+	WaitForSingleObject(pipe->write_mutex, INFINITE);
+	for (;;)
 	{
-		if (WaitForSingleObject(pipe->write_event, 0) == WAIT_TIMEOUT)
+		pipe_commit(pipe);
+		if (pipe_peer_closed(pipe))
 		{
-			r = -L_EAGAIN;
-			goto out;
+			log_info("Write failed: broken pipe.");
+			/* TODO: Send SIGPIPE signal */
+			r = written? written: -L_EPIPE;
+			break;
 		}
-		/* Make sure we have enough write quota available */
-		FILE_PIPE_LOCAL_INFORMATION info;
-		IO_STATUS_BLOCK status_block;
-		NTSTATUS status;
-		status = NtQueryInformationFile(pipe->handle, &status_block, &info, sizeof(info), FilePipeLocalInformation);
-		if (!NT_SUCCESS(status))
+		uint32_t tail = ring->tail;
+		size_t space = ring->size - (tail - ring->head);
+		if (space >= needed)
 		{
-			log_error("NtQueryInformationFile() failed, status: %x", status);
-			r = -L_EIO;
-			goto out;
+			size_t count = min(space, total - written);
+			pipe_copy_in(PIPE_RING_DATA(ring), ring->size, tail, iov, iovcnt, written, count);
+			ring->tail = tail + count;
+			MemoryBarrier();
+			if (ring->read_waiting)
+			{
+				ring->read_waiting = 0;
+				NtSetEvent(pipe->read_event, NULL);
+			}
+			written += count;
+			if (written == total || (f->flags & O_NONBLOCK))
+			{
+				r = written;
+				break;
+			}
+			continue;
 		}
-		if (info.NamedPipeState != FILE_PIPE_CONNECTED_STATE)
+		if (f->flags & O_NONBLOCK)
 		{
-			log_info("Write failed: broken pipe.");
-			/* TODO: Send SIGPIPE signal */
-			r = -L_EPIPE;
-			goto out;
+			r = written? written: -L_EAGAIN;
+			break;
 		}
-		/* Data length less than PIPE_BUF must be atomic */
-		if (info.WriteQuotaAvailable < min(PIPE_BUF, count))
+		ring->write_waiting = 1;
+		NtClearEvent(pipe->write_event);
+		MemoryBarrier();
+		if (pipe_ring_space(ring) >= needed || pipe_peer_closed(pipe))
+			continue;
+		ReleaseMutex(pipe->write_mutex);
+		DWORD result = signal_wait(1, &pipe->write_event, INFINITE);
+		WaitForSingleObject(pipe->write_mutex, INFINITE);
+		if (result == WAIT_INTERRUPTED)
 		{
-			r = -L_EAGAIN;
-			goto out;
+			r = written? written: -L_EINTR;
+			break;
 		}
 	}
-	size_t num_written;
-	if (!WriteFile(pipe->handle, buf, count, &num_written, NULL))
+	ReleaseMutex(pipe->write_mutex);
+	return r;
+}
+
+static size_t pipe_read(struct file *f, void *buf, size_t count)
+{
+	struct iovec iov;
+	iov.iov_base = buf;
+	iov.iov_len = count;
+	return pipe_readv(f, &iov, 1);
+}
+
+static size_t pipe_write(struct file *f, const void *buf, size_t count)
+{
+	struct iovec iov;
+	iov.iov_base = (void *)buf;
+	iov.iov_len = count;
+	return pipe_writev(f, &iov, 1);
+}
+
+static int pipe_set_size(struct pipe_file *pipe, int arg)
+{
+	if ((unsigned int)arg > PIPE_MAX_SIZE)
+		return -L_EPERM;
+	uint32_t size = PAGE_SIZE;
+	while (size < (uint32_t)arg)
+		size <<= 1;
+	/* Lock out both ends, always in the same order */
+	WaitForSingleObject(pipe->read_mutex, INFINITE);
+	WaitForSingleObject(pipe->write_mutex, INFINITE);
+	struct pipe_ring *ring = pipe->ring;
+	pipe_commit(pipe);
+	uint32_t available = ring->tail - ring->head;
+	int r;
+	if (available > size)
+		r = -L_EBUSY;
+	else
 	{
-		if (GetLastError() == ERROR_BROKEN_PIPE)
+		if (size > pipe->committed)
 		{
-			log_info("Write failed: broken pipe.");
-			/* TODO: Send SIGPIPE signal */
-			r = -L_EPIPE;
-			goto out;
+			if (!VirtualAlloc(PIPE_RING_DATA(ring), size, MEM_COMMIT, PAGE_READWRITE))
+			{
+				log_error("VirtualAlloc() failed, error code: %d", GetLastError());
+				r = -L_ENOMEM;
+				goto out;
+			}
+			pipe->committed = size;
 		}
-		r = -L_EIO;
-		goto out;
+		/* Positions wrap at the ring size, move remaining data to the start */
+		if (available)
+		{
+			struct iovec iov;
+			iov.iov_base = VirtualAlloc(NULL, available, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+			iov.iov_len = available;
+			if (!iov.iov_base)
+			{
+				r = -L_ENOMEM;
+				goto out;
+			}
+			pipe_copy_out(PIPE_RING_DATA(ring), ring->size, ring->head, &iov, 1, available);
+			pipe_copy_in(PIPE_RING_DATA(ring), size, 0, &iov, 1, 0, available);
+			VirtualFree(iov.iov_base, 0, MEM_RELEASE);
+		}
+		ring->head = 0;
+		ring->tail = available;
+		ring->size = size;
+		NtSetEvent(pipe->write_event, NULL);
+		r = size;
 	}
-	r = num_written;
 out:
-	pipe_update_events(pipe);
-	ReleaseSRWLockShared(&f->rw_lock);
+	ReleaseMutex(pipe->write_mutex);
+	ReleaseMutex(pipe->read_mutex);
 	return r;
 }
 
+static const struct file_ops pipe_ops;
+int pipe_fcntl(struct file *f, int cmd, int arg)
+{
+	if (f->op_vtable != &pipe_ops)
+		return -L_EBADF;
+	struct pipe_file *pipe = (struct pipe_file *)f;
+	switch (cmd)
+	{
+	case F_GETPIPE_SZ:
+		return pipe->ring->size;
+	case F_SETPIPE_SZ:
+		return pipe_set_size(pipe, arg);
+	default:
+		return -L_EINVAL;
+	}
+}
+
 static int pipe_llseek(struct file *f, loff_t offset, loff_t *newoffset, int whence)
 {
 	return -L_ESPIPE;
@@ -262,40 +521,112 @@ static int pipe_stat(struct file *f, struct newstat *buf)
 static const struct file_ops pipe_ops = {
 	.get_poll_status = pipe_get_poll_status,
 	.get_poll_handle = pipe_get_poll_handle,
+	.after_fork_child = pipe_after_fork_child,
 	.close = pipe_close,
 	.read = pipe_read,
 	.write = pipe_write,
+	.readv = pipe_readv,
+	.writev = pipe_writev,
 	.llseek = pipe_llseek,
 	.stat = pipe_stat,
 };
 
-static struct file *pipe_create_file(HANDLE handle, HANDLE read_event, HANDLE write_event, bool is_read, int flags)
+/* Create the link, a named pipe with both ends opened overlapped */
+static bool pipe_create_link(HANDLE *server, HANDLE *client)
+{
+	static volatile long pipe_link_count = 0;
+	SECURITY_ATTRIBUTES attr;
+	attr.nLength = sizeof(SECURITY_ATTRIBUTES);
+	attr.lpSecurityDescriptor = NULL;
+	attr.bInheritHandle = TRUE;
+	char pipe_name[256];
+	long pipe_id = InterlockedIncrement(&pipe_link_count);
+	ksprintf(pipe_name, "\\\\.\\pipe\\flinux-pipe%d-%d", GetCurrentProcessId(), pipe_id);
+	*server = CreateNamedPipeA(pipe_name,
+		PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE | FILE_FLAG_OVERLAPPED,
+		PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+		1,
+		0,
+		0,
+		0,
+		&attr);
+	if (*server == INVALID_HANDLE_VALUE)
+	{
+		log_warning("CreateNamedPipeA() failed, error code: %d", GetLastError());
+		return false;
+	}
+	*client = CreateFileA(pipe_name, GENERIC_READ | GENERIC_WRITE, 0, &attr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+	if (*client == INVALID_HANDLE_VALUE)
+	{
+		log_warning("CreateFileA() failed, error code: %d", GetLastError());
+		CloseHandle(*server);
+		return false;
+	}
+	return true;
+}
+
+static struct file *pipe_create_file(HANDLE section, HANDLE read_mutex, HANDLE write_mutex, HANDLE link, HANDLE read_event, HANDLE write_event, bool is_read, int flags)
 {
 	struct pipe_file *pipe = (struct pipe_file *)kmalloc(sizeof(struct pipe_file));
 	file_init(&pipe->base_file, &pipe_ops, is_read ? O_RDONLY: O_WRONLY);
-	pipe->handle = handle;
+	if (flags & O_NONBLOCK)
+		pipe->base_file.flags |= O_NONBLOCK;
+	pipe->section = section;
+	pipe_map_ring(pipe);
+	pipe->read_mutex = read_mutex;
+	pipe->write_mutex = write_mutex;
+	pipe->link = link;
 	pipe->read_event = read_event;
 	pipe->write_event = write_event;
+	InitializeSRWLock(&pipe->watch_lock);
+	pipe->watch_posted = false;
+	pipe->peer_closed = false;
 	pipe->is_read = is_read;
 	return (struct file *)pipe;
 }
 
 int pipe_alloc(struct file **fread, struct file **fwrite, int flags)
 {
-	HANDLE read_handle, write_handle;
+	OBJECT_ATTRIBUTES oa;
+	NTSTATUS status;
+	InitializeObjectAttributes(&oa, NULL, OBJ_INHERIT, NULL, NULL);
+	HANDLE section, section2;
+	LARGE_INTEGER section_size;
+	section_size.QuadPart = PAGE_SIZE + PIPE_MAX_SIZE;
+	status = NtCreateSection(&section, SECTION_MAP_READ | SECTION_MAP_WRITE, &oa, &section_size, PAGE_READWRITE, SEC_RESERVE, NULL);
+	if (!NT_SUCCESS(status))
+	{
+		log_error("NtCreateSection() failed, status: %x", status);
+		return -L_ENOMEM;
+	}
+	status = NtDuplicateObject(NtCurrentProcess(), section, NtCurrentProcess(), &section2, 0, OBJ_INHERIT, DUPLICATE_SAME_ACCESS);
+	if (!NT_SUCCESS(status))
+	{
+		log_error("NtDuplicateObject() failed, status: %x", status);
+		return -L_ENOMEM;
+	}
+	HANDLE read_link, write_link;
+	if (!pipe_create_link(&read_link, &write_link))
+		return -L_EMFILE; /* TODO: Find an appropriate flag */
 	SECURITY_ATTRIBUTES attr;
 	attr.nLength = sizeof(SECURITY_ATTRIBUTES);
 	attr.lpSecurityDescriptor = NULL;
 	attr.bInheritHandle = TRUE;
-	if (!CreatePipe(&read_handle, &write_handle, &attr, 0))
+	HANDLE read_mutex = CreateMutexW(&attr, FALSE, NULL);
+	HANDLE write_mutex = CreateMutexW(&attr, FALSE, NULL);
+	if (!read_mutex || !write_mutex)
 	{
-		log_warning("CreatePipe() failed, error code: %d");
-		return -L_EMFILE; /* TODO: Find an appropriate flag */
+		log_error("CreateMutexW() failed, error code: %d", GetLastError());
+		return -L_ENOMEM;
+	}
+	HANDLE read_mutex2, write_mutex2;
+	if (!DuplicateHandle(GetCurrentProcess(), read_mutex, GetCurrentProcess(), &read_mutex2, 0, TRUE, DUPLICATE_SAME_ACCESS)
+		|| !DuplicateHandle(GetCurrentProcess(), write_mutex, GetCurrentProcess(), &write_mutex2, 0, TRUE, DUPLICATE_SAME_ACCESS))
+	{
+		log_error("DuplicateHandle() failed, error code: %d", GetLastError());
+		return -L_ENOMEM;
 	}
-	OBJECT_ATTRIBUTES oa;
 	HANDLE read_event, write_event;
-	NTSTATUS status;
-	InitializeObjectAttributes(&oa, NULL, OBJ_INHERIT, NULL, NULL);
 	status = NtCreateEvent(&read_event, EVENT_ALL_ACCESS, &oa, NotificationEvent, FALSE);
 	if (!NT_SUCCESS(status))
 	{
@@ -321,7 +652,8 @@ int pipe_alloc(struct file **fread, struct file **fwrite, int flags)
 		log_error("NtDuplicateObject() failed, status: %x", status);
 		return -L_ENOMEM;
 	}
-	*fread = pipe_create_file(read_handle, read_event, write_event, true, flags);
-	*fwrite = pipe_create_file(write_handle, read_event2, write_event2, false, flags);
+	*fread = pipe_create_file(section, read_mutex, write_mutex, read_link, read_event, write_event, true, flags);
+	*fwrite = pipe_create_file(section2, read_mutex2, write_mutex2, write_link, read_event2, write_event2, false, flags);
+	((struct pipe_file *)*fread)->ring->size = PIPE_DEFAULT_SIZE;
 	return 0;
 }
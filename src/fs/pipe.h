@@ -22,3 +22,5 @@
 #include <fs/file.h>
 
 int pipe_alloc(struct file **fread, struct file **fwrite, int flags);
+/* F_GETPIPE_SZ and F_SETPIPE_SZ, returns -L_EBADF if the file is not a pipe */
+int pipe_fcntl(struct file *f, int cmd, int arg);
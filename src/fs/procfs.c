@@ -17,33 +17,62 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_VFS
+
 #include <common/errno.h>
 #include <common/param.h>
-#include <dbt/cpuid.h>
 #include <fs/procfs.h>
 #include <fs/virtual.h>
+#include <syscall/mm.h>
 #include <syscall/process.h>
+#include <syscall/timeline.h>
+#include <cache.h>
 #include <datetime.h>
+#include <hostinfo.h>
 #include <log.h>
 #include <ntdll.h>
 #include <str.h>
 
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#include <Psapi.h>
+
+static int proc_cmdline_gettext(int tag, char *buf)
+{
+	return process_query_pid(tag, PROCESS_QUERY_CMDLINE, buf);
+}
+
+static struct virtualfs_text_desc proc_cmdline_desc = VIRTUALFS_TEXT(proc_cmdline_gettext);
 
 static int proc_maps_gettext(int tag, char *buf)
 {
 	return process_query_pid(tag, PROCESS_QUERY_MAPS, buf);
 }
 
-static struct virtualfs_text_desc proc_maps_desc = VIRTUALFS_TEXT(proc_maps_gettext);
+/* Only the maps of the current process are versioned, other processes are queried every time */
+static bool proc_maps_getversion(int tag, uint32_t *version)
+{
+	if (tag != 0 && tag != process_get_pid())
+		return false;
+	*version = mm_get_maps_version();
+	return true;
+}
+
+static struct virtualfs_text_desc proc_maps_desc = VIRTUALFS_TEXT_VERSIONED(proc_maps_gettext, proc_maps_getversion);
 
 static int mounts_gettext(int tag, char *buf)
 {
 	return ksprintf(buf, "none / ntfs\n");
 }
 
-static struct virtualfs_text_desc proc_mounts_desc = VIRTUALFS_TEXT(mounts_gettext);
+/* The text never changes */
+static bool mounts_getversion(int tag, uint32_t *version)
+{
+	*version = 0;
+	return true;
+}
+
+static struct virtualfs_text_desc proc_mounts_desc = VIRTUALFS_TEXT_VERSIONED(mounts_gettext, mounts_getversion);
 
 static int proc_stat_gettext(int tag, char *buf)
 {
@@ -52,13 +81,87 @@ static int proc_stat_gettext(int tag, char *buf)
 
 static struct virtualfs_text_desc proc_stat_desc = VIRTUALFS_TEXT(proc_stat_gettext);
 
+static int proc_smaps_gettext(int tag, char *buf)
+{
+	return process_query_pid(tag, PROCESS_QUERY_SMAPS, buf);
+}
+
+static struct virtualfs_text_desc proc_smaps_desc = VIRTUALFS_TEXT(proc_smaps_gettext);
+
+static int proc_status_gettext(int tag, char *buf)
+{
+	return process_query_pid(tag, PROCESS_QUERY_STATUS, buf);
+}
+
+static struct virtualfs_text_desc proc_status_desc = VIRTUALFS_TEXT(proc_status_gettext);
+
+static int proc_flinux_dbt_gettext(int tag, char *buf)
+{
+	return process_query_pid(tag, PROCESS_QUERY_DBT, buf);
+}
+
+static struct virtualfs_text_desc proc_flinux_dbt_desc = VIRTUALFS_TEXT(proc_flinux_dbt_gettext);
+
+static int proc_flinux_mm_gettext(int tag, char *buf)
+{
+	return process_query_pid(tag, PROCESS_QUERY_MM, buf);
+}
+
+static struct virtualfs_text_desc proc_flinux_mm_desc = VIRTUALFS_TEXT(proc_flinux_mm_gettext);
+
+static int proc_flinux_fork_gettext(int tag, char *buf)
+{
+	return process_query_pid(tag, PROCESS_QUERY_FORK, buf);
+}
+
+static struct virtualfs_text_desc proc_flinux_fork_desc = VIRTUALFS_TEXT(proc_flinux_fork_gettext);
+
+static int proc_flinux_heap_gettext(int tag, char *buf)
+{
+	return process_query_pid(tag, PROCESS_QUERY_HEAP, buf);
+}
+
+static struct virtualfs_text_desc proc_flinux_heap_desc = VIRTUALFS_TEXT(proc_flinux_heap_gettext);
+
+static int proc_flinux_syscalls_gettext(int tag, char *buf)
+{
+	return process_query_pid(tag, PROCESS_QUERY_SYSCALLS, buf);
+}
+
+static struct virtualfs_text_desc proc_flinux_syscalls_desc = VIRTUALFS_TEXT(proc_flinux_syscalls_gettext);
+
+static int proc_flinux_winfs_gettext(int tag, char *buf)
+{
+	return process_query_pid(tag, PROCESS_QUERY_WINFS, buf);
+}
+
+static struct virtualfs_text_desc proc_flinux_winfs_desc = VIRTUALFS_TEXT(proc_flinux_winfs_gettext);
+
+struct virtualfs_directory_desc proc_pid_flinux_desc =
+{
+	.type = VIRTUALFS_TYPE_DIRECTORY,
+	.entries = {
+		VIRTUALFS_ENTRY("dbt", proc_flinux_dbt_desc)
+		VIRTUALFS_ENTRY("fork", proc_flinux_fork_desc)
+		VIRTUALFS_ENTRY("heap", proc_flinux_heap_desc)
+		VIRTUALFS_ENTRY("mm", proc_flinux_mm_desc)
+		VIRTUALFS_ENTRY("syscalls", proc_flinux_syscalls_desc)
+		VIRTUALFS_ENTRY("winfs", proc_flinux_winfs_desc)
+		VIRTUALFS_ENTRY_END()
+	}
+};
+
 struct virtualfs_directory_desc proc_pid_desc =
 {
 	.type = VIRTUALFS_TYPE_DIRECTORY,
 	.entries = {
+		VIRTUALFS_ENTRY("cmdline", proc_cmdline_desc)
+		VIRTUALFS_ENTRY("flinux", proc_pid_flinux_desc)
 		VIRTUALFS_ENTRY("maps", proc_maps_desc)
 		VIRTUALFS_ENTRY("mounts", proc_mounts_desc)
+		VIRTUALFS_ENTRY("smaps", proc_smaps_desc)
 		VIRTUALFS_ENTRY("stat", proc_stat_desc)
+		VIRTUALFS_ENTRY("status", proc_status_desc)
 		VIRTUALFS_ENTRY_END()
 	}
 };
@@ -83,16 +186,31 @@ static int procfs_pid_open(int dir_tag, const char *name, int namelen, int *file
 	return 0;
 }
 
-static int sys_vm_min_free_kbytes_get(int tag)
+static unsigned int sys_vm_flinux_cache_budget_kbytes_get(int tag)
+{
+	return cache_get_budget_kbytes();
+}
+static void sys_vm_flinux_cache_budget_kbytes_set(int tag, unsigned int value)
+{
+	cache_set_budget_kbytes(value);
+}
+static struct virtualfs_param_desc sys_vm_flinux_cache_budget_kbytes_desc = VIRTUALFS_PARAM_UINT(sys_vm_flinux_cache_budget_kbytes_get, sys_vm_flinux_cache_budget_kbytes_set);
+
+static unsigned int sys_vm_min_free_kbytes_get(int tag)
+{
+	return cache_get_min_free_kbytes();
+}
+static void sys_vm_min_free_kbytes_set(int tag, unsigned int value)
 {
-	return 4096;
+	cache_set_min_free_kbytes(value);
 }
-static struct virtualfs_param_desc sys_vm_min_free_kbytes_desc = VIRTUALFS_PARAM_UINT_READONLY(sys_vm_min_free_kbytes_get);
+static struct virtualfs_param_desc sys_vm_min_free_kbytes_desc = VIRTUALFS_PARAM_UINT(sys_vm_min_free_kbytes_get, sys_vm_min_free_kbytes_set);
 
 struct virtualfs_directory_desc sys_vm_desc =
 {
 	.type = VIRTUALFS_TYPE_DIRECTORY,
 	.entries = {
+		VIRTUALFS_ENTRY("flinux_cache_budget_kbytes", sys_vm_flinux_cache_budget_kbytes_desc)
 		VIRTUALFS_ENTRY("min_free_kbytes", sys_vm_min_free_kbytes_desc)
 		VIRTUALFS_ENTRY_END()
 	}
@@ -107,10 +225,11 @@ struct virtualfs_directory_desc sys_desc =
 	}
 };
 
+#define TICKS_TO_USER_HZ(ticks)	((uint64_t)(ticks) / (TICKS_PER_SECOND / USER_HZ))
+
 static int stat_gettext(int tag, char *buf)
 {
 	char *original_buf = buf;
-	/* TODO: Support more than one processors */
 	LARGE_INTEGER idle_time, kernel_time, user_time;
 	GetSystemTimes((FILETIME *)&idle_time, (FILETIME *)&kernel_time, (FILETIME *)&user_time);
 	uint64_t user = user_time.QuadPart / (TICKS_PER_SECOND / USER_HZ);
@@ -125,6 +244,21 @@ static int stat_gettext(int tag, char *buf)
 
 	buf += ksprintf(buf, "cpu   %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu\n",
 		user, nice, system, idle, iowait, irq, softirq, steal, guest, guest_nice);
+	/* Only processors in the group of the current process are reported */
+	SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION cpus[HOSTINFO_MAX_CPUS];
+	ULONG cpus_size;
+	if (NT_SUCCESS(NtQuerySystemInformation(SystemProcessorPerformanceInformation, cpus, sizeof(cpus), &cpus_size)))
+	{
+		int count = cpus_size / sizeof(SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION);
+		for (int i = 0; i < count; i++)
+		{
+			uint64_t cpu_user = TICKS_TO_USER_HZ(cpus[i].UserTime.QuadPart);
+			uint64_t cpu_idle = TICKS_TO_USER_HZ(cpus[i].IdleTime.QuadPart);
+			uint64_t cpu_system = TICKS_TO_USER_HZ(cpus[i].KernelTime.QuadPart) - cpu_idle;
+			buf += ksprintf(buf, "cpu%-3d%llu %llu %llu %llu %llu %llu %llu %llu %llu %llu\n",
+				i, cpu_user, nice, cpu_system, cpu_idle, iowait, irq, softirq, steal, guest, guest_nice);
+		}
+	}
 	buf += ksprintf(buf, "intr  %llu\n", 0);
 	buf += ksprintf(buf, "swap  %llu %llu\n", 0);
 	uint64_t ctxt = 0;
@@ -147,88 +281,33 @@ static struct virtualfs_text_desc stat_desc = VIRTUALFS_TEXT(stat_gettext);
 
 static int cpuinfo_gettext(int tag, char *buf)
 {
-	struct cpuid_t cpuid;
-
-	char vendorid[13];
-	vendorid[12] = 0;
-	dbt_cpuid(0, 0, &cpuid);
-	int cpuid_level = cpuid.eax;
-	memcpy(vendorid, &cpuid.ebx, sizeof(cpuid.ebx));
-	memcpy(vendorid + 4, &cpuid.edx, sizeof(cpuid.edx));
-	memcpy(vendorid + 8, &cpuid.ecx, sizeof(cpuid.ecx));
-	strip(vendorid);
-
-	dbt_cpuid(1, 0, &cpuid);
-	int clflush_size = ((cpuid.ebx & 0xFF00) >> 8) * 8;
-
-	dbt_cpuid(1, 0, &cpuid);
-	int stepping = cpuid.eax & 0xF;
-	int model = (cpuid.eax & 0xF0) >> 4;
-	int family = (cpuid.eax & 0xF00) >> 8;
-
-	int cache_size = 0;
-	for (int i = 0;; i++)
-	{
-		dbt_cpuid(4, i, &cpuid);
-		if (cpuid.eax == 0)
-			break;
-		struct ebx_struct
-		{
-			int line_size: 12;
-			int partitions: 10;
-			int ways: 10;
-		};
-		struct ebx_struct *ebx = (struct ebx_struct *)&cpuid.ebx;
-		cache_size = (ebx->ways + 1) * (ebx->partitions + 1) * (ebx->line_size + 1) * (cpuid.ecx + 1);
-	}
+	return hostinfo_get_cpuinfo(buf);
+}
 
-	char modelname[49];
-	modelname[48] = 0;
-	dbt_cpuid(0x80000002, 0, &cpuid);
-	memcpy(modelname, &cpuid, sizeof(cpuid));
-	dbt_cpuid(0x80000003, 0, &cpuid);
-	memcpy(modelname + 16, &cpuid, sizeof(cpuid));
-	dbt_cpuid(0x80000004, 0, &cpuid);
-	memcpy(modelname + 32, &cpuid, sizeof(cpuid));
-	strip(modelname);
-
-	dbt_cpuid(0x80000008, 0, &cpuid);
-	int physical_address_bits = cpuid.eax & 0xFF;
-	int virtual_address_bits = (cpuid.eax & 0xFF00) >> 8;
-
-	char flags[4096];
-	dbt_get_cpuinfo(flags);
-	return ksprintf(buf,
-		"processor\t: 0\n"
-		"vendor_id\t: %s\n"
-		"cpu family\t: %d\n"
-		"model\t\t: %d\n"
-		"model name\t: %s\n"
-		"stepping\t: %d\n"
-		"cache size\t: %d KB\n"
-		"cpuid level\t: %d\n"
-		"flags\t\t:%s\n"
-		"clflush size\t: %d\n"
-		"address sizes\t: %d bits physical, %d bits virtual\n",
-		vendorid,
-		family,
-		model,
-		modelname,
-		stepping,
-		cache_size / 1024,
-		cpuid_level,
-		flags,
-		clflush_size,
-		physical_address_bits, virtual_address_bits);
+/* The processors do not change during a session */
+static bool cpuinfo_getversion(int tag, uint32_t *version)
+{
+	*version = 0;
+	return true;
 }
 
-static struct virtualfs_text_desc cpuinfo_desc = VIRTUALFS_TEXT(cpuinfo_gettext);
+static struct virtualfs_text_desc cpuinfo_desc = VIRTUALFS_TEXT_VERSIONED(cpuinfo_gettext, cpuinfo_getversion);
 
 static int loadavg_gettext(int tag, char *buf)
 {
+	uintptr_t loads[3];
+	hostinfo_get_loadavg(loads);
+	pid_t last_pid;
+	int count = process_get_count(&last_pid);
+	/* Same rounding as the kernel */
+	for (int i = 0; i < 3; i++)
+		loads[i] += HOSTINFO_LOAD_FIXED_1 / 200;
 	return ksprintf(buf,
 		"%u.%02u %u.%02u %u.%02u %d/%d %d\n",
-		0, 0, 0, 0, 0, 0, 0, 0, 0);
+		(uint32_t)(loads[0] >> HOSTINFO_LOAD_FSHIFT), (uint32_t)((loads[0] & (HOSTINFO_LOAD_FIXED_1 - 1)) * 100 >> HOSTINFO_LOAD_FSHIFT),
+		(uint32_t)(loads[1] >> HOSTINFO_LOAD_FSHIFT), (uint32_t)((loads[1] & (HOSTINFO_LOAD_FIXED_1 - 1)) * 100 >> HOSTINFO_LOAD_FSHIFT),
+		(uint32_t)(loads[2] >> HOSTINFO_LOAD_FSHIFT), (uint32_t)((loads[2] & (HOSTINFO_LOAD_FIXED_1 - 1)) * 100 >> HOSTINFO_LOAD_FSHIFT),
+		1, count, last_pid);
 }
 
 static struct virtualfs_text_desc loadavg_desc = VIRTUALFS_TEXT(loadavg_gettext);
@@ -238,19 +317,38 @@ static int meminfo_gettext(int tag, char *buf)
 	MEMORYSTATUSEX memory;
 	memory.dwLength = sizeof(memory);
 	GlobalMemoryStatusEx(&memory);
+	PERFORMANCE_INFORMATION performance;
+	if (!GetPerformanceInfo(&performance, sizeof(performance)))
+		ZeroMemory(&performance, sizeof(performance));
+	uint64_t page_size = performance.PageSize;
+	/* The page file limit includes physical memory */
+	uint64_t swap_total = memory.ullTotalPageFile > memory.ullTotalPhys ? memory.ullTotalPageFile - memory.ullTotalPhys : 0;
+	uint64_t swap_free = memory.ullAvailPageFile > memory.ullAvailPhys ? memory.ullAvailPageFile - memory.ullAvailPhys : 0;
+	if (swap_free > swap_total)
+		swap_free = swap_total;
 	return ksprintf(buf,
-		"MemTotal:  %13llu kB\n"
-		"MemFree:   %13llu kB\n"
-		"HighTotal: %13llu kB\n"
-		"HighFree:  %13llu kB\n"
-		"LowTotal:  %13llu kB\n"
-		"LowFree:   %13llu kB\n"
-		"SwapTotal: %13llu kB\n"
-		"SwapFree:  %13llu kB\n",
+		"MemTotal:       %8llu kB\n"
+		"MemFree:        %8llu kB\n"
+		"MemAvailable:   %8llu kB\n"
+		"Buffers:        %8llu kB\n"
+		"Cached:         %8llu kB\n"
+		"HighTotal:      %8llu kB\n"
+		"HighFree:       %8llu kB\n"
+		"LowTotal:       %8llu kB\n"
+		"LowFree:        %8llu kB\n"
+		"SwapTotal:      %8llu kB\n"
+		"SwapFree:       %8llu kB\n"
+		"CommitLimit:    %8llu kB\n"
+		"Committed_AS:   %8llu kB\n",
 		memory.ullTotalPhys / 1024ULL, memory.ullAvailPhys / 1024ULL,
+		memory.ullAvailPhys / 1024ULL,
+		0ULL,
+		(uint64_t)performance.SystemCache * page_size / 1024ULL,
 		0ULL, 0ULL,
 		memory.ullTotalPhys / 1024ULL, memory.ullAvailPhys / 1024ULL,
-		memory.ullTotalPageFile / 1024ULL, memory.ullAvailPageFile / 1024ULL);
+		swap_total / 1024ULL, swap_free / 1024ULL,
+		(uint64_t)performance.CommitLimit * page_size / 1024ULL,
+		(uint64_t)performance.CommitTotal * page_size / 1024ULL);
 }
 
 static struct virtualfs_text_desc meminfo_desc = VIRTUALFS_TEXT(meminfo_gettext);
@@ -273,6 +371,13 @@ static int uptime_gettext(int tag, char *buf)
 
 static struct virtualfs_text_desc uptime_desc = VIRTUALFS_TEXT(uptime_gettext);
 
+static int flinux_timeline_gettext(int tag, char *buf)
+{
+	return timeline_get_trace(buf);
+}
+
+static struct virtualfs_text_desc flinux_timeline_desc = VIRTUALFS_TEXT(flinux_timeline_gettext);
+
 static const struct virtualfs_directory_desc procfs =
 {
 	.type = VIRTUALFS_TYPE_DIRECTORY,
@@ -286,6 +391,7 @@ static const struct virtualfs_directory_desc procfs =
 		VIRTUALFS_ENTRY("meminfo", meminfo_desc)
 		VIRTUALFS_ENTRY("uptime", uptime_desc)
 		VIRTUALFS_ENTRY("mounts", proc_mounts_desc)
+		VIRTUALFS_ENTRY("flinux_timeline", flinux_timeline_desc)
 		VIRTUALFS_ENTRY_END()
 	}
 };
@@ -0,0 +1,776 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define LOG_CATEGORY LOG_CAT_VFS
+
+#include <common/errno.h>
+#include <common/fcntl.h>
+#include <common/ioctls.h>
+#include <common/poll.h>
+#include <common/signal.h>
+#include <common/termios.h>
+#include <fs/pty.h>
+#include <fs/tty.h>
+#include <fs/virtual.h>
+#include <syscall/mm.h>
+#include <syscall/process.h>
+#include <syscall/sig.h>
+#include <heap.h>
+#include <log.h>
+#include <shared.h>
+#include <str.h>
+
+#include <ntdll.h>
+
+/* Pseudo terminals
+ * A pty pair lives in a section shared by all processes using it, named after the pty index
+ * in the session object directory, so /dev/pts/N can be opened by unrelated processes. Input
+ * written to the master goes through the line discipline into the input ring read by the
+ * slave, output written to the slave is post processed into the output ring read by the
+ * master. Nothing goes through the Windows console.
+ * Each ring has a manual reset event signaled when it becomes readable and one signaled when
+ * it gets free space. A waiter resets the event under the pty mutex before looking at the
+ * ring, and sets it again if it leaves something for other waiters.
+ */
+#define PTY_MAX		64
+
+struct pty_table
+{
+	volatile LONG used[PTY_MAX];
+};
+
+static struct pty_table *pty_table;
+
+void pty_init()
+{
+	pty_table = (struct pty_table *)shared_alloc(sizeof(struct pty_table));
+}
+
+void pty_afterfork_child()
+{
+	pty_table = (struct pty_table *)shared_alloc(sizeof(struct pty_table));
+}
+
+enum
+{
+	PTY_INPUT_READY,	/* Slave can read */
+	PTY_INPUT_SPACE,	/* Master can write */
+	PTY_OUTPUT_READY,	/* Master can read */
+	PTY_OUTPUT_SPACE,	/* Slave can write */
+	PTY_EVENT_COUNT,
+};
+
+struct pty_data
+{
+	struct termios termios;
+	struct winsize winsize;
+	volatile pid_t pgid; /* Foreground process group, 0 if not set */
+	volatile LONG master_refs, slave_refs; /* Number of file objects in all processes */
+	volatile int locked; /* Slave can't be opened, see TIOCSPTLCK */
+	volatile int slave_opened;
+	struct tty_input input; /* Master to slave, after the line discipline */
+	struct tty_input output; /* Slave to master, always committed */
+};
+
+struct pty_file
+{
+	struct file base_file;
+	int index;
+	bool master;
+	HANDLE section, mutex;
+	HANDLE events[PTY_EVENT_COUNT];
+	struct pty_data *data;
+};
+
+static struct pty_data *pty_map(HANDLE section)
+{
+	PVOID base_addr = NULL;
+	SIZE_T view_size = sizeof(struct pty_data);
+	NTSTATUS status = NtMapViewOfSection(section, NtCurrentProcess(), &base_addr, 0, view_size, NULL, &view_size, ViewUnmap, 0, PAGE_READWRITE);
+	if (!NT_SUCCESS(status))
+	{
+		log_error("NtMapViewOfSection() failed, status: %x", status);
+		return NULL;
+	}
+	return (struct pty_data *)base_addr;
+}
+
+static void pty_object_name(UNICODE_STRING *name, WCHAR *buf, int index, const char *suffix)
+{
+	char str[64];
+	int len = ksprintf(str, "pty_%d_%s", index, suffix);
+	utf8_to_utf16(str, len + 1, (uint16_t *)buf, 64);
+	RtlInitUnicodeString(name, buf);
+}
+
+static void pty_detach(struct pty_file *f)
+{
+	if (f->data)
+		NtUnmapViewOfSection(NtCurrentProcess(), f->data);
+	if (f->section)
+		NtClose(f->section);
+	if (f->mutex)
+		NtClose(f->mutex);
+	for (int i = 0; i < PTY_EVENT_COUNT; i++)
+		if (f->events[i])
+			NtClose(f->events[i]);
+}
+
+/* Create (master) or open (slave) the shared objects of a pty */
+static bool pty_attach(struct pty_file *f, int index, bool create)
+{
+	UNICODE_STRING name;
+	WCHAR buf[64];
+	OBJECT_ATTRIBUTES oa;
+	NTSTATUS status;
+	f->index = index;
+	f->master = create;
+	f->section = f->mutex = NULL;
+	for (int i = 0; i < PTY_EVENT_COUNT; i++)
+		f->events[i] = NULL;
+	f->data = NULL;
+	/* Objects left behind by a pty of a crashed process are reused */
+	pty_object_name(&name, buf, index, "section");
+	InitializeObjectAttributes(&oa, &name, OBJ_INHERIT | (create ? OBJ_OPENIF : 0), shared_get_object_directory(), NULL);
+	if (create)
+	{
+		LARGE_INTEGER section_size;
+		section_size.QuadPart = sizeof(struct pty_data);
+		status = NtCreateSection(&f->section, SECTION_MAP_READ | SECTION_MAP_WRITE, &oa, &section_size, PAGE_READWRITE, SEC_COMMIT, NULL);
+	}
+	else
+		status = NtOpenSection(&f->section, SECTION_MAP_READ | SECTION_MAP_WRITE, &oa);
+	if (!NT_SUCCESS(status))
+	{
+		log_warning("Creating or opening pty section failed, status: %x", status);
+		f->section = NULL;
+		goto fail;
+	}
+	pty_object_name(&name, buf, index, "mutex");
+	InitializeObjectAttributes(&oa, &name, OBJ_INHERIT | OBJ_OPENIF, shared_get_object_directory(), NULL);
+	status = NtCreateMutant(&f->mutex, MUTANT_ALL_ACCESS, &oa, FALSE);
+	if (!NT_SUCCESS(status))
+	{
+		log_warning("Creating pty mutex failed, status: %x", status);
+		f->mutex = NULL;
+		goto fail;
+	}
+	for (int i = 0; i < PTY_EVENT_COUNT; i++)
+	{
+		char suffix[16];
+		ksprintf(suffix, "event%d", i);
+		pty_object_name(&name, buf, index, suffix);
+		InitializeObjectAttributes(&oa, &name, OBJ_INHERIT | OBJ_OPENIF, shared_get_object_directory(), NULL);
+		status = NtCreateEvent(&f->events[i], EVENT_ALL_ACCESS, &oa, NotificationEvent, FALSE);
+		if (!NT_SUCCESS(status))
+		{
+			log_warning("Creating pty event failed, status: %x", status);
+			f->events[i] = NULL;
+			goto fail;
+		}
+	}
+	f->data = pty_map(f->section);
+	if (!f->data)
+		goto fail;
+	return true;
+
+fail:
+	pty_detach(f);
+	return false;
+}
+
+static void pty_lock(struct pty_file *f)
+{
+	WaitForSingleObject(f->mutex, INFINITE);
+}
+
+static void pty_unlock(struct pty_file *f)
+{
+	ReleaseMutex(f->mutex);
+}
+
+/* Wait for an event with the pty mutex released, returns the result of signal_wait() */
+static DWORD pty_wait(struct pty_file *f, int event, DWORD timeout)
+{
+	pty_unlock(f);
+	DWORD r = signal_wait(1, &f->events[event], timeout);
+	pty_lock(f);
+	return r;
+}
+
+static void pty_signal_foreground(struct pty_data *data, int sig)
+{
+	pid_t pgid = data->pgid;
+	if (pgid <= 0 || !process_pid_exist(pgid))
+		return;
+	/* TODO: Only the process group leader gets the signal as process group kill is not implemented */
+	struct siginfo info;
+	info.si_signo = sig;
+	info.si_code = SI_KERNEL;
+	info.si_errno = 0;
+	signal_kill(pgid, &info);
+}
+
+/* Echo to the output ring, dropped if the master does not read fast enough */
+static void pty_echo(void *param, const char *buf, size_t count)
+{
+	struct pty_file *f = (struct pty_file *)param;
+	if (tty_input_free(&f->data->output) < count)
+		return;
+	tty_input_put(&f->data->output, buf, count);
+	tty_input_commit(&f->data->output);
+	SetEvent(f->events[PTY_OUTPUT_READY]);
+}
+
+static int pty_close(struct file *f)
+{
+	struct pty_file *pty = (struct pty_file *)f;
+	struct pty_data *data = pty->data;
+	pty_lock(pty);
+	if (pty->master)
+		InterlockedDecrement(&data->master_refs);
+	else
+		InterlockedDecrement(&data->slave_refs);
+	bool last = data->master_refs == 0 && data->slave_refs == 0;
+	/* Wake up the other side to see the hang up */
+	for (int i = 0; i < PTY_EVENT_COUNT; i++)
+		SetEvent(pty->events[i]);
+	pty_unlock(pty);
+	if (last)
+		InterlockedExchange(&pty_table->used[pty->index], 0);
+	pty_detach(pty);
+	kfree(pty, sizeof(struct pty_file));
+	return 0;
+}
+
+static void pty_fork(struct file *f, HANDLE child_process, DWORD child_process_id)
+{
+	struct pty_file *pty = (struct pty_file *)f;
+	/* Counted here as the parent may close its file before the child runs */
+	if (pty->master)
+		InterlockedIncrement(&pty->data->master_refs);
+	else
+		InterlockedIncrement(&pty->data->slave_refs);
+}
+
+static void pty_after_fork_child(struct file *f)
+{
+	struct pty_file *pty = (struct pty_file *)f;
+	/* Views of the section are not inherited */
+	pty->data = pty_map(pty->section);
+}
+
+static int pty_getpath(struct file *f, char *buf)
+{
+	struct pty_file *pty = (struct pty_file *)f;
+	if (pty->master)
+		return ksprintf(buf, "/dev/ptmx");
+	else
+		return ksprintf(buf, "/dev/pts/%d", pty->index);
+}
+
+static int pty_stat(struct file *f, struct newstat *buf)
+{
+	struct pty_file *pty = (struct pty_file *)f;
+	INIT_STRUCT_NEWSTAT_PADDING(buf);
+	buf->st_dev = mkdev(0, 1);
+	buf->st_ino = 0;
+	buf->st_mode = S_IFCHR + 0620;
+	buf->st_nlink = 1;
+	buf->st_uid = 0;
+	buf->st_gid = 0;
+	buf->st_rdev = pty->master ? mkdev(5, 2) : mkdev(136, pty->index);
+	buf->st_size = 0;
+	buf->st_blksize = PAGE_SIZE;
+	buf->st_blocks = 0;
+	buf->st_atime = 0;
+	buf->st_atime_nsec = 0;
+	buf->st_mtime = 0;
+	buf->st_mtime_nsec = 0;
+	buf->st_ctime = 0;
+	buf->st_ctime_nsec = 0;
+	return 0;
+}
+
+static int pty_get_poll_status(struct file *f)
+{
+	struct pty_file *pty = (struct pty_file *)f;
+	struct pty_data *data = pty->data;
+	int r = 0;
+	pty_lock(pty);
+	if (pty->master)
+	{
+		if (!tty_input_available(&data->output))
+			ResetEvent(pty->events[PTY_OUTPUT_READY]);
+		if (tty_input_available(&data->output))
+			r |= LINUX_POLLIN;
+		else if (data->slave_opened && data->slave_refs == 0)
+			r |= LINUX_POLLHUP;
+		if (tty_input_free(&data->input) > 1)
+			r |= LINUX_POLLOUT;
+	}
+	else
+	{
+		if (!tty_input_available(&data->input) && !data->input.eof)
+			ResetEvent(pty->events[PTY_INPUT_READY]);
+		if (tty_input_available(&data->input) || data->input.eof)
+			r |= LINUX_POLLIN;
+		if (data->master_refs == 0)
+			r |= LINUX_POLLHUP;
+		else if (tty_input_free(&data->output) > 1)
+			r |= LINUX_POLLOUT;
+	}
+	pty_unlock(pty);
+	return r;
+}
+
+static HANDLE pty_get_poll_handle(struct file *f, int *poll_events)
+{
+	struct pty_file *pty = (struct pty_file *)f;
+	*poll_events = LINUX_POLLIN;
+	return pty->events[pty->master ? PTY_OUTPUT_READY : PTY_INPUT_READY];
+}
+
+static size_t pty_master_read(struct pty_file *pty, char *buf, size_t count)
+{
+	struct pty_data *data = pty->data;
+	size_t r;
+	for (;;)
+	{
+		ResetEvent(pty->events[PTY_OUTPUT_READY]);
+		r = tty_input_take(&data->output, buf, count);
+		if (r > 0)
+		{
+			if (tty_input_available(&data->output))
+				SetEvent(pty->events[PTY_OUTPUT_READY]);
+			SetEvent(pty->events[PTY_OUTPUT_SPACE]);
+			return r;
+		}
+		if (data->slave_opened && data->slave_refs == 0)
+			return -L_EIO;
+		if (pty->base_file.flags & O_NONBLOCK)
+			return -L_EAGAIN;
+		if (pty_wait(pty, PTY_OUTPUT_READY, INFINITE) == WAIT_INTERRUPTED)
+			return -L_EINTR;
+	}
+}
+
+static size_t pty_slave_read(struct pty_file *pty, char *buf, size_t count)
+{
+	struct pty_data *data = pty->data;
+	size_t bytes_read = 0;
+	for (;;)
+	{
+		ResetEvent(pty->events[PTY_INPUT_READY]);
+		if (data->master_refs == 0)
+			break;
+		size_t taken = tty_input_take(&data->input, buf + bytes_read, count - bytes_read);
+		bytes_read += taken;
+		if (taken > 0)
+			SetEvent(pty->events[PTY_INPUT_SPACE]);
+		if (data->termios.c_lflag & ICANON)
+		{
+			if (bytes_read > 0)
+				break;
+			if (data->input.eof)
+			{
+				data->input.eof = 0;
+				break;
+			}
+		}
+		else
+		{
+			int vmin = data->termios.c_cc[VMIN], vtime = data->termios.c_cc[VTIME];
+			if (bytes_read == count || (bytes_read > 0 && bytes_read >= (size_t)vmin))
+				break;
+			if (vmin == 0 && vtime == 0) /* Polling read */
+				break;
+		}
+		if (pty->base_file.flags & O_NONBLOCK)
+		{
+			if (bytes_read == 0)
+				bytes_read = -L_EAGAIN;
+			break;
+		}
+		/* Interbyte timer, or overall timer if VMIN is 0 */
+		DWORD timeout = INFINITE;
+		if (!(data->termios.c_lflag & ICANON) && data->termios.c_cc[VTIME] > 0
+			&& (data->termios.c_cc[VMIN] == 0 || bytes_read > 0))
+			timeout = data->termios.c_cc[VTIME] * 100;
+		DWORD r = pty_wait(pty, PTY_INPUT_READY, timeout);
+		if (r == WAIT_TIMEOUT)
+			break;
+		if (r == WAIT_INTERRUPTED)
+		{
+			if (bytes_read == 0)
+				bytes_read = -L_EINTR;
+			break;
+		}
+	}
+	if (tty_input_available(&data->input))
+		SetEvent(pty->events[PTY_INPUT_READY]);
+	return bytes_read;
+}
+
+static size_t pty_read(struct file *f, void *buf, size_t count)
+{
+	struct pty_file *pty = (struct pty_file *)f;
+	if (count == 0)
+		return 0;
+	pty_lock(pty);
+	size_t r;
+	if (pty->master)
+		r = pty_master_read(pty, (char *)buf, count);
+	else
+		r = pty_slave_read(pty, (char *)buf, count);
+	pty_unlock(pty);
+	return r;
+}
+
+/* Wait until the ring has room for a byte, returns 0 if it has, or the error to return */
+static int pty_wait_space(struct pty_file *pty, struct tty_input *ring, int event)
+{
+	struct pty_data *data = pty->data;
+	for (;;)
+	{
+		ResetEvent(pty->events[event]);
+		if (pty->master ? (data->slave_opened && data->slave_refs == 0) : data->master_refs == 0)
+			return -L_EIO;
+		/* Two bytes, for CR LF output or a line delimiter */
+		if (tty_input_free(ring) > 2)
+			return 0;
+		if (pty->base_file.flags & O_NONBLOCK)
+			return -L_EAGAIN;
+		if (pty_wait(pty, event, INFINITE) == WAIT_INTERRUPTED)
+			return -L_EINTR;
+	}
+}
+
+static size_t pty_write(struct file *f, const void *buf, size_t count)
+{
+	struct pty_file *pty = (struct pty_file *)f;
+	struct pty_data *data = pty->data;
+	const char *in = (const char *)buf;
+	size_t written = 0;
+	int sig = 0;
+	pty_lock(pty);
+	while (written < count)
+	{
+		int r;
+		if (pty->master)
+			r = pty_wait_space(pty, &data->input, PTY_INPUT_SPACE);
+		else
+			r = pty_wait_space(pty, &data->output, PTY_OUTPUT_SPACE);
+		if (r < 0)
+		{
+			if (written == 0)
+				written = r;
+			break;
+		}
+		/* Process as much as fits without waiting */
+		if (pty->master)
+		{
+			while (written < count && tty_input_free(&data->input) > 2)
+			{
+				int s = tty_input_char(&data->input, &data->termios, in[written++], pty_echo, pty);
+				if (s)
+					sig = s;
+			}
+			if (tty_input_available(&data->input) || data->input.eof)
+				SetEvent(pty->events[PTY_INPUT_READY]);
+		}
+		else
+		{
+			while (written < count && tty_input_free(&data->output) > 2)
+			{
+				char out[2];
+				int len = tty_output_char(&data->termios, in[written++], out);
+				tty_input_put(&data->output, out, len);
+			}
+			tty_input_commit(&data->output);
+			SetEvent(pty->events[PTY_OUTPUT_READY]);
+		}
+	}
+	pty_unlock(pty);
+	if (sig)
+		pty_signal_foreground(data, sig);
+	return written;
+}
+
+static int pty_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+	struct pty_file *pty = (struct pty_file *)f;
+	struct pty_data *data = pty->data;
+	int r = 0;
+	int sig = 0;
+	pty_lock(pty);
+	switch (cmd)
+	{
+	case L_TCGETS:
+	{
+		struct termios *t = (struct termios *)arg;
+		memcpy(t, &data->termios, sizeof(struct termios));
+		break;
+	}
+
+	case L_TCSETS:
+	case L_TCSETSW:
+	case L_TCSETSF:
+	{
+		const struct termios *t = (const struct termios *)arg;
+		memcpy(&data->termios, t, sizeof(struct termios));
+		if (cmd == L_TCSETSF)
+			tty_input_flush(&data->input);
+		tty_input_update_termios(&data->input, &data->termios);
+		if (tty_input_available(&data->input))
+			SetEvent(pty->events[PTY_INPUT_READY]);
+		break;
+	}
+
+	case L_TCFLSH:
+	{
+		/* Queues as seen from the slave */
+		if (arg == 0 || arg == 2) /* TCIFLUSH, TCIOFLUSH */
+		{
+			tty_input_flush(&data->input);
+			SetEvent(pty->events[PTY_INPUT_SPACE]);
+		}
+		if (arg == 1 || arg == 2) /* TCOFLUSH, TCIOFLUSH */
+		{
+			tty_input_flush(&data->output);
+			SetEvent(pty->events[PTY_OUTPUT_SPACE]);
+		}
+		break;
+	}
+
+	case L_FIONREAD:
+	{
+		*(int *)arg = (int)tty_input_available(pty->master ? &data->output : &data->input);
+		break;
+	}
+
+	case L_TIOCGPGRP:
+	{
+		*(pid_t *)arg = data->pgid ? data->pgid : process_get_pgid(0);
+		break;
+	}
+
+	case L_TIOCSPGRP:
+	{
+		data->pgid = *(const pid_t *)arg;
+		break;
+	}
+
+	case L_TIOCSCTTY:
+	{
+		if (!data->pgid)
+			data->pgid = process_get_pgid(0);
+		break;
+	}
+
+	case L_TIOCNOTTY:
+		break;
+
+	case L_TIOCGSID:
+	{
+		*(pid_t *)arg = process_get_sid();
+		break;
+	}
+
+	case L_TIOCGWINSZ:
+	{
+		memcpy((struct winsize *)arg, &data->winsize, sizeof(struct winsize));
+		break;
+	}
+
+	case L_TIOCSWINSZ:
+	{
+		const struct winsize *win = (const struct winsize *)arg;
+		if (win->ws_row != data->winsize.ws_row || win->ws_col != data->winsize.ws_col)
+			sig = SIGWINCH;
+		memcpy(&data->winsize, win, sizeof(struct winsize));
+		break;
+	}
+
+	case L_TIOCGPTN:
+	{
+		if (pty->master)
+			*(unsigned int *)arg = pty->index;
+		else
+			r = -L_EINVAL;
+		break;
+	}
+
+	case L_TIOCSPTLCK:
+	{
+		if (pty->master)
+			data->locked = *(const int *)arg;
+		else
+			r = -L_EINVAL;
+		break;
+	}
+
+	case L_TIOCGPTLCK:
+	{
+		if (pty->master)
+			*(int *)arg = data->locked;
+		else
+			r = -L_EINVAL;
+		break;
+	}
+
+	default:
+		log_error("pty: unknown ioctl command: %x", cmd);
+		r = -L_EINVAL;
+		break;
+	}
+	pty_unlock(pty);
+	if (sig)
+		pty_signal_foreground(data, sig);
+	return r;
+}
+
+static const struct file_ops pty_ops = {
+	.get_poll_status = pty_get_poll_status,
+	.get_poll_handle = pty_get_poll_handle,
+	.fork = pty_fork,
+	.after_fork_child = pty_after_fork_child,
+	.close = pty_close,
+	.getpath = pty_getpath,
+	.read = pty_read,
+	.write = pty_write,
+	.stat = pty_stat,
+	.ioctl = pty_ioctl,
+};
+
+static struct file *pty_master_alloc()
+{
+	int index;
+	for (index = 0; index < PTY_MAX; index++)
+		if (InterlockedCompareExchange(&pty_table->used[index], 1, 0) == 0)
+			break;
+	if (index == PTY_MAX)
+	{
+		log_warning("No free pty.");
+		return NULL;
+	}
+	struct pty_file *f = (struct pty_file *)kmalloc(sizeof(struct pty_file));
+	if (!pty_attach(f, index, true))
+	{
+		kfree(f, sizeof(struct pty_file));
+		InterlockedExchange(&pty_table->used[index], 0);
+		return NULL;
+	}
+	file_init(&f->base_file, &pty_ops, O_LARGEFILE | O_RDWR);
+	pty_lock(f);
+	struct pty_data *data = f->data;
+	tty_init_termios(&data->termios);
+	data->winsize.ws_row = 24;
+	data->winsize.ws_col = 80;
+	data->winsize.ws_xpixel = 0;
+	data->winsize.ws_ypixel = 0;
+	data->pgid = 0;
+	data->master_refs = 1;
+	data->slave_refs = 0;
+	data->locked = 1;
+	data->slave_opened = 0;
+	tty_input_init(&data->input);
+	tty_input_init(&data->output);
+	for (int i = 0; i < PTY_EVENT_COUNT; i++)
+		ResetEvent(f->events[i]);
+	pty_unlock(f);
+	log_info("Allocated pty %d.", index);
+	return (struct file *)f;
+}
+
+static struct file *pty_slave_alloc(int index)
+{
+	if (index < 0 || index >= PTY_MAX || !pty_table->used[index])
+		return NULL;
+	struct pty_file *f = (struct pty_file *)kmalloc(sizeof(struct pty_file));
+	if (!pty_attach(f, index, false))
+	{
+		kfree(f, sizeof(struct pty_file));
+		return NULL;
+	}
+	file_init(&f->base_file, &pty_ops, O_LARGEFILE | O_RDWR);
+	pty_lock(f);
+	struct pty_data *data = f->data;
+	bool ok = data->master_refs > 0 && !data->locked;
+	if (ok)
+	{
+		InterlockedIncrement(&data->slave_refs);
+		data->slave_opened = 1;
+	}
+	pty_unlock(f);
+	if (!ok)
+	{
+		pty_detach(f);
+		kfree(f, sizeof(struct pty_file));
+		return NULL;
+	}
+	return (struct file *)f;
+}
+
+struct virtualfs_custom_desc ptmx_desc = VIRTUALFS_CUSTOM(mkdev(5, 2), pty_master_alloc);
+static struct virtualfs_custom_desc pts_slave_desc = VIRTUALFS_CUSTOM_TAG(0, pty_slave_alloc);
+
+static void pts_begin_iter(int dir_tag)
+{
+}
+
+static void pts_end_iter(int dir_tag)
+{
+}
+
+static int pts_iter(int dir_tag, int iter_tag, int *type, char *name, int namelen)
+{
+	while (iter_tag < PTY_MAX && !pty_table->used[iter_tag])
+		iter_tag++;
+	if (iter_tag == PTY_MAX)
+		return VIRTUALFS_ITER_END;
+	*type = DT_CHR;
+	ksprintf(name, "%d", iter_tag);
+	return iter_tag + 1;
+}
+
+static int pts_open(int dir_tag, const char *name, int namelen, int *file_tag, struct virtualfs_desc **desc)
+{
+	char buf[32];
+	if (namelen >= sizeof(buf))
+		return -L_ENOENT;
+	strncpy(buf, name, namelen);
+	buf[namelen] = 0;
+	unsigned int index;
+	if (!katou(buf, &index) || index >= PTY_MAX || !pty_table->used[index])
+		return -L_ENOENT;
+	*file_tag = index;
+	*desc = (struct virtualfs_desc *)&pts_slave_desc;
+	return 0;
+}
+
+const struct virtualfs_directory_desc pts_desc =
+{
+	.type = VIRTUALFS_TYPE_DIRECTORY,
+	.entries = {
+		VIRTUALFS_ENTRY_DYNAMIC(pts_begin_iter, pts_end_iter, pts_iter, pts_open)
+		VIRTUALFS_ENTRY_END()
+	}
+};
@@ -17,29 +17,130 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_VFS
+
 #include <common/errno.h>
 #include <fs/file.h>
 #include <fs/virtual.h>
+#include <syscall/process.h>
 #include <syscall/syscall.h>
 #include <log.h>
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #define SystemFunction036 NTAPI SystemFunction036
 #include <NTSecAPI.h>
 #undef SystemFunction036
 
+/* Random numbers are served from a per thread ChaCha20 keystream seeded by RtlGenRandom(), so
+ * small reads do not call into advapi32 every time. After every refill the first 32 bytes of
+ * the fresh keystream become the new key and served bytes are wiped, so earlier output can't
+ * be recovered from the pool state. The key is reseeded every RANDOM_RESEED_BYTES and in a
+ * fork child, which must not repeat the output of its parent.
+ */
+#define RANDOM_POOL_BLOCKS	8
+#define RANDOM_RESEED_BYTES	(1024 * 1024)
+
+struct random_pool
+{
+	pid_t seed_pid; /* Process the pool was seeded in, 0 if not seeded */
+	uint32_t key[8];
+	uint64_t counter;
+	size_t pos; /* Next unused byte in buffer */
+	size_t generated; /* Bytes generated since the last reseed */
+	uint8_t buffer[RANDOM_POOL_BLOCKS * 64];
+};
+
+static __declspec(thread) struct random_pool random_pool;
+
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d) \
+	a += b; d ^= a; d = ROTL32(d, 16); \
+	c += d; b ^= c; b = ROTL32(b, 12); \
+	a += b; d ^= a; d = ROTL32(d, 8); \
+	c += d; b ^= c; b = ROTL32(b, 7);
+
+/* ChaCha20 block function with a 64-bit block counter and zero nonce */
+static void random_chacha20_block(const uint32_t key[8], uint64_t counter, uint32_t out[16])
+{
+	uint32_t state[16] = {
+		0x61707865, 0x3320646E, 0x79622D32, 0x6B206574,
+		key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+		(uint32_t)counter, (uint32_t)(counter >> 32), 0, 0,
+	};
+	uint32_t x[16];
+	memcpy(x, state, sizeof(x));
+	for (int i = 0; i < 10; i++)
+	{
+		QUARTERROUND(x[0], x[4], x[8], x[12]);
+		QUARTERROUND(x[1], x[5], x[9], x[13]);
+		QUARTERROUND(x[2], x[6], x[10], x[14]);
+		QUARTERROUND(x[3], x[7], x[11], x[15]);
+		QUARTERROUND(x[0], x[5], x[10], x[15]);
+		QUARTERROUND(x[1], x[6], x[11], x[12]);
+		QUARTERROUND(x[2], x[7], x[8], x[13]);
+		QUARTERROUND(x[3], x[4], x[9], x[14]);
+	}
+	for (int i = 0; i < 16; i++)
+		out[i] = x[i] + state[i];
+}
+
+static bool random_pool_refill(struct random_pool *pool)
+{
+	pid_t pid = process_get_pid();
+	if (pool->seed_pid != pid || pool->generated >= RANDOM_RESEED_BYTES)
+	{
+		if (!RtlGenRandom(pool->key, sizeof(pool->key)))
+		{
+			log_error("RtlGenRandom() failed.");
+			return false;
+		}
+		pool->seed_pid = pid;
+		pool->counter = 0;
+		pool->generated = 0;
+	}
+	for (int i = 0; i < RANDOM_POOL_BLOCKS; i++)
+		random_chacha20_block(pool->key, pool->counter++, (uint32_t *)(pool->buffer + i * 64));
+	memcpy(pool->key, pool->buffer, sizeof(pool->key));
+	pool->pos = sizeof(pool->key);
+	pool->generated += sizeof(pool->buffer);
+	return true;
+}
+
+static bool random_fill(void *buf, size_t count)
+{
+	struct random_pool *pool = &random_pool;
+	uint8_t *out = (uint8_t *)buf;
+	if (pool->seed_pid != process_get_pid())
+		pool->pos = sizeof(pool->buffer);
+	while (count > 0)
+	{
+		if (pool->pos == sizeof(pool->buffer) && !random_pool_refill(pool))
+			return false;
+		size_t n = min(count, sizeof(pool->buffer) - pool->pos);
+		memcpy(out, pool->buffer + pool->pos, n);
+		SecureZeroMemory(pool->buffer + pool->pos, n);
+		pool->pos += n;
+		out += n;
+		count -= n;
+	}
+	return true;
+}
+
 DEFINE_SYSCALL(getrandom, void *, buf, size_t, buflen, unsigned int, flags)
 {
 	log_info("getrandom(%p, %d, %x)", buf, buflen, flags);
 	if (!mm_check_write(buf, buflen))
 		return -L_EFAULT;
-	if (!RtlGenRandom(buf, buflen))
+	if (!random_fill(buf, buflen))
 		return 0;
 	return buflen;
 }
 
 static size_t random_read(int tag, void *buf, size_t count)
 {
-	if (!RtlGenRandom(buf, count))
+	if (!random_fill(buf, count))
 		return 0;
 	return count;
 }
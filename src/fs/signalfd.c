@@ -0,0 +1,161 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define LOG_CATEGORY LOG_CAT_VFS
+
+#include <common/errno.h>
+#include <common/poll.h>
+#include <common/signal.h>
+#include <common/signalfd.h>
+#include <fs/file.h>
+#include <syscall/mm.h>
+#include <syscall/sig.h>
+#include <syscall/syscall.h>
+#include <syscall/vfs.h>
+#include <heap.h>
+#include <log.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+/* A signalfd consumes signals pending in the process which are in its mask
+ * The signals should be blocked by all threads, otherwise they are delivered as usual before
+ * becoming pending. Since the signal state is per process, a signalfd inherited by fork() reads
+ * signals of the process it is used in, like on Linux.
+ */
+struct signalfd_file
+{
+	struct file base_file;
+	sigset_t mask;
+};
+
+static int signalfd_close(struct file *f)
+{
+	kfree(f, sizeof(struct signalfd_file));
+	return 0;
+}
+
+static bool signalfd_has_pending(struct signalfd_file *f)
+{
+	if (signal_get_pending() & f->mask)
+		return true;
+	/* Nothing for us, reset the event before checking again so a new signal is not missed */
+	ResetEvent(signal_get_pending_event());
+	return (signal_get_pending() & f->mask) != 0;
+}
+
+static int signalfd_get_poll_status(struct file *f)
+{
+	return signalfd_has_pending((struct signalfd_file *)f) ? LINUX_POLLIN : 0;
+}
+
+static HANDLE signalfd_get_poll_handle(struct file *f, int *poll_events)
+{
+	*poll_events = LINUX_POLLIN;
+	return signal_get_pending_event();
+}
+
+static void signalfd_fill_siginfo(struct signalfd_siginfo *ssi, const siginfo_t *info)
+{
+	memset(ssi, 0, sizeof(struct signalfd_siginfo));
+	ssi->ssi_signo = info->si_signo;
+	ssi->ssi_errno = info->si_errno;
+	ssi->ssi_code = info->si_code;
+	if (info->si_code == SI_USER || info->si_code == SI_TKILL)
+	{
+		ssi->ssi_pid = info->_sifields._kill._pid;
+		ssi->ssi_uid = info->_sifields._kill._uid;
+	}
+}
+
+static size_t signalfd_read(struct file *f, void *buf, size_t count)
+{
+	struct signalfd_file *signalfd = (struct signalfd_file *)f;
+	if (count < sizeof(struct signalfd_siginfo))
+		return -L_EINVAL;
+	struct signalfd_siginfo *ssi = (struct signalfd_siginfo *)buf;
+	size_t r = 0;
+	for (;;)
+	{
+		siginfo_t info;
+		while (r + sizeof(struct signalfd_siginfo) <= count && signal_dequeue(&signalfd->mask, &info))
+		{
+			signalfd_fill_siginfo(ssi++, &info);
+			r += sizeof(struct signalfd_siginfo);
+		}
+		if (r > 0)
+			return r;
+		if (f->flags & O_NONBLOCK)
+			return -L_EAGAIN;
+		if (!signalfd_has_pending(signalfd))
+		{
+			HANDLE event = signal_get_pending_event();
+			if (signal_wait(1, &event, INFINITE) == WAIT_INTERRUPTED)
+				return -L_EINTR;
+		}
+	}
+}
+
+static const struct file_ops signalfd_ops = {
+	.get_poll_status = signalfd_get_poll_status,
+	.get_poll_handle = signalfd_get_poll_handle,
+	.close = signalfd_close,
+	.read = signalfd_read,
+};
+
+DEFINE_SYSCALL(signalfd4, int, fd, const sigset_t *, mask, size_t, sizemask, int, flags)
+{
+	log_info("signalfd4(%d, %p, %d, 0x%x)", fd, mask, sizemask, flags);
+	if (sizemask != sizeof(sigset_t))
+		return -L_EINVAL;
+	if (flags & ~(SFD_CLOEXEC | SFD_NONBLOCK))
+		return -L_EINVAL;
+	if (!mm_check_read(mask, sizeof(sigset_t)))
+		return -L_EFAULT;
+	/* SIGKILL and SIGSTOP are silently ignored */
+	sigset_t new_mask = *mask;
+	sigdelset(&new_mask, SIGKILL);
+	sigdelset(&new_mask, SIGSTOP);
+	if (fd != -1)
+	{
+		struct file *f = vfs_get(fd);
+		if (!f)
+			return -L_EBADF;
+		if (f->op_vtable != &signalfd_ops)
+		{
+			vfs_release(f);
+			return -L_EINVAL;
+		}
+		((struct signalfd_file *)f)->mask = new_mask;
+		vfs_release(f);
+		return fd;
+	}
+	struct signalfd_file *f = (struct signalfd_file *)kmalloc(sizeof(struct signalfd_file));
+	file_init(&f->base_file, &signalfd_ops, O_RDONLY | (flags & SFD_NONBLOCK));
+	f->mask = new_mask;
+	int r = vfs_store_file((struct file *)f, flags & SFD_CLOEXEC);
+	if (r < 0)
+		vfs_release((struct file *)f);
+	return r;
+}
+
+DEFINE_SYSCALL(signalfd, int, fd, const sigset_t *, mask, size_t, sizemask)
+{
+	return sys_signalfd4(fd, mask, sizemask, 0);
+}
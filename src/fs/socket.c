@@ -17,6 +17,8 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_SOCKET
+
 #include <common/errno.h>
 #include <common/fcntl.h>
 #include <common/in.h>
@@ -184,6 +186,33 @@ struct socket_file_shared
 {
 	int af, type;
 	int events, connect_error;
+	int rx_disabled; /* Set on fork(), receive-ahead can't be shared between processes */
+};
+
+/* Stream sockets keep one overlapped WSARecv() posted into a private buffer
+ * so data is already in user space when recv() is called.
+ */
+#define SOCKET_RX_BUFFER_SIZE	16384
+
+/* AF_UNIX stream connections
+ * The connection is still set up through loopback TCP, but data goes through a pair of
+ * ring buffers in a section shared by the two endpoints. The connecting side creates
+ * the section and the wakeup events, named after the two loopback ports, before calling
+ * connect() and the accepting side opens them by the same names. The TCP connection only
+ * serves to detect the peer going away, its FD_CLOSE is reported on the wakeup event.
+ */
+#define UNIX_RING_SIZE		65536
+
+struct unix_ring
+{
+	volatile uint32_t head, tail; /* Free running read and write positions */
+	volatile int shutdown; /* The writer called shutdown(SHUT_WR) */
+	char data[UNIX_RING_SIZE];
+};
+
+struct unix_connection
+{
+	struct unix_ring ring[2]; /* ring[i] is written by side i, 0 is the connecting side */
 };
 
 struct socket_file
@@ -192,10 +221,31 @@ struct socket_file
 	SOCKET socket;
 	HANDLE event_handle;
 	HANDLE mutex;
+	bool inherit; /* The socket handle is inherited by fork children as is, see socket_fork() */
+	struct socket_accept_pool *accept_pool; /* Pre-posted AcceptEx() operations, NULL if not listening */
 	WSAPROTOCOL_INFOW fork_info;
 	volatile struct socket_file_shared *shared;
+	/* Receive-ahead state, protected by mutex */
+	char *rx_buffer;
+	int rx_start, rx_end;
+	int rx_error; /* Linux error code of a failed receive, reported after buffered data */
+	bool rx_pending, rx_eof;
+	WSAOVERLAPPED rx_overlapped;
+	/* AF_UNIX connection, NULL if data goes through the socket */
+	struct unix_connection *unix_conn;
+	HANDLE unix_section;
+	HANDLE unix_peer_event; /* Wakeup event of the other side */
+	int unix_side;
+	/* Readiness notification, see socket_poll_events() */
+	SRWLOCK poll_lock;
+	HANDLE poll_wait; /* One shot thread pool wait on event_handle, NULL if not armed */
+	volatile LONG poll_notified; /* event_handle was signaled since the wait was armed */
 };
 
+static bool socket_accept_pool_ready(struct socket_file *f);
+static void socket_accept_pool_create(struct socket_file *f);
+static void socket_accept_pool_destroy(struct socket_file *f);
+
 /* Reports current ready state
  * If one event in error_report_events has potential error code, the last WSA error code is set to that
  */
@@ -217,6 +267,15 @@ static int socket_update_events_unsafe(struct socket_file *f, int error_report_e
 		e |= FD_ACCEPT;
 	if (events.lNetworkEvents & FD_CLOSE)
 		e |= FD_CLOSE;
+	/* The overlapped receive signals the same event, keep it set until the data is consumed */
+	if (f->rx_pending && HasOverlappedIoCompleted(&f->rx_overlapped))
+		SetEvent(f->event_handle);
+	/* Same for completed connections in the accept pool, which are not reported by FD_ACCEPT */
+	if (f->accept_pool && socket_accept_pool_ready(f))
+	{
+		SetEvent(f->event_handle);
+		e |= FD_ACCEPT;
+	}
 	int original = InterlockedOr(&f->shared->events, e);
 	if (error_report_events & f->shared->events & FD_CONNECT)
 	{
@@ -227,17 +286,93 @@ static int socket_update_events_unsafe(struct socket_file *f, int error_report_e
 	return original | e;
 }
 
+/* Readiness notification for poll()
+ * WSAEnumNetworkEvents() is a kernel call, doing it for every socket on every poll() is expensive
+ * for a large set of idle sockets. Instead a one shot thread pool wait is registered on the event
+ * of the socket, which only sets poll_notified. As long as it has not fired, no network event was
+ * recorded since the last WSAEnumNetworkEvents() and the cached shared->events is current.
+ * The thread pool multiplexes the waits of all sockets on its own wait threads.
+ */
+static void CALLBACK socket_poll_callback(PVOID parameter, BOOLEAN timed_out)
+{
+	struct socket_file *f = (struct socket_file *)parameter;
+	InterlockedExchange(&f->poll_notified, 1);
+}
+
+static void socket_poll_init(struct socket_file *f)
+{
+	InitializeSRWLock(&f->poll_lock);
+	f->poll_wait = NULL;
+	f->poll_notified = 0;
+}
+
+/* Stop notification, waits for a running callback */
+static void socket_poll_disarm(struct socket_file *f)
+{
+	AcquireSRWLockExclusive(&f->poll_lock);
+	if (f->poll_wait)
+	{
+		UnregisterWaitEx(f->poll_wait, INVALID_HANDLE_VALUE);
+		f->poll_wait = NULL;
+	}
+	ReleaseSRWLockExclusive(&f->poll_lock);
+}
+
+static int socket_poll_events(struct socket_file *f)
+{
+	/* Somebody else is refreshing, just ask the kernel */
+	if (!TryAcquireSRWLockExclusive(&f->poll_lock))
+		return socket_update_events_unsafe(f, 0);
+	int e;
+	if (f->poll_wait && !InterlockedExchange(&f->poll_notified, 0))
+		e = f->shared->events;
+	else
+	{
+		if (f->poll_wait)
+		{
+			/* The one shot wait has fired, release it */
+			UnregisterWaitEx(f->poll_wait, NULL);
+			f->poll_wait = NULL;
+		}
+		e = socket_update_events_unsafe(f, 0);
+		/* Arm after WSAEnumNetworkEvents() reset the event, an event set meanwhile fires it at once */
+		if (!RegisterWaitForSingleObject(&f->poll_wait, f->event_handle, socket_poll_callback, f, INFINITE,
+			WT_EXECUTEONLYONCE | WT_EXECUTEINWAITTHREAD))
+			f->poll_wait = NULL;
+	}
+	ReleaseSRWLockExclusive(&f->poll_lock);
+	return e;
+}
+
 static int socket_get_poll_status(struct file *f)
 {
 	struct socket_file *socket_file = (struct socket_file *) f;
-	int e = socket_update_events_unsafe(socket_file, 0);
+	int e = socket_poll_events(socket_file);
 	int ret = 0;
+	if (socket_file->unix_conn)
+	{
+		struct unix_ring *rx = &socket_file->unix_conn->ring[!socket_file->unix_side];
+		struct unix_ring *tx = &socket_file->unix_conn->ring[socket_file->unix_side];
+		if (rx->tail != rx->head || rx->shutdown)
+			ret |= LINUX_POLLIN;
+		if (e & FD_CLOSE)
+			ret |= LINUX_POLLIN | LINUX_POLLHUP;
+		/* The accepting side is always connected, the connecting side gets FD_WRITE once connected */
+		if ((socket_file->unix_side == 1 || (e & FD_WRITE)) && tx->tail - tx->head < UNIX_RING_SIZE)
+			ret |= LINUX_POLLOUT;
+		return ret;
+	}
 	if (e & FD_READ)
 		ret |= LINUX_POLLIN;
 	if (e & FD_CLOSE)
 		ret |= LINUX_POLLIN | LINUX_POLLHUP;
 	if (e & FD_WRITE)
 		ret |= LINUX_POLLOUT;
+	if (socket_file->accept_pool && socket_accept_pool_ready(socket_file))
+		ret |= LINUX_POLLIN;
+	if (socket_file->rx_start < socket_file->rx_end || socket_file->rx_eof || socket_file->rx_error
+		|| (socket_file->rx_pending && HasOverlappedIoCompleted(&socket_file->rx_overlapped)))
+		ret |= LINUX_POLLIN;
 	return ret;
 }
 
@@ -248,11 +383,140 @@ static HANDLE socket_get_poll_handle(struct file *f, int *poll_events)
 	return socket_file->event_handle;
 }
 
+static void socket_rx_init(struct socket_file *f)
+{
+	f->rx_buffer = NULL;
+	f->rx_start = f->rx_end = 0;
+	f->rx_error = 0;
+	f->rx_pending = false;
+	f->rx_eof = false;
+}
+
+static void socket_rx_complete(struct socket_file *f, BOOL wait)
+{
+	DWORD bytes, flags;
+	if (WSAGetOverlappedResult(f->socket, &f->rx_overlapped, &bytes, wait, &flags))
+	{
+		f->rx_start = 0;
+		f->rx_end = bytes;
+		if (bytes == 0)
+			f->rx_eof = true;
+	}
+	else
+	{
+		int err = WSAGetLastError();
+		if (err == WSA_IO_INCOMPLETE)
+			return;
+		if (err != WSA_OPERATION_ABORTED)
+		{
+			log_warning("WSARecv() failed, error code: %d", err);
+			f->rx_error = translate_socket_error(err);
+		}
+	}
+	f->rx_pending = false;
+}
+
+/* Cancel the posted receive and wait for it, data already received is kept */
+static void socket_rx_cancel(struct socket_file *f)
+{
+	if (!f->rx_pending)
+		return;
+	CancelIoEx((HANDLE)f->socket, &f->rx_overlapped);
+	socket_rx_complete(f, TRUE);
+}
+
+static void socket_rx_post(struct socket_file *f)
+{
+	if (f->rx_pending || f->rx_eof || f->rx_error || f->rx_start < f->rx_end || f->shared->rx_disabled)
+		return;
+	if (!f->rx_buffer && !(f->rx_buffer = (char *)kmalloc(SOCKET_RX_BUFFER_SIZE)))
+		return;
+	WSABUF buffer;
+	buffer.len = SOCKET_RX_BUFFER_SIZE;
+	buffer.buf = f->rx_buffer;
+	DWORD flags = 0;
+	memset(&f->rx_overlapped, 0, sizeof(WSAOVERLAPPED));
+	f->rx_overlapped.hEvent = f->event_handle;
+	f->rx_start = f->rx_end = 0;
+	/* Data which arrived before is now ours, FD_READ no longer means anything */
+	InterlockedAnd(&f->shared->events, ~FD_READ);
+	if (WSARecv(f->socket, &buffer, 1, NULL, &flags, &f->rx_overlapped, NULL) != SOCKET_ERROR
+		|| WSAGetLastError() == WSA_IO_PENDING)
+		f->rx_pending = true;
+}
+
+/* Receive from the receive-ahead buffer
+ * Returns -L_ENOSYS if no receive can be posted, the caller falls back to plain recv() in such case
+ */
+static int socket_rx_recv(struct socket_file *f, void *buf, size_t len, int flags)
+{
+	if (f->shared->type != LINUX_SOCK_STREAM)
+		return -L_ENOSYS;
+	if (len == 0)
+		return 0;
+	for (;;)
+	{
+		if (f->rx_pending)
+			socket_rx_complete(f, FALSE);
+		if (f->rx_start < f->rx_end)
+		{
+			int r = min((int)len, f->rx_end - f->rx_start);
+			memcpy(buf, f->rx_buffer + f->rx_start, r);
+			if (!(flags & LINUX_MSG_PEEK))
+			{
+				f->rx_start += r;
+				socket_rx_post(f);
+			}
+			return r;
+		}
+		if (f->rx_error)
+		{
+			int r = f->rx_error;
+			f->rx_error = 0;
+			return r;
+		}
+		if (f->rx_eof)
+			return 0;
+		if (!f->rx_pending)
+		{
+			socket_rx_post(f);
+			if (!f->rx_pending)
+				return -L_ENOSYS;
+			continue;
+		}
+		if ((f->base_file.flags & O_NONBLOCK) || (flags & LINUX_MSG_DONTWAIT))
+			return -L_EWOULDBLOCK;
+		if (signal_wait(1, &f->event_handle, INFINITE) == WAIT_INTERRUPTED)
+			return -L_EINTR;
+		socket_update_events_unsafe(f, 0);
+	}
+}
+
+/* Passing sockets to fork children
+ * A socket of an IFS base provider is a plain kernel handle. It is made inheritable on creation
+ * and the child uses the inherited handle value directly, so fork() does no per socket work.
+ * Sockets of layered providers need WSADuplicateSocketW() here and WSASocketW() in the child.
+ */
+static bool socket_make_inheritable(SOCKET sock)
+{
+	WSAPROTOCOL_INFOW info;
+	int len = sizeof(info);
+	if (getsockopt(sock, SOL_SOCKET, SO_PROTOCOL_INFOW, (char *)&info, &len) == SOCKET_ERROR)
+		return false;
+	if (!(info.dwServiceFlags1 & XP1_IFS_HANDLES))
+		return false;
+	return SetHandleInformation((HANDLE)sock, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+}
+
 static void socket_fork(struct file *f, HANDLE child_process, DWORD child_process_id)
 {
 	struct socket_file *socket_file = (struct socket_file *) f;
 	AcquireSRWLockExclusive(&f->rw_lock);
-	WSADuplicateSocketW(socket_file->socket, child_process_id, &socket_file->fork_info);
+	/* The child shares the socket but can't complete our overlapped receive */
+	socket_file->shared->rx_disabled = 1;
+	socket_rx_cancel(socket_file);
+	if (!socket_file->inherit)
+		WSADuplicateSocketW(socket_file->socket, child_process_id, &socket_file->fork_info);
 }
 
 static void socket_after_fork_parent(struct file *f)
@@ -260,13 +524,128 @@ static void socket_after_fork_parent(struct file *f)
 	ReleaseSRWLockExclusive(&f->rw_lock);
 }
 
+static struct unix_connection *socket_unix_map(HANDLE section)
+{
+	PVOID base_addr = NULL;
+	SIZE_T view_size = sizeof(struct unix_connection);
+	NTSTATUS status = NtMapViewOfSection(section, NtCurrentProcess(), &base_addr, 0, view_size, NULL, &view_size, ViewUnmap, 0, PAGE_READWRITE);
+	if (!NT_SUCCESS(status))
+	{
+		log_error("NtMapViewOfSection() failed, status: %x", status);
+		return NULL;
+	}
+	return (struct unix_connection *)base_addr;
+}
+
+static void socket_unix_object_name(UNICODE_STRING *name, WCHAR *buf, int server_port, int client_port, const char *suffix)
+{
+	char str[64];
+	int len = ksprintf(str, "unix_%d_%d_%s", server_port, client_port, suffix);
+	utf8_to_utf16(str, len + 1, (uint16_t *)buf, 64);
+	RtlInitUnicodeString(name, buf);
+}
+
+/* Create (connecting side) or open (accepting side) the shared objects of an AF_UNIX connection */
+static bool socket_unix_attach(struct socket_file *f, int server_port, int client_port, int side)
+{
+	bool create = (side == 0);
+	HANDLE section = NULL, events[2] = { NULL, NULL };
+	UNICODE_STRING name;
+	WCHAR buf[64];
+	OBJECT_ATTRIBUTES oa;
+	NTSTATUS status;
+	socket_unix_object_name(&name, buf, server_port, client_port, "section");
+	InitializeObjectAttributes(&oa, &name, OBJ_INHERIT, shared_get_object_directory(), NULL);
+	if (create)
+	{
+		LARGE_INTEGER section_size;
+		section_size.QuadPart = sizeof(struct unix_connection);
+		status = NtCreateSection(&section, SECTION_MAP_READ | SECTION_MAP_WRITE, &oa, &section_size, PAGE_READWRITE, SEC_COMMIT, NULL);
+	}
+	else
+		status = NtOpenSection(&section, SECTION_MAP_READ | SECTION_MAP_WRITE, &oa);
+	if (!NT_SUCCESS(status))
+	{
+		log_warning("Creating or opening unix connection section failed, status: %x", status);
+		section = NULL;
+		goto fail;
+	}
+	for (int i = 0; i < 2; i++)
+	{
+		socket_unix_object_name(&name, buf, server_port, client_port, i == 0? "event0": "event1");
+		InitializeObjectAttributes(&oa, &name, OBJ_INHERIT, shared_get_object_directory(), NULL);
+		if (create)
+			status = NtCreateEvent(&events[i], EVENT_ALL_ACCESS, &oa, NotificationEvent, FALSE);
+		else
+			status = NtOpenEvent(&events[i], EVENT_ALL_ACCESS, &oa);
+		if (!NT_SUCCESS(status))
+		{
+			log_warning("Creating or opening unix connection event failed, status: %x", status);
+			events[i] = NULL;
+			goto fail;
+		}
+	}
+	struct unix_connection *conn = socket_unix_map(section);
+	if (!conn)
+		goto fail;
+	if (WSAEventSelect(f->socket, events[side], FD_READ | FD_WRITE | FD_ACCEPT | FD_CONNECT | FD_CLOSE) == SOCKET_ERROR)
+	{
+		log_error("WSAEventSelect() failed, error code: %d", WSAGetLastError());
+		NtUnmapViewOfSection(NtCurrentProcess(), conn);
+		goto fail;
+	}
+	socket_poll_disarm(f);
+	CloseHandle(f->event_handle);
+	f->event_handle = events[side];
+	f->unix_conn = conn;
+	f->unix_section = section;
+	f->unix_peer_event = events[!side];
+	f->unix_side = side;
+	return true;
+
+fail:
+	if (section)
+		NtClose(section);
+	for (int i = 0; i < 2; i++)
+		if (events[i])
+			NtClose(events[i]);
+	return false;
+}
+
+static void socket_unix_detach(struct socket_file *f)
+{
+	if (!f->unix_conn)
+		return;
+	NtUnmapViewOfSection(NtCurrentProcess(), f->unix_conn);
+	NtClose(f->unix_section);
+	NtClose(f->unix_peer_event);
+	f->unix_conn = NULL;
+}
+
 static void socket_after_fork_child(struct file *f)
 {
 	struct socket_file *socket_file = (struct socket_file *) f;
 	socket_ensure_initialized();
-	socket_file->socket = WSASocketW(0, 0, 0, &socket_file->fork_info, 0, 0);
-	if (socket_file->socket == INVALID_SOCKET)
-		log_error("WSASocketW() failed, error code: %d", socket_file->socket);
+	/* Thread pool waits and pending AcceptEx() of the parent do not exist here */
+	socket_poll_init(socket_file);
+	/* Data received ahead belongs to the parent, which still returns it, as does its posted receive */
+	if (socket_file->rx_buffer)
+		kfree(socket_file->rx_buffer, SOCKET_RX_BUFFER_SIZE);
+	socket_rx_init(socket_file);
+	if (socket_file->accept_pool)
+	{
+		kfree(socket_file->accept_pool, sizeof(struct socket_accept_pool));
+		socket_file->accept_pool = NULL;
+	}
+	if (!socket_file->inherit)
+	{
+		socket_file->socket = WSASocketW(0, 0, 0, &socket_file->fork_info, 0, 0);
+		if (socket_file->socket == INVALID_SOCKET)
+			log_error("WSASocketW() failed, error code: %d", socket_file->socket);
+	}
+	/* Views of the connection section are not inherited */
+	if (socket_file->unix_conn)
+		socket_file->unix_conn = socket_unix_map(socket_file->unix_section);
 }
 
 static int socket_wait_event(struct socket_file *f, int event, int flags)
@@ -283,8 +662,122 @@ static int socket_wait_event(struct socket_file *f, int event, int flags)
 	} while (1);
 }
 
+/* Copy len bytes starting at offset skip of the iovecs into the ring at pos */
+static void socket_unix_copy_in(struct unix_ring *ring, uint32_t pos, const struct iovec *iov, int iovcnt, size_t skip, size_t len)
+{
+	for (int i = 0; i < iovcnt && len > 0; i++)
+	{
+		if (skip >= iov[i].iov_len)
+		{
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		size_t count = min(iov[i].iov_len - skip, len);
+		const char *buf = (const char *)iov[i].iov_base + skip;
+		size_t offset = pos % UNIX_RING_SIZE;
+		size_t first = min(count, UNIX_RING_SIZE - offset);
+		memcpy(ring->data + offset, buf, first);
+		memcpy(ring->data, buf + first, count - first);
+		pos += count;
+		len -= count;
+		skip = 0;
+	}
+}
+
+static void socket_unix_copy_out(struct unix_ring *ring, uint32_t pos, const struct iovec *iov, int iovcnt, size_t len)
+{
+	for (int i = 0; i < iovcnt && len > 0; i++)
+	{
+		size_t count = min(iov[i].iov_len, len);
+		char *buf = (char *)iov[i].iov_base;
+		size_t offset = pos % UNIX_RING_SIZE;
+		size_t first = min(count, UNIX_RING_SIZE - offset);
+		memcpy(buf, ring->data + offset, first);
+		memcpy(buf + first, ring->data, count - first);
+		pos += count;
+		len -= count;
+	}
+}
+
+/* The wakeup event is reset by socket_update_events_unsafe() before the ring is checked,
+ * so a wakeup from the peer between the check and the wait is never lost
+ */
+static int socket_unix_write(struct socket_file *f, const struct iovec *iov, int iovcnt, int flags)
+{
+	struct unix_ring *ring = &f->unix_conn->ring[f->unix_side];
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (total == 0)
+		return 0;
+	size_t written = 0;
+	for (;;)
+	{
+		int e = socket_update_events_unsafe(f, 0);
+		if (ring->shutdown || (e & FD_CLOSE))
+			return written? written: -L_EPIPE;
+		uint32_t tail = ring->tail;
+		size_t space = UNIX_RING_SIZE - (tail - ring->head);
+		if (space > 0)
+		{
+			size_t count = min(space, total - written);
+			socket_unix_copy_in(ring, tail, iov, iovcnt, written, count);
+			ring->tail = tail + count;
+			SetEvent(f->unix_peer_event);
+			written += count;
+			if (written == total || (f->base_file.flags & O_NONBLOCK) || (flags & LINUX_MSG_DONTWAIT))
+				return written;
+			continue;
+		}
+		if ((f->base_file.flags & O_NONBLOCK) || (flags & LINUX_MSG_DONTWAIT))
+			return written? written: -L_EWOULDBLOCK;
+		if (signal_wait(1, &f->event_handle, INFINITE) == WAIT_INTERRUPTED)
+			return written? written: -L_EINTR;
+	}
+}
+
+static int socket_unix_read(struct socket_file *f, const struct iovec *iov, int iovcnt, int flags)
+{
+	struct unix_ring *ring = &f->unix_conn->ring[!f->unix_side];
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (total == 0)
+		return 0;
+	for (;;)
+	{
+		int e = socket_update_events_unsafe(f, 0);
+		uint32_t head = ring->head;
+		size_t available = ring->tail - head;
+		if (available > 0)
+		{
+			size_t count = min(available, total);
+			socket_unix_copy_out(ring, head, iov, iovcnt, count);
+			if (!(flags & LINUX_MSG_PEEK))
+			{
+				ring->head = head + count;
+				SetEvent(f->unix_peer_event);
+			}
+			return count;
+		}
+		if (ring->shutdown || (e & FD_CLOSE))
+			return 0;
+		if ((f->base_file.flags & O_NONBLOCK) || (flags & LINUX_MSG_DONTWAIT))
+			return -L_EWOULDBLOCK;
+		if (signal_wait(1, &f->event_handle, INFINITE) == WAIT_INTERRUPTED)
+			return -L_EINTR;
+	}
+}
+
 static int socket_sendto_unsafe(struct socket_file *f, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, int addrlen)
 {
+	if (f->unix_conn)
+	{
+		struct iovec iov;
+		iov.iov_base = (void *)buf;
+		iov.iov_len = len;
+		return socket_unix_write(f, &iov, 1, flags);
+	}
 	if (flags & ~LINUX_MSG_DONTWAIT)
 		log_error("flags (0x%x) contains unsupported bits.", flags);
 	struct sockaddr_storage addr_storage;
@@ -313,8 +806,16 @@ static int socket_sendto_unsafe(struct socket_file *f, const void *buf, size_t l
 	return r;
 }
 
-static int socket_sendmsg_unsafe(struct socket_file *f, const struct msghdr *msg, int flags)
+/* If try_first is true, the message is sent without waiting for FD_WRITE first,
+ * used by sendmmsg() to save a WSAEnumNetworkEvents() call for each further message
+ */
+static int socket_sendmsg_unsafe(struct socket_file *f, const struct msghdr *msg, int flags, bool try_first)
 {
+	/* The buffers are on the stack */
+	if (msg->msg_iovlen > IOV_MAX)
+		return -L_EMSGSIZE;
+	if (f->unix_conn)
+		return socket_unix_write(f, msg->msg_iov, msg->msg_iovlen, flags);
 	if (flags & ~LINUX_MSG_DONTWAIT)
 		log_error("socket_sendmsg(): flags (0x%x) contains unsupported bits.", flags);
 	WSABUF *buffers = (WSABUF *)alloca(sizeof(struct iovec) * msg->msg_iovlen);
@@ -342,8 +843,8 @@ static int socket_sendmsg_unsafe(struct socket_file *f, const struct msghdr *msg
 	wsamsg.Control.len = msg->msg_controllen;
 	wsamsg.dwFlags = 0;
 	
-	int r;
-	while ((r = socket_wait_event(f, FD_WRITE, flags)) == 0)
+	int r = try_first? 0: socket_wait_event(f, FD_WRITE, flags);
+	while (r == 0)
 	{
 		if (WSASendMsg(f->socket, &wsamsg, 0, &r, NULL, NULL) != SOCKET_ERROR)
 			break;
@@ -354,6 +855,7 @@ static int socket_sendmsg_unsafe(struct socket_file *f, const struct msghdr *msg
 			return translate_socket_error(err);
 		}
 		InterlockedAnd(&f->shared->events, ~FD_WRITE);
+		r = socket_wait_event(f, FD_WRITE, flags);
 	}
 	return r;
 }
@@ -362,9 +864,24 @@ static int socket_recvfrom_unsafe(struct socket_file *f, void *buf, size_t len,
 {
 	if (flags & ~(LINUX_MSG_PEEK | LINUX_MSG_DONTWAIT))
 		log_error("flags (0x%x) contains unsupported bits.", flags);
+	int r;
+	if (f->unix_conn)
+	{
+		struct iovec iov;
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		r = socket_unix_read(f, &iov, 1, flags);
+	}
+	else
+		r = socket_rx_recv(f, buf, len, flags);
+	if (r != -L_ENOSYS)
+	{
+		if (addrlen)
+			*addrlen = 0;
+		return r;
+	}
 	struct sockaddr_storage addr_storage;
 	int addr_storage_len = sizeof(struct sockaddr_storage);
-	int r;
 	while ((r = socket_wait_event(f, FD_READ | FD_CLOSE, flags)) == 0)
 	{
 		if (!(flags & LINUX_MSG_PEEK))
@@ -389,8 +906,12 @@ static int socket_recvfrom_unsafe(struct socket_file *f, void *buf, size_t len,
 	return r;
 }
 
-static int socket_recvmsg_unsafe(struct socket_file *f, struct msghdr *msg, int flags)
+/* try_first: same as socket_sendmsg_unsafe() */
+static int socket_recvmsg_unsafe(struct socket_file *f, struct msghdr *msg, int flags, bool try_first)
 {
+	/* The buffers are on the stack */
+	if (msg->msg_iovlen > IOV_MAX)
+		return -L_EMSGSIZE;
 	if (flags & ~LINUX_MSG_DONTWAIT)
 		log_error("socket_sendmsg(): flags (0x%x) contains unsupported bits.", flags);
 
@@ -444,8 +965,8 @@ static int socket_recvmsg_unsafe(struct socket_file *f, struct msghdr *msg, int
 	wsamsg.Control.len = msg->msg_controllen;
 	wsamsg.dwFlags = 0;
 
-	int r;
-	while ((r = socket_wait_event(f, FD_READ | FD_CLOSE, flags)) == 0)
+	int r = try_first? 0: socket_wait_event(f, FD_READ | FD_CLOSE, flags);
+	while (r == 0)
 	{
 		if (WSARecvMsg(f->socket, &wsamsg, &r, NULL, NULL) != SOCKET_ERROR)
 			break;
@@ -456,7 +977,10 @@ static int socket_recvmsg_unsafe(struct socket_file *f, struct msghdr *msg, int
 			log_warning("WSARecvMsg() failed, error code: %d", err);
 			return translate_socket_error(err);
 		}
+		r = socket_wait_event(f, FD_READ | FD_CLOSE, flags);
 	}
+	if (r < 0)
+		return r;
 	/* Translate WSAMSG back to msghdr */
 	addr_storage_len = translate_socket_addr_to_linux(&addr_storage, wsamsg.namelen);
 	int copylen = min(msg->msg_namelen, addr_storage_len);
@@ -475,8 +999,14 @@ static int socket_recvmsg_unsafe(struct socket_file *f, struct msghdr *msg, int
 static int socket_close(struct file *f)
 {
 	struct socket_file *socket_file = (struct socket_file *) f;
+	socket_poll_disarm(socket_file);
+	socket_rx_cancel(socket_file);
+	socket_accept_pool_destroy(socket_file);
 	closesocket(socket_file->socket);
+	socket_unix_detach(socket_file);
 	CloseHandle(socket_file->event_handle);
+	if (socket_file->rx_buffer)
+		kfree(socket_file->rx_buffer, SOCKET_RX_BUFFER_SIZE);
 	kfree(socket_file, sizeof(struct socket_file));
 	return 0;
 }
@@ -499,6 +1029,109 @@ static size_t socket_write(struct file *f, const char *buf, size_t count)
 	return r;
 }
 
+/* readv() and writev() hand the whole vector to WSARecv() and WSASend() */
+static size_t socket_readv(struct file *f, const struct iovec *iov, int iovcnt)
+{
+	struct socket_file *socket_file = (struct socket_file *) f;
+	if (iovcnt > IOV_MAX)
+		return -L_EINVAL;
+	WSABUF *buffers = (WSABUF *)alloca(sizeof(WSABUF) * iovcnt);
+	for (int i = 0; i < iovcnt; i++)
+	{
+		buffers[i].len = iov[i].iov_len;
+		buffers[i].buf = iov[i].iov_base;
+	}
+	WaitForSingleObject(socket_file->mutex, INFINITE);
+	int r;
+	if (socket_file->unix_conn)
+	{
+		r = socket_unix_read(socket_file, iov, iovcnt, 0);
+		ReleaseMutex(socket_file->mutex);
+		return r;
+	}
+	/* A zero length segment would read as end of file, wait on the first non empty one */
+	int first = 0;
+	while (first < iovcnt && iov[first].iov_len == 0)
+		first++;
+	if (first == iovcnt)
+	{
+		ReleaseMutex(socket_file->mutex);
+		return 0;
+	}
+	r = socket_rx_recv(socket_file, iov[first].iov_base, iov[first].iov_len, 0);
+	if (r != -L_ENOSYS)
+	{
+		/* Fill the remaining segments with what is already buffered */
+		for (int i = first + 1; i < iovcnt && r > 0; i++)
+		{
+			if (socket_file->rx_start == socket_file->rx_end)
+				break;
+			r += socket_rx_recv(socket_file, iov[i].iov_base, iov[i].iov_len, LINUX_MSG_DONTWAIT);
+		}
+		ReleaseMutex(socket_file->mutex);
+		return r;
+	}
+	while ((r = socket_wait_event(socket_file, FD_READ | FD_CLOSE, 0)) == 0)
+	{
+		InterlockedAnd(&socket_file->shared->events, ~FD_READ);
+		DWORD num_read, flags = 0;
+		if (WSARecv(socket_file->socket, buffers, iovcnt, &num_read, &flags, NULL, NULL) != SOCKET_ERROR)
+		{
+			r = num_read;
+			break;
+		}
+		int err = WSAGetLastError();
+		if (err != WSAEWOULDBLOCK)
+		{
+			log_warning("WSARecv() failed, error code: %d", err);
+			r = translate_socket_error(err);
+			break;
+		}
+	}
+	ReleaseMutex(socket_file->mutex);
+	return r;
+}
+
+static size_t socket_writev(struct file *f, const struct iovec *iov, int iovcnt)
+{
+	struct socket_file *socket_file = (struct socket_file *) f;
+	if (iovcnt > IOV_MAX)
+		return -L_EINVAL;
+	WSABUF *buffers = (WSABUF *)alloca(sizeof(WSABUF) * iovcnt);
+	for (int i = 0; i < iovcnt; i++)
+	{
+		buffers[i].len = iov[i].iov_len;
+		buffers[i].buf = iov[i].iov_base;
+	}
+	WaitForSingleObject(socket_file->mutex, INFINITE);
+	int r;
+	if (socket_file->unix_conn)
+	{
+		r = socket_unix_write(socket_file, iov, iovcnt, 0);
+		ReleaseMutex(socket_file->mutex);
+		return r;
+	}
+	while ((r = socket_wait_event(socket_file, FD_WRITE, 0)) == 0)
+	{
+		DWORD num_written;
+		if (WSASend(socket_file->socket, buffers, iovcnt, &num_written, 0, NULL, NULL) != SOCKET_ERROR)
+		{
+			r = num_written;
+			break;
+		}
+		int err = WSAGetLastError();
+		if (err != WSAEWOULDBLOCK)
+		{
+			log_warning("WSASend() failed, error code: %d", err);
+			r = translate_socket_error(err);
+			break;
+		}
+		InterlockedAnd(&socket_file->shared->events, ~FD_WRITE);
+	}
+	ReleaseMutex(socket_file->mutex);
+	return r;
+}
+
 static int socket_stat(struct file *f, struct newstat *buf)
 {
 	INIT_STRUCT_NEWSTAT_PADDING(buf);
@@ -626,11 +1259,17 @@ static int socket_open(int domain, int type, int protocol)
 	f->socket = sock;
 	f->event_handle = event_handle;
 	f->mutex = mutex;
+	f->inherit = socket_make_inheritable(sock);
 	f->shared = (struct socket_file_shared *)kmalloc_shared(sizeof(struct socket_file_shared));
 	f->shared->af = domain;
 	f->shared->type = (type & LINUX_SOCK_TYPE_MASK);
 	f->shared->events = 0;
 	f->shared->connect_error = 0;
+	f->shared->rx_disabled = 0;
+	socket_rx_init(f);
+	socket_poll_init(f);
+	f->unix_conn = NULL;
+	f->accept_pool = NULL;
 	if ((type & O_NONBLOCK))
 		f->base_file.flags |= O_NONBLOCK;
 
@@ -784,6 +1423,25 @@ static int socket_connect(struct file *f, const struct sockaddr *addr, size_t ad
 		return -L_EINVAL;
 
 	WaitForSingleObject(socket->mutex, INFINITE);
+	if (socket->shared->af == LINUX_AF_UNIX && socket->shared->type == LINUX_SOCK_STREAM && !socket->unix_conn)
+	{
+		/* The connection objects are named after both ports, bind first to know ours */
+		struct sockaddr_in client_addr;
+		int client_addr_len = sizeof(client_addr);
+		if (getsockname(socket->socket, (struct sockaddr *)&client_addr, &client_addr_len) == SOCKET_ERROR)
+		{
+			memset(&client_addr, 0, sizeof(client_addr));
+			client_addr.sin_family = AF_INET;
+			client_addr.sin_addr.S_un.S_addr = htonl(INADDR_LOOPBACK);
+			client_addr.sin_port = 0;
+			client_addr_len = sizeof(client_addr);
+			if (bind(socket->socket, (struct sockaddr *)&client_addr, sizeof(client_addr)) == SOCKET_ERROR
+				|| getsockname(socket->socket, (struct sockaddr *)&client_addr, &client_addr_len) == SOCKET_ERROR)
+				log_warning("Binding unix socket failed, error code: %d", WSAGetLastError());
+		}
+		if (client_addr.sin_port)
+			socket_unix_attach(socket, ntohs(((struct sockaddr_in *)&addr_storage)->sin_port), ntohs(client_addr.sin_port), 0);
+	}
 	int r = 0;
 	if (connect(socket->socket, (struct sockaddr *)&addr_storage, addr_storage_len) == SOCKET_ERROR)
 	{
@@ -792,6 +1450,7 @@ static int socket_connect(struct file *f, const struct sockaddr *addr, size_t ad
 		{
 			log_warning("connect() failed, error code: %d", err);
 			r = translate_socket_error(err);
+			socket_unix_detach(socket);
 		}
 		else if ((f->flags & O_NONBLOCK) > 0)
 		{
@@ -819,10 +1478,236 @@ static int socket_listen(struct file *f, int backlog)
 		log_warning("listen() failed, error code: %d", err);
 		r = translate_socket_error(err);
 	}
+	else if (socket->shared->type == LINUX_SOCK_STREAM && !socket->accept_pool)
+		socket_accept_pool_create(socket);
 	ReleaseMutex(socket->mutex);
 	return r;
 }
 
+/* Set up the socket file of an accepted connection and store it in the fd table */
+static int socket_accept_connection(struct socket_file *socket, SOCKET socket_handle, HANDLE event_handle,
+	const struct sockaddr_storage *addr_storage, int addr_storage_len, struct sockaddr *addr, int *addrlen, int flags)
+{
+	HANDLE mutex;
+	SECURITY_ATTRIBUTES attr;
+	attr.nLength = sizeof(SECURITY_ATTRIBUTES);
+	attr.lpSecurityDescriptor = NULL;
+	attr.bInheritHandle = TRUE;
+	mutex = CreateMutexW(&attr, FALSE, NULL);
+	struct socket_file *conn_socket = (struct socket_file *)kmalloc(sizeof(struct socket_file));
+	file_init(&conn_socket->base_file, &socket_ops, 0);
+	conn_socket->socket = socket_handle;
+	conn_socket->event_handle = event_handle;
+	conn_socket->mutex = mutex;
+	conn_socket->inherit = socket_make_inheritable(socket_handle);
+	conn_socket->shared = (struct socket_file_shared *)kmalloc_shared(sizeof(struct socket_file_shared));
+	conn_socket->shared->af = socket->shared->af;
+	conn_socket->shared->type = socket->shared->type;
+	conn_socket->shared->events = 0;
+	conn_socket->shared->connect_error = 0;
+	conn_socket->shared->rx_disabled = 0;
+	socket_rx_init(conn_socket);
+	socket_poll_init(conn_socket);
+	conn_socket->unix_conn = NULL;
+	conn_socket->accept_pool = NULL;
+	if (socket->shared->af == LINUX_AF_UNIX && socket->shared->type == LINUX_SOCK_STREAM)
+	{
+		struct sockaddr_in server_addr;
+		int server_addr_len = sizeof(server_addr);
+		if (getsockname(socket->socket, (struct sockaddr *)&server_addr, &server_addr_len) == SOCKET_ERROR)
+			log_warning("getsockname() failed, error code: %d", WSAGetLastError());
+		else if (!socket_unix_attach(conn_socket, ntohs(server_addr.sin_port), ntohs(((struct sockaddr_in *)addr_storage)->sin_port), 1))
+			log_warning("Unix connection objects not found, falling back to TCP.");
+	}
+	if (flags & O_NONBLOCK)
+		conn_socket->base_file.flags |= O_NONBLOCK;
+	int r = vfs_store_file((struct file *)conn_socket, 0);
+	if (r < 0)
+		vfs_release((struct file *)conn_socket);
+	/* Translate address back to Linux format */
+	if (addr && addrlen)
+	{
+		if (socket->shared->af == LINUX_AF_UNIX)
+		{
+			/* Set addr to unnamed */
+			struct sockaddr_un *addr_un = (struct sockaddr_un *)addr;
+			*addrlen = sizeof(addr_un->sun_family);
+		}
+		else
+		{
+			struct sockaddr_storage linux_addr = *addr_storage;
+			*addrlen = translate_socket_addr_to_linux(&linux_addr, addr_storage_len);
+			memcpy(addr, &linux_addr, *addrlen);
+		}
+	}
+	return r;
+}
+
+/* Pre-posted AcceptEx() pool of a listening stream socket
+ * Each slot holds a preallocated socket and event with an AcceptEx() posted on it, so under a
+ * connection storm accept() takes an already accepted connection instead of creating the socket
+ * and its event on the spot. The slots signal the event of the listening socket on completion,
+ * socket_update_events_unsafe() reports them as FD_ACCEPT. When all slots are taken, accept()
+ * falls back to accept() on the backlog. The pool belongs to the process which called listen(),
+ * fork children only use the backlog.
+ */
+#define SOCKET_ACCEPT_POOL_SIZE	8
+#define SOCKET_ACCEPT_ADDR_SIZE	(sizeof(struct sockaddr_storage) + 16)
+
+struct socket_accept_slot
+{
+	SOCKET socket; /* INVALID_SOCKET if no AcceptEx() is posted */
+	HANDLE event_handle;
+	WSAOVERLAPPED overlapped;
+	char addr_buffer[2 * SOCKET_ACCEPT_ADDR_SIZE];
+};
+
+struct socket_accept_pool
+{
+	WSAPROTOCOL_INFOW protocol_info;
+	LPFN_ACCEPTEX AcceptEx;
+	LPFN_GETACCEPTEXSOCKADDRS GetAcceptExSockaddrs;
+	int next; /* Slot to check first, connections are taken in posting order */
+	struct socket_accept_slot slots[SOCKET_ACCEPT_POOL_SIZE];
+};
+
+static void socket_accept_post(struct socket_file *f, struct socket_accept_slot *slot)
+{
+	struct socket_accept_pool *pool = f->accept_pool;
+	slot->socket = WSASocketW(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &pool->protocol_info, 0,
+		WSA_FLAG_OVERLAPPED | WSA_FLAG_NO_HANDLE_INHERIT);
+	if (slot->socket == INVALID_SOCKET)
+	{
+		log_warning("WSASocketW() failed, error code: %d", WSAGetLastError());
+		return;
+	}
+	if (!slot->event_handle && !(slot->event_handle = CreateEventW(NULL, TRUE, FALSE, NULL)))
+	{
+		closesocket(slot->socket);
+		slot->socket = INVALID_SOCKET;
+		return;
+	}
+	memset(&slot->overlapped, 0, sizeof(WSAOVERLAPPED));
+	slot->overlapped.hEvent = f->event_handle;
+	DWORD bytes;
+	if (!pool->AcceptEx(f->socket, slot->socket, slot->addr_buffer, 0, SOCKET_ACCEPT_ADDR_SIZE, SOCKET_ACCEPT_ADDR_SIZE,
+		&bytes, &slot->overlapped) && WSAGetLastError() != ERROR_IO_PENDING)
+	{
+		log_warning("AcceptEx() failed, error code: %d", WSAGetLastError());
+		closesocket(slot->socket);
+		slot->socket = INVALID_SOCKET;
+	}
+}
+
+static void socket_accept_pool_create(struct socket_file *f)
+{
+	struct socket_accept_pool *pool = (struct socket_accept_pool *)kmalloc(sizeof(struct socket_accept_pool));
+	if (!pool)
+		return;
+	int len = sizeof(pool->protocol_info);
+	GUID accept_guid = WSAID_ACCEPTEX, sockaddrs_guid = WSAID_GETACCEPTEXSOCKADDRS;
+	DWORD bytes;
+	if (getsockopt(f->socket, SOL_SOCKET, SO_PROTOCOL_INFOW, (char *)&pool->protocol_info, &len) == SOCKET_ERROR
+		|| WSAIoctl(f->socket, SIO_GET_EXTENSION_FUNCTION_POINTER, &accept_guid, sizeof(accept_guid),
+			&pool->AcceptEx, sizeof(pool->AcceptEx), &bytes, NULL, NULL) == SOCKET_ERROR
+		|| WSAIoctl(f->socket, SIO_GET_EXTENSION_FUNCTION_POINTER, &sockaddrs_guid, sizeof(sockaddrs_guid),
+			&pool->GetAcceptExSockaddrs, sizeof(pool->GetAcceptExSockaddrs), &bytes, NULL, NULL) == SOCKET_ERROR)
+	{
+		log_warning("Querying AcceptEx() failed, error code: %d", WSAGetLastError());
+		kfree(pool, sizeof(struct socket_accept_pool));
+		return;
+	}
+	pool->next = 0;
+	f->accept_pool = pool;
+	for (int i = 0; i < SOCKET_ACCEPT_POOL_SIZE; i++)
+	{
+		pool->slots[i].event_handle = NULL;
+		socket_accept_post(f, &pool->slots[i]);
+	}
+}
+
+static void socket_accept_pool_destroy(struct socket_file *f)
+{
+	struct socket_accept_pool *pool = f->accept_pool;
+	if (!pool)
+		return;
+	for (int i = 0; i < SOCKET_ACCEPT_POOL_SIZE; i++)
+	{
+		struct socket_accept_slot *slot = &pool->slots[i];
+		if (slot->socket != INVALID_SOCKET)
+		{
+			DWORD bytes, flags;
+			CancelIoEx((HANDLE)f->socket, &slot->overlapped);
+			WSAGetOverlappedResult(f->socket, &slot->overlapped, &bytes, TRUE, &flags);
+			closesocket(slot->socket);
+		}
+		if (slot->event_handle)
+			CloseHandle(slot->event_handle);
+	}
+	kfree(pool, sizeof(struct socket_accept_pool));
+	f->accept_pool = NULL;
+}
+
+static bool socket_accept_pool_ready(struct socket_file *f)
+{
+	struct socket_accept_pool *pool = f->accept_pool;
+	for (int i = 0; i < SOCKET_ACCEPT_POOL_SIZE; i++)
+		if (pool->slots[i].socket != INVALID_SOCKET && HasOverlappedIoCompleted(&pool->slots[i].overlapped))
+			return true;
+	return false;
+}
+
+/* Take a completed connection from the pool, returns -L_EWOULDBLOCK if there is none */
+static int socket_accept_pool_take(struct socket_file *f, struct sockaddr *addr, int *addrlen, int flags)
+{
+	struct socket_accept_pool *pool = f->accept_pool;
+	for (int n = 0; n < SOCKET_ACCEPT_POOL_SIZE; n++)
+	{
+		int i = (pool->next + n) % SOCKET_ACCEPT_POOL_SIZE;
+		struct socket_accept_slot *slot = &pool->slots[i];
+		if (slot->socket == INVALID_SOCKET)
+		{
+			socket_accept_post(f, slot);
+			continue;
+		}
+		if (!HasOverlappedIoCompleted(&slot->overlapped))
+			continue;
+		pool->next = (i + 1) % SOCKET_ACCEPT_POOL_SIZE;
+		SOCKET socket_handle = slot->socket;
+		slot->socket = INVALID_SOCKET;
+		DWORD bytes, wsa_flags;
+		if (!WSAGetOverlappedResult(f->socket, &slot->overlapped, &bytes, FALSE, &wsa_flags))
+		{
+			/* The peer went away before we took the connection */
+			log_info("AcceptEx() failed, error code: %d", WSAGetLastError());
+			closesocket(socket_handle);
+			socket_accept_post(f, slot);
+			continue;
+		}
+		setsockopt(socket_handle, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, (char *)&f->socket, sizeof(f->socket));
+		struct sockaddr *local_addr, *remote_addr;
+		int local_addr_len, remote_addr_len;
+		pool->GetAcceptExSockaddrs(slot->addr_buffer, 0, SOCKET_ACCEPT_ADDR_SIZE, SOCKET_ACCEPT_ADDR_SIZE,
+			&local_addr, &local_addr_len, &remote_addr, &remote_addr_len);
+		struct sockaddr_storage addr_storage;
+		memcpy(&addr_storage, remote_addr, remote_addr_len);
+		HANDLE event_handle = slot->event_handle;
+		slot->event_handle = NULL;
+		if (!SetHandleInformation(event_handle, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT)
+			|| WSAEventSelect(socket_handle, event_handle, FD_READ | FD_WRITE | FD_ACCEPT | FD_CONNECT | FD_CLOSE) == SOCKET_ERROR)
+		{
+			log_error("Setting up accepted socket failed, error code: %d", WSAGetLastError());
+			closesocket(socket_handle);
+			CloseHandle(event_handle);
+			socket_accept_post(f, slot);
+			return -L_ENFILE;
+		}
+		socket_accept_post(f, slot);
+		return socket_accept_connection(f, socket_handle, event_handle, &addr_storage, remote_addr_len, addr, addrlen, flags);
+	}
+	return -L_EWOULDBLOCK;
+}
+
 static int socket_accept4(struct file *f, struct sockaddr *addr, int *addrlen, int flags)
 {
 	struct socket_file *socket = (struct socket_file *)f;
@@ -832,6 +1717,8 @@ static int socket_accept4(struct file *f, struct sockaddr *addr, int *addrlen, i
 	int r;
 	while ((r = socket_wait_event(socket, FD_ACCEPT, 0)) == 0)
 	{
+		if (socket->accept_pool && (r = socket_accept_pool_take(socket, addr, addrlen, flags)) != -L_EWOULDBLOCK)
+			break;
 		SOCKET socket_handle;
 		addr_storage_len = sizeof(struct sockaddr_storage);
 		if ((socket_handle = accept(socket->socket, (struct sockaddr *)&addr_storage, &addr_storage_len)) != SOCKET_ERROR)
@@ -845,42 +1732,7 @@ static int socket_accept4(struct file *f, struct sockaddr *addr, int *addrlen, i
 				r = -L_ENFILE;
 				break;
 			}
-			HANDLE mutex;
-			SECURITY_ATTRIBUTES attr;
-			attr.nLength = sizeof(SECURITY_ATTRIBUTES);
-			attr.lpSecurityDescriptor = NULL;
-			attr.bInheritHandle = TRUE;
-			mutex = CreateMutexW(&attr, FALSE, NULL);
-			struct socket_file *conn_socket = (struct socket_file *)kmalloc(sizeof(struct socket_file));
-			file_init(&conn_socket->base_file, &socket_ops, 0);
-			conn_socket->socket = socket_handle;
-			conn_socket->event_handle = event_handle;
-			conn_socket->mutex = mutex;
-			conn_socket->shared = (struct socket_file_shared *)kmalloc_shared(sizeof(struct socket_file_shared));
-			conn_socket->shared->af = socket->shared->af;
-			conn_socket->shared->type = socket->shared->type;
-			conn_socket->shared->events = 0;
-			conn_socket->shared->connect_error = 0;
-			if (flags & O_NONBLOCK)
-				conn_socket->base_file.flags |= O_NONBLOCK;
-			r = vfs_store_file((struct file *)conn_socket, 0);
-			if (r < 0)
-				vfs_release((struct file *)conn_socket);
-			/* Translate address back to Linux format */
-			if (addr && addrlen)
-			{
-				if (socket->shared->af == LINUX_AF_UNIX)
-				{
-					/* Set addr to unnamed */
-					struct sockaddr_un *addr_un = (struct sockaddr_un *)addr;
-					*addrlen = sizeof(addr_un->sun_family);
-				}
-				else
-				{
-					*addrlen = translate_socket_addr_to_linux(&addr_storage, addr_storage_len);
-					memcpy(addr, &addr_storage, *addrlen);
-				}
-			}
+			r = socket_accept_connection(socket, socket_handle, event_handle, &addr_storage, addr_storage_len, addr, addrlen, flags);
 			break;
 		}
 		int err = WSAGetLastError();
@@ -1004,7 +1856,16 @@ static int socket_shutdown(struct file *f, int how)
 		return -L_EINVAL;
 	int r = 0;
 	WaitForSingleObject(socket->mutex, INFINITE);
-	if (shutdown(socket->socket, win32_how) == SOCKET_ERROR)
+	if (socket->unix_conn)
+	{
+		/* Keep the TCP connection intact, it tells the peer when we are gone */
+		if (how != SHUT_RD)
+		{
+			socket->unix_conn->ring[socket->unix_side].shutdown = 1;
+			SetEvent(socket->unix_peer_event);
+		}
+	}
+	else if (shutdown(socket->socket, win32_how) == SOCKET_ERROR)
 	{
 		log_warning("shutdown() failed, error code: %d", WSAGetLastError());
 		r = translate_socket_error(WSAGetLastError());
@@ -1013,6 +1874,42 @@ static int socket_shutdown(struct file *f, int how)
 	return r;
 }
 
+/* Translate SIO_TCP_INFO result to Linux tcp_info, Windows counts in bytes where Linux counts in segments */
+static void translate_tcp_info_to_linux(const TCP_INFO_v0 *win32_info, struct tcp_info *info)
+{
+	static const uint8_t state_table[] = {
+		[TCPSTATE_CLOSED] = LINUX_TCP_CLOSE,
+		[TCPSTATE_LISTEN] = LINUX_TCP_LISTEN,
+		[TCPSTATE_SYN_SENT] = LINUX_TCP_SYN_SENT,
+		[TCPSTATE_SYN_RCVD] = LINUX_TCP_SYN_RECV,
+		[TCPSTATE_ESTABLISHED] = LINUX_TCP_ESTABLISHED,
+		[TCPSTATE_FIN_WAIT_1] = LINUX_TCP_FIN_WAIT1,
+		[TCPSTATE_FIN_WAIT_2] = LINUX_TCP_FIN_WAIT2,
+		[TCPSTATE_CLOSE_WAIT] = LINUX_TCP_CLOSE_WAIT,
+		[TCPSTATE_CLOSING] = LINUX_TCP_CLOSING,
+		[TCPSTATE_LAST_ACK] = LINUX_TCP_LAST_ACK,
+		[TCPSTATE_TIME_WAIT] = LINUX_TCP_TIME_WAIT,
+	};
+	uint32_t mss = win32_info->Mss ? win32_info->Mss : 1;
+	memset(info, 0, sizeof(struct tcp_info));
+	info->tcpi_state = win32_info->State < TCPSTATE_MAX ? state_table[win32_info->State] : LINUX_TCP_CLOSE;
+	info->tcpi_retransmits = win32_info->SynRetrans;
+	if (win32_info->TimestampsEnabled)
+		info->tcpi_options |= LINUX_TCPI_OPT_TIMESTAMPS;
+	info->tcpi_snd_mss = win32_info->Mss;
+	info->tcpi_rcv_mss = win32_info->Mss;
+	info->tcpi_advmss = win32_info->Mss;
+	info->tcpi_unacked = (uint32_t)((win32_info->BytesInFlight + mss - 1) / mss);
+	info->tcpi_retrans = win32_info->FastRetrans;
+	info->tcpi_rtt = win32_info->RttUs;
+	info->tcpi_snd_cwnd = win32_info->Cwnd / mss;
+	info->tcpi_snd_ssthresh = 0x7FFFFFFF; /* Not reported, Linux uses this for "infinite" */
+	info->tcpi_rcv_ssthresh = win32_info->RcvWnd;
+	info->tcpi_rcv_space = win32_info->RcvBuf;
+	info->tcpi_reordering = (uint32_t)(win32_info->BytesReordered / mss);
+	info->tcpi_total_retrans = (uint32_t)(win32_info->BytesRetrans / mss);
+}
+
 static int socket_get_set_sockopt(int call, struct socket_file *f, int level, int optname, const void *set_optval, int set_optlen, void *get_optval, int *get_optlen)
 {
 	int in_level = level, in_optname = optname;
@@ -1023,8 +1920,11 @@ static int socket_get_set_sockopt(int call, struct socket_file *f, int level, in
 		level = IPPROTO_IP;
 		switch (optname)
 		{
+		case LINUX_IP_TOS: optname = IP_TOS; goto get_set_sockopt;
+		case LINUX_IP_TTL: optname = IP_TTL; goto get_set_sockopt;
 		case LINUX_IP_HDRINCL: optname = IP_HDRINCL; goto get_set_sockopt;
 		}
+		break;
 	}
 	case LINUX_SOL_SOCKET:
 	{
@@ -1034,10 +1934,31 @@ static int socket_get_set_sockopt(int call, struct socket_file *f, int level, in
 		case LINUX_SO_REUSEADDR: optname = SO_REUSEADDR;
 			log_warning("SO_REUSEADDR: Current semantic is not exactly correct.");
 			goto get_set_sockopt;
+		case LINUX_SO_REUSEPORT:
+		{
+			/* Multiple datagram receivers on one port is what SO_REUSEADDR does on Windows.
+			 * For stream sockets SO_REUSEADDR would let the port be stolen from a listener in
+			 * another process instead of load balancing between them, so it is not applied. */
+			if (f->shared->type != LINUX_SOCK_STREAM)
+			{
+				optname = SO_REUSEADDR;
+				goto get_set_sockopt;
+			}
+			if (call == SYS_GETSOCKOPT)
+			{
+				if (*get_optlen < (int)sizeof(int))
+					return -L_EINVAL;
+				*(int *)get_optval = 0;
+				*get_optlen = sizeof(int);
+			}
+			return 0;
+		}
 		case LINUX_SO_ERROR: optname = SO_ERROR; goto get_set_sockopt;
 		case LINUX_SO_BROADCAST: optname = SO_BROADCAST; goto get_set_sockopt;
-		case LINUX_SO_SNDBUF: optname = SO_SNDBUF; goto get_set_sockopt;
-		case LINUX_SO_RCVBUF: optname = SO_RCVBUF; goto get_set_sockopt;
+		case LINUX_SO_SNDBUF:
+		case LINUX_SO_SNDBUFFORCE: optname = SO_SNDBUF; goto get_set_sockopt;
+		case LINUX_SO_RCVBUF:
+		case LINUX_SO_RCVBUFFORCE: optname = SO_RCVBUF; goto get_set_sockopt;
 		case LINUX_SO_KEEPALIVE: optname = SO_KEEPALIVE; goto get_set_sockopt;
 		case LINUX_SO_LINGER: {
 			/* TODO: Handle integer overflow, buffer overflow etc */
@@ -1055,7 +1976,7 @@ static int socket_get_set_sockopt(int call, struct socket_file *f, int level, in
 			}
 			else
 			{
-				int optlen;
+				int optlen = sizeof(win32_linger);
 				if (getsockopt(f->socket, SOL_SOCKET, SO_LINGER, (char *)&win32_linger, &optlen) == SOCKET_ERROR)
 				{
 					log_warning("getsockopt() failed, error code: %d", WSAGetLastError());
@@ -1069,6 +1990,7 @@ static int socket_get_set_sockopt(int call, struct socket_file *f, int level, in
 			return 0;
 		}
 		}
+		break;
 	}
 	case LINUX_SOL_TCP:
 	{
@@ -1076,7 +1998,51 @@ static int socket_get_set_sockopt(int call, struct socket_file *f, int level, in
 		switch (optname)
 		{
 		case LINUX_TCP_NODELAY: optname = TCP_NODELAY; goto get_set_sockopt;
+		case LINUX_TCP_MAXSEG: optname = TCP_MAXSEG; goto get_set_sockopt;
+		case LINUX_TCP_KEEPIDLE: optname = TCP_KEEPALIVE; goto get_set_sockopt;
+		case LINUX_TCP_KEEPINTVL: optname = TCP_KEEPINTVL; goto get_set_sockopt;
+		case LINUX_TCP_KEEPCNT: optname = TCP_KEEPCNT; goto get_set_sockopt;
+		case LINUX_TCP_FASTOPEN:
+		{
+			/* Linux takes the length of the pending fast open queue, Windows a boolean */
+			optname = TCP_FASTOPEN;
+			if (call == SYS_SETSOCKOPT)
+			{
+				if (set_optlen < (int)sizeof(int))
+					return -L_EINVAL;
+				DWORD enable = *(const int *)set_optval != 0;
+				if (setsockopt(f->socket, level, optname, (const char *)&enable, sizeof(enable)) == SOCKET_ERROR)
+				{
+					log_warning("setsockopt() failed, error code: %d", WSAGetLastError());
+					return translate_socket_error(WSAGetLastError());
+				}
+				return 0;
+			}
+			goto get_set_sockopt;
 		}
+		case LINUX_TCP_INFO:
+		{
+			if (call == SYS_SETSOCKOPT)
+				return -L_ENOPROTOOPT;
+			DWORD version = 0, bytes;
+			TCP_INFO_v0 win32_info;
+			if (WSAIoctl(f->socket, SIO_TCP_INFO, &version, sizeof(version), &win32_info, sizeof(win32_info), &bytes, NULL, NULL) == SOCKET_ERROR)
+			{
+				log_warning("WSAIoctl(SIO_TCP_INFO) failed, error code: %d", WSAGetLastError());
+				return translate_socket_error(WSAGetLastError());
+			}
+			struct tcp_info info;
+			translate_tcp_info_to_linux(&win32_info, &info);
+			/* Linux truncates to the buffer given */
+			if (*get_optlen < 0)
+				return -L_EINVAL;
+			if (*get_optlen > sizeof(struct tcp_info))
+				*get_optlen = sizeof(struct tcp_info);
+			memcpy(get_optval, &info, *get_optlen);
+			return 0;
+		}
+		}
+		break;
 	}
 	}
 	log_error("Unhandled sockopt level %d, optname %d", in_level, in_optname);
@@ -1126,7 +2092,7 @@ static int socket_sendmsg(struct file *f, const struct msghdr *msg, int flags)
 {
 	struct socket_file *socket = (struct socket_file *)f;
 	WaitForSingleObject(socket->mutex, INFINITE);
-	int r = socket_sendmsg_unsafe(socket, msg, flags);
+	int r = socket_sendmsg_unsafe(socket, msg, flags, false);
 	ReleaseMutex(socket->mutex);
 	return r;
 }
@@ -1135,7 +2101,7 @@ static int socket_recvmsg(struct file *f, struct msghdr *msg, int flags)
 {
 	struct socket_file *socket = (struct socket_file *)f;
 	WaitForSingleObject(socket->mutex, INFINITE);
-	int r = socket_recvmsg_unsafe(socket, msg, flags);
+	int r = socket_recvmsg_unsafe(socket, msg, flags, false);
 	ReleaseMutex(socket->mutex);
 	return r;
 }
@@ -1145,10 +2111,12 @@ static int socket_sendmmsg(struct file *f, struct mmsghdr *msgvec, unsigned int
 	struct socket_file *socket = (struct socket_file *)f;
 	WaitForSingleObject(socket->mutex, INFINITE);
 	int r = 0;
-	/* Windows have no native sendmmsg(), we emulate it by sending msgvec one by one */
+	/* Windows have no native sendmmsg(), we emulate it by sending msgvec one by one
+	 * Only the first message waits for FD_WRITE, the rest are sent right away until the socket buffer fills up
+	 */
 	for (int i = 0; i < vlen; i++)
 	{
-		int len = socket_sendmsg_unsafe(socket, &msgvec[i].msg_hdr, flags);
+		int len = socket_sendmsg_unsafe(socket, &msgvec[i].msg_hdr, flags, i > 0);
 		if (i == 0 && len < 0)
 		{
 			r = len;
@@ -1180,6 +2148,37 @@ out:
 	return r;
 }
 
+static int socket_recvmmsg(struct file *f, struct mmsghdr *msgvec, unsigned int vlen, unsigned int flags, struct timespec *timeout)
+{
+	struct socket_file *socket = (struct socket_file *)f;
+	/* Like Linux, the timeout is only checked after each received message */
+	uint64_t deadline = 0;
+	if (timeout)
+		deadline = GetTickCount64() + timeout->tv_sec * 1000ULL + timeout->tv_nsec / 1000000;
+	int msg_flags = flags & ~LINUX_MSG_WAITFORONE;
+	WaitForSingleObject(socket->mutex, INFINITE);
+	int r = 0;
+	for (unsigned int i = 0; i < vlen; i++)
+	{
+		/* Datagrams queued behind the first are received without another wait */
+		int len = socket_recvmsg_unsafe(socket, &msgvec[i].msg_hdr, msg_flags, i > 0);
+		if (len < 0)
+		{
+			/* An error after the first message just ends the batch */
+			r = (i == 0)? len: i;
+			break;
+		}
+		msgvec[i].msg_len = len;
+		r = i + 1;
+		if (flags & LINUX_MSG_WAITFORONE)
+			msg_flags |= LINUX_MSG_DONTWAIT;
+		if (timeout && GetTickCount64() >= deadline)
+			break;
+	}
+	ReleaseMutex(socket->mutex);
+	return r;
+}
+
 static const struct file_ops socket_ops = 
 {
 	.get_poll_status = socket_get_poll_status,
@@ -1190,6 +2189,8 @@ static const struct file_ops socket_ops =
 	.close = socket_close,
 	.read = socket_read,
 	.write = socket_write,
+	.readv = socket_readv,
+	.writev = socket_writev,
 	.stat = socket_stat,
 	.bind = socket_bind,
 	.connect = socket_connect,
@@ -1205,6 +2206,7 @@ static const struct file_ops socket_ops =
 	.sendmsg = socket_sendmsg,
 	.recvmsg = socket_recvmsg,
 	.sendmmsg = socket_sendmmsg,
+	.recvmmsg = socket_recvmmsg,
 };
 
 DEFINE_SYSCALL(socket, int, domain, int, type, int, protocol)
@@ -1575,6 +2577,34 @@ DEFINE_SYSCALL(sendmmsg, int, sockfd, struct mmsghdr *, msgvec, unsigned int, vl
 	return r;
 }
 
+DEFINE_SYSCALL(recvmmsg, int, sockfd, struct mmsghdr *, msgvec, unsigned int, vlen, unsigned int, flags, struct timespec *, timeout)
+{
+	log_info("recvmmsg(sockfd=%d, msgvec=%p, vlen=%d, flags=%d, timeout=%p)", sockfd, msgvec, vlen, flags, timeout);
+	for (int i = 0; i < vlen; i++)
+	{
+		log_info("msgvec %d:", i);
+		if (!mm_check_write(&msgvec[i], sizeof(struct mmsghdr)) || !mm_check_write_msghdr(&msgvec[i].msg_hdr))
+			return -L_EFAULT;
+	}
+	if (timeout && !mm_check_read(timeout, sizeof(struct timespec)))
+		return -L_EFAULT;
+	if (timeout && (timeout->tv_sec < 0 || timeout->tv_nsec < 0 || timeout->tv_nsec >= 1000000000))
+		return -L_EINVAL;
+	struct file *f = vfs_get(sockfd);
+	if (!f)
+		return -L_EBADF;
+	int r;
+	if (!f->op_vtable->recvmmsg)
+	{
+		log_error("recvmmsg() not implemented.");
+		r = -L_ENOTSOCK;
+	}
+	else
+		r = f->op_vtable->recvmmsg(f, msgvec, vlen, flags, timeout);
+	vfs_release(f);
+	return r;
+}
+
 /* Argument list sizes for sys_socketcall */
 #define AL(x) ((x) * sizeof(uintptr_t))
 static const unsigned char nargs[21] = {
@@ -1643,6 +2673,9 @@ DEFINE_SYSCALL(socketcall, int, call, uintptr_t *, args)
 	case SYS_ACCEPT4:
 		return sys_accept4(args[0], (struct sockaddr *)args[1], (int *)args[2], args[3]);
 
+	case SYS_RECVMMSG:
+		return sys_recvmmsg(args[0], (struct mmsghdr *)args[1], args[2], args[3], (struct timespec *)args[4]);
+
 	case SYS_SENDMMSG:
 		return sys_sendmmsg(args[0], (struct mmsghdr *)args[1], args[2], args[3]);
 
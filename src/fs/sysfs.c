@@ -17,17 +17,69 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_VFS
+
 #include <fs/sysfs.h>
 #include <fs/virtual.h>
+#include <hostinfo.h>
 #include <log.h>
+#include <str.h>
 
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 
+/* glibc reads online to get the number of processors */
+static int cpu_online_gettext(int tag, char *buf)
+{
+	int cpu_count = hostinfo_get_cpu_count();
+	if (cpu_count == 1)
+		return ksprintf(buf, "0\n");
+	return ksprintf(buf, "0-%d\n", cpu_count - 1);
+}
+
+/* The processors do not change during a session */
+static bool cpu_online_getversion(int tag, uint32_t *version)
+{
+	*version = 0;
+	return true;
+}
+
+static struct virtualfs_text_desc cpu_online_desc = VIRTUALFS_TEXT_VERSIONED(cpu_online_gettext, cpu_online_getversion);
+
+static struct virtualfs_directory_desc devices_system_cpu_desc =
+{
+	.type = VIRTUALFS_TYPE_DIRECTORY,
+	.entries = {
+		VIRTUALFS_ENTRY("online", cpu_online_desc)
+		VIRTUALFS_ENTRY("possible", cpu_online_desc)
+		VIRTUALFS_ENTRY("present", cpu_online_desc)
+		VIRTUALFS_ENTRY_END()
+	}
+};
+
+static struct virtualfs_directory_desc devices_system_desc =
+{
+	.type = VIRTUALFS_TYPE_DIRECTORY,
+	.entries = {
+		VIRTUALFS_ENTRY("cpu", devices_system_cpu_desc)
+		VIRTUALFS_ENTRY_END()
+	}
+};
+
+static struct virtualfs_directory_desc devices_desc =
+{
+	.type = VIRTUALFS_TYPE_DIRECTORY,
+	.entries = {
+		VIRTUALFS_ENTRY("system", devices_system_desc)
+		VIRTUALFS_ENTRY_END()
+	}
+};
+
 static const struct virtualfs_directory_desc sysfs =
 {
 	.type = VIRTUALFS_TYPE_DIRECTORY,
 	.entries = {
+		VIRTUALFS_ENTRY("devices", devices_desc)
 		VIRTUALFS_ENTRY_END()
 	}
 };
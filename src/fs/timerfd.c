@@ -0,0 +1,332 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define LOG_CATEGORY LOG_CAT_VFS
+
+#include <common/errno.h>
+#include <common/poll.h>
+#include <common/time.h>
+#include <common/timerfd.h>
+#include <fs/file.h>
+#include <syscall/mm.h>
+#include <syscall/sig.h>
+#include <syscall/syscall.h>
+#include <syscall/timer.h>
+#include <syscall/vfs.h>
+#include <datetime.h>
+#include <heap.h>
+#include <log.h>
+#include <win7compat.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION	0x00000002
+#endif
+
+/* Timer state shared by all processes holding the file
+ * All times are on the monotonic clock, a CLOCK_REALTIME timer is converted when set.
+ * Expirations are computed from the clock instead of counted from timer signals, so periodic timers
+ * do not drift and are not limited by the millisecond period of SetWaitableTimer().
+ * The waitable timer is only used as a wakeup source, it is armed for the next expiration which
+ * has not been read yet.
+ */
+struct timerfd_shared
+{
+	bool armed;
+	uint64_t base; /* Time of the first expiration */
+	uint64_t interval; /* 0 for one shot timers */
+	uint64_t expirations; /* Number of expirations already read */
+};
+
+struct timerfd_file
+{
+	struct file base_file;
+	struct timerfd_shared *shared;
+	HANDLE shared_handle;
+	HANDLE mutex;
+	HANDLE timer; /* Manual reset, signaled when an expiration is pending */
+	clockid_t clockid;
+};
+
+static const struct file_ops timerfd_ops;
+
+static uint64_t timerfd_clock_ns(clockid_t clockid)
+{
+	if (clockid == CLOCK_REALTIME)
+	{
+		FILETIME system_time;
+		win7compat_GetSystemTimePreciseAsFileTime(&system_time);
+		return filetime_to_unix_nsec(&system_time);
+	}
+	return timer_monotonic_ns();
+}
+
+static uint64_t timespec_to_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * NANOSECONDS_PER_SECOND + ts->tv_nsec;
+}
+
+static void ns_to_timespec(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = (long)(ns / NANOSECONDS_PER_SECOND);
+	ts->tv_nsec = (long)(ns % NANOSECONDS_PER_SECOND);
+}
+
+/* Total number of expirations until now, must be called with the mutex held */
+static uint64_t timerfd_total_expirations(struct timerfd_file *f, uint64_t now)
+{
+	if (!f->shared->armed || now < f->shared->base)
+		return 0;
+	if (f->shared->interval == 0)
+		return 1;
+	return (now - f->shared->base) / f->shared->interval + 1;
+}
+
+/* Arm the waitable timer for the next unread expiration, must be called with the mutex held */
+static void timerfd_arm(struct timerfd_file *f, uint64_t now)
+{
+	LARGE_INTEGER due;
+	if (!f->shared->armed || (f->shared->interval == 0 && f->shared->expirations > 0))
+	{
+		/* Setting the timer resets it to non signaled, cancel it right after */
+		due.QuadPart = -1000000000LL;
+		SetWaitableTimer(f->timer, &due, 0, NULL, NULL, FALSE);
+		CancelWaitableTimer(f->timer);
+		return;
+	}
+	uint64_t next = f->shared->base + f->shared->expirations * f->shared->interval;
+	/* Relative due time in 100ns units, rounded up so we never wake up early */
+	due.QuadPart = next > now ? -(LONGLONG)((next - now + 99) / 100) : 0;
+	SetWaitableTimer(f->timer, &due, 0, NULL, NULL, FALSE);
+}
+
+static int timerfd_close(struct file *f)
+{
+	struct timerfd_file *timerfd = (struct timerfd_file *)f;
+	CloseHandle(timerfd->timer);
+	CloseHandle(timerfd->mutex);
+	UnmapViewOfFile(timerfd->shared);
+	CloseHandle(timerfd->shared_handle);
+	kfree(timerfd, sizeof(struct timerfd_file));
+	return 0;
+}
+
+static void timerfd_after_fork_child(struct file *f)
+{
+	struct timerfd_file *timerfd = (struct timerfd_file *)f;
+	timerfd->shared = MapViewOfFile(timerfd->shared_handle, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(struct timerfd_shared));
+}
+
+static int timerfd_get_poll_status(struct file *f)
+{
+	struct timerfd_file *timerfd = (struct timerfd_file *)f;
+	WaitForSingleObject(timerfd->mutex, INFINITE);
+	uint64_t now = timer_monotonic_ns();
+	int events = 0;
+	if (timerfd_total_expirations(timerfd, now) > timerfd->shared->expirations)
+		events = LINUX_POLLIN;
+	else if (WaitForSingleObject(timerfd->timer, 0) == WAIT_OBJECT_0)
+	{
+		/* The waitable timer fired slightly before our clock reached the expiration, rearm it */
+		timerfd_arm(timerfd, now);
+	}
+	ReleaseMutex(timerfd->mutex);
+	return events;
+}
+
+static HANDLE timerfd_get_poll_handle(struct file *f, int *poll_events)
+{
+	struct timerfd_file *timerfd = (struct timerfd_file *)f;
+	*poll_events = LINUX_POLLIN;
+	return timerfd->timer;
+}
+
+static size_t timerfd_read(struct file *f, void *buf, size_t count)
+{
+	struct timerfd_file *timerfd = (struct timerfd_file *)f;
+	if (count < sizeof(uint64_t))
+		return -L_EINVAL;
+	for (;;)
+	{
+		WaitForSingleObject(timerfd->mutex, INFINITE);
+		uint64_t now = timer_monotonic_ns();
+		uint64_t total = timerfd_total_expirations(timerfd, now);
+		uint64_t value = total - timerfd->shared->expirations;
+		if (value > 0)
+			timerfd->shared->expirations = total;
+		timerfd_arm(timerfd, now);
+		ReleaseMutex(timerfd->mutex);
+		if (value > 0)
+		{
+			*(uint64_t *)buf = value;
+			return sizeof(uint64_t);
+		}
+		if (f->flags & O_NONBLOCK)
+			return -L_EAGAIN;
+		if (signal_wait(1, &timerfd->timer, INFINITE) == WAIT_INTERRUPTED)
+			return -L_EINTR;
+	}
+}
+
+static const struct file_ops timerfd_ops = {
+	.get_poll_status = timerfd_get_poll_status,
+	.get_poll_handle = timerfd_get_poll_handle,
+	.after_fork_child = timerfd_after_fork_child,
+	.close = timerfd_close,
+	.read = timerfd_read,
+};
+
+/* Fill current setting of the timer, must be called with the mutex held */
+static void timerfd_get_setting(struct timerfd_file *f, uint64_t now, struct itimerspec *setting)
+{
+	ns_to_timespec(f->shared->interval, &setting->it_interval);
+	uint64_t total = timerfd_total_expirations(f, now);
+	if (!f->shared->armed || (f->shared->interval == 0 && total > 0))
+		ns_to_timespec(0, &setting->it_value);
+	else
+	{
+		uint64_t next = f->shared->base + total * f->shared->interval;
+		ns_to_timespec(next - now, &setting->it_value);
+	}
+}
+
+static int timerfd_get(int fd, struct timerfd_file **timerfd)
+{
+	struct file *f = vfs_get(fd);
+	if (!f)
+		return -L_EBADF;
+	if (f->op_vtable != &timerfd_ops)
+	{
+		vfs_release(f);
+		return -L_EINVAL;
+	}
+	*timerfd = (struct timerfd_file *)f;
+	return 0;
+}
+
+DEFINE_SYSCALL(timerfd_create, int, clockid, int, flags)
+{
+	log_info("timerfd_create(%d, 0x%x)", clockid, flags);
+	if (clockid != CLOCK_REALTIME && clockid != CLOCK_MONOTONIC && clockid != CLOCK_BOOTTIME)
+		return -L_EINVAL;
+	if (flags & ~(TFD_CLOEXEC | TFD_NONBLOCK))
+		return -L_EINVAL;
+
+	SECURITY_ATTRIBUTES attr;
+	attr.nLength = sizeof(SECURITY_ATTRIBUTES);
+	attr.lpSecurityDescriptor = NULL;
+	attr.bInheritHandle = TRUE;
+
+	HANDLE timer = CreateWaitableTimerExW(&attr, NULL, CREATE_WAITABLE_TIMER_MANUAL_RESET | CREATE_WAITABLE_TIMER_HIGH_RESOLUTION,
+		TIMER_ALL_ACCESS);
+	if (!timer) /* High resolution timers are only available since Windows 10 1803 */
+		timer = CreateWaitableTimerExW(&attr, NULL, CREATE_WAITABLE_TIMER_MANUAL_RESET, TIMER_ALL_ACCESS);
+	if (!timer)
+	{
+		log_error("CreateWaitableTimerExW() failed, error code: %d", GetLastError());
+		return -L_ENOMEM;
+	}
+	HANDLE shared_handle = CreateFileMapping(NULL, &attr, PAGE_READWRITE, 0, sizeof(struct timerfd_shared), NULL);
+	struct timerfd_shared *shared = shared_handle ? MapViewOfFile(shared_handle, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(struct timerfd_shared)) : NULL;
+	if (!shared)
+	{
+		log_error("Creating timerfd shared area failed, error code: %d", GetLastError());
+		if (shared_handle)
+			CloseHandle(shared_handle);
+		CloseHandle(timer);
+		return -L_ENOMEM;
+	}
+	shared->armed = false;
+
+	struct timerfd_file *f = (struct timerfd_file *)kmalloc(sizeof(struct timerfd_file));
+	file_init(&f->base_file, &timerfd_ops, O_RDONLY | (flags & TFD_NONBLOCK));
+	f->shared = shared;
+	f->shared_handle = shared_handle;
+	f->mutex = CreateMutexW(&attr, FALSE, NULL);
+	f->timer = timer;
+	f->clockid = clockid == CLOCK_REALTIME ? CLOCK_REALTIME : CLOCK_MONOTONIC;
+	int fd = vfs_store_file((struct file *)f, flags & TFD_CLOEXEC);
+	if (fd < 0)
+		vfs_release((struct file *)f);
+	return fd;
+}
+
+DEFINE_SYSCALL(timerfd_settime, int, fd, int, flags, const struct itimerspec *, new_value, struct itimerspec *, old_value)
+{
+	log_info("timerfd_settime(%d, 0x%x, %p, %p)", fd, flags, new_value, old_value);
+	if (flags & ~(TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET))
+		return -L_EINVAL;
+	if (!mm_check_read(new_value, sizeof(struct itimerspec)))
+		return -L_EFAULT;
+	if (old_value && !mm_check_write(old_value, sizeof(struct itimerspec)))
+		return -L_EFAULT;
+	if (new_value->it_value.tv_sec < 0 || new_value->it_value.tv_nsec < 0 || new_value->it_value.tv_nsec >= NANOSECONDS_PER_SECOND
+		|| new_value->it_interval.tv_sec < 0 || new_value->it_interval.tv_nsec < 0 || new_value->it_interval.tv_nsec >= NANOSECONDS_PER_SECOND)
+		return -L_EINVAL;
+	struct timerfd_file *f;
+	int r = timerfd_get(fd, &f);
+	if (r < 0)
+		return r;
+
+	WaitForSingleObject(f->mutex, INFINITE);
+	uint64_t now = timer_monotonic_ns();
+	if (old_value)
+		timerfd_get_setting(f, now, old_value);
+	uint64_t value = timespec_to_ns(&new_value->it_value);
+	if (value == 0)
+		f->shared->armed = false;
+	else
+	{
+		uint64_t base;
+		if (flags & TFD_TIMER_ABSTIME)
+		{
+			/* Convert to the same point of time on the monotonic clock */
+			int64_t delta = (int64_t)(value - timerfd_clock_ns(f->clockid));
+			base = (int64_t)now + delta < 0 ? 0 : now + delta;
+		}
+		else
+			base = now + value;
+		f->shared->armed = true;
+		f->shared->base = base;
+		f->shared->interval = timespec_to_ns(&new_value->it_interval);
+		f->shared->expirations = 0;
+	}
+	timerfd_arm(f, now);
+	ReleaseMutex(f->mutex);
+	vfs_release((struct file *)f);
+	return 0;
+}
+
+DEFINE_SYSCALL(timerfd_gettime, int, fd, struct itimerspec *, curr_value)
+{
+	log_info("timerfd_gettime(%d, %p)", fd, curr_value);
+	if (!mm_check_write(curr_value, sizeof(struct itimerspec)))
+		return -L_EFAULT;
+	struct timerfd_file *f;
+	int r = timerfd_get(fd, &f);
+	if (r < 0)
+		return r;
+	WaitForSingleObject(f->mutex, INFINITE);
+	timerfd_get_setting(f, timer_monotonic_ns(), curr_value);
+	ReleaseMutex(f->mutex);
+	vfs_release((struct file *)f);
+	return 0;
+}
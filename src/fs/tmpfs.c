@@ -0,0 +1,1348 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define LOG_CATEGORY LOG_CAT_VFS
+
+#include <common/errno.h>
+#include <common/fcntl.h>
+#include <common/fs.h>
+#include <fs/tmpfs.h>
+#include <lib/list.h>
+#include <syscall/mm.h>
+#include <syscall/process.h>
+#include <syscall/vfs.h>
+#include <datetime.h>
+#include <heap.h>
+#include <log.h>
+#include <ntdll.h>
+#include <shared.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+/* In-memory file system
+ *
+ * Inodes live in the shared heap, so the tree is the same in every process of the session and
+ * is protected by one session wide mutex. A tmpfs mount is identified by its mount point key,
+ * each key gets its own root directory.
+ *
+ * The data of a regular file is stored in a list of extents. Each extent is a pagefile backed
+ * section of whole blocks named after the inode number, a version and its index in the session
+ * object directory, so every process can open it and mm can map it directly as a file view. This
+ * makes MAP_SHARED mappings of tmpfs files, like POSIX shared memory objects in /dev/shm, zero copy.
+ * When a file needs more room, a new extent at least as large as all previous ones is appended.
+ * Data never moves, so existing mappings stay coherent as the file grows. The first extent is
+ * sized exactly, which is what a shm_open() and ftruncate() pair needs. Truncating a file to zero
+ * drops all extents and bumps the version.
+ *
+ * A section only lives as long as somebody has a handle to it. Besides the handles of open files,
+ * the data of every linked file is kept alive by handles owned by "keeper" processes, initially
+ * the process which created the extent. On exit a keeper passes its handles on to the nearest
+ * living ancestor. The data is lost when the last process of the session exits, or when a keeper
+ * dies without going through process_exit().
+ *
+ * Hard links are not supported.
+ */
+
+#define TMPFS_MAGIC			0x01021994
+#define TMPFS_MAX_MOUNTS	64
+#define TMPFS_NAME_MAX		255
+#ifdef _WIN64
+#define TMPFS_MAX_FILE_SIZE	0x400000000ULL /* 16GB */
+#else
+#define TMPFS_MAX_FILE_SIZE	0x20000000ULL /* 512MB */
+#endif
+#define TMPFS_MAX_EXTENTS	24
+#define TMPFS_SECTION_ACCESS	(SECTION_MAP_READ | SECTION_MAP_WRITE | SECTION_MAP_EXECUTE | SECTION_QUERY)
+
+struct tmpfs_extent
+{
+	uint64_t capacity;
+	HANDLE keeper_handle; /* Handle of the section in the keeper process */
+	DWORD keeper_win_pid;
+	uint64_t keeper_start_time;
+};
+
+struct tmpfs_inode
+{
+	uint32_t ino;
+	int mode;
+	int nlink; /* 1 if linked in a directory or a root, 0 after removal */
+	int open_count; /* Number of open files in all processes */
+	struct tmpfs_inode *parent, *prev, *next;
+	char *name;
+	int namelen;
+	struct timespec atime, mtime, ctime;
+	uint64_t size; /* File size, or target length of a symlink */
+	union
+	{
+		/* Directory */
+		struct tmpfs_inode *children;
+		/* Symlink */
+		char *target;
+		/* Regular file */
+		struct
+		{
+			uint64_t capacity; /* Total capacity of all extents */
+			uint32_t version; /* Version of the extents */
+			int extent_count;
+			struct tmpfs_extent *extents; /* TMPFS_MAX_EXTENTS entries, allocated with the first extent */
+		};
+	};
+};
+
+struct tmpfs_shared_data
+{
+	volatile LONG last_ino;
+	struct tmpfs_inode *roots[TMPFS_MAX_MOUNTS];
+};
+
+struct tmpfs_file
+{
+	struct file base_file;
+	struct list_node list; /* In tmpfs->files */
+	struct tmpfs_inode *inode;
+	int mp_key;
+	loff_t offset; /* File offset, or directory entry index for getdents() */
+	uint32_t version; /* Version of the extents the handles and views belong to */
+	HANDLE sections[TMPFS_MAX_EXTENTS];
+	char *views[TMPFS_MAX_EXTENTS];
+	uint64_t capacities[TMPFS_MAX_EXTENTS]; /* Extent sizes, valid for mapped extents and those before them */
+};
+
+struct tmpfs
+{
+	struct file_system base_fs;
+	HANDLE mutex;
+	uint64_t start_time; /* Creation time of the current process */
+	SRWLOCK files_lock;
+	struct list files; /* All open tmpfs files in this process */
+};
+
+static struct tmpfs *tmpfs;
+static struct tmpfs_shared_data *tmpfs_shared;
+
+static void tmpfs_lock()
+{
+	WaitForSingleObject(tmpfs->mutex, INFINITE);
+}
+
+static void tmpfs_unlock()
+{
+	NtReleaseMutant(tmpfs->mutex, NULL);
+}
+
+static void tmpfs_now(struct timespec *ts)
+{
+	FILETIME filetime;
+	GetSystemTimeAsFileTime(&filetime);
+	filetime_to_unix_timespec(&filetime, ts);
+}
+
+static uint64_t tmpfs_get_start_time(HANDLE process)
+{
+	FILETIME creation_time, exit_time, kernel_time, user_time;
+	if (!GetProcessTimes(process, &creation_time, &exit_time, &kernel_time, &user_time))
+		return 0;
+	return ((uint64_t)creation_time.dwHighDateTime << 32ULL) | creation_time.dwLowDateTime;
+}
+
+static NTSTATUS tmpfs_open_section(uint32_t ino, uint32_t version, int index, uint64_t capacity, ACCESS_MASK access, HANDLE *section)
+{
+	WCHAR namebuf[64];
+	UNICODE_STRING name;
+	RtlInitEmptyUnicodeString(&name, namebuf, sizeof(namebuf));
+	RtlAppendUnicodeToString(&name, L"tmpfs_");
+	RtlAppendIntegerToString(ino, 10, &name);
+	RtlAppendUnicodeToString(&name, L"_");
+	RtlAppendIntegerToString(version, 10, &name);
+	RtlAppendUnicodeToString(&name, L"_");
+	RtlAppendIntegerToString(index, 10, &name);
+	OBJECT_ATTRIBUTES oa;
+	InitializeObjectAttributes(&oa, &name, OBJ_INHERIT, shared_get_object_directory(), NULL);
+	if (capacity)
+	{
+		LARGE_INTEGER size;
+		size.QuadPart = capacity;
+		return NtCreateSection(section, access, &oa, &size, PAGE_EXECUTE_READWRITE, SEC_COMMIT, NULL);
+	}
+	return NtOpenSection(section, access, &oa);
+}
+
+/* Close the handle keeping an extent alive, caller holds the tmpfs mutex */
+static void tmpfs_release_keeper(struct tmpfs_extent *extent)
+{
+	if (!extent->keeper_handle)
+		return;
+	if (extent->keeper_win_pid == GetCurrentProcessId())
+		NtClose(extent->keeper_handle);
+	else
+	{
+		/* The handle is gone if the keeper died, make sure its pid is not reused by someone else */
+		HANDLE process = OpenProcess(PROCESS_DUP_HANDLE | PROCESS_QUERY_LIMITED_INFORMATION, FALSE, extent->keeper_win_pid);
+		if (process)
+		{
+			if (tmpfs_get_start_time(process) == extent->keeper_start_time)
+				DuplicateHandle(process, extent->keeper_handle, NULL, NULL, 0, FALSE, DUPLICATE_CLOSE_SOURCE);
+			CloseHandle(process);
+		}
+	}
+	extent->keeper_handle = NULL;
+	extent->keeper_win_pid = 0;
+}
+
+static void tmpfs_release_keepers(struct tmpfs_inode *inode)
+{
+	for (int i = 0; i < inode->extent_count; i++)
+		tmpfs_release_keeper(&inode->extents[i]);
+}
+
+/* Make the current process the keeper of an extent, caller holds the tmpfs mutex */
+static void tmpfs_set_keeper(struct tmpfs_inode *inode, struct tmpfs_extent *extent, HANDLE section)
+{
+	tmpfs_release_keeper(extent);
+	/* Removed files only live as long as they are open */
+	if (!inode->nlink)
+		return;
+	HANDLE handle;
+	NTSTATUS status = NtDuplicateObject(NtCurrentProcess(), section, NtCurrentProcess(), &handle, 0, 0, DUPLICATE_SAME_ACCESS);
+	if (!NT_SUCCESS(status))
+	{
+		log_error("NtDuplicateObject() failed, status: %x", status);
+		return;
+	}
+	extent->keeper_handle = handle;
+	extent->keeper_win_pid = GetCurrentProcessId();
+	extent->keeper_start_time = tmpfs->start_time;
+}
+
+/* Drop all extents of a file, caller holds the tmpfs mutex */
+static void tmpfs_drop_extents(struct tmpfs_inode *inode)
+{
+	if (!inode->extent_count)
+		return;
+	tmpfs_release_keepers(inode);
+	inode->extent_count = 0;
+	inode->capacity = 0;
+	inode->version++;
+}
+
+static void tmpfs_touch(struct tmpfs_inode *inode)
+{
+	tmpfs_now(&inode->mtime);
+	inode->ctime = inode->mtime;
+}
+
+static struct tmpfs_inode *tmpfs_inode_alloc(int mode)
+{
+	struct tmpfs_inode *inode = (struct tmpfs_inode *)kmalloc_shared(sizeof(struct tmpfs_inode));
+	if (!inode)
+		return NULL;
+	memset(inode, 0, sizeof(struct tmpfs_inode));
+	inode->ino = (uint32_t)InterlockedIncrement(&tmpfs_shared->last_ino);
+	inode->mode = mode;
+	inode->nlink = 1;
+	tmpfs_now(&inode->mtime);
+	inode->atime = inode->ctime = inode->mtime;
+	return inode;
+}
+
+static void tmpfs_inode_free(struct tmpfs_inode *inode)
+{
+	if (S_ISREG(inode->mode) && inode->extents)
+	{
+		tmpfs_release_keepers(inode);
+		kfree_shared(inode->extents, sizeof(struct tmpfs_extent) * TMPFS_MAX_EXTENTS);
+	}
+	else if (S_ISLNK(inode->mode))
+		kfree_shared(inode->target, (size_t)inode->size + 1);
+	if (inode->name)
+		kfree_shared(inode->name, inode->namelen + 1);
+	kfree_shared(inode, sizeof(struct tmpfs_inode));
+}
+
+/* Drop an open reference, caller holds the tmpfs mutex */
+static void tmpfs_inode_put(struct tmpfs_inode *inode)
+{
+	if (--inode->open_count == 0 && !inode->nlink)
+		tmpfs_inode_free(inode);
+}
+
+static void tmpfs_link_child(struct tmpfs_inode *dir, struct tmpfs_inode *inode)
+{
+	inode->parent = dir;
+	inode->prev = NULL;
+	inode->next = dir->children;
+	if (dir->children)
+		dir->children->prev = inode;
+	dir->children = inode;
+	tmpfs_touch(dir);
+}
+
+static void tmpfs_unlink_child(struct tmpfs_inode *inode)
+{
+	struct tmpfs_inode *dir = inode->parent;
+	if (inode->prev)
+		inode->prev->next = inode->next;
+	else
+		dir->children = inode->next;
+	if (inode->next)
+		inode->next->prev = inode->prev;
+	inode->parent = inode->prev = inode->next = NULL;
+	tmpfs_touch(dir);
+}
+
+/* Remove an inode from its directory, it is freed when it is no longer open */
+static void tmpfs_remove(struct tmpfs_inode *inode)
+{
+	tmpfs_unlink_child(inode);
+	inode->nlink = 0;
+	if (S_ISREG(inode->mode))
+		tmpfs_release_keepers(inode);
+	if (inode->open_count == 0)
+		tmpfs_inode_free(inode);
+}
+
+static struct tmpfs_inode *tmpfs_get_root(struct mount_point *mp)
+{
+	if (mp->key < 0 || mp->key >= TMPFS_MAX_MOUNTS)
+	{
+		log_error("tmpfs: Mount point key %d out of range.", mp->key);
+		return NULL;
+	}
+	struct tmpfs_inode *root = tmpfs_shared->roots[mp->key];
+	if (!root)
+	{
+		root = tmpfs_inode_alloc(S_IFDIR | 01777);
+		tmpfs_shared->roots[mp->key] = root;
+	}
+	return root;
+}
+
+static struct tmpfs_inode *tmpfs_find_child(struct tmpfs_inode *dir, const char *name, int namelen)
+{
+	for (struct tmpfs_inode *child = dir->children; child; child = child->next)
+		if (child->namelen == namelen && !memcmp(child->name, name, namelen))
+			return child;
+	return NULL;
+}
+
+/* Find the inode of a path on a tmpfs mount, caller holds the tmpfs mutex
+ * If only the last component does not exist, returns 0 with *inode set to NULL.
+ * On success *parent, *name and *namelen describe the last component, *parent is NULL for the root.
+ */
+static int tmpfs_lookup(struct mount_point *mp, const char *path, struct tmpfs_inode **parent,
+	const char **name, int *namelen, struct tmpfs_inode **inode)
+{
+	struct tmpfs_inode *cur = tmpfs_get_root(mp);
+	if (!cur)
+		return -L_ENOENT;
+	*parent = NULL;
+	*name = NULL;
+	*namelen = 0;
+	for (;;)
+	{
+		while (*path == '/')
+			path++;
+		if (!*path)
+		{
+			*inode = cur;
+			return 0;
+		}
+		const char *end = path;
+		while (*end && *end != '/')
+			end++;
+		int len = (int)(end - path);
+		if (len == 1 && path[0] == '.')
+		{
+			path = end;
+			continue;
+		}
+		if (!S_ISDIR(cur->mode))
+			return -L_ENOTDIR;
+		if (len > TMPFS_NAME_MAX)
+			return -L_ENAMETOOLONG;
+		*parent = cur;
+		*name = path;
+		*namelen = len;
+		cur = tmpfs_find_child(cur, path, len);
+		if (!cur)
+		{
+			while (*end == '/')
+				end++;
+			if (*end)
+				return -L_ENOENT;
+			*inode = NULL;
+			return 0;
+		}
+		path = end;
+	}
+}
+
+static int tmpfs_create(struct tmpfs_inode *parent, const char *name, int namelen, int mode, struct tmpfs_inode **out)
+{
+	struct tmpfs_inode *inode = tmpfs_inode_alloc(mode);
+	if (!inode)
+		return -L_ENOSPC;
+	inode->name = (char *)kmalloc_shared(namelen + 1);
+	if (!inode->name)
+	{
+		kfree_shared(inode, sizeof(struct tmpfs_inode));
+		return -L_ENOSPC;
+	}
+	memcpy(inode->name, name, namelen);
+	inode->name[namelen] = 0;
+	inode->namelen = namelen;
+	tmpfs_link_child(parent, inode);
+	*out = inode;
+	return 0;
+}
+
+static void tmpfs_unmap(struct tmpfs_file *file)
+{
+	for (int i = 0; i < TMPFS_MAX_EXTENTS; i++)
+	{
+		if (file->views[i])
+			NtUnmapViewOfSection(NtCurrentProcess(), file->views[i]);
+		if (file->sections[i])
+			NtClose(file->sections[i]);
+		file->views[i] = NULL;
+		file->sections[i] = NULL;
+	}
+}
+
+/* Forget the handles and views of dropped extents, caller holds the tmpfs mutex and the file lock */
+static void tmpfs_check_version(struct tmpfs_file *file)
+{
+	if (file->version != file->inode->version)
+	{
+		tmpfs_unmap(file);
+		file->version = file->inode->version;
+	}
+}
+
+/* Map views of the extents holding [offset, offset + count), caller holds the tmpfs mutex and the file lock */
+static int tmpfs_map(struct tmpfs_file *file, uint64_t offset, size_t count)
+{
+	struct tmpfs_inode *inode = file->inode;
+	tmpfs_check_version(file);
+	uint64_t start = 0;
+	for (int i = 0; i < inode->extent_count && start < offset + count; i++)
+	{
+		uint64_t capacity = inode->extents[i].capacity;
+		file->capacities[i] = capacity;
+		if (start + capacity > offset && !file->views[i])
+		{
+			NTSTATUS status;
+			if (!file->sections[i])
+			{
+				status = tmpfs_open_section(inode->ino, inode->version, i, 0, TMPFS_SECTION_ACCESS, &file->sections[i]);
+				if (!NT_SUCCESS(status))
+				{
+					log_error("tmpfs: Open extent %d of inode %d failed, status: %x", i, inode->ino, status);
+					file->sections[i] = NULL;
+					return -L_EIO;
+				}
+			}
+			PVOID base_addr = NULL;
+			SIZE_T view_size = 0;
+			status = NtMapViewOfSection(file->sections[i], NtCurrentProcess(), &base_addr, 0, 0, NULL, &view_size, ViewUnmap, 0, PAGE_READWRITE);
+			if (!NT_SUCCESS(status))
+			{
+				log_error("NtMapViewOfSection() failed, status: %x", status);
+				return -L_ENOMEM;
+			}
+			file->views[i] = (char *)base_addr;
+		}
+		start += capacity;
+	}
+	return 0;
+}
+
+/* Copy between a buffer and the file data, the range must be mapped by tmpfs_map()
+ * A NULL buffer on writing fills the range with zero. This needs no tmpfs mutex, the views and
+ * the sizes of the extents stay the same while we hold the file lock.
+ */
+static void tmpfs_copy(struct tmpfs_file *file, uint64_t offset, char *buf, size_t count, bool write)
+{
+	uint64_t start = 0;
+	for (int i = 0; count > 0; i++)
+	{
+		uint64_t end = start + file->capacities[i];
+		if (offset < end)
+		{
+			size_t len = (size_t)min((uint64_t)count, end - offset);
+			char *data = file->views[i] + (offset - start);
+			if (!write)
+				memcpy(buf, data, len);
+			else if (buf)
+				memcpy(data, buf, len);
+			else
+				memset(data, 0, len);
+			if (buf)
+				buf += len;
+			offset += len;
+			count -= len;
+		}
+		start = end;
+	}
+}
+
+/* Make room for size bytes of data, caller holds the tmpfs mutex and the file lock */
+static int tmpfs_reserve(struct tmpfs_file *file, uint64_t size)
+{
+	struct tmpfs_inode *inode = file->inode;
+	tmpfs_check_version(file);
+	if (size <= inode->capacity)
+		return 0;
+	if (size > TMPFS_MAX_FILE_SIZE || inode->extent_count == TMPFS_MAX_EXTENTS)
+		return -L_EFBIG;
+	if (!inode->extents)
+	{
+		inode->extents = (struct tmpfs_extent *)kmalloc_shared(sizeof(struct tmpfs_extent) * TMPFS_MAX_EXTENTS);
+		if (!inode->extents)
+			return -L_ENOSPC;
+	}
+	/* Grow geometrically to keep the number of extents small */
+	uint64_t capacity = (size - inode->capacity + BLOCK_SIZE - 1) & ~(uint64_t)(BLOCK_SIZE - 1);
+	if (capacity < inode->capacity)
+		capacity = min(inode->capacity, TMPFS_MAX_FILE_SIZE - inode->capacity);
+	int i = inode->extent_count;
+	HANDLE section;
+	NTSTATUS status = tmpfs_open_section(inode->ino, inode->version, i, capacity, TMPFS_SECTION_ACCESS, &section);
+	if (!NT_SUCCESS(status))
+	{
+		log_warning("tmpfs: Create extent of %llu bytes failed, status: %x", capacity, status);
+		return -L_ENOSPC;
+	}
+	struct tmpfs_extent *extent = &inode->extents[i];
+	extent->capacity = capacity;
+	extent->keeper_handle = NULL;
+	tmpfs_set_keeper(inode, extent, section);
+	inode->extent_count++;
+	inode->capacity += capacity;
+	file->sections[i] = section;
+	return 0;
+}
+
+/* Change the size of a regular file, caller holds the tmpfs mutex
+ * Growing needs an open file, shrinking to zero does not.
+ */
+static int tmpfs_resize(struct tmpfs_file *file, struct tmpfs_inode *inode, uint64_t length)
+{
+	if (length == 0)
+		tmpfs_drop_extents(inode);
+	else if (length < inode->size)
+	{
+		/* Keep the data beyond the end zero so the file can be extended in place */
+		int r = tmpfs_map(file, length, (size_t)(inode->size - length));
+		if (r < 0)
+			return r;
+		tmpfs_copy(file, length, NULL, (size_t)(inode->size - length), true);
+	}
+	else if (length > inode->size)
+	{
+		int r = tmpfs_reserve(file, length);
+		if (r < 0)
+			return r;
+	}
+	inode->size = length;
+	tmpfs_touch(inode);
+	return 0;
+}
+
+static int tmpfs_close(struct file *f)
+{
+	struct tmpfs_file *file = (struct tmpfs_file *)f;
+	AcquireSRWLockExclusive(&tmpfs->files_lock);
+	list_remove(&tmpfs->files, &file->list);
+	ReleaseSRWLockExclusive(&tmpfs->files_lock);
+	tmpfs_unmap(file);
+	tmpfs_lock();
+	tmpfs_inode_put(file->inode);
+	tmpfs_unlock();
+	kfree(file, sizeof(struct tmpfs_file));
+	return 0;
+}
+
+static int tmpfs_getpath(struct file *f, char *buf)
+{
+	struct tmpfs_file *file = (struct tmpfs_file *)f;
+	const struct mount_point *mp = vfs_get_mountpoint(file->mp_key);
+	/* Build the path backwards, starting from the file */
+	char path[PATH_MAX];
+	int pos = PATH_MAX;
+	tmpfs_lock();
+	for (struct tmpfs_inode *inode = file->inode; inode->parent; inode = inode->parent)
+	{
+		if (pos < inode->namelen + 1 + mp->mountpoint_len + 1)
+			break;
+		pos -= inode->namelen;
+		memcpy(path + pos, inode->name, inode->namelen);
+		path[--pos] = '/';
+	}
+	tmpfs_unlock();
+	int len = mp->mountpoint_len;
+	memcpy(buf, mp->mountpoint, len);
+	memcpy(buf + len, path + pos, PATH_MAX - pos);
+	len += PATH_MAX - pos;
+	buf[len] = 0;
+	return len;
+}
+
+static size_t tmpfs_pread_unsafe(struct tmpfs_file *file, void *buf, size_t count, loff_t offset)
+{
+	struct tmpfs_inode *inode = file->inode;
+	if (S_ISDIR(inode->mode))
+		return -L_EISDIR;
+	if (offset < 0)
+		return -L_EINVAL;
+	tmpfs_lock();
+	size_t r = 0;
+	if ((uint64_t)offset < inode->size)
+		r = (size_t)min((uint64_t)count, inode->size - offset);
+	int err = r? tmpfs_map(file, offset, r): 0;
+	tmpfs_unlock();
+	if (err < 0)
+		return err;
+	tmpfs_copy(file, offset, (char *)buf, r, false);
+	return r;
+}
+
+/* offset is -1 for appending */
+static size_t tmpfs_pwrite_unsafe(struct tmpfs_file *file, const void *buf, size_t count, loff_t offset)
+{
+	struct tmpfs_inode *inode = file->inode;
+	if (S_ISDIR(inode->mode))
+		return -L_EISDIR;
+	tmpfs_lock();
+	size_t r = count;
+	if (offset == -1)
+		offset = inode->size;
+	if (offset < 0)
+		r = -L_EINVAL;
+	else if (count > 0)
+	{
+		int err = tmpfs_reserve(file, offset + count);
+		if (err == 0)
+			err = tmpfs_map(file, offset, count);
+		if (err < 0)
+			r = err;
+		else
+		{
+			tmpfs_copy(file, offset, (char *)buf, count, true);
+			if ((uint64_t)offset + count > inode->size)
+				inode->size = offset + count;
+			tmpfs_touch(inode);
+			file->offset = offset + count;
+		}
+	}
+	tmpfs_unlock();
+	return r;
+}
+
+static size_t tmpfs_read(struct file *f, void *buf, size_t count)
+{
+	AcquireSRWLockExclusive(&f->rw_lock);
+	struct tmpfs_file *file = (struct tmpfs_file *)f;
+	size_t r = tmpfs_pread_unsafe(file, buf, count, file->offset);
+	if ((intptr_t)r > 0)
+		file->offset += r;
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return r;
+}
+
+static size_t tmpfs_write(struct file *f, const void *buf, size_t count)
+{
+	AcquireSRWLockExclusive(&f->rw_lock);
+	struct tmpfs_file *file = (struct tmpfs_file *)f;
+	size_t r = tmpfs_pwrite_unsafe(file, buf, count, (f->flags & O_APPEND)? -1: file->offset);
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return r;
+}
+
+static size_t tmpfs_pread(struct file *f, void *buf, size_t count, loff_t offset)
+{
+	AcquireSRWLockExclusive(&f->rw_lock);
+	struct tmpfs_file *file = (struct tmpfs_file *)f;
+	size_t r = tmpfs_pread_unsafe(file, buf, count, offset);
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return r;
+}
+
+static size_t tmpfs_pwrite(struct file *f, const void *buf, size_t count, loff_t offset)
+{
+	if (offset < 0)
+		return -L_EINVAL;
+	AcquireSRWLockExclusive(&f->rw_lock);
+	struct tmpfs_file *file = (struct tmpfs_file *)f;
+	loff_t saved_offset = file->offset;
+	size_t r = tmpfs_pwrite_unsafe(file, buf, count, offset);
+	file->offset = saved_offset;
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return r;
+}
+
+static size_t tmpfs_readlink(struct file *f, char *buf, size_t bufsize)
+{
+	struct tmpfs_file *file = (struct tmpfs_file *)f;
+	struct tmpfs_inode *inode = file->inode;
+	if (!S_ISLNK(inode->mode))
+		return -L_EINVAL;
+	/* The target of a symlink never changes */
+	size_t r = min(bufsize, (size_t)inode->size);
+	memcpy(buf, inode->target, r);
+	return r;
+}
+
+static int tmpfs_truncate(struct file *f, loff_t length)
+{
+	struct tmpfs_file *file = (struct tmpfs_file *)f;
+	if (length < 0)
+		return -L_EINVAL;
+	if (S_ISDIR(file->inode->mode))
+		return -L_EISDIR;
+	if ((uint64_t)length > TMPFS_MAX_FILE_SIZE)
+		return -L_EFBIG;
+	AcquireSRWLockExclusive(&f->rw_lock);
+	tmpfs_lock();
+	int r = tmpfs_resize(file, file->inode, length);
+	tmpfs_unlock();
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return r;
+}
+
+static int tmpfs_fsync(struct file *f)
+{
+	return 0;
+}
+
+static int tmpfs_llseek(struct file *f, loff_t offset, loff_t *newoffset, int whence)
+{
+	struct tmpfs_file *file = (struct tmpfs_file *)f;
+	AcquireSRWLockExclusive(&f->rw_lock);
+	int r = 0;
+	loff_t target;
+	if (whence == SEEK_SET)
+		target = offset;
+	else if (whence == SEEK_CUR)
+		target = file->offset + offset;
+	else if (whence == SEEK_END)
+	{
+		tmpfs_lock();
+		target = file->inode->size + offset;
+		tmpfs_unlock();
+	}
+	else
+		r = -L_EINVAL;
+	if (r == 0 && target < 0)
+		r = -L_EINVAL;
+	if (r == 0)
+		*newoffset = file->offset = target;
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	return r;
+}
+
+static void tmpfs_fill_stat(struct tmpfs_inode *inode, int mp_key, struct newstat *buf)
+{
+	INIT_STRUCT_NEWSTAT_PADDING(buf);
+	buf->st_dev = mkdev(0, 64 + mp_key);
+	buf->st_ino = inode->ino;
+	buf->st_mode = inode->mode;
+	buf->st_nlink = S_ISDIR(inode->mode)? 2: inode->nlink;
+	buf->st_uid = 0;
+	buf->st_gid = 0;
+	buf->st_rdev = 0;
+	buf->st_size = S_ISDIR(inode->mode)? 0: inode->size;
+	buf->st_blksize = PAGE_SIZE;
+	buf->st_blocks = (buf->st_size + 511) / 512;
+	buf->st_atime = inode->atime.tv_sec;
+	buf->st_atime_nsec = inode->atime.tv_nsec;
+	buf->st_mtime = inode->mtime.tv_sec;
+	buf->st_mtime_nsec = inode->mtime.tv_nsec;
+	buf->st_ctime = inode->ctime.tv_sec;
+	buf->st_ctime_nsec = inode->ctime.tv_nsec;
+}
+
+static int tmpfs_stat(struct file *f, struct newstat *buf)
+{
+	struct tmpfs_file *file = (struct tmpfs_file *)f;
+	tmpfs_lock();
+	tmpfs_fill_stat(file->inode, file->mp_key, buf);
+	tmpfs_unlock();
+	return 0;
+}
+
+static int tmpfs_utimens(struct file *f, const struct timespec *times)
+{
+	struct tmpfs_file *file = (struct tmpfs_file *)f;
+	tmpfs_lock();
+	if (!times)
+	{
+		tmpfs_now(&file->inode->mtime);
+		file->inode->atime = file->inode->mtime;
+	}
+	else
+	{
+		file->inode->atime = times[0];
+		file->inode->mtime = times[1];
+	}
+	tmpfs_now(&file->inode->ctime);
+	tmpfs_unlock();
+	return 0;
+}
+
+static int tmpfs_getdents(struct file *f, void *dirent, size_t count, getdents_callback *fill_callback)
+{
+	struct tmpfs_file *file = (struct tmpfs_file *)f;
+	struct tmpfs_inode *inode = file->inode;
+	if (!S_ISDIR(inode->mode))
+		return -L_ENOTDIR;
+	AcquireSRWLockExclusive(&f->rw_lock);
+	tmpfs_lock();
+	intptr_t r = 0;
+	size_t size = 0;
+	char *buf = (char *)dirent;
+	/* The offset is the index of the next entry, "." and ".." come first */
+	struct tmpfs_inode *child = inode->children;
+	for (loff_t i = 2; i < file->offset && child; i++)
+		child = child->next;
+	for (;;)
+	{
+		const char *name;
+		int namelen;
+		uint64_t ino;
+		char type;
+		if (file->offset == 0)
+		{
+			name = ".";
+			namelen = 1;
+			ino = inode->ino;
+			type = DT_DIR;
+		}
+		else if (file->offset == 1)
+		{
+			name = "..";
+			namelen = 2;
+			ino = inode->parent? inode->parent->ino: inode->ino;
+			type = DT_DIR;
+		}
+		else if (child)
+		{
+			name = child->name;
+			namelen = child->namelen;
+			ino = child->ino;
+			if (S_ISDIR(child->mode))
+				type = DT_DIR;
+			else if (S_ISLNK(child->mode))
+				type = DT_LNK;
+			else
+				type = DT_REG;
+		}
+		else
+			break;
+		r = (*fill_callback)(buf, ino, name, namelen, type, count, GETDENTS_UTF8);
+		if (r < 0)
+			break;
+		count -= r;
+		size += r;
+		buf += r;
+		if (file->offset++ >= 2)
+			child = child->next;
+	}
+	tmpfs_unlock();
+	ReleaseSRWLockExclusive(&f->rw_lock);
+	if (r < 0 && r != GETDENTS_ERR_BUFFER_OVERFLOW)
+		return (int)r;
+	return (int)size;
+}
+
+static int tmpfs_statfs(struct file *f, struct statfs64 *buf)
+{
+	MEMORYSTATUSEX memory;
+	memory.dwLength = sizeof(memory);
+	GlobalMemoryStatusEx(&memory);
+	buf->f_type = TMPFS_MAGIC;
+	buf->f_bsize = PAGE_SIZE;
+	buf->f_blocks = memory.ullTotalPhys / PAGE_SIZE;
+	buf->f_bfree = memory.ullAvailPhys / PAGE_SIZE;
+	buf->f_bavail = memory.ullAvailPhys / PAGE_SIZE;
+	buf->f_files = 0;
+	buf->f_ffree = 0;
+	buf->f_fsid.val[0] = 0;
+	buf->f_fsid.val[1] = 0;
+	buf->f_namelen = TMPFS_NAME_MAX;
+	buf->f_frsize = 0;
+	buf->f_flags = 0;
+	buf->f_spare[0] = 0;
+	buf->f_spare[1] = 0;
+	buf->f_spare[2] = 0;
+	buf->f_spare[3] = 0;
+	return 0;
+}
+
+/* Open a new handle to the extent holding the given offset for mm, returns NULL beyond the last extent
+ * This is called from the page fault handler, which may run in the middle of a write() to the
+ * same file, so only the tmpfs mutex is taken, which is recursive.
+ */
+static HANDLE tmpfs_create_section(struct file *f, bool writable, loff_t offset, loff_t *section_start, loff_t *section_end)
+{
+	struct tmpfs_file *file = (struct tmpfs_file *)f;
+	struct tmpfs_inode *inode = file->inode;
+	HANDLE section = NULL;
+	tmpfs_lock();
+	if (S_ISREG(inode->mode))
+	{
+		uint64_t start = 0;
+		for (int i = 0; i < inode->extent_count; i++)
+		{
+			if ((uint64_t)offset < start + inode->extents[i].capacity)
+			{
+				ACCESS_MASK access = SECTION_MAP_READ | SECTION_MAP_EXECUTE | SECTION_QUERY;
+				if (writable)
+					access |= SECTION_MAP_WRITE;
+				NTSTATUS status = tmpfs_open_section(inode->ino, inode->version, i, 0, access, &section);
+				if (!NT_SUCCESS(status))
+				{
+					log_warning("tmpfs: Open extent %d of inode %d failed, status: %x", i, inode->ino, status);
+					section = NULL;
+				}
+				*section_start = start;
+				*section_end = start + inode->extents[i].capacity;
+				break;
+			}
+			start += inode->extents[i].capacity;
+		}
+	}
+	tmpfs_unlock();
+	return section;
+}
+
+static const struct file_ops tmpfs_ops =
+{
+	.close = tmpfs_close,
+	.getpath = tmpfs_getpath,
+	.read = tmpfs_read,
+	.write = tmpfs_write,
+	.pread = tmpfs_pread,
+	.pwrite = tmpfs_pwrite,
+	.readlink = tmpfs_readlink,
+	.truncate = tmpfs_truncate,
+	.fsync = tmpfs_fsync,
+	.llseek = tmpfs_llseek,
+	.stat = tmpfs_stat,
+	.utimens = tmpfs_utimens,
+	.getdents = tmpfs_getdents,
+	.statfs = tmpfs_statfs,
+	.create_section = tmpfs_create_section,
+};
+
+/* Caller holds the tmpfs mutex */
+static struct tmpfs_file *tmpfs_file_alloc(struct tmpfs_inode *inode, int mp_key, int flags)
+{
+	struct tmpfs_file *file = (struct tmpfs_file *)kmalloc(sizeof(struct tmpfs_file));
+	file_init(&file->base_file, &tmpfs_ops, flags);
+	file->inode = inode;
+	file->mp_key = mp_key;
+	file->offset = 0;
+	file->version = inode->version;
+	memset(file->sections, 0, sizeof(file->sections));
+	memset(file->views, 0, sizeof(file->views));
+	/* Hold the extents from now on, a removed file must stay readable while it is open */
+	if (S_ISREG(inode->mode) && !(flags & O_PATH))
+	{
+		for (int i = 0; i < inode->extent_count; i++)
+		{
+			NTSTATUS status = tmpfs_open_section(inode->ino, inode->version, i, 0, TMPFS_SECTION_ACCESS, &file->sections[i]);
+			if (!NT_SUCCESS(status))
+			{
+				log_warning("tmpfs: Open extent %d of inode %d failed, status: %x", i, inode->ino, status);
+				file->sections[i] = NULL;
+			}
+		}
+	}
+	inode->open_count++;
+	AcquireSRWLockExclusive(&tmpfs->files_lock);
+	list_add(&tmpfs->files, &file->list);
+	ReleaseSRWLockExclusive(&tmpfs->files_lock);
+	return file;
+}
+
+static int tmpfs_open(struct mount_point *mp, const char *path, int flags, int internal_flags, int mode, struct file **fp, char *target, int buflen)
+{
+	/* Unix sockets are backed by winfs special files */
+	if (internal_flags & INTERNAL_O_SPECIAL)
+		return -L_EPERM;
+	tmpfs_lock();
+	struct tmpfs_inode *parent, *inode;
+	const char *name;
+	int namelen;
+	int r = tmpfs_lookup(mp, path, &parent, &name, &namelen, &inode);
+	if (r < 0)
+		goto out;
+	if (!inode)
+	{
+		if (!(flags & O_CREAT))
+		{
+			r = -L_ENOENT;
+			goto out;
+		}
+		r = tmpfs_create(parent, name, namelen, S_IFREG | (mode & 07777), &inode);
+		if (r < 0)
+			goto out;
+	}
+	else if ((flags & O_CREAT) && (flags & O_EXCL))
+	{
+		r = -L_EEXIST;
+		goto out;
+	}
+	else if (S_ISLNK(inode->mode))
+	{
+		if (!(flags & O_NOFOLLOW))
+		{
+			if (inode->size >= (uint64_t)buflen)
+				r = -L_ENAMETOOLONG;
+			else
+			{
+				memcpy(target, inode->target, (size_t)inode->size + 1);
+				r = 1;
+			}
+			goto out;
+		}
+		if (!(flags & O_PATH))
+		{
+			log_info("Specified O_NOFOLLOW but not O_PATH, returning ELOOP.");
+			r = -L_ELOOP;
+			goto out;
+		}
+	}
+	else if (S_ISDIR(inode->mode))
+	{
+		if (!(flags & O_PATH) && (flags & O_ACCMODE) != O_RDONLY)
+		{
+			r = -L_EISDIR;
+			goto out;
+		}
+	}
+	else if (flags & O_DIRECTORY)
+	{
+		r = -L_ENOTDIR;
+		goto out;
+	}
+	if ((flags & O_TRUNC) && S_ISREG(inode->mode) && (flags & O_ACCMODE) != O_RDONLY && inode->size)
+		tmpfs_resize(NULL, inode, 0);
+	if (fp)
+		*fp = (struct file *)tmpfs_file_alloc(inode, mp->key, flags);
+out:
+	tmpfs_unlock();
+	return r;
+}
+
+static int tmpfs_stat_path(struct mount_point *mp, const char *pathname, struct newstat *buf)
+{
+	tmpfs_lock();
+	struct tmpfs_inode *parent, *inode;
+	const char *name;
+	int namelen;
+	int r = tmpfs_lookup(mp, pathname, &parent, &name, &namelen, &inode);
+	if (r == 0 && !inode)
+		r = -L_ENOENT;
+	else if (r == 0 && S_ISLNK(inode->mode))
+		r = -L_ENOSYS; /* Let vfs follow the symlink */
+	else if (r == 0)
+		tmpfs_fill_stat(inode, mp->key, buf);
+	tmpfs_unlock();
+	return r;
+}
+
+static int tmpfs_symlink(struct mount_point *mp, const char *target, const char *linkpath)
+{
+	int len = strlen(target);
+	if (len >= PATH_MAX)
+		return -L_ENAMETOOLONG;
+	tmpfs_lock();
+	struct tmpfs_inode *parent, *inode;
+	const char *name;
+	int namelen;
+	int r = tmpfs_lookup(mp, linkpath, &parent, &name, &namelen, &inode);
+	if (r == 0 && inode)
+		r = -L_EEXIST;
+	if (r < 0)
+		goto out;
+	char *buf = (char *)kmalloc_shared(len + 1);
+	if (!buf)
+	{
+		r = -L_ENOSPC;
+		goto out;
+	}
+	memcpy(buf, target, len + 1);
+	r = tmpfs_create(parent, name, namelen, S_IFLNK | 0777, &inode);
+	if (r < 0)
+	{
+		kfree_shared(buf, len + 1);
+		goto out;
+	}
+	inode->target = buf;
+	inode->size = len;
+out:
+	tmpfs_unlock();
+	return r;
+}
+
+static int tmpfs_unlink(struct mount_point *mp, const char *pathname)
+{
+	tmpfs_lock();
+	struct tmpfs_inode *parent, *inode;
+	const char *name;
+	int namelen;
+	int r = tmpfs_lookup(mp, pathname, &parent, &name, &namelen, &inode);
+	if (r == 0 && !inode)
+		r = -L_ENOENT;
+	else if (r == 0 && !parent)
+		r = -L_EBUSY;
+	else if (r == 0 && S_ISDIR(inode->mode))
+		r = -L_EISDIR;
+	else if (r == 0)
+		tmpfs_remove(inode);
+	tmpfs_unlock();
+	return r;
+}
+
+static int tmpfs_rename(struct mount_point *mp, struct file *f, const char *newpath)
+{
+	if (!tmpfs_is_tmpfile(f) || ((struct tmpfs_file *)f)->mp_key != mp->key)
+		return -L_EXDEV;
+	struct tmpfs_inode *src = ((struct tmpfs_file *)f)->inode;
+	tmpfs_lock();
+	struct tmpfs_inode *parent, *inode;
+	const char *name;
+	int namelen;
+	int r = tmpfs_lookup(mp, newpath, &parent, &name, &namelen, &inode);
+	if (r < 0 || inode == src)
+		goto out;
+	if (!src->parent || !parent)
+	{
+		r = src->nlink? -L_EBUSY: -L_ENOENT;
+		goto out;
+	}
+	if (S_ISDIR(src->mode))
+	{
+		/* A directory can not be moved into itself */
+		for (struct tmpfs_inode *dir = parent; dir; dir = dir->parent)
+			if (dir == src)
+			{
+				r = -L_EINVAL;
+				goto out;
+			}
+	}
+	if (inode)
+	{
+		if (S_ISDIR(inode->mode) && !S_ISDIR(src->mode))
+			r = -L_EISDIR;
+		else if (!S_ISDIR(inode->mode) && S_ISDIR(src->mode))
+			r = -L_ENOTDIR;
+		else if (S_ISDIR(inode->mode) && inode->children)
+			r = -L_ENOTEMPTY;
+		if (r < 0)
+			goto out;
+	}
+	char *newname = (char *)kmalloc_shared(namelen + 1);
+	if (!newname)
+	{
+		r = -L_ENOSPC;
+		goto out;
+	}
+	memcpy(newname, name, namelen);
+	newname[namelen] = 0;
+	if (inode)
+		tmpfs_remove(inode);
+	tmpfs_unlink_child(src);
+	kfree_shared(src->name, src->namelen + 1);
+	src->name = newname;
+	src->namelen = namelen;
+	tmpfs_link_child(parent, src);
+	tmpfs_now(&src->ctime);
+out:
+	tmpfs_unlock();
+	return r;
+}
+
+static int tmpfs_mkdir(struct mount_point *mp, const char *pathname, int mode)
+{
+	tmpfs_lock();
+	struct tmpfs_inode *parent, *inode;
+	const char *name;
+	int namelen;
+	int r = tmpfs_lookup(mp, pathname, &parent, &name, &namelen, &inode);
+	if (r == 0 && inode)
+		r = -L_EEXIST;
+	else if (r == 0)
+		r = tmpfs_create(parent, name, namelen, S_IFDIR | (mode & 07777), &inode);
+	tmpfs_unlock();
+	return r;
+}
+
+static int tmpfs_rmdir(struct mount_point *mp, const char *pathname)
+{
+	tmpfs_lock();
+	struct tmpfs_inode *parent, *inode;
+	const char *name;
+	int namelen;
+	int r = tmpfs_lookup(mp, pathname, &parent, &name, &namelen, &inode);
+	if (r == 0 && !inode)
+		r = -L_ENOENT;
+	else if (r == 0 && !S_ISDIR(inode->mode))
+		r = -L_ENOTDIR;
+	else if (r == 0 && !parent)
+		r = -L_EBUSY;
+	else if (r == 0 && inode->children)
+		r = -L_ENOTEMPTY;
+	else if (r == 0)
+		tmpfs_remove(inode);
+	tmpfs_unlock();
+	return r;
+}
+
+struct file_system *tmpfs_alloc()
+{
+	tmpfs = (struct tmpfs *)kmalloc(sizeof(struct tmpfs));
+	tmpfs->base_fs.open = tmpfs_open;
+	tmpfs->base_fs.stat = tmpfs_stat_path;
+	tmpfs->base_fs.symlink = tmpfs_symlink;
+	tmpfs->base_fs.link = NULL;
+	tmpfs->base_fs.unlink = tmpfs_unlink;
+	tmpfs->base_fs.rename = tmpfs_rename;
+	tmpfs->base_fs.mkdir = tmpfs_mkdir;
+	tmpfs->base_fs.rmdir = tmpfs_rmdir;
+	tmpfs->start_time = tmpfs_get_start_time(GetCurrentProcess());
+	InitializeSRWLock(&tmpfs->files_lock);
+	list_init(&tmpfs->files);
+	tmpfs_shared = (struct tmpfs_shared_data *)shared_alloc(sizeof(struct tmpfs_shared_data));
+	UNICODE_STRING name;
+	RtlInitUnicodeString(&name, L"tmpfs_mutex");
+	OBJECT_ATTRIBUTES oa;
+	InitializeObjectAttributes(&oa, &name, OBJ_INHERIT | OBJ_OPENIF, shared_get_object_directory(), NULL);
+	NTSTATUS status = NtCreateMutant(&tmpfs->mutex, MUTANT_ALL_ACCESS, &oa, FALSE);
+	if (!NT_SUCCESS(status))
+	{
+		log_error("tmpfs: Create tmpfs mutex failed, status: %x", status);
+		__debugbreak();
+	}
+	return (struct file_system *)tmpfs;
+}
+
+int tmpfs_is_tmpfile(struct file *f)
+{
+	return f->op_vtable == &tmpfs_ops;
+}
+
+void tmpfs_fork()
+{
+	/* The child gets a copy of every open file, including those held by mm or as the cwd
+	 * Keep the list stable until the heap is copied.
+	 */
+	AcquireSRWLockShared(&tmpfs->files_lock);
+	tmpfs_lock();
+	struct list_node *cur;
+	list_iterate(&tmpfs->files, cur)
+		list_entry(cur, struct tmpfs_file, list)->inode->open_count++;
+	tmpfs_unlock();
+}
+
+void tmpfs_afterfork_parent()
+{
+	ReleaseSRWLockShared(&tmpfs->files_lock);
+}
+
+void tmpfs_afterfork_child(struct file_system *fs)
+{
+	tmpfs = (struct tmpfs *)fs;
+	tmpfs_shared = (struct tmpfs_shared_data *)shared_alloc(sizeof(struct tmpfs_shared_data));
+	tmpfs->start_time = tmpfs_get_start_time(GetCurrentProcess());
+	InitializeSRWLock(&tmpfs->files_lock);
+	/* Section handles are inherited but the views are not */
+	struct list_node *cur;
+	list_iterate(&tmpfs->files, cur)
+	{
+		struct tmpfs_file *file = list_entry(cur, struct tmpfs_file, list);
+		InitializeSRWLock(&file->base_file.rw_lock);
+		memset(file->views, 0, sizeof(file->views));
+	}
+}
+
+/* Next inode in depth first order in the tree of root */
+static struct tmpfs_inode *tmpfs_walk_next(struct tmpfs_inode *inode)
+{
+	if (S_ISDIR(inode->mode) && inode->children)
+		return inode->children;
+	while (inode && !inode->next)
+		inode = inode->parent;
+	return inode? inode->next: NULL;
+}
+
+void tmpfs_shutdown()
+{
+	tmpfs_lock();
+	struct list_node *cur;
+	list_iterate(&tmpfs->files, cur)
+		tmpfs_inode_put(list_entry(cur, struct tmpfs_file, list)->inode);
+	/* Find the nearest living ancestor to take over our extents */
+	HANDLE heir = NULL;
+	DWORD heir_win_pid = 0;
+	for (pid_t pid = process_get_ppid(process_get_pid()); pid > 0 && !heir; pid = process_get_ppid(pid))
+	{
+		heir_win_pid = process_get_win_pid(pid);
+		if (heir_win_pid)
+			heir = OpenProcess(PROCESS_DUP_HANDLE | PROCESS_QUERY_LIMITED_INFORMATION, FALSE, heir_win_pid);
+	}
+	uint64_t heir_start_time = heir? tmpfs_get_start_time(heir): 0;
+	DWORD win_pid = GetCurrentProcessId();
+	for (int i = 0; i < TMPFS_MAX_MOUNTS; i++)
+	{
+		if (!tmpfs_shared->roots[i])
+			continue;
+		for (struct tmpfs_inode *inode = tmpfs_shared->roots[i]; inode; inode = tmpfs_walk_next(inode))
+		{
+			if (!S_ISREG(inode->mode))
+				continue;
+			for (int j = 0; j < inode->extent_count; j++)
+			{
+				struct tmpfs_extent *extent = &inode->extents[j];
+				if (!extent->keeper_handle || extent->keeper_win_pid != win_pid)
+					continue;
+				HANDLE handle;
+				if (heir && DuplicateHandle(GetCurrentProcess(), extent->keeper_handle, heir, &handle, 0, FALSE,
+					DUPLICATE_SAME_ACCESS | DUPLICATE_CLOSE_SOURCE))
+				{
+					extent->keeper_handle = handle;
+					extent->keeper_win_pid = heir_win_pid;
+					extent->keeper_start_time = heir_start_time;
+				}
+				else
+				{
+					log_warning("tmpfs: No process left to keep the data of inode %d.", inode->ino);
+					tmpfs_release_keeper(extent);
+				}
+			}
+		}
+	}
+	if (heir)
+		CloseHandle(heir);
+	tmpfs_unlock();
+}
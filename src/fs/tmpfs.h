@@ -0,0 +1,31 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <fs/file.h>
+
+struct file_system *tmpfs_alloc();
+int tmpfs_is_tmpfile(struct file *f);
+/* Called by vfs on fork, for all tmpfs files of the process including those not in the fd table */
+void tmpfs_fork();
+void tmpfs_afterfork_parent();
+void tmpfs_afterfork_child(struct file_system *fs);
+/* Drop the files of the exiting process and pass the data it keeps alive on to an ancestor */
+void tmpfs_shutdown();
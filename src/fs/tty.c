@@ -0,0 +1,247 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <common/signal.h>
+#include <fs/tty.h>
+
+#include <string.h>
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+void tty_init_termios(struct termios *termios)
+{
+	termios->c_iflag = ICRNL | IUTF8;
+	termios->c_oflag = OPOST | ONLCR;
+	termios->c_cflag = B38400 | CS8 | CREAD;
+	termios->c_lflag = ISIG | ICANON | ECHO | ECHOE | ECHOK | ECHOCTL | ECHOKE | IEXTEN;
+	termios->c_line = 0;
+	memset(termios->c_cc, 0, sizeof(termios->c_cc));
+	termios->c_cc[VINTR] = 3;
+	termios->c_cc[VQUIT] = 034;
+	termios->c_cc[VERASE] = 0177;
+	termios->c_cc[VKILL] = 025;
+	termios->c_cc[VEOF] = 4;
+	termios->c_cc[VMIN] = 1;
+	termios->c_cc[VSTART] = 021;
+	termios->c_cc[VSTOP] = 023;
+	termios->c_cc[VSUSP] = 032;
+	termios->c_cc[VREPRINT] = 022;
+	termios->c_cc[VDISCARD] = 017;
+	termios->c_cc[VWERASE] = 027;
+	termios->c_cc[VLNEXT] = 026;
+}
+
+void tty_input_init(struct tty_input *in)
+{
+	in->head = in->canon_head = in->tail = 0;
+	in->eof = 0;
+}
+
+size_t tty_input_available(const struct tty_input *in)
+{
+	return in->canon_head - in->tail;
+}
+
+size_t tty_input_free(const struct tty_input *in)
+{
+	return TTY_INPUT_SIZE - (in->head - in->tail);
+}
+
+void tty_input_put(struct tty_input *in, const char *str, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+		in->buffer[in->head++ & (TTY_INPUT_SIZE - 1)] = str[i];
+}
+
+size_t tty_input_take(struct tty_input *in, char *buf, size_t count)
+{
+	size_t r = min(count, tty_input_available(in));
+	size_t start = in->tail & (TTY_INPUT_SIZE - 1);
+	size_t first = min(r, TTY_INPUT_SIZE - start);
+	memcpy(buf, in->buffer + start, first);
+	memcpy(buf + first, in->buffer, r - first);
+	in->tail += r;
+	return r;
+}
+
+void tty_input_commit(struct tty_input *in)
+{
+	in->canon_head = in->head;
+}
+
+bool tty_input_erase(struct tty_input *in)
+{
+	if (in->head == in->canon_head)
+		return false;
+	char c;
+	do
+		c = in->buffer[--in->head & (TTY_INPUT_SIZE - 1)];
+	while ((c & 0xC0) == 0x80 && in->head > in->canon_head);
+	return true;
+}
+
+void tty_input_flush(struct tty_input *in)
+{
+	in->head = in->canon_head = in->tail;
+	in->eof = 0;
+}
+
+void tty_input_update_termios(struct tty_input *in, const struct termios *termios)
+{
+	/* The line being edited becomes readable when leaving canonical mode */
+	if (!(termios->c_lflag & ICANON))
+		tty_input_commit(in);
+}
+
+static char tty_input_last(const struct tty_input *in)
+{
+	return in->buffer[(in->head - 1) & (TTY_INPUT_SIZE - 1)];
+}
+
+static void tty_echo_char(const struct termios *termios, char ch, tty_echo_callback *echo, void *data)
+{
+	if ((termios->c_lflag & ECHOCTL) && ((unsigned char)ch < 0x20 || ch == 0x7F) && ch != '\t' && ch != '\n')
+	{
+		char buf[2] = { '^', ch == 0x7F ? '?' : ch + 0x40 };
+		echo(data, buf, 2);
+	}
+	else
+		echo(data, &ch, 1);
+}
+
+static void tty_echo_erase(const struct termios *termios, tty_echo_callback *echo, void *data)
+{
+	if (termios->c_lflag & ECHO)
+		echo(data, "\b \b", 3);
+}
+
+int tty_input_char(struct tty_input *in, const struct termios *termios, char ch, tty_echo_callback *echo, void *data)
+{
+	tcflag_t lflag = termios->c_lflag;
+	const cc_t *cc = termios->c_cc;
+	if (termios->c_iflag & ISTRIP)
+		ch &= 0x7F;
+	if (ch == '\r')
+	{
+		if (termios->c_iflag & IGNCR)
+			return 0;
+		if (termios->c_iflag & ICRNL)
+			ch = '\n';
+	}
+	else if (ch == '\n' && (termios->c_iflag & INLCR))
+		ch = '\r';
+	/* A zero control character means the function is disabled */
+	cc_t c = (cc_t)ch;
+	if ((lflag & ISIG) && c)
+	{
+		int sig = 0;
+		if (c == cc[VINTR])
+			sig = SIGINT;
+		else if (c == cc[VQUIT])
+			sig = SIGQUIT;
+		else if (c == cc[VSUSP])
+			sig = SIGTSTP;
+		if (sig)
+		{
+			if (!(lflag & NOFLSH))
+				tty_input_flush(in);
+			if (lflag & ECHO)
+				tty_echo_char(termios, ch, echo, data);
+			return sig;
+		}
+	}
+	if (lflag & ICANON)
+	{
+		if (c && c == cc[VERASE])
+		{
+			if (tty_input_erase(in))
+				tty_echo_erase(termios, echo, data);
+			return 0;
+		}
+		if (c && c == cc[VKILL])
+		{
+			while (tty_input_erase(in))
+				tty_echo_erase(termios, echo, data);
+			return 0;
+		}
+		if (c && c == cc[VWERASE] && (lflag & IEXTEN))
+		{
+			while (in->head > in->canon_head && (tty_input_last(in) == ' ' || tty_input_last(in) == '\t'))
+				if (tty_input_erase(in))
+					tty_echo_erase(termios, echo, data);
+			while (in->head > in->canon_head && tty_input_last(in) != ' ' && tty_input_last(in) != '\t')
+				if (tty_input_erase(in))
+					tty_echo_erase(termios, echo, data);
+			return 0;
+		}
+		if (c && c == cc[VEOF])
+		{
+			if (in->head == in->canon_head)
+				in->eof = 1;
+			tty_input_commit(in);
+			return 0;
+		}
+		if (ch == '\n' || (c && (c == cc[VEOL] || c == cc[VEOL2])))
+		{
+			if (tty_input_free(in) > 0)
+				tty_input_put(in, &ch, 1);
+			tty_input_commit(in);
+			if ((lflag & ECHO) || (ch == '\n' && (lflag & ECHONL)))
+				tty_echo_char(termios, ch, echo, data);
+			return 0;
+		}
+		/* A byte is always reserved for the line delimiter */
+		if (tty_input_free(in) > 1)
+		{
+			tty_input_put(in, &ch, 1);
+			if (lflag & ECHO)
+				tty_echo_char(termios, ch, echo, data);
+		}
+		return 0;
+	}
+	if (tty_input_free(in) > 0)
+	{
+		tty_input_put(in, &ch, 1);
+		tty_input_commit(in);
+		if (lflag & ECHO)
+			tty_echo_char(termios, ch, echo, data);
+	}
+	return 0;
+}
+
+int tty_output_char(const struct termios *termios, char ch, char *out)
+{
+	if (termios->c_oflag & OPOST)
+	{
+		if (ch == '\n' && (termios->c_oflag & ONLCR))
+		{
+			out[0] = '\r';
+			out[1] = '\n';
+			return 2;
+		}
+		if (ch == '\r' && (termios->c_oflag & OCRNL))
+		{
+			out[0] = '\n';
+			return 1;
+		}
+	}
+	out[0] = ch;
+	return 1;
+}
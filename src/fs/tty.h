@@ -0,0 +1,66 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <common/termios.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Terminal line discipline shared by the console and pseudo terminals
+ * Input goes through a ring buffer. Bytes in [tail, canon_head) are ready for reading, bytes in
+ * [canon_head, head) form the line being edited in canonical mode. In non canonical mode both
+ * heads are always equal. The positions are free running and masked on access. The structure
+ * lives in memory shared by all processes using the terminal, so it holds no pointers.
+ */
+#define TTY_INPUT_SIZE		65536 /* must be a power of 2 */
+
+struct tty_input
+{
+	size_t head, canon_head, tail;
+	int eof; /* An end of file character terminated an empty line */
+	char buffer[TTY_INPUT_SIZE];
+};
+
+void tty_init_termios(struct termios *termios);
+
+void tty_input_init(struct tty_input *in);
+size_t tty_input_available(const struct tty_input *in);
+size_t tty_input_free(const struct tty_input *in);
+void tty_input_put(struct tty_input *in, const char *str, size_t size);
+size_t tty_input_take(struct tty_input *in, char *buf, size_t count);
+/* Make the line being edited readable */
+void tty_input_commit(struct tty_input *in);
+/* Erase the last UTF-8 character of the line being edited, returns false if the line is empty */
+bool tty_input_erase(struct tty_input *in);
+void tty_input_flush(struct tty_input *in);
+/* Called after the termios settings are changed */
+void tty_input_update_termios(struct tty_input *in, const struct termios *termios);
+
+/* Process one input byte of a byte oriented terminal according to termios
+ * Echoed bytes are passed to echo(). Returns the signal to send to the foreground process group
+ * if the byte is a signal character, 0 otherwise.
+ */
+typedef void tty_echo_callback(void *data, const char *buf, size_t count);
+int tty_input_char(struct tty_input *in, const struct termios *termios, char ch, tty_echo_callback *echo, void *data);
+
+/* Output post processing, returns the number of bytes written to out, which holds at least 2 bytes */
+int tty_output_char(const struct termios *termios, char ch, char *out);
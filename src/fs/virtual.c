@@ -17,6 +17,8 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_VFS
+
 #include <common/errno.h>
 #include <common/fcntl.h>
 #include <common/fs.h>
@@ -158,10 +160,10 @@ static int virtualfs_directory_getdents(struct file *f, void *dirent, size_t cou
 				for (;;)
 				{
 					int next_tag = file->desc->entries[i].iter(file->tag, file->iter_tag, &type, dynamic_name, sizeof(dynamic_name));
-					r = (*fill_callback)(buf, file->position, dynamic_name, strlen(dynamic_name), type, count, GETDENTS_UTF8);
+					/* No entry is returned with VIRTUALFS_ITER_END */
 					if (next_tag == VIRTUALFS_ITER_END)
 						break;
-					file->iter_tag = next_tag;
+					r = (*fill_callback)(buf, file->position, dynamic_name, strlen(dynamic_name), type, count, GETDENTS_UTF8);
 					if (r < 0)
 					{
 						file->desc->entries[i].end_iter(file->tag);
@@ -329,29 +331,141 @@ static struct file *virtualfs_char_alloc(struct virtualfs_char_desc *desc, int t
 	return (struct file *)file;
 }
 
+struct virtualfs_text_data
+{
+	volatile LONG refs;
+	int len;
+	char text[];
+};
+
+static void virtualfs_text_data_release(struct virtualfs_text_data *data)
+{
+	if (InterlockedDecrement(&data->refs) == 0)
+		kfree(data, sizeof(struct virtualfs_text_data) + data->len + 1);
+}
+
+/* Descs which have cached a text, they stay listed after their text is dropped */
+static struct virtualfs_text_desc *virtualfs_text_cached;
+static SRWLOCK virtualfs_text_cached_lock = SRWLOCK_INIT;
+
+size_t virtualfs_cache_size()
+{
+	size_t size = 0;
+	AcquireSRWLockShared(&virtualfs_text_cached_lock);
+	for (struct virtualfs_text_desc *desc = virtualfs_text_cached; desc; desc = desc->cache_next)
+	{
+		AcquireSRWLockShared(&desc->cache_lock);
+		if (desc->cache)
+			size += sizeof(struct virtualfs_text_data) + desc->cache->len + 1;
+		ReleaseSRWLockShared(&desc->cache_lock);
+	}
+	ReleaseSRWLockShared(&virtualfs_text_cached_lock);
+	return size;
+}
+
+void virtualfs_cache_shrink(size_t target)
+{
+	size_t size = virtualfs_cache_size();
+	AcquireSRWLockShared(&virtualfs_text_cached_lock);
+	for (struct virtualfs_text_desc *desc = virtualfs_text_cached; desc && size > target; desc = desc->cache_next)
+	{
+		AcquireSRWLockExclusive(&desc->cache_lock);
+		struct virtualfs_text_data *data = desc->cache;
+		desc->cache = NULL;
+		ReleaseSRWLockExclusive(&desc->cache_lock);
+		/* Files still open keep their reference */
+		if (data)
+		{
+			size -= min(size, sizeof(struct virtualfs_text_data) + data->len + 1);
+			virtualfs_text_data_release(data);
+		}
+	}
+	ReleaseSRWLockShared(&virtualfs_text_cached_lock);
+}
+
+/* Get the text of a file, regenerated only if it is not cached or the underlying state has changed */
+static struct virtualfs_text_data *virtualfs_text_get(struct virtualfs_text_desc *desc, int tag)
+{
+	uint32_t version;
+	bool versioned = desc->getversion && desc->getversion(tag, &version);
+	struct virtualfs_text_data *data = NULL;
+	if (versioned)
+	{
+		AcquireSRWLockShared(&desc->cache_lock);
+		if (desc->cache && desc->cache_tag == tag && desc->cache_version == version)
+		{
+			data = desc->cache;
+			InterlockedIncrement(&data->refs);
+		}
+		ReleaseSRWLockShared(&desc->cache_lock);
+		if (data)
+			return data;
+	}
+	/* The version is taken before generating, a change in between only causes another regeneration */
+	char buf[65536];
+	int len = desc->gettext(tag, buf);
+	if (len < 0)
+		return NULL;
+	data = (struct virtualfs_text_data *)kmalloc(sizeof(struct virtualfs_text_data) + len + 1);
+	data->refs = 1;
+	data->len = len;
+	memcpy(data->text, buf, len);
+	data->text[len] = 0;
+	if (versioned)
+	{
+		InterlockedIncrement(&data->refs);
+		AcquireSRWLockExclusive(&desc->cache_lock);
+		struct virtualfs_text_data *old = desc->cache;
+		desc->cache = data;
+		desc->cache_tag = tag;
+		desc->cache_version = version;
+		ReleaseSRWLockExclusive(&desc->cache_lock);
+		if (old)
+			virtualfs_text_data_release(old);
+		else if (!InterlockedExchange(&desc->cache_listed, 1))
+		{
+			AcquireSRWLockExclusive(&virtualfs_text_cached_lock);
+			desc->cache_next = virtualfs_text_cached;
+			virtualfs_text_cached = desc;
+			ReleaseSRWLockExclusive(&virtualfs_text_cached_lock);
+		}
+	}
+	return data;
+}
+
 struct virtualfs_text
 {
 	struct file base_file;
 	int position;
-	int buflen;
-	int textlen;
-	char text[];
+	struct virtualfs_text_data *data;
 };
 
 static int virtualfs_text_close(struct file *f)
 {
 	struct virtualfs_text *file = (struct virtualfs_text *)f;
-	kfree(file, sizeof(struct virtualfs_text) + file->buflen);
+	virtualfs_text_data_release(file->data);
+	kfree(file, sizeof(struct virtualfs_text));
 	return 0;
 }
 
+static size_t virtualfs_text_pread(struct file *f, void *buf, size_t count, loff_t offset)
+{
+	struct virtualfs_text *file = (struct virtualfs_text *)f;
+	if (offset < 0)
+		return -L_EINVAL;
+	if (offset >= file->data->len)
+		return 0;
+	size_t read_count = min(count, (size_t)(file->data->len - offset));
+	memcpy(buf, file->data->text + offset, read_count);
+	return read_count;
+}
+
 static size_t virtualfs_text_read(struct file *f, void *buf, size_t count)
 {
 	AcquireSRWLockExclusive(&f->rw_lock);
 	struct virtualfs_text *file = (struct virtualfs_text *)f;
-	int read_count = (int)min(count, (size_t)(file->textlen - file->position));
-	memcpy(buf, file->text + file->position, read_count);
-	file->position += read_count;
+	size_t read_count = virtualfs_text_pread(f, buf, count, file->position);
+	file->position += (int)read_count;
 	ReleaseSRWLockExclusive(&f->rw_lock);
 	return read_count;
 }
@@ -366,10 +480,10 @@ static int virtualfs_text_llseek(struct file *f, loff_t offset, loff_t *newoffse
 	{
 	case SEEK_SET: target = offset; break;
 	case SEEK_CUR: target = file->position + offset; break;
-	case SEEK_END: target = file->textlen - offset; break;
+	case SEEK_END: target = file->data->len + offset; break;
 	default: r = -L_EINVAL; goto out;
 	}
-	if (target >= 0 && target < file->textlen)
+	if (target >= 0 && target <= file->data->len)
 	{
 		file->position = (int)target;
 		*newoffset = target;
@@ -408,22 +522,19 @@ static const struct file_ops virtualfs_text_ops =
 {
 	.close = virtualfs_text_close,
 	.read = virtualfs_text_read,
+	.pread = virtualfs_text_pread,
 	.llseek = virtualfs_text_llseek,
 	.stat = virtualfs_text_stat,
 };
 
 static struct file *virtualfs_text_alloc(struct virtualfs_text_desc *desc, int tag)
 {
-	char buf[65536];
-	int len = desc->gettext(tag, buf);
-	if (len < 0)
+	struct virtualfs_text_data *data = virtualfs_text_get(desc, tag);
+	if (!data)
 		return NULL;
-	struct virtualfs_text *file = (struct virtualfs_text *)kmalloc(sizeof(struct virtualfs_text) + len + 1);
+	struct virtualfs_text *file = (struct virtualfs_text *)kmalloc(sizeof(struct virtualfs_text));
 	file_init(&file->base_file, &virtualfs_text_ops, O_RDONLY);
-	file->textlen = len;
-	memcpy(file->text, buf, len);
-	file->text[len] = 0;
-	file->buflen = len;
+	file->data = data;
 	file->position = 0;
 	return (struct file *)file;
 }
@@ -505,13 +616,41 @@ static size_t virtualfs_param_write(struct file *f, const void *buf, size_t coun
 		break;
 	}
 	case VIRTUALFS_PARAM_TYPE_INT:
-	{
-		log_error("Write to VIRTUALFS_PARAM_INT not implemented.");
-		break;
-	}
 	case VIRTUALFS_PARAM_TYPE_UINT:
 	{
-		log_error("Write to VIRTUALFS_PARAM_UINT not implemented.");
+		/* A number optionally followed by white space, as written by echo */
+		const char *text = (const char *)buf;
+		char nbuf[32];
+		size_t len = count;
+		while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == ' ' || text[len - 1] == '\t'))
+			len--;
+		if (len == 0 || len >= sizeof(nbuf))
+		{
+			r = -L_EINVAL;
+			goto out;
+		}
+		memcpy(nbuf, text, len);
+		nbuf[len] = 0;
+		if (file->desc->valtype == VIRTUALFS_PARAM_TYPE_INT)
+		{
+			int value;
+			if (!file->desc->set_int || !katoi(nbuf, &value))
+			{
+				r = -L_EINVAL;
+				goto out;
+			}
+			file->desc->set_int(file->tag, value);
+		}
+		else
+		{
+			unsigned int value;
+			if (!file->desc->set_uint || !katou(nbuf, &value))
+			{
+				r = -L_EINVAL;
+				goto out;
+			}
+			file->desc->set_uint(file->tag, value);
+		}
 		break;
 	}
 	default:
@@ -627,7 +766,7 @@ do_component:;
 		case VIRTUALFS_TYPE_CUSTOM:
 		{
 			struct virtualfs_custom_desc *desc = (struct virtualfs_custom_desc *)base_desc;
-			*p = desc->alloc();
+			*p = desc->alloc_tag ? desc->alloc_tag(tag) : desc->alloc();
 			if (*p == NULL)
 				return -L_ENOENT;
 			return 0;
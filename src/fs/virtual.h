@@ -78,12 +78,14 @@ struct virtualfs_directory_desc
 /* To use this desc, implement a custom file allocation function.
  * Call virtualfs_custom_file_init() in it.
  * Set the file_ops.stat vptr to virtualfs_custom_file_stat().
+ * Use VIRTUALFS_CUSTOM_TAG() if the allocation function needs the tag of a dynamic entry.
  */
 struct virtualfs_custom_desc
 {
 	int type;
 	int device;
 	struct file *(*alloc)();
+	struct file *(*alloc_tag)(int tag);
 };
 #define VIRTUALFS_CUSTOM(_device, _alloc) \
 	{ \
@@ -91,6 +93,12 @@ struct virtualfs_custom_desc
 		.device = _device, \
 		.alloc = _alloc, \
 	}
+#define VIRTUALFS_CUSTOM_TAG(_device, _alloc_tag) \
+	{ \
+		.type = VIRTUALFS_TYPE_CUSTOM, \
+		.device = _device, \
+		.alloc_tag = _alloc_tag, \
+	}
 
 /* VIRTUALFS_TYPE_CHAR */
 struct virtualfs_char_desc
@@ -109,16 +117,36 @@ struct virtualfs_char_desc
 	}
 
 /* VIRTUALFS_TYPE_TEXT */
+/* The text is generated on open, and shared by all opened instances while it stays the same.
+ * If getversion() is given and returns true, the last generated text is kept and reused as
+ * long as the tag and the version of the underlying state do not change.
+ */
+struct virtualfs_text_data;
 struct virtualfs_text_desc
 {
 	int type;
 	int (*gettext)(int tag, char *buf);
+	bool (*getversion)(int tag, uint32_t *version);
+	/* Cached text, only used with getversion() */
+	SRWLOCK cache_lock;
+	int cache_tag;
+	uint32_t cache_version;
+	struct virtualfs_text_data *cache;
+	/* Link in the list of descs which have cached a text, see virtualfs_cache_shrink() */
+	volatile LONG cache_listed;
+	struct virtualfs_text_desc *cache_next;
 };
 #define VIRTUALFS_TEXT(_gettext) \
 	{ \
 		.type = VIRTUALFS_TYPE_TEXT, \
 		.gettext = _gettext, \
 	}
+#define VIRTUALFS_TEXT_VERSIONED(_gettext, _getversion) \
+	{ \
+		.type = VIRTUALFS_TYPE_TEXT, \
+		.gettext = _gettext, \
+		.getversion = _getversion, \
+	}
 
 /* VIRTUALFS_TYPE_PARAM */
 #define VIRTUALFS_PARAM_TYPE_RAW		0
@@ -168,5 +196,9 @@ int virtualfs_get_poll_status_inout(struct file *f); /* get_poll_status: Always
 void virtualfs_custom_init(void *file, struct virtualfs_desc *desc);
 int virtualfs_custom_stat(struct file *f, struct newstat *buf);
 
+/* Shrinker of the cached texts of versioned files, see cache.h */
+size_t virtualfs_cache_size();
+void virtualfs_cache_shrink(size_t target);
+
 /* File system calls */
 struct file_system *virtualfs_alloc(const char *mountpoint, const struct virtualfs_directory_desc *dir);
@@ -17,33 +17,80 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_VFS
+
 #include <common/errno.h>
+#include <common/fadvise.h>
+#include <common/falloc.h>
 #include <common/fcntl.h>
 #include <common/fs.h>
 #include <fs/winfs.h>
 #include <syscall/mm.h>
+#include <syscall/sig.h>
 #include <syscall/vfs.h>
 #include <datetime.h>
 #include <heap.h>
 #include <log.h>
 #include <str.h>
+#include <win7compat.h>
 
 #include <ntdll.h>
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#include <winioctl.h>
 #include <limits.h>
 #include <malloc.h>
 
+/* Size of the read buffer and the largest read() which allocates it, see winfs_read_buffered() */
+#define WINFS_READ_BUFFER_SIZE	65536
+#define WINFS_READ_BUFFER_SMALL	4096
+
 struct winfs_file
 {
 	struct file base_file;
 	HANDLE handle;
 	HANDLE fp_mutex; /* Mutex for guarding file pointer */
+	HANDLE pos_handle; /* Asynchronous handle without file pointer for pread()/pwrite(), INVALID_HANDLE_VALUE if not available */
 	int restart_scan; /* for getdents() */
 	int mp_key; /* Mount point key */
 	char drive_letter; /* DOS drive letter where this file resides in */
+	uint64_t file_id; /* NTFS file ID, queried on first use by the directory entry cache */
+	SRWLOCK locks_lock;
+	struct winfs_lock *locks; /* Advisory locks held through pos_handle, see winfs_setlk() */
+	uint32_t direct_align; /* O_DIRECT only: required alignment of buffers, offsets and sizes */
+	/* Read buffer for small sequential reads, see winfs_read_buffered() */
+	char *read_buffer;
+	int read_buffer_pos, read_buffer_len;
+	LONG read_buffer_generation; /* Value of the winfs generation when the buffer was filled */
+	int small_reads;
+	bool read_buffer_disabled;
 };
 
+/* Counters of the read buffer, shown in /proc/self/flinux/winfs */
+static struct
+{
+	volatile LONG read_buffer_fills; /* Reads which filled the buffer */
+	volatile LONG read_buffer_hits; /* Reads served from the buffer without touching the file */
+	volatile LONG read_buffer_drops; /* Buffers dropped with unread data */
+} winfs_stats;
+
+/* Whether FileDispositionInformationEx and FileRenameInformationEx are available, cleared on first failure before Windows 10 1607 */
+static bool winfs_posix_delete = true;
+static bool winfs_posix_rename = true;
+
+/* Generation of the directory entry cache and read buffers, see winfs_getdents()
+ * It is session wide, so a modification made by any process drops the caches of all processes */
+static __forceinline LONG winfs_dirplus_generation()
+{
+	return *vfs_get_winfs_generation();
+}
+
+/* Drop all cached directory entries, called on every modification made through winfs */
+static void winfs_dirplus_invalidate()
+{
+	InterlockedIncrement(vfs_get_winfs_generation());
+}
+
 /* Convert an utf-8 file name to NT file name, return converted name length in characters, no NULL terminator is appended */
 static int filename_to_nt_pathname(struct mount_point *mp, const char *filename, WCHAR *buf, int buf_size)
 {
@@ -296,11 +343,12 @@ static int winfs_get_special_file_type(HANDLE hFile)
 /*
 Test if a handle is a symlink, also return its target if requested.
 For optimal performance, caller should ensure the handle is a regular file with system attribute.
+The header and the target are read in one go, no NULL terminator is appended if the target fills the buffer.
 File pointer is changed after the operation.
 */
 static int winfs_read_symlink_unsafe(HANDLE hFile, char *target, int buflen)
 {
-	char header[WINFS_SYMLINK_HEADER_LEN];
+	char buf[WINFS_SYMLINK_HEADER_LEN + PATH_MAX];
 	DWORD num_read;
 	OVERLAPPED overlapped;
 	overlapped.Internal = 0;
@@ -308,32 +356,39 @@ static int winfs_read_symlink_unsafe(HANDLE hFile, char *target, int buflen)
 	overlapped.Offset = 0;
 	overlapped.OffsetHigh = 0;
 	overlapped.hEvent = 0;
-	if (!ReadFile(hFile, header, WINFS_SYMLINK_HEADER_LEN, &num_read, &overlapped) || num_read < WINFS_SYMLINK_HEADER_LEN)
+	if (!ReadFile(hFile, buf, sizeof(buf), &num_read, &overlapped) || num_read < WINFS_SYMLINK_HEADER_LEN)
 		return 0;
-	if (memcmp(header, WINFS_SYMLINK_HEADER, WINFS_SYMLINK_HEADER_LEN))
+	if (memcmp(buf, WINFS_SYMLINK_HEADER, WINFS_SYMLINK_HEADER_LEN))
+		return 0;
+	int len = num_read - WINFS_SYMLINK_HEADER_LEN;
+	if (len >= PATH_MAX)
 		return 0;
 	if (target == NULL || buflen == 0)
-	{
-		LARGE_INTEGER size;
-		if (!GetFileSizeEx(hFile, &size) || size.QuadPart - WINFS_SYMLINK_HEADER_LEN >= PATH_MAX)
-			return 0;
-		return (int)size.QuadPart - WINFS_SYMLINK_HEADER_LEN;
-	}
-	else
-	{
-		overlapped.Offset = WINFS_SYMLINK_HEADER_LEN;
-		if (!ReadFile(hFile, target, buflen, &num_read, &overlapped))
-			return 0;
-		target[num_read] = 0;
-		return num_read;
-	}
+		return len;
+	if (len > buflen)
+		len = buflen;
+	memcpy(target, buf + WINFS_SYMLINK_HEADER_LEN, len);
+	if (len < buflen)
+		target[len] = 0;
+	return len;
 }
 
 static int winfs_close(struct file *f)
 {
 	struct winfs_file *winfile = (struct winfs_file *)f;
 	NtClose(winfile->handle);
+	if (winfile->pos_handle && winfile->pos_handle != INVALID_HANDLE_VALUE)
+		NtClose(winfile->pos_handle);
 	CloseHandle(winfile->fp_mutex);
+	if (winfile->read_buffer)
+		kfree(winfile->read_buffer, WINFS_READ_BUFFER_SIZE);
+	/* The locks themselves are gone with the handle */
+	while (winfile->locks)
+	{
+		struct winfs_lock *lock = winfile->locks;
+		winfile->locks = lock->next;
+		kfree(lock, sizeof(struct winfs_lock));
+	}
 	kfree(winfile, sizeof(struct winfs_file));
 	return 0;
 }
@@ -353,21 +408,21 @@ static int winfs_getpath(struct file *f, char *buf)
 		log_error("NtQueryInformationFile(FileNameInformation) failed, status: %x", status);
 		__debugbreak();
 	}
-	struct mount_point mp;
-	if (!vfs_get_mountpoint(winfile->mp_key, &mp))
-		vfs_get_root_mountpoint(&mp);
+	const struct mount_point *mp = vfs_get_mountpoint(winfile->mp_key);
+	if (!mp)
+		mp = vfs_get_root_mountpoint();
 	int len = 0;
 	WCHAR *relpath;
 	/* Test if the file is in the mount point */
 	/* \??\C:\Windows,  \Windows */
-	if (mp.win_path[4] == winfile->drive_letter &&
-		!wcsncmp(mp.win_path + 6, info->FileName, mp.win_path_len - 6))
+	if (mp->win_path[4] == winfile->drive_letter &&
+		!wcsncmp(mp->win_path + 6, info->FileName, mp->win_path_len - 6))
 	{
-		relpath = info->FileName + mp.win_path_len - 6;
+		relpath = info->FileName + mp->win_path_len - 6;
 		/* Copy mount point */
-		memcpy(buf, mp.mountpoint, mp.mountpoint_len);
-		len = mp.mountpoint_len;
-		buf += mp.mountpoint_len;
+		memcpy(buf, mp->mountpoint, mp->mountpoint_len);
+		len = mp->mountpoint_len;
+		buf += mp->mountpoint_len;
 		/* Remove trailling slash */
 		if (buf[-1] == '/')
 		{
@@ -401,22 +456,102 @@ static int winfs_getpath(struct file *f, char *buf)
 	return len;
 }
 
-static size_t winfs_read(struct file *f, void *buf, size_t count)
+/* Reopen the file without FILE_SYNCHRONOUS_IO_NONALERT, returns INVALID_HANDLE_VALUE on failure
+ * Only regular files are reopened, O_PATH files and directories never use the file pointer for I/O.
+ */
+static HANDLE winfs_reopen_async(struct winfs_file *winfile)
+{
+	HANDLE handle;
+	int flags = winfile->base_file.flags;
+	DWORD desired_access = FILE_READ_ATTRIBUTES;
+	if (flags & O_PATH)
+		return INVALID_HANDLE_VALUE;
+	else if (flags & O_RDWR)
+		desired_access |= FILE_READ_DATA | FILE_WRITE_DATA;
+	else if (flags & O_WRONLY)
+		desired_access |= FILE_WRITE_DATA;
+	else
+		desired_access |= FILE_READ_DATA;
+	UNICODE_STRING name;
+	RtlInitUnicodeString(&name, L"");
+	OBJECT_ATTRIBUTES attr;
+	attr.Length = sizeof(OBJECT_ATTRIBUTES);
+	attr.RootDirectory = winfile->handle;
+	attr.ObjectName = &name;
+	/* Inherited by forked children like the original handle, the winfs_file is copied to them */
+	DWORD handle_flags;
+	attr.Attributes = (GetHandleInformation(winfile->handle, &handle_flags) && (handle_flags & HANDLE_FLAG_INHERIT))? OBJ_INHERIT: 0;
+	attr.SecurityDescriptor = NULL;
+	attr.SecurityQualityOfService = NULL;
+	IO_STATUS_BLOCK status_block;
+	NTSTATUS status = NtOpenFile(&handle, desired_access, &attr, &status_block,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		FILE_NON_DIRECTORY_FILE | ((flags & O_DIRECT)? FILE_NO_INTERMEDIATE_BUFFERING: 0));
+	if (status == STATUS_FILE_IS_A_DIRECTORY)
+		return INVALID_HANDLE_VALUE;
+	if (!NT_SUCCESS(status))
+	{
+		log_warning("Reopening file for asynchronous I/O failed, status: %x", status);
+		return INVALID_HANDLE_VALUE;
+	}
+	return handle;
+}
+
+/* Get the positional handle of the file, see notes for pread() and pwrite() below
+ * Returns INVALID_HANDLE_VALUE if the file cannot be reopened.
+ * The handle is opened in winfs_open() rather than on first use. It is inherited together with
+ * the winfs_file, so a forked child always makes the same locking decision as its parent. A
+ * handle opened lazily after the child is created would exist in one process only, and the two
+ * would disagree on whether the shared file pointer needs fp_mutex.
+ */
+static HANDLE winfs_get_pos_handle(struct winfs_file *winfile)
+{
+	return winfile->pos_handle;
+}
+
+/* Check whether read(), write() and lseek() have to take fp_mutex
+ * Each of them is a single operation on the synchronous handle, which the kernel serializes
+ * on the file object, also shared by forked children. The file pointer is only moved back
+ * and forth by the fallback pread() and pwrite() if the positional handle is not available.
+ * winfs_stat() moves it too when checking special files, it always takes fp_mutex, as does
+ * every other user which moves the file pointer and restores it.
+ */
+static bool winfs_fp_lock_needed(struct winfs_file *winfile)
+{
+	return winfs_get_pos_handle(winfile) == INVALID_HANDLE_VALUE;
+}
+
+/* O_DIRECT I/O bypasses the cache, buffers, offsets and sizes must be sector aligned as on Linux */
+static bool winfs_direct_misaligned(struct winfs_file *winfile, const void *buf, size_t count, loff_t offset)
+{
+	if (!(winfile->base_file.flags & O_DIRECT) || !winfile->direct_align)
+		return false;
+	return (((uintptr_t)buf | count | (uint64_t)offset) & (winfile->direct_align - 1)) != 0;
+}
+
+static bool winfs_direct_misaligned_iov(struct winfs_file *winfile, const struct iovec *iov, int iovcnt, loff_t offset)
+{
+	for (int i = 0; i < iovcnt; i++)
+		if (winfs_direct_misaligned(winfile, iov[i].iov_base, iov[i].iov_len, offset))
+			return true;
+	return false;
+}
+
+/* Caller must hold the file pointer lock if needed */
+static size_t winfs_read_unsafe(struct winfs_file *winfile, void *buf, size_t count)
 {
-	AcquireSRWLockShared(&f->rw_lock);
-	struct winfs_file *winfile = (struct winfs_file *) f;
-	WaitForSingleObject(winfile->fp_mutex, INFINITE);
 	size_t num_read = 0;
 	while (count > 0)
 	{
 		DWORD count_dword = (DWORD)min(count, (size_t)UINT_MAX);
 		DWORD num_read_dword;
-		if (!ReadFile(winfile->handle, buf, count_dword, &num_read_dword, NULL))
+		if (!ReadFile(winfile->handle, (char *)buf + num_read, count_dword, &num_read_dword, NULL))
 		{
 			if (GetLastError() == ERROR_HANDLE_EOF)
 				break;
 			log_warning("ReadFile() failed, error code: %d", GetLastError());
-			num_read = -L_EIO;
+			if (num_read == 0)
+				num_read = -L_EIO;
 			break;
 		}
 		if (num_read_dword == 0)
@@ -424,16 +559,12 @@ static size_t winfs_read(struct file *f, void *buf, size_t count)
 		num_read += num_read_dword;
 		count -= num_read_dword;
 	}
-	ReleaseMutex(winfile->fp_mutex);
-	ReleaseSRWLockShared(&f->rw_lock);
 	return num_read;
 }
 
-static size_t winfs_write(struct file *f, const void *buf, size_t count)
+/* Caller must hold the file pointer lock if needed */
+static size_t winfs_write_unsafe(struct winfs_file *winfile, const void *buf, size_t count)
 {
-	AcquireSRWLockShared(&f->rw_lock);
-	struct winfs_file *winfile = (struct winfs_file *) f;
-	WaitForSingleObject(winfile->fp_mutex, INFINITE);
 	size_t num_written = 0;
 	OVERLAPPED overlapped;
 	overlapped.Internal = 0;
@@ -441,25 +572,292 @@ static size_t winfs_write(struct file *f, const void *buf, size_t count)
 	overlapped.Offset = 0xFFFFFFFF;
 	overlapped.OffsetHigh = 0xFFFFFFFF;
 	overlapped.hEvent = NULL;
-	OVERLAPPED *overlapped_pointer = (f->flags & O_APPEND)? &overlapped: NULL;
+	OVERLAPPED *overlapped_pointer = (winfile->base_file.flags & O_APPEND)? &overlapped: NULL;
 	while (count > 0)
 	{
 		DWORD count_dword = (DWORD)min(count, (size_t)UINT_MAX);
 		DWORD num_written_dword;
-		if (!WriteFile(winfile->handle, buf, count_dword, &num_written_dword, overlapped_pointer))
+		if (!WriteFile(winfile->handle, (const char *)buf + num_written, count_dword, &num_written_dword, overlapped_pointer))
 		{
 			log_warning("WriteFile() failed, error code: %d", GetLastError());
-			num_written = -L_EIO;
+			if (num_written == 0)
+				num_written = -L_EIO;
 			break;
 		}
 		num_written += num_written_dword;
 		count -= num_written_dword;
 	}
-	ReleaseMutex(winfile->fp_mutex);
+	return num_written;
+}
+
+/* Read buffer
+ * Shells and parsers often read files a few bytes at a time, each read() would be a ReadFile().
+ * On a file opened read only, the second read smaller than WINFS_READ_BUFFER_SMALL allocates a
+ * buffer and later reads are served from it, refilled WINFS_READ_BUFFER_SIZE bytes at a time.
+ * The file pointer of the handle is then ahead of the file position by the unread bytes, so the
+ * buffer and the file pointer are guarded by the exclusive file lock. Other users of the file
+ * pointer drop the buffer first, see winfs_lock_fp().
+ * The buffer is also dropped when a file is modified through winfs in this process. Changes made
+ * by other processes to the buffered range are not seen until the buffer is refilled.
+ * A forked child shares the file pointer, so buffering is disabled on fork().
+ */
+static bool winfs_read_buffer_allowed(struct winfs_file *winfile)
+{
+	return (winfile->base_file.flags & O_ACCMODE) == O_RDONLY && !(winfile->base_file.flags & O_DIRECT)
+		&& !winfile->read_buffer_disabled && !winfs_fp_lock_needed(winfile);
+}
+
+/* Move the file pointer back to the file position, caller must hold the exclusive file lock */
+static void winfs_drop_read_buffer(struct winfs_file *winfile)
+{
+	int unread = winfile->read_buffer_len - winfile->read_buffer_pos;
+	if (unread > 0)
+	{
+		LARGE_INTEGER distance;
+		distance.QuadPart = -unread;
+		SetFilePointerEx(winfile->handle, distance, NULL, FILE_CURRENT);
+		InterlockedIncrement(&winfs_stats.read_buffer_drops);
+	}
+	winfile->read_buffer_pos = 0;
+	winfile->read_buffer_len = 0;
+}
+
+/* Acquire the file lock for an operation using the file pointer, returns whether it is exclusive */
+static bool winfs_lock_fp(struct winfs_file *winfile)
+{
+	AcquireSRWLockShared(&winfile->base_file.rw_lock);
+	if (winfile->read_buffer_pos == winfile->read_buffer_len)
+		return false;
+	ReleaseSRWLockShared(&winfile->base_file.rw_lock);
+	AcquireSRWLockExclusive(&winfile->base_file.rw_lock);
+	winfs_drop_read_buffer(winfile);
+	return true;
+}
+
+static void winfs_unlock_fp(struct winfs_file *winfile, bool exclusive)
+{
+	if (exclusive)
+		ReleaseSRWLockExclusive(&winfile->base_file.rw_lock);
+	else
+		ReleaseSRWLockShared(&winfile->base_file.rw_lock);
+}
+
+/* Caller must hold the exclusive file lock */
+static size_t winfs_read_buffered(struct winfs_file *winfile, void *buf, size_t count)
+{
+	if (winfile->read_buffer_generation != winfs_dirplus_generation())
+		winfs_drop_read_buffer(winfile);
+	size_t num_read = 0;
+	bool filled = false;
+	while (num_read < count)
+	{
+		if (winfile->read_buffer_pos == winfile->read_buffer_len)
+		{
+			if (count - num_read >= WINFS_READ_BUFFER_SMALL)
+			{
+				/* Large enough to go directly to the caller */
+				size_t r = winfs_read_unsafe(winfile, (char *)buf + num_read, count - num_read);
+				filled = true;
+				if ((ssize_t)r < 0)
+					return num_read > 0? num_read: r;
+				num_read += r;
+				break;
+			}
+			LONG generation = winfs_dirplus_generation();
+			size_t r = winfs_read_unsafe(winfile, winfile->read_buffer, WINFS_READ_BUFFER_SIZE);
+			filled = true;
+			if ((ssize_t)r < 0)
+				return num_read > 0? num_read: r;
+			if (r == 0)
+				break;
+			winfile->read_buffer_pos = 0;
+			winfile->read_buffer_len = (int)r;
+			winfile->read_buffer_generation = generation;
+			InterlockedIncrement(&winfs_stats.read_buffer_fills);
+		}
+		size_t len = min(count - num_read, (size_t)(winfile->read_buffer_len - winfile->read_buffer_pos));
+		memcpy((char *)buf + num_read, winfile->read_buffer + winfile->read_buffer_pos, len);
+		winfile->read_buffer_pos += (int)len;
+		num_read += len;
+	}
+	if (!filled)
+		InterlockedIncrement(&winfs_stats.read_buffer_hits);
+	return num_read;
+}
+
+int winfs_get_stats(char *buf)
+{
+	return ksprintf(buf,
+		"read buffer fills: %d\n"
+		"read buffer hits:  %d\n"
+		"read buffer drops: %d\n",
+		winfs_stats.read_buffer_fills, winfs_stats.read_buffer_hits, winfs_stats.read_buffer_drops);
+}
+
+static size_t winfs_read(struct file *f, void *buf, size_t count)
+{
+	struct winfs_file *winfile = (struct winfs_file *) f;
+	if (winfs_direct_misaligned(winfile, buf, count, 0))
+		return -L_EINVAL;
+	if (winfs_read_buffer_allowed(winfile))
+	{
+		AcquireSRWLockExclusive(&f->rw_lock);
+		size_t num_read;
+		if (!winfile->read_buffer && !winfile->read_buffer_disabled && count < WINFS_READ_BUFFER_SMALL
+			&& ++winfile->small_reads >= 2)
+			winfile->read_buffer = (char *)kmalloc(WINFS_READ_BUFFER_SIZE);
+		if (winfile->read_buffer)
+			num_read = winfs_read_buffered(winfile, buf, count);
+		else
+			num_read = winfs_read_unsafe(winfile, buf, count);
+		ReleaseSRWLockExclusive(&f->rw_lock);
+		return num_read;
+	}
+	AcquireSRWLockShared(&f->rw_lock);
+	bool lock = winfs_fp_lock_needed(winfile);
+	if (lock)
+		WaitForSingleObject(winfile->fp_mutex, INFINITE);
+	size_t num_read = winfs_read_unsafe(winfile, buf, count);
+	if (lock)
+		ReleaseMutex(winfile->fp_mutex);
+	ReleaseSRWLockShared(&f->rw_lock);
+	return num_read;
+}
+
+static size_t winfs_write(struct file *f, const void *buf, size_t count)
+{
+	struct winfs_file *winfile = (struct winfs_file *) f;
+	if (winfs_direct_misaligned(winfile, buf, count, 0))
+		return -L_EINVAL;
+	winfs_dirplus_invalidate();
+	AcquireSRWLockShared(&f->rw_lock);
+	bool lock = winfs_fp_lock_needed(winfile);
+	if (lock)
+		WaitForSingleObject(winfile->fp_mutex, INFINITE);
+	size_t num_written = winfs_write_unsafe(winfile, buf, count);
+	if (lock)
+		ReleaseMutex(winfile->fp_mutex);
 	ReleaseSRWLockShared(&f->rw_lock);
 	return num_written;
 }
 
+/* readv() and writev() take the file locks once for the whole vector.
+ * Segments smaller than WINFS_BOUNCE_SIZE are coalesced in a stack buffer, so a vector of many
+ * small segments costs a single ReadFile() or WriteFile(). Such a vector is also atomic with respect
+ * to other users of the file pointer, as is a single large segment. Otherwise each segment is a
+ * separate call, and unlike Linux a read() or write() from another thread or a forked child may
+ * land in between, since with the positional handle plain reads and writes do not take fp_mutex.
+ */
+#define WINFS_BOUNCE_SIZE	4096
+
+static size_t winfs_readv(struct file *f, const struct iovec *iov, int iovcnt)
+{
+	struct winfs_file *winfile = (struct winfs_file *) f;
+	if (winfs_direct_misaligned_iov(winfile, iov, iovcnt, 0))
+		return -L_EINVAL;
+	bool exclusive = winfs_lock_fp(winfile);
+	bool lock = winfs_fp_lock_needed(winfile);
+	if (lock)
+		WaitForSingleObject(winfile->fp_mutex, INFINITE);
+	size_t total_len = 0;
+	for (int i = 0; i < iovcnt && total_len <= WINFS_BOUNCE_SIZE; i++)
+		total_len += iov[i].iov_len;
+	size_t total = 0;
+	/* The bounce buffer would break O_DIRECT alignment */
+	if (total_len <= WINFS_BOUNCE_SIZE && !(f->flags & O_DIRECT))
+	{
+		char bounce[WINFS_BOUNCE_SIZE];
+		total = winfs_read_unsafe(winfile, bounce, total_len);
+		if ((ssize_t)total > 0)
+		{
+			size_t copied = 0;
+			for (int i = 0; i < iovcnt && copied < total; i++)
+			{
+				size_t len = min(iov[i].iov_len, total - copied);
+				memcpy(iov[i].iov_base, bounce + copied, len);
+				copied += len;
+			}
+		}
+	}
+	else
+	{
+		for (int i = 0; i < iovcnt; i++)
+		{
+			size_t r = winfs_read_unsafe(winfile, iov[i].iov_base, iov[i].iov_len);
+			if ((ssize_t)r < 0)
+			{
+				if (total == 0)
+					total = r;
+				break;
+			}
+			total += r;
+			if (r < iov[i].iov_len)
+				break;
+		}
+	}
+	if (lock)
+		ReleaseMutex(winfile->fp_mutex);
+	winfs_unlock_fp(winfile, exclusive);
+	return total;
+}
+
+static size_t winfs_writev(struct file *f, const struct iovec *iov, int iovcnt)
+{
+	struct winfs_file *winfile = (struct winfs_file *) f;
+	if (winfs_direct_misaligned_iov(winfile, iov, iovcnt, 0))
+		return -L_EINVAL;
+	winfs_dirplus_invalidate();
+	AcquireSRWLockShared(&f->rw_lock);
+	bool lock = winfs_fp_lock_needed(winfile);
+	if (lock)
+		WaitForSingleObject(winfile->fp_mutex, INFINITE);
+	char bounce[WINFS_BOUNCE_SIZE];
+	size_t bounce_len = 0;
+	size_t total = 0;
+	for (int i = 0; i <= iovcnt; i++)
+	{
+		/* Flush the bounce buffer before a segment that does not fit and at the end */
+		if (bounce_len > 0 && (i == iovcnt || bounce_len + iov[i].iov_len > WINFS_BOUNCE_SIZE))
+		{
+			size_t r = winfs_write_unsafe(winfile, bounce, bounce_len);
+			if ((ssize_t)r < 0)
+			{
+				if (total == 0)
+					total = r;
+				break;
+			}
+			total += r;
+			if (r < bounce_len)
+				break;
+			bounce_len = 0;
+		}
+		if (i == iovcnt)
+			break;
+		if (iov[i].iov_len < WINFS_BOUNCE_SIZE && !(f->flags & O_DIRECT))
+		{
+			memcpy(bounce + bounce_len, iov[i].iov_base, iov[i].iov_len);
+			bounce_len += iov[i].iov_len;
+		}
+		else
+		{
+			size_t r = winfs_write_unsafe(winfile, iov[i].iov_base, iov[i].iov_len);
+			if ((ssize_t)r < 0)
+			{
+				if (total == 0)
+					total = r;
+				break;
+			}
+			total += r;
+			if (r < iov[i].iov_len)
+				break;
+		}
+	}
+	if (lock)
+		ReleaseMutex(winfile->fp_mutex);
+	ReleaseSRWLockShared(&f->rw_lock);
+	return total;
+}
+
 /* Notes for pread() and pwrite()
  * In Linux pread() and pwrite() are defined to be atomic and not touch file pointers.
  * In Windows we can specify the start pointer to use in the OVERLAPPED structure passed
@@ -470,17 +868,17 @@ static size_t winfs_write(struct file *f, const void *buf, size_t count)
  * operations. In pread() and pwrite() we read the fp before ReadFile() or WriteFile()
  * and seek to that position afterward.
  *
- * This method may be slow in practice, but the performance is completely untested.
- * Advices on potential improvements are encouraged.
- *
- * An alternative approach would be use two file handles, one for ordinary read/write,
- * and another for pread/pwrite, while it solves this problem easily, it may encounter
- * other problems such as file content desync, and file permission problems. Due to
- * the additional complications this method is not used here.
+ * This takes four system calls and serializes all positional I/O on the file, so it is
+ * only used as a fallback. Normally pread() and pwrite() use a second handle reopened from
+ * the first one without FILE_SYNCHRONOUS_IO_NONALERT. An asynchronous file object has no
+ * file pointer, each NtReadFile() or NtWriteFile() on it takes an explicit offset, so no
+ * lock is needed.
+ * Both handles refer to the same file and share its cache, the content never desyncs.
+ * The file pointer used by read(), write() and lseek() stays in the original handle, it is
+ * shared with forked children like in Linux.
  */
-static size_t winfs_pread(struct file *f, void *buf, size_t count, loff_t offset)
+static size_t winfs_pread_fp(struct file *f, void *buf, size_t count, loff_t offset)
 {
-	AcquireSRWLockShared(&f->rw_lock);
 	struct winfs_file *winfile = (struct winfs_file *) f;
 	WaitForSingleObject(winfile->fp_mutex, INFINITE);
 	/* Acquire current file pointer */
@@ -515,13 +913,11 @@ static size_t winfs_pread(struct file *f, void *buf, size_t count, loff_t offset
 	/* Restore previous file pointer */
 	SetFilePointerEx(winfile->handle, currentFilePointer, &currentFilePointer, FILE_BEGIN);
 	ReleaseMutex(winfile->fp_mutex);
-	ReleaseSRWLockShared(&f->rw_lock);
 	return num_read;
 }
 
-static size_t winfs_pwrite(struct file *f, const void *buf, size_t count, loff_t offset)
+static size_t winfs_pwrite_fp(struct file *f, const void *buf, size_t count, loff_t offset)
 {
-	AcquireSRWLockShared(&f->rw_lock);
 	struct winfs_file *winfile = (struct winfs_file *) f;
 	WaitForSingleObject(winfile->fp_mutex, INFINITE);
 	/* Acquire current file pointer */
@@ -552,10 +948,197 @@ static size_t winfs_pwrite(struct file *f, const void *buf, size_t count, loff_t
 	/* Restore previous file pointer */
 	SetFilePointerEx(winfile->handle, currentFilePointer, &currentFilePointer, FILE_BEGIN);
 	ReleaseMutex(winfile->fp_mutex);
+	return num_written;
+}
+
+/* Maximum number of requests a single preadv() or pwritev() keeps in flight */
+#define WINFS_IO_DEPTH		8
+
+/* Per thread events for waiting on asynchronous I/O, pread() and pwrite() use the first one */
+static __declspec(thread) HANDLE winfs_io_events[WINFS_IO_DEPTH];
+
+static HANDLE winfs_get_io_event(int i)
+{
+	if (!winfs_io_events[i])
+		winfs_io_events[i] = CreateEventW(NULL, FALSE, FALSE, NULL);
+	return winfs_io_events[i];
+}
+
+static NTSTATUS winfs_wait_io(NTSTATUS status, HANDLE event, IO_STATUS_BLOCK *status_block)
+{
+	if (status == STATUS_PENDING)
+	{
+		WaitForSingleObject(event, INFINITE);
+		status = status_block->Status;
+	}
+	return status;
+}
+
+static size_t winfs_pread(struct file *f, void *buf, size_t count, loff_t offset)
+{
+	struct winfs_file *winfile = (struct winfs_file *) f;
+	if (winfs_direct_misaligned(winfile, buf, count, offset))
+		return -L_EINVAL;
+	AcquireSRWLockShared(&f->rw_lock);
+	HANDLE handle = winfs_get_pos_handle(winfile);
+	HANDLE event = winfs_get_io_event(0);
+	if (handle == INVALID_HANDLE_VALUE || !event)
+	{
+		size_t r = winfs_pread_fp(f, buf, count, offset);
+		ReleaseSRWLockShared(&f->rw_lock);
+		return r;
+	}
+	size_t num_read = 0;
+	while (count > 0)
+	{
+		LARGE_INTEGER byte_offset;
+		byte_offset.QuadPart = offset;
+		ULONG count_ulong = (ULONG)min(count, (size_t)UINT_MAX);
+		IO_STATUS_BLOCK status_block;
+		NTSTATUS status = NtReadFile(handle, event, NULL, NULL, &status_block, buf, count_ulong, &byte_offset, NULL);
+		status = winfs_wait_io(status, event, &status_block);
+		if (status == STATUS_END_OF_FILE)
+			break;
+		if (!NT_SUCCESS(status))
+		{
+			log_warning("NtReadFile() failed, status: %x", status);
+			num_read = -L_EIO;
+			break;
+		}
+		if (status_block.Information == 0)
+			break;
+		num_read += status_block.Information;
+		buf = (char *)buf + status_block.Information;
+		offset += status_block.Information;
+		count -= status_block.Information;
+	}
+	ReleaseSRWLockShared(&f->rw_lock);
+	return num_read;
+}
+
+static size_t winfs_pwrite(struct file *f, const void *buf, size_t count, loff_t offset)
+{
+	struct winfs_file *winfile = (struct winfs_file *) f;
+	if (winfs_direct_misaligned(winfile, buf, count, offset))
+		return -L_EINVAL;
+	winfs_dirplus_invalidate();
+	AcquireSRWLockShared(&f->rw_lock);
+	HANDLE handle = winfs_get_pos_handle(winfile);
+	HANDLE event = winfs_get_io_event(0);
+	if (handle == INVALID_HANDLE_VALUE || !event)
+	{
+		size_t r = winfs_pwrite_fp(f, buf, count, offset);
+		ReleaseSRWLockShared(&f->rw_lock);
+		return r;
+	}
+	size_t num_written = 0;
+	while (count > 0)
+	{
+		LARGE_INTEGER byte_offset;
+		byte_offset.QuadPart = offset;
+		ULONG count_ulong = (ULONG)min(count, (size_t)UINT_MAX);
+		IO_STATUS_BLOCK status_block;
+		NTSTATUS status = NtWriteFile(handle, event, NULL, NULL, &status_block, (PVOID)buf, count_ulong, &byte_offset, NULL);
+		status = winfs_wait_io(status, event, &status_block);
+		if (!NT_SUCCESS(status))
+		{
+			log_warning("NtWriteFile() failed, status: %x", status);
+			num_written = -L_EIO;
+			break;
+		}
+		num_written += status_block.Information;
+		buf = (const char *)buf + status_block.Information;
+		offset += status_block.Information;
+		count -= status_block.Information;
+	}
 	ReleaseSRWLockShared(&f->rw_lock);
 	return num_written;
 }
 
+/* preadv() and pwritev() submit all segments on the positional handle before waiting for
+ * any of them, so the disk sees up to WINFS_IO_DEPTH requests at once instead of one.
+ * The result is accumulated in segment order and stops at the first short or failed segment
+ * like a sequential loop would, but all submitted requests are waited for before returning.
+ * Returns -L_ENOSYS if the caller should fall back to one pread() or pwrite() per segment.
+ */
+static size_t winfs_prwv(struct file *f, bool write, const struct iovec *iov, int iovcnt, loff_t offset)
+{
+	struct winfs_file *winfile = (struct winfs_file *) f;
+	HANDLE handle = winfs_get_pos_handle(winfile);
+	if (handle == INVALID_HANDLE_VALUE)
+		return -L_ENOSYS;
+	HANDLE events[WINFS_IO_DEPTH];
+	for (int i = 0; i < WINFS_IO_DEPTH; i++)
+		if (!(events[i] = winfs_get_io_event(i)))
+			return -L_ENOSYS;
+	for (int i = 0; i < iovcnt; i++)
+		if (iov[i].iov_len > UINT_MAX)
+			return -L_ENOSYS;
+
+	size_t total = 0;
+	bool done = false;
+	for (int start = 0; start < iovcnt && !done; start += WINFS_IO_DEPTH)
+	{
+		int n = min(iovcnt - start, WINFS_IO_DEPTH);
+		IO_STATUS_BLOCK status_blocks[WINFS_IO_DEPTH];
+		NTSTATUS statuses[WINFS_IO_DEPTH];
+		for (int i = 0; i < n; i++)
+		{
+			const struct iovec *vec = &iov[start + i];
+			LARGE_INTEGER byte_offset;
+			byte_offset.QuadPart = offset;
+			offset += vec->iov_len;
+			if (write)
+				statuses[i] = NtWriteFile(handle, events[i], NULL, NULL, &status_blocks[i], vec->iov_base, (ULONG)vec->iov_len, &byte_offset, NULL);
+			else
+				statuses[i] = NtReadFile(handle, events[i], NULL, NULL, &status_blocks[i], vec->iov_base, (ULONG)vec->iov_len, &byte_offset, NULL);
+		}
+		for (int i = 0; i < n; i++)
+		{
+			NTSTATUS status = winfs_wait_io(statuses[i], events[i], &status_blocks[i]);
+			if (done)
+				continue;
+			if (status == STATUS_END_OF_FILE)
+				done = true;
+			else if (!NT_SUCCESS(status))
+			{
+				log_warning("%s() failed, status: %x", write? "NtWriteFile": "NtReadFile", status);
+				if (total == 0)
+					total = -L_EIO;
+				done = true;
+			}
+			else
+			{
+				total += status_blocks[i].Information;
+				if (status_blocks[i].Information < iov[start + i].iov_len)
+					done = true;
+			}
+		}
+	}
+	return total;
+}
+
+static size_t winfs_preadv(struct file *f, const struct iovec *iov, int iovcnt, loff_t offset)
+{
+	if (winfs_direct_misaligned_iov((struct winfs_file *)f, iov, iovcnt, offset))
+		return -L_EINVAL;
+	AcquireSRWLockShared(&f->rw_lock);
+	size_t r = winfs_prwv(f, false, iov, iovcnt, offset);
+	ReleaseSRWLockShared(&f->rw_lock);
+	return r;
+}
+
+static size_t winfs_pwritev(struct file *f, const struct iovec *iov, int iovcnt, loff_t offset)
+{
+	if (winfs_direct_misaligned_iov((struct winfs_file *)f, iov, iovcnt, offset))
+		return -L_EINVAL;
+	winfs_dirplus_invalidate();
+	AcquireSRWLockShared(&f->rw_lock);
+	size_t r = winfs_prwv(f, true, iov, iovcnt, offset);
+	ReleaseSRWLockShared(&f->rw_lock);
+	return r;
+}
+
 static size_t winfs_readlink(struct file *f, char *target, size_t buflen)
 {
 	/* This file is a symlink, so read(), write() should not be called on this file
@@ -573,6 +1156,7 @@ static size_t winfs_readlink(struct file *f, char *target, size_t buflen)
 
 static int winfs_truncate(struct file *f, loff_t length)
 {
+	winfs_dirplus_invalidate();
 	AcquireSRWLockShared(&f->rw_lock);
 	struct winfs_file *winfile = (struct winfs_file *) f;
 	/* TODO: Correct errno */
@@ -590,6 +1174,307 @@ static int winfs_truncate(struct file *f, loff_t length)
 	return 0;
 }
 
+/* Advisory locks
+ * Windows byte range locks are mandatory, they would block our own reads and writes through the other
+ * handle. So locks are taken on a shadow range far beyond any file data instead, offset by WINFS_LOCK_BASE.
+ * flock() locks a single byte after the range, which makes them independent of fcntl() locks as on Linux.
+ * Locks are owned by the positional handle of the open file description, so both fcntl() record locks
+ * and open file description locks behave like the latter: locks from the same description never conflict.
+ * Windows neither merges, splits nor converts locks. The held locks are tracked to emulate these.
+ */
+#define WINFS_LOCK_BASE		0x2000000000000000ULL
+#define WINFS_LOCK_END		0x4000000000000000ULL
+#define WINFS_FLOCK_OFFSET	WINFS_LOCK_END
+
+struct winfs_lock
+{
+	struct winfs_lock *next;
+	uint64_t start, end;
+	int type;
+};
+
+/* Take a lock on the Windows range [start, end), a blocking wait can be interrupted by signals */
+static int winfs_lock_range(HANDLE handle, int type, uint64_t start, uint64_t end, bool wait)
+{
+	HANDLE event = winfs_get_io_event(0);
+	if (!event)
+		return -L_ENOLCK;
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.Offset = (DWORD)start;
+	overlapped.OffsetHigh = (DWORD)(start >> 32ULL);
+	overlapped.hEvent = event;
+	uint64_t len = end - start;
+	DWORD flags = (type == F_WRLCK? LOCKFILE_EXCLUSIVE_LOCK: 0) | (wait? 0: LOCKFILE_FAIL_IMMEDIATELY);
+	if (LockFileEx(handle, flags, 0, (DWORD)len, (DWORD)(len >> 32ULL), &overlapped))
+		return 0;
+	DWORD error = GetLastError();
+	if (error == ERROR_IO_PENDING)
+	{
+		if (signal_wait(1, &event, INFINITE) == WAIT_INTERRUPTED)
+			CancelIoEx(handle, &overlapped);
+		/* If the lock was granted before the cancellation it is simply kept */
+		DWORD bytes;
+		if (GetOverlappedResult(handle, &overlapped, &bytes, TRUE))
+			return 0;
+		error = GetLastError();
+		if (error == ERROR_OPERATION_ABORTED)
+			return -L_EINTR;
+	}
+	if (error == ERROR_LOCK_VIOLATION)
+		return -L_EAGAIN;
+	log_warning("LockFileEx() failed, error code: %d", error);
+	return -L_ENOLCK;
+}
+
+static void winfs_unlock_range(HANDLE handle, uint64_t start, uint64_t end)
+{
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.Offset = (DWORD)start;
+	overlapped.OffsetHigh = (DWORD)(start >> 32ULL);
+	uint64_t len = end - start;
+	if (!UnlockFileEx(handle, 0, (DWORD)len, (DWORD)(len >> 32ULL), &overlapped))
+		log_warning("UnlockFileEx() failed, error code: %d", GetLastError());
+}
+
+/* Caller must hold locks_lock exclusively */
+static void winfs_relock(struct winfs_file *winfile, HANDLE handle, int type, uint64_t start, uint64_t end)
+{
+	if (winfs_lock_range(handle, type, start, end, false) < 0)
+	{
+		log_warning("Lost lock [%llx, %llx) to another owner.", start, end);
+		return;
+	}
+	struct winfs_lock *lock = (struct winfs_lock *)kmalloc(sizeof(struct winfs_lock));
+	lock->start = start;
+	lock->end = end;
+	lock->type = type;
+	lock->next = winfile->locks;
+	winfile->locks = lock;
+}
+
+/* Set the lock type of the Windows range [start, end), type is F_RDLCK, F_WRLCK or F_UNLCK */
+static int winfs_setlk(struct winfs_file *winfile, int type, uint64_t start, uint64_t end, bool wait)
+{
+	HANDLE handle = winfs_get_pos_handle(winfile);
+	if (handle == INVALID_HANDLE_VALUE)
+		return -L_ENOLCK;
+	AcquireSRWLockExclusive(&winfile->locks_lock);
+	/* Release our locks overlapping the range, the parts outside it are locked again.
+	 * The parts inside are kept aside to be restored if the new lock cannot be taken.
+	 */
+	struct winfs_lock *removed = NULL;
+	struct winfs_lock **prev = &winfile->locks;
+	while (*prev)
+	{
+		struct winfs_lock *lock = *prev;
+		if (lock->end <= start || lock->start >= end)
+		{
+			prev = &lock->next;
+			continue;
+		}
+		*prev = lock->next;
+		winfs_unlock_range(handle, lock->start, lock->end);
+		if (lock->start < start)
+			winfs_relock(winfile, handle, lock->type, lock->start, start);
+		if (lock->end > end)
+			winfs_relock(winfile, handle, lock->type, end, lock->end);
+		lock->start = max(lock->start, start);
+		lock->end = min(lock->end, end);
+		lock->next = removed;
+		removed = lock;
+	}
+	int r = 0;
+	if (type != F_UNLCK)
+	{
+		/* Do not block other lock operations on the file while waiting */
+		if (wait)
+			ReleaseSRWLockExclusive(&winfile->locks_lock);
+		r = winfs_lock_range(handle, type, start, end, wait);
+		if (wait)
+			AcquireSRWLockExclusive(&winfile->locks_lock);
+		if (r == 0)
+		{
+			struct winfs_lock *lock = (struct winfs_lock *)kmalloc(sizeof(struct winfs_lock));
+			lock->start = start;
+			lock->end = end;
+			lock->type = type;
+			lock->next = winfile->locks;
+			winfile->locks = lock;
+		}
+		else
+		{
+			for (struct winfs_lock *lock = removed; lock; lock = lock->next)
+				winfs_relock(winfile, handle, lock->type, lock->start, lock->end);
+		}
+	}
+	ReleaseSRWLockExclusive(&winfile->locks_lock);
+	while (removed)
+	{
+		struct winfs_lock *lock = removed;
+		removed = lock->next;
+		kfree(lock, sizeof(struct winfs_lock));
+	}
+	return r;
+}
+
+/* Test whether a lock of the given type on [start, end) would be granted, returns the conflicting lock type or F_UNLCK */
+static int winfs_getlk(struct winfs_file *winfile, int type, uint64_t start, uint64_t end)
+{
+	HANDLE handle = winfs_get_pos_handle(winfile);
+	if (handle == INVALID_HANDLE_VALUE)
+		return -L_ENOLCK;
+	AcquireSRWLockShared(&winfile->locks_lock);
+	int r = F_UNLCK;
+	/* Our own locks never conflict, but Windows cannot tell them from others' */
+	for (struct winfs_lock *lock = winfile->locks; lock; lock = lock->next)
+		if (lock->end > start && lock->start < end)
+			goto out;
+	r = winfs_lock_range(handle, type, start, end, false);
+	if (r == 0)
+	{
+		winfs_unlock_range(handle, start, end);
+		r = F_UNLCK;
+	}
+	else if (r == -L_EAGAIN)
+	{
+		/* A conflicting write lock also conflicts with a read lock */
+		r = F_WRLCK;
+		if (type == F_WRLCK && winfs_lock_range(handle, F_RDLCK, start, end, false) == 0)
+		{
+			winfs_unlock_range(handle, start, end);
+			r = F_RDLCK;
+		}
+	}
+out:
+	ReleaseSRWLockShared(&winfile->locks_lock);
+	return r;
+}
+
+static int winfs_flock(struct file *f, int operation)
+{
+	struct winfs_file *winfile = (struct winfs_file *)f;
+	int type;
+	switch (operation & ~LOCK_NB)
+	{
+	case LOCK_SH:
+		type = F_RDLCK;
+		break;
+	case LOCK_EX:
+		type = F_WRLCK;
+		break;
+	case LOCK_UN:
+		type = F_UNLCK;
+		break;
+	default:
+		return -L_EINVAL;
+	}
+	return winfs_setlk(winfile, type, WINFS_FLOCK_OFFSET, WINFS_FLOCK_OFFSET + 1, !(operation & LOCK_NB));
+}
+
+static int winfs_lock(struct file *f, int cmd, struct flock64 *lock)
+{
+	struct winfs_file *winfile = (struct winfs_file *)f;
+	/* Offsets beyond the shadow range are far beyond any real file size */
+	uint64_t span = WINFS_LOCK_END - WINFS_LOCK_BASE;
+	uint64_t start = WINFS_LOCK_BASE + min((uint64_t)lock->l_start, span);
+	uint64_t end = WINFS_LOCK_END;
+	if (lock->l_len > 0 && (uint64_t)lock->l_len < span - (start - WINFS_LOCK_BASE))
+		end = start + lock->l_len;
+	if (start >= end)
+	{
+		if (cmd == F_GETLK)
+			lock->l_type = F_UNLCK;
+		return 0;
+	}
+	if (cmd == F_GETLK)
+	{
+		int r = winfs_getlk(winfile, lock->l_type, start, end);
+		if (r < 0)
+			return r;
+		lock->l_type = r;
+		/* The owner of a Windows lock is unknown */
+		lock->l_pid = -1;
+		return 0;
+	}
+	return winfs_setlk(winfile, lock->l_type, start, end, cmd == F_SETLKW);
+}
+
+static int winfs_fallocate(struct file *f, int mode, loff_t offset, loff_t len)
+{
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+		return -L_EOPNOTSUPP;
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE))
+		return -L_EOPNOTSUPP;
+	winfs_dirplus_invalidate();
+	AcquireSRWLockShared(&f->rw_lock);
+	struct winfs_file *winfile = (struct winfs_file *) f;
+	int r = 0;
+	loff_t end = offset + len;
+	FILE_STANDARD_INFO info;
+	if (!GetFileInformationByHandleEx(winfile->handle, FileStandardInfo, &info, sizeof(info)))
+	{
+		log_warning("GetFileInformationByHandleEx(FileStandardInfo) failed, error code: %d", GetLastError());
+		r = -L_EIO;
+		goto out;
+	}
+	if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+	{
+		/* Only zero the part inside the file, the rest of the range is allocated below */
+		FILE_ZERO_DATA_INFORMATION zero;
+		zero.FileOffset.QuadPart = offset;
+		zero.BeyondFinalZero.QuadPart = min(end, info.EndOfFile.QuadPart);
+		if (zero.FileOffset.QuadPart < zero.BeyondFinalZero.QuadPart)
+		{
+			DWORD bytes;
+			/* The clusters of a zeroed range are only released in a sparse file
+			 * On file systems without sparse files the range is just filled with zeros */
+			if (mode & FALLOC_FL_PUNCH_HOLE)
+				DeviceIoControl(winfile->handle, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes, NULL);
+			if (!DeviceIoControl(winfile->handle, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero), NULL, 0, &bytes, NULL))
+			{
+				log_warning("DeviceIoControl(FSCTL_SET_ZERO_DATA) failed, error code: %d", GetLastError());
+				r = -L_EIO;
+				goto out;
+			}
+		}
+		if (mode & FALLOC_FL_PUNCH_HOLE)
+			goto out;
+	}
+	IO_STATUS_BLOCK status_block;
+	NTSTATUS status;
+	/* Reserve clusters for the whole range in one go, a smaller allocation size would truncate the file */
+	if (end > info.AllocationSize.QuadPart)
+	{
+		FILE_ALLOCATION_INFORMATION alloc;
+		alloc.AllocationSize.QuadPart = end;
+		status = NtSetInformationFile(winfile->handle, &status_block, &alloc, sizeof(alloc), FileAllocationInformation);
+		if (!NT_SUCCESS(status))
+		{
+			log_warning("NtSetInformationFile(FileAllocationInformation) failed, status: %x", status);
+			r = status == STATUS_DISK_FULL ? -L_ENOSPC : -L_EIO;
+			goto out;
+		}
+	}
+	/* The valid data length is left alone, reads beyond it return zeros without exposing stale disk content */
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > info.EndOfFile.QuadPart)
+	{
+		FILE_END_OF_FILE_INFORMATION eof;
+		eof.EndOfFile.QuadPart = end;
+		status = NtSetInformationFile(winfile->handle, &status_block, &eof, sizeof(eof), FileEndOfFileInformation);
+		if (!NT_SUCCESS(status))
+		{
+			log_warning("NtSetInformationFile(FileEndOfFileInformation) failed, status: %x", status);
+			r = status == STATUS_DISK_FULL ? -L_ENOSPC : -L_EIO;
+			goto out;
+		}
+	}
+out:
+	ReleaseSRWLockShared(&f->rw_lock);
+	return r;
+}
+
 static int winfs_fsync(struct file *f)
 {
 	AcquireSRWLockShared(&f->rw_lock);
@@ -616,8 +1501,10 @@ static int winfs_llseek(struct file *f, loff_t offset, loff_t *newoffset, int wh
 		dwMoveMethod = FILE_END;
 	else
 		return -L_EINVAL;
-	AcquireSRWLockShared(&f->rw_lock);
-	WaitForSingleObject(winfile->fp_mutex, INFINITE);
+	bool exclusive = winfs_lock_fp(winfile);
+	bool lock = winfs_fp_lock_needed(winfile);
+	if (lock)
+		WaitForSingleObject(winfile->fp_mutex, INFINITE);
 	LARGE_INTEGER liDistanceToMove, liNewFilePointer;
 	liDistanceToMove.QuadPart = offset;
 	SetFilePointerEx(winfile->handle, liDistanceToMove, &liNewFilePointer, dwMoveMethod);
@@ -627,104 +1514,368 @@ static int winfs_llseek(struct file *f, loff_t offset, loff_t *newoffset, int wh
 		/* TODO: Currently we don't know if it is a directory, it's no harm to do this anyway */
 		winfile->restart_scan = 1;
 	}
-	ReleaseMutex(winfile->fp_mutex);
-	ReleaseSRWLockExclusive(&f->rw_lock);
+	if (lock)
+		ReleaseMutex(winfile->fp_mutex);
+	winfs_unlock_fp(winfile, exclusive);
 	return 0;
 }
 
-static int winfs_stat(struct file *f, struct newstat *buf)
+/* Fill stat structure from file information, special files are handled by the caller */
+static void winfs_fill_stat(struct newstat *buf, DWORD attributes, uint64_t file_id, uint64_t size, DWORD nlink,
+	const FILETIME *atime, const FILETIME *mtime, const FILETIME *ctime)
 {
-	AcquireSRWLockShared(&f->rw_lock);
-	struct winfs_file *winfile = (struct winfs_file *) f;
-	BY_HANDLE_FILE_INFORMATION info;
-	GetFileInformationByHandle(winfile->handle, &info);
-
 	/* Programs (ld.so) may use st_dev and st_ino to identity files so these must be unique for each file. */
 	INIT_STRUCT_NEWSTAT_PADDING(buf);
 	buf->st_dev = mkdev(8, 0); // (8, 0): /dev/sda
-	//buf->st_ino = ((uint64_t)info.nFileIndexHigh << 32ULL) + info.nFileIndexLow;
+	//buf->st_ino = file_id;
 	/* Hash 64 bit inode to 32 bit to fix legacy applications
 	 * We may later add an option for changing this behaviour
 	 */
-	buf->st_ino = info.nFileIndexHigh ^ info.nFileIndexLow;
-	if (info.dwFileAttributes & FILE_ATTRIBUTE_READONLY)
+	buf->st_ino = (uint32_t)(file_id >> 32ULL) ^ (uint32_t)file_id;
+	if (attributes & FILE_ATTRIBUTE_READONLY)
 		buf->st_mode = 0555;
 	else
 		buf->st_mode = 0755;
-	if (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+	if (attributes & FILE_ATTRIBUTE_DIRECTORY)
 	{
 		buf->st_mode |= S_IFDIR;
 		buf->st_size = 0;
 	}
 	else
 	{
-		buf->st_mode |= S_IFREG;
-		buf->st_size = ((uint64_t)info.nFileSizeHigh << 32ULL) + info.nFileSizeLow;
-		if (info.dwFileAttributes & FILE_ATTRIBUTE_SYSTEM)
+		buf->st_mode |= S_IFREG;
+		buf->st_size = size;
+	}
+	buf->st_nlink = nlink;
+	buf->st_uid = 0;
+	buf->st_gid = 0;
+	buf->st_rdev = 0;
+	buf->st_blksize = PAGE_SIZE;
+	buf->st_blocks = (buf->st_size + buf->st_blksize - 1) / buf->st_blksize;
+	buf->st_atime = filetime_to_unix_sec(atime);
+	buf->st_atime_nsec = filetime_to_unix_nsec(atime);
+	buf->st_mtime = filetime_to_unix_sec(mtime);
+	buf->st_mtime_nsec = filetime_to_unix_nsec(mtime);
+	buf->st_ctime = filetime_to_unix_sec(ctime);
+	buf->st_ctime_nsec = filetime_to_unix_nsec(ctime);
+}
+
+static int winfs_stat(struct file *f, struct newstat *buf)
+{
+	AcquireSRWLockShared(&f->rw_lock);
+	struct winfs_file *winfile = (struct winfs_file *) f;
+	BY_HANDLE_FILE_INFORMATION info;
+	GetFileInformationByHandle(winfile->handle, &info);
+
+	winfs_fill_stat(buf, info.dwFileAttributes, ((uint64_t)info.nFileIndexHigh << 32ULL) + info.nFileIndexLow,
+		((uint64_t)info.nFileSizeHigh << 32ULL) + info.nFileSizeLow, info.nNumberOfLinks,
+		&info.ftLastAccessTime, &info.ftLastWriteTime, &info.ftCreationTime);
+	if (!(info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && (info.dwFileAttributes & FILE_ATTRIBUTE_SYSTEM))
+	{
+		WaitForSingleObject(winfile->fp_mutex, INFINITE);
+		/* Save current file pointer */
+		LARGE_INTEGER distanceToMove, currentFilePointer;
+		distanceToMove.QuadPart = 0;
+		SetFilePointerEx(winfile->handle, distanceToMove, &currentFilePointer, FILE_CURRENT);
+
+		int type = winfs_get_special_file_type(winfile->handle);
+		if (type > 0)
+		{
+			if (type == SPECIAL_FILE_SYMLINK)
+			{
+				buf->st_mode |= S_IFLNK;
+				buf->st_size -= WINFS_SYMLINK_HEADER_LEN;
+			}
+			else if (type == SPECIAL_FILE_SOCKET)
+			{
+				buf->st_mode |= S_IFSOCK;
+				buf->st_size = 0;
+			}
+			buf->st_blocks = (buf->st_size + buf->st_blksize - 1) / buf->st_blksize;
+		}
+
+		/* Restore current file pointer */
+		SetFilePointerEx(winfile->handle, currentFilePointer, &currentFilePointer, FILE_BEGIN);
+		ReleaseMutex(winfile->fp_mutex);
+	}
+	ReleaseSRWLockShared(&f->rw_lock);
+	return 0;
+}
+
+/* st_ino is folded to 32 bits, the volume serial number and the full file index are exact */
+static int winfs_get_identity(struct file *f, uint64_t *volume, uint64_t *file_id)
+{
+	struct winfs_file *winfile = (struct winfs_file *)f;
+	BY_HANDLE_FILE_INFORMATION info;
+	if (!GetFileInformationByHandle(winfile->handle, &info))
+	{
+		log_warning("GetFileInformationByHandle() failed, error code: %d", GetLastError());
+		return -L_EIO;
+	}
+	*volume = info.dwVolumeSerialNumber;
+	*file_id = ((uint64_t)info.nFileIndexHigh << 32ULL) + info.nFileIndexLow;
+	return 0;
+}
+
+static int winfs_utimens(struct file *f, const struct timespec *times)
+{
+	winfs_dirplus_invalidate();
+	AcquireSRWLockShared(&f->rw_lock);
+	struct winfs_file *winfs = (struct winfs_file *)f;
+	if (!times)
+	{
+		SYSTEMTIME time;
+		GetSystemTime(&time);
+		FILETIME filetime;
+		SystemTimeToFileTime(&time, &filetime);
+		SetFileTime(winfs->handle, NULL, &filetime, &filetime);
+	}
+	else
+	{
+		FILETIME actime, modtime;
+		unix_timespec_to_filetime(&times[0], &actime);
+		unix_timespec_to_filetime(&times[1], &modtime);
+		SetFileTime(winfs->handle, NULL, &actime, &modtime);
+	}
+	ReleaseSRWLockShared(&f->rw_lock);
+	return 0;
+}
+
+/* Directory entry cache
+ * NtQueryDirectoryFile() returns the size, times and attributes of every entry, and tools like
+ * ls -l, du and find stat each entry right after reading the directory. We keep the records of
+ * the last few enumerated directories so fstatat(dirfd, name) can be answered without opening
+ * every file.
+ *
+ * Directories are identified by their file ID, so all handles to the same directory share the
+ * records. Any modification made through winfs in any process of the session bumps the session
+ * wide winfs generation, which drops all records. Changes made outside flinux are picked up after
+ * WINFS_DIRPLUS_TTL milliseconds. The link count is not part of the enumeration, NTFS reports one
+ * link for directories, for other files it is queried relative to the directory on first use.
+ *
+ * The records are per process. The slots live in .bss, so a forked child starts empty and never
+ * sees the parent's buffers.
+ */
+#define WINFS_DIRPLUS_SLOTS			4
+#define WINFS_DIRPLUS_MAX_ENTRIES	4096
+#define WINFS_DIRPLUS_BUCKETS		1024
+#define WINFS_DIRPLUS_NAME_MAX		64
+#define WINFS_DIRPLUS_TTL			1000
+struct winfs_dirplus_entry
+{
+	int next; /* Next entry in hash chain plus one, 0 for end */
+	DWORD attributes;
+	uint64_t file_id;
+	uint64_t size;
+	FILETIME atime, mtime, ctime;
+	volatile LONG nlink; /* 0 if not queried yet */
+	int name_len; /* In characters */
+	WCHAR name[WINFS_DIRPLUS_NAME_MAX];
+};
+struct winfs_dirplus
+{
+	uint64_t dir_id; /* 0 if the slot is not used */
+	char drive_letter;
+	struct winfs_file *owner; /* The handle whose enumeration is being recorded */
+	LONG generation;
+	ULONGLONG time;
+	int count;
+	struct winfs_dirplus_entry *entries;
+	int heads[WINFS_DIRPLUS_BUCKETS]; /* Index of first entry in each hash chain plus one */
+};
+static struct winfs_dirplus winfs_dirplus[WINFS_DIRPLUS_SLOTS];
+static SRWLOCK winfs_dirplus_lock = SRWLOCK_INIT;
+
+static uint64_t winfs_get_file_id(struct winfs_file *winfile)
+{
+	if (!winfile->file_id)
+	{
+		FILE_INTERNAL_INFORMATION info;
+		IO_STATUS_BLOCK status_block;
+		NTSTATUS status = NtQueryInformationFile(winfile->handle, &status_block, &info, sizeof(info), FileInternalInformation);
+		if (!NT_SUCCESS(status))
+		{
+			log_warning("NtQueryInformationFile(FileInternalInformation) failed, status: %x", status);
+			return 0;
+		}
+		winfile->file_id = info.IndexNumber.QuadPart;
+	}
+	return winfile->file_id;
+}
+
+static int winfs_dirplus_hash(const WCHAR *name, int len)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261U;
+	for (int i = 0; i < len; i++)
+		hash = (hash ^ name[i]) * 16777619U;
+	return hash % WINFS_DIRPLUS_BUCKETS;
+}
+
+static struct winfs_dirplus *winfs_dirplus_find(uint64_t dir_id, char drive_letter)
+{
+	for (int i = 0; i < WINFS_DIRPLUS_SLOTS; i++)
+		if (winfs_dirplus[i].dir_id == dir_id && winfs_dirplus[i].drive_letter == drive_letter)
+			return &winfs_dirplus[i];
+	return NULL;
+}
+
+/* Record a batch of FILE_ID_FULL_DIR_INFORMATION returned by NtQueryDirectoryFile() */
+static void winfs_dirplus_add(struct winfs_file *winfile, bool restart, const char *buffer)
+{
+	uint64_t dir_id = winfs_get_file_id(winfile);
+	if (!dir_id)
+		return;
+	AcquireSRWLockExclusive(&winfs_dirplus_lock);
+	struct winfs_dirplus *dirplus = winfs_dirplus_find(dir_id, winfile->drive_letter);
+	if (restart)
+	{
+		if (!dirplus)
+		{
+			/* Replace the least recently filled slot */
+			dirplus = &winfs_dirplus[0];
+			for (int i = 1; i < WINFS_DIRPLUS_SLOTS; i++)
+				if (winfs_dirplus[i].time < dirplus->time)
+					dirplus = &winfs_dirplus[i];
+		}
+		if (!dirplus->entries)
 		{
-			WaitForSingleObject(winfile->fp_mutex, INFINITE);
-			/* Save current file pointer */
-			LARGE_INTEGER distanceToMove, currentFilePointer;
-			distanceToMove.QuadPart = 0;
-			SetFilePointerEx(winfile->handle, distanceToMove, &currentFilePointer, FILE_CURRENT);
-
-			int type = winfs_get_special_file_type(winfile->handle);
-			if (type > 0)
+			dirplus->entries = VirtualAlloc(NULL, WINFS_DIRPLUS_MAX_ENTRIES * sizeof(struct winfs_dirplus_entry),
+				MEM_RESERVE | MEM_COMMIT | MEM_TOP_DOWN, PAGE_READWRITE);
+			if (!dirplus->entries)
 			{
-				if (type == SPECIAL_FILE_SYMLINK)
-				{
-					buf->st_mode |= S_IFLNK;
-					buf->st_size -= WINFS_SYMLINK_HEADER_LEN;
-				}
-				else if (type == SPECIAL_FILE_SOCKET)
-				{
-					buf->st_mode |= S_IFSOCK;
-					buf->st_size = 0;
-				}
+				log_warning("VirtualAlloc() for directory entry cache failed, error code: %d", GetLastError());
+				dirplus->dir_id = 0;
+				goto out;
 			}
-
-			/* Restore current file pointer */
-			SetFilePointerEx(winfile->handle, currentFilePointer, &currentFilePointer, FILE_BEGIN);
-			ReleaseMutex(winfile->fp_mutex);
 		}
+		dirplus->dir_id = dir_id;
+		dirplus->drive_letter = winfile->drive_letter;
+		dirplus->owner = winfile;
+		dirplus->generation = winfs_dirplus_generation();
+		dirplus->time = GetTickCount64();
+		dirplus->count = 0;
+		memset(dirplus->heads, 0, sizeof(dirplus->heads));
 	}
-	buf->st_nlink = info.nNumberOfLinks;
-	buf->st_uid = 0;
-	buf->st_gid = 0;
-	buf->st_rdev = 0;
-	buf->st_blksize = PAGE_SIZE;
-	buf->st_blocks = (buf->st_size + buf->st_blksize - 1) / buf->st_blksize;
-	buf->st_atime = filetime_to_unix_sec(&info.ftLastAccessTime);
-	buf->st_atime_nsec = filetime_to_unix_nsec(&info.ftLastAccessTime);
-	buf->st_mtime = filetime_to_unix_sec(&info.ftLastWriteTime);
-	buf->st_mtime_nsec = filetime_to_unix_nsec(&info.ftLastWriteTime);
-	buf->st_ctime = filetime_to_unix_sec(&info.ftCreationTime);
-	buf->st_ctime_nsec = filetime_to_unix_nsec(&info.ftCreationTime);
-	ReleaseSRWLockShared(&f->rw_lock);
-	return 0;
+	else if (!dirplus || dirplus->owner != winfile)
+		goto out; /* The beginning of this enumeration was not recorded */
+
+	const FILE_ID_FULL_DIR_INFORMATION *info;
+	int offset = 0;
+	do
+	{
+		info = (const FILE_ID_FULL_DIR_INFORMATION *)&buffer[offset];
+		offset += info->NextEntryOffset;
+		if (dirplus->count == WINFS_DIRPLUS_MAX_ENTRIES)
+			break;
+		int name_len = info->FileNameLength / sizeof(WCHAR);
+		if (name_len > WINFS_DIRPLUS_NAME_MAX)
+			continue;
+		/* Potential symlinks and sockets, the type is only known from the file content */
+		if (!(info->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) && (info->FileAttributes & FILE_ATTRIBUTE_SYSTEM))
+			continue;
+		struct winfs_dirplus_entry *entry = &dirplus->entries[dirplus->count++];
+		entry->attributes = info->FileAttributes;
+		entry->file_id = info->FileId.QuadPart;
+		entry->size = info->EndOfFile.QuadPart;
+		entry->atime = *(const FILETIME *)&info->LastAccessTime;
+		entry->mtime = *(const FILETIME *)&info->LastWriteTime;
+		entry->ctime = *(const FILETIME *)&info->CreationTime;
+		entry->nlink = (info->FileAttributes & FILE_ATTRIBUTE_DIRECTORY)? 1: 0;
+		entry->name_len = name_len;
+		memcpy(entry->name, info->FileName, info->FileNameLength);
+		int bucket = winfs_dirplus_hash(entry->name, name_len);
+		entry->next = dirplus->heads[bucket];
+		dirplus->heads[bucket] = dirplus->count;
+	} while (info->NextEntryOffset);
+out:
+	ReleaseSRWLockExclusive(&winfs_dirplus_lock);
 }
 
-static int winfs_utimens(struct file *f, const struct timespec *times)
+size_t winfs_dirplus_cache_size()
 {
-	AcquireSRWLockShared(&f->rw_lock);
-	struct winfs_file *winfs = (struct winfs_file *)f;
-	if (!times)
+	size_t size = 0;
+	AcquireSRWLockShared(&winfs_dirplus_lock);
+	for (int i = 0; i < WINFS_DIRPLUS_SLOTS; i++)
+		if (winfs_dirplus[i].entries)
+			size += WINFS_DIRPLUS_MAX_ENTRIES * sizeof(struct winfs_dirplus_entry);
+	ReleaseSRWLockShared(&winfs_dirplus_lock);
+	return size;
+}
+
+void winfs_dirplus_cache_shrink(size_t target)
+{
+	AcquireSRWLockExclusive(&winfs_dirplus_lock);
+	size_t size = 0;
+	for (int i = 0; i < WINFS_DIRPLUS_SLOTS; i++)
+		if (winfs_dirplus[i].entries)
+			size += WINFS_DIRPLUS_MAX_ENTRIES * sizeof(struct winfs_dirplus_entry);
+	/* Free the least recently filled slots first */
+	while (size > target)
 	{
-		SYSTEMTIME time;
-		GetSystemTime(&time);
-		FILETIME filetime;
-		SystemTimeToFileTime(&time, &filetime);
-		SetFileTime(winfs->handle, NULL, &filetime, &filetime);
+		struct winfs_dirplus *victim = NULL;
+		for (int i = 0; i < WINFS_DIRPLUS_SLOTS; i++)
+			if (winfs_dirplus[i].entries && (!victim || winfs_dirplus[i].time < victim->time))
+				victim = &winfs_dirplus[i];
+		VirtualFree(victim->entries, 0, MEM_RELEASE);
+		victim->entries = NULL;
+		victim->dir_id = 0;
+		size -= WINFS_DIRPLUS_MAX_ENTRIES * sizeof(struct winfs_dirplus_entry);
 	}
-	else
+	ReleaseSRWLockExclusive(&winfs_dirplus_lock);
+}
+
+/* Query the link count of a file in a directory by name, returns 0 on failure */
+static LONG winfs_query_nlink(struct winfs_file *dir, WCHAR *name, int name_len)
+{
+	UNICODE_STRING object_name;
+	object_name.Buffer = name;
+	object_name.MaximumLength = object_name.Length = name_len * sizeof(WCHAR);
+	OBJECT_ATTRIBUTES attr;
+	InitializeObjectAttributes(&attr, &object_name, 0, dir->handle, NULL);
+	IO_STATUS_BLOCK status_block;
+	FILE_STAT_INFORMATION info;
+	NTSTATUS status = win7compat_NtQueryInformationByName(&attr, &status_block, &info, sizeof(info), FileStatInformation);
+	if (!NT_SUCCESS(status))
+		return 0;
+	return info.NumberOfLinks;
+}
+
+int winfs_stat_dirent(struct file *f, const char *name, struct newstat *buf)
+{
+	if (!winfs_is_winfile(f))
+		return -L_ENOSYS;
+	struct winfs_file *winfile = (struct winfs_file *)f;
+	WCHAR wname[WINFS_DIRPLUS_NAME_MAX];
+	int name_len = utf8_to_utf16_filename(name, strlen(name), wname, WINFS_DIRPLUS_NAME_MAX);
+	if (name_len <= 0)
+		return -L_ENOSYS;
+	uint64_t dir_id = winfs_get_file_id(winfile);
+	if (!dir_id)
+		return -L_ENOSYS;
+	int r = -L_ENOSYS;
+	AcquireSRWLockShared(&winfs_dirplus_lock);
+	struct winfs_dirplus *dirplus = winfs_dirplus_find(dir_id, winfile->drive_letter);
+	if (dirplus && dirplus->generation == winfs_dirplus_generation() && GetTickCount64() - dirplus->time < WINFS_DIRPLUS_TTL)
 	{
-		FILETIME actime, modtime;
-		unix_timespec_to_filetime(&times[0], &actime);
-		unix_timespec_to_filetime(&times[1], &modtime);
-		SetFileTime(winfs->handle, NULL, &actime, &modtime);
+		for (int i = dirplus->heads[winfs_dirplus_hash(wname, name_len)]; i; i = dirplus->entries[i - 1].next)
+		{
+			struct winfs_dirplus_entry *entry = &dirplus->entries[i - 1];
+			if (entry->name_len == name_len && !memcmp(entry->name, wname, name_len * sizeof(WCHAR)))
+			{
+				if (!entry->nlink)
+					entry->nlink = winfs_query_nlink(winfile, wname, name_len);
+				if (!entry->nlink)
+					break;
+				winfs_fill_stat(buf, entry->attributes, entry->file_id, entry->size, entry->nlink,
+					&entry->atime, &entry->mtime, &entry->ctime);
+				r = 0;
+				break;
+			}
+		}
 	}
-	ReleaseSRWLockShared(&f->rw_lock);
-	return 0;
+	ReleaseSRWLockShared(&winfs_dirplus_lock);
+	return r;
 }
 
 static int winfs_getdents(struct file *f, void *dirent, size_t count, getdents_callback *fill_callback)
@@ -733,8 +1884,13 @@ static int winfs_getdents(struct file *f, void *dirent, size_t count, getdents_c
 	NTSTATUS status;
 	struct winfs_file *winfile = (struct winfs_file *) f;
 	IO_STATUS_BLOCK status_block;
-	#define BUFFER_SIZE	32768
-	char buffer[BUFFER_SIZE];
+	#define BUFFER_SIZE	65536
+	char *buffer = (char *)kmalloc(BUFFER_SIZE);
+	if (!buffer)
+	{
+		ReleaseSRWLockShared(&f->rw_lock);
+		return -L_ENOMEM;
+	}
 	int size = 0;
 
 	for (;;)
@@ -745,6 +1901,7 @@ static int winfs_getdents(struct file *f, void *dirent, size_t count, getdents_c
 		int buffer_size = (count - size) / 2;
 		if (buffer_size >= BUFFER_SIZE)
 			buffer_size = BUFFER_SIZE;
+		bool restart = winfile->restart_scan;
 		status = NtQueryDirectoryFile(winfile->handle, NULL, NULL, NULL, &status_block, buffer, buffer_size, FileIdFullDirectoryInformation, FALSE, NULL, winfile->restart_scan);
 		winfile->restart_scan = 0;
 		if (!NT_SUCCESS(status))
@@ -755,6 +1912,7 @@ static int winfs_getdents(struct file *f, void *dirent, size_t count, getdents_c
 		}
 		if (status_block.Information == 0)
 			break;
+		winfs_dirplus_add(winfile, restart, buffer);
 		int offset = 0;
 		FILE_ID_FULL_DIR_INFORMATION *info;
 		do
@@ -813,6 +1971,7 @@ static int winfs_getdents(struct file *f, void *dirent, size_t count, getdents_c
 		} while (info->NextEntryOffset);
 	}
 out:
+	kfree(buffer, BUFFER_SIZE);
 	ReleaseSRWLockShared(&f->rw_lock);
 	return size;
 	#undef BUFFER_SIZE
@@ -853,26 +2012,226 @@ out:
 	return r;
 }
 
+/* Create an inheritable section object backed by the file, returns NULL on failure */
+static HANDLE winfs_create_section(struct file *f, bool writable, loff_t offset, loff_t *section_start, loff_t *section_end)
+{
+	AcquireSRWLockShared(&f->rw_lock);
+	struct winfs_file *winfile = (struct winfs_file *)f;
+	HANDLE section = NULL;
+	DWORD desired_access = GENERIC_READ | GENERIC_EXECUTE;
+	if (writable)
+		desired_access |= GENERIC_WRITE;
+	/* The file handle may lack the execute access required by executable views */
+	HANDLE handle = ReOpenFile(winfile->handle, desired_access, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		log_warning("ReOpenFile() failed, error code: %d", GetLastError());
+		goto out;
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(handle, &size))
+	{
+		log_warning("GetFileSizeEx() failed, error code: %d", GetLastError());
+		CloseHandle(handle);
+		goto out;
+	}
+	*section_start = 0;
+	*section_end = size.QuadPart;
+	OBJECT_ATTRIBUTES attr;
+	attr.Length = sizeof(OBJECT_ATTRIBUTES);
+	attr.RootDirectory = NULL;
+	attr.ObjectName = NULL;
+	attr.Attributes = OBJ_INHERIT;
+	attr.SecurityDescriptor = NULL;
+	attr.SecurityQualityOfService = NULL;
+	ACCESS_MASK section_access = SECTION_MAP_READ | SECTION_MAP_EXECUTE | SECTION_QUERY;
+	if (writable)
+		section_access |= SECTION_MAP_WRITE;
+	NTSTATUS status = NtCreateSection(&section, section_access, &attr, NULL,
+		writable? PAGE_EXECUTE_READWRITE: PAGE_EXECUTE_WRITECOPY, SEC_COMMIT, handle);
+	NtClose(handle);
+	if (!NT_SUCCESS(status))
+	{
+		log_warning("NtCreateSection() on file failed, status: %x", status);
+		section = NULL;
+	}
+out:
+	ReleaseSRWLockShared(&f->rw_lock);
+	return section;
+}
+
+/* Size of a view mapped at a time for read-ahead */
+#define WINFS_PREFETCH_CHUNK	0x1000000
+
+/* Let the memory manager read the range into the cache asynchronously, through a temporary view
+ * The pages are shared with the cache manager, later read() calls find them in memory.
+ */
+static void winfs_prefetch(struct file *f, loff_t offset, loff_t len)
+{
+	loff_t section_start, section_end;
+	HANDLE section = winfs_create_section(f, false, offset, &section_start, &section_end);
+	if (!section)
+		return;
+	loff_t end = section_end;
+	if (len > 0 && offset + len < end)
+		end = offset + len;
+	/* Views must start at allocation granularity */
+	loff_t start = offset & ~(loff_t)(BLOCK_SIZE - 1);
+	while (start < end)
+	{
+		PVOID base = NULL;
+		SIZE_T size = (SIZE_T)min(end - start, WINFS_PREFETCH_CHUNK);
+		LARGE_INTEGER section_offset;
+		section_offset.QuadPart = start;
+		NTSTATUS status = NtMapViewOfSection(section, NtCurrentProcess(), &base, 0, 0, &section_offset, &size, ViewUnmap, 0, PAGE_READONLY);
+		if (!NT_SUCCESS(status))
+		{
+			log_warning("NtMapViewOfSection() failed, status: %x", status);
+			break;
+		}
+		/* Does nothing before Windows 8, where the cache manager's own read-ahead has to do */
+		BOOL ok = win7compat_PrefetchVirtualMemory(base, (SIZE_T)min(end - start, WINFS_PREFETCH_CHUNK));
+		NtUnmapViewOfSection(NtCurrentProcess(), base);
+		if (!ok)
+			break;
+		start += WINFS_PREFETCH_CHUNK;
+	}
+	NtClose(section);
+}
+
+/* Set or clear FILE_SEQUENTIAL_ONLY, with which the cache manager reads ahead more aggressively and
+ * drops pages behind the reader. The handle is shared with forked children like the Linux file description.
+ */
+static void winfs_set_sequential(HANDLE handle, bool sequential)
+{
+	if (!handle || handle == INVALID_HANDLE_VALUE)
+		return;
+	FILE_MODE_INFORMATION info;
+	IO_STATUS_BLOCK status_block;
+	NTSTATUS status = NtQueryInformationFile(handle, &status_block, &info, sizeof(info), FileModeInformation);
+	if (!NT_SUCCESS(status))
+	{
+		log_warning("NtQueryInformationFile(FileModeInformation) failed, status: %x", status);
+		return;
+	}
+	ULONG mode = sequential? (info.Mode | FILE_SEQUENTIAL_ONLY): (info.Mode & ~FILE_SEQUENTIAL_ONLY);
+	if (mode == info.Mode)
+		return;
+	info.Mode = mode;
+	status = NtSetInformationFile(handle, &status_block, &info, sizeof(info), FileModeInformation);
+	if (!NT_SUCCESS(status))
+		log_warning("NtSetInformationFile(FileModeInformation) failed, status: %x", status);
+}
+
+/* Drop the cached data of the file: file systems flush and purge the cache of a file on a non cached open */
+static void winfs_purge_cache(struct winfs_file *winfile)
+{
+	int flags = winfile->base_file.flags;
+	if (flags & O_PATH)
+		return;
+	UNICODE_STRING name;
+	RtlInitUnicodeString(&name, L"");
+	OBJECT_ATTRIBUTES attr;
+	attr.Length = sizeof(OBJECT_ATTRIBUTES);
+	attr.RootDirectory = winfile->handle;
+	attr.ObjectName = &name;
+	attr.Attributes = 0;
+	attr.SecurityDescriptor = NULL;
+	attr.SecurityQualityOfService = NULL;
+	IO_STATUS_BLOCK status_block;
+	HANDLE handle;
+	NTSTATUS status = NtOpenFile(&handle, (flags & O_ACCMODE) == O_WRONLY? FILE_WRITE_DATA: FILE_READ_DATA, &attr, &status_block,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, FILE_NON_DIRECTORY_FILE | FILE_NO_INTERMEDIATE_BUFFERING);
+	if (!NT_SUCCESS(status))
+	{
+		log_warning("Reopening file for non cached I/O failed, status: %x", status);
+		return;
+	}
+	NtClose(handle);
+}
+
+static int winfs_fadvise(struct file *f, loff_t offset, loff_t len, int advice)
+{
+	struct winfs_file *winfile = (struct winfs_file *)f;
+	switch (advice)
+	{
+	case POSIX_FADV_NORMAL:
+	case POSIX_FADV_RANDOM:
+	case POSIX_FADV_SEQUENTIAL:
+	{
+		/* FILE_RANDOM_ACCESS can only be given on open, random access just stops sequential read-ahead */
+		bool sequential = advice == POSIX_FADV_SEQUENTIAL;
+		AcquireSRWLockShared(&f->rw_lock);
+		winfs_set_sequential(winfile->handle, sequential);
+		winfs_set_sequential(winfile->pos_handle, sequential);
+		ReleaseSRWLockShared(&f->rw_lock);
+		break;
+	}
+	case POSIX_FADV_WILLNEED:
+		winfs_prefetch(f, offset, len);
+		break;
+	case POSIX_FADV_DONTNEED:
+		AcquireSRWLockShared(&f->rw_lock);
+		winfs_purge_cache(winfile);
+		ReleaseSRWLockShared(&f->rw_lock);
+		break;
+	}
+	return 0;
+}
+
+/* The child shares the file pointer, see winfs_read_buffered() */
+static void winfs_fork(struct file *f, HANDLE child_process, DWORD child_process_id)
+{
+	struct winfs_file *winfile = (struct winfs_file *)f;
+	/* Released in winfs_after_fork_parent() */
+	AcquireSRWLockExclusive(&f->rw_lock);
+	winfs_drop_read_buffer(winfile);
+	winfile->read_buffer_disabled = true;
+	if (winfile->read_buffer)
+	{
+		kfree(winfile->read_buffer, WINFS_READ_BUFFER_SIZE);
+		winfile->read_buffer = NULL;
+	}
+}
+
+static void winfs_after_fork_parent(struct file *f)
+{
+	ReleaseSRWLockExclusive(&f->rw_lock);
+}
+
 static struct file_ops winfs_ops = 
 {
 	.close = winfs_close,
 	.getpath = winfs_getpath,
 	.read = winfs_read,
 	.write = winfs_write,
+	.readv = winfs_readv,
+	.writev = winfs_writev,
 	.pread = winfs_pread,
 	.pwrite = winfs_pwrite,
+	.preadv = winfs_preadv,
+	.pwritev = winfs_pwritev,
 	.readlink = winfs_readlink,
 	.truncate = winfs_truncate,
+	.fallocate = winfs_fallocate,
 	.fsync = winfs_fsync,
+	.fadvise = winfs_fadvise,
+	.flock = winfs_flock,
+	.lock = winfs_lock,
 	.llseek = winfs_llseek,
 	.stat = winfs_stat,
+	.get_identity = winfs_get_identity,
 	.utimens = winfs_utimens,
 	.getdents = winfs_getdents,
 	.statfs = winfs_statfs,
+	.create_section = winfs_create_section,
+	.fork = winfs_fork,
+	.after_fork_parent = winfs_after_fork_parent,
 };
 
 static int winfs_symlink(struct mount_point *mp, const char *target, const char *linkpath)
 {
+	winfs_dirplus_invalidate();
 	WCHAR wlinkpath[PATH_MAX];
 	int len = filename_to_nt_pathname(mp, linkpath, wlinkpath, PATH_MAX);
 	if (len <= 0)
@@ -924,6 +2283,7 @@ static int winfs_symlink(struct mount_point *mp, const char *target, const char
 
 static int winfs_link(struct mount_point *mp, struct file *f, const char *newpath)
 {
+	winfs_dirplus_invalidate();
 	AcquireSRWLockShared(&f->rw_lock);
 	struct winfs_file *winfile = (struct winfs_file *) f;
 	NTSTATUS status;
@@ -953,6 +2313,7 @@ out:
 
 static int winfs_unlink(struct mount_point *mp, const char *pathname)
 {
+	winfs_dirplus_invalidate();
 	WCHAR wpathname[PATH_MAX];
 	int len = filename_to_nt_pathname(mp, pathname, wpathname, PATH_MAX);
 	if (len <= 0)
@@ -971,6 +2332,26 @@ static int winfs_unlink(struct mount_point *mp, const char *pathname)
 	IO_STATUS_BLOCK status_block;
 	NTSTATUS status;
 	HANDLE handle;
+	if (winfs_posix_delete)
+	{
+		/* POSIX delete removes the name at once even if the file is still open elsewhere */
+		status = NtOpenFile(&handle, DELETE, &attr, &status_block, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			FILE_NON_DIRECTORY_FILE | FILE_OPEN_FOR_BACKUP_INTENT);
+		if (!NT_SUCCESS(status))
+		{
+			log_warning("NtOpenFile() failed, status: %x", status);
+			return -L_ENOENT;
+		}
+		FILE_DISPOSITION_INFORMATION_EX info;
+		info.Flags = FILE_DISPOSITION_DELETE | FILE_DISPOSITION_POSIX_SEMANTICS;
+		status = NtSetInformationFile(handle, &status_block, &info, sizeof(info), FileDispositionInformationEx);
+		NtClose(handle);
+		if (NT_SUCCESS(status))
+			return 0;
+		if (status == STATUS_INVALID_INFO_CLASS || status == STATUS_NOT_IMPLEMENTED)
+			winfs_posix_delete = false;
+		/* Otherwise the file system does not support it or the file is a running image, try the old way */
+	}
 	status = NtOpenFile(&handle, DELETE, &attr, &status_block, FILE_SHARE_DELETE, FILE_NON_DIRECTORY_FILE | FILE_OPEN_FOR_BACKUP_INTENT);
 	if (!NT_SUCCESS(status))
 	{
@@ -1010,6 +2391,7 @@ static int winfs_unlink(struct mount_point *mp, const char *pathname)
 
 static int winfs_rename(struct mount_point *mp, struct file *f, const char *newpath)
 {
+	winfs_dirplus_invalidate();
 	AcquireSRWLockShared(&f->rw_lock);
 	struct winfs_file *winfile = (struct winfs_file *)f;
 	char buf[sizeof(FILE_RENAME_INFORMATION) + PATH_MAX * 2];
@@ -1022,8 +2404,8 @@ retry:
 		r = -L_EPERM;
 		goto out;
 	}
-	FILE_RENAME_INFORMATION *info = (FILE_RENAME_INFORMATION *)buf;
-	info->ReplaceIfExists = TRUE;
+	/* Both information classes share the same layout, Flags takes the place of ReplaceIfExists */
+	FILE_RENAME_INFORMATION_EX *info = (FILE_RENAME_INFORMATION_EX *)buf;
 	info->RootDirectory = NULL;
 	info->FileNameLength = 2 * filename_to_nt_pathname(mp, newpath, info->FileName, PATH_MAX);
 	if (info->FileNameLength == 0)
@@ -1032,6 +2414,19 @@ retry:
 		goto out;
 	}
 	IO_STATUS_BLOCK status_block;
+	if (winfs_posix_rename)
+	{
+		/* Atomically replaces the destination even if it is open elsewhere, in one call */
+		info->Flags = FILE_RENAME_REPLACE_IF_EXISTS | FILE_RENAME_POSIX_SEMANTICS;
+		status = NtSetInformationFile(winfile->handle, &status_block, info, info->FileNameLength + sizeof(FILE_RENAME_INFORMATION_EX), FileRenameInformationEx);
+		if (NT_SUCCESS(status))
+			goto out;
+		if (status == STATUS_INVALID_INFO_CLASS || status == STATUS_NOT_IMPLEMENTED)
+			winfs_posix_rename = false;
+		/* Otherwise the file system does not support it or the destination is a directory, try the old way */
+	}
+	info->Flags = 0;
+	((FILE_RENAME_INFORMATION *)info)->ReplaceIfExists = TRUE;
 	status = NtSetInformationFile(winfile->handle, &status_block, info, info->FileNameLength + sizeof(FILE_RENAME_INFORMATION), FileRenameInformation);
 	if (!NT_SUCCESS(status))
 	{
@@ -1056,10 +2451,12 @@ out:
 
 static int winfs_mkdir(struct mount_point *mp, const char *pathname, int mode)
 {
+	winfs_dirplus_invalidate();
 	WCHAR wpathname[PATH_MAX];
-
-	if (utf8_to_utf16_filename(pathname, strlen(pathname) + 1, wpathname, PATH_MAX) <= 0)
+	int len = filename_to_nt_pathname(mp, pathname, wpathname, PATH_MAX - 1);
+	if (len <= 0)
 		return -L_ENOENT;
+	wpathname[len] = 0;
 	if (!CreateDirectoryW(wpathname, NULL))
 	{
 		DWORD err = GetLastError();
@@ -1076,9 +2473,12 @@ static int winfs_mkdir(struct mount_point *mp, const char *pathname, int mode)
 
 static int winfs_rmdir(struct mount_point *mp, const char *pathname)
 {
+	winfs_dirplus_invalidate();
 	WCHAR wpathname[PATH_MAX];
-	if (utf8_to_utf16_filename(pathname, strlen(pathname) + 1, wpathname, PATH_MAX) <= 0)
+	int len = filename_to_nt_pathname(mp, pathname, wpathname, PATH_MAX - 1);
+	if (len <= 0)
 		return -L_ENOENT;
+	wpathname[len] = 0;
 	if (!RemoveDirectoryW(wpathname))
 	{
 		log_warning("RemoveDirectoryW() failed, error code: %d", GetLastError());
@@ -1192,6 +2592,59 @@ static int open_file(HANDLE *hFile, struct mount_point *mp, const char *pathname
 	return 0;
 }
 
+/* Replace the handle of an O_DIRECT file by one for unbuffered I/O
+ * The original buffered handle is still needed by open_file() to read symlink headers.
+ */
+static int winfs_reopen_direct(HANDLE *handle, DWORD desired_access, BOOL inherit, uint32_t *direct_align)
+{
+	FILE_ATTRIBUTE_TAG_INFORMATION attribute_info;
+	IO_STATUS_BLOCK status_block;
+	NTSTATUS status = NtQueryInformationFile(*handle, &status_block, &attribute_info, sizeof(attribute_info), FileAttributeTagInformation);
+	if (!NT_SUCCESS(status))
+	{
+		log_warning("NtQueryInformationFile(FileAttributeTagInformation) failed, status: %x", status);
+		return -L_EIO;
+	}
+	/* O_DIRECT has no effect on directories */
+	if (attribute_info.FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		return 0;
+	FILE_FS_FULL_SIZE_INFORMATION size_info;
+	status = NtQueryVolumeInformationFile(*handle, &status_block, &size_info, sizeof(size_info), FileFsFullSizeInformation);
+	if (!NT_SUCCESS(status))
+	{
+		log_warning("NtQueryVolumeInformationFile() failed, status: %x", status);
+		return -L_EINVAL;
+	}
+	FILE_ALIGNMENT_INFORMATION alignment_info;
+	status = NtQueryInformationFile(*handle, &status_block, &alignment_info, sizeof(alignment_info), FileAlignmentInformation);
+	if (!NT_SUCCESS(status))
+		alignment_info.AlignmentRequirement = 0;
+	*direct_align = max(size_info.BytesPerSector, alignment_info.AlignmentRequirement + 1);
+
+	UNICODE_STRING name;
+	RtlInitUnicodeString(&name, L"");
+	OBJECT_ATTRIBUTES attr;
+	attr.Length = sizeof(OBJECT_ATTRIBUTES);
+	attr.RootDirectory = *handle;
+	attr.ObjectName = &name;
+	attr.Attributes = inherit? OBJ_INHERIT: 0;
+	attr.SecurityDescriptor = NULL;
+	attr.SecurityQualityOfService = NULL;
+	HANDLE direct_handle;
+	status = NtOpenFile(&direct_handle, desired_access | SYNCHRONIZE | FILE_READ_ATTRIBUTES, &attr, &status_block,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT | FILE_NO_INTERMEDIATE_BUFFERING);
+	if (!NT_SUCCESS(status))
+	{
+		log_warning("Reopening file for unbuffered I/O failed, status: %x", status);
+		NtClose(*handle);
+		return -L_EINVAL;
+	}
+	NtClose(*handle);
+	*handle = direct_handle;
+	return 0;
+}
+
 static int winfs_open(struct mount_point *mp, const char *pathname, int flags, int internal_flags, int mode, struct file **fp, char *target, int buflen)
 {
 	/* TODO: mode */
@@ -1214,6 +2667,8 @@ static int winfs_open(struct mount_point *mp, const char *pathname, int flags, i
 		create_disposition = FILE_OPEN_IF;
 	else
 		create_disposition = FILE_OPEN;
+	if ((flags & O_CREAT) || (flags & O_TRUNC))
+		winfs_dirplus_invalidate();
 	DWORD attributes;
 	if (internal_flags & INTERNAL_O_SPECIAL)
 		attributes = FILE_ATTRIBUTE_SYSTEM;
@@ -1226,6 +2681,13 @@ static int winfs_open(struct mount_point *mp, const char *pathname, int flags, i
 	int r = open_file(&handle, mp, pathname, desired_access, create_disposition, attributes, flags, bInherit, target, buflen, &drive_letter);
 	if (r < 0 || r == 1)
 		return r;
+	uint32_t direct_align = 0;
+	if ((flags & O_DIRECT) && fp && !(flags & O_PATH))
+	{
+		r = winfs_reopen_direct(&handle, desired_access, bInherit, &direct_align);
+		if (r < 0)
+			return r;
+	}
 	if ((flags & O_TRUNC) && ((flags & O_WRONLY) || (flags & O_RDWR)))
 	{
 		/* Truncate the file */
@@ -1252,6 +2714,17 @@ static int winfs_open(struct mount_point *mp, const char *pathname, int flags, i
 		file->restart_scan = 1;
 		file->mp_key = mp->key;
 		file->drive_letter = drive_letter;
+		file->file_id = 0;
+		InitializeSRWLock(&file->locks_lock);
+		file->locks = NULL;
+		file->direct_align = direct_align;
+		file->read_buffer = NULL;
+		file->read_buffer_pos = 0;
+		file->read_buffer_len = 0;
+		file->read_buffer_generation = 0;
+		file->small_reads = 0;
+		file->read_buffer_disabled = false;
+		file->pos_handle = winfs_reopen_async(file);
 		if (internal_flags & INTERNAL_O_TMP)
 		{
 			FILE_DISPOSITION_INFORMATION info;
@@ -1272,6 +2745,42 @@ static int winfs_open(struct mount_point *mp, const char *pathname, int flags, i
 	return 0;
 }
 
+/* Stat a file by name without opening it
+ * Returns -L_ENOSYS if the caller should open the file and stat the handle instead,
+ * this is the case for special files and when FileStatInformation is not supported.
+ */
+static int winfs_stat_path(struct mount_point *mp, const char *pathname, struct newstat *buf)
+{
+	WCHAR wbuf[PATH_MAX];
+	UNICODE_STRING name;
+	name.Buffer = wbuf;
+	name.MaximumLength = name.Length = 2 * filename_to_nt_pathname(mp, pathname, wbuf, PATH_MAX);
+	if (name.Length == 0)
+		return -L_ENOENT;
+
+	OBJECT_ATTRIBUTES attr;
+	attr.Length = sizeof(OBJECT_ATTRIBUTES);
+	attr.RootDirectory = NULL;
+	attr.ObjectName = &name;
+	attr.Attributes = 0;
+	attr.SecurityDescriptor = NULL;
+	attr.SecurityQualityOfService = NULL;
+
+	IO_STATUS_BLOCK status_block;
+	FILE_STAT_INFORMATION info;
+	NTSTATUS status = win7compat_NtQueryInformationByName(&attr, &status_block, &info, sizeof(info), FileStatInformation);
+	if (status == STATUS_OBJECT_NAME_NOT_FOUND || status == STATUS_OBJECT_PATH_NOT_FOUND)
+		return -L_ENOENT;
+	if (!NT_SUCCESS(status))
+		return -L_ENOSYS;
+	/* The system attribute marks a potential symlink or socket, whose type is only known from the file content */
+	if (!(info.FileAttributes & FILE_ATTRIBUTE_DIRECTORY) && (info.FileAttributes & FILE_ATTRIBUTE_SYSTEM))
+		return -L_ENOSYS;
+	winfs_fill_stat(buf, info.FileAttributes, info.FileId.QuadPart, info.EndOfFile.QuadPart, info.NumberOfLinks,
+		(FILETIME *)&info.LastAccessTime, (FILETIME *)&info.LastWriteTime, (FILETIME *)&info.CreationTime);
+	return 0;
+}
+
 struct winfs
 {
 	struct file_system base_fs;
@@ -1281,6 +2790,7 @@ struct file_system *winfs_alloc()
 {
 	struct winfs *fs = (struct winfs *)kmalloc(sizeof(struct winfs));
 	fs->base_fs.open = winfs_open;
+	fs->base_fs.stat = winfs_stat_path;
 	fs->base_fs.symlink = winfs_symlink;
 	fs->base_fs.link = winfs_link;
 	fs->base_fs.unlink = winfs_unlink;
@@ -1294,3 +2804,72 @@ int winfs_is_winfile(struct file *f)
 {
 	return f->op_vtable == &winfs_ops;
 }
+
+HANDLE winfs_open_async(struct file *f)
+{
+	if (!winfs_is_winfile(f))
+		return INVALID_HANDLE_VALUE;
+	AcquireSRWLockShared(&f->rw_lock);
+	HANDLE handle = winfs_reopen_async((struct winfs_file *)f);
+	ReleaseSRWLockShared(&f->rw_lock);
+	/* Owned by the caller, not by the winfs_file, so it must not leak into forked children */
+	if (handle != INVALID_HANDLE_VALUE)
+		SetHandleInformation(handle, HANDLE_FLAG_INHERIT, 0);
+	return handle;
+}
+
+HANDLE winfs_open_notify(struct file *f)
+{
+	if (!winfs_is_winfile(f))
+		return INVALID_HANDLE_VALUE;
+	struct winfs_file *winfile = (struct winfs_file *)f;
+	UNICODE_STRING name;
+	RtlInitUnicodeString(&name, L"");
+	OBJECT_ATTRIBUTES attr;
+	attr.Length = sizeof(OBJECT_ATTRIBUTES);
+	attr.RootDirectory = winfile->handle;
+	attr.ObjectName = &name;
+	attr.Attributes = 0;
+	attr.SecurityDescriptor = NULL;
+	attr.SecurityQualityOfService = NULL;
+	IO_STATUS_BLOCK status_block;
+	HANDLE handle;
+	/* Without FILE_SYNCHRONOUS_IO_NONALERT, for overlapped ReadDirectoryChangesW() */
+	AcquireSRWLockShared(&f->rw_lock);
+	NTSTATUS status = NtOpenFile(&handle, FILE_LIST_DIRECTORY, &attr, &status_block,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, FILE_DIRECTORY_FILE);
+	ReleaseSRWLockShared(&f->rw_lock);
+	if (!NT_SUCCESS(status))
+	{
+		log_warning("Opening directory for change notification failed, status: %x", status);
+		return INVALID_HANDLE_VALUE;
+	}
+	return handle;
+}
+
+bool winfs_notify_isdir(HANDLE dir, const WCHAR *name, int name_len)
+{
+	UNICODE_STRING str;
+	str.Buffer = (PWSTR)name;
+	str.Length = str.MaximumLength = name_len * sizeof(WCHAR);
+	OBJECT_ATTRIBUTES attr;
+	attr.Length = sizeof(OBJECT_ATTRIBUTES);
+	attr.RootDirectory = dir;
+	attr.ObjectName = &str;
+	attr.Attributes = 0;
+	attr.SecurityDescriptor = NULL;
+	attr.SecurityQualityOfService = NULL;
+	IO_STATUS_BLOCK status_block;
+	HANDLE handle;
+	NTSTATUS status = NtOpenFile(&handle, FILE_READ_ATTRIBUTES, &attr, &status_block,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, FILE_DIRECTORY_FILE | FILE_OPEN_REPARSE_POINT);
+	if (!NT_SUCCESS(status))
+		return false;
+	NtClose(handle);
+	return true;
+}
+
+void winfs_notify_change()
+{
+	winfs_dirplus_invalidate();
+}
@@ -23,5 +23,24 @@
 
 struct file_system *winfs_alloc();
 int winfs_is_winfile(struct file *f);
+/* Open a new handle to the file for overlapped I/O, which must take explicit offsets.
+ * The caller owns the handle. Returns INVALID_HANDLE_VALUE on failure.
+ */
+HANDLE winfs_open_async(struct file *f);
+/* Open a new handle to a directory for ReadDirectoryChangesW(), which is owned by the caller.
+ * Returns INVALID_HANDLE_VALUE on failure.
+ */
+HANDLE winfs_open_notify(struct file *f);
+/* Test whether an entry of a directory opened by winfs_open_notify() is a directory */
+bool winfs_notify_isdir(HANDLE dir, const WCHAR *name, int name_len);
+/* Drop the directory entry cache after a change was observed */
+void winfs_notify_change();
+/* Stat an entry of a directory from the records of its last enumeration, returns -L_ENOSYS if not cached */
+int winfs_stat_dirent(struct file *f, const char *name, struct newstat *buf);
+/* Memory held by the directory entry cache, see cache.h */
+size_t winfs_dirplus_cache_size();
+void winfs_dirplus_cache_shrink(size_t target);
 int winfs_read_special_file(struct file *f, const char *header, int headerlen, char *buf, int buflen);
 int winfs_write_special_file(struct file *f, const char *header, int headerlen, char *buf, int buflen);
+/* Format read buffer counters for /proc/self/flinux/winfs */
+int winfs_get_stats(char *buf);
@@ -20,53 +20,122 @@
 #include <syscall/mm.h>
 #include <heap.h>
 #include <log.h>
+#include <str.h>
+
+#include <string.h>
 
 /* Fast kernel heap management for Foreign Linux
  *
- * We set up a memory pool for each power-of-two size.
+ * We set up a memory pool for each size class. Classes are 16 bytes apart up to 128 bytes, above that
+ * there are four classes for each power of two, so an object wastes at most 20% of its size.
  * When allocating memory, we use the minimum sized pool which fit.
  * A pool is a chained list of bucket, each of a memory block size (64kB), at 
  * each bucket there is a header structure storing the status of the bucket.
+ * Like a slab allocator, buckets of a pool are kept in separate lists of full, partially free and
+ * empty buckets, so allocation never looks at full buckets. A bucket is found from an object address
+ * by rounding it down to the block size. A few empty buckets are kept per pool to avoid mapping and
+ * unmapping a bucket repeatedly when allocations hover around a bucket boundary, further empty
+ * buckets are returned to the system.
+ *
+ * Each thread caches free objects of each pool in a magazine, which serves most allocations
+ * without taking the heap lock. An empty magazine is refilled and a full magazine is drained
+ * from and to the pools in batches of half its capacity.
+ *
+ * Objects larger than the largest class get their own block aligned mapping.
  */
 
 struct bucket
 {
 	int ref_cnt;
+	int objsize;
 	void *first_free;
-	struct bucket *next_bucket;
+	struct bucket *prev_bucket, *next_bucket;
 };
 
 struct pool
 {
 	int objsize;
-	struct bucket *first;
+	int magazine_capacity;
+	struct bucket *full, *partial, *empty;
+	int empty_count;
+	/* Statistics */
+	int bucket_count; /* Number of mapped buckets */
+	int allocated; /* Number of objects handed out, including objects cached in magazines */
+	int peak_allocated;
 };
 
-#define POOL_COUNT	11
+#define POOL_EMPTY_BUCKETS	2	/* Maximum number of empty buckets kept in a pool */
+
+#define POOL_COUNT	36
+#define MAX_OBJSIZE	16384
 struct heap_data
 {
 	SRWLOCK rw_lock;
 	struct pool pools[POOL_COUNT];
+	/* Large object statistics */
+	int large_count;
+	size_t large_bytes;
 };
 
 static struct heap_data *heap;
 
+#define MAGAZINE_SIZE		32
+#define MAGAZINE_MAX_BYTES	65536 /* Keep at most this many bytes of large objects in a magazine */
+struct magazine
+{
+	int count;
+	void *objects[MAGAZINE_SIZE];
+};
+
+static __declspec(thread) struct magazine magazines[POOL_COUNT];
+
+/* Pool index of each allocation size in 16 bytes granularity */
+static uint8_t size_to_pool[(MAX_OBJSIZE >> 4) + 1];
+
+static void init_size_to_pool()
+{
+	int p = 0;
+	for (int i = 0; i <= (MAX_OBJSIZE >> 4); i++)
+	{
+		while ((i << 4) > heap->pools[p].objsize)
+			p++;
+		size_to_pool[i] = p;
+	}
+}
+
+static int get_pool(int size)
+{
+	if (size < 0 || size > MAX_OBJSIZE)
+		return -1;
+	return size_to_pool[(size + 15) >> 4];
+}
+
 void heap_init()
 {
 	log_info("heap subsystem initializating...");
 	heap = mm_static_alloc(sizeof(struct heap_data));
 	InitializeSRWLock(&heap->rw_lock);
-	heap->pools[0].objsize = 16;		heap->pools[0].first = NULL;
-	heap->pools[1].objsize = 32;		heap->pools[1].first = NULL;
-	heap->pools[2].objsize = 64;		heap->pools[2].first = NULL;
-	heap->pools[3].objsize = 128;		heap->pools[3].first = NULL;
-	heap->pools[4].objsize = 256;		heap->pools[4].first = NULL;
-	heap->pools[5].objsize = 512;		heap->pools[5].first = NULL;
-	heap->pools[6].objsize = 1024;		heap->pools[6].first = NULL;
-	heap->pools[7].objsize = 2048;		heap->pools[7].first = NULL;
-	heap->pools[8].objsize = 4096;		heap->pools[8].first = NULL;
-	heap->pools[9].objsize = 8192;		heap->pools[9].first = NULL;
-	heap->pools[10].objsize = 16384;	heap->pools[10].first = NULL;
+	for (int i = 0; i < POOL_COUNT; i++)
+	{
+		if (i < 8)
+			heap->pools[i].objsize = 16 * (i + 1);
+		else
+		{
+			int base = 128 << ((i - 8) / 4);
+			heap->pools[i].objsize = base + base / 4 * ((i - 8) % 4 + 1);
+		}
+		heap->pools[i].magazine_capacity = max(4, min(MAGAZINE_SIZE, MAGAZINE_MAX_BYTES / heap->pools[i].objsize));
+		heap->pools[i].full = NULL;
+		heap->pools[i].partial = NULL;
+		heap->pools[i].empty = NULL;
+		heap->pools[i].empty_count = 0;
+		heap->pools[i].bucket_count = 0;
+		heap->pools[i].allocated = 0;
+		heap->pools[i].peak_allocated = 0;
+	}
+	heap->large_count = 0;
+	heap->large_bytes = 0;
+	init_size_to_pool();
 	log_info("heap subsystem initialized.");
 }
 
@@ -76,6 +145,8 @@ void heap_shutdown()
 
 int heap_fork(HANDLE process)
 {
+	/* Objects cached by the forking thread would leak in the child, caches of other threads do */
+	heap_shutdown_thread();
 	AcquireSRWLockShared(&heap->rw_lock);
 	return 1;
 }
@@ -89,6 +160,7 @@ void heap_afterfork_child()
 {
 	heap = mm_static_alloc(sizeof(struct heap_data));
 	InitializeSRWLock(&heap->rw_lock);
+	init_size_to_pool();
 }
 
 #define ALIGN(x, align) (((x) + ((align) - 1)) & -(align))
@@ -96,13 +168,18 @@ static struct bucket *alloc_bucket(int objsize)
 {
 	struct bucket *b = mm_mmap(NULL, BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE,
 		INTERNAL_MAP_TOPDOWN | INTERNAL_MAP_NORESET | INTERNAL_MAP_VIRTUALALLOC, NULL, 0);
+	if ((uintptr_t)b >= (uintptr_t)-PAGE_SIZE)
+		return NULL;
 	b->ref_cnt = 0;
+	b->objsize = objsize;
+	b->prev_bucket = NULL;
 	b->next_bucket = NULL;
 
 	/* Set up the chain of free objects */
-	char *c = (char *)b + ALIGN(sizeof(struct bucket), sizeof(void *)); /* Align to machine word size */
+	char *c = (char *)b + ALIGN(sizeof(struct bucket), 16); /* Align objects to 16 bytes */
+	int count = (int)(((char *)b + BLOCK_SIZE - c) / objsize);
 	b->first_free = c;
-	while (c + objsize < (char *)b + BLOCK_SIZE)
+	for (int i = 1; i < count; i++)
 	{
 		*(char **)c = c + objsize;
 		c += objsize;
@@ -111,106 +188,246 @@ static struct bucket *alloc_bucket(int objsize)
 	return b;
 }
 
-void *kmalloc(int size)
+static void link_bucket(struct bucket **list, struct bucket *b)
 {
-	AcquireSRWLockExclusive(&heap->rw_lock);
-	/* Find pool */
-	int p = -1;
-	for (int i = 0; i < POOL_COUNT; i++)
-		if (size <= heap->pools[i].objsize)
+	b->prev_bucket = NULL;
+	b->next_bucket = *list;
+	if (*list)
+		(*list)->prev_bucket = b;
+	*list = b;
+}
+
+static void unlink_bucket(struct bucket **list, struct bucket *b)
+{
+	if (b->prev_bucket)
+		b->prev_bucket->next_bucket = b->next_bucket;
+	else
+		*list = b->next_bucket;
+	if (b->next_bucket)
+		b->next_bucket->prev_bucket = b->prev_bucket;
+}
+
+/* Caller ensures the heap lock is acquired (exclusive) */
+static void *pool_alloc(struct pool *pool)
+{
+	struct bucket *current = pool->partial;
+	if (!current)
+	{
+		/* Take an empty bucket, or allocate a new one */
+		if (pool->empty)
 		{
-			p = i;
-			break;
+			current = pool->empty;
+			unlink_bucket(&pool->empty, current);
+			pool->empty_count--;
 		}
-	if (p == -1)
+		else if (!(current = alloc_bucket(pool->objsize)))
+			return NULL;
+		else
+			pool->bucket_count++;
+		link_bucket(&pool->partial, current);
+	}
+	void *c = current->first_free;
+	current->first_free = *(void**)c;
+	current->ref_cnt++;
+	if (++pool->allocated > pool->peak_allocated)
+		pool->peak_allocated = pool->allocated;
+	if (!current->first_free)
 	{
-		log_error("kmalloc(%d): size too large.", size);
-		ReleaseSRWLockExclusive(&heap->rw_lock);
-		return NULL;
+		/* Bucket full */
+		unlink_bucket(&pool->partial, current);
+		link_bucket(&pool->full, current);
+	}
+	return c;
+}
+
+/* Caller ensures the heap lock is acquired (exclusive) */
+static void pool_free(struct pool *pool, void *mem)
+{
+	struct bucket *current = (struct bucket *)((size_t) mem & (-BLOCK_SIZE));
+	if (current->objsize != pool->objsize)
+	{
+		log_error("kfree(): Invalid memory pointer or size: (%x, %d)", mem, pool->objsize);
+		return;
 	}
-	
-	/* Find a bucket with a free object slot */
-	if (!heap->pools[p].first)
-		heap->pools[p].first = alloc_bucket(heap->pools[p].objsize);
+	if (!current->first_free)
+	{
+		/* Bucket was full */
+		unlink_bucket(&pool->full, current);
+		link_bucket(&pool->partial, current);
+	}
+	*(void **)mem = current->first_free;
+	current->first_free = mem;
+	current->ref_cnt--;
+	pool->allocated--;
 
-	struct bucket *current = heap->pools[p].first;
-	for (;;)
+	if (!current->ref_cnt)
 	{
-		if (!current)
+		/* Bucket empty, keep it for reuse or free it */
+		unlink_bucket(&pool->partial, current);
+		if (pool->empty_count < POOL_EMPTY_BUCKETS)
 		{
-			log_error("kmalloc(%d): out of memory", size);
-			ReleaseSRWLockExclusive(&heap->rw_lock);
-			return NULL;
+			link_bucket(&pool->empty, current);
+			pool->empty_count++;
 		}
-
-		/* Current bucket has a free object, return it */
-		if (current->first_free)
+		else
 		{
-			void *c = current->first_free;
-			current->first_free = *(void**)c;
-			current->ref_cnt++;
-			ReleaseSRWLockExclusive(&heap->rw_lock);
-			return c;
+			mm_munmap(current, BLOCK_SIZE);
+			pool->bucket_count--;
 		}
+	}
+}
 
-		/* Next bucket does not exist, allocate one */
-		if (!current->next_bucket)
-			current->next_bucket = alloc_bucket(heap->pools[p].objsize);
-
-		/* Move to next bucket */
-		current = current->next_bucket;
+static void *alloc_large(int size)
+{
+	size_t len = ALIGN((size_t)size, BLOCK_SIZE);
+	void *mem = mm_mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE,
+		INTERNAL_MAP_TOPDOWN | INTERNAL_MAP_NORESET | INTERNAL_MAP_VIRTUALALLOC, NULL, 0);
+	if ((uintptr_t)mem >= (uintptr_t)-PAGE_SIZE)
+	{
+		log_error("kmalloc(%d): out of memory", size);
+		return NULL;
 	}
+	AcquireSRWLockExclusive(&heap->rw_lock);
+	heap->large_count++;
+	heap->large_bytes += len;
+	ReleaseSRWLockExclusive(&heap->rw_lock);
+	return mem;
 }
 
-void kfree(void *mem, int size)
+static void free_large(void *mem, int size)
 {
+	size_t len = ALIGN((size_t)size, BLOCK_SIZE);
+	if ((size_t)mem & (BLOCK_SIZE - 1))
+	{
+		log_error("kfree(): Invalid memory pointer or size: (%x, %d)", mem, size);
+		return;
+	}
+	mm_munmap(mem, len);
 	AcquireSRWLockExclusive(&heap->rw_lock);
-	/* Find memory bucket */
-	void *bucket_addr = (void *)((size_t) mem & (-BLOCK_SIZE));
+	heap->large_count--;
+	heap->large_bytes -= len;
+	ReleaseSRWLockExclusive(&heap->rw_lock);
+}
 
-	/* Find pool */
-	int p = -1;
-	for (int i = 0; i < POOL_COUNT; i++)
-		if (size <= heap->pools[i].objsize)
+void *kmalloc(int size)
+{
+	if (size > MAX_OBJSIZE)
+		return alloc_large(size);
+	int p = get_pool(size);
+	if (p == -1)
+	{
+		log_error("kmalloc(%d): invalid size.", size);
+		return NULL;
+	}
+	struct magazine *m = &magazines[p];
+	if (m->count == 0)
+	{
+		/* Refill magazine */
+		struct pool *pool = &heap->pools[p];
+		AcquireSRWLockExclusive(&heap->rw_lock);
+		for (int i = pool->magazine_capacity / 2; i > 0; i--)
+		{
+			void *c = pool_alloc(pool);
+			if (!c)
+				break;
+			m->objects[m->count++] = c;
+		}
+		ReleaseSRWLockExclusive(&heap->rw_lock);
+		if (m->count == 0)
 		{
-			p = i;
-			break;
+			log_error("kmalloc(%d): out of memory", size);
+			return NULL;
 		}
+	}
+	return m->objects[--m->count];
+}
+
+void kfree(void *mem, int size)
+{
+	if (size > MAX_OBJSIZE)
+	{
+		free_large(mem, size);
+		return;
+	}
+	int p = get_pool(size);
 	if (p == -1)
 	{
 		log_error("kfree(): Invalid size: %x", mem);
-		ReleaseSRWLockExclusive(&heap->rw_lock);
 		return;
 	}
+	struct magazine *m = &magazines[p];
+	struct pool *pool = &heap->pools[p];
+	if (m->count == pool->magazine_capacity)
+	{
+		/* Drain the older half of the magazine, recently freed objects are more likely in cache */
+		int batch = pool->magazine_capacity / 2;
+		AcquireSRWLockExclusive(&heap->rw_lock);
+		for (int i = 0; i < batch; i++)
+			pool_free(pool, m->objects[i]);
+		ReleaseSRWLockExclusive(&heap->rw_lock);
+		m->count -= batch;
+		memmove(&m->objects[0], &m->objects[batch], m->count * sizeof(void *));
+	}
+	m->objects[m->count++] = mem;
+}
 
-	/* Loop over the chain to find the corresponding bucket */
-	struct bucket *previous = NULL;
-	struct bucket *current = heap->pools[p].first;
-	while (current)
+void heap_shutdown_thread()
+{
+	AcquireSRWLockExclusive(&heap->rw_lock);
+	for (int p = 0; p < POOL_COUNT; p++)
 	{
-		if (current != bucket_addr)
-		{
-			previous = current;
-			current = current->next_bucket;
-			continue;
-		}
+		struct magazine *m = &magazines[p];
+		for (int i = 0; i < m->count; i++)
+			pool_free(&heap->pools[p], m->objects[i]);
+		m->count = 0;
+	}
+	ReleaseSRWLockExclusive(&heap->rw_lock);
+}
 
-		*(void **)mem = current->first_free;
-		current->first_free = mem;
-		current->ref_cnt--;
+size_t heap_cache_size()
+{
+	size_t size = 0;
+	AcquireSRWLockShared(&heap->rw_lock);
+	for (int i = 0; i < POOL_COUNT; i++)
+		size += (size_t)heap->pools[i].empty_count * BLOCK_SIZE;
+	ReleaseSRWLockShared(&heap->rw_lock);
+	return size;
+}
 
-		if (!current->ref_cnt)
+void heap_cache_shrink(size_t target)
+{
+	AcquireSRWLockExclusive(&heap->rw_lock);
+	size_t size = 0;
+	for (int i = 0; i < POOL_COUNT; i++)
+		size += (size_t)heap->pools[i].empty_count * BLOCK_SIZE;
+	for (int i = 0; i < POOL_COUNT && size > target; i++)
+	{
+		struct pool *pool = &heap->pools[i];
+		while (pool->empty && size > target)
 		{
-			/* Bucket empty, free it */
-			if (!previous)
-				heap->pools[p].first = current->next_bucket;
-			else
-				previous->next_bucket = current->next_bucket;
-			mm_munmap(current, BLOCK_SIZE);
+			struct bucket *b = pool->empty;
+			unlink_bucket(&pool->empty, b);
+			pool->empty_count--;
+			mm_munmap(b, BLOCK_SIZE);
+			pool->bucket_count--;
+			size -= BLOCK_SIZE;
 		}
-		ReleaseSRWLockExclusive(&heap->rw_lock);
-		return;
 	}
-	log_error("kfree(): Invalid memory pointer or size: (%x, %d)", mem, size);
 	ReleaseSRWLockExclusive(&heap->rw_lock);
 }
+
+int heap_get_stats(char *buf)
+{
+	char *original_buf = buf;
+	AcquireSRWLockShared(&heap->rw_lock);
+	buf += ksprintf(buf, " objsize  buckets  allocated       peak\n");
+	for (int i = 0; i < POOL_COUNT; i++)
+	{
+		struct pool *pool = &heap->pools[i];
+		if (pool->bucket_count || pool->peak_allocated)
+			buf += ksprintf(buf, "%8d %8d %10d %10d\n", pool->objsize, pool->bucket_count, pool->allocated, pool->peak_allocated);
+	}
+	buf += ksprintf(buf, "Large objects: %d (%lu kB)\n", heap->large_count, heap->large_bytes / 1024);
+	ReleaseSRWLockShared(&heap->rw_lock);
+	return (int)(buf - original_buf);
+}
@@ -28,5 +28,13 @@ int heap_fork(HANDLE process);
 void heap_afterfork_parent();
 void heap_afterfork_child();
 
+/* Objects larger than 16kB are allocated in their own block aligned mapping */
 void *kmalloc(int size);
 void kfree(void *mem, int size);
+/* Return objects cached by the current thread to the heap, called on thread exit */
+void heap_shutdown_thread();
+/* Get per size class usage statistics, reported in /proc/[pid]/flinux/heap */
+int heap_get_stats(char *buf);
+/* Shrinker of the empty buckets kept for reuse, see cache.h */
+size_t heap_cache_size();
+void heap_cache_shrink(size_t target);
@@ -0,0 +1,447 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dbt/cpuid.h>
+#include <hostinfo.h>
+#include <log.h>
+#include <shared.h>
+#include <str.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#define HOSTINFO_MAX_GROUPS		32
+
+#define HOSTINFO_UNINITIALIZED	0
+#define HOSTINFO_INITIALIZING	1
+#define HOSTINFO_READY			2
+
+/* Text files are generated in a 64kB buffer, see virtualfs_text_get() */
+#define CPUINFO_MAX_LEN			65536
+#define CPUINFO_HEAD_SIZE		512
+#define CPUINFO_TAIL_SIZE		4096
+
+/* Load average decay factors for each 5 seconds period, same as the kernel */
+#define LOAD_FREQ_MS			5000
+#define EXP_1					1884	/* 1/exp(5sec/1min) as fixed-point */
+#define EXP_5					2014	/* 1/exp(5sec/5min) */
+#define EXP_15					2037	/* 1/exp(5sec/15min) */
+/* Periods older than an hour have no visible effect on the averages */
+#define LOAD_MAX_PERIODS		720
+
+struct hostinfo_cpu
+{
+	int package_id;
+	int core_id; /* Index of the core in its package */
+	int siblings; /* Logical processors in the package */
+	int cores; /* Cores in the package */
+};
+
+struct hostinfo_shared_data
+{
+	/* Everything except the load average is filled once by the first process which needs it */
+	volatile LONG state;
+	int cpu_count;
+	int group_count;
+	int group_base[HOSTINFO_MAX_GROUPS]; /* Linux cpu number of the first processor of each group */
+	struct hostinfo_cpu cpus[HOSTINFO_MAX_CPUS];
+	/* The parts of a /proc/cpuinfo entry shared by all processors, before and after the topology */
+	int cpuinfo_head_len, cpuinfo_tail_len;
+	char cpuinfo_head[CPUINFO_HEAD_SIZE];
+	char cpuinfo_tail[CPUINFO_TAIL_SIZE];
+	/* Load average, updated by the reader which finds it due */
+	volatile LONG load_lock;
+	uint64_t load_last_tick;
+	uint64_t load_last_idle, load_last_total;
+	volatile uintptr_t avenrun[3];
+};
+
+static struct hostinfo_shared_data *hostinfo;
+
+void hostinfo_init()
+{
+	hostinfo = (struct hostinfo_shared_data *)shared_alloc(sizeof(struct hostinfo_shared_data));
+}
+
+void hostinfo_afterfork_child()
+{
+	hostinfo = (struct hostinfo_shared_data *)shared_alloc(sizeof(struct hostinfo_shared_data));
+}
+
+static int hostinfo_cpu_index(int group, int number)
+{
+	if (group < 0 || group >= hostinfo->group_count)
+		return -1;
+	int cpu = hostinfo->group_base[group] + number;
+	if (cpu >= hostinfo->cpu_count)
+		return -1;
+	return cpu;
+}
+
+/* Get Linux cpu numbers of processors in a group affinity mask, returns the count */
+static int hostinfo_mask_to_cpus(const GROUP_AFFINITY *affinity, int *cpus)
+{
+	int count = 0;
+	for (int i = 0; i < sizeof(KAFFINITY) * 8; i++)
+		if (affinity->Mask & ((KAFFINITY)1 << i))
+		{
+			int cpu = hostinfo_cpu_index(affinity->Group, i);
+			if (cpu >= 0)
+				cpus[count++] = cpu;
+		}
+	return count;
+}
+
+static bool hostinfo_init_topology()
+{
+	DWORD size = 0;
+	GetLogicalProcessorInformationEx(RelationAll, NULL, &size);
+	if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+		return false;
+	char *buf = (char *)VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!buf)
+		return false;
+	bool ok = false;
+	if (!GetLogicalProcessorInformationEx(RelationAll, (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)buf, &size))
+		goto out;
+	/* Groups first, the other relations refer to processors by group */
+	PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX info;
+	for (DWORD offset = 0; offset < size; offset += info->Size)
+	{
+		info = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)(buf + offset);
+		if (info->Relationship == RelationGroup)
+		{
+			int base = 0;
+			hostinfo->group_count = min(info->Group.ActiveGroupCount, HOSTINFO_MAX_GROUPS);
+			for (int i = 0; i < hostinfo->group_count; i++)
+			{
+				hostinfo->group_base[i] = base;
+				base += info->Group.GroupInfo[i].ActiveProcessorCount;
+			}
+			hostinfo->cpu_count = min(base, HOSTINFO_MAX_CPUS);
+		}
+	}
+	if (hostinfo->cpu_count == 0)
+		goto out;
+	int cpus[HOSTINFO_MAX_CPUS];
+	int package_count = 0;
+	for (DWORD offset = 0; offset < size; offset += info->Size)
+	{
+		info = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)(buf + offset);
+		if (info->Relationship == RelationProcessorPackage)
+		{
+			for (int i = 0; i < info->Processor.GroupCount; i++)
+			{
+				int count = hostinfo_mask_to_cpus(&info->Processor.GroupMask[i], cpus);
+				for (int j = 0; j < count; j++)
+					hostinfo->cpus[cpus[j]].package_id = package_count;
+			}
+			package_count++;
+		}
+	}
+	int package_cores[HOSTINFO_MAX_CPUS] = { 0 };
+	for (DWORD offset = 0; offset < size; offset += info->Size)
+	{
+		info = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)(buf + offset);
+		if (info->Relationship == RelationProcessorCore)
+		{
+			/* A core never spans groups */
+			int count = hostinfo_mask_to_cpus(&info->Processor.GroupMask[0], cpus);
+			if (count == 0)
+				continue;
+			int package = hostinfo->cpus[cpus[0]].package_id;
+			for (int j = 0; j < count; j++)
+				hostinfo->cpus[cpus[j]].core_id = package_cores[package];
+			package_cores[package]++;
+		}
+	}
+	for (int i = 0; i < hostinfo->cpu_count; i++)
+	{
+		int package = hostinfo->cpus[i].package_id;
+		hostinfo->cpus[i].cores = package_cores[package];
+		hostinfo->cpus[i].siblings = 0;
+		for (int j = 0; j < hostinfo->cpu_count; j++)
+			if (hostinfo->cpus[j].package_id == package)
+				hostinfo->cpus[i].siblings++;
+	}
+	ok = true;
+out:
+	VirtualFree(buf, 0, MEM_RELEASE);
+	return ok;
+}
+
+/* Treat every processor as a core of a single package */
+static void hostinfo_init_topology_fallback()
+{
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+	hostinfo->cpu_count = min((int)system_info.dwNumberOfProcessors, HOSTINFO_MAX_CPUS);
+	hostinfo->group_count = 1;
+	hostinfo->group_base[0] = 0;
+	for (int i = 0; i < hostinfo->cpu_count; i++)
+	{
+		hostinfo->cpus[i].package_id = 0;
+		hostinfo->cpus[i].core_id = i;
+		hostinfo->cpus[i].siblings = hostinfo->cpu_count;
+		hostinfo->cpus[i].cores = hostinfo->cpu_count;
+	}
+}
+
+static int hostinfo_get_cpu_mhz()
+{
+	HKEY key;
+	DWORD mhz = 0, size = sizeof(mhz);
+	if (RegOpenKeyExW(HKEY_LOCAL_MACHINE, L"HARDWARE\\DESCRIPTION\\System\\CentralProcessor\\0", 0, KEY_READ, &key) == ERROR_SUCCESS)
+	{
+		if (RegQueryValueExW(key, L"~MHz", NULL, NULL, (LPBYTE)&mhz, &size) != ERROR_SUCCESS)
+			mhz = 0;
+		RegCloseKey(key);
+	}
+	return (int)mhz;
+}
+
+/* The processor information is taken from the emulated cpuid, so it matches what applications see */
+static void hostinfo_init_cpuinfo()
+{
+	struct cpuid_t cpuid;
+
+	char vendorid[13];
+	vendorid[12] = 0;
+	dbt_cpuid(0, 0, &cpuid);
+	int cpuid_level = cpuid.eax;
+	memcpy(vendorid, &cpuid.ebx, sizeof(cpuid.ebx));
+	memcpy(vendorid + 4, &cpuid.edx, sizeof(cpuid.edx));
+	memcpy(vendorid + 8, &cpuid.ecx, sizeof(cpuid.ecx));
+	strip(vendorid);
+
+	dbt_cpuid(1, 0, &cpuid);
+	int clflush_size = ((cpuid.ebx & 0xFF00) >> 8) * 8;
+	int stepping = cpuid.eax & 0xF;
+	int model = (cpuid.eax & 0xF0) >> 4;
+	int family = (cpuid.eax & 0xF00) >> 8;
+
+	int cache_size = 0;
+	for (int i = 0;; i++)
+	{
+		dbt_cpuid(4, i, &cpuid);
+		if (cpuid.eax == 0)
+			break;
+		struct ebx_struct
+		{
+			int line_size: 12;
+			int partitions: 10;
+			int ways: 10;
+		};
+		struct ebx_struct *ebx = (struct ebx_struct *)&cpuid.ebx;
+		cache_size = (ebx->ways + 1) * (ebx->partitions + 1) * (ebx->line_size + 1) * (cpuid.ecx + 1);
+	}
+
+	char modelname[49];
+	modelname[48] = 0;
+	dbt_cpuid(0x80000002, 0, &cpuid);
+	memcpy(modelname, &cpuid, sizeof(cpuid));
+	dbt_cpuid(0x80000003, 0, &cpuid);
+	memcpy(modelname + 16, &cpuid, sizeof(cpuid));
+	dbt_cpuid(0x80000004, 0, &cpuid);
+	memcpy(modelname + 32, &cpuid, sizeof(cpuid));
+	strip(modelname);
+
+	dbt_cpuid(0x80000008, 0, &cpuid);
+	int physical_address_bits = cpuid.eax & 0xFF;
+	int virtual_address_bits = (cpuid.eax & 0xFF00) >> 8;
+
+	int mhz = hostinfo_get_cpu_mhz();
+
+	hostinfo->cpuinfo_head_len = ksprintf(hostinfo->cpuinfo_head,
+		"vendor_id\t: %s\n"
+		"cpu family\t: %d\n"
+		"model\t\t: %d\n"
+		"model name\t: %s\n"
+		"stepping\t: %d\n"
+		"cpu MHz\t\t: %d.000\n"
+		"cache size\t: %d KB\n",
+		vendorid,
+		family,
+		model,
+		modelname,
+		stepping,
+		mhz,
+		cache_size / 1024);
+
+	char flags[CPUINFO_TAIL_SIZE - 512];
+	dbt_get_cpuinfo(flags);
+	hostinfo->cpuinfo_tail_len = ksprintf(hostinfo->cpuinfo_tail,
+		"fpu\t\t: yes\n"
+		"fpu_exception\t: yes\n"
+		"cpuid level\t: %d\n"
+		"wp\t\t: yes\n"
+		"flags\t\t:%s\n"
+		"bogomips\t: %d.00\n"
+		"clflush size\t: %d\n"
+		"cache_alignment\t: %d\n"
+		"address sizes\t: %d bits physical, %d bits virtual\n"
+		"power management:\n",
+		cpuid_level,
+		flags,
+		mhz * 2,
+		clflush_size,
+		clflush_size,
+		physical_address_bits, virtual_address_bits);
+}
+
+static void hostinfo_ensure_ready()
+{
+	if (hostinfo->state == HOSTINFO_READY)
+		return;
+	if (InterlockedCompareExchange(&hostinfo->state, HOSTINFO_INITIALIZING, HOSTINFO_UNINITIALIZED) == HOSTINFO_UNINITIALIZED)
+	{
+		if (!hostinfo_init_topology())
+		{
+			log_warning("GetLogicalProcessorInformationEx() failed, error code: %d", GetLastError());
+			hostinfo_init_topology_fallback();
+		}
+		hostinfo_init_cpuinfo();
+		log_info("Host has %d logical processors.", hostinfo->cpu_count);
+		InterlockedExchange(&hostinfo->state, HOSTINFO_READY);
+	}
+	else
+	{
+		/* Another process is filling it */
+		while (hostinfo->state != HOSTINFO_READY)
+			Sleep(0);
+	}
+}
+
+int hostinfo_get_cpu_count()
+{
+	hostinfo_ensure_ready();
+	return hostinfo->cpu_count;
+}
+
+int hostinfo_get_cpu_index(int group, int number)
+{
+	hostinfo_ensure_ready();
+	return hostinfo_cpu_index(group, number);
+}
+
+bool hostinfo_get_cpu_group(int cpu, int *group, int *number)
+{
+	hostinfo_ensure_ready();
+	if (cpu < 0 || cpu >= hostinfo->cpu_count)
+		return false;
+	/* Groups are numbered in ascending order of their base */
+	for (int i = hostinfo->group_count - 1; i >= 0; i--)
+		if (cpu >= hostinfo->group_base[i])
+		{
+			*group = i;
+			*number = cpu - hostinfo->group_base[i];
+			return *number < sizeof(KAFFINITY) * 8;
+		}
+	return false;
+}
+
+int hostinfo_get_cpuinfo(char *buf)
+{
+	hostinfo_ensure_ready();
+	char *original = buf;
+	for (int i = 0; i < hostinfo->cpu_count; i++)
+	{
+		/* The topology lines take at most 128 bytes */
+		if (buf - original + hostinfo->cpuinfo_head_len + hostinfo->cpuinfo_tail_len + 128 > CPUINFO_MAX_LEN)
+		{
+			log_warning("Too many processors, only the first %d are listed.", i);
+			break;
+		}
+		const struct hostinfo_cpu *cpu = &hostinfo->cpus[i];
+		buf += ksprintf(buf, "processor\t: %d\n", i);
+		memcpy(buf, hostinfo->cpuinfo_head, hostinfo->cpuinfo_head_len);
+		buf += hostinfo->cpuinfo_head_len;
+		buf += ksprintf(buf,
+			"physical id\t: %d\n"
+			"siblings\t: %d\n"
+			"core id\t\t: %d\n"
+			"cpu cores\t: %d\n",
+			cpu->package_id,
+			cpu->siblings,
+			cpu->core_id,
+			cpu->cores);
+		memcpy(buf, hostinfo->cpuinfo_tail, hostinfo->cpuinfo_tail_len);
+		buf += hostinfo->cpuinfo_tail_len;
+		*buf++ = '\n';
+	}
+	return buf - original;
+}
+
+static uintptr_t calc_load(uintptr_t load, uintptr_t exp, uintptr_t active)
+{
+	uintptr_t newload = load * exp + active * (HOSTINFO_LOAD_FIXED_1 - exp);
+	if (active >= load)
+		newload += HOSTINFO_LOAD_FIXED_1 - 1;
+	return newload / HOSTINFO_LOAD_FIXED_1;
+}
+
+/* Windows does not keep a load average, so it is estimated from the system wide cpu usage.
+ * The number of busy processors over each elapsed 5 seconds period is taken as the number of
+ * running tasks and decayed like the kernel does. The samples are only taken when someone reads
+ * the load average, the average usage since the last reading is used for all periods in between.
+ */
+void hostinfo_get_loadavg(uintptr_t loads[3])
+{
+	hostinfo_ensure_ready();
+	uint64_t tick = GetTickCount64();
+	if (tick - hostinfo->load_last_tick >= LOAD_FREQ_MS
+		&& InterlockedCompareExchange(&hostinfo->load_lock, 1, 0) == 0)
+	{
+		uint64_t periods = (tick - hostinfo->load_last_tick) / LOAD_FREQ_MS;
+		if (periods > 0)
+		{
+			LARGE_INTEGER idle_time, kernel_time, user_time;
+			GetSystemTimes((FILETIME *)&idle_time, (FILETIME *)&kernel_time, (FILETIME *)&user_time);
+			/* KernelTime includes IdleTime */
+			uint64_t idle = idle_time.QuadPart, total = kernel_time.QuadPart + user_time.QuadPart;
+			uint64_t delta_idle = idle - hostinfo->load_last_idle, delta_total = total - hostinfo->load_last_total;
+			uintptr_t active = 0;
+			if (delta_total > 0 && delta_total >= delta_idle)
+				active = (uintptr_t)((delta_total - delta_idle) * hostinfo->cpu_count * HOSTINFO_LOAD_FIXED_1 / delta_total);
+			if (hostinfo->load_last_tick == 0)
+			{
+				/* First sample of the session, start from the average usage since boot */
+				for (int i = 0; i < 3; i++)
+					hostinfo->avenrun[i] = active;
+			}
+			else
+			{
+				if (periods > LOAD_MAX_PERIODS)
+					periods = LOAD_MAX_PERIODS;
+				for (uint64_t i = 0; i < periods; i++)
+				{
+					hostinfo->avenrun[0] = calc_load(hostinfo->avenrun[0], EXP_1, active);
+					hostinfo->avenrun[1] = calc_load(hostinfo->avenrun[1], EXP_5, active);
+					hostinfo->avenrun[2] = calc_load(hostinfo->avenrun[2], EXP_15, active);
+				}
+			}
+			hostinfo->load_last_tick = tick;
+			hostinfo->load_last_idle = idle;
+			hostinfo->load_last_total = total;
+		}
+		InterlockedExchange(&hostinfo->load_lock, 0);
+	}
+	for (int i = 0; i < 3; i++)
+		loads[i] = hostinfo->avenrun[i];
+}
@@ -0,0 +1,45 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Information about the host machine, cached in the shared area for the whole session */
+
+#define HOSTINFO_MAX_CPUS		256
+
+/* Fixed point load averages, in the same format as the kernel's avenrun[] */
+#define HOSTINFO_LOAD_FSHIFT	11
+#define HOSTINFO_LOAD_FIXED_1	(1 << HOSTINFO_LOAD_FSHIFT)
+
+void hostinfo_init();
+void hostinfo_afterfork_child();
+
+/* Number of logical processors available to the session */
+int hostinfo_get_cpu_count();
+/* Map a processor of a processor group to its Linux cpu number, returns -1 if it is out of range */
+int hostinfo_get_cpu_index(int group, int number);
+/* Map a Linux cpu number to its processor group and number in the group, returns false if it is out of range */
+bool hostinfo_get_cpu_group(int cpu, int *group, int *number);
+/* Get the text of /proc/cpuinfo */
+int hostinfo_get_cpuinfo(char *buf);
+/* Get 1, 5 and 15 minutes load averages, estimated from the system wide cpu usage */
+void hostinfo_get_loadavg(uintptr_t loads[3]);
@@ -0,0 +1,340 @@
+#include <lib/btree.h>
+#include <heap.h>
+
+/* B+ tree properties:
+ * 1. All entries are stored in leaves, all leaves have the same depth
+ * 2. Every node has at least one key
+ * 3. In an internal node, keys[i] is not larger than any key in child i, and
+ *    for i > 0 it is larger than any key in child i - 1
+ *
+ * The tree is used by the dbt translator which must not clobber SIMD registers,
+ * so entries are moved with plain loops instead of memmove().
+ */
+
+static struct btree_node *btree_alloc_node(struct btree *tree, bool leaf)
+{
+	struct btree_node *node;
+	if (tree->alloc)
+		node = tree->alloc();
+	else
+		node = (struct btree_node *)kmalloc(sizeof(struct btree_node));
+	if (!node)
+		return NULL;
+	node->count = 0;
+	node->leaf = leaf;
+	node->prev = NULL;
+	node->next = NULL;
+	return node;
+}
+
+static void btree_free_node(struct btree *tree, struct btree_node *node)
+{
+	if (tree->free)
+		tree->free(node);
+	else
+		kfree(node, sizeof(struct btree_node));
+}
+
+/* Number of keys in node which are not larger than key */
+static __forceinline int btree_search(const struct btree_node *node, size_t key)
+{
+	int l = 0, r = node->count;
+	while (l < r)
+	{
+		int mid = (l + r) / 2;
+		if (node->keys[mid] <= key)
+			l = mid + 1;
+		else
+			r = mid;
+	}
+	return l;
+}
+
+/* Index of the child of an internal node which may contain key */
+static __forceinline int btree_child_index(const struct btree_node *node, size_t key)
+{
+	int i = btree_search(node, key);
+	return i > 0 ? i - 1 : 0;
+}
+
+static __forceinline void btree_insert_at(struct btree_node *node, int pos, size_t key, void *value)
+{
+	for (int i = node->count; i > pos; i--)
+	{
+		node->keys[i] = node->keys[i - 1];
+		node->values[i] = node->values[i - 1];
+	}
+	node->keys[pos] = key;
+	node->values[pos] = value;
+	node->count++;
+}
+
+static __forceinline void btree_remove_at(struct btree_node *node, int pos)
+{
+	node->count--;
+	for (int i = pos; i < node->count; i++)
+	{
+		node->keys[i] = node->keys[i + 1];
+		node->values[i] = node->values[i + 1];
+	}
+}
+
+/* Split the full child idx of a non full internal node into two halves */
+static bool btree_split_child(struct btree *tree, struct btree_node *parent, int idx)
+{
+	struct btree_node *child = (struct btree_node *)parent->values[idx];
+	struct btree_node *sibling = btree_alloc_node(tree, child->leaf);
+	if (!sibling)
+		return false;
+	int half = child->count / 2;
+	for (int i = half; i < child->count; i++)
+	{
+		sibling->keys[i - half] = child->keys[i];
+		sibling->values[i - half] = child->values[i];
+	}
+	sibling->count = child->count - half;
+	child->count = half;
+	if (child->leaf)
+	{
+		sibling->prev = child;
+		sibling->next = child->next;
+		if (child->next)
+			child->next->prev = sibling;
+		child->next = sibling;
+	}
+	btree_insert_at(parent, idx + 1, sibling->keys[0], sibling);
+	return true;
+}
+
+static void btree_free_subtree(struct btree *tree, struct btree_node *node)
+{
+	if (!node->leaf)
+		for (int i = 0; i < node->count; i++)
+			btree_free_subtree(tree, (struct btree_node *)node->values[i]);
+	btree_free_node(tree, node);
+}
+
+void btree_clear(struct btree *tree)
+{
+	if (tree->root)
+		btree_free_subtree(tree, tree->root);
+	tree->root = NULL;
+	tree->height = 0;
+}
+
+bool btree_insert(struct btree *tree, size_t key, void *value)
+{
+	if (!tree->root)
+	{
+		if (!(tree->root = btree_alloc_node(tree, true)))
+			return false;
+		tree->height = 1;
+	}
+	/* Full nodes are split on the way down so the parent always has room */
+	if (tree->root->count == BTREE_ORDER)
+	{
+		struct btree_node *root = btree_alloc_node(tree, false);
+		if (!root)
+			return false;
+		root->keys[0] = tree->root->keys[0];
+		root->values[0] = tree->root;
+		root->count = 1;
+		if (!btree_split_child(tree, root, 0))
+		{
+			btree_free_node(tree, root);
+			return false;
+		}
+		tree->root = root;
+		tree->height++;
+	}
+	struct btree_node *node = tree->root;
+	while (!node->leaf)
+	{
+		int idx = btree_child_index(node, key);
+		if (key < node->keys[0])
+			node->keys[0] = key;
+		if (((struct btree_node *)node->values[idx])->count == BTREE_ORDER)
+		{
+			if (!btree_split_child(tree, node, idx))
+				return false;
+			if (key >= node->keys[idx + 1])
+				idx++;
+		}
+		node = (struct btree_node *)node->values[idx];
+	}
+	int pos = btree_search(node, key);
+	if (pos > 0 && node->keys[pos - 1] == key)
+		node->values[pos - 1] = value;
+	else
+		btree_insert_at(node, pos, key, value);
+	return true;
+}
+
+/* Return values of btree_remove_from() */
+#define BTREE_NOT_FOUND		0
+#define BTREE_REMOVED		1
+#define BTREE_NODE_EMPTY	2 /* The node is now empty and should be freed by the caller */
+
+static int btree_remove_from(struct btree *tree, struct btree_node *node, size_t key)
+{
+	if (node->leaf)
+	{
+		int pos = btree_search(node, key);
+		if (pos == 0 || node->keys[pos - 1] != key)
+			return BTREE_NOT_FOUND;
+		btree_remove_at(node, pos - 1);
+		if (node->count > 0)
+			return BTREE_REMOVED;
+		if (node->prev)
+			node->prev->next = node->next;
+		if (node->next)
+			node->next->prev = node->prev;
+		return BTREE_NODE_EMPTY;
+	}
+	int idx = btree_child_index(node, key);
+	struct btree_node *child = (struct btree_node *)node->values[idx];
+	int ret = btree_remove_from(tree, child, key);
+	if (ret == BTREE_NODE_EMPTY)
+	{
+		btree_free_node(tree, child);
+		btree_remove_at(node, idx);
+		return node->count > 0 ? BTREE_REMOVED : BTREE_NODE_EMPTY;
+	}
+	return ret;
+}
+
+bool btree_remove(struct btree *tree, size_t key)
+{
+	if (!tree->root)
+		return false;
+	int ret = btree_remove_from(tree, tree->root, key);
+	if (ret == BTREE_NOT_FOUND)
+		return false;
+	if (ret == BTREE_NODE_EMPTY)
+	{
+		btree_free_node(tree, tree->root);
+		tree->root = NULL;
+		tree->height = 0;
+		return true;
+	}
+	/* Shrink the tree while the root has only one child */
+	while (!tree->root->leaf && tree->root->count == 1)
+	{
+		struct btree_node *child = (struct btree_node *)tree->root->values[0];
+		btree_free_node(tree, tree->root);
+		tree->root = child;
+		tree->height--;
+	}
+	return true;
+}
+
+static __forceinline struct btree_node *btree_find_leaf(struct btree *tree, size_t key)
+{
+	struct btree_node *node = tree->root;
+	while (!node->leaf)
+		node = (struct btree_node *)node->values[btree_child_index(node, key)];
+	return node;
+}
+
+void *btree_find(struct btree *tree, size_t key)
+{
+	if (!tree->root)
+		return NULL;
+	struct btree_node *leaf = btree_find_leaf(tree, key);
+	int pos = btree_search(leaf, key);
+	if (pos > 0 && leaf->keys[pos - 1] == key)
+		return leaf->values[pos - 1];
+	return NULL;
+}
+
+bool btree_lower_bound(struct btree *tree, size_t key, struct btree_iter *iter)
+{
+	if (!tree->root)
+		return false;
+	struct btree_node *leaf = btree_find_leaf(tree, key);
+	int pos = btree_search(leaf, key);
+	if (pos > 0 && leaf->keys[pos - 1] == key)
+		pos--;
+	if (pos == leaf->count)
+	{
+		/* All keys in later leaves are larger than key */
+		if (!leaf->next)
+			return false;
+		leaf = leaf->next;
+		pos = 0;
+	}
+	iter->node = leaf;
+	iter->index = pos;
+	return true;
+}
+
+bool btree_upper_bound(struct btree *tree, size_t key, struct btree_iter *iter)
+{
+	if (!tree->root)
+		return false;
+	struct btree_node *leaf = btree_find_leaf(tree, key);
+	int pos = btree_search(leaf, key);
+	if (pos == 0)
+	{
+		/* All keys in earlier leaves are smaller than key */
+		if (!leaf->prev)
+			return false;
+		leaf = leaf->prev;
+		pos = leaf->count;
+	}
+	iter->node = leaf;
+	iter->index = pos - 1;
+	return true;
+}
+
+bool btree_first(struct btree *tree, struct btree_iter *iter)
+{
+	struct btree_node *node = tree->root;
+	if (!node)
+		return false;
+	while (!node->leaf)
+		node = (struct btree_node *)node->values[0];
+	iter->node = node;
+	iter->index = 0;
+	return true;
+}
+
+bool btree_last(struct btree *tree, struct btree_iter *iter)
+{
+	struct btree_node *node = tree->root;
+	if (!node)
+		return false;
+	while (!node->leaf)
+		node = (struct btree_node *)node->values[node->count - 1];
+	iter->node = node;
+	iter->index = node->count - 1;
+	return true;
+}
+
+bool btree_prev(struct btree_iter *iter)
+{
+	if (iter->index > 0)
+	{
+		iter->index--;
+		return true;
+	}
+	if (!iter->node->prev)
+		return false;
+	iter->node = iter->node->prev;
+	iter->index = iter->node->count - 1;
+	return true;
+}
+
+bool btree_next(struct btree_iter *iter)
+{
+	if (iter->index + 1 < iter->node->count)
+	{
+		iter->index++;
+		return true;
+	}
+	if (!iter->node->next)
+		return false;
+	iter->node = iter->node->next;
+	iter->index = 0;
+	return true;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <lib/core.h>
+#include <stdbool.h>
+
+/* B+ tree mapping unique size_t keys to pointers
+ * Nodes are wide so a lookup only touches a few cache lines, and leaves are
+ * linked in key order for iteration. Removal frees empty nodes but does not
+ * merge underfull ones.
+ */
+
+#define BTREE_ORDER		32
+
+struct btree_node
+{
+	int count;
+	bool leaf;
+	struct btree_node *prev, *next; /* Adjacent leaves in key order, leaves only */
+	size_t keys[BTREE_ORDER]; /* For internal nodes, a lower bound of the keys in each child */
+	void *values[BTREE_ORDER]; /* For internal nodes, the children */
+};
+
+/* Node allocator, return NULL on failure */
+typedef struct btree_node *btree_alloc(void);
+typedef void btree_free(struct btree_node *node);
+
+struct btree
+{
+	struct btree_node *root;
+	int height;
+	btree_alloc *alloc; /* kmalloc() if NULL */
+	btree_free *free; /* kfree() if NULL */
+};
+
+/* Position of an entry in a tree, invalidated by insertion and removal */
+struct btree_iter
+{
+	struct btree_node *node;
+	int index;
+};
+
+#define btree_iter_key(iter)	((iter)->node->keys[(iter)->index])
+#define btree_iter_value(iter)	((iter)->node->values[(iter)->index])
+
+/* Test if the tree is empty */
+#define btree_empty(tree)	((tree)->root == NULL)
+
+/* Initialize a tree */
+#define btree_init(tree)	\
+	do { \
+		(tree)->root = NULL; \
+		(tree)->height = 0; \
+		(tree)->alloc = NULL; \
+		(tree)->free = NULL; \
+	} while (0)
+
+/* Initialize a tree with a custom node allocator */
+#define btree_init_allocator(tree, alloc_func, free_func)	\
+	do { \
+		(tree)->root = NULL; \
+		(tree)->height = 0; \
+		(tree)->alloc = (alloc_func); \
+		(tree)->free = (free_func); \
+	} while (0)
+
+/* Remove all entries and free all nodes */
+void btree_clear(struct btree *tree);
+
+/* Add an entry, replacing the value of an existing entry with the same key
+ * Return false if node allocation failed, the tree is unchanged in that case
+ */
+bool btree_insert(struct btree *tree, size_t key, void *value);
+
+/* Remove the entry with the given key, return false if not found */
+bool btree_remove(struct btree *tree, size_t key);
+
+/* Find the value of the entry with the given key, NULL if not found */
+void *btree_find(struct btree *tree, size_t key);
+
+/* Find the entry with the smallest key which is not less than key */
+bool btree_lower_bound(struct btree *tree, size_t key, struct btree_iter *iter);
+
+/* Find the entry with the largest key which is not larger than key */
+bool btree_upper_bound(struct btree *tree, size_t key, struct btree_iter *iter);
+
+/* Get the first entry of a tree, false if the tree is empty */
+bool btree_first(struct btree *tree, struct btree_iter *iter);
+
+/* Get the last entry of a tree, false if the tree is empty */
+bool btree_last(struct btree *tree, struct btree_iter *iter);
+
+/* Move to the precedent entry, false if none */
+bool btree_prev(struct btree_iter *iter);
+
+/* Move to the next entry, false if none */
+bool btree_next(struct btree_iter *iter);
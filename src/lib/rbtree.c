@@ -54,6 +54,11 @@ static __forceinline void rb_left_rotate(struct rb_tree *tree, struct rb_node *n
 		rb_set_parent(p->right, p);
 	n->left = p;
 	rb_set_parent(p, n);
+	if (tree->augment)
+	{
+		tree->augment(p);
+		tree->augment(n);
+	}
 }
 
 static __forceinline void rb_right_rotate(struct rb_tree *tree, struct rb_node *n)
@@ -81,6 +86,11 @@ static __forceinline void rb_right_rotate(struct rb_tree *tree, struct rb_node *
 		rb_set_parent(p->left, p);
 	n->right = p;
 	rb_set_parent(p, n);
+	if (tree->augment)
+	{
+		tree->augment(p);
+		tree->augment(n);
+	}
 }
 
 static void rb_exchange(struct rb_tree *tree, struct rb_node *victim, struct rb_node *replacement)
@@ -119,6 +129,13 @@ static void rb_exchange(struct rb_tree *tree, struct rb_node *victim, struct rb_
 		rb_set_parent(replacement->right, replacement);
 }
 
+/* Recompute augmented data from node up to the root */
+static void rb_augment_propagate(struct rb_tree *tree, struct rb_node *node)
+{
+	for (; node; node = rb_parent(node))
+		tree->augment(node);
+}
+
 static void rb_add_fixup(struct rb_tree *tree, struct rb_node *n)
 {
 	struct rb_node *p = rb_parent(n); /* parent */
@@ -215,6 +232,8 @@ void rb_add(struct rb_tree *tree, struct rb_node *node, rb_cmp *cmp)
 	{
 		tree->root = node;
 		rb_set_parent_and_color(node, NULL, RB_BLACK);
+		if (tree->augment)
+			tree->augment(node);
 		return;
 	}
 
@@ -243,6 +262,9 @@ void rb_add(struct rb_tree *tree, struct rb_node *node, rb_cmp *cmp)
 			cur = cur->right;
 		}
 	}
+	/* Rotations in fixup only change subtrees locally, update the whole path first */
+	if (tree->augment)
+		rb_augment_propagate(tree, node);
 	rb_add_fixup(tree, node);
 }
 
@@ -417,6 +439,9 @@ void rb_remove(struct rb_tree *tree, struct rb_node *node)
 		else
 			p->right = n;
 	}
+	/* All subtrees changed by the removal are on the path from p to the root */
+	if (tree->augment)
+		rb_augment_propagate(tree, p);
 }
 
 struct rb_node *rb_find(struct rb_tree *tree, const struct rb_node *value, rb_cmp *cmp)
@@ -11,9 +11,13 @@ struct rb_node
 #define rb_entry(node, type, member) \
 	container_of(node, type, member)
 
+/* Recompute augmented data of a node from its own data and its children */
+typedef void rb_augment(struct rb_node *node);
+
 struct rb_tree
 {
 	struct rb_node *root;
+	rb_augment *augment; /* For augmented trees, NULL otherwise */
 };
 
 typedef int rb_cmp(const struct rb_node *left, const struct rb_node *right);
@@ -25,6 +29,14 @@ typedef int rb_cmp(const struct rb_node *left, const struct rb_node *right);
 #define rb_init(tree)	\
 	do { \
 		(tree)->root = NULL; \
+		(tree)->augment = NULL; \
+	} while (0)
+
+/* Initialize an augmented tree, the callback is called on every node whose subtree changes */
+#define rb_init_augmented(tree, augment_func)	\
+	do { \
+		(tree)->root = NULL; \
+		(tree)->augment = (augment_func); \
 	} while (0)
 
 /* Add a node to a tree */
@@ -25,12 +25,53 @@
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
 
 int logger_attached;
-static __declspec(thread) HANDLE hLoggerPipe;
+volatile unsigned char log_levels[LOG_CAT_COUNT];
+
+static const char *log_category_names[LOG_CAT_COUNT] = {
+	"generic", "dbt", "mm", "vfs", "socket", "signal", "futex", "process", "timer",
+};
+static const char *log_level_names[LOG_NONE + 1] = {
+	"debug", "info", "warning", "error", "none",
+};
+
+/* Log records are not written to the flog pipe by the logging thread. Every thread appends its
+ * packets to its own ring buffer, which are written in batches by a background writer thread.
+ * Each ring has a single producer (its thread), the writer and log_flush() serialize consumers by
+ * the per ring flush lock. When a ring is full the record is dropped and counted, the writer
+ * reports the number of dropped records instead of blocking the logging thread.
+ * Errors are flushed synchronously, as they are often followed by a crash.
+ */
+#define LOG_RING_SIZE			0x00010000U /* Must be a power of two */
+#define LOG_FLUSH_INTERVAL		10 /* In milliseconds */
+/* Number of format strings remembered per thread, must be a power of two */
+#define LOG_FORMAT_CACHE_SIZE	4096
+#define LOG_FORMAT_CACHE_PROBE	16
+
+struct log_ring
+{
+	struct log_ring *prev, *next;
+	HANDLE pipe;
+	SRWLOCK flush_lock;
+	volatile uint32_t head; /* Written by producer */
+	volatile uint32_t tail; /* Written by consumer */
+	volatile LONG dropped;
+	/* Format strings already sent to the logger on this connection */
+	const char *formats[LOG_FORMAT_CACHE_SIZE];
+	char data[LOG_RING_SIZE];
+};
+
+static __declspec(thread) struct log_ring *current_ring;
+static __declspec(thread) bool ring_deferred; /* Connect on first record, see log_init_thread_deferred() */
 static __declspec(thread) char buffer[1024];
+static SRWLOCK ring_list_lock = SRWLOCK_INIT;
+static struct log_ring *ring_list;
+static HANDLE writer_event;
 
-#define PROTOCOL_VERSION	2
+#define PROTOCOL_VERSION	3
 #define PROTOCOL_MAGIC		'flog'
 struct request
 {
@@ -40,10 +81,21 @@ struct request
 	uint32_t tid;
 };
 
-#define LOG_DEBUG		0
-#define LOG_INFO		1
-#define LOG_WARNING		2
-#define LOG_ERROR		3
+/* Packet kinds, combined with the log level (bits 0-7) and category (bits 16-23) in the type field */
+#define LOG_PACKET_TEXT		0x000
+#define LOG_PACKET_FORMAT	0x100
+#define LOG_PACKET_RECORD	0x200
+#define LOG_PACKET_CATEGORY(category)	((category) << 16)
+
+/* Commands sent by the logger */
+#define LOG_COMMAND_SET_LEVEL	1
+struct command
+{
+	uint32_t command;
+	uint32_t category; /* LOG_CAT_COUNT for all categories */
+	uint32_t level;
+};
+/* Preformatted text */
 struct packet
 {
 	uint32_t packet_size;
@@ -52,21 +104,220 @@ struct packet
 	char text[];
 };
 
+/* Formatting is deferred to the logger. A format string is sent once per connection, identified
+ * by its address. A record carries the id of its format, the raw FILETIME timestamp and the
+ * arguments: all integers are 64-bit, strings are a 32-bit length followed by the characters.
+ */
+struct format_packet
+{
+	uint32_t packet_size;
+	uint32_t type;
+	uint32_t pointer_size;
+	uint32_t len;
+	uint64_t id;
+	char text[];
+};
+
+struct record_packet
+{
+	uint32_t packet_size;
+	uint32_t type;
+	uint64_t id;
+	uint64_t time;
+	char args[];
+};
+
+static int log_format_header(char *buf, char typech)
+{
+	FILETIME tf;
+	win7compat_GetSystemTimePreciseAsFileTime(&tf);
+	/* Convert FILETIME to human readable text */
+	uint64_t time = ((uint64_t)tf.dwHighDateTime << 32ULL) + tf.dwLowDateTime;
+	/* FILETIME is in 100-nanosecond units */
+	uint64_t seconds = (time / 10'000'000ULL);
+	int nano = (int)(time % 10'000'000ULL);
+	int sec = (int)(seconds % 60);
+	int min = (int)((seconds / 60) % 60);
+	int hr = (int)((seconds / 3600) % 24);
+	return ksprintf(buf, "[%02u:%02u:%02u.%07u] (%c%c) ", hr, min, sec, nano, typech, typech);
+}
+
+static void log_detach()
+{
+	logger_attached = 0;
+	for (int i = 0; i < LOG_CAT_COUNT; i++)
+		log_levels[i] = LOG_NONE;
+}
+
+static bool log_write_pipe(HANDLE pipe, const void *data, DWORD size)
+{
+	DWORD bytes_written;
+	if (!WriteFile(pipe, data, size, &bytes_written, NULL))
+	{
+		log_detach();
+		return false;
+	}
+	return true;
+}
+
+void log_set_level(int category, int level)
+{
+	if (!logger_attached)
+		return;
+	if (category == LOG_CAT_COUNT)
+	{
+		for (int i = 0; i < LOG_CAT_COUNT; i++)
+			log_levels[i] = (unsigned char)level;
+	}
+	else
+		log_levels[category] = (unsigned char)level;
+}
+
+void log_get_levels(unsigned char *levels)
+{
+	for (int i = 0; i < LOG_CAT_COUNT; i++)
+		levels[i] = log_levels[i];
+}
+
+void log_set_levels(const unsigned char *levels)
+{
+	for (int i = 0; i < LOG_CAT_COUNT; i++)
+		log_set_level(i, levels[i]);
+}
+
+static int log_find_name(const char **names, int count, const char *name, int len)
+{
+	for (int i = 0; i < count; i++)
+		if (!strncmp(names[i], name, len) && names[i][len] == 0)
+			return i;
+	return -1;
+}
+
+bool log_parse_levels(const char *spec, unsigned char *levels)
+{
+	while (*spec)
+	{
+		const char *end = spec;
+		while (*end && *end != ',')
+			end++;
+		const char *eq = spec;
+		while (eq < end && *eq != '=')
+			eq++;
+		int level;
+		if (eq == end)
+		{
+			/* Level for all categories */
+			level = log_find_name(log_level_names, LOG_NONE + 1, spec, (int)(end - spec));
+			if (level == -1)
+				return false;
+			for (int i = 0; i < LOG_CAT_COUNT; i++)
+				levels[i] = (unsigned char)level;
+		}
+		else
+		{
+			int category = log_find_name(log_category_names, LOG_CAT_COUNT, spec, (int)(eq - spec));
+			level = log_find_name(log_level_names, LOG_NONE + 1, eq + 1, (int)(end - eq - 1));
+			if (category == -1 || level == -1)
+				return false;
+			levels[category] = (unsigned char)level;
+		}
+		spec = *end ? end + 1 : end;
+	}
+	return true;
+}
+
+/* Process commands sent by the logger on a ring's connection, called by the writer */
+static void log_read_commands(struct log_ring *ring)
+{
+	DWORD avail;
+	while (PeekNamedPipe(ring->pipe, NULL, 0, NULL, &avail, NULL) && avail >= sizeof(struct command))
+	{
+		struct command command;
+		DWORD bytes_read;
+		if (!ReadFile(ring->pipe, &command, sizeof(struct command), &bytes_read, NULL) || bytes_read != sizeof(struct command))
+			return;
+		if (command.command == LOG_COMMAND_SET_LEVEL && command.category <= LOG_CAT_COUNT && command.level <= LOG_NONE)
+			log_set_level(command.category, command.level);
+	}
+}
+
+/* Write all pending records of a ring to its pipe */
+static void log_flush_ring(struct log_ring *ring)
+{
+	AcquireSRWLockExclusive(&ring->flush_lock);
+	uint32_t head = ring->head;
+	uint32_t tail = ring->tail;
+	MemoryBarrier();
+	LONG dropped = InterlockedExchange(&ring->dropped, 0);
+	if (head != tail)
+	{
+		uint32_t start = tail & (LOG_RING_SIZE - 1);
+		uint32_t len = head - tail;
+		if (start + len > LOG_RING_SIZE)
+		{
+			log_write_pipe(ring->pipe, ring->data + start, LOG_RING_SIZE - start);
+			log_write_pipe(ring->pipe, ring->data, len - (LOG_RING_SIZE - start));
+		}
+		else
+			log_write_pipe(ring->pipe, ring->data + start, len);
+		/* Make sure the data is consumed before the space is handed back to the producer */
+		MemoryBarrier();
+		ring->tail = head;
+	}
+	if (dropped)
+	{
+		char buf[128];
+		struct packet *packet = (struct packet *)buf;
+		packet->type = LOG_PACKET_TEXT | LOG_WARNING;
+		packet->len = log_format_header(packet->text, 'W');
+		packet->len += ksprintf(packet->text + packet->len, "%d log records dropped: log buffer full.", dropped);
+		packet->packet_size = sizeof(struct packet) + packet->len;
+		log_write_pipe(ring->pipe, buf, packet->packet_size);
+	}
+	ReleaseSRWLockExclusive(&ring->flush_lock);
+}
+
+void log_flush()
+{
+	AcquireSRWLockShared(&ring_list_lock);
+	for (struct log_ring *ring = ring_list; ring; ring = ring->next)
+		log_flush_ring(ring);
+	ReleaseSRWLockShared(&ring_list_lock);
+}
+
+static DWORD WINAPI log_writer_thread(LPVOID parameter)
+{
+	for (;;)
+	{
+		WaitForSingleObject(writer_event, LOG_FLUSH_INTERVAL);
+		if (!logger_attached)
+			return 0;
+		AcquireSRWLockShared(&ring_list_lock);
+		for (struct log_ring *ring = ring_list; ring; ring = ring->next)
+		{
+			log_read_commands(ring);
+			log_flush_ring(ring);
+		}
+		ReleaseSRWLockShared(&ring_list_lock);
+	}
+}
+
 void log_init_thread()
 {
 	if (!logger_attached)
 		return;
 	LPCWSTR pipeName = L"\\\\.\\pipe\\flog_server";
+	HANDLE pipe;
 	for (;;)
 	{
-		hLoggerPipe = CreateFileW(pipeName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
-		if (hLoggerPipe == INVALID_HANDLE_VALUE)
+		pipe = CreateFileW(pipeName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+		if (pipe == INVALID_HANDLE_VALUE)
 		{
 			/* Non critical error code, just wait and try connecting again */
 			if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeW(pipeName, NMPWAIT_WAIT_FOREVER))
 			{
-				logger_attached = 0;
-				break;
+				log_detach();
+				return;
 			}
 			continue;
 		}
@@ -76,82 +327,291 @@ void log_init_thread()
 		request.version = PROTOCOL_VERSION;
 		request.pid = GetProcessId(GetCurrentProcess());
 		request.tid = GetThreadId(GetCurrentThread());
-		DWORD written;
-		if (!WriteFile(hLoggerPipe, &request, sizeof(request), &written, NULL))
+		if (!log_write_pipe(pipe, &request, sizeof(request)))
 		{
-			CloseHandle(hLoggerPipe);
-			logger_attached = 0;
+			CloseHandle(pipe);
+			return;
 		}
 		break;
 	}
+	struct log_ring *ring = (struct log_ring *)VirtualAlloc(NULL, sizeof(struct log_ring), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!ring)
+	{
+		CloseHandle(pipe);
+		log_detach();
+		return;
+	}
+	ring->pipe = pipe;
+	InitializeSRWLock(&ring->flush_lock);
+	AcquireSRWLockExclusive(&ring_list_lock);
+	ring->prev = NULL;
+	ring->next = ring_list;
+	if (ring_list)
+		ring_list->prev = ring;
+	ring_list = ring;
+	ReleaseSRWLockExclusive(&ring_list_lock);
+	current_ring = ring;
+}
+
+void log_init_thread_deferred()
+{
+	if (logger_attached)
+		ring_deferred = true;
 }
 
 void log_init()
 {
 	logger_attached = 1;
+	for (int i = 0; i < LOG_CAT_COUNT; i++)
+		log_levels[i] = LOG_DEBUG;
+	writer_event = CreateEventW(NULL, FALSE, FALSE, NULL);
+	HANDLE writer = CreateThread(NULL, 0, log_writer_thread, NULL, 0, NULL);
+	if (!writer)
+	{
+		log_detach();
+		return;
+	}
+	CloseHandle(writer);
 	log_init_thread();
 }
 
 void log_shutdown()
 {
-	/* TODO */
-	if (logger_attached)
-		CloseHandle(hLoggerPipe);
+	if (!logger_attached)
+		return;
+	log_flush();
+	ring_deferred = false;
+	struct log_ring *ring = current_ring;
+	if (!ring)
+		return;
+	AcquireSRWLockExclusive(&ring_list_lock);
+	if (ring->prev)
+		ring->prev->next = ring->next;
+	else
+		ring_list = ring->next;
+	if (ring->next)
+		ring->next->prev = ring->prev;
+	ReleaseSRWLockExclusive(&ring_list_lock);
+	current_ring = NULL;
+	/* Records logged after the last flush */
+	log_flush_ring(ring);
+	CloseHandle(ring->pipe);
+	VirtualFree(ring, 0, MEM_RELEASE);
 }
 
-static void log_internal(int type, char typech, const char *format, va_list ap)
+/* Append a packet to the ring buffer of current thread */
+static bool log_ring_put(struct log_ring *ring, const void *data, uint32_t size)
 {
-	struct packet *packet = (struct packet*)buffer;
-	packet->type = type;
-	FILETIME tf;
-	SYSTEMTIME ts;
-	win7compat_GetSystemTimePreciseAsFileTime(&tf);
-	/* Convert FILETIME to human readable text */
-	uint64_t time = ((uint64_t)tf.dwHighDateTime << 32ULL) + tf.dwLowDateTime;
-	/* FILETIME is in 100-nanosecond units */
-	uint64_t seconds = (time / 10'000'000ULL);
-	int nano = (int)(time % 10'000'000ULL);
-	int sec = (int)(seconds % 60);
-	int min = (int)((seconds / 60) % 60);
-	int hr = (int)((seconds / 3600) % 24);
-	packet->len = ksprintf(packet->text, "[%02u:%02u:%02u.%07u] (%c%c) ",
-		hr, min, sec, nano, typech, typech);
-	packet->len += kvsprintf(packet->text + packet->len, format, ap);
-	packet->packet_size = sizeof(struct packet) + packet->len;
-	DWORD bytes_written;
-	if (!WriteFile(hLoggerPipe, buffer, packet->packet_size, &bytes_written, NULL))
+	uint32_t head = ring->head;
+	uint32_t used = head - ring->tail;
+	if (size > LOG_RING_SIZE - used)
+	{
+		InterlockedIncrement(&ring->dropped);
+		SetEvent(writer_event);
+		return false;
+	}
+	uint32_t start = head & (LOG_RING_SIZE - 1);
+	if (start + size > LOG_RING_SIZE)
 	{
-		CloseHandle(hLoggerPipe);
-		logger_attached = 0;
+		memcpy(ring->data + start, data, LOG_RING_SIZE - start);
+		memcpy(ring->data, (const char *)data + (LOG_RING_SIZE - start), size - (LOG_RING_SIZE - start));
 	}
+	else
+		memcpy(ring->data + start, data, size);
+	/* Publish the packet after its content */
+	MemoryBarrier();
+	ring->head = head + size;
+	if (used + size >= LOG_RING_SIZE / 2 && used < LOG_RING_SIZE / 2)
+		SetEvent(writer_event);
+	return true;
+}
+
+/* Make sure the logger knows the format string, returns false if it can not be sent */
+static bool log_send_format(struct log_ring *ring, const char *format)
+{
+	uint32_t hash = (uint32_t)(((uintptr_t)format >> 3) * 2654435761U);
+	int slot = -1;
+	for (int i = 0; i < LOG_FORMAT_CACHE_PROBE; i++)
+	{
+		int s = (hash + i) & (LOG_FORMAT_CACHE_SIZE - 1);
+		if (ring->formats[s] == format)
+			return true;
+		if (!ring->formats[s])
+		{
+			slot = s;
+			break;
+		}
+	}
+	if (slot == -1)
+		return false;
+	size_t len = strlen(format);
+	if (sizeof(struct format_packet) + len > sizeof(buffer))
+		return false;
+	struct format_packet *packet = (struct format_packet *)buffer;
+	packet->type = LOG_PACKET_FORMAT;
+	packet->id = (uint64_t)(uintptr_t)format;
+	packet->pointer_size = sizeof(void *);
+	packet->len = (uint32_t)len;
+	memcpy(packet->text, format, len);
+	packet->packet_size = (uint32_t)(sizeof(struct format_packet) + len);
+	if (!log_ring_put(ring, packet, packet->packet_size))
+		return false;
+	ring->formats[slot] = format;
+	return true;
+}
+
+static char *log_encode_int(char *out, char *end, uint64_t value)
+{
+	if (out + sizeof(uint64_t) > end)
+		return end;
+	memcpy(out, &value, sizeof(uint64_t));
+	return out + sizeof(uint64_t);
+}
+
+/* Encode arguments of format, following the conversions supported by kvsprintf() */
+static char *log_encode_args(char *out, char *end, const char *format, va_list ap)
+{
+	while (*format)
+	{
+		if (*format++ != '%')
+			continue;
+		if (*format == '0')
+			format++;
+		while (*format >= '0' && *format <= '9')
+			format++;
+		switch (*format++)
+		{
+		case 'c': out = log_encode_int(out, end, (uint8_t)va_arg(ap, int)); break;
+		case 'd': out = log_encode_int(out, end, (int64_t)va_arg(ap, int32_t)); break;
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X': out = log_encode_int(out, end, va_arg(ap, uint32_t)); break;
+		case 's':
+		case 'S':
+		{
+			bool wide = (format[-1] == 'S');
+			const void *str = va_arg(ap, const void *);
+			if (out + sizeof(uint32_t) > end)
+			{
+				out = end;
+				break;
+			}
+			uint32_t len = 0;
+			char *text = out + sizeof(uint32_t);
+			if (str)
+			{
+				if (wide)
+				{
+					for (const wchar_t *ch = (const wchar_t *)str; *ch && text + len < end; ch++)
+						text[len++] = (char)*ch;
+				}
+				else
+				{
+					for (const char *ch = (const char *)str; *ch && text + len < end; ch++)
+						text[len++] = *ch;
+				}
+			}
+			memcpy(out, &len, sizeof(uint32_t));
+			out = text + len;
+			break;
+		}
+		case 'l':
+		{
+			if (format[0] == 'd')
+			{
+				format++;
+				out = log_encode_int(out, end, (int64_t)va_arg(ap, intptr_t));
+				break;
+			}
+			if (format[0] == 'u')
+			{
+				format++;
+				out = log_encode_int(out, end, va_arg(ap, uintptr_t));
+				break;
+			}
+			if (format[0] == 'l' && (format[1] == 'x' || format[1] == 'd' || format[1] == 'u'))
+			{
+				format += 2;
+				out = log_encode_int(out, end, va_arg(ap, uint64_t));
+				break;
+			}
+			/* Other forms are printed as %p by kvsprintf() */
+			out = log_encode_int(out, end, va_arg(ap, uintptr_t));
+			break;
+		}
+		case 'p': out = log_encode_int(out, end, va_arg(ap, uintptr_t)); break;
+		case '%': break;
+		default: format--; break;
+		}
+	}
+	return out;
+}
+
+static void log_internal(int category, int type, char typech, const char *format, va_list ap)
+{
+	struct log_ring *ring = current_ring;
+	if (!ring)
+	{
+		if (!ring_deferred)
+			return;
+		ring_deferred = false;
+		log_init_thread();
+		if (!(ring = current_ring))
+			return;
+	}
+	if (log_send_format(ring, format))
+	{
+		FILETIME tf;
+		win7compat_GetSystemTimePreciseAsFileTime(&tf);
+		struct record_packet *packet = (struct record_packet *)buffer;
+		packet->type = LOG_PACKET_RECORD | LOG_PACKET_CATEGORY(category) | type;
+		packet->id = (uint64_t)(uintptr_t)format;
+		packet->time = ((uint64_t)tf.dwHighDateTime << 32ULL) + tf.dwLowDateTime;
+		char *end = log_encode_args(packet->args, buffer + sizeof(buffer), format, ap);
+		packet->packet_size = (uint32_t)(end - buffer);
+	}
+	else
+	{
+		/* Format string can not be cached, send as text */
+		struct packet *packet = (struct packet *)buffer;
+		packet->type = LOG_PACKET_TEXT | LOG_PACKET_CATEGORY(category) | type;
+		packet->len = log_format_header(packet->text, typech);
+		packet->len += kvsprintf(packet->text + packet->len, format, ap);
+		packet->packet_size = sizeof(struct packet) + packet->len;
+	}
+	if (!log_ring_put(ring, buffer, *(uint32_t *)buffer))
+		return;
+	if (type == LOG_ERROR)
+		log_flush_ring(ring);
 }
 
-void log_debug_internal(const char *format, ...)
+void log_debug_internal(int category, const char *format, ...)
 {
 	va_list ap;
 	va_start(ap, format);
-	log_internal(LOG_DEBUG, 'D', format, ap);
+	log_internal(category, LOG_DEBUG, 'D', format, ap);
 }
 
-void log_info_internal(const char *format, ...)
+void log_info_internal(int category, const char *format, ...)
 {
 	va_list ap;
 	va_start(ap, format);
-	log_internal(LOG_INFO, 'I', format, ap);
+	log_internal(category, LOG_INFO, 'I', format, ap);
 }
 
-void log_warning_internal(const char *format, ...)
+void log_warning_internal(int category, const char *format, ...)
 {
 	va_list ap;
 	va_start(ap, format);
-	log_internal(LOG_WARNING, 'W', format, ap);
+	log_internal(category, LOG_WARNING, 'W', format, ap);
 }
 
-void log_error_internal(const char *format, ...)
+void log_error_internal(int category, const char *format, ...)
 {
 	va_list ap;
 	va_start(ap, format);
-	log_internal(LOG_ERROR, 'E', format, ap);
+	log_internal(category, LOG_ERROR, 'E', format, ap);
 }
 
 #ifdef _DEBUG
@@ -160,7 +620,7 @@ void log_assert_internal(const char *format, ...)
 {
 	va_list ap;
 	va_start(ap, format);
-	log_internal(LOG_DEBUG, 'D', format, ap);
+	log_internal(LOG_CAT_GENERIC, LOG_DEBUG, 'D', format, ap);
 	process_exit(LOG_ASSERT_EXIT, 0);
 }
 
@@ -19,19 +19,69 @@
 
 #pragma once
 
+#include <stdbool.h>
+
+/* Log levels */
+#define LOG_DEBUG		0
+#define LOG_INFO		1
+#define LOG_WARNING		2
+#define LOG_ERROR		3
+#define LOG_NONE		4 /* Only as a category level: disable all messages */
+
+/* Log categories
+ * A source file selects its category by defining LOG_CATEGORY before including any header
+ */
+#define LOG_CAT_GENERIC		0
+#define LOG_CAT_DBT			1
+#define LOG_CAT_MM			2
+#define LOG_CAT_VFS			3
+#define LOG_CAT_SOCKET		4
+#define LOG_CAT_SIGNAL		5
+#define LOG_CAT_FUTEX		6
+#define LOG_CAT_PROCESS		7
+#define LOG_CAT_TIMER		8
+#define LOG_CAT_COUNT		9
+
+#ifndef LOG_CATEGORY
+#define LOG_CATEGORY		LOG_CAT_GENERIC
+#endif
+
+/* Messages below this level are compiled out */
+#ifndef LOG_COMPILE_LEVEL
+#ifdef _DEBUG
+#define LOG_COMPILE_LEVEL	LOG_DEBUG
+#else
+#define LOG_COMPILE_LEVEL	LOG_INFO
+#endif
+#endif
+
 void log_init_thread();
+/* Connect the current thread to the logger on its first record instead, threads which never log skip the connection */
+void log_init_thread_deferred();
 void log_init();
+/* Flush pending log records of all threads and close the log of current thread */
 void log_shutdown();
-void log_debug_internal(const char *format, ...);
-void log_info_internal(const char *format, ...);
-void log_warning_internal(const char *format, ...);
-void log_error_internal(const char *format, ...);
+/* Write pending log records of all threads to the logger */
+void log_flush();
+void log_debug_internal(int category, const char *format, ...);
+void log_info_internal(int category, const char *format, ...);
+void log_warning_internal(int category, const char *format, ...);
+void log_error_internal(int category, const char *format, ...);
+
+/* Minimum enabled level of each category, can be changed at runtime by the logger */
+void log_set_level(int category, int level);
+void log_get_levels(unsigned char *levels);
+void log_set_levels(const unsigned char *levels);
+/* Parse a level specification: "<level>" or "<category>=<level>[,<category>=<level>...]" */
+bool log_parse_levels(const char *spec, unsigned char *levels);
 
 extern int logger_attached;
-#define log_debug(format, ...) do { if (logger_attached) log_debug_internal(format, __VA_ARGS__); } while (0)
-#define log_info(format, ...) do { if (logger_attached) log_info_internal(format, __VA_ARGS__); } while (0)
-#define log_warning(format, ...) do { if (logger_attached) log_warning_internal(format, __VA_ARGS__); } while (0)
-#define log_error(format, ...) do { if (logger_attached) log_error_internal(format, __VA_ARGS__); } while (0)
+extern volatile unsigned char log_levels[LOG_CAT_COUNT];
+#define log_enabled(level) ((level) >= LOG_COMPILE_LEVEL && log_levels[LOG_CATEGORY] <= (level))
+#define log_debug(format, ...) do { if (log_enabled(LOG_DEBUG)) log_debug_internal(LOG_CATEGORY, format, __VA_ARGS__); } while (0)
+#define log_info(format, ...) do { if (log_enabled(LOG_INFO)) log_info_internal(LOG_CATEGORY, format, __VA_ARGS__); } while (0)
+#define log_warning(format, ...) do { if (log_enabled(LOG_WARNING)) log_warning_internal(LOG_CATEGORY, format, __VA_ARGS__); } while (0)
+#define log_error(format, ...) do { if (log_enabled(LOG_ERROR)) log_error_internal(LOG_CATEGORY, format, __VA_ARGS__); } while (0)
 
 #ifdef _DEBUG
 
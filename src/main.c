@@ -19,16 +19,21 @@
 
 #include <common/auxvec.h>
 #include <common/errno.h>
+#include <dbt/sampler.h>
 #include <syscall/exec.h>
 #include <syscall/fork.h>
 #include <syscall/mm.h>
 #include <syscall/process.h>
 #include <syscall/sig.h>
+#include <syscall/timer.h>
 #include <syscall/tls.h>
 #include <syscall/vfs.h>
+#include <cache.h>
+#include <etw.h>
 #include <flags.h>
 #include <log.h>
 #include <heap.h>
+#include <hostinfo.h>
 #include <shared.h>
 #include <str.h>
 #include <version.h>
@@ -84,6 +89,31 @@ static void print_help()
 	kprintf("Debug options:\n");
 	kprintf("  --dbt-trace       Trace dbt basic block generation.\n");
 	kprintf("  --dbt-trace-all   Full trace of dbt execution. (massive performance drop)\n");
+	kprintf("  --dbt-cache-size <size>\n");
+	kprintf("                    Set the maximum per thread dbt code cache size in megabytes.\n");
+	kprintf("                    (default: 8 on x86, 16 on x64, at most %d)\n", MAX_DBT_CACHE_SIZE);
+	kprintf("  --dbt-pretranslate\n");
+	kprintf("                    Translate direct branch targets ahead of execution.\n");
+	kprintf("  --dbt-profile     Count dbt block executions and log hottest blocks on exit.\n");
+	kprintf("  --dbt-sample <interval>\n");
+	kprintf("                    Sample guest threads every <interval> milliseconds and write\n");
+	kprintf("                    folded stacks to flinux-<pid>.folded on exit.\n");
+	kprintf("  --mm-fault-around <blocks>\n");
+	kprintf("                    Load up to <blocks> detached 64kB blocks around a page fault\n");
+	kprintf("                    in forked processes, 0 to disable. (default: 16)\n");
+	kprintf("  --mm-large-pages  Back large anonymous mappings with large pages. Requires the\n");
+	kprintf("                    \"Lock pages in memory\" privilege.\n");
+	kprintf("  --timer-high-res  Raise system timer resolution while short sleeps are pending.\n");
+	kprintf("  --syscall-stats   Log a summary of syscall counts and time on exit, like strace -c.\n");
+	kprintf("  --tmpfs           Mount an in-memory file system at /tmp. Unix domain sockets can\n");
+	kprintf("                    not be created there.\n");
+	kprintf("  --exec-prefetch   Record the files a program reads at startup and prefetch them\n");
+	kprintf("                    when it is started again.\n");
+	kprintf("  --log-level <spec>\n");
+	kprintf("                    Set minimum level of log messages sent to flog. <spec> is a level\n");
+	kprintf("                    or a comma separated list of <category>=<level>. Levels: debug,\n");
+	kprintf("                    info, warning, error, none. Categories: generic, dbt, mm, vfs,\n");
+	kprintf("                    socket, signal, futex, process, timer.\n");
 }
 
 /*
@@ -94,15 +124,40 @@ static void print_help()
  */
 char *startup;
 
+static const struct
+{
+	const char *name;
+	void (*init)();
+} subsystems[] =
+{
+	{ "shared", shared_init },
+	{ "heap", heap_init },
+	{ "signal", signal_init },
+	{ "process", process_init },
+	{ "tls", tls_init },
+	{ "timer", timer_init },
+	{ "etw", etw_init },
+	{ "vfs", vfs_init },
+	{ "hostinfo", hostinfo_init },
+	{ "cache", cache_init },
+	{ "dbt", dbt_init },
+	{ "sampler", sampler_init },
+};
+
 static void init_subsystems()
 {
-	shared_init();
-	heap_init();
-	signal_init();
-	process_init();
-	tls_init();
-	vfs_init();
-	dbt_init();
+	/* Time each subsystem for the startup breakdown in the log, timer_init() is not done yet */
+	LARGE_INTEGER freq, start, end;
+	QueryPerformanceFrequency(&freq);
+	char breakdown[512], *p = breakdown;
+	for (int i = 0; i < sizeof(subsystems) / sizeof(subsystems[0]); i++)
+	{
+		QueryPerformanceCounter(&start);
+		subsystems[i].init();
+		QueryPerformanceCounter(&end);
+		p += ksprintf(p, " %s %dus", subsystems[i].name, (int)((end.QuadPart - start.QuadPart) * 1000000 / freq.QuadPart));
+	}
+	log_info("Startup time breakdown:%s", breakdown);
 }
 
 #define ENV(x) \
@@ -237,6 +292,100 @@ void main()
 			cmdline_flags->dbt_trace = true;
 			cmdline_flags->dbt_trace_all = true;
 		}
+		else if (!strcmp(argv[i], "--dbt-profile"))
+			cmdline_flags->dbt_profile = true;
+		else if (!strcmp(argv[i], "--dbt-sample"))
+		{
+			int interval = 0;
+			if (++i < argc)
+			{
+				for (const char *ch = argv[i]; *ch; ch++)
+				{
+					if (*ch < '0' || *ch > '9' || interval > 1000)
+					{
+						interval = 0;
+						break;
+					}
+					interval = interval * 10 + (*ch - '0');
+				}
+			}
+			if (interval < 1 || interval > 1000)
+			{
+				init_subsystems();
+				kprintf("--dbt-sample: Interval must be between 1 and 1000.\n");
+				process_exit(1, 0);
+			}
+			cmdline_flags->dbt_sample_interval = interval;
+		}
+		else if (!strcmp(argv[i], "--mm-fault-around"))
+		{
+			int blocks = -1;
+			if (++i < argc && argv[i][0])
+			{
+				blocks = 0;
+				for (const char *ch = argv[i]; *ch; ch++)
+				{
+					if (*ch < '0' || *ch > '9' || blocks > 256)
+					{
+						blocks = -1;
+						break;
+					}
+					blocks = blocks * 10 + (*ch - '0');
+				}
+			}
+			if (blocks < 0 || blocks > 256)
+			{
+				init_subsystems();
+				kprintf("--mm-fault-around: Block count must be between 0 and 256.\n");
+				process_exit(1, 0);
+			}
+			cmdline_flags->mm_fault_around = blocks? blocks: -1;
+		}
+		else if (!strcmp(argv[i], "--mm-large-pages"))
+			cmdline_flags->mm_large_pages = true;
+		else if (!strcmp(argv[i], "--timer-high-res"))
+			cmdline_flags->timer_high_res = true;
+		else if (!strcmp(argv[i], "--syscall-stats"))
+			cmdline_flags->syscall_stats = true;
+		else if (!strcmp(argv[i], "--tmpfs"))
+			cmdline_flags->tmpfs_tmp = true;
+		else if (!strcmp(argv[i], "--exec-prefetch"))
+			cmdline_flags->exec_prefetch = true;
+		else if (!strcmp(argv[i], "--log-level"))
+		{
+			if (++i >= argc || !log_parse_levels(argv[i], cmdline_flags->log_levels))
+			{
+				init_subsystems();
+				kprintf("--log-level: Invalid level specification.\n");
+				process_exit(1, 0);
+			}
+			log_set_levels(cmdline_flags->log_levels);
+		}
+		else if (!strcmp(argv[i], "--dbt-pretranslate"))
+			cmdline_flags->dbt_pretranslate = true;
+		else if (!strcmp(argv[i], "--dbt-cache-size"))
+		{
+			int size = 0;
+			if (++i < argc)
+			{
+				for (const char *ch = argv[i]; *ch; ch++)
+				{
+					if (*ch < '0' || *ch > '9' || size > MAX_DBT_CACHE_SIZE)
+					{
+						size = 0;
+						break;
+					}
+					size = size * 10 + (*ch - '0');
+				}
+			}
+			if (size < 2 || size > MAX_DBT_CACHE_SIZE)
+			{
+				init_subsystems();
+				kprintf("--dbt-cache-size: Size must be between 2 and %d.\n", MAX_DBT_CACHE_SIZE);
+				process_exit(1, 0);
+			}
+			cmdline_flags->dbt_cache_size = size;
+		}
 		else if (argv[i][0] == '-')
 		{
 			init_subsystems();
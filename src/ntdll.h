@@ -7,13 +7,22 @@
 typedef LONG NTSTATUS;
 
 #define STATUS_SUCCESS					0x00000000
+#define STATUS_NOT_ALL_ASSIGNED			0x00000106
 #define STATUS_OBJECT_NAME_EXISTS		0x40000000
 #define STATUS_NO_MORE_FILES			0x80000006
+#define STATUS_NOT_IMPLEMENTED			0xC0000002
+#define STATUS_END_OF_FILE				0xC0000011
 #define STATUS_CONFLICTING_ADDRESSES	0xC0000018
 #define STATUS_NOT_MAPPED_VIEW			0xC0000019
 #define STATUS_ACCESS_DENIED			0xC0000022
+#define STATUS_OBJECT_NAME_NOT_FOUND	0xC0000034
 #define STATUS_OBJECT_NAME_COLLISION	0xC0000035
+#define STATUS_OBJECT_PATH_NOT_FOUND	0xC000003A
 #define STATUS_SHARING_VIOLATION		0xC0000043
+#define STATUS_SECTION_PROTECTION		0xC000004E
+#define STATUS_FILE_IS_A_DIRECTORY		0xC00000BA
+#define STATUS_CANCELLED				0xC0000120
+#define STATUS_PIPE_BROKEN				0xC000014B
 
 #ifndef NT_SUCCESS
 #define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
@@ -230,6 +239,12 @@ NTSYSAPI NTSTATUS NTAPI NtCreateEvent(
 	_In_		BOOLEAN InitialState
 	);
 
+NTSYSAPI NTSTATUS NTAPI NtOpenEvent(
+	_Out_		PHANDLE EventHandle,
+	_In_		ACCESS_MASK DesiredAccess,
+	_In_		POBJECT_ATTRIBUTES ObjectAttributes
+	);
+
 NTSYSAPI NTSTATUS NTAPI NtSetEvent(
 	_In_		HANDLE EventHandle,
 	_Out_opt_	PULONG PreviousState
@@ -318,6 +333,30 @@ NTSYSAPI NTSTATUS NTAPI NtOpenFile(
 	_In_		ULONG OpenOptions
 	);
 
+NTSYSAPI NTSTATUS NTAPI NtReadFile(
+	_In_		HANDLE FileHandle,
+	_In_opt_	HANDLE Event,
+	_In_opt_	PIO_APC_ROUTINE ApcRoutine,
+	_In_opt_	PVOID ApcContext,
+	_Out_		PIO_STATUS_BLOCK IoStatusBlock,
+	_Out_		PVOID Buffer,
+	_In_		ULONG Length,
+	_In_opt_	PLARGE_INTEGER ByteOffset,
+	_In_opt_	PULONG Key
+	);
+
+NTSYSAPI NTSTATUS NTAPI NtWriteFile(
+	_In_		HANDLE FileHandle,
+	_In_opt_	HANDLE Event,
+	_In_opt_	PIO_APC_ROUTINE ApcRoutine,
+	_In_opt_	PVOID ApcContext,
+	_Out_		PIO_STATUS_BLOCK IoStatusBlock,
+	_In_		PVOID Buffer,
+	_In_		ULONG Length,
+	_In_opt_	PLARGE_INTEGER ByteOffset,
+	_In_opt_	PULONG Key
+	);
+
 /* File information class */
 typedef enum _FILE_INFORMATION_CLASS {
 	FileDirectoryInformation = 1,
@@ -376,6 +415,9 @@ typedef enum _FILE_INFORMATION_CLASS {
 	FileStandardLinkInformation,
 	FileRemoteProtocolInformation,
 	FileReplaceCompletionInformation,
+	FileDispositionInformationEx = 64, /* Windows 10 1607 and later */
+	FileRenameInformationEx, /* Windows 10 1607 and later */
+	FileStatInformation = 68, /* Windows 10 1709 and later */
 	FileMaximumInformation
 } FILE_INFORMATION_CLASS, *PFILE_INFORMATION_CLASS;
 
@@ -395,6 +437,17 @@ typedef struct _FILE_RENAME_INFORMATION {
 	WCHAR   FileName[1];
 } FILE_RENAME_INFORMATION, *PFILE_RENAME_INFORMATION;
 
+#define FILE_RENAME_REPLACE_IF_EXISTS					0x00000001
+#define FILE_RENAME_POSIX_SEMANTICS						0x00000002
+#define FILE_RENAME_SUPPRESS_PIN_STATE_INHERITANCE		0x00000004
+#define FILE_RENAME_SUPPRESS_STORAGE_RESERVE_INHERITANCE	0x00000008
+typedef struct _FILE_RENAME_INFORMATION_EX {
+	ULONG   Flags;
+	HANDLE  RootDirectory;
+	ULONG   FileNameLength;
+	WCHAR   FileName[1];
+} FILE_RENAME_INFORMATION_EX, *PFILE_RENAME_INFORMATION_EX;
+
 typedef struct _FILE_LINK_INFORMATION {
 	BOOLEAN ReplaceIfExists;
 	HANDLE  RootDirectory;
@@ -406,10 +459,23 @@ typedef struct _FILE_DISPOSITION_INFORMATION {
 	BOOL    DeleteFile;
 } FILE_DISPOSITION_INFORMATION, *PFILE_DISPOSITION_INFORMATION;
 
+#define FILE_DISPOSITION_DO_NOT_DELETE				0x00000000
+#define FILE_DISPOSITION_DELETE						0x00000001
+#define FILE_DISPOSITION_POSIX_SEMANTICS			0x00000002
+#define FILE_DISPOSITION_FORCE_IMAGE_SECTION_CHECK	0x00000004
+#define FILE_DISPOSITION_ON_CLOSE					0x00000008
+typedef struct _FILE_DISPOSITION_INFORMATION_EX {
+	ULONG Flags;
+} FILE_DISPOSITION_INFORMATION_EX, *PFILE_DISPOSITION_INFORMATION_EX;
+
 typedef struct _FILE_END_OF_FILE_INFORMATION {
 	LARGE_INTEGER EndOfFile;
 } FILE_END_OF_FILE_INFORMATION, *PFILE_END_OF_FILE_INFORMATION;
 
+typedef struct _FILE_ALLOCATION_INFORMATION {
+	LARGE_INTEGER AllocationSize;
+} FILE_ALLOCATION_INFORMATION, *PFILE_ALLOCATION_INFORMATION;
+
 /* NamedPipeState */
 #define FILE_PIPE_DISCONNECTED_STATE	0x00000001
 #define FILE_PIPE_LISTENING_STATE		0x00000002
@@ -433,6 +499,28 @@ typedef struct _FILE_ATTRIBUTE_TAG_INFORMATION {
 	ULONG ReparseTag;
 } FILE_ATTRIBUTE_TAG_INFORMATION, *PFILE_ATTRIBUTE_TAG_INFORMATION;
 
+typedef struct _FILE_MODE_INFORMATION {
+	ULONG Mode;
+} FILE_MODE_INFORMATION, *PFILE_MODE_INFORMATION;
+
+typedef struct _FILE_ALIGNMENT_INFORMATION {
+	ULONG AlignmentRequirement;
+} FILE_ALIGNMENT_INFORMATION, *PFILE_ALIGNMENT_INFORMATION;
+
+typedef struct _FILE_STAT_INFORMATION {
+	LARGE_INTEGER FileId;
+	LARGE_INTEGER CreationTime;
+	LARGE_INTEGER LastAccessTime;
+	LARGE_INTEGER LastWriteTime;
+	LARGE_INTEGER ChangeTime;
+	LARGE_INTEGER AllocationSize;
+	LARGE_INTEGER EndOfFile;
+	ULONG         FileAttributes;
+	ULONG         ReparseTag;
+	ULONG         NumberOfLinks;
+	ACCESS_MASK   EffectiveAccess;
+} FILE_STAT_INFORMATION, *PFILE_STAT_INFORMATION;
+
 typedef struct _FILE_ID_FULL_DIR_INFORMATION {
 	ULONG         NextEntryOffset;
 	ULONG         FileIndex;
@@ -614,6 +702,25 @@ NTSYSAPI NTSTATUS NTAPI NtUnmapViewOfSection(
 	_In_opt_	PVOID BaseAddress
 	);
 
+typedef enum _SECTION_INFORMATION_CLASS {
+	SectionBasicInformation,
+	SectionImageInformation
+} SECTION_INFORMATION_CLASS, *PSECTION_INFORMATION_CLASS;
+
+typedef struct _SECTION_BASIC_INFORMATION {
+	PVOID BaseAddress;
+	ULONG AllocationAttributes;
+	LARGE_INTEGER MaximumSize;
+} SECTION_BASIC_INFORMATION, *PSECTION_BASIC_INFORMATION;
+
+NTSYSAPI NTSTATUS NTAPI NtQuerySection(
+	_In_		HANDLE SectionHandle,
+	_In_		SECTION_INFORMATION_CLASS SectionInformationClass,
+	_Out_		PVOID SectionInformation,
+	_In_		SIZE_T SectionInformationLength,
+	_Out_opt_	PSIZE_T ReturnLength
+	);
+
 /* Thread */
 typedef struct _CLIENT_ID {
 	HANDLE UniqueProcess;
@@ -622,6 +729,59 @@ typedef struct _CLIENT_ID {
 
 typedef LONG KPRIORITY;
 
+/* For SystemProcessInformation */
+typedef struct _SYSTEM_THREAD_INFORMATION {
+	LARGE_INTEGER KernelTime;
+	LARGE_INTEGER UserTime;
+	LARGE_INTEGER CreateTime;
+	ULONG WaitTime;
+	PVOID StartAddress;
+	CLIENT_ID ClientId;
+	KPRIORITY Priority;
+	LONG BasePriority;
+	ULONG ContextSwitches;
+	ULONG ThreadState;
+	ULONG WaitReason;
+} SYSTEM_THREAD_INFORMATION, *PSYSTEM_THREAD_INFORMATION;
+
+typedef struct _SYSTEM_PROCESS_INFORMATION {
+	ULONG NextEntryOffset;
+	ULONG NumberOfThreads;
+	LARGE_INTEGER WorkingSetPrivateSize;
+	ULONG HardFaultCount;
+	ULONG NumberOfThreadsHighWatermark;
+	ULONGLONG CycleTime;
+	LARGE_INTEGER CreateTime;
+	LARGE_INTEGER UserTime;
+	LARGE_INTEGER KernelTime;
+	UNICODE_STRING ImageName;
+	KPRIORITY BasePriority;
+	HANDLE UniqueProcessId;
+	HANDLE InheritedFromUniqueProcessId;
+	ULONG HandleCount;
+	ULONG SessionId;
+	ULONG_PTR UniqueProcessKey;
+	SIZE_T PeakVirtualSize;
+	SIZE_T VirtualSize;
+	ULONG PageFaultCount;
+	SIZE_T PeakWorkingSetSize;
+	SIZE_T WorkingSetSize;
+	SIZE_T QuotaPeakPagedPoolUsage;
+	SIZE_T QuotaPagedPoolUsage;
+	SIZE_T QuotaPeakNonPagedPoolUsage;
+	SIZE_T QuotaNonPagedPoolUsage;
+	SIZE_T PagefileUsage;
+	SIZE_T PeakPagefileUsage;
+	SIZE_T PrivatePageCount;
+	LARGE_INTEGER ReadOperationCount;
+	LARGE_INTEGER WriteOperationCount;
+	LARGE_INTEGER OtherOperationCount;
+	LARGE_INTEGER ReadTransferCount;
+	LARGE_INTEGER WriteTransferCount;
+	LARGE_INTEGER OtherTransferCount;
+	SYSTEM_THREAD_INFORMATION Threads[1];
+} SYSTEM_PROCESS_INFORMATION, *PSYSTEM_PROCESS_INFORMATION;
+
 NTSYSAPI NTSTATUS NTAPI NtDelayExecution(
 	_In_		BOOLEAN Alertable,
 	_In_		PLARGE_INTEGER DelayInterval
@@ -633,6 +793,12 @@ NTSYSAPI NTSTATUS NTAPI NtQueryTimerResolution(
 	_Out_		PULONG ActualResolution
 	);
 
+NTSYSAPI NTSTATUS NTAPI NtSetTimerResolution(
+	_In_		ULONG DesiredResolution,
+	_In_		BOOLEAN SetResolution,
+	_Out_		PULONG CurrentResolution
+	);
+
 typedef enum _NT_THREAD_INFORMATION_CLASS {
 	ThreadBasicInformation,
 	ThreadTimes,
@@ -692,6 +858,17 @@ NTSYSAPI NTSTATUS NTAPI NtQueryInformationToken(
 	_Out_		PULONG ReturnLength
 	);
 
+#define SE_LOCK_MEMORY_PRIVILEGE	4
+
+NTSYSAPI NTSTATUS NTAPI NtAdjustPrivilegesToken(
+	_In_		HANDLE TokenHandle,
+	_In_		BOOLEAN DisableAllPrivileges,
+	_In_opt_	PTOKEN_PRIVILEGES NewState,
+	_In_		ULONG BufferLength,
+	_Out_opt_	PTOKEN_PRIVILEGES PreviousState,
+	_Out_opt_	PULONG ReturnLength
+	);
+
 /* RTL functions */
 #define HASH_STRING_ALGORITHM_DEFAULT	0
 #define HASH_STRING_ALGORITHM_X65599	1
@@ -24,32 +24,48 @@
 
 #include <ntdll.h>
 
-#define SHARED_HEAP_POOL_COUNT	1024
+/* All shared heap pools of a session are mapped in a fixed address window, so a shared object has the
+ * same address in every process. The window is out of the range used for non fixed Linux mappings.
+ * Every pool address is held by a MEM_RESERVE placeholder until the pool is mapped. Views cannot be
+ * mapped into reserved memory before Windows 10, the placeholder is released right before mapping.
+ */
 #define SHARED_HEAP_POOL_SIZE	BLOCK_SIZE
+#define SHARED_HEAP_POOL_COUNT	(int)(SHARED_HEAP_WINDOW_SIZE / SHARED_HEAP_POOL_SIZE)
+#define SHARED_HEAP_POOL_ADDRESS(id)	((char *)SHARED_HEAP_BASE + (size_t)(id) * SHARED_HEAP_POOL_SIZE)
+#define SHARED_HEAP_MIN_SHIFT	4 /* 16 bytes */
+#define SHARED_HEAP_CLASS_COUNT	12 /* Power of two size classes from 16 bytes to 32kB */
 
-struct shared_heap_pool_header
-{
-	volatile int initialized;
-	void *volatile first_free;
-};
+/* Free lists refer to objects as (pool id << 16 | offset in pool) to fit the 64-bit list head,
+ * 0 is the null reference as pool 0 is never used.
+ * Free objects of a size class form a lock free list, the first 4 bytes of a free object hold the
+ * reference of the next. The list head is updated with a 64-bit compare exchange of the reference and
+ * a tag incremented on every update, which avoids the ABA problem.
+ * Pools are never freed, so reading a free object which was just taken by someone else is harmless,
+ * the compare exchange will fail. The shared heap mutex is only used to create new pools.
+ */
+#define SHARED_HEAP_REF(id, offset)	(((uint32_t)(id) << 16) | (uint32_t)(offset))
+#define SHARED_HEAP_REF_ID(ref)		((ref) >> 16)
+#define SHARED_HEAP_REF_OFFSET(ref)	((ref) & 0xFFFF)
 
-struct shared_heap_pool_desc
+struct shared_heap_pool_header
 {
-	/* Use volatile for automatic release semantic and avoids compiler reordering */
-	volatile int obj_size;
-	volatile int ref_count;
-	volatile int next_pool_id;
+	int id;
+	int obj_size;
 };
 
 struct shared_heap_data
 {
-	struct shared_heap_pool_desc pools[SHARED_HEAP_POOL_COUNT];
+	volatile LONGLONG free_list[SHARED_HEAP_CLASS_COUNT]; /* High 32 bits: tag, low 32 bits: first free object */
+	volatile int pool_count; /* Number of pool ids used, including the unused pool 0 */
 };
 
+/* Pools are mapped in a process on first use, either by kmalloc_shared()/kfree_shared() or by the
+ * page fault handler when an object received from another process (or the parent) is accessed.
+ */
 struct shared_heap_mapped_pool_desc
 {
 	HANDLE handle;
-	struct shared_heap_pool_header *addr;
+	volatile bool mapped;
 };
 
 /* This structure stores per process local descriptor of shared data region */
@@ -66,15 +82,45 @@ struct shared_data
 	HANDLE shared_heap_mutex;
 	struct shared_heap_data *shared_heap;
 	struct shared_heap_mapped_pool_desc shared_heap_mapped_pools[SHARED_HEAP_POOL_COUNT];
+
+	/* For shared_get_handle() */
+	HANDLE handles[SHARED_HANDLE_COUNT];
 };
 
 static struct shared_data *shared;
 
+/* Reserve the addresses of all pools not mapped in this process */
+static void shared_reserve_heap_window()
+{
+	int failed = 0;
+	for (int id = 0; id < SHARED_HEAP_POOL_COUNT; id++)
+		if (!VirtualAlloc(SHARED_HEAP_POOL_ADDRESS(id), SHARED_HEAP_POOL_SIZE, MEM_RESERVE, PAGE_NOACCESS))
+			failed++;
+	if (failed)
+		log_warning("shared: %d shared heap pool addresses are already in use, objects in these pools are inaccessible.", failed);
+}
+
 HANDLE shared_get_object_directory()
 {
 	return shared->object_directory;
 }
 
+HANDLE shared_get_handle(int id)
+{
+	return shared->handles[id];
+}
+
+HANDLE shared_set_handle(int id, HANDLE handle)
+{
+	HANDLE old = InterlockedCompareExchangePointer(&shared->handles[id], handle, NULL);
+	if (old)
+	{
+		NtClose(handle);
+		return old;
+	}
+	return handle;
+}
+
 static void shared_create_object_directory()
 {
 	/* Convert session id to wide string */
@@ -159,6 +205,7 @@ void shared_init()
 		NtTerminateProcess(NtCurrentProcess(), 0);
 	}
 	shared->shared_heap = (struct shared_heap_data *)shared_alloc(sizeof(struct shared_heap_data));
+	shared_reserve_heap_window();
 }
 
 bool shared_fork(HANDLE process)
@@ -183,41 +230,12 @@ bool shared_fork(HANDLE process)
 		log_error("shared_fork: Map global shared area failed, status: %x", status);
 		return false;
 	}
-	/* Map mapped shared heap data regions */
-	AcquireSRWLockShared(&shared->rw_lock);
-	int current_pool = shared->shared_heap->pools[0].next_pool_id;
-	while (current_pool != 0)
-	{
-		if (shared->shared_heap_mapped_pools[current_pool].addr)
-		{
-			view_size = SHARED_HEAP_POOL_SIZE;
-			status = NtMapViewOfSection(
-				shared->shared_heap_mapped_pools[current_pool].handle,
-				process,
-				&shared->shared_heap_mapped_pools[current_pool].addr,
-				0,
-				SHARED_HEAP_POOL_SIZE,
-				NULL,
-				&view_size,
-				ViewUnmap,
-				0,
-				PAGE_READWRITE
-				);
-			if (!NT_SUCCESS(status))
-			{
-				log_error("shared_fork: Map shared heap pool %d failed, status: %x", current_pool, status);
-				ReleaseSRWLockShared(&shared->rw_lock);
-				return false;
-			}
-		}
-		current_pool = shared->shared_heap->pools[current_pool].next_pool_id;
-	}
+	/* Shared heap pools are not remapped, the child maps them at the same addresses when used */
 	return true;
 }
 
 void shared_afterfork_parent()
 {
-	ReleaseSRWLockShared(&shared->rw_lock);
 }
 
 void shared_afterfork_child()
@@ -226,6 +244,10 @@ void shared_afterfork_child()
 	InitializeSRWLock(&shared->rw_lock);
 	shared->shared_alloc_current = shared->shared_alloc_begin;
 	shared->shared_heap = (struct shared_heap_data *)shared_alloc(sizeof(struct shared_heap_data));
+	/* Section handles are inherited but the views are not */
+	for (int id = 0; id < SHARED_HEAP_POOL_COUNT; id++)
+		shared->shared_heap_mapped_pools[id].mapped = false;
+	shared_reserve_heap_window();
 }
 
 void *shared_alloc(size_t size)
@@ -242,151 +264,172 @@ void *shared_alloc(size_t size)
 	return ret;
 }
 
-static bool map_shared_heap_pool(size_t obj_size, int id)
+/* Map a shared heap pool in the current process at its fixed address, creating it if it does not exist
+ * Caller ensures the process shared lock is acquired (exclusive)
+ */
+static bool map_shared_heap_pool(int id)
 {
-	/* Create/open shared heap pool */
-	WCHAR namebuf[64];
-	UNICODE_STRING name;
-	OBJECT_ATTRIBUTES oa;
-	RtlInitEmptyUnicodeString(&name, namebuf, sizeof(namebuf));
-	RtlAppendUnicodeToString(&name, L"shared_heap_pool_");
-	RtlAppendIntegerToString(id, 10, &name);
-	InitializeObjectAttributes(&oa, &name, OBJ_INHERIT | OBJ_OPENIF, shared->object_directory, NULL);
-
-	LARGE_INTEGER size;
-	size.QuadPart = SHARED_HEAP_POOL_SIZE;
-	NTSTATUS status = NtCreateSection(&shared->shared_heap_mapped_pools[id].handle,
-		SECTION_MAP_READ | SECTION_MAP_WRITE, &oa, &size, PAGE_READWRITE, SEC_COMMIT, NULL);
-	if (!NT_SUCCESS(status))
+	if (shared->shared_heap_mapped_pools[id].mapped)
+		return true;
+	NTSTATUS status;
+	if (!shared->shared_heap_mapped_pools[id].handle)
 	{
-		log_error("map_shared_heap_pool(%d, %d): NtCreateSection() failed, status: %x", (int)obj_size, id, status);
-		return false;
+		/* Create/open shared heap pool */
+		WCHAR namebuf[64];
+		UNICODE_STRING name;
+		OBJECT_ATTRIBUTES oa;
+		RtlInitEmptyUnicodeString(&name, namebuf, sizeof(namebuf));
+		RtlAppendUnicodeToString(&name, L"shared_heap_pool_");
+		RtlAppendIntegerToString(id, 10, &name);
+		InitializeObjectAttributes(&oa, &name, OBJ_INHERIT | OBJ_OPENIF, shared->object_directory, NULL);
+
+		LARGE_INTEGER size;
+		size.QuadPart = SHARED_HEAP_POOL_SIZE;
+		status = NtCreateSection(&shared->shared_heap_mapped_pools[id].handle,
+			SECTION_MAP_READ | SECTION_MAP_WRITE, &oa, &size, PAGE_READWRITE, SEC_COMMIT, NULL);
+		if (!NT_SUCCESS(status))
+		{
+			shared->shared_heap_mapped_pools[id].handle = NULL;
+			log_error("map_shared_heap_pool(%d): NtCreateSection() failed, status: %x", id, status);
+			return false;
+		}
 	}
 	SIZE_T view_size = SHARED_HEAP_POOL_SIZE;
+	PVOID addr = SHARED_HEAP_POOL_ADDRESS(id);
+	/* Release the placeholder, see shared_reserve_heap_window() */
+	VirtualFree(addr, 0, MEM_RELEASE);
 	status = NtMapViewOfSection(shared->shared_heap_mapped_pools[id].handle, NtCurrentProcess(),
-		(PVOID *)&shared->shared_heap_mapped_pools[id].addr, 0, SHARED_HEAP_POOL_SIZE, NULL, &view_size, ViewUnmap,
-		MEM_TOP_DOWN, PAGE_READWRITE);
+		&addr, 0, SHARED_HEAP_POOL_SIZE, NULL, &view_size, ViewUnmap, 0, PAGE_READWRITE);
 	if (!NT_SUCCESS(status))
 	{
-		NtClose(shared->shared_heap_mapped_pools[id].handle);
-		shared->shared_heap_mapped_pools[id].handle = NULL;
-		shared->shared_heap_mapped_pools[id].addr = NULL;
-		log_error("map_shared_heap_pool(%d, %d): NtMapViewOfSection() failed, status: %x", (int)obj_size, id, status);
+		log_error("map_shared_heap_pool(%d): NtMapViewOfSection() at %p failed, status: %x",
+			id, SHARED_HEAP_POOL_ADDRESS(id), status);
 		return false;
 	}
-	struct shared_heap_pool_header *pool = (struct shared_heap_pool_header *)shared->shared_heap_mapped_pools[id].addr;
- 	if (!pool->initialized)
-	{
-		/* We just created the pool, initialize it now */
-		int pool_ref_count = (SHARED_HEAP_POOL_SIZE - sizeof(struct shared_heap_pool_header)) / obj_size;
-		size_t start = (size_t)pool + ALIGN_TO(sizeof(struct shared_heap_pool_header), 8);
-		size_t end = (size_t)pool + SHARED_HEAP_POOL_SIZE;
-		pool->first_free = (void*)start;
-		for (size_t addr = start; addr < end; addr += obj_size)
-		{
-			if (addr + obj_size < end)
-				*(void**)addr = (void*)(addr + obj_size);
-			else
-				*(void**)addr = NULL;
-		}
-		shared->shared_heap->pools[id].obj_size = obj_size;
-		shared->shared_heap->pools[id].ref_count = pool_ref_count;
-		pool->initialized = true;
-	}
+	/* Publish after the mapping is complete, it is read without the lock */
+	MemoryBarrier();
+	shared->shared_heap_mapped_pools[id].mapped = true;
 	return true;
 }
 
-void *kmalloc_shared(size_t obj_size)
+static bool ensure_shared_heap_pool(int id)
 {
-	obj_size = ALIGN_TO(obj_size, 8);
+	if (shared->shared_heap_mapped_pools[id].mapped)
+		return true;
 	AcquireSRWLockExclusive(&shared->rw_lock);
-	WaitForSingleObject(shared->shared_heap_mutex, INFINITE);
-	int pool_max_ref_count = (SHARED_HEAP_POOL_SIZE - sizeof(struct shared_heap_pool_header)) / obj_size;
-	/* Find or create a pool suitable for requested object size */
-	int last_pool = 0;
-	int current_pool = shared->shared_heap->pools[0].next_pool_id;
-	while (current_pool != 0)
-	{
-		if (shared->shared_heap->pools[current_pool].obj_size == obj_size
-			&& shared->shared_heap->pools[current_pool].ref_count < pool_max_ref_count)
-			break;
-		last_pool = current_pool;
-		current_pool = shared->shared_heap->pools[current_pool].next_pool_id;
-	}
-	if (current_pool == 0)
+	bool mapped = map_shared_heap_pool(id);
+	ReleaseSRWLockExclusive(&shared->rw_lock);
+	return mapped;
+}
+
+bool shared_handle_page_fault(void *addr)
+{
+	if ((size_t)addr < (size_t)SHARED_HEAP_POOL_ADDRESS(1) || (size_t)addr >= (size_t)SHARED_HEAP_POOL_ADDRESS(SHARED_HEAP_POOL_COUNT))
+		return false;
+	int id = (int)(((size_t)addr - SHARED_HEAP_BASE) / SHARED_HEAP_POOL_SIZE);
+	/* A fault in a mapped pool is a real fault */
+	if (id >= shared->shared_heap->pool_count || shared->shared_heap_mapped_pools[id].mapped)
+		return false;
+	log_info("Mapping shared heap pool %d on page fault at %p", id, addr);
+	return ensure_shared_heap_pool(id);
+}
+
+static int shared_heap_get_class(size_t obj_size)
+{
+	int c = 0;
+	while (c < SHARED_HEAP_CLASS_COUNT && ((size_t)1 << (c + SHARED_HEAP_MIN_SHIFT)) < obj_size)
+		c++;
+	return c < SHARED_HEAP_CLASS_COUNT ? c : -1;
+}
+
+/* Push the chain of free objects first...last (last given by its address) to a free list */
+static void shared_heap_push(int c, uint32_t first, void *last)
+{
+	volatile LONGLONG *head = &shared->shared_heap->free_list[c];
+	for (;;)
 	{
-		/* Did not find an appropriate pool, create a new one */
-		/* Firstly, find an unused pool id */
-		for (int i = 1; i < SHARED_HEAP_POOL_COUNT; i++)
-		{
-			if (shared->shared_heap->pools[i].obj_size == 0)
-			{
-				current_pool = i;
-				break;
-			}
-		}
-		/* All pool ids are exhausted, give up */
-		if (current_pool == 0)
-			goto failed;
-		/* Secondly, create the pool with that id */
-		if (!map_shared_heap_pool(obj_size, current_pool))
-			goto failed;
-		/* Finally, link the pool information to the shared data area */
-		shared->shared_heap->pools[current_pool].next_pool_id = 0;
-		shared->shared_heap->pools[last_pool].next_pool_id = current_pool;
+		LONGLONG old_head = *head;
+		*(volatile uint32_t *)last = (uint32_t)old_head;
+		LONGLONG new_head = (((old_head >> 32) + 1) << 32) | first;
+		if (InterlockedCompareExchange64(head, new_head, old_head) == old_head)
+			return;
 	}
+}
+
+/* Create a new pool for size class c and put its objects on the free list */
+static bool shared_heap_grow(int c)
+{
+	/* The process lock is taken before the mutex to keep the lock order */
+	AcquireSRWLockExclusive(&shared->rw_lock);
+	WaitForSingleObject(shared->shared_heap_mutex, INFINITE);
+	bool ok = false;
+	/* Another thread or process may have created a pool while we were waiting */
+	if ((uint32_t)shared->shared_heap->free_list[c] != 0)
+		ok = true;
+	else if (shared->shared_heap->pool_count >= SHARED_HEAP_POOL_COUNT)
+		log_error("kmalloc_shared(): shared heap pools exhausted.");
 	else
 	{
-		if (shared->shared_heap_mapped_pools[current_pool].addr == NULL)
+		int id = shared->shared_heap->pool_count;
+		if (id == 0)
+			id = 1;
+		if (map_shared_heap_pool(id))
 		{
-			/* Pool currently not mapped on this process, map it now */
-			if (!map_shared_heap_pool(obj_size, current_pool))
-				goto failed;
+			int obj_size = 1 << (c + SHARED_HEAP_MIN_SHIFT);
+			struct shared_heap_pool_header *pool = (struct shared_heap_pool_header *)SHARED_HEAP_POOL_ADDRESS(id);
+			pool->id = id;
+			pool->obj_size = obj_size;
+			size_t start = ALIGN_TO(sizeof(struct shared_heap_pool_header), 16);
+			size_t last = start + ((SHARED_HEAP_POOL_SIZE - start) / obj_size - 1) * obj_size;
+			for (size_t offset = start; offset < last; offset += obj_size)
+				*(uint32_t *)((char *)pool + offset) = SHARED_HEAP_REF(id, offset + obj_size);
+			shared->shared_heap->pool_count = id + 1;
+			shared_heap_push(c, SHARED_HEAP_REF(id, start), (char *)pool + last);
+			ok = true;
 		}
 	}
-	/* Pool found and successfully mapped, allocate memory on selected pool */
-	void *cur = shared->shared_heap_mapped_pools[current_pool].addr->first_free;
-	void *next = *(void **)cur;
-	shared->shared_heap_mapped_pools[current_pool].addr->first_free = next;
-	shared->shared_heap->pools[current_pool].ref_count--;
 	NtReleaseMutant(shared->shared_heap_mutex, NULL);
 	ReleaseSRWLockExclusive(&shared->rw_lock);
-	return cur;
+	return ok;
+}
 
-failed:
-	NtReleaseMutant(shared->shared_heap_mutex, NULL);
-	ReleaseSRWLockExclusive(&shared->rw_lock);
-	return NULL;
+void *kmalloc_shared(size_t obj_size)
+{
+	int c = shared_heap_get_class(obj_size);
+	if (c == -1)
+	{
+		log_error("kmalloc_shared(%d): size too large.", (int)obj_size);
+		return NULL;
+	}
+	volatile LONGLONG *head = &shared->shared_heap->free_list[c];
+	for (;;)
+	{
+		LONGLONG old_head = *head;
+		uint32_t ref = (uint32_t)old_head;
+		if (ref == 0)
+		{
+			if (!shared_heap_grow(c))
+				return NULL;
+			continue;
+		}
+		if (!ensure_shared_heap_pool(SHARED_HEAP_REF_ID(ref)))
+			return NULL;
+		void *obj = SHARED_HEAP_POOL_ADDRESS(SHARED_HEAP_REF_ID(ref)) + SHARED_HEAP_REF_OFFSET(ref);
+		uint32_t next = *(volatile uint32_t *)obj;
+		LONGLONG new_head = (((old_head >> 32) + 1) << 32) | next;
+		if (InterlockedCompareExchange64(head, new_head, old_head) == old_head)
+			return obj;
+	}
 }
 
 void kfree_shared(void *obj, size_t obj_size)
 {
-	obj_size = ALIGN_TO(obj_size, 8);
-	AcquireSRWLockExclusive(&shared->rw_lock);
-	WaitForSingleObject(shared->shared_heap_mutex, INFINITE);
-	/* Find pool id */
+	int c = shared_heap_get_class(obj_size);
 	struct shared_heap_pool_header *pool = (struct shared_heap_pool_header *)((size_t)obj & -(SHARED_HEAP_POOL_SIZE));
-	int last_pool = 0;
-	int current_pool = shared->shared_heap->pools[0].next_pool_id;
-	while (shared->shared_heap_mapped_pools[current_pool].addr != pool)
+	if (c == -1 || pool->obj_size != (1 << (c + SHARED_HEAP_MIN_SHIFT)))
 	{
-		last_pool = current_pool;
-		current_pool = shared->shared_heap->pools[current_pool].next_pool_id;
+		log_error("kfree_shared(): Invalid memory pointer or size: (%p, %d)", obj, (int)obj_size);
+		return;
 	}
-	/* Remove occupied memory in shared heap pool */
-	*(void **)obj = pool->first_free;
-	pool->first_free = obj;
-	shared->shared_heap->pools[current_pool].ref_count--;
-	/* If the pool becomes empty after this operation, free the entire pool */
-	if (shared->shared_heap->pools[current_pool].ref_count == 0)
-	{
-		/* Unlink pool */
-		shared->shared_heap->pools[last_pool].next_pool_id = shared->shared_heap->pools[current_pool].next_pool_id;
-		/* Delete pool */
-		NtUnmapViewOfSection(NtCurrentProcess(), shared->shared_heap_mapped_pools[last_pool].addr);
-		shared->shared_heap_mapped_pools[last_pool].handle = NULL;
-		shared->shared_heap_mapped_pools[last_pool].addr = NULL;
-	}
-	NtReleaseMutant(shared->shared_heap_mutex, NULL);
-	ReleaseSRWLockExclusive(&shared->rw_lock);
+	shared_heap_push(c, SHARED_HEAP_REF(pool->id, (char *)obj - (char *)pool), obj);
 }
@@ -26,6 +26,23 @@
 #include <ntdll.h>
 
 HANDLE shared_get_object_directory();
+
+/* Handles of named session objects opened by other subsystems
+ * They are kept in the per process shared descriptor, which is copied to fork children, and are
+ * inherited by them. A child then reuses the parent's handles instead of looking the objects up by
+ * name again. Only objects created with OBJ_INHERIT can be stored.
+ */
+enum
+{
+	SHARED_HANDLE_PROCESS_MUTEX,	/* process_shared_mutex */
+	SHARED_HANDLE_FUTEX_SECTION,	/* futex */
+	SHARED_HANDLE_TIMELINE_SECTION,	/* timeline */
+	SHARED_HANDLE_PREFETCH_SECTION,	/* prefetch */
+	SHARED_HANDLE_COUNT,
+};
+HANDLE shared_get_handle(int id);
+/* Store a newly opened handle, returns the stored handle which is not ours if another thread won the race */
+HANDLE shared_set_handle(int id, HANDLE handle);
 void shared_init();
 bool shared_fork(HANDLE child);
 void shared_afterfork_parent();
@@ -35,19 +52,26 @@ void shared_afterfork_child();
  * Currently the users of this API should make sure to work with zero initialization
  * Because they do not have any chance of manually initialize their shared data area
  */
-#define SHARED_ALLOC_SIZE		4 * BLOCK_SIZE
+#define SHARED_ALLOC_SIZE		5 * BLOCK_SIZE
 void *shared_alloc(size_t size);
 
 /* Memory allocation for shared data regions
- * The shared memory manager creates one or more pools for each size of shared
- * data region. Every pool is managed as a linked list allocator, which
- * is pretty like the heap. But they are equipped with carefully written procedures
- * to avoid races even in the tricky case where one process died when altering the
- * shared pool.
- * Currently the only possible heap sharing scheme is via forking.
- * To simplify the process, we remap all pools currently mapped to the child process
- * to the same memory address at fork time. Hence all shared pointers will stay the
- * same in the child. No additional handling is needed in caller.
+ * The shared memory manager keeps one lock free free list for each size class of shared
+ * data region, backed by 64kB pools. Every pool of the session is mapped at a fixed address
+ * in a reserved window, so a shared pointer is valid in all processes of the session,
+ * including forked children. A process maps a pool when it first allocates from it or
+ * accesses an object in it, in the latter case through shared_handle_page_fault().
+ * The window is reserved at process start so host allocations stay out of it, and is outside
+ * the range mm uses for non fixed Linux mappings. Fixed Linux mappings in it are refused.
  */
+#ifdef _WIN64
+#define SHARED_HEAP_BASE		0x00000001C0000000ULL
+#define SHARED_HEAP_WINDOW_SIZE	0x0000000004000000ULL
+#else
+#define SHARED_HEAP_BASE		0x6F000000U
+#define SHARED_HEAP_WINDOW_SIZE	0x01000000U
+#endif
 void *kmalloc_shared(size_t obj_size);
 void kfree_shared(void *obj, size_t obj_size);
+/* Map the shared heap pool containing addr if it is not mapped yet, returns false if addr is not in an unmapped pool */
+bool shared_handle_page_fault(void *addr);
@@ -24,6 +24,7 @@
 
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#include <emmintrin.h>
 #include <stdarg.h>
 
 #define BUFFER_SIZE	4096
@@ -282,6 +283,108 @@ static __forceinline int utf16_count_len(uint32_t codepoint)
 		return 2;
 }
 
+/* ASCII fast paths
+ * Paths, directory entries and console text are mostly ASCII. These convert a run of ASCII
+ * characters 16 at a time with SSE2 and stop at the first non ASCII character, which is then
+ * handled by the scalar code above.
+ */
+
+/* Bytes which are not ASCII or need escaping in file names: < 0x20 " * / : < > ? | */
+static __forceinline int ascii_filename_special_mask(__m128i v)
+{
+	__m128i special = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(0x1F)), _mm_set1_epi8(0x1F));
+	special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+	special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8('*')));
+	special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+	special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8(':')));
+	special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+	special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+	special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8('?')));
+	special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8('|')));
+	return _mm_movemask_epi8(special);
+}
+
+/* Get the number of leading ASCII bytes, at most count */
+static __forceinline int utf8_ascii_len(const char *data, int count)
+{
+	int i = 0;
+	for (; i + 16 <= count; i += 16)
+		if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(data + i))))
+			break;
+	while (i < count && !(data[i] & 0x80))
+		i++;
+	return i;
+}
+
+/* Convert leading ASCII bytes to UTF-16, at most count, returns the number converted */
+static __forceinline int utf8_ascii_to_utf16(const char *data, uint16_t *out, int count, bool filename)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+		if (_mm_movemask_epi8(v))
+			break;
+		if (filename && ascii_filename_special_mask(v))
+		{
+			for (int j = 0; j < 16; j++)
+				out[i + j] = filename_transform_chars[data[i + j]];
+			continue;
+		}
+		_mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi8(v, zero));
+		_mm_storeu_si128((__m128i *)(out + i + 8), _mm_unpackhi_epi8(v, zero));
+	}
+	for (; i < count && !(data[i] & 0x80); i++)
+		out[i] = filename? filename_transform_chars[data[i]]: data[i];
+	return i;
+}
+
+/* Get the number of leading UTF-16 ASCII characters, at most count */
+static __forceinline int utf16_ascii_len(const uint16_t *data, int count)
+{
+	const __m128i high = _mm_set1_epi16((short)0xFF80);
+	const __m128i zero = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, high), zero)) != 0xFFFF)
+			break;
+	}
+	while (i < count && data[i] < 0x80)
+		i++;
+	return i;
+}
+
+/* Convert leading UTF-16 ASCII characters to UTF-8, at most count, returns the number converted */
+static __forceinline int utf16_ascii_to_utf8(const uint16_t *data, char *out, int count, bool filename)
+{
+	const __m128i high = _mm_set1_epi16((short)0xFF80);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i slash = _mm_set1_epi8('/');
+	int i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i lo = _mm_loadu_si128((const __m128i *)(data + i));
+		__m128i hi = _mm_loadu_si128((const __m128i *)(data + i + 8));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(_mm_or_si128(lo, hi), high), zero)) != 0xFFFF)
+			break;
+		__m128i v = _mm_packus_epi16(lo, hi);
+		if (filename)
+		{
+			/* Only '\\' changes, other ASCII characters are never escaped */
+			__m128i mask = _mm_cmpeq_epi8(v, backslash);
+			v = _mm_or_si128(_mm_andnot_si128(mask, v), _mm_and_si128(mask, slash));
+		}
+		_mm_storeu_si128((__m128i *)(out + i), v);
+	}
+	for (; i < count && data[i] < 0x80; i++)
+		out[i] = (filename && data[i] == '\\')? '/': (char)data[i];
+	return i;
+}
+
 int utf8_to_utf16(const char *data, int srclen, uint16_t *outdata, int dstlen)
 {
 	const char *last = data + srclen;
@@ -291,6 +394,17 @@ int utf8_to_utf16(const char *data, int srclen, uint16_t *outdata, int dstlen)
 	{
 		while (data < last)
 		{
+			if (!(*data & 0x80))
+			{
+				int n = utf8_ascii_to_utf16(data, outdata, (int)min(last - data, outlast - outdata), false);
+				if (n > 0)
+				{
+					data += n;
+					outdata += n;
+					outlen += n;
+					continue;
+				}
+			}
 			uint32_t codepoint = utf8_read_increment(&data, last);
 			if (codepoint == -1)
 				return -1;
@@ -304,6 +418,13 @@ int utf8_to_utf16(const char *data, int srclen, uint16_t *outdata, int dstlen)
 	{
 		while (data < last)
 		{
+			if (!(*data & 0x80))
+			{
+				int n = utf8_ascii_len(data, (int)(last - data));
+				data += n;
+				outlen += n;
+				continue;
+			}
 			uint32_t codepoint = utf8_read_increment(&data, last);
 			if (codepoint == -1)
 				return -1;
@@ -322,10 +443,21 @@ int utf8_to_utf16_filename(const char *data, int srclen, uint16_t *outdata, int
 	{
 		while (data < last)
 		{
+			if (!(*data & 0x80))
+			{
+				int n = utf8_ascii_to_utf16(data, outdata, (int)min(last - data, outlast - outdata), true);
+				if (n > 0)
+				{
+					data += n;
+					outdata += n;
+					outlen += n;
+					continue;
+				}
+			}
 			uint32_t codepoint = utf8_read_increment(&data, last);
 			if (codepoint == -1)
 				return -1;
-			if (codepoint <= 0x80)
+			if (codepoint <= 0x7F)
 				codepoint = filename_transform_chars[codepoint];
 			int r = utf16_write_increment(codepoint, &outdata, outlast);
 			if (r < 0)
@@ -337,6 +469,14 @@ int utf8_to_utf16_filename(const char *data, int srclen, uint16_t *outdata, int
 	{
 		while (data < last)
 		{
+			if (!(*data & 0x80))
+			{
+				/* Escaped ASCII characters are still one UTF-16 unit */
+				int n = utf8_ascii_len(data, (int)(last - data));
+				data += n;
+				outlen += n;
+				continue;
+			}
 			uint32_t codepoint = utf8_read_increment(&data, last);
 			if (codepoint == -1)
 				return -1;
@@ -357,6 +497,17 @@ int utf16_to_utf8(const uint16_t *data, int srclen, char *outdata, int dstlen)
 	{
 		while (data < last)
 		{
+			if (*data < 0x80)
+			{
+				int n = utf16_ascii_to_utf8(data, outdata, (int)min(last - data, outlast - outdata), false);
+				if (n > 0)
+				{
+					data += n;
+					outdata += n;
+					outlen += n;
+					continue;
+				}
+			}
 			uint32_t codepoint = utf16_read_increment(&data, last);
 			if (codepoint == -1)
 				return -1;
@@ -370,6 +521,13 @@ int utf16_to_utf8(const uint16_t *data, int srclen, char *outdata, int dstlen)
 	{
 		while (data < last)
 		{
+			if (*data < 0x80)
+			{
+				int n = utf16_ascii_len(data, (int)(last - data));
+				data += n;
+				outlen += n;
+				continue;
+			}
 			uint32_t codepoint = utf16_read_increment(&data, last);
 			if (codepoint == -1)
 				return -1;
@@ -388,6 +546,17 @@ int utf16_to_utf8_filename(const uint16_t *data, int srclen, char *outdata, int
 	{
 		while (data < last)
 		{
+			if (*data < 0x80)
+			{
+				int n = utf16_ascii_to_utf8(data, outdata, (int)min(last - data, outlast - outdata), true);
+				if (n > 0)
+				{
+					data += n;
+					outdata += n;
+					outlen += n;
+					continue;
+				}
+			}
 			uint32_t codepoint = utf16_read_increment(&data, last);
 			if (codepoint == -1)
 				return -1;
@@ -405,6 +574,13 @@ int utf16_to_utf8_filename(const uint16_t *data, int srclen, char *outdata, int
 	{
 		while (data < last)
 		{
+			if (*data < 0x80)
+			{
+				int n = utf16_ascii_len(data, (int)(last - data));
+				data += n;
+				outlen += n;
+				continue;
+			}
 			uint32_t codepoint = utf16_read_increment(&data, last);
 			if (codepoint == -1)
 				return -1;
@@ -0,0 +1,463 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define LOG_CATEGORY LOG_CAT_VFS
+
+
+#include <common/aio_abi.h>
+#include <common/errno.h>
+#include <common/mman.h>
+#include <common/time.h>
+#include <common/uio.h>
+#include <fs/winfs.h>
+#include <syscall/mm.h>
+#include <syscall/process_info.h>
+#include <syscall/syscall.h>
+#include <syscall/timer.h>
+#include <syscall/vfs.h>
+#include <heap.h>
+#include <log.h>
+
+#include <stdbool.h>
+#include <ntdll.h>
+
+/* Linux AIO on top of I/O completion ports
+ * Each AIO context owns a completion port. Reads and writes on winfs files are issued as overlapped
+ * NtReadFile()/NtWriteFile() calls on a private handle associated with the port, everything else
+ * is executed synchronously in io_submit() and posted to the port as an already completed request.
+ * The context id is the address of a zeroed read only page, which makes libaio think the completion
+ * ring is not available in user space and always call io_getevents().
+ */
+
+#define AIO_MAX_CONTEXTS	16
+#define AIO_MAX_FILES		64
+#define AIO_MAX_EVENTS		4096
+#define AIO_REAP_BATCH		64
+/* Largest byte count of a single read or write, same as MAX_RW_COUNT of Linux */
+#define AIO_MAX_RW_COUNT	0x7FFFF000
+
+/* Completion key of wake up packets, requests on file handles use key 0 */
+#define AIO_KEY_WAKE		1
+
+extern intptr_t sys_pread64(int fd, char *buf, size_t count, loff_t offset);
+extern intptr_t sys_pwrite64(int fd, const char *buf, size_t count, loff_t offset);
+extern intptr_t sys_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+extern intptr_t sys_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+extern intptr_t sys_fsync(int fd);
+extern intptr_t sys_fdatasync(int fd);
+
+struct aio_request
+{
+	uint64_t data, obj;
+	bool done; /* Completed synchronously, the result is in res */
+	int64_t res;
+	IO_STATUS_BLOCK status_block;
+};
+
+struct aio_file
+{
+	struct file *f;
+	HANDLE handle; /* Overlapped handle associated with the completion port */
+};
+
+struct aio_context
+{
+	aio_context_t id;
+	HANDLE port;
+	LONG max_events;
+	volatile LONG in_flight; /* Submitted but not yet reaped requests */
+	volatile LONG users; /* Number of system calls currently using the context */
+	volatile bool destroyed;
+	SRWLOCK lock; /* Protects files[] */
+	int file_count;
+	struct aio_file files[AIO_MAX_FILES];
+};
+
+/* AIO contexts are not inherited by fork() children */
+static struct aio_context aio_contexts[AIO_MAX_CONTEXTS];
+static SRWLOCK aio_lock = SRWLOCK_INIT;
+
+static struct aio_context *aio_get_context(aio_context_t id)
+{
+	struct aio_context *ctx = NULL;
+	AcquireSRWLockShared(&aio_lock);
+	for (int i = 0; i < AIO_MAX_CONTEXTS; i++)
+		if (aio_contexts[i].port && aio_contexts[i].id == id && !aio_contexts[i].destroyed)
+		{
+			ctx = &aio_contexts[i];
+			InterlockedIncrement(&ctx->users);
+			break;
+		}
+	ReleaseSRWLockShared(&aio_lock);
+	return ctx;
+}
+
+static void aio_put_context(struct aio_context *ctx)
+{
+	InterlockedDecrement(&ctx->users);
+}
+
+/* Get the overlapped handle of a winfs file, returns INVALID_HANDLE_VALUE if the request must be done synchronously */
+static HANDLE aio_get_handle(struct aio_context *ctx, struct file *f)
+{
+	if (!winfs_is_winfile(f))
+		return INVALID_HANDLE_VALUE;
+	HANDLE handle = INVALID_HANDLE_VALUE;
+	AcquireSRWLockShared(&ctx->lock);
+	for (int i = 0; i < ctx->file_count; i++)
+		if (ctx->files[i].f == f)
+		{
+			handle = ctx->files[i].handle;
+			break;
+		}
+	ReleaseSRWLockShared(&ctx->lock);
+	if (handle != INVALID_HANDLE_VALUE)
+		return handle;
+
+	AcquireSRWLockExclusive(&ctx->lock);
+	for (int i = 0; i < ctx->file_count; i++)
+		if (ctx->files[i].f == f)
+		{
+			handle = ctx->files[i].handle;
+			goto out;
+		}
+	if (ctx->file_count == AIO_MAX_FILES)
+		goto out;
+	handle = winfs_open_async(f);
+	if (handle == INVALID_HANDLE_VALUE)
+		goto out;
+	if (!CreateIoCompletionPort(handle, ctx->port, 0, 0))
+	{
+		log_warning("CreateIoCompletionPort() failed, error code: %d", GetLastError());
+		NtClose(handle);
+		handle = INVALID_HANDLE_VALUE;
+		goto out;
+	}
+	vfs_ref(f);
+	ctx->files[ctx->file_count].f = f;
+	ctx->files[ctx->file_count].handle = handle;
+	ctx->file_count++;
+out:
+	ReleaseSRWLockExclusive(&ctx->lock);
+	return handle;
+}
+
+static int64_t aio_submit_sync(struct iocb *iocb)
+{
+	int fd = iocb->aio_fildes;
+	void *buf = (void *)(uintptr_t)iocb->aio_buf;
+	switch (iocb->aio_lio_opcode)
+	{
+	case IOCB_CMD_PREAD: return sys_pread64(fd, buf, (size_t)iocb->aio_nbytes, iocb->aio_offset);
+	case IOCB_CMD_PWRITE: return sys_pwrite64(fd, buf, (size_t)iocb->aio_nbytes, iocb->aio_offset);
+	case IOCB_CMD_PREADV: return sys_preadv(fd, buf, (int)iocb->aio_nbytes, (off_t)iocb->aio_offset);
+	case IOCB_CMD_PWRITEV: return sys_pwritev(fd, buf, (int)iocb->aio_nbytes, (off_t)iocb->aio_offset);
+	case IOCB_CMD_FSYNC: return sys_fsync(fd);
+	case IOCB_CMD_FDSYNC: return sys_fdatasync(fd);
+	default: return 0; /* IOCB_CMD_NOOP */
+	}
+}
+
+static int aio_submit_one(struct aio_context *ctx, struct iocb *iocb)
+{
+	if (iocb->aio_flags & IOCB_FLAG_RESFD)
+	{
+		log_error("IOCB_FLAG_RESFD not supported.");
+		return -L_EINVAL;
+	}
+	if (iocb->aio_reserved2)
+		return -L_EINVAL;
+	int opcode = iocb->aio_lio_opcode;
+	if (opcode != IOCB_CMD_PREAD && opcode != IOCB_CMD_PWRITE && opcode != IOCB_CMD_PREADV && opcode != IOCB_CMD_PWRITEV
+		&& opcode != IOCB_CMD_FSYNC && opcode != IOCB_CMD_FDSYNC && opcode != IOCB_CMD_NOOP)
+	{
+		log_error("Unsupported iocb opcode: %d", opcode);
+		return -L_EINVAL;
+	}
+	struct file *f = vfs_get(iocb->aio_fildes);
+	if (!f)
+		return -L_EBADF;
+	void *buf = (void *)(uintptr_t)iocb->aio_buf;
+	ULONG count = (ULONG)min(iocb->aio_nbytes, AIO_MAX_RW_COUNT);
+	if ((opcode == IOCB_CMD_PREAD && !mm_check_write(buf, count))
+		|| (opcode == IOCB_CMD_PWRITE && !mm_check_read(buf, count)))
+	{
+		vfs_release(f);
+		return -L_EFAULT;
+	}
+	if (InterlockedIncrement(&ctx->in_flight) > ctx->max_events)
+	{
+		InterlockedDecrement(&ctx->in_flight);
+		vfs_release(f);
+		return -L_EAGAIN;
+	}
+	struct aio_request *req = (struct aio_request *)kmalloc(sizeof(struct aio_request));
+	req->data = iocb->aio_data;
+	req->obj = (uintptr_t)iocb;
+	req->done = true;
+	HANDLE handle = INVALID_HANDLE_VALUE;
+	if (opcode == IOCB_CMD_PREAD || opcode == IOCB_CMD_PWRITE)
+		handle = aio_get_handle(ctx, f);
+	if (handle != INVALID_HANDLE_VALUE)
+	{
+		/* The completion packet carries req as its context */
+		req->done = false;
+		LARGE_INTEGER offset;
+		offset.QuadPart = iocb->aio_offset;
+		NTSTATUS status;
+		if (opcode == IOCB_CMD_PREAD)
+			status = NtReadFile(handle, NULL, NULL, req, &req->status_block, buf, count, &offset, NULL);
+		else
+			status = NtWriteFile(handle, NULL, NULL, req, &req->status_block, buf, count, &offset, NULL);
+		if (NT_ERROR(status))
+		{
+			/* Failed immediately, no completion packet will be queued */
+			req->done = true;
+			req->res = status == STATUS_END_OF_FILE ? 0 : -L_EIO;
+			PostQueuedCompletionStatus(ctx->port, 0, 0, (LPOVERLAPPED)req);
+		}
+	}
+	else
+	{
+		req->res = aio_submit_sync(iocb);
+		PostQueuedCompletionStatus(ctx->port, 0, 0, (LPOVERLAPPED)req);
+	}
+	vfs_release(f);
+	return 0;
+}
+
+static void aio_fill_event(struct io_event *event, struct aio_request *req)
+{
+	event->data = req->data;
+	event->obj = req->obj;
+	if (req->done)
+		event->res = req->res;
+	else if (req->status_block.Status == STATUS_END_OF_FILE)
+		event->res = 0;
+	else if (req->status_block.Status == STATUS_CANCELLED)
+		event->res = -L_ECANCELED;
+	else if (NT_ERROR(req->status_block.Status))
+		event->res = -L_EIO;
+	else
+		event->res = req->status_block.Information;
+	event->res2 = 0;
+	kfree(req, sizeof(struct aio_request));
+}
+
+static VOID CALLBACK aio_wake_callback(PVOID parameter, BOOLEAN timer_or_wait_fired)
+{
+	PostQueuedCompletionStatus((HANDLE)parameter, 0, AIO_KEY_WAKE, NULL);
+}
+
+DEFINE_SYSCALL(io_setup, unsigned int, nr_events, aio_context_t *, ctxp)
+{
+	log_info("io_setup(%u, %p)", nr_events, ctxp);
+	if (!mm_check_write(ctxp, sizeof(aio_context_t)))
+		return -L_EFAULT;
+	if (*ctxp || nr_events == 0)
+		return -L_EINVAL;
+	if (nr_events > AIO_MAX_EVENTS)
+		return -L_EAGAIN;
+	int r = -L_EAGAIN;
+	AcquireSRWLockExclusive(&aio_lock);
+	for (int i = 0; i < AIO_MAX_CONTEXTS; i++)
+	{
+		struct aio_context *ctx = &aio_contexts[i];
+		if (ctx->port)
+			continue;
+		void *page = mm_mmap(NULL, PAGE_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, 0, NULL, 0);
+		if ((uintptr_t)page >= (uintptr_t)-PAGE_SIZE)
+		{
+			r = (int)(intptr_t)page;
+			break;
+		}
+		HANDLE port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+		if (!port)
+		{
+			log_error("CreateIoCompletionPort() failed, error code: %d", GetLastError());
+			mm_munmap(page, PAGE_SIZE);
+			break;
+		}
+		ctx->id = (aio_context_t)page;
+		ctx->port = port;
+		ctx->max_events = nr_events;
+		ctx->in_flight = 0;
+		ctx->users = 0;
+		ctx->destroyed = false;
+		InitializeSRWLock(&ctx->lock);
+		ctx->file_count = 0;
+		*ctxp = ctx->id;
+		r = 0;
+		break;
+	}
+	ReleaseSRWLockExclusive(&aio_lock);
+	return r;
+}
+
+DEFINE_SYSCALL(io_destroy, aio_context_t, ctx_id)
+{
+	log_info("io_destroy(%p)", ctx_id);
+	struct aio_context *ctx = NULL;
+	AcquireSRWLockExclusive(&aio_lock);
+	for (int i = 0; i < AIO_MAX_CONTEXTS; i++)
+		if (aio_contexts[i].port && aio_contexts[i].id == ctx_id && !aio_contexts[i].destroyed)
+		{
+			ctx = &aio_contexts[i];
+			ctx->destroyed = true;
+			break;
+		}
+	ReleaseSRWLockExclusive(&aio_lock);
+	if (!ctx)
+		return -L_EINVAL;
+	/* Kick threads blocked in io_getevents() and wait for all users to leave */
+	while (ctx->users > 0)
+	{
+		PostQueuedCompletionStatus(ctx->port, 0, AIO_KEY_WAKE, NULL);
+		Sleep(1);
+	}
+	for (int i = 0; i < ctx->file_count; i++)
+		CancelIoEx(ctx->files[i].handle, NULL);
+	while (ctx->in_flight > 0)
+	{
+		OVERLAPPED_ENTRY entries[AIO_REAP_BATCH];
+		ULONG removed;
+		if (!GetQueuedCompletionStatusEx(ctx->port, entries, AIO_REAP_BATCH, &removed, INFINITE, FALSE))
+			break;
+		for (ULONG i = 0; i < removed; i++)
+			if (entries[i].lpCompletionKey != AIO_KEY_WAKE)
+			{
+				kfree(entries[i].lpOverlapped, sizeof(struct aio_request));
+				InterlockedDecrement(&ctx->in_flight);
+			}
+	}
+	for (int i = 0; i < ctx->file_count; i++)
+	{
+		NtClose(ctx->files[i].handle);
+		vfs_release(ctx->files[i].f);
+	}
+	CloseHandle(ctx->port);
+	mm_munmap((void *)ctx->id, PAGE_SIZE);
+	AcquireSRWLockExclusive(&aio_lock);
+	ctx->id = 0;
+	ctx->port = NULL;
+	ReleaseSRWLockExclusive(&aio_lock);
+	return 0;
+}
+
+DEFINE_SYSCALL(io_submit, aio_context_t, ctx_id, intptr_t, nr, struct iocb **, iocbpp)
+{
+	log_info("io_submit(%p, %d, %p)", ctx_id, nr, iocbpp);
+	if (nr < 0)
+		return -L_EINVAL;
+	if (!mm_check_read(iocbpp, nr * sizeof(struct iocb *)))
+		return -L_EFAULT;
+	struct aio_context *ctx = aio_get_context(ctx_id);
+	if (!ctx)
+		return -L_EINVAL;
+	intptr_t i;
+	int r = 0;
+	for (i = 0; i < nr; i++)
+	{
+		if (!mm_check_read(iocbpp[i], sizeof(struct iocb)))
+			r = -L_EFAULT;
+		else
+			r = aio_submit_one(ctx, iocbpp[i]);
+		if (r < 0)
+			break;
+	}
+	aio_put_context(ctx);
+	return i > 0 ? i : r;
+}
+
+DEFINE_SYSCALL(io_getevents, aio_context_t, ctx_id, intptr_t, min_nr, intptr_t, nr, struct io_event *, events, struct timespec *, timeout)
+{
+	log_info("io_getevents(%p, %d, %d, %p, %p)", ctx_id, min_nr, nr, events, timeout);
+	if (min_nr < 0 || nr < 0 || min_nr > nr)
+		return -L_EINVAL;
+	if (!mm_check_write(events, nr * sizeof(struct io_event)))
+		return -L_EFAULT;
+	if (timeout && !mm_check_read(timeout, sizeof(struct timespec)))
+		return -L_EFAULT;
+	if (timeout && timer_timespec_to_ns(timeout) < 0)
+		return -L_EINVAL;
+	struct aio_context *ctx = aio_get_context(ctx_id);
+	if (!ctx)
+		return -L_EINVAL;
+	/* Validated above */
+	DWORD timeout_ms = timeout ? (DWORD)timer_timespec_to_ms(timeout) : INFINITE;
+	uint64_t end = timer_monotonic_ms() + timeout_ms;
+	HANDLE wait = NULL;
+	intptr_t count = 0;
+	int r = 0;
+	while (count < nr)
+	{
+		DWORD wait_ms = 0;
+		if (count < min_nr)
+		{
+			if (timeout_ms == INFINITE)
+				wait_ms = INFINITE;
+			else
+			{
+				uint64_t now = timer_monotonic_ms();
+				wait_ms = now < end ? (DWORD)(end - now) : 0;
+			}
+		}
+		/* A pending signal posts a wake up packet to the port while we are blocked */
+		if (wait_ms && !wait
+			&& !RegisterWaitForSingleObject(&wait, current_thread->sigevent, aio_wake_callback, ctx->port, INFINITE, WT_EXECUTEONLYONCE))
+			wait = NULL;
+		OVERLAPPED_ENTRY entries[AIO_REAP_BATCH];
+		ULONG removed;
+		if (!GetQueuedCompletionStatusEx(ctx->port, entries, (ULONG)min(nr - count, AIO_REAP_BATCH), &removed, wait_ms, FALSE))
+			break;
+		bool interrupted = false;
+		for (ULONG i = 0; i < removed; i++)
+		{
+			if (entries[i].lpCompletionKey == AIO_KEY_WAKE)
+			{
+				/* Stale packets of previous calls are ignored */
+				if (ctx->destroyed || WaitForSingleObject(current_thread->sigevent, 0) == WAIT_OBJECT_0)
+					interrupted = true;
+				continue;
+			}
+			aio_fill_event(&events[count++], (struct aio_request *)entries[i].lpOverlapped);
+			InterlockedDecrement(&ctx->in_flight);
+		}
+		if (interrupted)
+		{
+			r = ctx->destroyed ? -L_EINVAL : -L_EINTR;
+			break;
+		}
+	}
+	if (wait)
+		UnregisterWaitEx(wait, INVALID_HANDLE_VALUE);
+	aio_put_context(ctx);
+	return count > 0 ? count : r;
+}
+
+DEFINE_SYSCALL(io_cancel, aio_context_t, ctx_id, struct iocb *, iocb, struct io_event *, result)
+{
+	log_info("io_cancel(%p, %p, %p)", ctx_id, iocb, result);
+	struct aio_context *ctx = aio_get_context(ctx_id);
+	if (!ctx)
+		return -L_EINVAL;
+	aio_put_context(ctx);
+	/* Submitted requests are not tracked by their iocb, report them as not cancellable */
+	return -L_EAGAIN;
+}
@@ -17,19 +17,28 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_PROCESS
+
 #include <binfmt/elf.h>
 #include <common/auxvec.h>
 #include <common/errno.h>
 #include <common/fcntl.h>
 #include <dbt/x86.h>
+#include <fs/imgfs.h>
 #include <fs/winfs.h>
 #include <syscall/exec.h>
+#include <syscall/fork.h>
 #include <syscall/mm.h>
+#include <syscall/prefetch.h>
 #include <syscall/process.h>
 #include <syscall/sig.h>
 #include <syscall/syscall.h>
+#include <syscall/timeline.h>
+#include <syscall/timer.h>
 #include <syscall/tls.h>
+#include <syscall/vdso.h>
 #include <syscall/vfs.h>
+#include <etw.h>
 #include <log.h>
 #include <heap.h>
 
@@ -72,6 +81,80 @@ __declspec(noreturn) void goto_entrypoint(const char *stack, void *entrypoint);
 #define MAX_PHT_STORAGE		4096
 static char pht_storage[MAX_PHT_STORAGE];
 
+/* Interpreter cache
+ * Nearly all executables use the same few interpreters. Their files are kept open, so execve() does
+ * not have to resolve and open them again. The cache lives on the heap and is inherited on fork(),
+ * like the files referenced by map entries. The pages are shared across processes by the file's
+ * section views already, so only the open files are cached.
+ * The path may have been replaced or the file modified since, so each lookup compares the identity
+ * and modification time of the file at the path with the cached ones and evicts the entry on mismatch.
+ */
+#define INTERP_CACHE_SIZE	4
+struct interp_cache
+{
+	int next; /* Entry to replace when the cache is full */
+	struct interp_cache_entry
+	{
+		char path[MAX_PATH];
+		struct file *f;
+		uint64_t dev, ino, size, mtime, mtime_nsec; /* Of f when it was added */
+	} entries[INTERP_CACHE_SIZE];
+};
+static struct interp_cache *interp_cache;
+
+/* Get the cached interpreter file of the given path, the caller releases it */
+static struct file *interp_cache_get(const char *path)
+{
+	if (!interp_cache)
+		return NULL;
+	for (int i = 0; i < INTERP_CACHE_SIZE; i++)
+	{
+		struct interp_cache_entry *entry = &interp_cache->entries[i];
+		if (entry->f && !strcmp(entry->path, path))
+		{
+			struct newstat st;
+			if (vfs_statat(AT_FDCWD, path, &st, 0) < 0 || st.st_dev != entry->dev || st.st_ino != entry->ino
+				|| st.st_size != entry->size || st.st_mtime != entry->mtime || st.st_mtime_nsec != entry->mtime_nsec)
+			{
+				log_info("Cached interpreter %s changed, evicting.", path);
+				vfs_release(entry->f);
+				entry->f = NULL;
+				return NULL;
+			}
+			vfs_ref(entry->f);
+			return entry->f;
+		}
+	}
+	return NULL;
+}
+
+static void interp_cache_add(const char *path, struct file *f)
+{
+	/* Relative paths depend on the current directory */
+	if (path[0] != '/')
+		return;
+	struct newstat st;
+	if (!f->op_vtable->stat || f->op_vtable->stat(f, &st) < 0)
+		return;
+	if (!interp_cache)
+	{
+		interp_cache = (struct interp_cache *)kmalloc(sizeof(struct interp_cache));
+		memset(interp_cache, 0, sizeof(struct interp_cache));
+	}
+	struct interp_cache_entry *entry = &interp_cache->entries[interp_cache->next];
+	interp_cache->next = (interp_cache->next + 1) % INTERP_CACHE_SIZE;
+	if (entry->f)
+		vfs_release(entry->f);
+	strcpy(entry->path, path);
+	entry->dev = st.st_dev;
+	entry->ino = st.st_ino;
+	entry->size = st.st_size;
+	entry->mtime = st.st_mtime;
+	entry->mtime_nsec = st.st_mtime_nsec;
+	vfs_ref(f);
+	entry->f = f;
+}
+
 static void run(struct binfmt *binary, int argc, char *argv[], int env_size, char *envp[])
 {
 	/* Generate initial stack */
@@ -98,6 +181,9 @@ static void run(struct binfmt *binary, int argc, char *argv[], int env_size, cha
 	else
 		AUX_VEC(AT_ENTRY, executable->eh.e_entry);
 	AUX_VEC(AT_BASE, (binary->has_interpreter ? (void*)(interpreter->load_base - interpreter->low) : NULL));
+	void *vdso = vdso_map();
+	if (vdso)
+		AUX_VEC(AT_SYSINFO_EHDR, vdso);
 
 	/* environment variables */
 	PTR(NULL);
@@ -122,6 +208,7 @@ static void run(struct binfmt *binary, int argc, char *argv[], int env_size, cha
 
 	/* argc */
 	PTR(argc);
+	process_set_cmdline(argc, (char **)(stack + sizeof(void*)));
 
 	/* Call executable entrypoint */
 	size_t entrypoint;
@@ -203,8 +290,11 @@ static int load_elf(struct file *f, struct binfmt *binary)
 	VirtualFree(region_start, 0, MEM_RELEASE); /* This will silently fail if it's not the intended case */
 #endif
 
-	/* Map executable segments */
-	/* TODO: Directly use mmap() */
+	/* Map executable segments
+	 * The file backed part of each segment is mapped from the image file, its pages are loaded on
+	 * demand. Read only segments are backed by views of the file's section where possible, which
+	 * are shared by all processes running the same binary. The rest of the segment is anonymous.
+	 */
 	int load_base_set = 0;
 	for (int i = 0; i < elf->eh.e_phnum; i++)
 	{
@@ -227,13 +317,36 @@ static int load_elf(struct file *f, struct binfmt *binary)
 				prot |= PROT_EXEC;
 			if (elf->eh.e_type == ET_DYN)
 				addr += elf->load_base;
-			mm_mmap((void*)addr, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-				MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED | MAP_POPULATE, 0, NULL, 0);
 			char *vaddr = (char *)ph->p_vaddr;
 			if (elf->eh.e_type == ET_DYN)
 				vaddr += elf->load_base;
-			mm_check_write(vaddr, ph->p_filesz); /* Populate the memory, otherwise pread() will fail */
-			f->op_vtable->pread(f, vaddr, ph->p_filesz, ph->p_offset);
+			size_t file_end = (size_t)vaddr + ph->p_filesz;
+			size_t file_map_end = ALIGN_TO(file_end, PAGE_SIZE);
+			/* The file content after the segment in its last page has to be cleared */
+			bool clear_tail = ph->p_memsz > ph->p_filesz && file_end != file_map_end;
+			if (ph->p_filesz > 0)
+			{
+				void *r = mm_mmap((void*)addr, file_map_end - addr, clear_tail? prot | PROT_WRITE: prot,
+					MAP_PRIVATE | MAP_FIXED, 0, f, offset_pages);
+				if ((uintptr_t)r >= (uintptr_t)-PAGE_SIZE)
+					return -L_ENOMEM;
+				if (clear_tail)
+				{
+					RtlZeroMemory((void*)file_end, file_map_end - file_end);
+					/* Only the last page was written, take the write access back from read only segments */
+					if (!(prot & PROT_WRITE) && mm_mprotect((void*)(file_map_end - PAGE_SIZE), PAGE_SIZE, prot) < 0)
+						return -L_ENOMEM;
+				}
+			}
+			else
+				file_map_end = addr;
+			if (addr + size > file_map_end)
+			{
+				void *r = mm_mmap((void*)file_map_end, addr + size - file_map_end, prot,
+					MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, 0, NULL, 0);
+				if ((uintptr_t)r >= (uintptr_t)-PAGE_SIZE)
+					return -L_ENOMEM;
+			}
 			if (!binary->has_interpreter) /* This is not interpreter */
 				mm_update_brk((void*)(addr + size));
 			if (elf->eh.e_type == ET_EXEC && !load_base_set)
@@ -260,17 +373,23 @@ static int load_elf(struct file *f, struct binfmt *binary)
 			path[ph->p_filesz] = 0;
 			log_info("interpreter: %s", path);
 
-			struct file *fi;
-			int r = vfs_openat(AT_FDCWD, path, O_RDONLY, 0, 0, &fi);
-			if (r < 0)
-				return r;
-			if (!winfs_is_winfile(fi))
+			struct file *fi = interp_cache_get(path);
+			if (fi)
+				prefetch_record_open(path, O_RDONLY, fi);
+			else
 			{
-				vfs_release(fi);
-				return -L_EACCES;
+				int r = vfs_openat(AT_FDCWD, path, O_RDONLY, 0, 0, &fi);
+				if (r < 0)
+					return r;
+				if (!winfs_is_winfile(fi) && !imgfs_is_imgfile(fi))
+				{
+					vfs_release(fi);
+					return -L_EACCES;
+				}
+				interp_cache_add(path, fi);
 			}
 
-			r = load_elf(fi, binary);
+			int r = load_elf(fi, binary);
 			vfs_release(fi);
 			if (r < 0)
 				return -L_EACCES; /* Bad interpreter */
@@ -324,7 +443,7 @@ static int load_script(struct file *f, struct binfmt *binary)
 	int r = vfs_openat(AT_FDCWD, executable, O_RDONLY, 0, 0, &fe);
 	if (r < 0)
 		return r;
-	if (!winfs_is_winfile(fe))
+	if (!winfs_is_winfile(fe) && !imgfs_is_imgfile(fe))
 	{
 		vfs_release(fe);
 		return -L_EACCES;
@@ -333,9 +452,19 @@ static int load_script(struct file *f, struct binfmt *binary)
 	return load_elf(fe, binary);
 }
 
+#define EXEC_PHASE(phase) \
+	do { \
+		uint64_t now = timer_monotonic_ns(); \
+		if (etw_enabled(ETW_KEYWORD_PROCESS)) \
+			etw_exec_phase(filename, phase, now - phase_start); \
+		phase_start = now; \
+	} while (0)
+
 int do_execve(const char *filename, int argc, char *argv[], int env_size, char *envp[], char *buffer_base,
 	void (*initialize_routine)())
 {
+	uint64_t phase_start = timer_monotonic_ns();
+	uint64_t timeline_start = timeline_now();
 	buffer_base = (char*)((uintptr_t)(buffer_base + sizeof(void*) - 1) & -sizeof(void*));
 
 	/* Detect file type */
@@ -345,7 +474,7 @@ int do_execve(const char *filename, int argc, char *argv[], int env_size, char *
 	r = vfs_openat(AT_FDCWD, filename, O_RDONLY, 0, 0, &f);
 	if (r < 0)
 		return r;
-	if (!winfs_is_winfile(f))
+	if (!winfs_is_winfile(f) && !imgfs_is_imgfile(f))
 	{
 		vfs_release(f);
 		return -L_EACCES;
@@ -353,6 +482,7 @@ int do_execve(const char *filename, int argc, char *argv[], int env_size, char *
 	r = f->op_vtable->pread(f, magic, 4, 0);
 	if (r < 4)
 		return -L_EACCES;
+	EXEC_PHASE("open");
 
 	struct binfmt binary;
 	binary.argv0 = NULL;
@@ -369,6 +499,8 @@ int do_execve(const char *filename, int argc, char *argv[], int env_size, char *
 		log_info("It is an ELF file.");
 		if (initialize_routine)
 			initialize_routine();
+		EXEC_PHASE("reset");
+		prefetch_exec(f);
 		r = load_elf(f, &binary);
 	}
 	else if (magic[0] == '#' && magic[1] == '!')
@@ -376,6 +508,8 @@ int do_execve(const char *filename, int argc, char *argv[], int env_size, char *
 		log_info("It is a script file.");
 		if (initialize_routine)
 			initialize_routine();
+		EXEC_PHASE("reset");
+		prefetch_exec(f);
 		r = load_script(f, &binary);
 	}
 	else
@@ -389,8 +523,11 @@ int do_execve(const char *filename, int argc, char *argv[], int env_size, char *
 		log_error("FATAL: Load executable failed, cannot continue.");
 		process_exit(1, 0);
 	}
+	EXEC_PHASE("load");
 
 	/* Execute file */
+	process_set_comm(filename);
+	timeline_record(TIMELINE_EVENT_EXEC, timeline_start, 0, filename);
 	if (binary.replace_argv0)
 		argv[0] = (char *)filename;
 	run(&binary, argc, argv, env_size, envp);
@@ -404,6 +541,8 @@ static void execve_initialize_routine()
 	signal_reset();
 	vfs_reset();
 	mm_reset();
+	/* The memory of a vfork() parent is not used any more */
+	fork_release_vfork_parent();
 	tls_reset();
 	dbt_reset();
 }
@@ -494,5 +633,11 @@ int exec_fork(HANDLE process)
 		log_error("exec_fork(): NtWriteVirtualMemory() failed, status: %x", status);
 		return 0;
 	}
+	status = NtWriteVirtualMemory(process, &interp_cache, &interp_cache, sizeof(interp_cache), NULL);
+	if (!NT_SUCCESS(status))
+	{
+		log_error("exec_fork(): NtWriteVirtualMemory() failed, status: %x", status);
+		return 0;
+	}
 	return 1;
 }
@@ -17,20 +17,30 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_PROCESS
+
 #include <common/sched.h>
 #include <common/types.h>
 #include <common/ptrace.h>
+#include <dbt/sampler.h>
 #include <dbt/x86.h>
 #include <syscall/fork.h>
 #include <syscall/mm.h>
+#include <syscall/prefetch.h>
 #include <syscall/process.h>
 #include <syscall/process_info.h>
 #include <syscall/syscall.h>
+#include <syscall/timeline.h>
+#include <syscall/timer.h>
 #include <syscall/tls.h>
+#include <cache.h>
+#include <etw.h>
 #include <flags.h>
 #include <heap.h>
+#include <hostinfo.h>
 #include <log.h>
 #include <shared.h>
+#include <str.h>
 
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
@@ -43,6 +53,13 @@
  * 3. Set up fork_info
  * 4. Copy thread stack
  * 5. Wake up child process, it will use fork_info to restore context
+ *
+ * The child process cannot be created ahead of time. Handles are passed to it by inheritance at
+ * CreateProcessW(), and the handle values are written to the child as is, so it has to be
+ * created after all the handles it needs are opened.
+ *
+ * For vfork() the parent's memory is not made copy-on-write. Instead the parent waits until
+ * the child calls execve() or exits, as the child references sections shared with the parent.
  */
 
 struct fork_info
@@ -54,6 +71,7 @@ struct fork_info
 	pid_t pid;
 	int gs;
 	struct user_desc tls_data;
+	HANDLE vfork_event; /* Signaled by a vfork() child when the parent can continue */
 } _fork;
 
 static struct fork_info *fork = &_fork;
@@ -63,13 +81,19 @@ __declspec(noreturn) static void fork_child()
 	install_syscall_handler();
 	mm_afterfork_child();
 	flags_afterfork_child();
+	log_set_levels(cmdline_flags->log_levels);
 	shared_afterfork_child();
 	heap_afterfork_child();
 	signal_afterfork_child();
 	process_afterfork_child(fork->stack_base, fork->pid);
 	tls_afterfork_child();
+	timer_init();
+	etw_init();
 	vfs_afterfork_child();
+	hostinfo_afterfork_child();
+	cache_afterfork_child();
 	dbt_init();
+	sampler_init();
 	if (fork->ctid)
 		*(pid_t *)fork->ctid = fork->pid;
 	dbt_restore_fork_context(&fork->context);
@@ -137,12 +161,22 @@ void fork_init()
 	}
 }
 
+void fork_release_vfork_parent()
+{
+	if (fork->vfork_event)
+	{
+		SetEvent(fork->vfork_event);
+		CloseHandle(fork->vfork_event);
+		fork->vfork_event = NULL;
+	}
+}
+
 /* Currently supported flags (see sched.h):
  o CLONE_VM
  o CLONE_FS
  o CLONE_SIGHAND
  o CLONE_PTRACE
- o CLONE_VFORK
+ * CLONE_VFORK
  o CLONE_PARENT
  o CLONE_THREAD
  o CLONE_NEWNS
@@ -160,62 +194,221 @@ void fork_init()
  o CLONE_NEWNET
  o CLONE_IO
 */
+/* Path of flinux executable, initialized at first fork */
+static wchar_t fork_filename[MAX_PATH];
+
+/* Fork phases, timed separately and reported in /proc/[pid]/flinux/fork */
+enum
+{
+	FORK_PHASE_CREATE_PROCESS,
+	FORK_PHASE_TLS,
+	FORK_PHASE_VFS,
+	FORK_PHASE_MM,
+	FORK_PHASE_SHARED,
+	FORK_PHASE_HEAP,
+	FORK_PHASE_SIGNAL,
+	FORK_PHASE_PROCESS,
+	FORK_PHASE_EXEC,
+	FORK_PHASE_FORK_INFO,	/* process_init_child() and fork_info */
+	FORK_PHASE_STACK,
+	FORK_PHASE_RESUME,
+	FORK_PHASE_TOTAL,
+	FORK_PHASE_COUNT
+};
+
+static const char *fork_phase_names[FORK_PHASE_COUNT] =
+{
+	"create_process: ",
+	"tls:            ",
+	"vfs:            ",
+	"mm:             ",
+	"shared:         ",
+	"heap:           ",
+	"signal:         ",
+	"process:        ",
+	"exec:           ",
+	"fork_info:      ",
+	"stack:          ",
+	"resume:         ",
+	"total:          ",
+};
+
+/* Histogram bucket i counts phases which took [2^(i-1), 2^i) microseconds, the last one all slower */
+#define FORK_HISTOGRAM_BUCKETS	20
+
+static struct
+{
+	SRWLOCK lock;
+	int forks;
+	uint64_t sections;
+	uint64_t bytes;
+	uint64_t total_us[FORK_PHASE_COUNT];
+	uint64_t max_us[FORK_PHASE_COUNT];
+	int histogram[FORK_PHASE_COUNT][FORK_HISTOGRAM_BUCKETS];
+} fork_stats = { SRWLOCK_INIT };
+
+static void fork_trace_phases(pid_t pid, const uint64_t *phase_ns)
+{
+	for (int i = 0; i < FORK_PHASE_COUNT; i++)
+	{
+		/* Without the colon and padding */
+		char phase[32];
+		int len = 0;
+		while (fork_phase_names[i][len] != ':')
+		{
+			phase[len] = fork_phase_names[i][len];
+			len++;
+		}
+		phase[len] = 0;
+		etw_fork_phase(pid, phase, phase_ns[i]);
+	}
+}
+
+static void fork_record_stats(pid_t pid, const uint64_t *phase_ns, size_t sections, size_t bytes)
+{
+	if (etw_enabled(ETW_KEYWORD_PROCESS))
+		fork_trace_phases(pid, phase_ns);
+	AcquireSRWLockExclusive(&fork_stats.lock);
+	fork_stats.forks++;
+	fork_stats.sections += sections;
+	fork_stats.bytes += bytes;
+	for (int i = 0; i < FORK_PHASE_COUNT; i++)
+	{
+		uint64_t us = phase_ns[i] / 1000ULL;
+		fork_stats.total_us[i] += us;
+		if (us > fork_stats.max_us[i])
+			fork_stats.max_us[i] = us;
+		int bucket = 0;
+		while (bucket < FORK_HISTOGRAM_BUCKETS - 1 && us >= (1ULL << bucket))
+			bucket++;
+		fork_stats.histogram[i][bucket]++;
+	}
+	ReleaseSRWLockExclusive(&fork_stats.lock);
+	log_info("fork(): %llu us in total, create_process %llu us, mm %llu us, stack %llu us, %lu sections, %lu bytes.",
+		phase_ns[FORK_PHASE_TOTAL] / 1000ULL, phase_ns[FORK_PHASE_CREATE_PROCESS] / 1000ULL,
+		phase_ns[FORK_PHASE_MM] / 1000ULL, phase_ns[FORK_PHASE_STACK] / 1000ULL, sections, bytes);
+}
+
+int fork_get_stats(char *buf)
+{
+	char *original = buf;
+	AcquireSRWLockShared(&fork_stats.lock);
+	buf += ksprintf(buf,
+		"forks:          %d\n"
+		"sections:       %llu\n"
+		"bytes:          %llu\n"
+		"phase           total_us max_us histogram (buckets of 2^i us)\n",
+		fork_stats.forks, fork_stats.sections, fork_stats.bytes);
+	for (int i = 0; i < FORK_PHASE_COUNT; i++)
+	{
+		buf += ksprintf(buf, "%s%llu %llu", fork_phase_names[i], fork_stats.total_us[i], fork_stats.max_us[i]);
+		for (int j = 0; j < FORK_HISTOGRAM_BUCKETS; j++)
+			buf += ksprintf(buf, " %d", fork_stats.histogram[i][j]);
+		buf += ksprintf(buf, "\n");
+	}
+	ReleaseSRWLockShared(&fork_stats.lock);
+	return buf - original;
+}
+
+#define FORK_PHASE(phase) \
+	do { \
+		uint64_t now = timer_monotonic_ns(); \
+		phase_ns[phase] = now - phase_start; \
+		phase_start = now; \
+	} while (0)
+
 static pid_t fork_process(struct syscall_context *context, unsigned long flags, void *ptid, void *ctid)
 {
-	wchar_t filename[MAX_PATH];
-	GetModuleFileNameW(NULL, filename, sizeof(filename) / sizeof(filename[0]));
-	
+	if (!fork_filename[0])
+		GetModuleFileNameW(NULL, fork_filename, sizeof(fork_filename) / sizeof(fork_filename[0]));
+	/* The child must not inherit references to the recorded files, startup is over anyway */
+	prefetch_finish();
+
+	uint64_t phase_ns[FORK_PHASE_COUNT];
+	uint64_t fork_start = timer_monotonic_ns(), phase_start = fork_start;
+	uint64_t timeline_start = timeline_now();
 	PROCESS_INFORMATION info;
 	STARTUPINFOW si = { 0 };
 	si.cb = sizeof(si);
-	if (!CreateProcessW(filename, L"/?/fork", NULL, NULL, TRUE, CREATE_SUSPENDED, NULL, NULL, &si, &info))
+	if (!CreateProcessW(fork_filename, L"/?/fork", NULL, NULL, TRUE, CREATE_SUSPENDED, NULL, NULL, &si, &info))
 	{
 		log_warning("fork(): CreateProcessW() failed.");
 		return -1;
 	}
+	FORK_PHASE(FORK_PHASE_CREATE_PROCESS);
 
 	if (!tls_fork(info.hProcess))
 		goto fail;
+	FORK_PHASE(FORK_PHASE_TLS);
 
 	if (!vfs_fork(info.hProcess, info.dwProcessId))
 		goto fail;
+	FORK_PHASE(FORK_PHASE_VFS);
 
-	if (!mm_fork(info.hProcess))
+	bool vfork = (flags & CLONE_VFORK) != 0;
+	/* Pass log levels changed at runtime to the child */
+	log_get_levels(cmdline_flags->log_levels);
+	if (!mm_fork(info.hProcess, vfork))
 		goto fail;
+	FORK_PHASE(FORK_PHASE_MM);
+	size_t sections, bytes;
+	mm_get_fork_transfer(&sections, &bytes);
 
 	if (!shared_fork(info.hProcess))
 		goto fail;
+	FORK_PHASE(FORK_PHASE_SHARED);
 
 	if (!heap_fork(info.hProcess))
 		goto fail;
+	FORK_PHASE(FORK_PHASE_HEAP);
 
 	if (!signal_fork(info.hProcess))
 		goto fail;
+	FORK_PHASE(FORK_PHASE_SIGNAL);
 
 	if (!process_fork(info.hProcess))
 		goto fail;
+	FORK_PHASE(FORK_PHASE_PROCESS);
 
 	if (!exec_fork(info.hProcess))
 		goto fail;
+	FORK_PHASE(FORK_PHASE_EXEC);
 
 	pid_t pid = process_init_child(info.dwProcessId, info.dwThreadId, info.hProcess);
 
-	/* Set up fork_info in child process */
-	void *stack_base = process_get_stack_base();
-	NtWriteVirtualMemory(info.hProcess, &fork->context, context, sizeof(struct syscall_context), NULL);
-	NtWriteVirtualMemory(info.hProcess, &fork->stack_base, &stack_base, sizeof(stack_base), NULL);
-	NtWriteVirtualMemory(info.hProcess, &fork->pid, &pid, sizeof(pid_t), NULL);
+	/* Set up fork_info in child process, filled locally and written in one go */
+	struct fork_info child_info = { 0 };
+	child_info.context = *context;
+	child_info.stack_base = process_get_stack_base();
+	child_info.pid = pid;
 	if (flags & CLONE_CHILD_SETTID)
-		NtWriteVirtualMemory(info.hProcess, &fork->ctid, &ctid, sizeof(void*), NULL);
+		child_info.ctid = ctid;
 	if (flags & CLONE_PARENT_SETTID)
 		*(pid_t*)ptid = pid;
+	HANDLE vfork_event = NULL;
+	if (vfork)
+	{
+		vfork_event = CreateEventW(NULL, TRUE, FALSE, NULL);
+		if (!vfork_event || !DuplicateHandle(GetCurrentProcess(), vfork_event, info.hProcess, &child_info.vfork_event, 0, FALSE, DUPLICATE_SAME_ACCESS))
+		{
+			log_error("vfork(): Creating vfork event failed, error code: %d", GetLastError());
+			/* Fall back to waiting for the child to exit */
+			child_info.vfork_event = NULL;
+		}
+	}
+	NtWriteVirtualMemory(info.hProcess, fork, &child_info, sizeof(struct fork_info), NULL);
+	bytes += sizeof(struct fork_info);
+	FORK_PHASE(FORK_PHASE_FORK_INFO);
 
 	/* Copy stack */
-	VirtualAllocEx(info.hProcess, stack_base, STACK_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE);
-	NtWriteVirtualMemory(info.hProcess, (PVOID)context->esp, (PVOID)context->esp,
-		(SIZE_T)((char *)stack_base + STACK_SIZE - context->esp), NULL);
+	VirtualAllocEx(info.hProcess, child_info.stack_base, STACK_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE);
+	SIZE_T stack_size = (SIZE_T)((char *)child_info.stack_base + STACK_SIZE - context->esp);
+	NtWriteVirtualMemory(info.hProcess, (PVOID)context->esp, (PVOID)context->esp, stack_size, NULL);
+	bytes += stack_size;
+	FORK_PHASE(FORK_PHASE_STACK);
 	ResumeThread(info.hThread);
 	CloseHandle(info.hThread);
+	FORK_PHASE(FORK_PHASE_RESUME);
 
 	/* Call afterfork routines */
 	vfs_afterfork_parent();
@@ -227,6 +420,18 @@ static pid_t fork_process(struct syscall_context *context, unsigned long flags,
 	flags_afterfork_parent();
 	mm_afterfork_parent();
 
+	if (vfork)
+	{
+		/* Wait until the child calls execve() or exits */
+		HANDLE handles[2] = { info.hProcess, vfork_event };
+		WaitForMultipleObjects(vfork_event? 2: 1, handles, FALSE, INFINITE);
+		if (vfork_event)
+			CloseHandle(vfork_event);
+	}
+
+	phase_ns[FORK_PHASE_TOTAL] = timer_monotonic_ns() - fork_start;
+	fork_record_stats(pid, phase_ns, sections, bytes);
+	timeline_record(TIMELINE_EVENT_FORK, timeline_start, pid, NULL);
 	log_info("Child pid: %d, win_pid: %d", pid, info.dwProcessId);
 	return pid;
 
@@ -237,12 +442,34 @@ fail:
 	return -1;
 }
 
-static DWORD WINAPI fork_thread_callback(void *data)
+/* Thread creation
+ *
+ * Creating a host thread and setting up its per thread dbt tables takes most of the time of
+ * clone(CLONE_VM). To take it off the critical path a small pool of host threads is kept which
+ * have already done dbt_init_thread() and wait for a clone() to pick them up. A thread taken from
+ * the pool starts a replacement before running guest code, so the pool refills in parallel with
+ * the new guest thread. The pool is only started on the first clone(CLONE_VM), single threaded
+ * programs never pay for it.
+ *
+ * Threads are not returned to the pool when a guest thread exits, they only ever run one guest
+ * thread. The logging connection of new threads is established on their first log record.
+ */
+
+#define FORK_THREAD_POOL_SIZE	2
+
+struct fork_thread_slot
+{
+	SLIST_ENTRY entry;
+	HANDLE event; /* Signaled when info is filled */
+	struct fork_info info;
+};
+
+static DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) SLIST_HEADER fork_thread_pool;
+static volatile LONG fork_thread_pool_pending; /* Threads started for the pool but not yet taken */
+
+__declspec(noreturn) static void fork_thread_run(struct fork_info *info)
 {
 	/* This function runs in child thread */
-	struct fork_info *info = (struct fork_info *)data;
-	log_init_thread();
-	dbt_init_thread();
 	process_thread_entry(info->pid);
 	if (info->flags & CLONE_SETTLS)
 		tls_set_thread_area(&info->tls_data);
@@ -253,31 +480,110 @@ static DWORD WINAPI fork_thread_callback(void *data)
 	dbt_update_tls(info->gs);
 	struct syscall_context context = info->context;
 	context.eax = 0;
-	VirtualFree(info, 0, MEM_RELEASE);
 	dbt_restore_fork_context(&context);
+}
+
+static DWORD WINAPI fork_thread_pool_entry(void *data);
+
+static void fork_thread_pool_fill()
+{
+	while (fork_thread_pool_pending < FORK_THREAD_POOL_SIZE)
+	{
+		if (InterlockedIncrement(&fork_thread_pool_pending) > FORK_THREAD_POOL_SIZE)
+		{
+			InterlockedDecrement(&fork_thread_pool_pending);
+			return;
+		}
+		HANDLE handle = CreateThread(NULL, 0, fork_thread_pool_entry, NULL, 0, NULL);
+		if (!handle)
+		{
+			log_warning("CreateThread() for thread pool failed, error code: %d", GetLastError());
+			InterlockedDecrement(&fork_thread_pool_pending);
+			return;
+		}
+		CloseHandle(handle);
+	}
+}
+
+static DWORD WINAPI fork_thread_pool_entry(void *data)
+{
+	/* This function runs in pool thread */
+	struct fork_thread_slot *slot = VirtualAlloc(NULL, sizeof(struct fork_thread_slot), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!slot)
+	{
+		InterlockedDecrement(&fork_thread_pool_pending);
+		return 0;
+	}
+	if (!(slot->event = CreateEventW(NULL, FALSE, FALSE, NULL)))
+	{
+		VirtualFree(slot, 0, MEM_RELEASE);
+		InterlockedDecrement(&fork_thread_pool_pending);
+		return 0;
+	}
+	log_init_thread_deferred();
+	dbt_init_thread();
+	InterlockedPushEntrySList(&fork_thread_pool, &slot->entry);
+	WaitForSingleObject(slot->event, INFINITE);
+	/* Taken by fork_thread(), which already accounted it in fork_thread_pool_pending */
+	struct fork_info info = slot->info;
+	CloseHandle(slot->event);
+	VirtualFree(slot, 0, MEM_RELEASE);
+	fork_thread_pool_fill();
+	fork_thread_run(&info);
 	return 0;
 }
 
-static pid_t fork_thread(struct syscall_context *context, void *child_stack, unsigned long flags, void *ptid, void *ctid)
+static DWORD WINAPI fork_thread_callback(void *data)
+{
+	/* This function runs in child thread */
+	struct fork_info info = *(struct fork_info *)data;
+	VirtualFree(data, 0, MEM_RELEASE);
+	log_init_thread_deferred();
+	dbt_init_thread();
+	fork_thread_run(&info);
+	return 0;
+}
+
+static void fork_thread_fill_info(struct fork_info *info, struct syscall_context *context, void *child_stack, unsigned long flags, pid_t pid, void *ctid)
 {
-	struct fork_info *info = VirtualAlloc(NULL, sizeof(struct fork_info), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
-	DWORD win_tid;
-	HANDLE handle = CreateThread(NULL, 0, fork_thread_callback, info, CREATE_SUSPENDED, &win_tid);
-	pid_t pid = process_create_thread(win_tid);
 	info->context = *context;
 	info->context.esp = (DWORD)child_stack;
 	info->pid = pid;
 	info->ctid = ctid;
 	info->flags = flags;
+	info->gs = dbt_get_gs();
+	if (flags & CLONE_SETTLS)
+		info->tls_data = *(struct user_desc *)context->esi;
+}
+
+static pid_t fork_thread(struct syscall_context *context, void *child_stack, unsigned long flags, void *ptid, void *ctid)
+{
+	struct fork_thread_slot *slot = (struct fork_thread_slot *)InterlockedPopEntrySList(&fork_thread_pool);
+	if (slot)
+	{
+		InterlockedDecrement(&fork_thread_pool_pending);
+		pid_t pid = process_create_thread(0);
+		fork_thread_fill_info(&slot->info, context, child_stack, flags, pid, ctid);
+		if (flags & CLONE_CHILD_SETTID)
+			*(pid_t *)ctid = pid;
+		if (flags & CLONE_PARENT_SETTID)
+			*(pid_t *)ptid = pid;
+		SetEvent(slot->event);
+		return pid;
+	}
+	struct fork_info *info = VirtualAlloc(NULL, sizeof(struct fork_info), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	DWORD win_tid;
+	HANDLE handle = CreateThread(NULL, 0, fork_thread_callback, info, CREATE_SUSPENDED, &win_tid);
+	pid_t pid = process_create_thread(win_tid);
+	fork_thread_fill_info(info, context, child_stack, flags, pid, ctid);
 	if (flags & CLONE_CHILD_SETTID)
 		*(pid_t *)ctid = pid;
 	if (flags & CLONE_PARENT_SETTID)
 		*(pid_t *)ptid = pid;
-	info->gs = dbt_get_gs();
-	if (flags & CLONE_SETTLS)
-		info->tls_data = *(struct user_desc *)context->esi;
 	ResumeThread(handle);
 	CloseHandle(handle);
+	/* The process is multithreaded from now on, have threads ready for the next clone() */
+	fork_thread_pool_fill();
 	return pid;
 }
 
@@ -290,7 +596,7 @@ int sys_fork_imp(struct syscall_context *context)
 int sys_vfork_imp(struct syscall_context *context)
 {
 	log_info("vfork()");
-	return fork_process(context, 0, NULL, NULL);
+	return fork_process(context, CLONE_VFORK, NULL, NULL);
 }
 
 #ifdef _WIN64
@@ -20,3 +20,7 @@
 #pragma once
 
 void fork_init();
+/* Wake up the parent waiting in vfork(), called once the child is done with the parent's memory */
+void fork_release_vfork_parent();
+/* Get fork latency statistics, for /proc/[pid]/flinux/fork */
+int fork_get_stats(char *buf);
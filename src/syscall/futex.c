@@ -17,32 +17,52 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_FUTEX
+
 #include <common/errno.h>
 #include <common/futex.h>
 #include <common/time.h>
 #include <syscall/futex.h>
+#include <syscall/mm.h>
 #include <syscall/process_info.h>
 #include <syscall/sig.h>
 #include <syscall/syscall.h>
+#include <syscall/timer.h>
 #include <lib/list.h>
+#include <datetime.h>
 #include <log.h>
+#include <shared.h>
+#include <win7compat.h>
 
+#include <limits.h>
 #include <ntdll.h>
 
-/* TODO: How to implement interprocess futex? */
+#define FUTEX_HASH_BITS			12
+#define FUTEX_HASH_BUCKETS		(1 << FUTEX_HASH_BITS)
 
-#define FUTEX_HASH_BUCKETS		256
+/* Bounds of the adaptive spin phase in futex_wait(), in iterations */
+#define FUTEX_SPIN_MIN			16
+#define FUTEX_SPIN_MAX			4000
 
 struct futex_wait_block
 {
 	struct thread *thread;
 	int *addr;
+	unsigned int bitset;
+	bool woken; /* Set by the waker when the block is removed from the wait list */
 	struct list_node list;
 };
 
-struct futex_hash_bucket
+/* Padded to a cache line to avoid false sharing between unrelated futexes */
+__declspec(align(64)) struct futex_hash_bucket
 {
-	volatile LONG spin_lock;
+	SRWLOCK lock;
+	/* Number of wait blocks in the bucket, lets futex_wake() return without taking the lock
+	 * It is incremented before the waiter checks the futex value, see futex_wait()
+	 */
+	volatile LONG waiters;
+	/* Current spin budget, grows when spinning saw the value change and shrinks when it ended up blocking */
+	volatile LONG spin_budget;
 	struct list wait_list;
 };
 
@@ -55,13 +75,12 @@ static struct futex_data *const futex = &_futex;
 
 static void lock_bucket(int bucket)
 {
-	while (InterlockedCompareExchange(&futex->hash[bucket].spin_lock, 1, 0))
-		YieldProcessor();
+	AcquireSRWLockExclusive(&futex->hash[bucket].lock);
 }
 
 static void unlock_bucket(int bucket)
 {
-	futex->hash[bucket].spin_lock = 0;
+	ReleaseSRWLockExclusive(&futex->hash[bucket].lock);
 }
 
 /* Lock two buckets in deterministic order to avoid dead lock */
@@ -81,24 +100,69 @@ static void lock_buckets(int bucket1, int bucket2)
 
 static int futex_hash(size_t addr)
 {
-	/* TODO: Improve this silly hash function */
-	return addr % FUTEX_HASH_BUCKETS;
+	/* Fibonacci hashing, futex words are at least 4 byte aligned and often laid out with a fixed stride */
+#ifdef _WIN64
+	return (int)(((addr >> 2) * 0x9E3779B97F4A7C15ULL) >> (64 - FUTEX_HASH_BITS));
+#else
+	return (int)(((addr >> 2) * 0x9E3779B9U) >> (32 - FUTEX_HASH_BITS));
+#endif
 }
 
-int futex_wait(volatile int *addr, int val, DWORD timeout)
+static bool futex_spin(struct futex_hash_bucket *hb, volatile int *addr, int val)
+{
+	static int cpu_count;
+	if (cpu_count == 0)
+	{
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		cpu_count = info.dwNumberOfProcessors;
+	}
+	/* Spinning is pointless when the owner can't be running at the same time */
+	if (cpu_count == 1)
+		return false;
+	LONG budget = hb->spin_budget;
+	if (budget < FUTEX_SPIN_MIN)
+		budget = FUTEX_SPIN_MIN;
+	for (LONG i = 0; i < budget; i++)
+	{
+		if (*addr != val)
+		{
+			/* Worked, spin longer next time */
+			LONG new_budget = budget + budget / 8;
+			hb->spin_budget = new_budget > FUTEX_SPIN_MAX ? FUTEX_SPIN_MAX : new_budget;
+			return true;
+		}
+		YieldProcessor();
+	}
+	/* The wait is longer than we are willing to spin, back off */
+	hb->spin_budget = budget / 2;
+	return false;
+}
+
+static int futex_wait_bitset(volatile int *addr, int val, DWORD timeout, unsigned int bitset)
 {
 	struct futex_wait_block wait_block;
 	int bucket = futex_hash((size_t)addr);
+	if (timeout != 0 && futex_spin(&futex->hash[bucket], addr, val))
+	{
+		/* The value changed while spinning */
+		return -L_EAGAIN;
+	}
+	/* Announce ourselves before checking the value, the full barrier pairs with the one in futex_wake_requeue() */
+	InterlockedIncrement(&futex->hash[bucket].waiters);
 	lock_bucket(bucket);
 	if (*addr != val)
 	{
 		/* The value changed */
+		InterlockedDecrement(&futex->hash[bucket].waiters);
 		unlock_bucket(bucket);
-		return 0;
+		return -L_EAGAIN;
 	}
 	/* Append wait block */
 	wait_block.thread = current_thread;
 	wait_block.addr = (int *)addr;
+	wait_block.bitset = bitset;
+	wait_block.woken = false;
 	list_add(&futex->hash[bucket].wait_list, &wait_block.list);
 	unlock_bucket(bucket);
 	DWORD result = signal_wait(1, &current_thread->wait_event, timeout);
@@ -110,15 +174,35 @@ int futex_wait(volatile int *addr, int val, DWORD timeout)
 	}
 	else
 	{
-		/* Wait unsuccessful, we need to remove us from the wait list */
-		lock_bucket(bucket);
-		/* Check again if we're not woke, to avoid data race when we are woken between
-		 * signal_wait() and lock_bucket()
+		/* Wait unsuccessful, we need to remove us from the wait list
+		 * The wait block may have been requeued meanwhile, so look up its current bucket under lock
 		 */
-		if (WaitForSingleObject(current_thread->wait_event, 0) != WAIT_OBJECT_0)
+		for (;;)
+		{
+			bucket = futex_hash((size_t)wait_block.addr);
+			lock_bucket(bucket);
+			if (wait_block.woken || futex_hash((size_t)wait_block.addr) == bucket)
+				break;
+			unlock_bucket(bucket);
+		}
+		bool woken = wait_block.woken;
+		if (woken)
+		{
+			/* We were woken between signal_wait() and lock_bucket(), consume the event set by the waker */
+			WaitForSingleObject(current_thread->wait_event, INFINITE);
+		}
+		else
+		{
 			list_remove(&futex->hash[bucket].wait_list, &wait_block.list);
+			InterlockedDecrement(&futex->hash[bucket].waiters);
+		}
 		unlock_bucket(bucket);
-		if (result == WAIT_INTERRUPTED)
+		if (woken)
+		{
+			log_info("Wait successful.");
+			return 0;
+		}
+		else if (result == WAIT_INTERRUPTED)
 		{
 			log_info("Wait interrupted.");
 			return -L_EINTR;
@@ -131,9 +215,48 @@ int futex_wait(volatile int *addr, int val, DWORD timeout)
 	}
 }
 
-static int futex_wake_requeue(int *addr, int count, int *requeue_addr, int *requeue_val)
+int futex_wait(volatile int *addr, int val, DWORD timeout)
+{
+	return futex_wait_bitset(addr, val, timeout, FUTEX_BITSET_MATCH_ANY);
+}
+
+/* Wake up to count waiters on addr matching bitset in a locked bucket */
+static int futex_wake_locked(int bucket, int *addr, int count, unsigned int bitset)
+{
+	int num_woken = 0;
+	struct list_node *prev = NULL;
+	while (num_woken < count)
+	{
+		struct list_node *cur = prev ? list_next(prev) : list_head(&futex->hash[bucket].wait_list);
+		if (cur == NULL)
+			break;
+		struct futex_wait_block *wait_block = list_entry(cur, struct futex_wait_block, list);
+		if (wait_block->addr == addr && (wait_block->bitset & bitset))
+		{
+			list_remove(&futex->hash[bucket].wait_list, cur);
+			InterlockedDecrement(&futex->hash[bucket].waiters);
+			wait_block->woken = true;
+			NtSetEvent(wait_block->thread->wait_event, NULL);
+			num_woken++;
+		}
+		else
+			prev = cur;
+	}
+	return num_woken;
+}
+
+static int futex_wake_requeue(int *addr, int count, int *requeue_addr, int *requeue_val, unsigned int bitset)
 {
 	int bucket = futex_hash((size_t)addr);
+	/* Pairs with InterlockedIncrement() in futex_wait(): either we see the waiter, or it sees the new value */
+	MemoryBarrier();
+	if (futex->hash[bucket].waiters == 0)
+	{
+		/* Nobody to wake or requeue */
+		if (requeue_val && *(volatile int *)addr != *requeue_val)
+			return -L_EAGAIN;
+		return 0;
+	}
 	int bucket2;
 	if (requeue_addr)
 	{
@@ -151,8 +274,9 @@ static int futex_wake_requeue(int *addr, int count, int *requeue_addr, int *requ
 		{
 			/* The value changed */
 			unlock_bucket(bucket);
-			unlock_bucket(bucket2);
-			return -EAGAIN;
+			if (bucket != bucket2)
+				unlock_bucket(bucket2);
+			return -L_EAGAIN;
 		}
 	}
 	/* Wake up to count threads */
@@ -170,7 +294,7 @@ static int futex_wake_requeue(int *addr, int count, int *requeue_addr, int *requ
 		if (cur == NULL)
 			break;
 		struct futex_wait_block *wait_block = list_entry(cur, struct futex_wait_block, list);
-		if (wait_block->addr == addr)
+		if (wait_block->addr == addr && (wait_block->bitset & bitset))
 		{
 			if (num_woken == count && requeue_addr)
 			{
@@ -184,13 +308,17 @@ static int futex_wake_requeue(int *addr, int count, int *requeue_addr, int *requ
 				{
 					/* Move this wait block to destination bucket */
 					list_remove(&futex->hash[bucket].wait_list, cur);
+					InterlockedDecrement(&futex->hash[bucket].waiters);
 					list_add(&futex->hash[bucket2].wait_list, cur);
+					InterlockedIncrement(&futex->hash[bucket2].waiters);
 				}
 			}
 			else
 			{
 				/* Remove current wait block and notify corresponding thread */
 				list_remove(&futex->hash[bucket].wait_list, cur);
+				InterlockedDecrement(&futex->hash[bucket].waiters);
+				wait_block->woken = true;
 				NtSetEvent(wait_block->thread->wait_event, NULL);
 				num_woken++;
 			}
@@ -206,12 +334,453 @@ static int futex_wake_requeue(int *addr, int count, int *requeue_addr, int *requ
 
 int futex_wake(int *addr, int count)
 {
-	return futex_wake_requeue(addr, count, NULL, NULL);
+	return futex_wake_requeue(addr, count, NULL, NULL, FUTEX_BITSET_MATCH_ANY);
 }
 
 int futex_requeue(int *addr, int count, int *requeue_addr, int *requeue_val)
 {
-	return futex_wake_requeue(addr, count, requeue_addr, requeue_val);
+	return futex_wake_requeue(addr, count, requeue_addr, requeue_val, FUTEX_BITSET_MATCH_ANY);
+}
+
+/* Decode and apply the operation of FUTEX_WAKE_OP to uaddr2 atomically, returns whether to wake waiters on uaddr2 */
+static int futex_atomic_op(int *uaddr2, int encoded_op)
+{
+	int op = (encoded_op >> 28) & 7;
+	int cmp = (encoded_op >> 24) & 15;
+	/* Sign extend the 12 bit arguments */
+	int oparg = (encoded_op << 8) >> 20;
+	int cmparg = (encoded_op << 20) >> 20;
+	if ((encoded_op >> 28) & FUTEX_OP_OPARG_SHIFT)
+	{
+		if (oparg < 0 || oparg > 31)
+			return -L_EINVAL;
+		oparg = 1 << oparg;
+	}
+	if (op > FUTEX_OP_XOR || cmp > FUTEX_OP_CMP_GE)
+		return -L_ENOSYS;
+
+	LONG oldval, newval;
+	do
+	{
+		oldval = *(volatile LONG *)uaddr2;
+		switch (op)
+		{
+		case FUTEX_OP_SET: newval = oparg; break;
+		case FUTEX_OP_ADD: newval = oldval + oparg; break;
+		case FUTEX_OP_OR: newval = oldval | oparg; break;
+		case FUTEX_OP_ANDN: newval = oldval & ~oparg; break;
+		default: newval = oldval ^ oparg; break;
+		}
+	} while (InterlockedCompareExchange((volatile LONG *)uaddr2, newval, oldval) != oldval);
+
+	switch (cmp)
+	{
+	case FUTEX_OP_CMP_EQ: return oldval == cmparg;
+	case FUTEX_OP_CMP_NE: return oldval != cmparg;
+	case FUTEX_OP_CMP_LT: return oldval < cmparg;
+	case FUTEX_OP_CMP_LE: return oldval <= cmparg;
+	case FUTEX_OP_CMP_GT: return oldval > cmparg;
+	default: return oldval >= cmparg;
+	}
+}
+
+static int futex_wake_op(int *addr, int count, int *addr2, int count2, int encoded_op)
+{
+	int bucket = futex_hash((size_t)addr);
+	int bucket2 = futex_hash((size_t)addr2);
+	/* The operation is done with both buckets locked so waiters can't miss the change of uaddr2 */
+	if (bucket == bucket2)
+		lock_bucket(bucket);
+	else
+		lock_buckets(bucket, bucket2);
+	int r = futex_atomic_op(addr2, encoded_op);
+	if (r >= 0)
+	{
+		int num_woken = futex_wake_locked(bucket, addr, count, FUTEX_BITSET_MATCH_ANY);
+		if (r)
+			num_woken += futex_wake_locked(bucket2, addr2, count2, FUTEX_BITSET_MATCH_ANY);
+		r = num_woken;
+	}
+	unlock_bucket(bucket);
+	if (bucket != bucket2)
+		unlock_bucket(bucket2);
+	return r;
+}
+
+/* Shared futexes
+ * Futexes in MAP_SHARED memory are keyed by the identity of the shared object and the offset in it,
+ * which is the same in all processes mapping it, see mm_get_shared_key().
+ * Waiters are recorded in a table in a named section shared by the whole session. Each bucket has a
+ * fixed number of wait slots, and each slot has a named auto reset event used to wake its waiter.
+ * A bucket is protected by a spin lock holding the owner's process id, so a lock left held by a
+ * dead process can be taken over.
+ */
+
+#define FUTEX_SHARED_HASH_BITS	8
+#define FUTEX_SHARED_BUCKETS	(1 << FUTEX_SHARED_HASH_BITS)
+#define FUTEX_SHARED_SLOTS		16
+
+#define FUTEX_SLOT_FREE			0
+#define FUTEX_SLOT_WAITING		1
+#define FUTEX_SLOT_WOKEN		2
+
+struct futex_shared_slot
+{
+	uint64_t object, offset;
+	unsigned int bitset;
+	DWORD pid;
+	volatile LONG state;
+};
+
+__declspec(align(64)) struct futex_shared_bucket
+{
+	volatile LONG lock;
+	struct futex_shared_slot slots[FUTEX_SHARED_SLOTS];
+};
+
+struct futex_shared_data
+{
+	struct futex_shared_bucket hash[FUTEX_SHARED_BUCKETS];
+};
+
+/* Process local state, reinitialized when the process id changes, i.e. in a forked child */
+static SRWLOCK futex_shared_lock = SRWLOCK_INIT;
+static DWORD futex_shared_pid;
+static HANDLE futex_shared_section;
+static struct futex_shared_data *futex_shared;
+static HANDLE futex_shared_events[FUTEX_SHARED_BUCKETS * FUTEX_SHARED_SLOTS];
+
+static bool futex_shared_init()
+{
+	DWORD pid = GetCurrentProcessId();
+	if (futex_shared_pid == pid)
+		return true;
+	AcquireSRWLockExclusive(&futex_shared_lock);
+	if (futex_shared_pid != pid)
+	{
+		/* Handles and views of the parent are not inherited */
+		memset(futex_shared_events, 0, sizeof(futex_shared_events));
+		futex_shared = NULL;
+
+		/* The section handle is inherited from the parent if it opened it before fork() */
+		NTSTATUS status;
+		if (!(futex_shared_section = shared_get_handle(SHARED_HANDLE_FUTEX_SECTION)))
+		{
+			UNICODE_STRING name;
+			RtlInitUnicodeString(&name, L"futex");
+			OBJECT_ATTRIBUTES oa;
+			InitializeObjectAttributes(&oa, &name, OBJ_INHERIT | OBJ_OPENIF, shared_get_object_directory(), NULL);
+			LARGE_INTEGER size;
+			size.QuadPart = sizeof(struct futex_shared_data);
+			status = NtCreateSection(&futex_shared_section, SECTION_MAP_READ | SECTION_MAP_WRITE, &oa, &size,
+				PAGE_READWRITE, SEC_COMMIT, NULL);
+			if (!NT_SUCCESS(status))
+			{
+				log_error("NtCreateSection() failed, status: %x", status);
+				ReleaseSRWLockExclusive(&futex_shared_lock);
+				return false;
+			}
+			futex_shared_section = shared_set_handle(SHARED_HANDLE_FUTEX_SECTION, futex_shared_section);
+		}
+		PVOID view = NULL;
+		SIZE_T view_size = sizeof(struct futex_shared_data);
+		status = NtMapViewOfSection(futex_shared_section, NtCurrentProcess(), &view, 0, view_size, NULL, &view_size,
+			ViewUnmap, MEM_TOP_DOWN, PAGE_READWRITE);
+		if (!NT_SUCCESS(status))
+		{
+			log_error("NtMapViewOfSection() failed, status: %x", status);
+			ReleaseSRWLockExclusive(&futex_shared_lock);
+			return false;
+		}
+		futex_shared = (struct futex_shared_data *)view;
+		futex_shared_pid = pid;
+	}
+	ReleaseSRWLockExclusive(&futex_shared_lock);
+	return true;
+}
+
+static HANDLE futex_shared_get_event(int index)
+{
+	if (futex_shared_events[index])
+		return futex_shared_events[index];
+	WCHAR namebuf[32];
+	UNICODE_STRING name;
+	RtlInitEmptyUnicodeString(&name, namebuf, sizeof(namebuf));
+	RtlAppendUnicodeToString(&name, L"futex_");
+	RtlAppendIntegerToString(index, 10, &name);
+	OBJECT_ATTRIBUTES oa;
+	InitializeObjectAttributes(&oa, &name, OBJ_OPENIF, shared_get_object_directory(), NULL);
+	HANDLE handle;
+	NTSTATUS status = NtCreateEvent(&handle, EVENT_ALL_ACCESS, &oa, SynchronizationEvent, FALSE);
+	if (!NT_SUCCESS(status))
+	{
+		log_error("NtCreateEvent() failed, status: %x", status);
+		return NULL;
+	}
+	if (InterlockedCompareExchangePointer(&futex_shared_events[index], handle, NULL) != NULL)
+		NtClose(handle); /* Another thread opened it first */
+	return futex_shared_events[index];
+}
+
+static bool futex_process_alive(DWORD pid)
+{
+	HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, pid);
+	if (!process)
+		return false;
+	bool alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+	CloseHandle(process);
+	return alive;
+}
+
+static int futex_shared_hash(uint64_t object, uint64_t offset)
+{
+	return (int)(((object ^ (offset >> 2)) * 0x9E3779B97F4A7C15ULL) >> (64 - FUTEX_SHARED_HASH_BITS));
+}
+
+static void futex_shared_lock_bucket(struct futex_shared_bucket *b)
+{
+	LONG pid = (LONG)GetCurrentProcessId();
+	for (int i = 0;; i++)
+	{
+		LONG owner = InterlockedCompareExchange(&b->lock, pid, 0);
+		if (owner == 0)
+			return;
+		if (i < 64)
+			YieldProcessor();
+		else
+		{
+			/* The owner may have died while holding the lock */
+			if ((i & 1023) == 0 && owner != pid && !futex_process_alive(owner))
+				InterlockedCompareExchange(&b->lock, 0, owner);
+			SwitchToThread();
+		}
+	}
+}
+
+static void futex_shared_unlock_bucket(struct futex_shared_bucket *b)
+{
+	InterlockedExchange(&b->lock, 0);
+}
+
+/* Find a slot for a new waiter, reclaiming slots left by dead processes */
+static int futex_shared_alloc_slot(struct futex_shared_bucket *b, int bucket)
+{
+	for (int i = 0; i < FUTEX_SHARED_SLOTS; i++)
+		if (b->slots[i].state == FUTEX_SLOT_FREE)
+			return i;
+	for (int i = 0; i < FUTEX_SHARED_SLOTS; i++)
+		if (!futex_process_alive(b->slots[i].pid))
+		{
+			HANDLE event = futex_shared_get_event(bucket * FUTEX_SHARED_SLOTS + i);
+			if (event)
+				ResetEvent(event);
+			return i;
+		}
+	return -1;
+}
+
+static int futex_shared_wait(volatile int *addr, uint64_t object, uint64_t offset, int val, DWORD timeout, unsigned int bitset)
+{
+	int bucket = futex_shared_hash(object, offset);
+	struct futex_shared_bucket *b = &futex_shared->hash[bucket];
+	futex_shared_lock_bucket(b);
+	if (*addr != val)
+	{
+		futex_shared_unlock_bucket(b);
+		return -L_EAGAIN;
+	}
+	int slot = futex_shared_alloc_slot(b, bucket);
+	HANDLE event = slot >= 0 ? futex_shared_get_event(bucket * FUTEX_SHARED_SLOTS + slot) : NULL;
+	if (!event)
+	{
+		/* Out of slots, sleep briefly and let the caller recheck, spurious wake ups are allowed */
+		futex_shared_unlock_bucket(b);
+		log_warning("Shared futex bucket %d is full.", bucket);
+		if (signal_wait(0, NULL, min(timeout, 1)) == WAIT_INTERRUPTED)
+			return -L_EINTR;
+		return 0;
+	}
+	struct futex_shared_slot *s = &b->slots[slot];
+	s->object = object;
+	s->offset = offset;
+	s->bitset = bitset;
+	s->pid = GetCurrentProcessId();
+	s->state = FUTEX_SLOT_WAITING;
+	futex_shared_unlock_bucket(b);
+
+	DWORD result = signal_wait(1, &event, timeout);
+
+	futex_shared_lock_bucket(b);
+	bool woken = s->state == FUTEX_SLOT_WOKEN;
+	if (woken && result != WAIT_OBJECT_0)
+	{
+		/* Woken between signal_wait() and locking the bucket, consume the event */
+		WaitForSingleObject(event, INFINITE);
+	}
+	s->state = FUTEX_SLOT_FREE;
+	futex_shared_unlock_bucket(b);
+	if (woken)
+		return 0;
+	else if (result == WAIT_INTERRUPTED)
+		return -L_EINTR;
+	else
+		return -L_ETIMEDOUT;
+}
+
+/* Wake up to count waiters, then requeue the rest to the requeue key if given
+ * Waiters can only be requeued within a bucket, those in other buckets are woken instead.
+ */
+static int futex_shared_wake_requeue(int *addr, uint64_t object, uint64_t offset, int count, unsigned int bitset,
+	bool requeue, uint64_t requeue_object, uint64_t requeue_offset, int *requeue_val)
+{
+	int bucket = futex_shared_hash(object, offset);
+	struct futex_shared_bucket *b = &futex_shared->hash[bucket];
+	futex_shared_lock_bucket(b);
+	if (requeue_val && *(volatile int *)addr != *requeue_val)
+	{
+		futex_shared_unlock_bucket(b);
+		return -L_EAGAIN;
+	}
+	bool same_bucket = requeue && futex_shared_hash(requeue_object, requeue_offset) == bucket;
+	int num_woken = 0;
+	for (int i = 0; i < FUTEX_SHARED_SLOTS; i++)
+	{
+		struct futex_shared_slot *s = &b->slots[i];
+		if (s->state != FUTEX_SLOT_WAITING || s->object != object || s->offset != offset || !(s->bitset & bitset))
+			continue;
+		if (num_woken >= count)
+		{
+			if (!requeue)
+				break;
+			if (same_bucket)
+			{
+				s->object = requeue_object;
+				s->offset = requeue_offset;
+				num_woken++;
+				continue;
+			}
+		}
+		HANDLE event = futex_shared_get_event(bucket * FUTEX_SHARED_SLOTS + i);
+		if (!event)
+			continue;
+		s->state = FUTEX_SLOT_WOKEN;
+		SetEvent(event);
+		num_woken++;
+	}
+	futex_shared_unlock_bucket(b);
+	return num_woken;
+}
+
+/* Get the shared futex key of uaddr if the operation is on a shared futex */
+static bool futex_get_shared_key(int op, const int *uaddr, uint64_t *object, uint64_t *offset)
+{
+	if (op & FUTEX_PRIVATE_FLAG)
+		return false;
+	if (!mm_get_shared_key(uaddr, object, offset))
+		return false;
+	return futex_shared_init();
+}
+
+/* A futex address, together with its shared key if it is a shared futex */
+struct futex_key
+{
+	int *addr;
+	bool shared;
+	uint64_t object, offset;
+};
+
+static int futex_key_wait(struct futex_key *key, int val, DWORD timeout, unsigned int bitset)
+{
+	if (key->shared)
+		return futex_shared_wait((volatile int *)key->addr, key->object, key->offset, val, timeout, bitset);
+	return futex_wait_bitset((volatile int *)key->addr, val, timeout, bitset);
+}
+
+static int futex_key_wake(struct futex_key *key, int count, unsigned int bitset)
+{
+	if (key->shared)
+		return futex_shared_wake_requeue(key->addr, key->object, key->offset, count, bitset, false, 0, 0, NULL);
+	return futex_wake_requeue(key->addr, count, NULL, NULL, bitset);
+}
+
+/* Current time of the clock used by an absolute futex timeout */
+static uint64_t futex_clock_ns(bool realtime)
+{
+	if (realtime)
+	{
+		FILETIME system_time;
+		win7compat_GetSystemTimePreciseAsFileTime(&system_time);
+		return filetime_to_unix_nsec(&system_time);
+	}
+	return timer_monotonic_ns();
+}
+
+/* Convert an absolute timeout to milliseconds left from now, rounded up */
+static DWORD futex_deadline_to_ms(const struct timespec *deadline, bool realtime)
+{
+	uint64_t deadline_ns = (uint64_t)deadline->tv_sec * NANOSECONDS_PER_SECOND + deadline->tv_nsec;
+	uint64_t now = futex_clock_ns(realtime);
+	if (deadline->tv_sec < 0 || deadline_ns <= now)
+		return 0;
+	uint64_t ms = (deadline_ns - now + 999999) / 1000000;
+	return ms > INT32_MAX ? INT32_MAX : (DWORD)ms;
+}
+
+/* Priority inheritance futexes
+ * Windows offers no way to boost the priority of the owner thread, so these implement the PI futex
+ * protocol on the futex word but without priority inheritance. The owner's tid lives in the futex
+ * word, with FUTEX_WAITERS set when somebody is blocked on it. Unlocking releases the futex and wakes
+ * one waiter, which then sets FUTEX_WAITERS again when reacquiring in case there are more waiters.
+ */
+static int futex_lock_pi(struct futex_key *key, const struct timespec *deadline, bool trylock)
+{
+	volatile LONG *word = (volatile LONG *)key->addr;
+	LONG tid = current_thread->pid;
+	bool waited = false;
+	for (;;)
+	{
+		LONG v = *word;
+		if ((v & FUTEX_TID_MASK) == 0)
+		{
+			LONG nv = tid | (v & FUTEX_OWNER_DIED) | (waited ? FUTEX_WAITERS : 0);
+			if (InterlockedCompareExchange(word, nv, v) == v)
+				return 0;
+			continue;
+		}
+		if ((v & FUTEX_TID_MASK) == tid)
+			return -L_EDEADLK;
+		if (trylock)
+			return -L_EAGAIN;
+		if (!(v & FUTEX_WAITERS))
+		{
+			if (InterlockedCompareExchange(word, v | FUTEX_WAITERS, v) != v)
+				continue;
+			v |= FUTEX_WAITERS;
+		}
+		waited = true;
+		DWORD timeout = deadline ? futex_deadline_to_ms(deadline, true) : INFINITE;
+		if (timeout == 0)
+			return -L_ETIMEDOUT;
+		int r = futex_key_wait(key, v, timeout, FUTEX_BITSET_MATCH_ANY);
+		if (r == -L_ETIMEDOUT || r == -L_EINTR)
+			return r;
+	}
+}
+
+static int futex_unlock_pi(struct futex_key *key)
+{
+	volatile LONG *word = (volatile LONG *)key->addr;
+	LONG tid = current_thread->pid;
+	LONG v;
+	do
+	{
+		v = *word;
+		if ((v & FUTEX_TID_MASK) != tid)
+			return -L_EPERM;
+	} while (InterlockedCompareExchange(word, 0, v) != v);
+	if (v & FUTEX_WAITERS)
+		futex_key_wake(key, 1, FUTEX_BITSET_MATCH_ANY);
+	return 0;
 }
 
 DEFINE_SYSCALL(futex, int *, uaddr, int, op, int, val, const struct timespec *, timeout, int *, uaddr2, int, val3)
@@ -219,35 +788,109 @@ DEFINE_SYSCALL(futex, int *, uaddr, int, op, int, val, const struct timespec *,
 	log_info("futex(%p, %d, %d, %p, %p, %d)", uaddr, op, val, timeout, uaddr2, val3);
 	if (!mm_check_read(uaddr, sizeof(int)))
 		return -L_EACCES;
-	switch (op & FUTEX_CMD_MASK)
+	struct futex_key key;
+	key.addr = uaddr;
+	key.shared = futex_get_shared_key(op, uaddr, &key.object, &key.offset);
+	int cmd = op & FUTEX_CMD_MASK;
+	switch (cmd)
 	{
 	case FUTEX_WAIT:
+	case FUTEX_WAIT_BITSET:
 	{
 		if (timeout && !mm_check_read(timeout, sizeof(struct timespec)))
 			return -L_EFAULT;
-		DWORD time = timeout ? timeout->tv_sec * 1000 + timeout->tv_nsec / 1000000 : INFINITE;
-		return futex_wait((volatile int *)uaddr, val, time);
+		if (timeout && (timeout->tv_nsec < 0 || timeout->tv_nsec >= NANOSECONDS_PER_SECOND))
+			return -L_EINVAL;
+		/* A relative timeout must not be negative either */
+		int ms = 0;
+		if (timeout && cmd == FUTEX_WAIT && (ms = timer_timespec_to_ms(timeout)) < 0)
+			return ms;
+		unsigned int bitset = (cmd == FUTEX_WAIT_BITSET) ? (unsigned int)val3 : FUTEX_BITSET_MATCH_ANY;
+		if (bitset == 0)
+			return -L_EINVAL;
+		DWORD time;
+		if (!timeout)
+			time = INFINITE;
+		else if (cmd == FUTEX_WAIT_BITSET) /* Absolute timeout, monotonic clock unless FUTEX_CLOCK_REALTIME is given */
+			time = futex_deadline_to_ms(timeout, (op & FUTEX_CLOCK_REALTIME) != 0);
+		else
+			time = ms;
+		if (time == 0 && *(volatile int *)uaddr == val)
+			return -L_ETIMEDOUT;
+		return futex_key_wait(&key, val, time, bitset);
 	}
 
 	case FUTEX_WAKE:
-		return futex_wake(uaddr, val);
+	case FUTEX_WAKE_BITSET:
+	{
+		unsigned int bitset = (cmd == FUTEX_WAKE_BITSET) ? (unsigned int)val3 : FUTEX_BITSET_MATCH_ANY;
+		if (bitset == 0)
+			return -L_EINVAL;
+		return futex_key_wake(&key, val, bitset);
+	}
 
 	case FUTEX_REQUEUE:
+	case FUTEX_CMP_REQUEUE:
 	{
 		if (!mm_check_read(uaddr2, sizeof(int)))
 			return -L_EACCES;
-		return futex_requeue(uaddr, val, uaddr2, NULL);
+		int *requeue_val = (cmd == FUTEX_CMP_REQUEUE) ? &val3 : NULL;
+		if (key.shared)
+		{
+			uint64_t requeue_object, requeue_offset;
+			/* Waiters can't be moved to a private futex, wake them all */
+			if (!mm_get_shared_key(uaddr2, &requeue_object, &requeue_offset))
+				return futex_shared_wake_requeue(uaddr, key.object, key.offset, INT_MAX, FUTEX_BITSET_MATCH_ANY,
+					false, 0, 0, requeue_val);
+			return futex_shared_wake_requeue(uaddr, key.object, key.offset, val, FUTEX_BITSET_MATCH_ANY,
+				true, requeue_object, requeue_offset, requeue_val);
+		}
+		return futex_requeue(uaddr, val, uaddr2, requeue_val);
 	}
 
-	case FUTEX_CMP_REQUEUE:
+	case FUTEX_WAKE_OP:
 	{
-		if (!mm_check_read(uaddr2, sizeof(int)))
-			return -L_EACCES;
-		return futex_requeue(uaddr, val, uaddr2, &val3);
+		if (!mm_check_write(uaddr2, sizeof(int)))
+			return -L_EFAULT;
+		/* The timeout argument carries the number of waiters to wake on uaddr2 */
+		int val2 = (int)(intptr_t)timeout;
+		struct futex_key key2;
+		key2.addr = uaddr2;
+		key2.shared = futex_get_shared_key(op, uaddr2, &key2.object, &key2.offset);
+		if (!key.shared && !key2.shared)
+			return futex_wake_op(uaddr, val, uaddr2, val2, val3);
+		int r = futex_atomic_op(uaddr2, val3);
+		if (r < 0)
+			return r;
+		int num_woken = futex_key_wake(&key, val, FUTEX_BITSET_MATCH_ANY);
+		if (r)
+			num_woken += futex_key_wake(&key2, val2, FUTEX_BITSET_MATCH_ANY);
+		return num_woken;
 	}
 
+	case FUTEX_LOCK_PI:
+	case FUTEX_TRYLOCK_PI:
+	{
+		if (!mm_check_write(uaddr, sizeof(int)))
+			return -L_EFAULT;
+		if (cmd == FUTEX_LOCK_PI && timeout)
+		{
+			if (!mm_check_read(timeout, sizeof(struct timespec)))
+				return -L_EFAULT;
+			if (timeout->tv_nsec < 0 || timeout->tv_nsec >= NANOSECONDS_PER_SECOND)
+				return -L_EINVAL;
+		}
+		/* FUTEX_LOCK_PI always uses an absolute CLOCK_REALTIME timeout */
+		return futex_lock_pi(&key, cmd == FUTEX_LOCK_PI ? timeout : NULL, cmd == FUTEX_TRYLOCK_PI);
+	}
+
+	case FUTEX_UNLOCK_PI:
+		if (!mm_check_write(uaddr, sizeof(int)))
+			return -L_EFAULT;
+		return futex_unlock_pi(&key);
+
 	default:
-		log_error("Unsupported futex operation, returning ENOSYS");
+		log_error("Unsupported futex operation %d, returning ENOSYS", cmd);
 		return -L_ENOSYS;
 	}
 }
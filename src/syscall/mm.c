@@ -17,16 +17,22 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_MM
+
 #include <common/errno.h>
 #include <dbt/x86.h>
 #include <lib/rbtree.h>
 #include <lib/slist.h>
 #include <syscall/mm.h>
+#include <syscall/prefetch.h>
 #include <syscall/syscall.h>
 #include <syscall/vfs.h>
+#include <etw.h>
 #include <flags.h>
 #include <log.h>
+#include <shared.h>
 #include <str.h>
+#include <win7compat.h>
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -45,6 +51,8 @@
  *     read/write file content manually on mmap()/msync()/munmap() calls.
  *     This may be slow. But we can possibly implement demand paging to
  *     improve performance.
+ *     Blocks at block aligned file offsets are mapped as views of the file's
+ *     section instead (see map_file_view()), msync() flushes those views.
  *
  * 2. Use MAP_FIXED with non 64kB aligned address
  *     We can allocate full 64kB aligned memory blocks and do partial
@@ -53,14 +61,18 @@
  */
 
 /* Hard limits */
-/* Maximum number of mmap()-ed areas */
-#define MAX_MMAP_COUNT 1024
+/* Maximum number of mmap()-ed areas, same as default vm.max_map_count of Linux */
+#define MAX_MMAP_COUNT 65530
+/* Number of map entries available at startup, embedded in mm_data */
+#define MM_INITIAL_MAP_ENTRIES 1024
+/* Default number of blocks in the window loaded around a detached block page fault */
+#define MM_FAULT_AROUND_BLOCKS 16
 
 #ifdef _WIN64
 
 /* Lower bound of the virtual address space */
 #define ADDRESS_SPACE_LOW		0x0000000000000000ULL
-/* Higher bound of the virtual address space */
+/* Higher bound of the virtual address space tables, see address_space_high */
 #define ADDRESS_SPACE_HIGH		0x0001000000000000ULL
 /* The lowest non fixed allocation address we can make */
 #define ADDRESS_ALLOCATION_LOW	0x0000000200000000ULL
@@ -71,12 +83,18 @@
 
 /* Lower bound of the virtual address space */
 #define ADDRESS_SPACE_LOW		0x00000000U
-/* Higher bound of the virtual address space */
-#define ADDRESS_SPACE_HIGH		0x80000000U
+/* Higher bound of the virtual address space tables, the user space size of i386 Linux, see address_space_high */
+#define ADDRESS_SPACE_HIGH		0xC0000000U
 /* The lowest non fixed allocation address we can make */
 #define ADDRESS_ALLOCATION_LOW	0x10000000U
-/* The highest non fixed allocation address we can make */
-#define ADDRESS_ALLOCATION_HIGH	0x70000000U
+/* The highest non fixed allocation address we can make, the shared heap window and system DLLs live above */
+#define ADDRESS_ALLOCATION_HIGH	SHARED_HEAP_BASE
+/* Second allocation window above 2GB, only available to a large address aware process on 64-bit Windows
+ * Top down allocations (our own heap and tables) prefer it, leaving the low window to the application.
+ * Host allocations made with MEM_TOP_DOWN (dbt caches, section tables) land above ADDRESS_SPACE_HIGH.
+ */
+#define ADDRESS_ALLOCATION_LAA_LOW	0x80000000U
+#define ADDRESS_ALLOCATION_LAA_HIGH	0xC0000000U
 
 #endif
 
@@ -89,6 +107,17 @@
 
 #define GET_SECTION_TABLE(i) ((i) / SECTION_HANDLE_PER_TABLE)
 
+#define PAGE_COUNT ((ADDRESS_SPACE_HIGH - ADDRESS_SPACE_LOW) / PAGE_SIZE)
+#define PAGE_BITMAP_BITS_PER_TABLE (BLOCK_SIZE * 8)
+#define PAGE_BITMAP_TABLE_COUNT (PAGE_COUNT / PAGE_BITMAP_BITS_PER_TABLE)
+
+/* Anonymous private memory is allocated in section chunks of up to this many blocks (2MB).
+ * All blocks of a chunk share one section handle and one view, a chunk never crosses an
+ * aligned window of SECTION_CHUNK_BLOCKS blocks so it can be found by scanning the handle table.
+ */
+#define SECTION_CHUNK_BLOCKS 32
+#define GET_SECTION_CHUNK_WINDOW(i) ((i) & ~(size_t)(SECTION_CHUNK_BLOCKS - 1))
+
 /* Helper macros */
 #define IS_ALIGNED(addr, alignment) ((size_t) (addr) % (size_t) (alignment) == 0)
 #define ALIGN_TO_BLOCK(addr) (((size_t) addr + BLOCK_SIZE - 1) & (-BLOCK_SIZE))
@@ -109,6 +138,10 @@
 struct map_entry
 {
 	struct rb_node tree;
+	/* Augmented data of the subtree rooted at this entry, used by free pages finders */
+	struct map_entry *subtree_first, *subtree_last; /* Lowest and highest entries */
+	size_t subtree_max_gap; /* Largest number of free pages between two adjacent entries */
+	size_t subtree_next_page; /* First page after the subtree not colliding with block aligned entries */
 	union
 	{
 		struct slist free_list;
@@ -119,6 +152,7 @@ struct map_entry
 			int prot, flags;
 			struct file *f;
 			off_t offset_pages;
+			uint64_t shared_id; /* MAP_SHARED only: identity of the shared object, see mm_get_shared_key() */
 		};
 	};
 };
@@ -135,6 +169,31 @@ static int map_entry_cmp(const struct rb_node *l, const struct rb_node *r)
 		return 1;
 }
 
+static void map_entry_augment(struct rb_node *node)
+{
+	struct map_entry *e = rb_entry(node, struct map_entry, tree);
+	e->subtree_first = e;
+	e->subtree_last = e;
+	e->subtree_max_gap = 0;
+	e->subtree_next_page = e->end_page + 1;
+	if (BLOCK_ALIGNED(e->flags))
+		e->subtree_next_page = (e->subtree_next_page + PAGES_PER_BLOCK - 1) & -PAGES_PER_BLOCK;
+	if (node->left)
+	{
+		struct map_entry *l = rb_entry(node->left, struct map_entry, tree);
+		e->subtree_first = l->subtree_first;
+		e->subtree_max_gap = max(l->subtree_max_gap, e->start_page - l->subtree_last->end_page - 1);
+		e->subtree_next_page = max(e->subtree_next_page, l->subtree_next_page);
+	}
+	if (node->right)
+	{
+		struct map_entry *r = rb_entry(node->right, struct map_entry, tree);
+		e->subtree_last = r->subtree_last;
+		e->subtree_max_gap = max(e->subtree_max_gap, max(r->subtree_max_gap, r->subtree_first->start_page - e->end_page - 1));
+		e->subtree_next_page = max(e->subtree_next_page, r->subtree_next_page);
+	}
+}
+
 struct mm_munmap_list_entry
 {
 	void *addr;
@@ -142,6 +201,15 @@ struct mm_munmap_list_entry
 	struct mm_munmap_list_entry *next;
 };
 
+/* An executable file mapping released by mm_reset(), see mm_is_code_retained() */
+#define MM_RETAINED_CODE_COUNT	32
+struct retained_code
+{
+	size_t start_page, end_page;
+	off_t offset_pages;
+	uint64_t dev, ino, size, mtime, mtime_nsec; /* Identity of the file */
+};
+
 struct mm_data
 {
 	/* RW lock for multi-threading protection */
@@ -155,6 +223,8 @@ struct mm_data
 
 	/* Program break address, brk() will use this */
 	void *brk;
+	/* End of the pages mapped for the program break, which grows ahead of it, see sys_brk() */
+	void *brk_end;
 
 	/* Used for mm_static_alloc() */
 	void *static_alloc_begin, *static_alloc_end;
@@ -162,14 +232,250 @@ struct mm_data
 	/* Information for all existing mappings */
 	struct rb_tree entry_tree;
 	struct slist entry_free_list;
-	struct map_entry entries[MAX_MMAP_COUNT];
+	int entry_free_count;
+	int entry_count; /* Number of map entry objects allocated in total */
+	bool entry_growing;
+	struct map_entry entries[MM_INITIAL_MAP_ENTRIES];
+
+	/* Large page support, see get_large_page_pages() */
+	bool large_pages_checked;
+	size_t large_page_pages; /* Number of pages in a large page, 0 if large pages are unavailable */
+
+	/* Executable file mappings released by the last mm_reset() */
+	int retained_code_count;
+	struct retained_code retained_code[MM_RETAINED_CODE_COUNT];
+
+	/* Page fault statistics, reported in /proc/[pid]/flinux/mm */
+	struct
+	{
+		int on_demand_faults;
+		int detached_faults;
+		int cow_faults;
+		int cow_pages; /* Pages privately copied by copy-on-write */
+		int cow_blocks; /* Section chunks duplicated by copy-on-write */
+		int fork_rebuilds; /* Section chunks rebuilt from private pages on fork */
+		int fault_around_blocks; /* Detached blocks loaded ahead of access */
+		int file_view_blocks; /* Blocks mapped as views of file sections */
+		int remap_moved_blocks; /* Blocks moved by mremap() without copying */
+		int remap_copied_blocks; /* Blocks copied by mremap() */
+		int large_pages; /* Large pages allocated */
+		int large_page_splits; /* Large page allocations split into regular pages */
+		int protect_calls; /* NtProtectVirtualMemory() calls by mm_change_protection() */
+		int protect_skipped_pages; /* Pages mprotect() left alone as their protection did not change */
+		LONG resolved_faults; /* Faults found already resolved by another thread */
+		int code_write_faults; /* Writes caught on pages holding translated code */
+		LONG unresolved_faults; /* Faults not caused by mm, passed on to the crash handler */
+	} stats;
 
 	/* Section handle count for each table */
 	uint16_t section_table_handle_count[SECTION_TABLE_COUNT];
+
+	/* Last id given to an anonymous MAP_SHARED mapping, see get_shared_id() */
+	uint32_t shared_id_counter;
+
+	/* Bumped whenever a mapping is added, removed, resized or its protection is changed */
+	volatile uint32_t maps_version;
 } _mm;
 static struct mm_data *const mm = &_mm;
 static HANDLE *mm_section_handle;
 
+/* Higher bound of the usable virtual address space, see init_address_space() */
+static size_t address_space_high;
+#ifndef _WIN64
+/* End of the allocation window above 2GB, 0 if unavailable */
+static size_t laa_allocation_high;
+#endif
+
+/* Clamp the address space to what Windows gives us
+ * A 32-bit process only gets more than 2GB on 64-bit Windows or with a /3GB boot configuration
+ * when it is large address aware, and the amount depends on the configuration.
+ */
+static void init_address_space()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	address_space_high = min(ADDRESS_SPACE_HIGH, ((size_t)info.lpMaximumApplicationAddress + 1) & -BLOCK_SIZE);
+#ifndef _WIN64
+	laa_allocation_high = min(ADDRESS_ALLOCATION_LAA_HIGH, address_space_high);
+	if (laa_allocation_high <= ADDRESS_ALLOCATION_LAA_LOW)
+		laa_allocation_high = 0;
+#endif
+}
+
+/* Page permission bitmap
+ * Two bitmaps of PAGE_COUNT bits, for readable and writable pages in this order, are used by
+ * mm_check_read() and mm_check_write() to validate user buffers without touching them.
+ * A set bit means the page is known to be accessible in this process. It is set when pages
+ * are loaded or their protection is changed, and cleared whenever the page may lose the access.
+ * A clear bit means nothing, such pages are probed as before.
+ * Two more bitmaps track pages translated by the dbt, see mm_protect_code().
+ * The last one marks pages known to be zero filled: those of a newly created section which
+ * were never given to a map entry. They need not be zeroed for anonymous memory, see
+ * zero_pages(). The bits are cleared once the page is accessible or its section is removed.
+ * Tables of the bitmaps are committed on first use. Neither the bitmap nor the committed
+ * flags are part of mm_data, a forked child starts with all bits clear.
+ */
+#define PAGE_BITMAP_READ			0
+#define PAGE_BITMAP_WRITE			1
+#define PAGE_BITMAP_CODE			2 /* The dbt has translated code from the page */
+#define PAGE_BITMAP_CODE_PROTECTED	3 /* Write access of the page is removed by protect_code_pages() */
+#define PAGE_BITMAP_ZERO			4 /* The page is untouched since its section was created */
+#define PAGE_BITMAP_COUNT			5
+static uint8_t *mm_page_bitmap;
+static bool mm_page_bitmap_committed[PAGE_BITMAP_COUNT * PAGE_BITMAP_TABLE_COUNT];
+
+static void update_page_bitmap(int bitmap, size_t start_page, size_t end_page, bool accessible)
+{
+	size_t first_bit = bitmap * PAGE_COUNT + start_page;
+	size_t last_bit = bitmap * PAGE_COUNT + end_page;
+	for (size_t bit = first_bit; bit <= last_bit;)
+	{
+		size_t t = bit / PAGE_BITMAP_BITS_PER_TABLE;
+		size_t table_last_bit = min(last_bit, (t + 1) * PAGE_BITMAP_BITS_PER_TABLE - 1);
+		if (!mm_page_bitmap_committed[t])
+		{
+			if (!accessible)
+			{
+				bit = table_last_bit + 1;
+				continue;
+			}
+			if (!VirtualAlloc(&mm_page_bitmap[t * BLOCK_SIZE], BLOCK_SIZE, MEM_COMMIT, PAGE_READWRITE))
+			{
+				log_error("Committing page bitmap table 0x%p failed, error code: %d", t, GetLastError());
+				return;
+			}
+			mm_page_bitmap_committed[t] = true;
+		}
+		while (bit <= table_last_bit)
+		{
+			if (bit % 8 == 0 && bit + 7 <= table_last_bit)
+			{
+				mm_page_bitmap[bit / 8] = accessible? 0xFF: 0;
+				bit += 8;
+			}
+			else
+			{
+				if (accessible)
+					mm_page_bitmap[bit / 8] |= 1 << (bit % 8);
+				else
+					mm_page_bitmap[bit / 8] &= ~(1 << (bit % 8));
+				bit++;
+			}
+		}
+	}
+}
+
+static bool test_page_bitmap(int bitmap, size_t start_page, size_t end_page)
+{
+	size_t last_bit = bitmap * PAGE_COUNT + end_page;
+	for (size_t bit = bitmap * PAGE_COUNT + start_page; bit <= last_bit;)
+	{
+		if (!mm_page_bitmap_committed[bit / PAGE_BITMAP_BITS_PER_TABLE])
+			return false;
+		uint8_t bits = mm_page_bitmap[bit / 8];
+		if (bit % 8 == 0 && bit + 7 <= last_bit)
+		{
+			if (bits != 0xFF)
+				return false;
+			bit += 8;
+		}
+		else
+		{
+			if (!(bits & (1 << (bit % 8))))
+				return false;
+			bit++;
+		}
+	}
+	return true;
+}
+
+/* Find the first page in [start_page, end_page] with its bit set, returns end_page + 1 if there is none */
+static size_t find_page_bitmap(int bitmap, size_t start_page, size_t end_page)
+{
+	size_t base = bitmap * PAGE_COUNT;
+	for (size_t page = start_page; page <= end_page;)
+	{
+		size_t bit = base + page;
+		if (!mm_page_bitmap_committed[bit / PAGE_BITMAP_BITS_PER_TABLE])
+		{
+			page = (bit / PAGE_BITMAP_BITS_PER_TABLE + 1) * PAGE_BITMAP_BITS_PER_TABLE - base;
+			continue;
+		}
+		uint8_t bits = mm_page_bitmap[bit / 8];
+		if (bit % 8 == 0 && bits == 0)
+			page += 8;
+		else if (bits & (1 << (bit % 8)))
+			return page;
+		else
+			page++;
+	}
+	return end_page + 1;
+}
+
+static DWORD prot_linux2win(int prot);
+
+/* Translated code protection
+ * The dbt reports the pages it translated code from with mm_protect_code(). Write access of
+ * these pages is removed, so a write to them faults and handle_code_page_fault() drops the
+ * translations of the page and gives the write access back until the page is translated again.
+ * Pages not writable when translated are marked only, they lose write access in
+ * set_page_permission() once they gain it. Copy-on-write views are left writable as their
+ * protection cannot be restored from the map entry.
+ * The marks outlive the mapping like the translations do, they are dropped when new content
+ * is loaded into the pages, see map_entry_range().
+ * The range is published to other threads by dbt_code_changed() before write access is given
+ * back, they drop their own translations of it the next time they enter the translator.
+ */
+static void protect_code_pages(size_t start_page, size_t end_page, int prot)
+{
+	DWORD protection = prot_linux2win(prot);
+	DWORD code_protection = prot_linux2win((prot | PROT_READ) & ~PROT_WRITE);
+	for (size_t page = find_page_bitmap(PAGE_BITMAP_CODE, start_page, end_page); page <= end_page;
+		page = find_page_bitmap(PAGE_BITMAP_CODE, page + 1, end_page))
+	{
+		MEMORY_BASIC_INFORMATION info;
+		DWORD old_protection;
+		if (!VirtualQuery(GET_PAGE_ADDRESS(page), &info, sizeof(info)) || info.State != MEM_COMMIT || (info.Protect & 0xFF) != protection)
+			continue;
+		if (!VirtualProtect(GET_PAGE_ADDRESS(page), PAGE_SIZE, code_protection, &old_protection))
+		{
+			log_warning("VirtualProtect(0x%p) for translated code failed, error code: %d.", GET_PAGE_ADDRESS(page), GetLastError());
+			continue;
+		}
+		update_page_bitmap(PAGE_BITMAP_WRITE, page, page, false);
+		update_page_bitmap(PAGE_BITMAP_CODE_PROTECTED, page, page, true);
+	}
+}
+
+/* Record pages [start_page, end_page] as accessible with the given protection */
+static void set_page_permission(size_t start_page, size_t end_page, int prot)
+{
+	update_page_bitmap(PAGE_BITMAP_READ, start_page, end_page, (prot & PROT_READ) != 0);
+	update_page_bitmap(PAGE_BITMAP_WRITE, start_page, end_page, (prot & PROT_WRITE) != 0);
+	update_page_bitmap(PAGE_BITMAP_CODE_PROTECTED, start_page, end_page, false);
+	if (prot != PROT_NONE)
+		update_page_bitmap(PAGE_BITMAP_ZERO, start_page, end_page, false);
+	if (prot & PROT_WRITE)
+		protect_code_pages(start_page, end_page, prot);
+}
+
+/* Forget the translations of pages [start_page, end_page] before new content is loaded into them */
+static void drop_code_pages(size_t start_page, size_t end_page)
+{
+	for (size_t page = find_page_bitmap(PAGE_BITMAP_CODE, start_page, end_page); page <= end_page;
+		page = find_page_bitmap(PAGE_BITMAP_CODE, page + 1, end_page))
+	{
+		update_page_bitmap(PAGE_BITMAP_CODE, page, page, false);
+		dbt_code_changed((size_t)GET_PAGE_ADDRESS(page), PAGE_SIZE);
+	}
+}
+
+/* Forget the permissions of pages [start_page, end_page] */
+static __forceinline void clear_page_permission(size_t start_page, size_t end_page)
+{
+	set_page_permission(start_page, end_page, PROT_NONE);
+}
+
 static __forceinline HANDLE get_section_handle(size_t i)
 {
 	size_t t = GET_SECTION_TABLE(i);
@@ -196,20 +502,37 @@ static __forceinline void replace_section_handle(size_t i, HANDLE handle)
 	mm_section_handle[i] = handle;
 }
 
-static __forceinline void replace_section_handle_ex(HANDLE process, size_t i, HANDLE handle)
+/* Replace a section handle in the section handle table of another process */
+static __forceinline void replace_section_handle_ex(HANDLE process, HANDLE *table, size_t i, HANDLE handle)
 {
 	SIZE_T written;
-	NtWriteVirtualMemory(process, &mm_section_handle[i], &handle, sizeof(HANDLE), &written);
+	NtWriteVirtualMemory(process, &table[i], &handle, sizeof(HANDLE), &written);
 }
 
 static __forceinline void remove_section_handle(size_t i)
 {
 	mm_section_handle[i] = NULL;
+	update_page_bitmap(PAGE_BITMAP_ZERO, GET_FIRST_PAGE_OF_BLOCK(i), GET_LAST_PAGE_OF_BLOCK(i), false);
 	size_t t = GET_SECTION_TABLE(i);
 	if (--mm->section_table_handle_count[t] == 0)
 		VirtualFree(&mm_section_handle[t * SECTION_HANDLE_PER_TABLE], BLOCK_SIZE, MEM_DECOMMIT);
 }
 
+/* Get the range of blocks sharing the section of the given block, the block must have a section */
+static void get_section_chunk(size_t block, size_t *first_block, size_t *last_block)
+{
+	HANDLE handle = mm_section_handle[block];
+	size_t window_first = GET_SECTION_CHUNK_WINDOW(block);
+	size_t window_last = window_first + SECTION_CHUNK_BLOCKS - 1;
+	size_t first = block, last = block;
+	while (first > window_first && mm_section_handle[first - 1] == handle)
+		first--;
+	while (last < window_last && mm_section_handle[last + 1] == handle)
+		last++;
+	*first_block = first;
+	*last_block = last;
+}
+
 static void munmap_list_add(void *addr, size_t length)
 {
 	struct mm_munmap_list_entry *e = HeapAlloc(GetProcessHeap(), 0, sizeof(struct mm_munmap_list_entry));
@@ -231,8 +554,38 @@ static void *munmap_list_pop(size_t *length)
 	return addr;
 }
 
+/* Map entry pool
+ * Besides the initial entries in mm_data, more entries are allocated a block at a time from
+ * a VirtualAlloc()-ed mapping managed by mmap_internal() itself. Such mappings are copied to
+ * the same address by mm_fork(), together with mm_data this keeps all the pointers in the
+ * tree and free list valid in the child. The mapping itself needs a map entry, so the pool
+ * grows when the last free entry is about to be taken, and the nested mmap_internal() uses it.
+ */
+static void *mmap_internal(void *addr, size_t length, int prot, int flags, int internal_flags, struct file *f, off_t offset_pages);
+static void grow_map_entries()
+{
+	int count = BLOCK_SIZE / sizeof(struct map_entry);
+	if (mm->entry_count + count > MAX_MMAP_COUNT)
+		return;
+	mm->entry_growing = true;
+	struct map_entry *entries = mmap_internal(NULL, BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS,
+		INTERNAL_MAP_TOPDOWN | INTERNAL_MAP_NORESET | INTERNAL_MAP_VIRTUALALLOC, NULL, 0);
+	mm->entry_growing = false;
+	if ((uintptr_t)entries >= (uintptr_t)-PAGE_SIZE)
+	{
+		log_error("Allocating map entries failed.");
+		return;
+	}
+	for (int i = 0; i < count; i++)
+		slist_add(&mm->entry_free_list, &entries[i].free_list);
+	mm->entry_free_count += count;
+	mm->entry_count += count;
+}
+
 static struct map_entry *new_map_entry()
 {
+	if (mm->entry_free_count == 1 && !mm->entry_growing)
+		grow_map_entries();
 	if (slist_empty(&mm->entry_free_list))
 	{
 		log_error("Map entry exhausted.");
@@ -240,12 +593,14 @@ static struct map_entry *new_map_entry()
 	}
 	struct map_entry *entry = slist_next_entry(&mm->entry_free_list, struct map_entry, free_list);
 	slist_remove(&mm->entry_free_list, &entry->free_list);
+	mm->entry_free_count--;
 	return entry;
 }
 
 static void free_map_entry(struct map_entry *entry)
 {
 	slist_add(&mm->entry_free_list, &entry->free_list);
+	mm->entry_free_count++;
 }
 
 static struct rb_node *start_node(size_t start_page)
@@ -270,9 +625,70 @@ static struct map_entry *find_map_entry(void *addr)
 	return NULL;
 }
 
-static void split_map_entry(struct map_entry *e, size_t last_page_of_first_entry)
+/* Get the end address of the VirtualAlloc() allocation of the given memory region */
+static char *get_allocation_end(MEMORY_BASIC_INFORMATION *info)
+{
+	PVOID base = info->AllocationBase;
+	char *end = (char *)info->BaseAddress + info->RegionSize;
+	MEMORY_BASIC_INFORMATION next;
+	while (VirtualQuery(end, &next, sizeof(next)) && next.State != MEM_FREE && next.AllocationBase == base)
+		end = (char *)next.BaseAddress + next.RegionSize;
+	return end;
+}
+
+/* Release all VirtualAlloc() allocations starting in pages [start_page, end_page] */
+static void free_virtualalloc_range(size_t start_page, size_t end_page)
+{
+	size_t current = start_page;
+	while (current <= end_page)
+	{
+		MEMORY_BASIC_INFORMATION info;
+		if (!VirtualQuery(GET_PAGE_ADDRESS(current), &info, sizeof(info)))
+			break;
+		if (info.State != MEM_FREE && (size_t)info.AllocationBase >= (size_t)GET_PAGE_ADDRESS(start_page))
+			VirtualFree(info.AllocationBase, 0, MEM_RELEASE);
+		current = GET_PAGE((size_t)info.BaseAddress + info.RegionSize);
+	}
+}
+
+/* Split the read-write VirtualAlloc() allocation containing the given page into two regular
+ * allocations at the page, so each map entry owns whole allocations. Large pages cannot be
+ * partially released, the content is moved to regular pages instead.
+ */
+static void split_virtualalloc_allocation(size_t page)
+{
+	char *addr = (char *)GET_PAGE_ADDRESS(page);
+	MEMORY_BASIC_INFORMATION info;
+	if (!VirtualQuery(addr, &info, sizeof(info)) || info.State == MEM_FREE || info.AllocationBase == addr)
+		return;
+	char *base = (char *)info.AllocationBase;
+	char *end = get_allocation_end(&info);
+	size_t size = end - base;
+	void *copy = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!copy)
+	{
+		log_error("VirtualAlloc(%p) failed, error code: %d", size, GetLastError());
+		return;
+	}
+	CopyMemory(copy, base, size);
+	VirtualFree(base, 0, MEM_RELEASE);
+	if (!VirtualAlloc(base, addr - base, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE)
+		|| !VirtualAlloc(addr, end - addr, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE))
+		log_error("Splitting allocation [%p, %p) at %p failed, error code: %d", base, end, addr, GetLastError());
+	else
+		CopyMemory(base, copy, size);
+	VirtualFree(copy, 0, MEM_RELEASE);
+	mm->stats.large_page_splits++;
+}
+
+/* Split map entry e after the given page, returns false if no map entry is available, e is then unchanged */
+static bool split_map_entry(struct map_entry *e, size_t last_page_of_first_entry)
 {
 	struct map_entry *ne = new_map_entry();
+	if (!ne)
+		return false;
+	if (e->flags & INTERNAL_MAP_LARGE_PAGES)
+		split_virtualalloc_allocation(last_page_of_first_entry + 1);
 	ne->start_page = last_page_of_first_entry + 1;
 	ne->end_page = e->end_page;
 	if ((ne->f = e->f))
@@ -282,12 +698,79 @@ static void split_map_entry(struct map_entry *e, size_t last_page_of_first_entry
 	}
 	ne->prot = e->prot;
 	ne->flags = e->flags;
+	ne->shared_id = e->shared_id;
 	e->end_page = last_page_of_first_entry;
 	rb_add(&mm->entry_tree, &ne->tree, map_entry_cmp);
+	mm->maps_version++;
+	return true;
+}
+
+/* Whether map entry b, which starts right after map entry a, can be merged into a
+ * Only private anonymous entries are merged. File entries would need matching offsets and
+ * file views, shared entries have their own identity and VirtualAlloc()-ed entries their own
+ * allocations.
+ */
+static bool can_merge_map_entries(struct map_entry *a, struct map_entry *b)
+{
+	if (a->end_page + 1 != b->start_page || a->prot != b->prot || a->flags != b->flags)
+		return false;
+	if (a->f || b->f || (a->flags & (INTERNAL_MAP_SHARED | INTERNAL_MAP_VIRTUALALLOC)))
+		return false;
+	return true;
+}
+
+/* Merge map entry e with its neighbours if possible, returns the resulting entry */
+static struct map_entry *merge_map_entry(struct map_entry *e)
+{
+	struct rb_node *prev = rb_prev(&e->tree);
+	if (prev && can_merge_map_entries(rb_entry(prev, struct map_entry, tree), e))
+	{
+		struct map_entry *pe = rb_entry(prev, struct map_entry, tree);
+		rb_remove(&mm->entry_tree, &e->tree);
+		/* Re-add the entry to update augmented data */
+		rb_remove(&mm->entry_tree, &pe->tree);
+		pe->end_page = e->end_page;
+		rb_add(&mm->entry_tree, &pe->tree, map_entry_cmp);
+		free_map_entry(e);
+		e = pe;
+		mm->maps_version++;
+	}
+	struct rb_node *next = rb_next(&e->tree);
+	if (next && can_merge_map_entries(e, rb_entry(next, struct map_entry, tree)))
+	{
+		struct map_entry *ne = rb_entry(next, struct map_entry, tree);
+		rb_remove(&mm->entry_tree, &ne->tree);
+		rb_remove(&mm->entry_tree, &e->tree);
+		e->end_page = ne->end_page;
+		rb_add(&mm->entry_tree, &e->tree, map_entry_cmp);
+		free_map_entry(ne);
+		mm->maps_version++;
+	}
+	return e;
+}
+
+static void split_section_chunk(size_t first_block, size_t last_block);
+static void free_block_range(size_t start_block, size_t end_block);
+
+/* Split the section chunk of the given block if it reaches out of [start_block, end_block] */
+static void split_crossing_section_chunk(size_t block, size_t start_block, size_t end_block)
+{
+	if (!get_section_handle(block))
+		return;
+	size_t first, last;
+	get_section_chunk(block, &first, &last);
+	if (first < start_block || last > end_block)
+		split_section_chunk(first, last);
 }
 
 static void free_map_entry_blocks(struct map_entry *e)
 {
+	clear_page_permission(e->start_page, e->end_page);
+	if (e->flags & INTERNAL_MAP_LARGE_PAGES)
+	{
+		free_virtualalloc_range(e->start_page, e->end_page);
+		return;
+	}
 	if (e->flags & INTERNAL_MAP_VIRTUALALLOC)
 	{
 		VirtualFree(GET_PAGE_ADDRESS(e->start_page), 0, MEM_RELEASE);
@@ -299,10 +782,22 @@ static void free_map_entry_blocks(struct map_entry *e)
 	struct rb_node *next = rb_next(&e->tree);
 	size_t start_block = GET_BLOCK_OF_PAGE(e->start_page);
 	size_t end_block = GET_BLOCK_OF_PAGE(e->end_page);
+	bool first_shared = prev && GET_BLOCK_OF_PAGE(rb_entry(prev, struct map_entry, tree)->end_page) == start_block;
+	bool last_shared = next && GET_BLOCK_OF_PAGE(rb_entry(next, struct map_entry, tree)->start_page) == end_block;
+
+	/* Section chunks only partially covered by the freed blocks are split before protection of
+	 * the shared blocks is changed, so the new sections inherit the protection of the live entries */
+	size_t free_start = start_block + first_shared;
+	if (free_start + last_shared <= end_block)
+	{
+		size_t free_end = end_block - last_shared;
+		split_crossing_section_chunk(free_start, free_start, free_end);
+		split_crossing_section_chunk(free_end, free_start, free_end);
+	}
 
 	/* The first block and last block may be shared with previous/next entry
 	 * We should mark corresponding pages in such blocks as PAGE_NOACCESS instead of free them */
-	if (prev && GET_BLOCK_OF_PAGE(rb_entry(prev, struct map_entry, tree)->end_page) == start_block)
+	if (first_shared)
 	{
 		/* First block is shared, just make it inaccessible */
 		size_t last_page = GET_LAST_PAGE_OF_BLOCK(GET_BLOCK_OF_PAGE(e->start_page));
@@ -311,7 +806,7 @@ static void free_map_entry_blocks(struct map_entry *e)
 		VirtualProtect(GET_PAGE_ADDRESS(e->start_page), (last_page - e->start_page + 1) * PAGE_SIZE, PAGE_NOACCESS, &oldProtect);
 		start_block++;
 	}
-	if (end_block >= start_block && next && GET_BLOCK_OF_PAGE(rb_entry(next, struct map_entry, tree)->start_page) == end_block)
+	if (end_block >= start_block && last_shared)
 	{
 		/* Last block is shared, just make it inaccessible */
 		DWORD oldProtect;
@@ -319,17 +814,8 @@ static void free_map_entry_blocks(struct map_entry *e)
 		end_block--;
 	}
 	/* Unmap non-shared full blocks */
-	for (size_t i = start_block; i <= end_block; i++)
-	{
-		HANDLE handle = get_section_handle(i);
-		if (handle)
-		{
-			/* The section handle may not be currrently mapped, let it silently fail here */
-			NtUnmapViewOfSection(NtCurrentProcess(), GET_BLOCK_ADDRESS(i));
-			NtClose(handle);
-			remove_section_handle(i);
-		}
-	}
+	if (start_block <= end_block)
+		free_block_range(start_block, end_block);
 }
 
 
@@ -337,28 +823,117 @@ void mm_init()
 {
 	/* Initialize RW lock */
 	InitializeSRWLock(&mm->rw_lock);
+	init_address_space();
 	/* Initialize thread ID */
 	mm->thread_id = 0;
 	/* Initialize munmap_list */
 	mm->munmap_list = NULL;
 	/* Initialize mapping info freelist */
-	rb_init(&mm->entry_tree);
+	rb_init_augmented(&mm->entry_tree, map_entry_augment);
 	slist_init(&mm->entry_free_list);
-	for (size_t i = 0; i + 1 < MAX_MMAP_COUNT; i++)
+	for (size_t i = 0; i < MM_INITIAL_MAP_ENTRIES; i++)
 		slist_add(&mm->entry_free_list, &mm->entries[i].free_list);
+	mm->entry_free_count = MM_INITIAL_MAP_ENTRIES;
+	mm->entry_count = MM_INITIAL_MAP_ENTRIES;
+	mm->entry_growing = false;
 	mm->brk = 0;
+	mm->brk_end = 0;
+	/* Ids are only unique together with the process id, seed the counter to make reused process ids less likely to collide */
+	mm->shared_id_counter = GetTickCount();
 	/* Initialize section handle table */
 	mm_section_handle = VirtualAlloc(NULL, BLOCK_COUNT * sizeof(HANDLE), MEM_RESERVE | MEM_TOP_DOWN, PAGE_READWRITE);
+	/* Initialize page permission bitmap */
+	mm_page_bitmap = VirtualAlloc(NULL, PAGE_BITMAP_COUNT * PAGE_BITMAP_TABLE_COUNT * BLOCK_SIZE, MEM_RESERVE | MEM_TOP_DOWN, PAGE_READWRITE);
 	/* Initialize static alloc */
 	mm->static_alloc_begin = mm_mmap(NULL, MM_STATIC_ALLOC_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS,
 		INTERNAL_MAP_TOPDOWN | INTERNAL_MAP_NORESET | INTERNAL_MAP_VIRTUALALLOC, NULL, 0);
 	mm->static_alloc_end = (uint8_t*)mm->static_alloc_begin + MM_STATIC_ALLOC_SIZE;
 }
 
+/* Retained code
+ * Translated code does not have to be thrown away on execve() if the new image maps the same
+ * content at the same address again, which is the case for the interpreter and libraries
+ * loaded at the same base. mm_reset() records the read only executable file mappings it
+ * releases, the dbt keeps translations inside them. A new mapping overlapping a record is
+ * checked in check_retained_code(), if it does not map the same file at the same offset the
+ * translations of the whole record are dropped.
+ */
+static bool get_retained_code(struct map_entry *e, struct retained_code *code)
+{
+	struct newstat st;
+	if (!e->f || (e->prot & (PROT_EXEC | PROT_WRITE)) != PROT_EXEC || (e->flags & INTERNAL_MAP_SHARED))
+		return false;
+	if (!e->f->op_vtable->stat || e->f->op_vtable->stat(e->f, &st) < 0)
+		return false;
+	code->start_page = e->start_page;
+	code->end_page = e->end_page;
+	code->offset_pages = e->offset_pages;
+	code->dev = st.st_dev;
+	code->ino = st.st_ino;
+	code->size = st.st_size;
+	code->mtime = st.st_mtime;
+	code->mtime_nsec = st.st_mtime_nsec;
+	return true;
+}
+
+static void check_retained_code(struct map_entry *e)
+{
+	struct retained_code code;
+	int has_code = -1; /* Not queried yet */
+	for (int i = 0; i < mm->retained_code_count;)
+	{
+		struct retained_code *r = &mm->retained_code[i];
+		if (r->end_page < e->start_page || r->start_page > e->end_page)
+		{
+			i++;
+			continue;
+		}
+		if (has_code == -1)
+			has_code = get_retained_code(e, &code);
+		if (has_code && code.ino == r->ino && code.dev == r->dev && code.size == r->size && code.mtime == r->mtime
+			&& code.mtime_nsec == r->mtime_nsec && code.offset_pages - (off_t)code.start_page == r->offset_pages - (off_t)r->start_page)
+		{
+			i++;
+			continue;
+		}
+		dbt_code_changed((size_t)GET_PAGE_ADDRESS(r->start_page), (r->end_page - r->start_page + 1) * PAGE_SIZE);
+		*r = mm->retained_code[--mm->retained_code_count];
+	}
+}
+
+bool mm_is_code_retained(size_t pc, size_t end_pc)
+{
+	size_t start_page = GET_PAGE(pc), end_page = GET_PAGE(end_pc - 1);
+	for (int i = 0; i < mm->retained_code_count; i++)
+		if (mm->retained_code[i].start_page <= start_page && mm->retained_code[i].end_page >= end_page)
+			return true;
+	return false;
+}
+
+void mm_protect_code(size_t pc, size_t end_pc)
+{
+	size_t start_page = GET_PAGE(pc), end_page = GET_PAGE(end_pc - 1);
+	/* Bits are only set with the lock held, already marked pages need no locking */
+	if (test_page_bitmap(PAGE_BITMAP_CODE, start_page, end_page))
+		return;
+	AcquireSRWLockExclusive(&mm->rw_lock);
+	for (size_t page = start_page; page <= end_page; page++)
+	{
+		if (test_page_bitmap(PAGE_BITMAP_CODE, page, page))
+			continue;
+		update_page_bitmap(PAGE_BITMAP_CODE, page, page, true);
+		struct map_entry *e = find_map_entry(GET_PAGE_ADDRESS(page));
+		if (e && (e->prot & PROT_WRITE))
+			protect_code_pages(page, page, e->prot);
+	}
+	ReleaseSRWLockExclusive(&mm->rw_lock);
+}
+
 void mm_reset()
 {
 	/* Release all user memory */
 	size_t last_block = 0;
+	mm->retained_code_count = 0;
 	for (struct rb_node *cur = rb_first(&mm->entry_tree); cur;)
 	{
 		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
@@ -369,20 +944,17 @@ void mm_reset()
 			cur = rb_next(cur);
 			continue;
 		}
+		if (mm->retained_code_count < MM_RETAINED_CODE_COUNT
+			&& get_retained_code(e, &mm->retained_code[mm->retained_code_count]))
+			mm->retained_code_count++;
 
+		clear_page_permission(e->start_page, e->end_page);
+		/* Translations of retained code are checked by check_retained_code(), the rest are dropped by dbt_reset() */
+		update_page_bitmap(PAGE_BITMAP_CODE, e->start_page, e->end_page, false);
 		if (start_block == last_block)
 			start_block++;
-		for (size_t i = start_block; i <= end_block; i++)
-		{
-			HANDLE handle = get_section_handle(i);
-			if (handle)
-			{
-				/* The section handle may not be currrently mapped, let it silently fail here */
-				NtUnmapViewOfSection(NtCurrentProcess(), GET_BLOCK_ADDRESS(i));
-				NtClose(handle);
-				remove_section_handle(i);
-			}
-		}
+		if (start_block <= end_block)
+			free_block_range(start_block, end_block);
 		last_block = end_block;
 
 		if (e->f)
@@ -392,23 +964,16 @@ void mm_reset()
 		rb_remove(&mm->entry_tree, cur);
 		cur = next;
 	}
+	mm->maps_version++;
 	mm->brk = 0;
+	mm->brk_end = 0;
 }
 
 void mm_shutdown()
 {
-	for (size_t i = 0; i < BLOCK_COUNT; i++)
-	{
-		HANDLE handle = get_section_handle(i);
-		if (handle)
-		{
-			/* The section handle may not be currrently mapped, let it silently fail here */
-			NtUnmapViewOfSection(NtCurrentProcess(), GET_BLOCK_ADDRESS(i));
-			NtClose(handle);
-			remove_section_handle(i);
-		}
-	}
+	free_block_range(0, BLOCK_COUNT - 1);
 	VirtualFree(mm_section_handle, 0, MEM_RELEASE);
+	VirtualFree(mm_page_bitmap, 0, MEM_RELEASE);
 }
 
 void *mm_static_alloc(size_t size)
@@ -433,73 +998,233 @@ void mm_update_brk(void *brk)
 #else
 	mm->brk = (void*)max((size_t)mm->brk, ALIGN_TO_PAGE(brk));
 #endif
+	mm->brk_end = mm->brk;
 }
 
-/* Find 'count' consecutive free pages, return 0 if not found */
-static size_t find_free_pages(size_t count, bool block_align)
+/* Free pages finders
+ * Both walk the entries in address order like a plain linear scan, but skip every subtree
+ * which can not contain a large enough hole according to its subtree_max_gap, so a search
+ * only visits O(log n) entries unless block alignment rejects many candidate holes.
+ * Return values of the subtree helpers: 1 for found, 0 for not found yet, -1 for giving up.
+ */
+static __forceinline size_t next_free_page(struct map_entry *e, bool block_align)
 {
-	size_t last = GET_PAGE(ADDRESS_ALLOCATION_LOW);
-	for (struct rb_node *cur = rb_first(&mm->entry_tree); cur; cur = rb_next(cur))
+	size_t last = e->end_page + 1;
+	/* Make sure not collide with block aligned entries */
+	if (block_align || BLOCK_ALIGNED(e->flags))
+		last = (last + PAGES_PER_BLOCK - 1) & -PAGES_PER_BLOCK;
+	return last;
+}
+
+static int find_free_pages_subtree(struct rb_node *node, size_t count, bool block_align, size_t limit, size_t *last)
+{
+	if (!node)
+		return 0;
+	struct map_entry *e = rb_entry(node, struct map_entry, tree);
+	struct map_entry *first = e->subtree_first, *lastentry = e->subtree_last;
+	if (e->subtree_max_gap < count && !(first->start_page >= *last && first->start_page - *last >= count))
 	{
-		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
-		if (e->start_page >= last && e->start_page - last >= count)
-			return last;
-		else if (e->end_page >= last)
-		{
-			last = e->end_page + 1;
-			/* Make sure not collide with block aligned entries */
-			if (block_align || BLOCK_ALIGNED(e->flags))
-				last = (last + PAGES_PER_BLOCK - 1) & -PAGES_PER_BLOCK;
-		}
-		if (last >= GET_PAGE(ADDRESS_ALLOCATION_HIGH))
-			return 0;
+		/* No hole inside or right before this subtree is large enough
+		 * A block aligned entry may pad past the end of later entries in the subtree,
+		 * so the first usable page after it comes from the augmented data */
+		if (block_align)
+			*last = max(*last, next_free_page(lastentry, true));
+		else
+			*last = max(*last, e->subtree_next_page);
+		return *last >= limit ? -1 : 0;
 	}
-	if (GET_PAGE(ADDRESS_ALLOCATION_HIGH) > last && GET_PAGE(ADDRESS_ALLOCATION_HIGH) - last >= count)
+	int r = find_free_pages_subtree(node->left, count, block_align, limit, last);
+	if (r)
+		return r;
+	if (e->start_page >= *last && e->start_page - *last >= count)
+		return 1;
+	else if (e->end_page >= *last)
+		*last = next_free_page(e, block_align);
+	if (*last >= limit)
+		return -1;
+	return find_free_pages_subtree(node->right, count, block_align, limit, last);
+}
+
+/* Find 'count' consecutive free pages in [low, high), return 0 if not found */
+static size_t find_free_pages_in(size_t low, size_t high, size_t count, bool block_align)
+{
+	size_t last = low;
+	int r = find_free_pages_subtree(mm->entry_tree.root, count, block_align, high, &last);
+	if (r == 1)
+		return last;
+	if (r == 0 && high > last && high - last >= count)
 		return last;
 	else
 		return 0;
 }
 
-/* Find 'count' consecutive free pages at the highest possible address with, return 0 if not found */
-static size_t find_free_pages_topdown(size_t count, bool block_align)
+/* Find 'count' consecutive free pages, return 0 if not found */
+static size_t find_free_pages(size_t count, bool block_align)
 {
-	size_t last = GET_PAGE(ADDRESS_ALLOCATION_HIGH);
-	for (struct rb_node *cur = rb_last(&mm->entry_tree); cur; cur = rb_prev(cur))
+	size_t page = find_free_pages_in(GET_PAGE(ADDRESS_ALLOCATION_LOW), GET_PAGE(min(ADDRESS_ALLOCATION_HIGH, address_space_high)), count, block_align);
+#ifndef _WIN64
+	if (!page && laa_allocation_high)
+		page = find_free_pages_in(GET_PAGE(ADDRESS_ALLOCATION_LAA_LOW), GET_PAGE(laa_allocation_high), count, block_align);
+#endif
+	return page;
+}
+
+static __forceinline size_t entry_alloc_end_page(struct map_entry *e)
+{
+	/* MAP_SHARED entries always occupy entire blocks */
+	if (e->flags & INTERNAL_MAP_SHARED)
+		return (e->end_page & -PAGES_PER_BLOCK) + (PAGES_PER_BLOCK - 1);
+	return e->end_page;
+}
+
+static int find_free_pages_topdown_subtree(struct rb_node *node, size_t count, bool block_align, size_t limit, size_t *last)
+{
+	if (!node)
+		return 0;
+	struct map_entry *e = rb_entry(node, struct map_entry, tree);
+	struct map_entry *first = e->subtree_first, *lastentry = e->subtree_last;
+	size_t end_page = entry_alloc_end_page(lastentry);
+	if (e->subtree_max_gap < count && !(end_page < *last && end_page + count < *last))
 	{
-		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
-		size_t end_page = e->end_page;
-		/* MAP_SHARED entries always occupy entire blocks */
-		if (e->flags & INTERNAL_MAP_SHARED)
-			end_page = (end_page & -PAGES_PER_BLOCK) + (PAGES_PER_BLOCK - 1);
-		if (e->end_page < last && e->end_page + count < last)
-			return last - count;
-		else if (e->start_page < last)
-		{
-			last = e->start_page;
+		/* No hole inside or right after this subtree is large enough */
+		if (first->start_page < *last)
+		{
+			*last = first->start_page;
 			if (block_align)
-				last &= -PAGES_PER_BLOCK;
+				*last &= -PAGES_PER_BLOCK;
 		}
-		if (last <= GET_PAGE(ADDRESS_ALLOCATION_LOW))
-			return 0;
+		return *last <= limit ? -1 : 0;
+	}
+	int r = find_free_pages_topdown_subtree(node->right, count, block_align, limit, last);
+	if (r)
+		return r;
+	end_page = entry_alloc_end_page(e);
+	if (end_page < *last && end_page + count < *last)
+		return 1;
+	else if (e->start_page < *last)
+	{
+		*last = e->start_page;
+		if (block_align)
+			*last &= -PAGES_PER_BLOCK;
 	}
-	if (GET_PAGE(ADDRESS_ALLOCATION_LOW) < last && GET_PAGE(ADDRESS_ALLOCATION_LOW) + count < last)
+	if (*last <= limit)
+		return -1;
+	return find_free_pages_topdown_subtree(node->left, count, block_align, limit, last);
+}
+
+/* Find 'count' consecutive free pages in [low, high) at the highest possible address, return 0 if not found */
+static size_t find_free_pages_topdown_in(size_t low, size_t high, size_t count, bool block_align)
+{
+	size_t last = high;
+	int r = find_free_pages_topdown_subtree(mm->entry_tree.root, count, block_align, low, &last);
+	if (r == 1)
+		return last - count;
+	if (r == 0 && low < last && low + count < last)
 		return last - count;
 	else
 		return 0;
 }
 
-size_t mm_find_free_pages(size_t count_bytes)
+/* Find 'count' consecutive free pages at the highest possible address, return 0 if not found */
+static size_t find_free_pages_topdown(size_t count, bool block_align)
 {
-	return find_free_pages(GET_PAGE(ALIGN_TO_PAGE(count_bytes)), false);
+#ifndef _WIN64
+	if (laa_allocation_high)
+	{
+		size_t page = find_free_pages_topdown_in(GET_PAGE(ADDRESS_ALLOCATION_LAA_LOW), GET_PAGE(laa_allocation_high), count, block_align);
+		if (page)
+			return page;
+	}
+#endif
+	return find_free_pages_topdown_in(GET_PAGE(ADDRESS_ALLOCATION_LOW), GET_PAGE(min(ADDRESS_ALLOCATION_HIGH, address_space_high)), count, block_align);
 }
 
-static DWORD prot_linux2win(int prot)
+/* Get the number of pages in a large page, or 0 if large pages are disabled or unavailable
+ * Allocating large pages requires SeLockMemoryPrivilege, which is enabled at first use.
+ */
+static size_t get_large_page_pages()
 {
-	if ((prot & PROT_EXEC) && (prot & PROT_WRITE))
-		return PAGE_EXECUTE_READWRITE;
-	else if ((prot & PROT_EXEC) && (prot & PROT_READ))
-		return PAGE_EXECUTE_READ;
-	else if ((prot & PROT_EXEC))
+	if (!cmdline_flags->mm_large_pages)
+		return 0;
+	if (!mm->large_pages_checked)
+	{
+		mm->large_pages_checked = true;
+		HANDLE token;
+		NTSTATUS status = NtOpenProcessToken(NtCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token);
+		if (!NT_SUCCESS(status))
+		{
+			log_warning("NtOpenProcessToken() failed, status: %x", status);
+			return 0;
+		}
+		TOKEN_PRIVILEGES privileges;
+		privileges.PrivilegeCount = 1;
+		privileges.Privileges[0].Luid.LowPart = SE_LOCK_MEMORY_PRIVILEGE;
+		privileges.Privileges[0].Luid.HighPart = 0;
+		privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+		status = NtAdjustPrivilegesToken(token, FALSE, &privileges, sizeof(privileges), NULL, NULL);
+		NtClose(token);
+		if (status != STATUS_SUCCESS)
+		{
+			log_warning("Enabling SeLockMemoryPrivilege failed, status: %x. Large pages disabled.", status);
+			return 0;
+		}
+		size_t large_page_size = GetLargePageMinimum();
+		/* Large pages must be whole blocks to be allocated on their own */
+		if (large_page_size && IS_ALIGNED(large_page_size, BLOCK_SIZE))
+			mm->large_page_pages = large_page_size / PAGE_SIZE;
+		log_info("Large page size: %p", large_page_size);
+	}
+	return mm->large_page_pages;
+}
+
+/* Find free pages starting at a large page boundary */
+static size_t find_free_large_pages(size_t count)
+{
+	size_t large_pages = mm->large_page_pages;
+	size_t page = find_free_pages(count + large_pages - PAGES_PER_BLOCK, true);
+	if (!page)
+		return 0;
+	return ALIGN_TO(page, large_pages);
+}
+
+/* Allocate read-write pages [start_page, end_page] in pieces of one large page each, backed by
+ * large pages if the system has enough contiguous physical memory. The start page must be large
+ * page aligned, the last piece may be shorter and is always allocated with regular pages.
+ */
+static bool allocate_large_pages(size_t start_page, size_t end_page)
+{
+	size_t large_pages = mm->large_page_pages;
+	for (size_t page = start_page; page <= end_page; page += large_pages)
+	{
+		size_t count = min(large_pages, end_page - page + 1);
+		if (count == large_pages && VirtualAlloc(GET_PAGE_ADDRESS(page), count * PAGE_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE))
+		{
+			mm->stats.large_pages++;
+			continue;
+		}
+		if (!VirtualAlloc(GET_PAGE_ADDRESS(page), count * PAGE_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE))
+		{
+			log_error("VirtualAlloc(%p, %p) failed, error code: %d", GET_PAGE_ADDRESS(page), count * PAGE_SIZE, GetLastError());
+			if (page > start_page)
+				free_virtualalloc_range(start_page, page - 1);
+			return false;
+		}
+	}
+	return true;
+}
+
+size_t mm_find_free_pages(size_t count_bytes)
+{
+	return find_free_pages(GET_PAGE(ALIGN_TO_PAGE(count_bytes)), false);
+}
+
+static DWORD prot_linux2win(int prot)
+{
+	if ((prot & PROT_EXEC) && (prot & PROT_WRITE))
+		return PAGE_EXECUTE_READWRITE;
+	else if ((prot & PROT_EXEC) && (prot & PROT_READ))
+		return PAGE_EXECUTE_READ;
+	else if ((prot & PROT_EXEC))
 		return PAGE_EXECUTE; /* Unsupported for file mapping */
 	else if (prot & PROT_WRITE)
 		return PAGE_READWRITE;
@@ -562,44 +1287,170 @@ void mm_dump_memory_mappings()
 	ReleaseSRWLockShared(&mm->rw_lock);
 }
 
+static int print_map_entry(char *buf, struct map_entry *e)
+{
+	char perm[5] = "----";
+	if (e->prot & PROT_READ)
+		perm[0] = 'r';
+	if (e->prot & PROT_WRITE)
+		perm[1] = 'w';
+	if (e->prot & PROT_EXEC)
+		perm[2] = 'x';
+	if (!(e->flags & INTERNAL_MAP_SHARED))
+		perm[3] = 'p'; /* Private mapping */
+	char path[PATH_MAX];
+	if (e->f)
+	{
+		int len = e->f->op_vtable->getpath(e->f, path);
+		path[len] = 0;
+	}
+	else
+		path[0] = 0;
+	return ksprintf(buf, "%p-%p %s %p %02x:%02x %5d %s\n",
+		GET_PAGE_ADDRESS(e->start_page), GET_PAGE_ADDRESS(e->end_page + 1),
+		perm,
+		0,
+		0, 0,
+		0,
+		path);
+}
+
+uint32_t mm_get_maps_version()
+{
+	return mm->maps_version;
+}
+
 int mm_get_maps(char *buf)
 {
 	int r = 0;
 	AcquireSRWLockShared(&mm->rw_lock);
-	char path[PATH_MAX];
 	for (struct rb_node *cur = rb_first(&mm->entry_tree); cur; cur = rb_next(cur))
+		r += print_map_entry(buf + r, rb_entry(cur, struct map_entry, tree));
+	ReleaseSRWLockShared(&mm->rw_lock);
+	return r;
+}
+
+/* Memory usage of a range of pages */
+struct mm_usage
+{
+	size_t committed_pages; /* Pages committed by Windows */
+	size_t resident_pages; /* Pages in the working set */
+	size_t shared_pages; /* Resident pages also mapped by other processes */
+	size_t pss; /* Proportional set size in bytes, shared pages divided by their share count */
+};
+
+/* Number of pages passed to QueryWorkingSetEx() at once */
+#define MM_USAGE_QUERY_PAGES 256
+
+/* Add up the memory usage of pages [start_page, end_page], only committed regions are queried */
+static void get_range_usage(size_t start_page, size_t end_page, struct mm_usage *usage)
+{
+	PSAPI_WORKING_SET_EX_INFORMATION info[MM_USAGE_QUERY_PAGES];
+	size_t page = start_page;
+	while (page <= end_page)
 	{
-		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
-		char perm[5] = "----";
-		if (e->prot & PROT_READ)
-			perm[0] = 'r';
-		if (e->prot & PROT_WRITE)
-			perm[1] = 'w';
-		if (e->prot & PROT_EXEC)
-			perm[2] = 'x';
-		if (!(e->flags & INTERNAL_MAP_SHARED))
-			perm[3] = 'p'; /* Private mapping */
-		if (e->f)
+		MEMORY_BASIC_INFORMATION mbi;
+		if (!VirtualQuery(GET_PAGE_ADDRESS(page), &mbi, sizeof(mbi)))
+			break;
+		size_t region_end = min(end_page, GET_PAGE((size_t)mbi.BaseAddress + mbi.RegionSize) - 1);
+		if (mbi.State == MEM_COMMIT)
 		{
-			int len = e->f->op_vtable->getpath(e->f, path);
-			path[len] = 0;
+			usage->committed_pages += region_end - page + 1;
+			for (size_t batch = page; batch <= region_end; batch += MM_USAGE_QUERY_PAGES)
+			{
+				size_t count = min(MM_USAGE_QUERY_PAGES, region_end - batch + 1);
+				for (size_t i = 0; i < count; i++)
+					info[i].VirtualAddress = GET_PAGE_ADDRESS(batch + i);
+				if (!QueryWorkingSetEx(GetCurrentProcess(), info, (DWORD)(count * sizeof(info[0]))))
+					continue;
+				for (size_t i = 0; i < count; i++)
+				{
+					if (!info[i].VirtualAttributes.Valid)
+						continue;
+					usage->resident_pages++;
+					size_t share_count = info[i].VirtualAttributes.ShareCount;
+					if (info[i].VirtualAttributes.Shared && share_count > 1)
+					{
+						usage->shared_pages++;
+						usage->pss += PAGE_SIZE / share_count;
+					}
+					else
+						usage->pss += PAGE_SIZE;
+				}
+			}
 		}
-		else
-			path[0] = 0;
-		r += ksprintf(buf + r, "%p-%p %s %p %02x:%02x %5d %s\n",
-			GET_PAGE_ADDRESS(e->start_page), GET_PAGE_ADDRESS(e->end_page + 1),
-			perm,
-			0,
-			0, 0,
-			0,
-			path);
+		page = region_end + 1;
+	}
+}
+
+/* Leave room for one more smaps entry in the 64kB procfs text buffer */
+#define MM_SMAPS_BUFFER_LIMIT (65536 - PATH_MAX - 512)
+
+int mm_get_smaps(char *buf)
+{
+	int r = 0;
+	AcquireSRWLockShared(&mm->rw_lock);
+	for (struct rb_node *cur = rb_first(&mm->entry_tree); cur && r < MM_SMAPS_BUFFER_LIMIT; cur = rb_next(cur))
+	{
+		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		struct mm_usage usage = { 0 };
+		get_range_usage(e->start_page, e->end_page, &usage);
+		r += print_map_entry(buf + r, e);
+		r += ksprintf(buf + r,
+			"Size:           %8lu kB\n"
+			"Rss:            %8lu kB\n"
+			"Pss:            %8lu kB\n"
+			"Shared:         %8lu kB\n"
+			"Private:        %8lu kB\n"
+			"Committed:      %8lu kB\n",
+			(e->end_page - e->start_page + 1) * (PAGE_SIZE / 1024),
+			usage.resident_pages * (PAGE_SIZE / 1024),
+			usage.pss / 1024,
+			usage.shared_pages * (PAGE_SIZE / 1024),
+			(usage.resident_pages - usage.shared_pages) * (PAGE_SIZE / 1024),
+			usage.committed_pages * (PAGE_SIZE / 1024));
 	}
 	ReleaseSRWLockShared(&mm->rw_lock);
 	return r;
 }
 
+void mm_get_usage(size_t *vm_size, size_t *vm_rss)
+{
+	size_t pages = 0;
+	struct mm_usage usage = { 0 };
+	AcquireSRWLockShared(&mm->rw_lock);
+	for (struct rb_node *cur = rb_first(&mm->entry_tree); cur; cur = rb_next(cur))
+	{
+		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		pages += e->end_page - e->start_page + 1;
+		get_range_usage(e->start_page, e->end_page, &usage);
+	}
+	ReleaseSRWLockShared(&mm->rw_lock);
+	*vm_size = pages * PAGE_SIZE;
+	*vm_rss = usage.resident_pages * PAGE_SIZE;
+}
+
+/* Zero pages [start_page, end_page] except those still zero filled since their section was created */
+static void zero_pages(size_t start_page, size_t end_page)
+{
+	for (size_t page = start_page; page <= end_page;)
+	{
+		if (test_page_bitmap(PAGE_BITMAP_ZERO, page, page))
+		{
+			page++;
+			continue;
+		}
+		size_t last_page = page;
+		while (last_page < end_page && !test_page_bitmap(PAGE_BITMAP_ZERO, last_page + 1, last_page + 1))
+			last_page++;
+		RtlZeroMemory(GET_PAGE_ADDRESS(page), (last_page - page + 1) * PAGE_SIZE);
+		page = last_page + 1;
+	}
+}
+
 static void map_entry_range(struct map_entry *e, size_t start_page, size_t end_page)
 {
+	drop_code_pages(start_page, end_page);
 	if (e->f)
 	{
 		size_t desired_size = (end_page - start_page + 1) * PAGE_SIZE;
@@ -610,11 +1461,18 @@ static void map_entry_range(struct map_entry *e, size_t start_page, size_t end_p
 			size_t remain = desired_size - r;
 			RtlZeroMemory((char*)GET_PAGE_ADDRESS(end_page + 1) - remain, remain);
 		}
+		update_page_bitmap(PAGE_BITMAP_ZERO, start_page, end_page, false);
 	}
 	else
-		RtlZeroMemory(GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE);
+		zero_pages(start_page, end_page);
+	/* The caller gives the pages the protection of the entry */
+	set_page_permission(start_page, end_page, e->prot);
 }
 
+/* Change the protection of pages [start_page, end_page]
+ * Blocks of a section chunk share one view, so each chunk takes one call. A detached chunk has
+ * no view and the call fails, its protection is loaded from the map entries when it is mapped.
+ */
 static int mm_change_protection(HANDLE process, size_t start_page, size_t end_page, int prot)
 {
 	DWORD protection = prot_linux2win(prot);
@@ -623,16 +1481,34 @@ static int mm_change_protection(HANDLE process, size_t start_page, size_t end_pa
 	for (size_t i = start_block; i <= end_block; i++)
 	{
 		HANDLE handle = get_section_handle(i);
+		size_t last_block = i;
+		while (handle && last_block < end_block && get_section_handle(last_block + 1) == handle)
+			last_block++;
 		if (handle)
 		{
 			size_t range_start = max(GET_FIRST_PAGE_OF_BLOCK(i), start_page);
-			size_t range_end = min(GET_LAST_PAGE_OF_BLOCK(i), end_page);
+			size_t range_end = min(GET_LAST_PAGE_OF_BLOCK(last_block), end_page);
 			DWORD old_protection;
 			PVOID addr = GET_PAGE_ADDRESS(range_start);
 			SIZE_T size = PAGE_SIZE * (range_end - range_start + 1);
+			DWORD block_protection = protection;
+			if (prot & PROT_WRITE)
+			{
+				/* Writes to a copy-on-write file view must fault to be recorded, see handle_cow_page_fault() */
+				MEMORY_BASIC_INFORMATION info;
+				if (VirtualQueryEx(process, addr, &info, sizeof(info)) && info.AllocationProtect == PAGE_EXECUTE_WRITECOPY)
+					block_protection = prot_linux2win(prot & ~PROT_WRITE);
+			}
 			NTSTATUS status;
-			status = NtProtectVirtualMemory(process, &addr, &size, protection, &old_protection);
-			if (status == STATUS_CONFLICTING_ADDRESSES) /* The block is not yet mapped */
+			status = NtProtectVirtualMemory(process, &addr, &size, block_protection, &old_protection);
+			if (process == NtCurrentProcess())
+			{
+				if (NT_SUCCESS(status))
+					set_page_permission(range_start, range_end, block_protection == protection? prot: prot & ~PROT_WRITE);
+				else
+					clear_page_permission(range_start, range_end);
+			}
+			if (status == STATUS_CONFLICTING_ADDRESSES) /* The chunk is not yet mapped */
 				log_info("NtProtectVirtualMemory(0x%p, 0x%p) failed: block %p not yet mapped, silently ignore.", addr, size, i);
 			else if (!NT_SUCCESS(status))
 			{
@@ -640,11 +1516,69 @@ static int mm_change_protection(HANDLE process, size_t start_page, size_t end_pa
 				mm_dump_windows_memory_mappings(process);
 				return 0;
 			}
+			mm->stats.protect_calls++;
 		}
+		else if (process == NtCurrentProcess())
+			clear_page_permission(max(GET_FIRST_PAGE_OF_BLOCK(i), start_page), min(GET_LAST_PAGE_OF_BLOCK(i), end_page));
+		i = last_block;
 	}
 	return 1;
 }
 
+static int get_fault_around_blocks()
+{
+	int blocks = cmdline_flags->mm_fault_around;
+	if (blocks == 0)
+		return MM_FAULT_AROUND_BLOCKS;
+	return blocks;
+}
+
+int mm_get_stats(char *buf)
+{
+	AcquireSRWLockShared(&mm->rw_lock);
+	int r = ksprintf(buf,
+		"map_entries:         %d (%d free)\n"
+		"on_demand_faults:    %d\n"
+		"detached_faults:     %d\n"
+		"cow_faults:          %d\n"
+		"cow_pages:           %d\n"
+		"cow_blocks:          %d\n"
+		"fork_rebuilds:       %d\n"
+		"fault_around:        %d blocks\n"
+		"fault_around_blocks: %d\n"
+		"file_view_blocks:    %d\n"
+		"remap_moved_blocks:  %d\n"
+		"remap_copied_blocks: %d\n"
+		"large_pages:         %d\n"
+		"large_page_splits:   %d\n"
+		"protect_calls:       %d\n"
+		"protect_skipped:     %d pages\n"
+		"resolved_faults:     %d\n"
+		"code_write_faults:   %d\n"
+		"unresolved_faults:   %d\n",
+		mm->entry_count - mm->entry_free_count, mm->entry_free_count,
+		mm->stats.on_demand_faults,
+		mm->stats.detached_faults,
+		mm->stats.cow_faults,
+		mm->stats.cow_pages,
+		mm->stats.cow_blocks,
+		mm->stats.fork_rebuilds,
+		get_fault_around_blocks(),
+		mm->stats.fault_around_blocks,
+		mm->stats.file_view_blocks,
+		mm->stats.remap_moved_blocks,
+		mm->stats.remap_copied_blocks,
+		mm->stats.large_pages,
+		mm->stats.large_page_splits,
+		mm->stats.protect_calls,
+		mm->stats.protect_skipped_pages,
+		mm->stats.resolved_faults,
+		mm->stats.code_write_faults,
+		mm->stats.unresolved_faults);
+	ReleaseSRWLockShared(&mm->rw_lock);
+	return r;
+}
+
 void mm_dump_stack_trace(PCONTEXT context)
 {
 	log_info("Stack trace:");
@@ -665,7 +1599,8 @@ void mm_dump_stack_trace(PCONTEXT context)
 	}
 }
 
-static int allocate_block(size_t i)
+/* Create an inheritable section object spanning count blocks */
+static HANDLE create_section(size_t count)
 {
 	OBJECT_ATTRIBUTES attr;
 	attr.Length = sizeof(OBJECT_ATTRIBUTES);
@@ -675,22 +1610,33 @@ static int allocate_block(size_t i)
 	attr.SecurityDescriptor = NULL;
 	attr.SecurityQualityOfService = NULL;
 	LARGE_INTEGER max_size;
-	max_size.QuadPart = BLOCK_SIZE;
+	max_size.QuadPart = count * BLOCK_SIZE;
 	NTSTATUS status;
 	HANDLE handle;
 
-	/* Allocate section */
-	status = NtCreateSection(&handle, SECTION_MAP_READ | SECTION_MAP_WRITE | SECTION_MAP_EXECUTE, &attr, &max_size, PAGE_EXECUTE_READWRITE, SEC_COMMIT, NULL);
+	status = NtCreateSection(&handle, SECTION_MAP_READ | SECTION_MAP_WRITE | SECTION_MAP_EXECUTE | SECTION_QUERY, &attr, &max_size, PAGE_EXECUTE_READWRITE, SEC_COMMIT, NULL);
 	if (!NT_SUCCESS(status))
 	{
 		log_error("NtCreateSection() failed. Status: %x", status);
-		return 0;
+		return NULL;
 	}
+	return handle;
+}
+
+/* Allocate and map a section spanning count blocks starting at the given block */
+static int allocate_section(size_t block, size_t count)
+{
+	NTSTATUS status;
+	HANDLE handle;
+
+	/* Allocate section */
+	if (!(handle = create_section(count)))
+		return 0;
 
 	/* Map section */
-	PVOID base_addr = GET_BLOCK_ADDRESS(i);
-	SIZE_T view_size = BLOCK_SIZE;
-	status = NtMapViewOfSection(handle, NtCurrentProcess(), &base_addr, 0, BLOCK_SIZE, NULL, &view_size, ViewUnmap, 0, PAGE_EXECUTE_READWRITE);
+	PVOID base_addr = GET_BLOCK_ADDRESS(block);
+	SIZE_T view_size = count * BLOCK_SIZE;
+	status = NtMapViewOfSection(handle, NtCurrentProcess(), &base_addr, 0, view_size, NULL, &view_size, ViewUnmap, 0, PAGE_EXECUTE_READWRITE);
 	if (!NT_SUCCESS(status))
 	{
 		log_error("NtMapViewOfSection() failed. Address: %p, Status: %x", base_addr, status);
@@ -698,67 +1644,224 @@ static int allocate_block(size_t i)
 		mm_dump_windows_memory_mappings(NtCurrentProcess());
 		return 0;
 	}
-	add_section_handle(i, handle);
+	for (size_t i = 0; i < count; i++)
+		add_section_handle(block + i, handle);
+	/* Pages of a new section are demand zero */
+	update_page_bitmap(PAGE_BITMAP_ZERO, GET_FIRST_PAGE_OF_BLOCK(block), GET_LAST_PAGE_OF_BLOCK(block + count - 1), true);
 	return 1;
 }
 
-/* Duplicate the section at given block. */
-static int duplicate_section(size_t block)
+static __forceinline int allocate_block(size_t i)
 {
-	OBJECT_ATTRIBUTES attr;
-	attr.Length = sizeof(OBJECT_ATTRIBUTES);
-	attr.RootDirectory = NULL;
-	attr.ObjectName = NULL;
-	attr.Attributes = OBJ_INHERIT;
-	attr.SecurityDescriptor = NULL;
-	attr.SecurityQualityOfService = NULL;
-	LARGE_INTEGER max_size;
-	max_size.QuadPart = BLOCK_SIZE;
-	SIZE_T view_size = BLOCK_SIZE;
-	NTSTATUS status;
+	return allocate_section(i, 1);
+}
 
-	void *base_addr = GET_BLOCK_ADDRESS(block);
-	void *remapped_addr = NULL;
+/* Check if the section object is backed by a file */
+static bool is_file_section(HANDLE handle)
+{
+	SECTION_BASIC_INFORMATION info;
+	NTSTATUS status = NtQuerySection(handle, SectionBasicInformation, &info, sizeof(info), NULL);
+	return NT_SUCCESS(status) && (info.AllocationAttributes & SEC_FILE);
+}
 
-	/* Remap the old section out of this block address as read-write.
-	 * This not only frees the occupied address space, but also fixes the problem
-	 * that the region is mapped as not writable and write protection can not be
-	 * promoted afterwards. See mm_fork() for details.
-	 */
-	status = NtUnmapViewOfSection(NtCurrentProcess(), base_addr);
-	/* The section may not be mapped yet */
-	if (status == STATUS_NOT_MAPPED_VIEW)
-		log_info("NtUnmapViewOfSection() failed: view not yet mapped, silently ignore.");
-	else if (!NT_SUCCESS(status))
+/* Get the file offset of the view of the section chunk starting at first_block
+ * Returns NULL if the section is anonymous, which is always viewed from its beginning.
+ */
+static PLARGE_INTEGER get_section_chunk_offset(size_t first_block, PLARGE_INTEGER offset)
+{
+	if (!is_file_section(get_section_handle(first_block)))
+		return NULL;
+	/* A file section chunk lies inside a single file map entry */
+	size_t first_page = GET_FIRST_PAGE_OF_BLOCK(first_block);
+	for (struct rb_node *cur = start_node(first_page); cur; cur = rb_next(cur))
 	{
-		log_error("NtUnmapViewOfSection() failed, status: %x", status);
-		return 0;
+		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		if (e->start_page > GET_LAST_PAGE_OF_BLOCK(first_block))
+			break;
+		if (e->end_page < first_page || !e->f)
+			continue;
+		offset->QuadPart = (loff_t)(e->offset_pages + first_page - e->start_page) * PAGE_SIZE;
+		return offset;
 	}
+	log_error("No file map entry found for file section at block 0x%p.", first_block);
+	return NULL;
+}
 
-	HANDLE source = get_section_handle(block);
-	status = NtMapViewOfSection(source, NtCurrentProcess(), &remapped_addr, 0, BLOCK_SIZE,
-		NULL, &view_size, ViewUnmap, 0, PAGE_READWRITE);
-	if (!NT_SUCCESS(status))
+/* Map a view of count blocks of the section at the given block
+ * Read-only file sections only allow copy-on-write views, they are used as a fallback.
+ */
+static NTSTATUS map_section_view(HANDLE section, size_t block, size_t count, PLARGE_INTEGER offset)
+{
+	PVOID addr = GET_BLOCK_ADDRESS(block);
+	SIZE_T size = count * BLOCK_SIZE;
+	NTSTATUS status = NtMapViewOfSection(section, NtCurrentProcess(), &addr, 0, size,
+		offset, &size, ViewUnmap, 0, PAGE_EXECUTE_READWRITE);
+	/* Read-only files and sections opened without write access */
+	if (status == STATUS_SECTION_PROTECTION || status == STATUS_ACCESS_DENIED)
 	{
-		log_error("NtMapViewOfSection() failed, status: %x", status);
-		return 0;
+		addr = GET_BLOCK_ADDRESS(block);
+		size = count * BLOCK_SIZE;
+		status = NtMapViewOfSection(section, NtCurrentProcess(), &addr, 0, size,
+			offset, &size, ViewUnmap, 0, PAGE_EXECUTE_WRITECOPY);
 	}
+	return status;
+}
 
-	/* Allocate new section */
-	allocate_block(block);
+/* Map the view of the section chunk containing the given block at its address */
+static NTSTATUS map_section_chunk(size_t block, size_t *first_block, size_t *last_block)
+{
+	get_section_chunk(block, first_block, last_block);
+	LARGE_INTEGER offset;
+	return map_section_view(get_section_handle(block), *first_block, *last_block - *first_block + 1,
+		get_section_chunk_offset(*first_block, &offset));
+}
 
-	/* Copy memory */
-	CopyMemory(base_addr, remapped_addr, BLOCK_SIZE);
+/* Load protection flags of blocks [first_block, last_block], the blocks must be in
+ * one view mapped as PAGE_EXECUTE_READWRITE and has its content loaded.
+ * prot_mask is AND-ed to the entry's prot flag
+ * initial_prot is the current prot of the blocks, or INITIAL_PROT_UNKNOWN if multiple
+ * prot flags are mixed or the current prot flag is unknown.
+ */
+#define INITIAL_PROT_UNKNOWN	-1
+static bool load_block_protection(size_t first_block, size_t last_block, int prot_mask, int initial_prot)
+{
+	size_t start_page = GET_FIRST_PAGE_OF_BLOCK(first_block);
+	size_t end_page = GET_LAST_PAGE_OF_BLOCK(last_block);
+	for (struct rb_node *cur = start_node(start_page); cur; cur = rb_next(cur))
+	{
+		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		if (end_page < e->start_page)
+			break;
+		else
+		{
+			size_t range_start = max(start_page, e->start_page);
+			size_t range_end = min(end_page, e->end_page);
+			if (range_start > range_end)
+				continue;
+			DWORD oldProtect;
+			int prot = (e->prot & prot_mask);
+			if (initial_prot == INITIAL_PROT_UNKNOWN || prot != initial_prot)
+			{
+				if (!VirtualProtect(GET_PAGE_ADDRESS(range_start), PAGE_SIZE * (range_end - range_start + 1), prot_linux2win(prot), &oldProtect))
+				{
+					log_error("VirtualProtect(0x%p, 0x%p) failed, error code: %d.", GET_PAGE_ADDRESS(range_start),
+						PAGE_SIZE * (range_end - range_start + 1), GetLastError());
+					return false;
+				}
+			}
+			set_page_permission(range_start, range_end, prot);
+		}
+	}
+	return true;
+}
 
-	/* Delete source section */
-	status = NtUnmapViewOfSection(NtCurrentProcess(), remapped_addr);
-	if (!NT_SUCCESS(status))
+/* Move the content of section chunk [first_block, last_block] into new private sections,
+ * one for the whole chunk, or one for each block if split is true.
+ * The content is taken from the current view if it is mapped, as it may contain private
+ * copy-on-write pages which are not in the section. The new sections are mapped in place
+ * with the protection of the map entries, pages not covered by any entry are inaccessible.
+ */
+static int rebuild_section_chunk(size_t first_block, size_t last_block, bool split)
+{
+	size_t count = last_block - first_block + 1;
+	size_t section_blocks = split? 1: count;
+	size_t section_count = count / section_blocks;
+	HANDLE source = get_section_handle(first_block);
+	void *base_addr = GET_BLOCK_ADDRESS(first_block);
+	HANDLE handles[SECTION_CHUNK_BLOCKS];
+	PVOID views[SECTION_CHUNK_BLOCKS];
+	size_t created = 0;
+	NTSTATUS status;
+
+	/* The view is made read only then replaced, permissions are loaded again afterwards */
+	clear_page_permission(GET_FIRST_PAGE_OF_BLOCK(first_block), GET_LAST_PAGE_OF_BLOCK(last_block));
+
+	/* Create new sections at temporary addresses */
+	for (; created < section_count; created++)
 	{
-		log_error("NtUnmapViewOfSection() failed, status: %x", status);
-		return 0;
+		if (!(handles[created] = create_section(section_blocks)))
+			goto fail;
+		views[created] = NULL;
+		SIZE_T view_size = section_blocks * BLOCK_SIZE;
+		status = NtMapViewOfSection(handles[created], NtCurrentProcess(), &views[created], 0, view_size,
+			NULL, &view_size, ViewUnmap, 0, PAGE_READWRITE);
+		if (!NT_SUCCESS(status))
+		{
+			log_error("NtMapViewOfSection() failed, status: %x", status);
+			NtClose(handles[created]);
+			goto fail;
+		}
+	}
+
+	/* Copy content */
+	MEMORY_BASIC_INFORMATION info;
+	PVOID remapped_addr = NULL;
+	char *content;
+	if (VirtualQuery(base_addr, &info, sizeof(info)) && info.State != MEM_FREE)
+	{
+		DWORD oldProtect;
+		VirtualProtect(base_addr, count * BLOCK_SIZE, PAGE_READONLY, &oldProtect);
+		content = (char *)base_addr;
+	}
+	else
+	{
+		/* The section is detached, there are no private pages */
+		SIZE_T view_size = count * BLOCK_SIZE;
+		LARGE_INTEGER offset;
+		status = NtMapViewOfSection(source, NtCurrentProcess(), &remapped_addr, 0, view_size,
+			get_section_chunk_offset(first_block, &offset), &view_size, ViewUnmap, 0, PAGE_READONLY);
+		if (!NT_SUCCESS(status))
+		{
+			log_error("NtMapViewOfSection() failed, status: %x", status);
+			goto fail;
+		}
+		content = (char *)remapped_addr;
 	}
+	for (size_t i = 0; i < section_count; i++)
+		CopyMemory(views[i], content + i * section_blocks * BLOCK_SIZE, section_blocks * BLOCK_SIZE);
+	NtUnmapViewOfSection(NtCurrentProcess(), content);
 	NtClose(source);
+
+	/* Move new sections in place */
+	for (size_t i = first_block; i <= last_block; i++)
+		remove_section_handle(i);
+	for (size_t i = 0; i < section_count; i++)
+	{
+		size_t block = first_block + i * section_blocks;
+		for (size_t j = 0; j < section_blocks; j++)
+			add_section_handle(block + j, handles[i]);
+		NtUnmapViewOfSection(NtCurrentProcess(), views[i]);
+		/* If mapping fails the section is left detached, it will be loaded on next access */
+		PVOID addr = GET_BLOCK_ADDRESS(block);
+		SIZE_T view_size = section_blocks * BLOCK_SIZE;
+		status = NtMapViewOfSection(handles[i], NtCurrentProcess(), &addr, 0, view_size,
+			NULL, &view_size, ViewUnmap, 0, PAGE_EXECUTE_READWRITE);
+		if (!NT_SUCCESS(status))
+		{
+			log_error("NtMapViewOfSection() failed. Address: %p, Status: %x", addr, status);
+			continue;
+		}
+		DWORD oldProtect;
+		VirtualProtect(addr, view_size, PAGE_NOACCESS, &oldProtect);
+		load_block_protection(block, block + section_blocks - 1, PROT_READ | PROT_WRITE | PROT_EXEC, INITIAL_PROT_UNKNOWN);
+	}
 	return 1;
+
+fail:
+	for (size_t i = 0; i < created; i++)
+	{
+		NtUnmapViewOfSection(NtCurrentProcess(), views[i]);
+		NtClose(handles[i]);
+	}
+	return 0;
+}
+
+/* Duplicate the section at given block, the whole section chunk is duplicated. */
+static int duplicate_section(size_t block)
+{
+	size_t first_block, last_block;
+	get_section_chunk(block, &first_block, &last_block);
+	return rebuild_section_chunk(first_block, last_block, false);
 }
 
 static int take_block_ownership(size_t block)
@@ -778,7 +1881,8 @@ static int take_block_ownership(size_t block)
 		log_error("NtQueryObject() on block %p failed, status: 0x%x.", block, status);
 		return 0;
 	}
-	if (info.HandleCount == 1)
+	/* A file section is also held by the file, private content must go to an anonymous section */
+	if (info.HandleCount == 1 && !is_file_section(handle))
 	{
 		log_info("We're the only owner.");
 		return 1;
@@ -786,6 +1890,7 @@ static int take_block_ownership(size_t block)
 
 	/* We are not the only one holding the section, duplicate it */
 	log_info("Duplicating section %p...", block);
+	mm->stats.cow_blocks++;
 	if (!duplicate_section(block))
 	{
 		log_error("Duplicating section failed.");
@@ -795,56 +1900,56 @@ static int take_block_ownership(size_t block)
 	return 1;
 }
 
-/* Load block protection flags, the block must be mapped as PAGE_EXECUTE_READWRITE
- * and has its content loaded.
- * prot_mask is AND-ed to the entry's prot flag
- * initial_prot is the current prot of the block, or INITIAL_PROT_UNKNOWN if multiple
- * prot flags are mixed or the current prot flag is unknown.
- */
-#define INITIAL_PROT_UNKNOWN	-1
-static bool load_block_protection(size_t block, int prot_mask, int initial_prot)
+/* Split a section chunk into private sections of one block each */
+static void split_section_chunk(size_t first_block, size_t last_block)
 {
-	size_t start_page = GET_FIRST_PAGE_OF_BLOCK(block);
-	size_t end_page = GET_LAST_PAGE_OF_BLOCK(block);
-	for (struct rb_node *cur = start_node(start_page); cur; cur = rb_next(cur))
+	log_info("Splitting section chunk [%p, %p]...", first_block, last_block);
+	if (!rebuild_section_chunk(first_block, last_block, true))
+		log_error("Splitting section chunk failed.");
+}
+
+/* Unmap and release all sections in blocks [start_block, end_block] */
+static void free_block_range(size_t start_block, size_t end_block)
+{
+	clear_page_permission(GET_FIRST_PAGE_OF_BLOCK(start_block), GET_LAST_PAGE_OF_BLOCK(end_block));
+	for (size_t i = start_block; i <= end_block; i++)
 	{
-		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
-		if (end_page < e->start_page)
-			break;
-		else
+		HANDLE handle = get_section_handle(i);
+		if (!handle)
+			continue;
+		size_t first, last;
+		get_section_chunk(i, &first, &last);
+		if (first < start_block || last > end_block)
 		{
-			size_t range_start = max(start_page, e->start_page);
-			size_t range_end = min(end_page, e->end_page);
-			if (range_start > range_end)
-				continue;
-			DWORD oldProtect;
-			int prot = (e->prot & prot_mask);
-			if (initial_prot == INITIAL_PROT_UNKNOWN || prot != initial_prot)
+			/* Only part of the chunk is released */
+			split_section_chunk(first, last);
+			handle = get_section_handle(i);
+			get_section_chunk(i, &first, &last);
+			if (first < start_block || last > end_block)
 			{
-				if (!VirtualProtect(GET_PAGE_ADDRESS(range_start), PAGE_SIZE * (range_end - range_start + 1), prot_linux2win(prot), &oldProtect))
-				{
-					log_error("VirtualProtect(0x%p, 0x%p) failed, error code: %d.", GET_PAGE_ADDRESS(range_start),
-						PAGE_SIZE * (range_end - range_start + 1), GetLastError());
-					return false;
-				}
+				/* Splitting failed, keep the chunk */
+				i = last;
+				continue;
 			}
 		}
+		/* The section handle may not be currrently mapped, let it silently fail here */
+		NtUnmapViewOfSection(NtCurrentProcess(), GET_BLOCK_ADDRESS(first));
+		NtClose(handle);
+		for (size_t j = first; j <= last; j++)
+			remove_section_handle(j);
+		i = last;
 	}
-	return true;
 }
 
 /* Load the detached block if not yet loaded, returns true if a detached block is loaded */
 static bool load_detached_block(size_t block)
 {
-	HANDLE section = get_section_handle(block);
-	PVOID addr = GET_BLOCK_ADDRESS(block);
-	SIZE_T size = BLOCK_SIZE;
-	NTSTATUS status = NtMapViewOfSection(section, NtCurrentProcess(), &addr, 0, BLOCK_SIZE,
-		NULL, &size, ViewUnmap, 0, PAGE_EXECUTE_READWRITE);
+	size_t first_block, last_block;
+	NTSTATUS status = map_section_chunk(block, &first_block, &last_block);
 	if (NT_SUCCESS(status))
 	{
 		/* Load content of the block and disable write permission */
-		if (load_block_protection(block, PROT_READ | PROT_EXEC, PROT_READ | PROT_WRITE | PROT_EXEC))
+		if (load_block_protection(first_block, last_block, PROT_READ | PROT_EXEC, PROT_READ | PROT_WRITE | PROT_EXEC))
 		{
 			log_info("Detached block 0x%p successfully loaded.", block);
 			return true;
@@ -854,7 +1959,40 @@ static bool load_detached_block(size_t block)
 	return false;
 }
 
-static int handle_cow_page_fault(void *addr)
+static bool is_section_shared(size_t block)
+{
+	HANDLE handle = get_section_handle(block);
+	OBJECT_BASIC_INFORMATION info;
+	NTSTATUS status;
+	status = NtQueryObject(handle, ObjectBasicInformation, &info, sizeof(OBJECT_BASIC_INFORMATION), NULL);
+	return NT_SUCCESS(status) && (info.HandleCount > 1 || is_file_section(handle));
+}
+
+/* Give the page containing addr a private copy on its next write, leaving the rest of the
+ * shared section untouched. The entry is marked so mm_fork() moves its private pages
+ * back into sections before handing them to a child.
+ */
+static bool copy_on_write_page(struct map_entry *entry, void *addr)
+{
+	size_t block = GET_BLOCK(addr);
+	size_t first_block, last_block;
+	/* Load the section first if it is detached */
+	if (NT_SUCCESS(map_section_chunk(block, &first_block, &last_block)))
+		load_block_protection(first_block, last_block, PROT_READ | PROT_EXEC, PROT_READ | PROT_WRITE | PROT_EXEC);
+	DWORD oldProtect;
+	DWORD protection = (entry->prot & PROT_EXEC)? PAGE_EXECUTE_WRITECOPY: PAGE_WRITECOPY;
+	if (!VirtualProtect(GET_PAGE_ADDRESS(GET_PAGE(addr)), PAGE_SIZE, protection, &oldProtect))
+	{
+		log_warning("VirtualProtect(0x%p) to copy-on-write failed, error code: %d.", GET_PAGE_ADDRESS(GET_PAGE(addr)), GetLastError());
+		return false;
+	}
+	entry->flags |= INTERNAL_MAP_PRIVATE_COPY;
+	set_page_permission(GET_PAGE(addr), GET_PAGE(addr), entry->prot);
+	mm->stats.cow_pages++;
+	return true;
+}
+
+static int handle_cow_page_fault(void *addr)
 {
 	struct map_entry *entry = find_map_entry(addr);
 	if (entry == NULL)
@@ -869,36 +2007,175 @@ static int handle_cow_page_fault(void *addr)
 	}
 	size_t block = GET_BLOCK(addr);
 
+	/* Copy only the written page if the section is still shared, the section is duplicated as a fallback */
+	if (is_section_shared(block) && copy_on_write_page(entry, addr))
+	{
+		log_info("CoW page %p successfully copied.", GET_PAGE(addr));
+		return 1;
+	}
+
 	if (!take_block_ownership(block))
 		return 0;
 
 	/* Make sure it is mapped */
-	PVOID base_addr = GET_BLOCK_ADDRESS(block);
-	HANDLE section = get_section_handle(block);
-	SIZE_T size = BLOCK_SIZE;
-	NTSTATUS status;
-	status = NtMapViewOfSection(section, NtCurrentProcess(), &base_addr, 0, size,
-		NULL, &size, ViewUnmap, 0, PAGE_EXECUTE_READWRITE);
+	size_t first_block, last_block;
+	NTSTATUS status = map_section_chunk(block, &first_block, &last_block);
 	int initial_prot = INITIAL_PROT_UNKNOWN;
 	if (NT_SUCCESS(status))
 		initial_prot = PROT_READ | PROT_WRITE | PROT_EXEC;
 
 	/* We're the only owner of the section now, change page protection flags */
-	load_block_protection(block, PROT_READ | PROT_WRITE | PROT_EXEC, initial_prot);
+	load_block_protection(first_block, last_block, PROT_READ | PROT_WRITE | PROT_EXEC, initial_prot);
 
 	/* TODO: Mark unmapped pages as PAGE_NOACCESS */
 	log_info("CoW section %p successfully duplicated.", block);
 	return 1;
 }
 
+/* A write to a page holding translated code, see protect_code_pages()
+ * Returns false if the fault is left to the other paths
+ */
+static bool handle_code_page_fault(void *addr)
+{
+	size_t page = GET_PAGE(addr);
+	struct map_entry *entry = find_map_entry(addr);
+	if (entry == NULL || (entry->prot & PROT_WRITE) == 0)
+		return false;
+	update_page_bitmap(PAGE_BITMAP_CODE, page, page, false);
+	dbt_code_changed((size_t)GET_PAGE_ADDRESS(page), PAGE_SIZE);
+	mm->stats.code_write_faults++;
+	/* The page may be read only for another reason, e.g. a shared section */
+	if (!test_page_bitmap(PAGE_BITMAP_CODE_PROTECTED, page, page))
+		return false;
+	DWORD oldProtect;
+	if (!VirtualProtect(GET_PAGE_ADDRESS(page), PAGE_SIZE, prot_linux2win(entry->prot), &oldProtect))
+	{
+		log_warning("VirtualProtect(0x%p) for translated code failed, error code: %d.", GET_PAGE_ADDRESS(page), GetLastError());
+		return false;
+	}
+	set_page_permission(page, page, entry->prot);
+	return true;
+}
+
+/* Find the blocks to allocate together on a demand page fault of the given block.
+ * Free blocks fully covered by the same anonymous private entry are batched into one
+ * section chunk within the chunk window.
+ */
+static void get_on_demand_blocks(size_t block, size_t *first_block, size_t *last_block)
+{
+	*first_block = *last_block = block;
+	size_t block_start_page = GET_FIRST_PAGE_OF_BLOCK(block);
+	struct rb_node *node = start_node(block_start_page);
+	if (!node)
+		return;
+	struct map_entry *e = rb_entry(node, struct map_entry, tree);
+	if (e->start_page > block_start_page || e->end_page < GET_LAST_PAGE_OF_BLOCK(block))
+		return;
+	if (e->f || (e->flags & (INTERNAL_MAP_SHARED | INTERNAL_MAP_VIRTUALALLOC)))
+		return;
+	size_t window_first = GET_SECTION_CHUNK_WINDOW(block);
+	size_t window_last = window_first + SECTION_CHUNK_BLOCKS - 1;
+	size_t low = max(window_first, GET_BLOCK_OF_PAGE(e->start_page + PAGES_PER_BLOCK - 1));
+	size_t high = min(window_last, GET_BLOCK_OF_PAGE(e->end_page + 1) - 1);
+	while (*first_block > low && !get_section_handle(*first_block - 1))
+		(*first_block)--;
+	while (*last_block < high && !get_section_handle(*last_block + 1))
+		(*last_block)++;
+}
+
+/* Check if the file map entry can be backed by views of its file's section in place of read() copies
+ * A private view is copy-on-write, so only read-only private entries are eligible.
+ */
+static bool can_map_file_view(struct map_entry *e)
+{
+	if (!e->f || !e->f->op_vtable->create_section || (e->flags & INTERNAL_MAP_VIRTUALALLOC))
+		return false;
+	return (e->flags & INTERNAL_MAP_SHARED) || !(e->prot & PROT_WRITE);
+}
+
+/* Map a free block of a file map entry and free blocks around it as one view of the file's section.
+ * Only blocks fully inside both the entry and the file at block aligned file offsets are mapped.
+ * Returns false if the given block is not eligible, the caller falls back to reading the file.
+ */
+static bool map_file_view(size_t block, size_t *first_block, size_t *last_block)
+{
+	size_t block_start_page = GET_FIRST_PAGE_OF_BLOCK(block);
+	struct rb_node *node = start_node(block_start_page);
+	if (!node)
+		return false;
+	struct map_entry *e = rb_entry(node, struct map_entry, tree);
+	if (e->start_page > block_start_page || e->end_page < GET_LAST_PAGE_OF_BLOCK(block) || !can_map_file_view(e))
+		return false;
+	size_t file_page = e->offset_pages + block_start_page - e->start_page;
+	if (file_page % PAGES_PER_BLOCK != 0)
+		return false;
+	size_t file_block = file_page / PAGES_PER_BLOCK;
+
+	HANDLE section = NULL;
+	loff_t section_start, section_end;
+	if (e->flags & INTERNAL_MAP_SHARED)
+		section = e->f->op_vtable->create_section(e->f, true, (loff_t)file_block * BLOCK_SIZE, &section_start, &section_end);
+	if (!section && !(e->prot & PROT_WRITE))
+		section = e->f->op_vtable->create_section(e->f, false, (loff_t)file_block * BLOCK_SIZE, &section_start, &section_end);
+	if (!section)
+		return false;
+	/* The section holds file blocks [first_file_block, file_blocks)
+	 * The partial block at the end of file is left to the caller */
+	size_t first_file_block = (size_t)(max(section_start, 0) / BLOCK_SIZE);
+	size_t file_blocks = (size_t)(section_end / BLOCK_SIZE);
+	if (file_block < first_file_block || file_block >= file_blocks)
+	{
+		NtClose(section);
+		return false;
+	}
+
+	size_t window_first = GET_SECTION_CHUNK_WINDOW(block);
+	size_t window_last = window_first + SECTION_CHUNK_BLOCKS - 1;
+	size_t low = max(window_first, GET_BLOCK_OF_PAGE(e->start_page + PAGES_PER_BLOCK - 1));
+	size_t high = min(window_last, GET_BLOCK_OF_PAGE(e->end_page + 1) - 1);
+	low = max(low, block - min(block, file_block - first_file_block));
+	high = min(high, block + (file_blocks - file_block - 1));
+	*first_block = *last_block = block;
+	while (*first_block > low && !get_section_handle(*first_block - 1))
+		(*first_block)--;
+	while (*last_block < high && !get_section_handle(*last_block + 1))
+		(*last_block)++;
+
+	size_t count = *last_block - *first_block + 1;
+	LARGE_INTEGER offset;
+	offset.QuadPart = (loff_t)(file_block - (block - *first_block)) * BLOCK_SIZE - section_start;
+	NTSTATUS status = map_section_view(section, *first_block, count, &offset);
+	if (!NT_SUCCESS(status))
+	{
+		log_warning("NtMapViewOfSection() on file section failed. Address: %p, Status: %x", GET_BLOCK_ADDRESS(*first_block), status);
+		NtClose(section);
+		return false;
+	}
+	for (size_t i = *first_block; i <= *last_block; i++)
+		add_section_handle(i, section);
+	DWORD oldProtect;
+	if (VirtualProtect(GET_BLOCK_ADDRESS(*first_block), count * BLOCK_SIZE, prot_linux2win(e->prot), &oldProtect))
+		set_page_permission(GET_FIRST_PAGE_OF_BLOCK(*first_block), GET_LAST_PAGE_OF_BLOCK(*last_block), e->prot);
+	mm->stats.file_view_blocks += (int)count;
+	return true;
+}
+
 static int handle_on_demand_page_fault(size_t block)
 {
 	size_t page = GET_FIRST_PAGE_OF_BLOCK(block);
-	/* Map all map entries in the block */
-	size_t start_page = GET_FIRST_PAGE_OF_BLOCK(block);
-	size_t end_page = GET_LAST_PAGE_OF_BLOCK(block);
+	size_t first_block, last_block;
+	if (map_file_view(block, &first_block, &last_block))
+	{
+		log_info("File view blocks [0x%p, 0x%p] loaded.", first_block, last_block);
+		return 1;
+	}
+	/* Map all map entries in the blocks */
+	get_on_demand_blocks(block, &first_block, &last_block);
+	size_t start_page = GET_FIRST_PAGE_OF_BLOCK(first_block);
+	size_t end_page = GET_LAST_PAGE_OF_BLOCK(last_block);
 	int found = 0;
-	allocate_block(block);
+	if (!allocate_section(first_block, last_block - first_block + 1))
+		return 0;
 	for (struct rb_node *cur = start_node(start_page); cur; cur = rb_next(cur))
 	{
 		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
@@ -912,59 +2189,389 @@ static int handle_on_demand_page_fault(size_t block)
 				continue;
 			if (page >= range_start && page <= range_end)
 				found = 1;
-			map_entry_range(e, range_start, range_end);
+			/* A newly created section is already zero filled, avoid touching anonymous pages */
+			if (e->f)
+				map_entry_range(e, range_start, range_end);
 			if (e->prot != (PROT_READ | PROT_WRITE | PROT_EXEC))
 			{
 				DWORD oldProtect;
 				VirtualProtect(GET_PAGE_ADDRESS(range_start), (range_end - range_start + 1) * PAGE_SIZE, prot_linux2win(e->prot), &oldProtect);
 			}
+			set_page_permission(range_start, range_end, e->prot);
 		}
 	}
 	/* TODO: Mark unmapped pages as PAGE_NOACCESS */
 	if (!found)
 		log_error("Block 0x%p not mapped.", block);
+	else if (first_block != last_block)
+		log_info("On demand blocks [0x%p, 0x%p] loaded.", first_block, last_block);
 	else
 		log_info("On demand block 0x%p loaded.", block);
 	return found;
 }
 
-int mm_handle_page_fault(void *addr, bool is_write)
+/* Load detached blocks of the same map entry in the window around a faulted detached block.
+ * A forked child usually touches memory near what it just touched, this saves one page fault
+ * round trip for each such block.
+ */
+static void load_detached_blocks_around(void *addr)
+{
+	int window = get_fault_around_blocks();
+	if (window <= 1)
+		return;
+	size_t page = GET_PAGE(addr);
+	struct rb_node *node = start_node(page);
+	if (!node)
+		return;
+	struct map_entry *e = rb_entry(node, struct map_entry, tree);
+	if (e->start_page > page || e->end_page < page || (e->flags & INTERNAL_MAP_VIRTUALALLOC))
+		return;
+	size_t block = GET_BLOCK(addr);
+	size_t window_first = block - block % window;
+	size_t first_block = max(window_first, GET_BLOCK_OF_PAGE(e->start_page));
+	size_t last_block = min(window_first + window - 1, GET_BLOCK_OF_PAGE(e->end_page));
+	for (size_t i = first_block; i <= last_block; i++)
+	{
+		if (!get_section_handle(i))
+			continue;
+		size_t chunk_first, chunk_last;
+		get_section_chunk(i, &chunk_first, &chunk_last);
+		if (block < chunk_first || block > chunk_last)
+		{
+			if (load_detached_block(i))
+				mm->stats.fault_around_blocks += (int)(chunk_last - chunk_first + 1);
+		}
+		i = chunk_last;
+	}
+}
+
+/* Check whether the current protection of the page at addr allows a read or write access
+ * Windows updates page protection atomically, so this needs no lock. A fault on an accessible
+ * page has been resolved by another thread in the meantime and just needs a retry.
+ */
+static bool is_page_accessible(void *addr, int access)
+{
+	MEMORY_BASIC_INFORMATION info;
+	if (!VirtualQuery(addr, &info, sizeof(info)) || info.State != MEM_COMMIT || (info.Protect & PAGE_GUARD))
+		return false;
+	switch (info.Protect & 0xFF)
+	{
+	case PAGE_READONLY:
+	case PAGE_EXECUTE_READ: return access == PAGE_FAULT_READ;
+	case PAGE_READWRITE:
+	case PAGE_WRITECOPY:
+	case PAGE_EXECUTE_READWRITE:
+	case PAGE_EXECUTE_WRITECOPY: return true;
+	default: return false;
+	}
+}
+
+/* Report the file offset of an on demand fault to the startup profile, see prefetch.h */
+static void record_prefetch_fault(void *addr)
+{
+	size_t page = GET_PAGE(addr);
+	struct rb_node *node = start_node(page);
+	if (!node)
+		return;
+	struct map_entry *e = rb_entry(node, struct map_entry, tree);
+	if (e->start_page > page || e->end_page < page || !e->f)
+		return;
+	prefetch_record_fault(e->f, (loff_t)(e->offset_pages + page - e->start_page) * PAGE_SIZE);
+}
+
+#define MM_TRACE_PAGE_FAULT(addr, access, type) \
+	do { \
+		if (etw_enabled(ETW_KEYWORD_PAGE_FAULT)) \
+			etw_page_fault(addr, access, type); \
+	} while (0)
+
+/* Called on every CoW and on demand fault, do not log anything unless the fault is not ours */
+int mm_handle_page_fault(void *addr, int access)
 {
-	log_info("Handling page fault at address %p (page %p)", addr, GET_PAGE(addr));
-	if ((size_t)addr < ADDRESS_SPACE_LOW || (size_t)addr >= ADDRESS_SPACE_HIGH)
+	if ((size_t)addr < ADDRESS_SPACE_LOW || (size_t)addr >= address_space_high)
 	{
-		log_warning("Address %p outside of valid usermode address space.", addr);
+		InterlockedIncrement(&mm->stats.unresolved_faults);
+		MM_TRACE_PAGE_FAULT(addr, access, "unresolved");
 		return 0;
 	}
+	/* Faults racing with the thread resolving them do not wait for the lock
+	 * Not for execute faults, the caller does not know which page of the instruction faulted
+	 */
+	bool check_resolved = (access != PAGE_FAULT_EXECUTE);
+	if (check_resolved && is_page_accessible(addr, access))
+	{
+		InterlockedIncrement(&mm->stats.resolved_faults);
+		MM_TRACE_PAGE_FAULT(addr, access, "resolved");
+		return 1;
+	}
 	AcquireSRWLockExclusive(&mm->rw_lock);
+	/* Check again, the fault may be resolved while we were waiting */
+	if (check_resolved && is_page_accessible(addr, access))
+	{
+		InterlockedIncrement(&mm->stats.resolved_faults);
+		ReleaseSRWLockExclusive(&mm->rw_lock);
+		MM_TRACE_PAGE_FAULT(addr, access, "resolved");
+		return 1;
+	}
+	bool is_write = (access == PAGE_FAULT_WRITE);
+	if (is_write && test_page_bitmap(PAGE_BITMAP_CODE, GET_PAGE(addr), GET_PAGE(addr)) && handle_code_page_fault(addr))
+	{
+		ReleaseSRWLockExclusive(&mm->rw_lock);
+		MM_TRACE_PAGE_FAULT(addr, access, "code");
+		return 1;
+	}
 	int r;
+	const char *type;
 	size_t block = GET_BLOCK(addr);
 	HANDLE section = get_section_handle(block);
 	if (!section)
 	{
 		/* Page not loaded, load it now */
+		mm->stats.on_demand_faults++;
+		type = "on_demand";
+		if (prefetch_recording)
+			record_prefetch_fault(addr);
 		r = handle_on_demand_page_fault(block);
 	}
 	else
 	{
+		/* A block with a section but no view is detached, see mm_fork() */
+		MEMORY_BASIC_INFORMATION info;
+		bool detached = VirtualQuery(addr, &info, sizeof(info)) && info.State == MEM_FREE;
+		if (detached)
+			mm->stats.detached_faults++;
 		if (!is_write)
 		{
 			/* A detached block */
+			type = "detached";
 			r = load_detached_block(block);
 		}
 		else
 		{
 			/* CoW triggered, this function will automatically map the section if not yet */
+			mm->stats.cow_faults++;
+			type = "cow";
 			r = handle_cow_page_fault(addr);
 		}
+		if (r && detached)
+			load_detached_blocks_around(addr);
 	}
 	ReleaseSRWLockExclusive(&mm->rw_lock);
+	if (!r)
+	{
+		InterlockedIncrement(&mm->stats.unresolved_faults);
+		type = "unresolved";
+	}
+	MM_TRACE_PAGE_FAULT(addr, access, type);
+	return r;
+}
+
+/* Re-create the allocations of a large page map entry in the child, piece by piece */
+static bool fork_large_page_allocations(HANDLE process, struct map_entry *e)
+{
+	size_t large_page_size = mm->large_page_pages * PAGE_SIZE;
+	char *current = GET_PAGE_ADDRESS(e->start_page);
+	char *end = GET_PAGE_ADDRESS(e->end_page + 1);
+	while (current < end)
+	{
+		MEMORY_BASIC_INFORMATION info;
+		if (!VirtualQuery(current, &info, sizeof(info)))
+		{
+			log_error("VirtualQuery(%p) failed, error code: %d", current, GetLastError());
+			return false;
+		}
+		char *allocation_end = min(get_allocation_end(&info), end);
+		size_t size = allocation_end - current;
+		if (!(size == large_page_size && IS_ALIGNED(current, large_page_size)
+			&& VirtualAllocEx(process, current, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE))
+			&& !VirtualAllocEx(process, current, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE))
+		{
+			log_error("VirtualAllocEx() failed, error code: %d", GetLastError());
+			mm_dump_windows_memory_mappings(process);
+			return false;
+		}
+		current = allocation_end;
+	}
+	return true;
+}
+
+/* Section handles and bytes transferred to the child by the last mm_fork() */
+static size_t fork_transfer_sections, fork_transfer_bytes;
+
+void mm_get_fork_transfer(size_t *sections, size_t *bytes)
+{
+	*sections = fork_transfer_sections;
+	*bytes = fork_transfer_bytes;
+}
+
+/* Copy the content of pages [start_page, end_page] to the same address in the child process */
+static bool fork_copy_pages(HANDLE process, size_t start_page, size_t end_page)
+{
+	SIZE_T written;
+	NTSTATUS status = NtWriteVirtualMemory(process, GET_PAGE_ADDRESS(start_page), GET_PAGE_ADDRESS(start_page),
+		(end_page - start_page + 1) * PAGE_SIZE, &written);
+	fork_transfer_bytes += (end_page - start_page + 1) * PAGE_SIZE;
+	if (!NT_SUCCESS(status))
+	{
+		log_error("NtWriteVirtualMemory() failed, status: %x", status);
+		mm_dump_windows_memory_mappings(process);
+		return false;
+	}
+	return true;
+}
+
+/* Add pages [start_page, end_page] to the pending run [*copy_start, *copy_end], the run is
+ * written to the child first if the pages are not adjacent to it. *copy_end is 0 if there is no run.
+ */
+static bool fork_queue_pages(HANDLE process, size_t *copy_start, size_t *copy_end, size_t start_page, size_t end_page)
+{
+	if (*copy_end && *copy_end + 1 == start_page)
+	{
+		*copy_end = end_page;
+		return true;
+	}
+	if (*copy_end && !fork_copy_pages(process, *copy_start, *copy_end))
+		return false;
+	*copy_start = start_page;
+	*copy_end = end_page;
+	return true;
+}
+
+/* Queue pages in [start_page, end_page] which have ever been written to, the others are zero */
+static bool fork_queue_written_pages(HANDLE process, size_t *copy_start, size_t *copy_end, size_t start_page, size_t end_page)
+{
+	PVOID addresses[256];
+	size_t current = start_page;
+	while (current <= end_page)
+	{
+		ULONG_PTR count = sizeof(addresses) / sizeof(addresses[0]);
+		DWORD granularity;
+		if (GetWriteWatch(0, GET_PAGE_ADDRESS(current), (end_page - current + 1) * PAGE_SIZE, addresses, &count, &granularity))
+		{
+			log_warning("GetWriteWatch(%p) failed, error code: %d, copying all pages.", GET_PAGE_ADDRESS(current), GetLastError());
+			return fork_queue_pages(process, copy_start, copy_end, current, end_page);
+		}
+		for (ULONG_PTR i = 0; i < count; i++)
+		{
+			size_t page = GET_PAGE(addresses[i]);
+			if (!fork_queue_pages(process, copy_start, copy_end, page, page))
+				return false;
+		}
+		if (count < sizeof(addresses) / sizeof(addresses[0]))
+			break;
+		current = GET_PAGE(addresses[count - 1]) + 1;
+	}
+	return true;
+}
+
+/* A section chunk rebuilt by mm_fork(), the child still holds the inherited handle of the old section */
+struct fork_rebuilt_chunk
+{
+	struct fork_rebuilt_chunk *next;
+	size_t first_block;
+	HANDLE old_handle, new_handle;
+};
+
+/* Private copy-on-write pages are not in the sections inherited by the child.
+ * Move them into new sections, the child is given handles to these instead by mm_fork().
+ * This changes the mappings of the parent, the caller locks mm exclusively.
+ */
+static bool fork_rebuild_private_copies(struct fork_rebuilt_chunk **rebuilt)
+{
+	size_t next_block = 0;
+	for (struct rb_node *cur = rb_first(&mm->entry_tree); cur; cur = rb_next(cur))
+	{
+		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		if (!(e->flags & INTERNAL_MAP_PRIVATE_COPY))
+			continue;
+		e->flags &= ~INTERNAL_MAP_PRIVATE_COPY;
+		size_t start_block = max(next_block, GET_BLOCK_OF_PAGE(e->start_page));
+		size_t end_block = GET_BLOCK_OF_PAGE(e->end_page);
+		for (size_t i = start_block; i <= end_block; i++)
+		{
+			HANDLE old_handle = get_section_handle(i);
+			if (!old_handle)
+				continue;
+			size_t first_block, last_block;
+			get_section_chunk(i, &first_block, &last_block);
+			i = last_block;
+			next_block = last_block + 1;
+			/* A detached section has no private pages */
+			MEMORY_BASIC_INFORMATION info;
+			if (!VirtualQuery(GET_BLOCK_ADDRESS(first_block), &info, sizeof(info)) || info.State == MEM_FREE)
+				continue;
+			if (!rebuild_section_chunk(first_block, last_block, false))
+			{
+				log_error("mm_fork(): Rebuilding section chunk 0x%p failed.", first_block);
+				return false;
+			}
+			struct fork_rebuilt_chunk *chunk = HeapAlloc(GetProcessHeap(), 0, sizeof(struct fork_rebuilt_chunk));
+			chunk->first_block = first_block;
+			chunk->old_handle = old_handle;
+			chunk->new_handle = get_section_handle(first_block);
+			chunk->next = *rebuilt;
+			*rebuilt = chunk;
+			mm->stats.fork_rebuilds++;
+		}
+	}
+	return true;
+}
+
+static void fork_free_rebuilt_chunks(struct fork_rebuilt_chunk *rebuilt)
+{
+	while (rebuilt)
+	{
+		struct fork_rebuilt_chunk *chunk = rebuilt;
+		rebuilt = chunk->next;
+		HeapFree(GetProcessHeap(), 0, chunk);
+	}
+}
+
+/* Give the child the sections of the chunks rebuilt by fork_rebuild_private_copies() */
+static bool fork_transfer_rebuilt_chunks(HANDLE process, HANDLE *forked_section_handle, struct fork_rebuilt_chunk *rebuilt)
+{
+	bool r = true;
+	for (struct fork_rebuilt_chunk *chunk = rebuilt; chunk; chunk = chunk->next)
+	{
+		/* Close the inherited handle of the old section in the child */
+		DuplicateHandle(process, chunk->old_handle, NULL, NULL, 0, FALSE, DUPLICATE_CLOSE_SOURCE);
+		/* The chunk may have been unmapped or replaced while mm was not locked */
+		if (r && get_section_handle(chunk->first_block) == chunk->new_handle)
+		{
+			HANDLE child_handle;
+			if (DuplicateHandle(GetCurrentProcess(), chunk->new_handle, process, &child_handle, 0, TRUE, DUPLICATE_SAME_ACCESS))
+			{
+				size_t first_block, last_block;
+				get_section_chunk(chunk->first_block, &first_block, &last_block);
+				for (size_t j = first_block; j <= last_block; j++)
+					replace_section_handle_ex(process, forked_section_handle, j, child_handle);
+			}
+			else
+			{
+				log_error("mm_fork(): DuplicateHandle() failed, error code: %d", GetLastError());
+				r = false;
+			}
+		}
+	}
+	fork_free_rebuilt_chunks(rebuilt);
 	return r;
 }
 
-int mm_fork(HANDLE process)
+int mm_fork(HANDLE process, bool vfork)
 {
+	/* Rebuilding changes mappings, do it before taking the shared lock held through the duplication */
+	struct fork_rebuilt_chunk *rebuilt = NULL;
+	AcquireSRWLockExclusive(&mm->rw_lock);
+	bool rebuilt_ok = fork_rebuild_private_copies(&rebuilt);
+	ReleaseSRWLockExclusive(&mm->rw_lock);
 	AcquireSRWLockShared(&mm->rw_lock);
+	if (!rebuilt_ok)
+	{
+		fork_free_rebuilt_chunks(rebuilt);
+		return 0;
+	}
+	fork_transfer_sections = 0;
+	fork_transfer_bytes = sizeof(struct mm_data);
 	NTSTATUS status;
 	/* Copy mm_data struct */
 	status = NtWriteVirtualMemory(process, mm, mm, sizeof(struct mm_data), NULL);
@@ -975,6 +2582,11 @@ int mm_fork(HANDLE process)
 	}
 	/* Copy section handle tables */
 	HANDLE *forked_section_handle = VirtualAllocEx(process, NULL, BLOCK_COUNT * sizeof(HANDLE), MEM_RESERVE | MEM_TOP_DOWN, PAGE_READWRITE);
+	if (!forked_section_handle)
+	{
+		log_error("mm_fork(): Reserve section handle table failed, error code: %d", GetLastError());
+		return 0;
+	}
 	status = NtWriteVirtualMemory(process, &mm_section_handle, &forked_section_handle, sizeof(HANDLE *), NULL);
 	if (!NT_SUCCESS(status))
 	{
@@ -991,12 +2603,28 @@ int mm_fork(HANDLE process)
 				return 0;
 			}
 			status = NtWriteVirtualMemory(process, &forked_section_handle[j], &mm_section_handle[j], BLOCK_SIZE, NULL);
+			fork_transfer_bytes += BLOCK_SIZE;
 			if (!NT_SUCCESS(status))
 			{
 				log_error("mm_fork(): Write section table 0x%p failed, status: %x", status);
 				return 0;
 			}
 		}
+	/* Reserve the page permission bitmap, the child fills its own */
+	uint8_t *forked_page_bitmap = VirtualAllocEx(process, NULL, PAGE_BITMAP_COUNT * PAGE_BITMAP_TABLE_COUNT * BLOCK_SIZE, MEM_RESERVE | MEM_TOP_DOWN, PAGE_READWRITE);
+	if (!forked_page_bitmap)
+	{
+		log_error("mm_fork(): Reserve page bitmap failed, error code: %d", GetLastError());
+		return 0;
+	}
+	status = NtWriteVirtualMemory(process, &mm_page_bitmap, &forked_page_bitmap, sizeof(uint8_t *), NULL);
+	if (!NT_SUCCESS(status))
+	{
+		log_error("mm_fork(): Copy page bitmap address failed, status: %x", status);
+		return 0;
+	}
+	if (!fork_transfer_rebuilt_chunks(process, forked_section_handle, rebuilt))
+		return 0;
 	/* Section mapping plus protection change is very time consuming
 	 * It takes about 8 msec for 50-60 sections (3-4M) on my machine.
 	 * This is too slow that even a NtWriteVirtualMemory() for such amount of
@@ -1014,16 +2642,25 @@ int mm_fork(HANDLE process)
 	 * and mark CoW memory regions in parent as non-writeable.
 	 */
 	log_info("Copy VirtualAlloc() memory blocks...");
+	/* Pages to be copied are collected into runs of adjacent pages, possibly spanning multiple
+	 * VirtualAlloc()-ed entries, and each run is written to the child in one call.
+	 * The child side is allocated read-write, a run is flushed before changing protection.
+	 * For entries with write watch only pages ever written to are copied, the child's fresh
+	 * allocation is already zero elsewhere. Such allocations are not write watched in the child.
+	 */
+	size_t copy_start = 0, copy_end = 0;
 	for (struct rb_node *cur = rb_first(&mm->entry_tree); cur; cur = rb_next(cur))
 	{
 		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
 		/* Map section */
 		size_t start_block = GET_BLOCK_OF_PAGE(e->start_page);
 		size_t end_block = GET_BLOCK_OF_PAGE(e->end_page);
+		if ((e->flags & INTERNAL_MAP_LARGE_PAGES) && !fork_large_page_allocations(process, e))
+			return 0;
 		if (e->flags & INTERNAL_MAP_VIRTUALALLOC)
 		{
 			/* Memory region allocated via VirtualAlloc(), always block aligned */
-			if (!VirtualAllocEx(process, GET_BLOCK_ADDRESS(start_block), (end_block - start_block + 1) * BLOCK_SIZE, MEM_RESERVE | MEM_COMMIT, prot_linux2win(e->prot)))
+			if (!(e->flags & INTERNAL_MAP_LARGE_PAGES) && !VirtualAllocEx(process, GET_BLOCK_ADDRESS(start_block), (end_block - start_block + 1) * BLOCK_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE))
 			{
 				log_error("VirtualAllocEx() failed, error code: %d", GetLastError());
 				mm_dump_windows_memory_mappings(process);
@@ -1046,7 +2683,7 @@ int mm_fork(HANDLE process)
 					return 0;
 				}
 				size_t start_page = current;
-				size_t end_page = min(e->end_page, GET_PAGE((size_t)info.BaseAddress + info.RegionSize));
+				size_t end_page = min(e->end_page, GET_PAGE((size_t)info.BaseAddress + info.RegionSize) - 1);
 
 				log_assert(info.State == MEM_COMMIT && info.Type == MEM_PRIVATE);
 				if (info.Protect == PAGE_NOACCESS || info.Protect == 0)
@@ -1058,35 +2695,46 @@ int mm_fork(HANDLE process)
 				else
 				{
 					/* TODO: Check unhandled/invalid protections */
-					SIZE_T written;
-					status = NtWriteVirtualMemory(process, GET_PAGE_ADDRESS(e->start_page), GET_PAGE_ADDRESS(e->start_page),
-						(e->end_page - e->start_page + 1) * PAGE_SIZE, &written);
-					if (!NT_SUCCESS(status))
+					if (e->flags & INTERNAL_MAP_WRITE_WATCH)
 					{
-						log_error("NtWriteVirtualMemory() failed, status: %x", status);
-						mm_dump_windows_memory_mappings(process);
-						return 0;
+						if (!fork_queue_written_pages(process, &copy_start, &copy_end, start_page, end_page))
+							return 0;
 					}
+					else if (!fork_queue_pages(process, &copy_start, &copy_end, start_page, end_page))
+						return 0;
 				}
-				/* Change memory protection */
-				DWORD old;
-				if (!VirtualProtectEx(process, GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE,
-					info.Protect, &old))
+				if (info.Protect != PAGE_READWRITE)
 				{
-					log_error("VirtualProtectEx() failed, error code: %d", GetLastError());
-					mm_dump_windows_memory_mappings(process);
-					return 0;
+					/* Change memory protection, after the pending run containing this region is written */
+					if (copy_end && !fork_copy_pages(process, copy_start, copy_end))
+						return 0;
+					copy_end = 0;
+					DWORD old;
+					if (!VirtualProtectEx(process, GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE,
+						info.Protect, &old))
+					{
+						log_error("VirtualProtectEx() failed, error code: %d", GetLastError());
+						mm_dump_windows_memory_mappings(process);
+						return 0;
+					}
 				}
 				current = end_page + 1;
 			}
 		}
-		else if (!(e->flags & INTERNAL_MAP_SHARED))
+		else if (!(e->flags & INTERNAL_MAP_SHARED) && !vfork)
 		{
-			/* It is a CoW page, disable write permission on parent */
+			/* It is a CoW page, disable write permission on parent
+			 * Not needed for vfork(), the parent waits until the child has released its sections.
+			 * The child never writes to them in place, they are shared so its writes are CoW.
+			 */
 			if ((e->prot & PROT_WRITE))
 				mm_change_protection(NtCurrentProcess(), e->start_page, e->end_page, e->prot & ~PROT_WRITE);
 		}
 	}
+	if (copy_end && !fork_copy_pages(process, copy_start, copy_end))
+		return 0;
+	for (size_t i = 0; i < SECTION_TABLE_COUNT; i++)
+		fork_transfer_sections += mm->section_table_handle_count[i];
 	log_info("Memory copying completed.");
 	return 1;
 }
@@ -1099,16 +2747,96 @@ void mm_afterfork_parent()
 void mm_afterfork_child()
 {
 	InitializeSRWLock(&mm->rw_lock);
+	init_address_space();
+	ZeroMemory(&mm->stats, sizeof(mm->stats));
+	/* No view is mapped in the child yet, so no entry has private pages
+	 * VirtualAlloc()-ed memory is allocated by mm_fork() without write watch
+	 */
+	for (struct rb_node *cur = rb_first(&mm->entry_tree); cur; cur = rb_next(cur))
+		rb_entry(cur, struct map_entry, tree)->flags &= ~(INTERNAL_MAP_PRIVATE_COPY | INTERNAL_MAP_WRITE_WATCH);
 	mm->static_alloc_begin = (uint8_t *)mm->static_alloc_end - MM_STATIC_ALLOC_SIZE;
 }
 
+/* Allocate and set up the blocks [start_block, end_block] of a map entry which are not yet loaded */
+static void populate_map_entry_blocks(struct map_entry *e, size_t start_block, size_t end_block)
+{
+	for (size_t i = start_block; i <= end_block; i++)
+	{
+		if (get_section_handle(i))
+			continue;
+		/* Blocks backed by the file section need no copying */
+		size_t first_block, last_block;
+		if (map_file_view(i, &first_block, &last_block))
+		{
+			i = last_block;
+			continue;
+		}
+		if (allocate_block(i))
+		{
+			/* A newly created section is already zero filled, avoid touching anonymous pages */
+			if (e->f)
+				map_entry_range(e, GET_FIRST_PAGE_OF_BLOCK(i), GET_LAST_PAGE_OF_BLOCK(i));
+			mm_change_protection(NtCurrentProcess(), GET_FIRST_PAGE_OF_BLOCK(i), GET_LAST_PAGE_OF_BLOCK(i), e->prot);
+		}
+	}
+}
+
+/* Identity of a MAP_SHARED object, the same in every process mapping it
+ * Anonymous shared memory can only be shared with forked children, which inherit the entry, so it gets a new id.
+ * A shared file mapping is identified by a hash of its volume and file id, which unlike the path are the
+ * same through hard links, symlinks and bind mounts and do not move to another file on rename().
+ * Without get_identity() the device and inode numbers from stat() are used if there is an inode number.
+ */
+static uint64_t get_shared_id(struct file *f)
+{
+	if (f)
+	{
+		uint64_t id[2];
+		struct newstat st;
+		bool found = false;
+		if (f->op_vtable->get_identity)
+			found = f->op_vtable->get_identity(f, &id[0], &id[1]) == 0;
+		else if (f->op_vtable->stat && f->op_vtable->stat(f, &st) == 0 && st.st_ino)
+		{
+			id[0] = st.st_dev;
+			id[1] = st.st_ino;
+			found = true;
+		}
+		if (found)
+		{
+			/* FNV-1a, with the top bit set so it never collides with anonymous ids */
+			const uint8_t *p = (const uint8_t *)id;
+			uint64_t hash = 0xCBF29CE484222325ULL;
+			for (int i = 0; i < sizeof(id); i++)
+				hash = (hash ^ p[i]) * 0x100000001B3ULL;
+			return hash | 0x8000000000000000ULL;
+		}
+	}
+	return ((uint64_t)GetCurrentProcessId() << 32) | ++mm->shared_id_counter;
+}
+
+/* Check if the file is /dev/zero, whose mappings are plain anonymous memory */
+static bool is_dev_zero(struct file *f)
+{
+	struct newstat st;
+	if (!f->op_vtable->stat || f->op_vtable->stat(f, &st) < 0)
+		return false;
+	return S_ISCHR(st.st_mode) && st.st_rdev == mkdev(1, 5);
+}
+
+/* Check if [addr, addr + length) overlaps the shared heap window, see kmalloc_shared() */
+static bool overlaps_shared_heap_window(size_t addr, size_t length)
+{
+	return addr < SHARED_HEAP_BASE + SHARED_HEAP_WINDOW_SIZE && SHARED_HEAP_BASE < addr + length;
+}
+
 static void *mmap_internal(void *addr, size_t length, int prot, int flags, int internal_flags, struct file *f, off_t offset_pages)
 {
 	if (length == 0)
 		return (void*)-L_EINVAL;
 	length = ALIGN_TO_PAGE(length);
-	if ((size_t)addr < ADDRESS_SPACE_LOW || (size_t)addr >= ADDRESS_SPACE_HIGH
-		|| (size_t)addr + length < ADDRESS_SPACE_LOW || (size_t)addr + length >= ADDRESS_SPACE_HIGH
+	if ((size_t)addr < ADDRESS_SPACE_LOW || (size_t)addr >= address_space_high
+		|| (size_t)addr + length < ADDRESS_SPACE_LOW || (size_t)addr + length >= address_space_high
 		|| (size_t)addr + length < (size_t)addr)
 		return (void*)-L_EINVAL;
 	if ((flags & MAP_ANONYMOUS) && f != NULL)
@@ -1121,6 +2849,13 @@ static void *mmap_internal(void *addr, size_t length, int prot, int flags, int i
 		log_error("MAP_FILE with bad file descriptor.");
 		return (void*)-L_EBADF;
 	}
+	if (f && is_dev_zero(f))
+	{
+		/* Map it as anonymous memory, sections are demand zero so the pages need not be read */
+		f = NULL;
+		offset_pages = 0;
+		flags |= MAP_ANONYMOUS;
+	}
 	if ((internal_flags & INTERNAL_MAP_VIRTUALALLOC) &&
 		(!IS_ALIGNED(addr, BLOCK_SIZE) || !IS_ALIGNED(length, BLOCK_SIZE)))
 	{
@@ -1141,10 +2876,24 @@ static void *mmap_internal(void *addr, size_t length, int prot, int flags, int i
 		/* To avoid this, we always use VirtualAlloc() for holding stacks */
 		internal_flags |= INTERNAL_MAP_VIRTUALALLOC;
 	}
+	/* Back big private anonymous read-write mappings with large pages if enabled */
+	if (!(flags & MAP_FIXED) && (flags & MAP_ANONYMOUS) && !(flags & MAP_SHARED)
+		&& !(internal_flags & INTERNAL_MAP_VIRTUALALLOC) && prot == (PROT_READ | PROT_WRITE)
+		&& IS_ALIGNED(length, BLOCK_SIZE) && get_large_page_pages() && length >= mm->large_page_pages * PAGE_SIZE)
+		internal_flags |= INTERNAL_MAP_VIRTUALALLOC | INTERNAL_MAP_LARGE_PAGES;
 
 	bool block_align = BLOCK_ALIGNED(internal_flags);
+	/* Place file mappings at block aligned offsets so they can be backed by views of the file's section */
+	if (!(flags & MAP_FIXED) && f && f->op_vtable->create_section && length >= BLOCK_SIZE
+		&& offset_pages % PAGES_PER_BLOCK == 0 && ((flags & MAP_SHARED) || !(prot & PROT_WRITE)))
+		block_align = true;
 	if ((flags & MAP_FIXED))
 	{
+		if (overlaps_shared_heap_window((size_t)addr, length))
+		{
+			log_error("MAP_FIXED addr collides with the shared heap window.");
+			return (void*)-L_ENOMEM;
+		}
 		if (block_align && !IS_ALIGNED(addr, BLOCK_SIZE))
 		{
 			log_error("Non-64kB aligned MAP_FIXED address with the suppied flag is unsupported.");
@@ -1174,7 +2923,9 @@ static void *mmap_internal(void *addr, size_t length, int prot, int flags, int i
 	else /* MAP_FIXED */
 	{
 		size_t alloc_page;
-		if (internal_flags & INTERNAL_MAP_TOPDOWN)
+		if (internal_flags & INTERNAL_MAP_LARGE_PAGES)
+			alloc_page = find_free_large_pages(GET_PAGE(ALIGN_TO_PAGE(length)));
+		else if (internal_flags & INTERNAL_MAP_TOPDOWN)
 			alloc_page = find_free_pages_topdown(GET_PAGE(ALIGN_TO_PAGE(length)), block_align);
 		else
 			alloc_page = find_free_pages(GET_PAGE(ALIGN_TO_PAGE(length)), block_align);
@@ -1215,12 +2966,16 @@ static void *mmap_internal(void *addr, size_t length, int prot, int flags, int i
 		else
 		{
 			static int munmap_internal(void *addr, size_t length);
-			munmap_internal(addr, length);
+			int r = munmap_internal(addr, length);
+			if (r < 0)
+				return (void*)r;
 		}
 	}
 
 	/* Create new map_entry */
 	struct map_entry *entry = new_map_entry();
+	if (!entry)
+		return (void*)-L_ENOMEM;
 	entry->start_page = start_page;
 	entry->end_page = end_page;
 	entry->f = f;
@@ -1233,24 +2988,46 @@ static void *mmap_internal(void *addr, size_t length, int prot, int flags, int i
 		entry->flags |= INTERNAL_MAP_NORESET;
 	if (internal_flags & INTERNAL_MAP_VIRTUALALLOC)
 		entry->flags |= INTERNAL_MAP_VIRTUALALLOC;
+	if (internal_flags & INTERNAL_MAP_LARGE_PAGES)
+		entry->flags |= INTERNAL_MAP_LARGE_PAGES;
+	if (internal_flags & INTERNAL_MAP_SHARED)
+	{
+		entry->flags |= INTERNAL_MAP_SHARED;
+		entry->shared_id = get_shared_id(f);
+	}
 
 	/* Add the new entry to VAD tree */
 	rb_add(&mm->entry_tree, &entry->tree, map_entry_cmp);
+	mm->maps_version++;
+	if (mm->retained_code_count)
+		check_retained_code(entry);
 
-	if (internal_flags & INTERNAL_MAP_VIRTUALALLOC)
+	if (internal_flags & INTERNAL_MAP_LARGE_PAGES)
 	{
-		/* Allocate the memory now */
-		if (!VirtualAlloc(GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE, MEM_RESERVE | MEM_COMMIT, prot_linux2win(prot)))
+		if (!allocate_large_pages(start_page, end_page))
 		{
-			log_error("VirtualAlloc(%p, %p) failed, error code: %d", GET_PAGE_ADDRESS(start_page),
-				(end_page - start_page + 1) * PAGE_SIZE, GetLastError());
 			mm_dump_windows_memory_mappings(GetCurrentProcess());
 			return (void*)-L_ENOMEM;
 		}
 	}
-
-	/* If the first or last block is already allocated, we have to set up proper content in it
-	   For other blocks we map them on demand */
+	else if (internal_flags & INTERNAL_MAP_VIRTUALALLOC)
+	{
+		/* Allocate the memory now, track written pages so mm_fork() can skip untouched ones */
+		if (VirtualAlloc(GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_WRITE_WATCH, prot_linux2win(prot)))
+			entry->flags |= INTERNAL_MAP_WRITE_WATCH;
+		else if (!VirtualAlloc(GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE, MEM_RESERVE | MEM_COMMIT, prot_linux2win(prot)))
+		{
+			log_error("VirtualAlloc(%p, %p) failed, error code: %d", GET_PAGE_ADDRESS(start_page),
+				(end_page - start_page + 1) * PAGE_SIZE, GetLastError());
+			mm_dump_windows_memory_mappings(GetCurrentProcess());
+			return (void*)-L_ENOMEM;
+		}
+	}
+	if (internal_flags & INTERNAL_MAP_VIRTUALALLOC)
+		set_page_permission(start_page, end_page, prot);
+
+	/* If the first or last block is already allocated, we have to set up proper content in it
+	   For other blocks we map them on demand */
 	HANDLE section;
 	NTSTATUS status;
 	if ((section = get_section_handle(start_block)) != NULL)
@@ -1291,12 +3068,9 @@ static void *mmap_internal(void *addr, size_t length, int prot, int flags, int i
 		end_block--;
 	}
 	if ((flags & MAP_POPULATE) && start_block < end_block)
-	{
-		for (size_t i = start_block; i <= end_block; i++)
-			allocate_block(i);
-		map_entry_range(entry, GET_FIRST_PAGE_OF_BLOCK(start_block), GET_LAST_PAGE_OF_BLOCK(end_block));
-		mm_change_protection(NtCurrentProcess(), GET_FIRST_PAGE_OF_BLOCK(start_block), GET_LAST_PAGE_OF_BLOCK(end_block), prot);
-	}
+		populate_map_entry_blocks(entry, start_block, end_block);
+	/* Adjacent compatible mappings, e.g. made by growing the heap, are kept as one entry */
+	merge_map_entry(entry);
 	log_info("Allocated memory: [%p, %p)", addr, (size_t)addr + length);
 	return addr;
 }
@@ -1307,8 +3081,8 @@ static int munmap_internal_check(void *addr, size_t *length)
 	if (!IS_ALIGNED(addr, PAGE_SIZE))
 		return -L_EINVAL;
 	*length = ALIGN_TO_PAGE(*length);
-	if ((size_t)addr < ADDRESS_SPACE_LOW || (size_t)addr >= ADDRESS_SPACE_HIGH
-		|| (size_t)addr + *length < ADDRESS_SPACE_LOW || (size_t)addr + *length >= ADDRESS_SPACE_HIGH
+	if ((size_t)addr < ADDRESS_SPACE_LOW || (size_t)addr >= address_space_high
+		|| (size_t)addr + *length < ADDRESS_SPACE_LOW || (size_t)addr + *length >= address_space_high
 		|| (size_t)addr + *length < (size_t)addr)
 	{
 		return -L_EINVAL;
@@ -1316,11 +3090,17 @@ static int munmap_internal_check(void *addr, size_t *length)
 	return 0;
 }
 
-static void munmap_internal_unsafe(void *addr, size_t length)
+/* Returns -L_ENOMEM if an entry partially in the range cannot be split, the rest of that range is then left mapped */
+static int munmap_internal_unsafe(void *addr, size_t length)
 {
+	int r = 0;
 	mm->thread_id = GetCurrentThreadId();
+	mm->maps_version++;
 	do
 	{
+		/* Pages mapped ahead of the program break are given up once they are unmapped */
+		if ((size_t)addr < (size_t)mm->brk_end && (size_t)addr + length > ALIGN_TO_PAGE(mm->brk))
+			mm->brk_end = (void*)max(ALIGN_TO_PAGE(mm->brk), (size_t)addr);
 		size_t start_page = GET_PAGE(addr);
 		size_t end_page = GET_PAGE((size_t)addr + length - 1);
 		for (struct rb_node *cur = start_node(start_page); cur;)
@@ -1356,7 +3136,11 @@ static void munmap_internal_unsafe(void *addr, size_t length)
 					/* Not so good, part of current entry is overlapped */
 					if (range_start == e->start_page)
 					{
-						split_map_entry(e, range_end);
+						if (!split_map_entry(e, range_end))
+						{
+							r = -L_ENOMEM;
+							break;
+						}
 						struct rb_node *next = rb_next(cur);
 						free_map_entry_blocks(e);
 						rb_remove(&mm->entry_tree, cur);
@@ -1365,7 +3149,11 @@ static void munmap_internal_unsafe(void *addr, size_t length)
 					}
 					else
 					{
-						split_map_entry(e, range_start - 1);
+						if (!split_map_entry(e, range_start - 1))
+						{
+							r = -L_ENOMEM;
+							break;
+						}
 						/* The current entry is unrelated, we just skip to next entry (which we just generated) */
 						cur = rb_next(cur);
 					}
@@ -1375,6 +3163,7 @@ static void munmap_internal_unsafe(void *addr, size_t length)
 		addr = munmap_list_pop(&length);
 	} while (addr != NULL);
 	mm->thread_id = 0;
+	return r;
 }
 
 static int munmap_internal(void *addr, size_t length)
@@ -1383,8 +3172,7 @@ static int munmap_internal(void *addr, size_t length)
 	if (err)
 		return err;
 
-	munmap_internal_unsafe(addr, length);
-	return 0;
+	return munmap_internal_unsafe(addr, length);
 }
 
 void *mm_mmap(void *addr, size_t length, int prot, int flags, int internal_flags, struct file *f, off_t offset_pages)
@@ -1410,9 +3198,9 @@ int mm_munmap(void *addr, size_t length)
 	}
 
 	AcquireSRWLockExclusive(&mm->rw_lock);
-	munmap_internal_unsafe(addr, length);
+	err = munmap_internal_unsafe(addr, length);
 	ReleaseSRWLockExclusive(&mm->rw_lock);
-	return 0;
+	return err;
 }
 
 DEFINE_SYSCALL(mmap, void *, addr, size_t, length, int, prot, int, flags, int, fd, off_t, offset)
@@ -1461,19 +3249,19 @@ DEFINE_SYSCALL(munmap, void *, addr, size_t, length)
 	return mm_munmap(addr, length);
 }
 
-DEFINE_SYSCALL(mprotect, void *, addr, size_t, length, int, prot)
+int mm_mprotect(void *addr, size_t length, int prot)
 {
-	log_info("mprotect(%p, %p, %x)", addr, length, prot);
 	int r = 0;
 	AcquireSRWLockExclusive(&mm->rw_lock);
+	mm->maps_version++;
 	if (!IS_ALIGNED(addr, PAGE_SIZE))
 	{
 		r = -L_EINVAL;
 		goto out;
 	}
 	length = ALIGN_TO_PAGE(length);
-	if ((size_t)addr < ADDRESS_SPACE_LOW || (size_t)addr >= ADDRESS_SPACE_HIGH
-		|| (size_t)addr + length < ADDRESS_SPACE_LOW || (size_t)addr + length >= ADDRESS_SPACE_HIGH
+	if ((size_t)addr < ADDRESS_SPACE_LOW || (size_t)addr >= address_space_high
+		|| (size_t)addr + length < ADDRESS_SPACE_LOW || (size_t)addr + length >= address_space_high
 		|| (size_t)addr + length < (size_t)addr)
 	{
 		r = -L_EINVAL;
@@ -1502,45 +3290,65 @@ DEFINE_SYSCALL(mprotect, void *, addr, size_t, length, int, prot)
 		goto out;
 	}
 
-	/* Change protection flags */
+	/* Change protection flags
+	 * Entries which already have the protection are left alone, their pages are in a state
+	 * consistent with it. The pages of the others are collected in runs of adjacent pages,
+	 * each run is changed at once.
+	 */
+	size_t run_start = 0, run_end = 0;
+	bool has_run = false;
 	for (struct rb_node *cur = start_node(start_page); cur; cur = rb_next(cur))
 	{
 		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
 		if (end_page < e->start_page)
 			break;
-		else
+		size_t range_start = max(start_page, e->start_page);
+		size_t range_end = min(end_page, e->end_page);
+		if (range_start > range_end)
+			continue;
+		/* Do not split VirtualAlloc()-ed memory regions, so we can deal with the entire entry at mm_fork() */
+		if ((e->flags & INTERNAL_MAP_VIRTUALALLOC))
+			continue;
+		if (range_start != e->start_page)
 		{
-			size_t range_start = max(start_page, e->start_page);
-			size_t range_end = min(end_page, e->end_page);
-			if (range_start > range_end)
-				continue;
-			/* Do not split VirtualAlloc()-ed memory regions, so we can deal with the entire entry at mm_fork() */
-			if ((e->flags & INTERNAL_MAP_VIRTUALALLOC))
-				continue;
-			if ((range_start == e->start_page && range_end == e->end_page))
-			{
-				/* That's good, the current entry is fully overlapped */
-				e->prot = prot;
-			}
-			else
+			/* Part of current entry is overlapped, the part before the range is unrelated
+			 * Split it and handle the rest as the next entry (which we just generated) */
+			if (!split_map_entry(e, range_start - 1))
 			{
-				/* Not so good, part of current entry is overlapped, we need to split the entry */
-				if (range_start == e->start_page)
-				{
-					split_map_entry(e, range_end);
-					e->prot = prot;
-				}
-				else
-				{
-					split_map_entry(e, range_start - 1);
-					/* The current entry is unrelated, we just skip to next entry (which we just generated) */
-				}
+				r = -L_ENOMEM;
+				break;
 			}
+			continue;
+		}
+		if (range_end != e->end_page && !split_map_entry(e, range_end))
+		{
+			/* Like Linux, the part before is left changed, the pending run is applied below */
+			r = -L_ENOMEM;
+			break;
+		}
+		if (e->prot == prot)
+		{
+			mm->stats.protect_skipped_pages += (int)(range_end - range_start + 1);
+			continue;
 		}
+		e->prot = prot;
+		if (has_run && range_start == run_end + 1)
+		{
+			run_end = range_end;
+			continue;
+		}
+		/* We remove the write protection in case the pages are already shared */
+		if (has_run && !mm_change_protection(GetCurrentProcess(), run_start, run_end, prot & ~PROT_WRITE))
+		{
+			r = -L_ENOMEM; /* TODO */
+			goto out;
+		}
+		run_start = range_start;
+		run_end = range_end;
+		has_run = true;
 	}
-	if (!mm_change_protection(GetCurrentProcess(), start_page, end_page, prot & ~PROT_WRITE))
+	if (has_run && !mm_change_protection(GetCurrentProcess(), run_start, run_end, prot & ~PROT_WRITE))
 	{
-		/* We remove the write protection in case the pages are already shared */
 		r = -L_ENOMEM; /* TODO */
 		goto out;
 	}
@@ -1550,11 +3358,81 @@ out:
 	return r;
 }
 
+DEFINE_SYSCALL(mprotect, void *, addr, size_t, length, int, prot)
+{
+	log_info("mprotect(%p, %p, %x)", addr, length, prot);
+	return mm_mprotect(addr, length, prot);
+}
+
 DEFINE_SYSCALL(msync, void *, addr, size_t, len, int, flags)
 {
 	log_info("msync(0x%p, 0x%p, %d)", addr, len, flags);
-	log_error("msync() not implemented.");
-	return -L_ENOSYS;
+	if (!IS_ALIGNED(addr, PAGE_SIZE) || (flags & ~(MS_ASYNC | MS_INVALIDATE | MS_SYNC))
+		|| (flags & (MS_ASYNC | MS_SYNC)) == (MS_ASYNC | MS_SYNC))
+		return -L_EINVAL;
+	if (len == 0)
+		return 0;
+	size_t start_page = GET_PAGE(addr);
+	size_t end_page = GET_PAGE((size_t)addr + len - 1);
+	int r = 0;
+	AcquireSRWLockShared(&mm->rw_lock);
+	/* Every page in the range must be mapped */
+	size_t next_page = start_page;
+	for (struct rb_node *cur = start_node(start_page); cur; cur = rb_next(cur))
+	{
+		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		if (e->start_page > end_page)
+			break;
+		if (e->end_page < start_page)
+			continue;
+		if (e->start_page > next_page)
+			break;
+		next_page = e->end_page + 1;
+		if (next_page > end_page)
+			break;
+	}
+	if (next_page <= end_page)
+	{
+		r = -L_ENOMEM;
+		goto out;
+	}
+	/* Views of file sections are coherent with read() and write() through the cache manager,
+	 * dirty pages are written back lazily by the system. So MS_ASYNC and MS_INVALIDATE need
+	 * nothing, MS_SYNC flushes the dirty pages of the range and the file's buffers.
+	 */
+	if (!(flags & MS_SYNC))
+		goto out;
+	for (struct rb_node *cur = start_node(start_page); cur; cur = rb_next(cur))
+	{
+		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		if (e->start_page > end_page)
+			break;
+		if (e->end_page < start_page || !e->f || !(e->flags & INTERNAL_MAP_SHARED))
+			continue;
+		size_t range_start = max(start_page, e->start_page);
+		size_t range_end = min(end_page, e->end_page);
+		/* Only flush loaded blocks, an unloaded block has nothing dirty */
+		size_t start_block = GET_BLOCK_OF_PAGE(range_start);
+		size_t end_block = GET_BLOCK_OF_PAGE(range_end);
+		for (size_t i = start_block; i <= end_block; i++)
+		{
+			if (!get_section_handle(i))
+				continue;
+			size_t flush_start = max(range_start, GET_FIRST_PAGE_OF_BLOCK(i));
+			size_t flush_end = min(range_end, GET_LAST_PAGE_OF_BLOCK(i));
+			if (!FlushViewOfFile(GET_PAGE_ADDRESS(flush_start), (flush_end - flush_start + 1) * PAGE_SIZE))
+				log_warning("FlushViewOfFile() failed, error code: %d", GetLastError());
+		}
+		if (e->f->op_vtable->fsync)
+		{
+			int fr = e->f->op_vtable->fsync(e->f);
+			if (fr < 0)
+				r = fr;
+		}
+	}
+out:
+	ReleaseSRWLockShared(&mm->rw_lock);
+	return r;
 }
 
 static int mm_populate_internal(const void *addr, size_t len)
@@ -1587,12 +3465,23 @@ static int mm_populate_internal(const void *addr, size_t len)
 				}
 				else
 				{
+					size_t first_block, last_block;
+					if (map_file_view(i, &first_block, &last_block))
+					{
+						num_blocks += last_block - i + 1;
+						i = last_block;
+						continue;
+					}
 					if (!allocate_block(i))
 						return -L_ENOMEM;
 					num_blocks++;
 					size_t first_page = max(range_start, GET_FIRST_PAGE_OF_BLOCK(i));
 					size_t last_page = min(range_end, GET_LAST_PAGE_OF_BLOCK(i));
-					map_entry_range(e, first_page, last_page);
+					/* A newly created section is already zero filled, avoid touching anonymous pages */
+					if (e->f)
+						map_entry_range(e, first_page, last_page);
+					else
+						set_page_permission(first_page, last_page, e->prot);
 					if (e->prot != PROT_READ | PROT_WRITE | PROT_EXEC)
 					{
 						DWORD oldProtect;
@@ -1618,6 +3507,64 @@ void mm_populate(void *addr)
 	ReleaseSRWLockExclusive(&mm->rw_lock);
 }
 
+/* Probing checkers in stubs.asm, they touch every page and catch access violations */
+int mm_probe_read(const void *addr, size_t size);
+int mm_probe_read_string(const char *addr);
+int mm_probe_write(void *addr, size_t size);
+
+static bool test_page_permission(int bitmap, const void *addr, size_t size)
+{
+	size_t last = (size_t)addr + size - 1;
+	if (last < (size_t)addr || last >= address_space_high)
+		return false;
+	return test_page_bitmap(bitmap, GET_PAGE(addr), GET_PAGE(last));
+}
+
+int mm_check_read(const void *addr, size_t size)
+{
+	if (size == 0 || test_page_permission(PAGE_BITMAP_READ, addr, size))
+		return 1;
+	return mm_probe_read(addr, size);
+}
+
+int mm_check_read_string(const char *addr)
+{
+	/* Look for the terminating null in pages known to be readable first */
+	while (test_page_permission(PAGE_BITMAP_READ, addr, 1))
+	{
+		const char *page_end = (const char *)GET_PAGE_ADDRESS(GET_PAGE(addr) + 1);
+		for (; addr < page_end; addr++)
+			if (!*addr)
+				return 1;
+	}
+	return mm_probe_read_string(addr);
+}
+
+int mm_check_write(void *addr, size_t size)
+{
+	if (size == 0 || test_page_permission(PAGE_BITMAP_WRITE, addr, size))
+		return 1;
+	return mm_probe_write(addr, size);
+}
+
+bool mm_get_shared_key(const void *addr, uint64_t *object, uint64_t *offset)
+{
+	bool shared = false;
+	AcquireSRWLockShared(&mm->rw_lock);
+	struct map_entry probe;
+	probe.start_page = GET_PAGE(addr);
+	struct rb_node *node = rb_upper_bound(&mm->entry_tree, &probe.tree, map_entry_cmp);
+	struct map_entry *e = node ? rb_entry(node, struct map_entry, tree) : NULL;
+	if (e && GET_PAGE(addr) <= e->end_page && (e->flags & INTERNAL_MAP_SHARED))
+	{
+		*object = e->shared_id;
+		*offset = (uint64_t)(e->offset_pages + GET_PAGE(addr) - e->start_page) * PAGE_SIZE + ((size_t)addr & (PAGE_SIZE - 1));
+		shared = true;
+	}
+	ReleaseSRWLockShared(&mm->rw_lock);
+	return shared;
+}
+
 DEFINE_SYSCALL(mlock, const void *, addr, size_t, len)
 {
 	log_info("mlock(0x%p, 0x%p)", addr, len);
@@ -1661,46 +3608,693 @@ DEFINE_SYSCALL(munlock, const void *, addr, size_t, len)
 	return 0;
 }
 
+/* Check if there are no map entries in the block other than in pages [start_page, end_page] */
+static bool is_block_exclusive(size_t block, size_t start_page, size_t end_page)
+{
+	size_t first_page = GET_FIRST_PAGE_OF_BLOCK(block);
+	size_t last_page = GET_LAST_PAGE_OF_BLOCK(block);
+	for (struct rb_node *cur = start_node(first_page); cur; cur = rb_next(cur))
+	{
+		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		if (e->start_page > last_page)
+			break;
+		size_t range_start = max(first_page, e->start_page);
+		size_t range_end = min(last_page, e->end_page);
+		if (range_start > range_end)
+			continue;
+		if (range_start < start_page || range_end > end_page)
+			return false;
+	}
+	return true;
+}
+
+/* Check if the section chunk [first_block, last_block] can be moved by delta_blocks as a whole
+ * The chunk must be used only by the remapped pages, and its target blocks must be free.
+ */
+static bool can_move_section_chunk(size_t first_block, size_t last_block, size_t delta_blocks,
+	size_t old_start_page, size_t old_end_page, size_t new_start_page, size_t new_end_page)
+{
+	/* A chunk must stay inside its chunk window */
+	if (first_block != last_block && delta_blocks % SECTION_CHUNK_BLOCKS != 0)
+		return false;
+	for (size_t i = first_block; i <= last_block; i++)
+	{
+		if (!is_block_exclusive(i, old_start_page, old_end_page))
+			return false;
+		if (get_section_handle(i + delta_blocks) || !is_block_exclusive(i + delta_blocks, new_start_page, new_end_page))
+			return false;
+	}
+	return true;
+}
+
+/* Move the section chunk [first_block, last_block] of map entry e by delta_blocks without copying */
+static void move_section_chunk(struct map_entry *e, size_t first_block, size_t last_block, size_t delta_blocks)
+{
+	MEMORY_BASIC_INFORMATION info;
+	bool mapped = VirtualQuery(GET_BLOCK_ADDRESS(first_block), &info, sizeof(info)) && info.State != MEM_FREE;
+	/* Private copy-on-write pages only live in the view */
+	if (mapped && (e->flags & INTERNAL_MAP_PRIVATE_COPY))
+		rebuild_section_chunk(first_block, last_block, false);
+	HANDLE handle = get_section_handle(first_block);
+	if (mapped)
+		NtUnmapViewOfSection(NtCurrentProcess(), GET_BLOCK_ADDRESS(first_block));
+	for (size_t i = first_block; i <= last_block; i++)
+	{
+		remove_section_handle(i);
+		add_section_handle(i + delta_blocks, handle);
+	}
+	/* If mapping fails the section is left detached, it will be loaded on next access */
+	size_t new_first_block, new_last_block;
+	if (mapped && NT_SUCCESS(map_section_chunk(first_block + delta_blocks, &new_first_block, &new_last_block)))
+	{
+		DWORD oldProtect;
+		VirtualProtect(GET_BLOCK_ADDRESS(new_first_block), (new_last_block - new_first_block + 1) * BLOCK_SIZE, PAGE_NOACCESS, &oldProtect);
+		/* Sections still shared with forked processes must keep faulting on writes */
+		int prot_mask = PROT_READ | PROT_WRITE | PROT_EXEC;
+		if (!(e->flags & INTERNAL_MAP_SHARED) && is_section_shared(new_first_block))
+			prot_mask &= ~PROT_WRITE;
+		load_block_protection(new_first_block, new_last_block, prot_mask, INITIAL_PROT_UNKNOWN);
+	}
+}
+
+/* Make pages [start_page, end_page] of map entry e inside one block loaded, owned and writable
+ * The pages are set up with the content of e if fill is true.
+ */
+static bool prepare_block_pages(struct map_entry *e, size_t block, size_t start_page, size_t end_page, bool fill)
+{
+	DWORD oldProtect;
+	if (get_section_handle(block))
+	{
+		if (!(e->flags & INTERNAL_MAP_SHARED) && !take_block_ownership(block))
+			return false;
+		load_detached_block(block);
+		VirtualProtect(GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE, prot_linux2win(e->prot | PROT_WRITE), &oldProtect);
+		if (fill)
+			map_entry_range(e, start_page, end_page);
+		return true;
+	}
+	if (!allocate_block(block))
+		return false;
+	/* Set up all entries in the new block as a demand page fault would do */
+	size_t first_page = GET_FIRST_PAGE_OF_BLOCK(block);
+	size_t last_page = GET_LAST_PAGE_OF_BLOCK(block);
+	for (struct rb_node *cur = start_node(first_page); cur; cur = rb_next(cur))
+	{
+		struct map_entry *entry = rb_entry(cur, struct map_entry, tree);
+		if (entry->start_page > last_page)
+			break;
+		size_t range_start = max(first_page, entry->start_page);
+		size_t range_end = min(last_page, entry->end_page);
+		if (range_start > range_end)
+			continue;
+		if (entry->f)
+			map_entry_range(entry, range_start, range_end);
+		int prot = (entry == e)? (entry->prot | PROT_WRITE): entry->prot;
+		VirtualProtect(GET_PAGE_ADDRESS(range_start), (range_end - range_start + 1) * PAGE_SIZE, prot_linux2win(prot), &oldProtect);
+	}
+	return true;
+}
+
+/* Copy pages [start_page, end_page] into map entry ne at delta_pages away
+ * Pages never loaded are left to be loaded on demand from the same backing.
+ */
+static bool copy_remapped_pages(struct map_entry *ne, size_t start_page, size_t end_page, size_t delta_pages)
+{
+	for (size_t page = start_page; page <= end_page;)
+	{
+		size_t new_page = page + delta_pages;
+		size_t count = min(end_page - page + 1, PAGES_PER_BLOCK - GET_PAGE_IN_BLOCK(page));
+		count = min(count, PAGES_PER_BLOCK - GET_PAGE_IN_BLOCK(new_page));
+		size_t block = GET_BLOCK_OF_PAGE(page);
+		size_t new_block = GET_BLOCK_OF_PAGE(new_page);
+		bool loaded = get_section_handle(block) != NULL;
+		if (loaded || get_section_handle(new_block))
+		{
+			if (!prepare_block_pages(ne, new_block, new_page, new_page + count - 1, !loaded))
+				return false;
+			DWORD oldProtect;
+			if (loaded)
+			{
+				/* The old pages are unmapped after copying */
+				load_detached_block(block);
+				VirtualProtect(GET_PAGE_ADDRESS(page), count * PAGE_SIZE, PAGE_READONLY, &oldProtect);
+				CopyMemory(GET_PAGE_ADDRESS(new_page), GET_PAGE_ADDRESS(page), count * PAGE_SIZE);
+			}
+			VirtualProtect(GET_PAGE_ADDRESS(new_page), count * PAGE_SIZE, prot_linux2win(ne->prot), &oldProtect);
+		}
+		page += count;
+	}
+	return true;
+}
+
+/* Copy the content and page protection of a VirtualAlloc()-ed range to another one */
+static void copy_virtualalloc_range(size_t start_page, size_t end_page, size_t new_start_page)
+{
+	size_t current = start_page;
+	while (current <= end_page)
+	{
+		MEMORY_BASIC_INFORMATION info;
+		if (!VirtualQuery(GET_PAGE_ADDRESS(current), &info, sizeof(info)))
+		{
+			log_error("VirtualQuery(%p) failed, error code: %d", GET_PAGE_ADDRESS(current), GetLastError());
+			return;
+		}
+		size_t last_page = min(end_page, GET_PAGE((size_t)info.BaseAddress + info.RegionSize) - 1);
+		size_t size = (last_page - current + 1) * PAGE_SIZE;
+		void *new_addr = GET_PAGE_ADDRESS(new_start_page + current - start_page);
+		DWORD oldProtect;
+		VirtualProtect(GET_PAGE_ADDRESS(current), size, PAGE_READONLY, &oldProtect);
+		VirtualProtect(new_addr, size, PAGE_READWRITE, &oldProtect);
+		CopyMemory(new_addr, GET_PAGE_ADDRESS(current), size);
+		VirtualProtect(new_addr, size, info.Protect, &oldProtect);
+		current = last_page + 1;
+	}
+}
+
+/* Find free pages for moving count pages starting at old_start_page with no copying
+ * The new pages keep the position inside the section chunk window if possible, so whole
+ * section chunks can be moved, otherwise only the position inside the block is kept.
+ */
+static size_t find_remap_free_pages(size_t old_start_page, size_t count)
+{
+	size_t window_pages = PAGES_PER_BLOCK * SECTION_CHUNK_BLOCKS;
+	size_t window_offset = old_start_page % window_pages;
+	size_t base = find_free_pages(window_pages - PAGES_PER_BLOCK + ALIGN_TO(window_offset + count, PAGES_PER_BLOCK), true);
+	if (base)
+		return ALIGN_TO(base, window_pages) + window_offset;
+	size_t block_offset = GET_PAGE_IN_BLOCK(old_start_page);
+	base = find_free_pages(ALIGN_TO(block_offset + count, PAGES_PER_BLOCK), true);
+	if (base)
+		return base + block_offset;
+	return 0;
+}
+
+/* Extend map entry e by count pages in place, returns false if the pages are not free */
+static bool extend_map_entry(struct map_entry *e, size_t count)
+{
+	size_t start_page = e->end_page + 1;
+	struct rb_node *next = rb_next(&e->tree);
+	if (next && rb_entry(next, struct map_entry, tree)->start_page <= e->end_page + count)
+		return false;
+	/* Map the new pages as a separate entry, then merge it */
+	int flags = MAP_FIXED | ((e->flags & INTERNAL_MAP_SHARED)? MAP_SHARED: MAP_PRIVATE) | (e->f? 0: MAP_ANONYMOUS);
+	int internal_flags = INTERNAL_MAP_NOOVERWRITE | (e->flags & INTERNAL_MAP_NORESET);
+	void *addr = mmap_internal(GET_PAGE_ADDRESS(start_page), count * PAGE_SIZE, e->prot, flags, internal_flags,
+		e->f, e->offset_pages + start_page - e->start_page);
+	if ((uintptr_t)addr >= (uintptr_t)-PAGE_SIZE)
+		return false;
+	struct map_entry *ne = find_map_entry(addr);
+	if (ne == e)
+		return true; /* Merged by mmap_internal() */
+	rb_remove(&mm->entry_tree, &ne->tree);
+	if (ne->end_page != e->end_page + count)
+	{
+		/* The new entry was merged with the entry after it, give the new pages to e instead of
+		 * splitting it, which would need another map entry */
+		ne->start_page += count;
+		if (ne->f)
+			ne->offset_pages += count;
+		rb_add(&mm->entry_tree, &ne->tree, map_entry_cmp);
+	}
+	else
+	{
+		if (ne->f)
+			vfs_release(ne->f);
+		free_map_entry(ne);
+	}
+	rb_remove(&mm->entry_tree, &e->tree);
+	e->end_page += count;
+	rb_add(&mm->entry_tree, &e->tree, map_entry_cmp);
+	mm->maps_version++;
+	return true;
+}
+
+static void *mremap_internal(void *old_address, size_t old_size, size_t new_size, int flags, void *new_address)
+{
+	size_t old_start_page = GET_PAGE(old_address);
+	struct map_entry *e = find_map_entry(old_address);
+	if (!e || e->end_page < GET_PAGE((size_t)old_address + old_size - 1))
+		return (void*)-L_EFAULT;
+	if (new_size < old_size)
+	{
+		/* Shrink the mapping first */
+		int r = munmap_internal((char *)old_address + new_size, old_size - new_size);
+		if (r < 0)
+			return (void*)r;
+		old_size = new_size;
+		e = find_map_entry(old_address);
+	}
+	size_t old_pages = old_size / PAGE_SIZE;
+	size_t new_pages = new_size / PAGE_SIZE;
+	size_t old_end_page = old_start_page + old_pages - 1;
+	if (!(flags & MREMAP_FIXED))
+	{
+		if (new_pages == old_pages)
+			return old_address;
+		/* Try growing in place */
+		if (old_end_page == e->end_page && !(e->flags & INTERNAL_MAP_VIRTUALALLOC)
+			&& extend_map_entry(e, new_pages - old_pages))
+			return old_address;
+		if (!(flags & MREMAP_MAYMOVE))
+			return (void*)-L_ENOMEM;
+	}
+	/* The old pages are unmapped or made read only while being moved */
+	clear_page_permission(old_start_page, old_end_page);
+
+	if (e->flags & INTERNAL_MAP_VIRTUALALLOC)
+	{
+		/* VirtualAlloc()-ed memory can only be copied, and is always operated as a whole */
+		if (old_start_page != e->start_page || old_end_page != e->end_page)
+			return (void*)-L_EINVAL;
+		int large_pages = e->flags & INTERNAL_MAP_LARGE_PAGES;
+		if (!(flags & MREMAP_FIXED))
+		{
+			size_t page = large_pages? find_free_large_pages(new_pages): find_free_pages(new_pages, true);
+			if (!page)
+				return (void*)-L_ENOMEM;
+			new_address = GET_PAGE_ADDRESS(page);
+		}
+		else if (!IS_ALIGNED(new_address, mm->large_page_pages * PAGE_SIZE))
+			large_pages = 0;
+		void *r = mmap_internal(new_address, new_size, e->prot, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS,
+			INTERNAL_MAP_VIRTUALALLOC | large_pages | (e->flags & INTERNAL_MAP_NORESET), NULL, 0);
+		if ((uintptr_t)r >= (uintptr_t)-PAGE_SIZE)
+			return r;
+		copy_virtualalloc_range(old_start_page, old_end_page, GET_PAGE(new_address));
+		munmap_internal(old_address, old_size);
+		return new_address;
+	}
+
+	size_t new_start_page;
+	if (flags & MREMAP_FIXED)
+	{
+		int r = munmap_internal(new_address, new_size);
+		if (r < 0)
+			return (void*)r;
+		new_start_page = GET_PAGE(new_address);
+		/* munmap() may have split the entry */
+		e = find_map_entry(old_address);
+	}
+	else if (!(new_start_page = find_remap_free_pages(old_start_page, new_pages)))
+		return (void*)-L_ENOMEM;
+	size_t new_end_page = new_start_page + new_pages - 1;
+	size_t delta_pages = new_start_page - old_start_page;
+	bool movable = GET_PAGE_IN_BLOCK(new_start_page) == GET_PAGE_IN_BLOCK(old_start_page);
+	size_t delta_blocks = GET_BLOCK_OF_PAGE(new_start_page) - GET_BLOCK_OF_PAGE(old_start_page);
+	size_t start_block = GET_BLOCK_OF_PAGE(old_start_page);
+	size_t end_block = GET_BLOCK_OF_PAGE(old_end_page);
+
+	if (e->flags & INTERNAL_MAP_SHARED)
+	{
+		/* Copying would break the sharing, all loaded blocks must be moved */
+		if (!movable || old_start_page != e->start_page || old_end_page != e->end_page)
+		{
+			log_error("mremap(): Partial or misaligned move of MAP_SHARED mapping unsupported.");
+			return (void*)-L_EINVAL;
+		}
+		for (size_t i = start_block; i <= end_block; i++)
+		{
+			if (!get_section_handle(i))
+				continue;
+			size_t first_block, last_block;
+			get_section_chunk(i, &first_block, &last_block);
+			if (!can_move_section_chunk(first_block, last_block, delta_blocks, old_start_page, old_end_page, new_start_page, new_end_page))
+			{
+				log_error("mremap(): Target of MAP_SHARED mapping collides with other mappings.");
+				return (void*)-L_EINVAL;
+			}
+			i = last_block;
+		}
+	}
+
+	/* Create new map entry */
+	struct map_entry *ne = new_map_entry();
+	if (!ne)
+		return (void*)-L_ENOMEM;
+	ne->start_page = new_start_page;
+	ne->end_page = new_end_page;
+	if ((ne->f = e->f))
+		vfs_ref(ne->f);
+	ne->offset_pages = e->offset_pages + (old_start_page - e->start_page);
+	ne->prot = e->prot;
+	ne->flags = e->flags;
+	ne->shared_id = e->shared_id;
+	rb_add(&mm->entry_tree, &ne->tree, map_entry_cmp);
+	mm->maps_version++;
+
+	/* Move whole section chunks, copy what cannot be moved
+	 * Copying may fail, so all copies are made first while the old range is still intact. Moving
+	 * cannot fail, and only touches new blocks no copy has written to.
+	 */
+	for (size_t i = start_block; i <= end_block; i++)
+	{
+		size_t first_page = max(old_start_page, GET_FIRST_PAGE_OF_BLOCK(i));
+		size_t last_page = min(old_end_page, GET_LAST_PAGE_OF_BLOCK(i));
+		if (get_section_handle(i))
+		{
+			size_t first_block, last_block;
+			get_section_chunk(i, &first_block, &last_block);
+			if (movable && can_move_section_chunk(first_block, last_block, delta_blocks, old_start_page, old_end_page, new_start_page, new_end_page))
+			{
+				i = last_block;
+				continue;
+			}
+			last_page = min(old_end_page, GET_LAST_PAGE_OF_BLOCK(last_block));
+			mm->stats.remap_copied_blocks += (int)(GET_BLOCK_OF_PAGE(last_page) - i + 1);
+			i = GET_BLOCK_OF_PAGE(last_page);
+		}
+		if (!copy_remapped_pages(ne, first_page, last_page, delta_pages))
+		{
+			log_error("mremap(): Copying pages failed.");
+			munmap_internal(GET_PAGE_ADDRESS(new_start_page), new_size);
+			return (void*)-L_ENOMEM;
+		}
+	}
+	for (size_t i = start_block; movable && i <= end_block; i++)
+	{
+		if (!get_section_handle(i))
+			continue;
+		size_t first_block, last_block;
+		get_section_chunk(i, &first_block, &last_block);
+		if (can_move_section_chunk(first_block, last_block, delta_blocks, old_start_page, old_end_page, new_start_page, new_end_page))
+		{
+			move_section_chunk(e, first_block, last_block, delta_blocks);
+			mm->stats.remap_moved_blocks += (int)(last_block - first_block + 1);
+		}
+		i = last_block;
+	}
+
+	/* Set up grown pages which fall in loaded blocks */
+	size_t grow_start_page = new_start_page + old_pages;
+	if (grow_start_page <= new_end_page)
+	{
+		size_t grow_start_block = GET_BLOCK_OF_PAGE(grow_start_page);
+		size_t grow_end_block = GET_BLOCK_OF_PAGE(new_end_page);
+		for (size_t i = grow_start_block; i <= grow_end_block; i++)
+		{
+			HANDLE handle = get_section_handle(i);
+			/* A file section view already has the content */
+			if (!handle || is_file_section(handle))
+				continue;
+			size_t first_page = max(grow_start_page, GET_FIRST_PAGE_OF_BLOCK(i));
+			size_t last_page = min(new_end_page, GET_LAST_PAGE_OF_BLOCK(i));
+			if (prepare_block_pages(ne, i, first_page, last_page, true))
+			{
+				DWORD oldProtect;
+				VirtualProtect(GET_PAGE_ADDRESS(first_page), (last_page - first_page + 1) * PAGE_SIZE, prot_linux2win(ne->prot), &oldProtect);
+			}
+		}
+		if (ne->flags & INTERNAL_MAP_SHARED)
+			populate_map_entry_blocks(ne, grow_start_block, grow_end_block);
+	}
+
+	munmap_internal(old_address, old_size);
+	log_info("Remapped memory: [%p, %p) -> [%p, %p)", old_address, (size_t)old_address + old_size,
+		GET_PAGE_ADDRESS(new_start_page), GET_PAGE_ADDRESS(new_end_page + 1));
+	return GET_PAGE_ADDRESS(new_start_page);
+}
+
 DEFINE_SYSCALL(mremap, void *, old_address, size_t, old_size, size_t, new_size, int, flags, void *, new_address)
 {
 	log_info("mremap(old_address=%p, old_size=%p, new_size=%p, flags=%x, new_address=%p)", old_address, old_size, new_size, flags, new_address);
-	log_error("mremap() not implemented.");
-	return -L_ENOSYS;
+	if (!IS_ALIGNED(old_address, PAGE_SIZE))
+		return -L_EINVAL;
+	if ((flags & ~(MREMAP_MAYMOVE | MREMAP_FIXED)) || ((flags & MREMAP_FIXED) && !(flags & MREMAP_MAYMOVE)))
+		return -L_EINVAL;
+	old_size = ALIGN_TO_PAGE(old_size);
+	new_size = ALIGN_TO_PAGE(new_size);
+	if (old_size == 0)
+	{
+		/* Duplicating a MAP_SHARED mapping */
+		log_error("mremap() with old_size 0 not supported.");
+		return -L_EINVAL;
+	}
+	if (new_size == 0)
+		return -L_EINVAL;
+	if ((size_t)old_address < ADDRESS_SPACE_LOW || (size_t)old_address + old_size > address_space_high
+		|| (size_t)old_address + old_size < (size_t)old_address)
+		return -L_EFAULT;
+	if (flags & MREMAP_FIXED)
+	{
+		if (!IS_ALIGNED(new_address, PAGE_SIZE))
+			return -L_EINVAL;
+		if ((size_t)new_address < ADDRESS_SPACE_LOW || (size_t)new_address + new_size >= address_space_high
+			|| (size_t)new_address + new_size < (size_t)new_address)
+			return -L_EINVAL;
+		/* The old and new ranges must not overlap */
+		if ((size_t)new_address < (size_t)old_address + old_size && (size_t)old_address < (size_t)new_address + new_size)
+			return -L_EINVAL;
+		if (overlaps_shared_heap_window((size_t)new_address, new_size))
+			return -L_ENOMEM;
+	}
+	AcquireSRWLockExclusive(&mm->rw_lock);
+	void *r = mremap_internal(old_address, old_size, new_size, flags, new_address);
+	ReleaseSRWLockExclusive(&mm->rw_lock);
+	return (intptr_t)r;
+}
+
+/* Replace committed pages of a VirtualAlloc()-ed range with fresh zero pages */
+static void reset_virtualalloc_range(size_t start_page, size_t end_page)
+{
+	size_t current = start_page;
+	while (current <= end_page)
+	{
+		MEMORY_BASIC_INFORMATION info;
+		if (!VirtualQuery(GET_PAGE_ADDRESS(current), &info, sizeof(info)))
+		{
+			log_error("VirtualQuery(%p) failed, error code: %d", GET_PAGE_ADDRESS(current), GetLastError());
+			return;
+		}
+		size_t last_page = min(end_page, GET_PAGE((size_t)info.BaseAddress + info.RegionSize) - 1);
+		size_t size = (last_page - current + 1) * PAGE_SIZE;
+		if (info.State == MEM_COMMIT)
+		{
+			VirtualFree(GET_PAGE_ADDRESS(current), size, MEM_DECOMMIT);
+			if (!VirtualAlloc(GET_PAGE_ADDRESS(current), size, MEM_COMMIT, info.Protect))
+				log_error("VirtualAlloc(%p, %p) failed, error code: %d", GET_PAGE_ADDRESS(current), size, GetLastError());
+		}
+		current = last_page + 1;
+	}
+}
+
+/* Reload pages [start_page, end_page] inside one block of a private map entry from its backing */
+static void reload_block_pages(struct map_entry *e, size_t block, size_t start_page, size_t end_page)
+{
+	if (!take_block_ownership(block))
+		return;
+	load_detached_block(block);
+	DWORD oldProtect;
+	VirtualProtect(GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE, prot_linux2win(e->prot | PROT_WRITE), &oldProtect);
+	map_entry_range(e, start_page, end_page);
+	if ((e->prot & PROT_WRITE) == 0)
+		VirtualProtect(GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE, prot_linux2win(e->prot), &oldProtect);
+}
+
+/* MADV_DONTNEED: Private pages are zero filled or reloaded from file on next access */
+static void madvise_dontneed(struct map_entry *e, size_t start_page, size_t end_page)
+{
+	if (e->flags & INTERNAL_MAP_SHARED)
+	{
+		/* Content must be kept, only remove the pages from working set */
+		VirtualUnlock(GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE);
+		return;
+	}
+	if (e->prot & PROT_EXEC)
+		dbt_code_changed((size_t)GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE);
+	if (e->flags & INTERNAL_MAP_LARGE_PAGES)
+	{
+		/* Large pages cannot be decommitted */
+		RtlZeroMemory(GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE);
+		return;
+	}
+	if (e->flags & INTERNAL_MAP_VIRTUALALLOC)
+	{
+		reset_virtualalloc_range(start_page, end_page);
+		return;
+	}
+	/* Blocks fully inside the range are released and loaded afresh on demand */
+	size_t start_block = GET_BLOCK_OF_PAGE(start_page);
+	size_t end_block = GET_BLOCK_OF_PAGE(end_page);
+	size_t full_start_block = GET_BLOCK_OF_PAGE(start_page + PAGES_PER_BLOCK - 1);
+	size_t full_end_block = GET_BLOCK_OF_PAGE(end_page + 1); /* Exclusive */
+	if (full_start_block < full_end_block)
+		free_block_range(full_start_block, full_end_block - 1);
+	/* Partial blocks at both ends are reloaded in place */
+	if (start_block < full_start_block && get_section_handle(start_block))
+		reload_block_pages(e, start_block, start_page, min(end_page, GET_LAST_PAGE_OF_BLOCK(start_block)));
+	if (end_block >= full_end_block && end_block != start_block && get_section_handle(end_block))
+		reload_block_pages(e, end_block, GET_FIRST_PAGE_OF_BLOCK(end_block), end_page);
+}
+
+/* MADV_FREE: Let the system discard anonymous private pages instead of paging them out */
+static void madvise_free(struct map_entry *e, size_t start_page, size_t end_page)
+{
+	if (e->f || (e->flags & (INTERNAL_MAP_SHARED | INTERNAL_MAP_PRIVATE_COPY)))
+		return;
+	if (e->flags & INTERNAL_MAP_VIRTUALALLOC)
+	{
+		win7compat_DiscardVirtualMemory(GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE);
+		return;
+	}
+	/* Pages of sections still shared by a forked process must be kept */
+	size_t start_block = GET_BLOCK_OF_PAGE(start_page);
+	size_t end_block = GET_BLOCK_OF_PAGE(end_page);
+	for (size_t i = start_block; i <= end_block; i++)
+	{
+		if (!get_section_handle(i))
+			continue;
+		size_t first_block, last_block;
+		get_section_chunk(i, &first_block, &last_block);
+		if (!is_section_shared(i))
+		{
+			size_t first_page = max(start_page, GET_FIRST_PAGE_OF_BLOCK(i));
+			size_t last_page = min(end_page, GET_LAST_PAGE_OF_BLOCK(last_block));
+			/* Fails silently if the section is detached */
+			win7compat_DiscardVirtualMemory(GET_PAGE_ADDRESS(first_page), (last_page - first_page + 1) * PAGE_SIZE);
+		}
+		i = last_block;
+	}
+}
+
+/* MADV_WILLNEED: Read in file content now and prefetch the pages */
+static void madvise_willneed(struct map_entry *e, size_t start_page, size_t end_page)
+{
+	if (e->f && !(e->flags & INTERNAL_MAP_SHARED))
+		mm_populate_internal(GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE);
+	win7compat_PrefetchVirtualMemory(GET_PAGE_ADDRESS(start_page), (end_page - start_page + 1) * PAGE_SIZE);
+}
+
+/* MADV_HUGEPAGE: Move the large page aligned part of an untouched anonymous region to large pages */
+static void madvise_hugepage(struct map_entry *e, size_t start_page, size_t end_page)
+{
+	if (e->f || (e->flags & (INTERNAL_MAP_SHARED | INTERNAL_MAP_VIRTUALALLOC | INTERNAL_MAP_PRIVATE_COPY))
+		|| e->prot != (PROT_READ | PROT_WRITE) || !get_large_page_pages())
+		return;
+	size_t large_pages = mm->large_page_pages;
+	size_t first_page = ALIGN_TO(start_page, large_pages);
+	size_t last_page = ((end_page + 1) & -large_pages) - 1;
+	if (first_page > last_page || last_page == (size_t)-1)
+		return;
+	/* Pages already allocated in sections are left where they are */
+	for (size_t i = GET_BLOCK_OF_PAGE(first_page); i <= GET_BLOCK_OF_PAGE(last_page); i++)
+		if (get_section_handle(i))
+			return;
+	/* Split first, an entry left split by a failure later is harmless */
+	if (first_page > e->start_page)
+	{
+		if (!split_map_entry(e, first_page - 1))
+			return;
+		e = find_map_entry(GET_PAGE_ADDRESS(first_page));
+	}
+	if (last_page < e->end_page && !split_map_entry(e, last_page))
+		return;
+	if (!allocate_large_pages(first_page, last_page))
+		return;
+	/* The entry is block aligned already, no need to update subtree_next_page */
+	e->flags |= INTERNAL_MAP_VIRTUALALLOC | INTERNAL_MAP_LARGE_PAGES;
+	set_page_permission(first_page, last_page, e->prot);
 }
 
 DEFINE_SYSCALL(madvise, void *, addr, size_t, length, int, advise)
 {
 	log_info("madvise(%p, %p, %x)", addr, length, advise);
-	/* Notes behaviour-changing advices, other non-critical advises are ignored for now */
-	if (advise & MADV_DONTFORK)
+	if (!IS_ALIGNED(addr, PAGE_SIZE))
+		return -L_EINVAL;
+	length = ALIGN_TO_PAGE(length);
+	if ((size_t)addr < ADDRESS_SPACE_LOW || (size_t)addr >= address_space_high
+		|| (size_t)addr + length < ADDRESS_SPACE_LOW || (size_t)addr + length >= address_space_high
+		|| (size_t)addr + length < (size_t)addr)
+		return -L_EINVAL;
+	if (length == 0)
+		return 0;
+	void (*handler)(struct map_entry *e, size_t start_page, size_t end_page);
+	switch (advise)
+	{
+	case MADV_DONTNEED: handler = madvise_dontneed; break;
+	case MADV_FREE: handler = madvise_free; break;
+	case MADV_WILLNEED: handler = madvise_willneed; break;
+	case MADV_HUGEPAGE: handler = madvise_hugepage; break;
+	case MADV_DONTFORK:
+		/* Notes behaviour-changing advices, other non-critical advises are ignored for now */
 		log_error("MADV_DONTFORK not supported.");
+		return 0;
+	default:
+		return 0;
+	}
+
+	AcquireSRWLockExclusive(&mm->rw_lock);
+	size_t start_page = GET_PAGE(addr);
+	size_t end_page = GET_PAGE((size_t)addr + length - 1);
+	size_t last_page = start_page - 1;
+	for (struct rb_node *cur = start_node(start_page); cur; cur = rb_next(cur))
+	{
+		struct map_entry *e = rb_entry(cur, struct map_entry, tree);
+		if (end_page < e->start_page)
+			break;
+		size_t range_start = max(start_page, e->start_page);
+		size_t range_end = min(end_page, e->end_page);
+		if (range_start > range_end)
+			continue;
+		if (range_start == last_page + 1)
+			last_page = range_end;
+		/* Internal memory of flinux is never touched */
+		if (!(e->flags & INTERNAL_MAP_NORESET))
+			handler(e, range_start, range_end);
+	}
+	ReleaseSRWLockExclusive(&mm->rw_lock);
+	/* Linux reports unmapped pages in the range after applying the advice to mapped ones */
+	if (last_page != end_page)
+		return -L_ENOMEM;
 	return 0;
 }
 
+/* Map pages [start, end) for the program break, they are merged into the heap entry before them */
+static bool map_brk_range(size_t start, size_t end)
+{
+	void *r = mmap_internal((void *)start, end - start, PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE, INTERNAL_MAP_NOOVERWRITE, NULL, 0);
+	return (uintptr_t)r < (uintptr_t)-PAGE_SIZE;
+}
+
+/* The program break is mapped ahead in steps of this size, moving the break inside the mapped
+ * pages needs no mapping operation. The pages are demand zero, untouched ones cost nothing. */
+#define MM_BRK_RESERVE_SIZE		0x00100000
+
 DEFINE_SYSCALL(brk, void *, addr)
 {
 	log_info("brk(%p)", addr);
 	log_info("Last brk: %p", mm->brk);
 	AcquireSRWLockExclusive(&mm->rw_lock);
 	size_t brk = ALIGN_TO_PAGE(mm->brk);
+	size_t brk_end = max(brk, (size_t)mm->brk_end);
 	addr = (void*)ALIGN_TO_PAGE(addr);
 	if (addr > 0 && addr < mm->brk)
 	{
-		if (munmap_internal(addr, (size_t)brk - (size_t)addr) < 0)
+		/* Also unmap the pages mapped ahead, pages regrown later must be zero */
+		if (munmap_internal(addr, brk_end - (size_t)addr) < 0)
 		{
 			log_error("Shrink brk failed.");
 			goto out;
 		}
 		mm->brk = addr;
+		mm->brk_end = addr;
 	}
 	else if (addr > mm->brk)
 	{
-		int r = (int)mmap_internal((void *)brk, (size_t)addr - (size_t)brk, PROT_READ | PROT_WRITE | PROT_EXEC,
-			MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE, INTERNAL_MAP_NOOVERWRITE, NULL, 0);
-		if (r < 0)
+		if ((size_t)addr > brk_end)
 		{
-			log_error("Enlarge brk failed.");
-			goto out;
+			size_t end = ALIGN_TO((size_t)addr, MM_BRK_RESERVE_SIZE);
+			if (!map_brk_range(brk_end, end))
+			{
+				/* Something is mapped right after the break, only map what is asked */
+				end = (size_t)addr;
+				if (!map_brk_range(brk_end, end))
+				{
+					log_error("Enlarge brk failed.");
+					goto out;
+				}
+			}
+			mm->brk_end = (void*)end;
 		}
 		mm->brk = addr;
 	}
@@ -55,6 +55,9 @@
 #define INTERNAL_MAP_NORESET		4	/* Don't unmap the memory region at mm_reset() */
 #define INTERNAL_MAP_VIRTUALALLOC	8	/* This will cause the memory region to be allocated via VirtualAlloc() */
 #define INTERNAL_MAP_SHARED			16	/* A MAP_SHARED memory region */
+#define INTERNAL_MAP_PRIVATE_COPY	32	/* Map entry only: may contain private copy-on-write pages not backed by sections */
+#define INTERNAL_MAP_LARGE_PAGES	64	/* With INTERNAL_MAP_VIRTUALALLOC: allocate in separate pieces of large page size, using large pages if possible */
+#define INTERNAL_MAP_WRITE_WATCH	128	/* Map entry only: VirtualAlloc()-ed with MEM_WRITE_WATCH, pages never written to are zero */
 /* Macro to test if the given internal flags require block aligned memory region to be allocated */
 #define BLOCK_ALIGNED(flag)			((flag & INTERNAL_MAP_VIRTUALALLOC) || (flag & INTERNAL_MAP_SHARED))
 
@@ -63,19 +66,40 @@ void mm_init_global_shared();
 void mm_reset();
 void mm_shutdown();
 void mm_update_brk(void *brk);
+/* Check if translated code of [pc, end_pc) may be kept on execve(), called by dbt_reset() */
+bool mm_is_code_retained(size_t pc, size_t end_pc);
+/* Write protect the pages code of [pc, end_pc) is translated from, a write to them invalidates the translations */
+void mm_protect_code(size_t pc, size_t end_pc);
 
 void mm_dump_stack_trace(PCONTEXT context);
 void mm_dump_windows_memory_mappings(HANDLE process);
 void mm_dump_memory_mappings();
+/* Get a counter which changes whenever the output of mm_get_maps() may change */
+uint32_t mm_get_maps_version();
 int mm_get_maps(char *buf);
+int mm_get_smaps(char *buf);
+int mm_get_stats(char *buf);
+/* Get total size and resident size of all mappings in bytes */
+void mm_get_usage(size_t *vm_size, size_t *vm_rss);
 
 /* Check if the memory region is compatible with desired access */
 int mm_check_read(const void *addr, size_t size);
 int mm_check_read_string(const char *addr);
 int mm_check_write(void *addr, size_t size);
 
-int mm_handle_page_fault(void *addr, bool is_write);
-int mm_fork(HANDLE process);
+/* Get the identity of a MAP_SHARED memory location which is the same in all processes mapping it
+ * Returns false if the address is not in a MAP_SHARED region
+ */
+bool mm_get_shared_key(const void *addr, uint64_t *object, uint64_t *offset);
+
+/* Access types of page faults, same as the first parameter of EXCEPTION_ACCESS_VIOLATION */
+#define PAGE_FAULT_READ		0
+#define PAGE_FAULT_WRITE	1
+#define PAGE_FAULT_EXECUTE	8
+int mm_handle_page_fault(void *addr, int access);
+int mm_fork(HANDLE process, bool vfork);
+/* Get number of section handles and bytes transferred to the child by the last mm_fork() */
+void mm_get_fork_transfer(size_t *sections, size_t *bytes);
 void mm_afterfork_parent();
 void mm_afterfork_child();
 
@@ -83,6 +107,7 @@ size_t mm_find_free_pages(size_t count_bytes);
 struct file;
 void *mm_mmap(void *addr, size_t len, int prot, int flags, int internal_flags, struct file *f, off_t offset_pages);
 int mm_munmap(void *addr, size_t len);
+int mm_mprotect(void *addr, size_t len, int prot);
 
 /* Populate a memory region containing given address */
 void mm_populate(void *addr);
@@ -0,0 +1,483 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define LOG_CATEGORY LOG_CAT_PROCESS
+
+#include <common/fadvise.h>
+#include <common/fcntl.h>
+#include <fs/winfs.h>
+#include <syscall/mm.h>
+#include <syscall/prefetch.h>
+#include <syscall/timer.h>
+#include <syscall/vfs.h>
+#include <flags.h>
+#include <log.h>
+#include <shared.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <ntdll.h>
+#include <string.h>
+
+#define PREFETCH_WINDOW_MS		1000
+#define PREFETCH_PROFILE_COUNT	32
+#define PREFETCH_FILE_COUNT		32
+#define PREFETCH_RANGE_COUNT	16
+#define PREFETCH_PATH_MAX		256
+/* Bytes prefetched from files which are opened but not mapped, they are usually read() whole */
+#define PREFETCH_READ_AHEAD		0x40000
+/* Profiles are saved in this file in the root directory, see prefetch_load() */
+#define PREFETCH_STORE_NAME		L"\\.flinux-prefetch"
+#define PREFETCH_STORE_MAGIC	0x48435046 /* FPCH */
+#define PREFETCH_STORE_VERSION	1
+
+/* A run of file blocks */
+struct prefetch_range
+{
+	uint32_t block, count;
+};
+
+struct prefetch_file
+{
+	char path[PREFETCH_PATH_MAX];
+	int range_count;
+	struct prefetch_range ranges[PREFETCH_RANGE_COUNT];
+};
+
+struct prefetch_profile
+{
+	/* Try lock, a profile held by another process is skipped instead of waited on. If the holder
+	 * dies in between the slot is lost for the session, no worse than a full table. */
+	volatile LONG lock;
+	LONG stamp; /* Last use, the least recently used profile is replaced */
+	char path[PREFETCH_PATH_MAX]; /* Executable, always null terminated */
+	uint64_t exe_size, exe_mtime; /* The profile is dropped if the executable changes */
+	int file_count;
+	struct prefetch_file files[PREFETCH_FILE_COUNT];
+};
+
+struct prefetch_data
+{
+	volatile LONG clock;
+	struct prefetch_profile profiles[PREFETCH_PROFILE_COUNT];
+};
+
+/* Header of the store, followed by the profile slots in the order of prefetch_data */
+struct prefetch_store_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t profile_size;
+	uint32_t profile_count;
+};
+
+/* Process local state, reinitialized when the process id changes, i.e. in a forked child */
+static SRWLOCK prefetch_init_lock = SRWLOCK_INIT;
+static DWORD prefetch_pid;
+static struct prefetch_data *prefetch;
+
+/* Recording state, forked children start with a fresh copy of it and do not record
+ * The recorded files are referenced so a file pointer cannot be reused by another file in the
+ * meantime, fork_process() calls prefetch_finish() first to not leak the references to the child.
+ */
+bool prefetch_recording;
+static SRWLOCK prefetch_lock = SRWLOCK_INIT;
+static uint64_t prefetch_deadline;
+static struct prefetch_profile prefetch_current;
+static struct file *prefetch_files[PREFETCH_FILE_COUNT];
+
+/* Open the store in the root directory, returns NULL on failure */
+static HANDLE prefetch_open_store()
+{
+	struct mount_point *mp = vfs_get_root_mountpoint();
+	WCHAR path[MAX_PATH + 32];
+	int len = mp->win_path_len;
+	if (len > 0 && mp->win_path[len - 1] == L'\\')
+		len--;
+	memcpy(path, mp->win_path, len * sizeof(WCHAR));
+	wcscpy(path + len, PREFETCH_STORE_NAME);
+	UNICODE_STRING name;
+	RtlInitUnicodeString(&name, path);
+	OBJECT_ATTRIBUTES oa;
+	InitializeObjectAttributes(&oa, &name, 0, NULL, NULL);
+	HANDLE handle;
+	IO_STATUS_BLOCK status_block;
+	NTSTATUS status = NtCreateFile(&handle, GENERIC_READ | GENERIC_WRITE | SYNCHRONIZE, &oa, &status_block, NULL,
+		FILE_ATTRIBUTE_HIDDEN, FILE_SHARE_READ | FILE_SHARE_WRITE, FILE_OPEN_IF,
+		FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT, NULL, 0);
+	if (!NT_SUCCESS(status))
+	{
+		log_warning("Opening prefetch store failed, status: %x", status);
+		return NULL;
+	}
+	return handle;
+}
+
+/* Check a profile read from the store, it may be torn by concurrent writers or from an older build */
+static bool prefetch_valid_profile(const struct prefetch_profile *profile)
+{
+	if (!memchr(profile->path, 0, PREFETCH_PATH_MAX) || profile->file_count < 0 || profile->file_count > PREFETCH_FILE_COUNT)
+		return false;
+	for (int i = 0; i < profile->file_count; i++)
+	{
+		const struct prefetch_file *pf = &profile->files[i];
+		if (!memchr(pf->path, 0, PREFETCH_PATH_MAX) || pf->range_count < 0 || pf->range_count > PREFETCH_RANGE_COUNT)
+			return false;
+	}
+	return true;
+}
+
+/* Fill a newly created section from the store, so profiles outlive the session
+ * Slots are locked while being filled, a process of the session which opened the section in the
+ * meantime skips them like any profile in use.
+ */
+static void prefetch_load()
+{
+	HANDLE handle = prefetch_open_store();
+	if (!handle)
+		return;
+	struct prefetch_store_header header;
+	IO_STATUS_BLOCK status_block;
+	LARGE_INTEGER offset;
+	offset.QuadPart = 0;
+	NTSTATUS status = NtReadFile(handle, NULL, NULL, NULL, &status_block, &header, sizeof(header), &offset, NULL);
+	if (!NT_SUCCESS(status) || status_block.Information != sizeof(header) || header.magic != PREFETCH_STORE_MAGIC
+		|| header.version != PREFETCH_STORE_VERSION || header.profile_size != sizeof(struct prefetch_profile)
+		|| header.profile_count != PREFETCH_PROFILE_COUNT)
+	{
+		/* Missing or incompatible, start over */
+		header.magic = PREFETCH_STORE_MAGIC;
+		header.version = PREFETCH_STORE_VERSION;
+		header.profile_size = sizeof(struct prefetch_profile);
+		header.profile_count = PREFETCH_PROFILE_COUNT;
+		FILE_END_OF_FILE_INFORMATION eof;
+		eof.EndOfFile.QuadPart = 0;
+		NtSetInformationFile(handle, &status_block, &eof, sizeof(eof), FileEndOfFileInformation);
+		NtWriteFile(handle, NULL, NULL, NULL, &status_block, &header, sizeof(header), &offset, NULL);
+		NtClose(handle);
+		return;
+	}
+	int loaded = 0;
+	for (int i = 0; i < PREFETCH_PROFILE_COUNT; i++)
+	{
+		struct prefetch_profile *profile = &prefetch->profiles[i];
+		if (InterlockedCompareExchange(&profile->lock, 1, 0) != 0)
+			continue;
+		offset.QuadPart = sizeof(header) + (LONGLONG)i * sizeof(struct prefetch_profile);
+		status = NtReadFile(handle, NULL, NULL, NULL, &status_block, profile, sizeof(struct prefetch_profile), &offset, NULL);
+		if (NT_SUCCESS(status) && status_block.Information == sizeof(struct prefetch_profile) && prefetch_valid_profile(profile))
+		{
+			profile->stamp = 0;
+			if (profile->path[0])
+				loaded++;
+		}
+		else
+			memset(profile, 0, sizeof(struct prefetch_profile));
+		InterlockedExchange(&profile->lock, 0);
+	}
+	NtClose(handle);
+	log_info("Loaded %d startup profiles.", loaded);
+}
+
+/* Write a published profile to its slot in the store */
+static void prefetch_save(int slot, const struct prefetch_profile *profile)
+{
+	HANDLE handle = prefetch_open_store();
+	if (!handle)
+		return;
+	IO_STATUS_BLOCK status_block;
+	LARGE_INTEGER offset;
+	offset.QuadPart = sizeof(struct prefetch_store_header) + (LONGLONG)slot * sizeof(struct prefetch_profile);
+	/* Unused file entries are written too, the slot has a fixed size */
+	NTSTATUS status = NtWriteFile(handle, NULL, NULL, NULL, &status_block, (PVOID)profile, sizeof(struct prefetch_profile), &offset, NULL);
+	if (!NT_SUCCESS(status))
+		log_warning("Writing prefetch store failed, status: %x", status);
+	NtClose(handle);
+}
+
+static bool prefetch_init()
+{
+	DWORD pid = GetCurrentProcessId();
+	if (prefetch_pid == pid)
+		return true;
+	AcquireSRWLockExclusive(&prefetch_init_lock);
+	if (prefetch_pid != pid)
+	{
+		/* The section handle is inherited from the parent if it opened it before fork() */
+		NTSTATUS status;
+		HANDLE section;
+		bool created = false;
+		if (!(section = shared_get_handle(SHARED_HANDLE_PREFETCH_SECTION)))
+		{
+			UNICODE_STRING name;
+			RtlInitUnicodeString(&name, L"prefetch");
+			OBJECT_ATTRIBUTES oa;
+			InitializeObjectAttributes(&oa, &name, OBJ_INHERIT | OBJ_OPENIF, shared_get_object_directory(), NULL);
+			LARGE_INTEGER size;
+			size.QuadPart = sizeof(struct prefetch_data);
+			status = NtCreateSection(&section, SECTION_MAP_READ | SECTION_MAP_WRITE, &oa, &size,
+				PAGE_READWRITE, SEC_COMMIT, NULL);
+			if (!NT_SUCCESS(status))
+			{
+				log_error("NtCreateSection() failed, status: %x", status);
+				ReleaseSRWLockExclusive(&prefetch_init_lock);
+				return false;
+			}
+			created = status != STATUS_OBJECT_NAME_EXISTS;
+			section = shared_set_handle(SHARED_HANDLE_PREFETCH_SECTION, section);
+		}
+		PVOID view = NULL;
+		SIZE_T view_size = sizeof(struct prefetch_data);
+		status = NtMapViewOfSection(section, NtCurrentProcess(), &view, 0, view_size, NULL, &view_size,
+			ViewUnmap, MEM_TOP_DOWN, PAGE_READWRITE);
+		if (!NT_SUCCESS(status))
+		{
+			log_error("NtMapViewOfSection() failed, status: %x", status);
+			ReleaseSRWLockExclusive(&prefetch_init_lock);
+			return false;
+		}
+		prefetch = (struct prefetch_data *)view;
+		if (created)
+			prefetch_load();
+		prefetch_pid = pid;
+	}
+	ReleaseSRWLockExclusive(&prefetch_init_lock);
+	return true;
+}
+
+/* Lock the profile of an executable, NULL if it is not found or in use
+ * With create, the least recently used profile is taken over if there is none for path.
+ * A profile recorded for another size or modification time of the executable is not returned
+ * without create, and is emptied with it.
+ */
+static struct prefetch_profile *prefetch_lock_profile(const char *path, uint64_t exe_size, uint64_t exe_mtime, bool create)
+{
+	struct prefetch_profile *found = NULL, *victim = NULL;
+	for (int i = 0; i < PREFETCH_PROFILE_COUNT; i++)
+	{
+		struct prefetch_profile *profile = &prefetch->profiles[i];
+		if (!strcmp(profile->path, path))
+		{
+			found = profile;
+			break;
+		}
+		if (!victim || profile->stamp - victim->stamp < 0)
+			victim = profile;
+	}
+	struct prefetch_profile *profile = found ? found : victim;
+	if ((!found && !create) || InterlockedCompareExchange(&profile->lock, 1, 0) != 0)
+		return NULL;
+	/* Check again under the lock, another process may have taken the slot over */
+	if (strcmp(profile->path, path) || profile->exe_size != exe_size || profile->exe_mtime != exe_mtime)
+	{
+		if (!create)
+		{
+			InterlockedExchange(&profile->lock, 0);
+			return NULL;
+		}
+		profile->file_count = 0;
+	}
+	profile->stamp = InterlockedIncrement(&prefetch->clock);
+	return profile;
+}
+
+static void prefetch_unlock_profile(struct prefetch_profile *profile)
+{
+	InterlockedExchange(&profile->lock, 0);
+}
+
+/* Copy the header and the used file entries of a profile */
+static void prefetch_copy_profile(struct prefetch_profile *dst, const struct prefetch_profile *src)
+{
+	strcpy(dst->path, src->path);
+	dst->exe_size = src->exe_size;
+	dst->exe_mtime = src->exe_mtime;
+	dst->file_count = src->file_count;
+	memcpy(dst->files, src->files, src->file_count * sizeof(struct prefetch_file));
+}
+
+/* Publish the current profile and release the recorded files, caller holds prefetch_lock */
+static void prefetch_stop()
+{
+	prefetch_recording = false;
+	struct prefetch_profile *profile = prefetch_lock_profile(prefetch_current.path,
+		prefetch_current.exe_size, prefetch_current.exe_mtime, true);
+	if (profile)
+	{
+		prefetch_copy_profile(profile, &prefetch_current);
+		prefetch_unlock_profile(profile);
+		prefetch_save((int)(profile - prefetch->profiles), &prefetch_current);
+		log_info("Recorded %d files in the startup profile of %s.", prefetch_current.file_count, prefetch_current.path);
+	}
+	for (int i = 0; i < prefetch_current.file_count; i++)
+	{
+		vfs_release(prefetch_files[i]);
+		prefetch_files[i] = NULL;
+	}
+}
+
+/* Stop recording when the window is over, caller holds prefetch_lock */
+static bool prefetch_check_window()
+{
+	if (!prefetch_recording)
+		return false;
+	if (timer_monotonic_ms() < prefetch_deadline)
+		return true;
+	prefetch_stop();
+	return false;
+}
+
+void prefetch_finish()
+{
+	if (!prefetch_recording)
+		return;
+	AcquireSRWLockExclusive(&prefetch_lock);
+	if (prefetch_recording)
+		prefetch_stop();
+	ReleaseSRWLockExclusive(&prefetch_lock);
+}
+
+/* Open the files of a profile and let the memory manager read the recorded blocks ahead */
+static void prefetch_replay(const struct prefetch_profile *profile)
+{
+	for (int i = 0; i < profile->file_count; i++)
+	{
+		const struct prefetch_file *pf = &profile->files[i];
+		struct file *f;
+		if (vfs_openat(AT_FDCWD, pf->path, O_RDONLY, 0, 0, &f) < 0)
+			continue;
+		if (f->op_vtable->fadvise)
+		{
+			if (pf->range_count == 0)
+				f->op_vtable->fadvise(f, 0, PREFETCH_READ_AHEAD, POSIX_FADV_WILLNEED);
+			for (int j = 0; j < pf->range_count; j++)
+				f->op_vtable->fadvise(f, (loff_t)pf->ranges[j].block * BLOCK_SIZE, (loff_t)pf->ranges[j].count * BLOCK_SIZE, POSIX_FADV_WILLNEED);
+		}
+		vfs_release(f);
+	}
+	log_info("Prefetched %d files of the startup profile of %s.", profile->file_count, profile->path);
+}
+
+/* Add a file to the current profile, caller holds prefetch_lock */
+static void prefetch_add_file(const char *path, struct file *f)
+{
+	int count = prefetch_current.file_count;
+	if (count == PREFETCH_FILE_COUNT)
+		return;
+	for (int i = 0; i < count; i++)
+		if (prefetch_files[i] == f || !strcmp(prefetch_current.files[i].path, path))
+			return;
+	struct prefetch_file *pf = &prefetch_current.files[count];
+	strcpy(pf->path, path);
+	pf->range_count = 0;
+	vfs_ref(f);
+	prefetch_files[count] = f;
+	prefetch_current.file_count++;
+}
+
+void prefetch_exec(struct file *f)
+{
+	prefetch_finish();
+	if (!cmdline_flags->exec_prefetch || !f->op_vtable->getpath || !prefetch_init())
+		return;
+	char path[PATH_MAX];
+	int len = f->op_vtable->getpath(f, path);
+	if (len <= 0 || len >= PREFETCH_PATH_MAX)
+		return;
+	path[len] = 0;
+	struct newstat st;
+	if (!f->op_vtable->stat || f->op_vtable->stat(f, &st) < 0)
+		return;
+	uint64_t exe_mtime = st.st_mtime * 1000000000ULL + st.st_mtime_nsec;
+	AcquireSRWLockExclusive(&prefetch_lock);
+	/* The profile is copied out first, replaying it may take a while */
+	struct prefetch_profile *profile = prefetch_lock_profile(path, st.st_size, exe_mtime, false);
+	if (profile)
+	{
+		prefetch_copy_profile(&prefetch_current, profile);
+		prefetch_unlock_profile(profile);
+		prefetch_replay(&prefetch_current);
+	}
+	strcpy(prefetch_current.path, path);
+	prefetch_current.exe_size = st.st_size;
+	prefetch_current.exe_mtime = exe_mtime;
+	prefetch_current.file_count = 0;
+	prefetch_add_file(path, f);
+	prefetch_deadline = timer_monotonic_ms() + PREFETCH_WINDOW_MS;
+	prefetch_recording = true;
+	ReleaseSRWLockExclusive(&prefetch_lock);
+}
+
+void prefetch_record_open(const char *path, int flags, struct file *f)
+{
+	if (!prefetch_recording)
+		return;
+	/* Only files opened for reading are worth prefetching */
+	if ((flags & (O_ACCMODE | O_CREAT | O_DIRECTORY)) != O_RDONLY || !winfs_is_winfile(f) || strlen(path) >= PREFETCH_PATH_MAX)
+		return;
+	AcquireSRWLockExclusive(&prefetch_lock);
+	if (prefetch_check_window())
+		prefetch_add_file(path, f);
+	ReleaseSRWLockExclusive(&prefetch_lock);
+}
+
+/* Add a block to the ranges of a file, extending an adjacent range if possible */
+static void prefetch_add_block(struct prefetch_file *pf, uint32_t block)
+{
+	for (int i = 0; i < pf->range_count; i++)
+	{
+		struct prefetch_range *range = &pf->ranges[i];
+		if (block >= range->block && block < range->block + range->count)
+			return;
+		if (block == range->block + range->count)
+		{
+			range->count++;
+			return;
+		}
+		if (block + 1 == range->block)
+		{
+			range->block--;
+			range->count++;
+			return;
+		}
+	}
+	if (pf->range_count < PREFETCH_RANGE_COUNT)
+	{
+		pf->ranges[pf->range_count].block = block;
+		pf->ranges[pf->range_count].count = 1;
+		pf->range_count++;
+	}
+}
+
+void prefetch_record_fault(struct file *f, loff_t offset)
+{
+	if (!prefetch_recording || offset < 0)
+		return;
+	AcquireSRWLockExclusive(&prefetch_lock);
+	if (prefetch_check_window())
+	{
+		for (int i = 0; i < prefetch_current.file_count; i++)
+			if (prefetch_files[i] == f)
+			{
+				prefetch_add_block(&prefetch_current.files[i], (uint32_t)(offset / BLOCK_SIZE));
+				break;
+			}
+	}
+	ReleaseSRWLockExclusive(&prefetch_lock);
+}
@@ -0,0 +1,46 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <common/types.h>
+#include <fs/file.h>
+
+#include <stdbool.h>
+
+/* Exec prefetch
+ * With --exec-prefetch, the files a process opens and the file blocks it faults in during its first
+ * PREFETCH_WINDOW_MS milliseconds after execve() are recorded as the startup profile of the executable.
+ * The next execve() of the same executable opens these files and prefetches the recorded blocks before
+ * loading it, so the reads are issued together instead of one page fault at a time. Profiles live in
+ * a session wide shared section. Each published profile is also saved to a file in the root directory,
+ * which the first process of a session loads, and is keyed on the size and modification time of the
+ * executable besides its path.
+ */
+
+extern bool prefetch_recording;
+
+/* Publish the profile being recorded, if any, and stop recording */
+void prefetch_finish();
+/* Replay the profile of executable f and start recording a new one, called after the old image is gone */
+void prefetch_exec(struct file *f);
+/* Record a successful open of path */
+void prefetch_record_open(const char *path, int flags, struct file *f);
+/* Record an on demand page fault at offset of file f */
+void prefetch_record_fault(struct file *f, loff_t offset);
@@ -17,21 +17,33 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_PROCESS
+
 #include <common/errno.h>
 #include <common/futex.h>
 #include <common/param.h>
 #include <common/resource.h>
 #include <common/sysinfo.h>
 #include <common/wait.h>
+#include <dbt/sampler.h>
+#include <dbt/x86.h>
+#include <fs/tmpfs.h>
 #include <fs/virtual.h>
+#include <fs/winfs.h>
+#include <syscall/fork.h>
 #include <syscall/futex.h>
 #include <syscall/mm.h>
+#include <syscall/prefetch.h>
 #include <syscall/process.h>
 #include <syscall/process_info.h>
 #include <syscall/sig.h>
 #include <syscall/vfs.h>
 #include <syscall/syscall.h>
+#include <syscall/syscall_dispatch.h>
+#include <syscall/timeline.h>
 #include <datetime.h>
+#include <heap.h>
+#include <hostinfo.h>
 #include <log.h>
 #include <ntdll.h>
 #include <shared.h>
@@ -40,10 +52,23 @@
 #include <stdbool.h>
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#include <Psapi.h>
 
+/* Shared process table
+ * Slots are written with the shared mutex held, between process_info_begin_write() and
+ * process_info_end_write(). Readers of a single slot take a consistent copy with
+ * process_info_read() instead of locking.
+ * Free slots are linked in the order they are freed, pids are reused as late as possible.
+ */
 struct process_shared_data
 {
 	pid_t last_allocated_process;
+	/* Number of used slots */
+	int count;
+	/* Free list, linked through free_next[] and terminated by 0, built on first allocation */
+	bool free_list_initialized;
+	pid_t free_head, free_tail;
+	pid_t free_next[MAX_PROCESS_COUNT];
 	struct process_info processes[MAX_PROCESS_COUNT]; /* The zero slot is never used */
 };
 
@@ -59,11 +84,17 @@ static void process_init_private()
 	/* Initialize thread RW lock */
 	InitializeSRWLock(&process->rw_lock);
 	/* Initialize thread list */
+	InitializeSRWLock(&process->child_lock);
 	process->child_count = 0;
-	slist_init(&process->child_list);
 	slist_init(&process->child_freelist);
 	for (int i = 0; i < MAX_CHILD_COUNT; i++)
 		slist_add(&process->child_freelist, &process->child[i].list);
+	memset(process->child_table, 0, sizeof(process->child_table));
+	list_init(&process->child_terminated);
+	process->child_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	ZeroMemory(&process->child_rusage, sizeof(struct rusage));
+	InitializeSRWLock(&process->record_lock);
+	process->record = NULL;
 	/* Initialize thread list */
 	process->thread_count = 0;
 	list_init(&process->thread_list);
@@ -72,10 +103,13 @@ static void process_init_private()
 		list_add(&process->thread_freelist, &process->threads[i].list);
 	/* Initialize shared process table related data structures */
 	process_shared = (volatile struct process_shared_data *)shared_alloc(sizeof(struct process_shared_data));
+	/* A fork child inherits the mutex handle of its parent */
+	if ((process->shared_mutex = shared_get_handle(SHARED_HANDLE_PROCESS_MUTEX)))
+		return;
 	UNICODE_STRING shared_mutex_name;
 	RtlInitUnicodeString(&shared_mutex_name, L"process_shared_mutex");
 	OBJECT_ATTRIBUTES oa;
-	InitializeObjectAttributes(&oa, &shared_mutex_name, OBJ_OPENIF, shared_get_object_directory(), NULL);
+	InitializeObjectAttributes(&oa, &shared_mutex_name, OBJ_INHERIT | OBJ_OPENIF, shared_get_object_directory(), NULL);
 	NTSTATUS status;
 	status = NtCreateMutant(&process->shared_mutex, MUTANT_ALL_ACCESS, &oa, FALSE);
 	if (!NT_SUCCESS(status))
@@ -83,6 +117,7 @@ static void process_init_private()
 		log_info("NtCreateMutant() failed, status: %x", status);
 		NtTerminateProcess(NtCurrentProcess(), 1);
 	}
+	shared_set_handle(SHARED_HANDLE_PROCESS_MUTEX, process->shared_mutex);
 }
 
 static void process_lock_shared()
@@ -95,6 +130,141 @@ static void process_unlock_shared()
 	NtReleaseMutant(process->shared_mutex, NULL);
 }
 
+/* Begin and end an update of the published record of the current process */
+static void process_record_begin_update()
+{
+	AcquireSRWLockExclusive(&process->record_lock);
+	InterlockedIncrement(&process->record->seq);
+}
+
+static void process_record_end_update()
+{
+	InterlockedIncrement(&process->record->seq);
+	ReleaseSRWLockExclusive(&process->record_lock);
+}
+
+#define PROCESS_RECORD_MAX_RETRY	1000
+
+static void process_info_begin_write(pid_t pid)
+{
+	InterlockedIncrement(&process_shared->processes[pid].seq);
+}
+
+static void process_info_end_write(pid_t pid)
+{
+	InterlockedIncrement(&process_shared->processes[pid].seq);
+}
+
+/* Copy a slot of the process table without taking the shared mutex */
+static void process_info_read(pid_t pid, struct process_info *info)
+{
+	volatile struct process_info *entry = &process_shared->processes[pid];
+	for (int i = 0; i < PROCESS_RECORD_MAX_RETRY; i++)
+	{
+		LONG seq = entry->seq;
+		if (!(seq & 1))
+		{
+			MemoryBarrier();
+			memcpy(info, (void *)entry, sizeof(struct process_info));
+			MemoryBarrier();
+			if (entry->seq == seq)
+				return;
+		}
+		YieldProcessor();
+	}
+	/* The writer died in the middle of an update, the slot does not change while we hold the mutex */
+	process_lock_shared();
+	memcpy(info, (void *)entry, sizeof(struct process_info));
+	process_unlock_shared();
+}
+
+/* Copy a published record while its owner may be updating it
+ * Returns false if no consistent copy is made, e.g. the owner died in the middle of an update.
+ */
+static bool process_record_copy(volatile struct process_record *record, struct process_record *copy)
+{
+	for (int i = 0; i < PROCESS_RECORD_MAX_RETRY; i++)
+	{
+		LONG seq = record->seq;
+		if (!(seq & 1))
+		{
+			MemoryBarrier();
+			memcpy(copy, (void *)record, sizeof(struct process_record));
+			MemoryBarrier();
+			if (record->seq == seq)
+				return true;
+		}
+		YieldProcessor();
+	}
+	return false;
+}
+
+/* Allocate the published record of the current process, comm and cmdline are inherited from parent if given */
+static struct process_record *process_record_alloc(volatile struct process_record *parent)
+{
+	struct process_record *record = (struct process_record *)kmalloc_shared(sizeof(struct process_record));
+	if (!record)
+	{
+		log_error("Allocating process record failed, other processes will query us instead.");
+		return NULL;
+	}
+	if (!parent || !process_record_copy(parent, record))
+		ZeroMemory(record, sizeof(struct process_record));
+	record->seq = 0;
+	record->thread_count = 1;
+	ZeroMemory(&record->child_rusage, sizeof(struct rusage));
+	process->record = record;
+	return record;
+}
+
+static void process_record_update_threads()
+{
+	if (!process->record)
+		return;
+	process_record_begin_update();
+	process->record->thread_count = process->thread_count;
+	process_record_end_update();
+}
+
+void process_set_comm(const char *filename)
+{
+	if (!process->record)
+		return;
+	const char *name = filename;
+	for (const char *p = filename; *p; p++)
+		if (*p == '/')
+			name = p + 1;
+	process_record_begin_update();
+	strncpy(process->record->comm, name, PROCESS_COMM_MAX - 1);
+	process->record->comm[PROCESS_COMM_MAX - 1] = 0;
+	process_record_end_update();
+}
+
+void process_set_cmdline(int argc, char *argv[])
+{
+	if (!process->record)
+		return;
+	process_record_begin_update();
+	char *cmdline = process->record->cmdline;
+	int len = 0;
+	for (int i = 0; i < argc; i++)
+	{
+		int arg_len = (int)strlen(argv[i]) + 1;
+		if (len + arg_len > PROCESS_CMDLINE_MAX)
+		{
+			/* Truncated, like the kernel does for arguments beyond a page */
+			memcpy(cmdline + len, argv[i], PROCESS_CMDLINE_MAX - len - 1);
+			cmdline[PROCESS_CMDLINE_MAX - 1] = 0;
+			len = PROCESS_CMDLINE_MAX;
+			break;
+		}
+		memcpy(cmdline + len, argv[i], arg_len);
+		len += arg_len;
+	}
+	process->record->cmdline_len = len;
+	process_record_end_update();
+}
+
 /* Allocate a new thread structure in process_data */
 static struct thread *thread_alloc()
 {
@@ -122,32 +292,54 @@ static void thread_free(struct thread *thread)
 /* Allocate a new process/thread, return pid. Caller ensures shared_mutex is acquired. */
 static pid_t process_shared_alloc()
 {
-	/* Note that pid starts from 1, but initial value of last_allocated_process is zero */
-	for (int i = 1; i < MAX_PROCESS_COUNT; i++)
+	if (!process_shared->free_list_initialized)
 	{
-		pid_t cur = process_shared->last_allocated_process + i;
-		if (cur >= MAX_PROCESS_COUNT)
-			cur -= MAX_PROCESS_COUNT - 1;
-		if (process_shared->processes[cur].status == PROCESS_NOTEXIST)
-		{
-			process_shared->last_allocated_process = cur;
-			return cur;
-		}
+		/* Note that pid starts from 1 */
+		for (pid_t i = 1; i < MAX_PROCESS_COUNT - 1; i++)
+			process_shared->free_next[i] = i + 1;
+		process_shared->free_next[MAX_PROCESS_COUNT - 1] = 0;
+		process_shared->free_head = 1;
+		process_shared->free_tail = MAX_PROCESS_COUNT - 1;
+		process_shared->free_list_initialized = true;
 	}
-	log_error("Process table exhausted.");
-	__debugbreak();
-	return 0;
+	pid_t pid = process_shared->free_head;
+	if (!pid)
+	{
+		log_error("Process table exhausted.");
+		__debugbreak();
+		return 0;
+	}
+	process_shared->free_head = process_shared->free_next[pid];
+	if (!process_shared->free_head)
+		process_shared->free_tail = 0;
+	process_shared->last_allocated_process = pid;
+	process_shared->count++;
+	return pid;
+}
+
+/* Return the slot of a process/thread which no longer exists. Caller ensures shared_mutex is acquired. */
+static void process_shared_free(pid_t pid)
+{
+	process_shared->free_next[pid] = 0;
+	if (process_shared->free_tail)
+		process_shared->free_next[process_shared->free_tail] = pid;
+	else
+		process_shared->free_head = pid;
+	process_shared->free_tail = pid;
+	process_shared->count--;
 }
 
 void process_init()
 {
 	process_init_private();
+	struct process_record *record = process_record_alloc(NULL);
 	/* Allocate global process table slot */
 	process_lock_shared();
 	pid_t pid = process_shared_alloc();
 	if (pid == 1)
 	{
 		/* INIT process does not exist, create it now */
+		process_info_begin_write(1);
 		process_shared->processes[1].status = PROCESS_RUNNING;
 		process_shared->processes[1].win_pid = 0;
 		process_shared->processes[1].win_tid = 0;
@@ -157,9 +349,12 @@ void process_init()
 		process_shared->processes[1].sid = 1;
 		process_shared->processes[1].sigwrite = NULL;
 		process_shared->processes[1].query_mutex = NULL;
+		process_shared->processes[1].record = NULL;
+		process_info_end_write(1);
 		/* Done, allocate a new pid for current process */
 		pid = process_shared_alloc();
 	}
+	process_info_begin_write(pid);
 	process_shared->processes[pid].status = PROCESS_RUNNING;
 	process_shared->processes[pid].win_pid = GetCurrentProcessId();
 	process_shared->processes[pid].win_tid = GetCurrentThreadId();
@@ -169,6 +364,8 @@ void process_init()
 	process_shared->processes[pid].sid = pid;
 	process_shared->processes[pid].sigwrite = signal_get_process_sigwrite();
 	process_shared->processes[pid].query_mutex = signal_get_process_query_mutex();
+	process_shared->processes[pid].record = record;
+	process_info_end_write(pid);
 	process_unlock_shared();
 	process->pid = pid;
 	/* Allocate structure for main thread */
@@ -177,6 +374,7 @@ void process_init()
 	DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &thread->handle,
 		0, FALSE, DUPLICATE_SAME_ACCESS);
 	NtCreateEvent(&thread->wait_event, EVENT_ALL_ACCESS, NULL, SynchronizationEvent, FALSE);
+	thread->sleep_timer = NULL;
 	signal_init_thread(thread);
 	current_thread = thread;
 	current_thread->stack_base = VirtualAlloc(NULL, STACK_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE);
@@ -190,13 +388,19 @@ void process_afterfork_child(void *stack_base, pid_t pid)
 	 * We just use the pid they give us
 	 */
 	process->pid = pid;
+	pid_t ppid = process_shared->processes[pid].ppid;
+	struct process_record *record = process_record_alloc(process_shared->processes[ppid].record);
+	process_info_begin_write(pid);
 	process_shared->processes[pid].sigwrite = signal_get_process_sigwrite();
+	process_shared->processes[pid].record = record;
+	process_info_end_write(pid);
 	/* Allocate structure for main thread */
 	struct thread *thread = thread_alloc();
 	thread->pid = pid;
 	DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &thread->handle,
 		0, FALSE, DUPLICATE_SAME_ACCESS);
 	NtCreateEvent(&thread->wait_event, EVENT_ALL_ACCESS, NULL, SynchronizationEvent, FALSE);
+	thread->sleep_timer = NULL;
 	signal_init_thread(thread);
 	current_thread = thread;
 	current_thread->stack_base = stack_base;
@@ -218,9 +422,11 @@ void process_thread_entry(pid_t tid)
 	struct thread *thread = thread_alloc();
 	thread->pid = tid;
 	ReleaseSRWLockExclusive(&process->rw_lock);
+	process_record_update_threads();
 	DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &thread->handle,
 		0, FALSE, DUPLICATE_SAME_ACCESS);
 	NtCreateEvent(&thread->wait_event, EVENT_ALL_ACCESS, NULL, SynchronizationEvent, FALSE);
+	thread->sleep_timer = NULL;
 	signal_init_thread(thread);
 	current_thread = thread;
 	/* TODO: stack_base */
@@ -235,6 +441,7 @@ void *process_get_stack_base()
 pid_t process_init_child(DWORD win_pid, DWORD win_tid, HANDLE process_handle)
 {
 	AcquireSRWLockExclusive(&process->rw_lock);
+	AcquireSRWLockExclusive(&process->child_lock);
 	if (slist_empty(&process->child_freelist))
 	{
 		log_error("process: Maximum number of process exceeded.");
@@ -243,6 +450,7 @@ pid_t process_init_child(DWORD win_pid, DWORD win_tid, HANDLE process_handle)
 	/* Allocate a new process table entry */
 	process_lock_shared();
 	pid_t pid = process_shared_alloc();
+	process_info_begin_write(pid);
 	process_shared->processes[pid].status = PROCESS_RUNNING;
 	process_shared->processes[pid].win_pid = win_pid;
 	process_shared->processes[pid].win_tid = win_tid;
@@ -252,15 +460,18 @@ pid_t process_init_child(DWORD win_pid, DWORD win_tid, HANDLE process_handle)
 	process_shared->processes[pid].sid = process_shared->processes[process->pid].sid;
 	process_shared->processes[pid].sigwrite = NULL;
 	process_shared->processes[pid].query_mutex = NULL;
+	process_shared->processes[pid].record = NULL;
+	process_info_end_write(pid);
 	process_unlock_shared();
 
 	struct child_process *proc = slist_entry(slist_next(&process->child_freelist), struct child_process, list);
 	slist_remove(&process->child_freelist, &proc->list);
-	slist_add(&process->child_list, &proc->list);
 	proc->pid = pid;
 	proc->hProcess = process_handle;
 	proc->terminated = false;
+	process->child_table[pid] = proc;
 	process->child_count++;
+	ReleaseSRWLockExclusive(&process->child_lock);
 	signal_init_child(proc);
 
 	ReleaseSRWLockExclusive(&process->rw_lock);
@@ -273,6 +484,7 @@ pid_t process_create_thread(DWORD win_tid)
 	/* Allocate a new process table entry */
 	process_lock_shared();
 	pid_t pid = process_shared_alloc();
+	process_info_begin_write(pid);
 	process_shared->processes[pid].status = PROCESS_RUNNING;
 	process_shared->processes[pid].win_pid = process->pid;
 	process_shared->processes[pid].tgid = process->pid;
@@ -281,6 +493,8 @@ pid_t process_create_thread(DWORD win_tid)
 	process_shared->processes[pid].sid = process_shared->processes[process->pid].sid;
 	process_shared->processes[pid].sigwrite = NULL;
 	process_shared->processes[pid].query_mutex = NULL;
+	process_shared->processes[pid].record = NULL;
+	process_info_end_write(pid);
 	process->child_count++;
 	process_unlock_shared();
 	ReleaseSRWLockExclusive(&process->rw_lock);
@@ -288,106 +502,207 @@ pid_t process_create_thread(DWORD win_tid)
 	return pid;
 }
 
-/* Caller ensures process rw lock is acquired (shared) */
-/* FIXME: Using shared lock here is incorrect */
-static pid_t process_wait(pid_t pid, int *status, int options, struct rusage *rusage)
+/* Convert a Windows process or thread time in 100ns units */
+static void process_time_to_timeval(const FILETIME *time, struct linux_timeval *tv)
+{
+	uint64_t ticks = ((uint64_t)time->dwHighDateTime << 32) | time->dwLowDateTime;
+	tv->tv_sec = (long)(ticks / TICKS_PER_SECOND);
+	tv->tv_usec = (long)(ticks % TICKS_PER_SECOND / 10);
+}
+
+static void process_add_timeval(struct linux_timeval *total, const struct linux_timeval *tv)
+{
+	total->tv_sec += tv->tv_sec;
+	total->tv_usec += tv->tv_usec;
+	if (total->tv_usec >= 1000000)
+	{
+		total->tv_sec++;
+		total->tv_usec -= 1000000;
+	}
+}
+
+static uintptr_t process_timeval_to_clock_ticks(const struct linux_timeval *tv)
+{
+	return (uintptr_t)tv->tv_sec * USER_HZ + tv->tv_usec / (1000000 / USER_HZ);
+}
+
+/* Get the number of page faults which read from disk and context switches of a live process
+ * from the system process list. If win_tid is not 0 only context switches of that thread are counted.
+ * Windows does not tell voluntary and involuntary context switches apart.
+ */
+static void process_get_system_counters(DWORD win_pid, DWORD win_tid, intptr_t *hard_faults, intptr_t *context_switches)
+{
+	*hard_faults = 0;
+	*context_switches = 0;
+	ULONG size = 256 * 1024;
+	void *buf;
+	for (;;)
+	{
+		buf = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		if (!buf)
+			return;
+		ULONG needed = 0;
+		NTSTATUS status = NtQuerySystemInformation(SystemProcessInformation, buf, size, &needed);
+		if (NT_SUCCESS(status))
+			break;
+		VirtualFree(buf, 0, MEM_RELEASE);
+		if (status != STATUS_INFO_LENGTH_MISMATCH)
+			return;
+		/* The process list may grow before the next query */
+		size = needed + 16384;
+	}
+	PSYSTEM_PROCESS_INFORMATION info = (PSYSTEM_PROCESS_INFORMATION)buf;
+	for (;;)
+	{
+		if ((DWORD)(ULONG_PTR)info->UniqueProcessId == win_pid)
+		{
+			*hard_faults = info->HardFaultCount;
+			for (ULONG i = 0; i < info->NumberOfThreads; i++)
+				if (!win_tid || (DWORD)(ULONG_PTR)info->Threads[i].ClientId.UniqueThread == win_tid)
+					*context_switches += info->Threads[i].ContextSwitches;
+			break;
+		}
+		if (!info->NextEntryOffset)
+			break;
+		info = (PSYSTEM_PROCESS_INFORMATION)((char *)info + info->NextEntryOffset);
+	}
+	VirtualFree(buf, 0, MEM_RELEASE);
+}
+
+/* Get CPU times, peak working set and page faults of a process, it may be already terminated */
+static void process_get_rusage(HANDLE hProcess, struct rusage *usage)
+{
+	ZeroMemory(usage, sizeof(struct rusage));
+	FILETIME creation_time, exit_time, kernel_time, user_time;
+	if (GetProcessTimes(hProcess, &creation_time, &exit_time, &kernel_time, &user_time))
+	{
+		process_time_to_timeval(&user_time, &usage->ru_utime);
+		process_time_to_timeval(&kernel_time, &usage->ru_stime);
+	}
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(hProcess, &counters, sizeof(counters)))
+	{
+		usage->ru_maxrss = counters.PeakWorkingSetSize / 1024;
+		usage->ru_minflt = counters.PageFaultCount;
+	}
+}
+
+static void process_get_self_rusage(struct rusage *usage)
+{
+	process_get_rusage(GetCurrentProcess(), usage);
+	process_get_system_counters(GetCurrentProcessId(), 0, &usage->ru_majflt, &usage->ru_nvcsw);
+	/* PageFaultCount includes the hard faults */
+	usage->ru_minflt = max(usage->ru_minflt - usage->ru_majflt, 0);
+}
+
+void process_child_terminated(struct child_process *proc)
+{
+	AcquireSRWLockExclusive(&process->child_lock);
+	proc->terminated = true;
+	list_add(&process->child_terminated, &proc->terminated_node);
+	SetEvent(process->child_event);
+	ReleaseSRWLockExclusive(&process->child_lock);
+}
+
+/* Children are looked up by pid in child_table. waitpid(-1) takes the oldest terminated child from
+ * the head of child_terminated, without looking at children still running.
+ */
+static pid_t process_wait_child(pid_t pid, int *status, int options, struct rusage *rusage)
 {
 	if (options & WUNTRACED)
 		log_error("Unhandled option WUNTRACED");
 	if (options & WCONTINUED)
 		log_error("Unhandled option WCONTINUED");
-	if (rusage)
-		log_error("rusage not supported.");
-	struct child_process *proc = NULL;
-	if (pid > 0)
+	if (pid == 0 || pid < -1)
 	{
-		slist_iterate_safe(&process->child_list, prev, cur)
-		{
-			struct child_process *p = slist_entry(cur, struct child_process, list);
-			if (p->pid == pid)
-			{
-				proc = p;
-				if (options & WNOHANG)
-				{
-					if (!proc->terminated)
-					{
-						log_warning("Child not terminated yet.");
-						return -L_ECHILD;
-					}
-				}
-				else
-				{
-					DWORD result = signal_wait(1, &proc->hProcess, INFINITE);
-					if (result == WAIT_INTERRUPTED)
-					{
-						log_warning("Interrupted by signal.");
-						return -L_EINTR;
-					}
-				}
-				/* Decrement semaphore */
-				WaitForSingleObject(signal_get_process_wait_semaphore(), INFINITE);
-				/* Remove from child list */
-				slist_remove(prev, cur);
-				slist_add(&process->child_freelist, cur);
-				process->child_count--;
-				break;
-			}
-		}
-		if (proc == NULL)
-		{
-			log_warning("pid %d is not a child.", pid);
-			return -L_ECHILD;
-		}
+		log_error("pid unhandled.");
+		return -L_EINVAL;
 	}
-	else if (pid == -1)
+	if (pid >= MAX_PROCESS_COUNT)
 	{
-		if (process->child_count == 0)
-		{
-			log_warning("No children.");
-			return -L_ECHILD;
-		}
-		if (!(options & WNOHANG))
+		log_warning("pid %d is not a child.", pid);
+		return -L_ECHILD;
+	}
+	struct child_process *proc;
+	for (;;)
+	{
+		HANDLE handle;
+		AcquireSRWLockExclusive(&process->child_lock);
+		if (pid > 0)
 		{
-			HANDLE sem = signal_get_process_wait_semaphore();
-			DWORD result = signal_wait(1, &sem, INFINITE);
-			if (result == WAIT_INTERRUPTED)
-				return -L_EINTR;
+			proc = process->child_table[pid];
+			if (proc == NULL)
+			{
+				ReleaseSRWLockExclusive(&process->child_lock);
+				log_warning("pid %d is not a child.", pid);
+				return -L_ECHILD;
+			}
+			if (proc->terminated)
+				break;
+			/* The process handle is signaled slightly before the signal thread queues the child,
+			 * we may loop a few times in between */
+			handle = proc->hProcess;
 		}
-		/* Find the terminated child */
-		slist_iterate_safe(&process->child_list, prev, cur)
+		else
 		{
-			struct child_process *p = slist_entry(cur, struct child_process, list);
-			if (p->terminated)
+			if (process->child_count == 0)
 			{
-				if (options & WNOHANG)
-				{
-					/* Decrement semaphore */
-					WaitForSingleObject(signal_get_process_wait_semaphore(), INFINITE);
-				}
-				proc = p;
-				/* Remove from child list */
-				slist_remove(prev, cur);
-				slist_add(&process->child_freelist, cur);
-				process->child_count--;
+				ReleaseSRWLockExclusive(&process->child_lock);
+				log_warning("No children.");
+				return -L_ECHILD;
+			}
+			if (!list_empty(&process->child_terminated))
+			{
+				proc = list_entry(list_head(&process->child_terminated), struct child_process, terminated_node);
 				break;
 			}
+			ResetEvent(process->child_event);
+			handle = process->child_event;
+		}
+		ReleaseSRWLockExclusive(&process->child_lock);
+		if (options & WNOHANG)
+			return 0;
+		if (signal_wait(1, &handle, INFINITE) == WAIT_INTERRUPTED)
+		{
+			log_warning("Interrupted by signal.");
+			return -L_EINTR;
 		}
-		if (proc == NULL) /* WNOHANG and no unwaited child */
-			return -L_ECHILD;
 	}
-	else
+	/* Remove from child table */
+	list_remove(&process->child_terminated, &proc->terminated_node);
+	if (list_empty(&process->child_terminated))
+		ResetEvent(process->child_event);
+	pid = proc->pid;
+	HANDLE hProcess = proc->hProcess;
+	process->child_table[pid] = NULL;
+	slist_add(&process->child_freelist, &proc->list);
+	process->child_count--;
+	ReleaseSRWLockExclusive(&process->child_lock);
+
+	struct rusage child_rusage;
+	process_get_rusage(hProcess, &child_rusage);
+	AcquireSRWLockExclusive(&process->child_lock);
+	struct rusage *total = &process->child_rusage;
+	process_add_timeval(&total->ru_utime, &child_rusage.ru_utime);
+	process_add_timeval(&total->ru_stime, &child_rusage.ru_stime);
+	total->ru_maxrss = max(total->ru_maxrss, child_rusage.ru_maxrss);
+	total->ru_minflt += child_rusage.ru_minflt;
+	if (process->record)
 	{
-		log_error("pid unhandled.");
-		return -L_EINVAL;
+		process_record_begin_update();
+		process->record->child_rusage = *total;
+		process_record_end_update();
 	}
-	pid = proc->pid;
+	ReleaseSRWLockExclusive(&process->child_lock);
+	if (rusage)
+		*rusage = child_rusage;
 	process_lock_shared();
 	int exit_code, exit_signal;
 	if (process_shared->processes[pid].status == PROCESS_RUNNING)
 	{
 		DWORD code;
 		/* The process died abnormally */
-		GetExitCodeProcess(proc->hProcess, &code);
+		GetExitCodeProcess(hProcess, &code);
 		exit_code = code;
 		exit_signal = 0;
 	}
@@ -402,7 +717,14 @@ static pid_t process_wait(pid_t pid, int *status, int options, struct rusage *ru
 		log_error("Invalid process status: %d (pid: %d)", process_shared->processes[pid].status, pid);
 		process_exit(1, 0);
 	}
+	struct process_record *record = process_shared->processes[pid].record;
+	process_info_begin_write(pid);
 	process_shared->processes[pid].status = PROCESS_NOTEXIST;
+	process_shared->processes[pid].record = NULL;
+	process_info_end_write(pid);
+	process_shared_free(pid);
+	if (record)
+		kfree_shared(record, sizeof(struct process_record));
 	process_unlock_shared();
 	log_info("pid: %d exit code: %d exit signal: %d", pid, exit_code, exit_signal);
 	if (status)
@@ -412,44 +734,59 @@ static pid_t process_wait(pid_t pid, int *status, int options, struct rusage *ru
 		else
 			*status = W_EXITCODE(exit_code, 0);
 	}
-	CloseHandle(proc->hProcess);
+	CloseHandle(hProcess);
 	return pid;
 }
 
+static pid_t process_wait(pid_t pid, int *status, int options, struct rusage *rusage)
+{
+	uint64_t start = timeline_now();
+	pid_t r = process_wait_child(pid, status, options, rusage);
+	/* WNOHANG polls which found nothing would flood the timeline */
+	if (r > 0)
+		timeline_record(TIMELINE_EVENT_WAIT, start, r, NULL);
+	return r;
+}
+
 DEFINE_SYSCALL(waitpid, pid_t, pid, int *, status, int, options)
 {
 	log_info("sys_waitpid(%d, %p, %d)", pid, status, options);
-	AcquireSRWLockShared(&process->rw_lock);
-	intptr_t r = process_wait(pid, status, options, NULL);
-	ReleaseSRWLockShared(&process->rw_lock);
-	return r;
+	return process_wait(pid, status, options, NULL);
 }
 
 DEFINE_SYSCALL(wait4, pid_t, pid, int *, status, int, options, struct rusage *, rusage)
 {
 	log_info("sys_wait4(%d, %p, %d, %p)", pid, status, options, rusage);
-	if (rusage)
-		log_error("rusage != NULL");
-	AcquireSRWLockShared(&process->rw_lock);
-	intptr_t r = process_wait(pid, status, options, rusage);
-	ReleaseSRWLockShared(&process->rw_lock);
-	return r;
+	if (rusage && !mm_check_write(rusage, sizeof(struct rusage)))
+		return -L_EFAULT;
+	return process_wait(pid, status, options, rusage);
 }
 
 __declspec(noreturn) void process_exit(int exit_code, int exit_signal)
 {
 	/* TODO: Gracefully shutdown subsystems, but take care of race conditions */
+	dbt_profile_report();
+	syscall_stats_report();
+	sampler_shutdown();
+	tmpfs_shutdown();
+	prefetch_finish();
+	timeline_record(TIMELINE_EVENT_EXIT, timeline_now(), exit_code, NULL);
 	process_lock_shared();
 	pid_t pid = process->pid;
+	process_info_begin_write(pid);
 	process_shared->processes[pid].exit_code = exit_code;
 	process_shared->processes[pid].exit_signal = exit_signal;
 	process_shared->processes[pid].status = PROCESS_ZOMBIE;
+	process_info_end_write(pid);
+	log_flush();
 	/* Let Windows release process lock for us */
 	ExitProcess(exit_code);
 }
 
 __declspec(noreturn) void thread_exit(int exit_code, int exit_signal)
 {
+	dbt_profile_report();
+	dbt_shutdown_thread();
 	signal_exit_thread(current_thread);
 	if (current_thread->clear_tid)
 	{
@@ -460,16 +797,31 @@ __declspec(noreturn) void thread_exit(int exit_code, int exit_signal)
 		}
 	}
 	NtClose(current_thread->wait_event);
+	heap_shutdown_thread();
+	if (current_thread->sleep_timer)
+		NtClose(current_thread->sleep_timer);
 	process_lock_shared();
+	process_info_begin_write(current_thread->pid);
 	process_shared->processes[current_thread->pid].status = PROCESS_NOTEXIST;
 	process_shared->processes[current_thread->pid].exit_code = exit_code;
 	process_shared->processes[current_thread->pid].exit_signal = exit_signal;
+	process_info_end_write(current_thread->pid);
+	process_shared_free(current_thread->pid);
 	process_unlock_shared();
 	log_shutdown();
 	if (InterlockedDecrement(&process->thread_count) == 0)
 		process_exit(exit_code, exit_signal);
 	else
+	{
+		process_record_update_threads();
 		ExitThread(exit_code);
+	}
+}
+
+int process_get_count(pid_t *last_pid)
+{
+	*last_pid = process_shared->last_allocated_process;
+	return process_shared->count;
 }
 
 bool process_pid_exist(pid_t pid)
@@ -492,7 +844,20 @@ DEFINE_SYSCALL(getpid)
 
 pid_t process_get_ppid(pid_t pid)
 {
-	return process_shared->processes[process->pid].ppid;
+	if (pid <= 0 || pid >= MAX_PROCESS_COUNT)
+		return 0;
+	return process_shared->processes[pid].ppid;
+}
+
+DWORD process_get_win_pid(pid_t pid)
+{
+	if (pid <= 0 || pid >= MAX_PROCESS_COUNT)
+		return 0;
+	struct process_info info;
+	process_info_read(pid, &info);
+	if (info.status != PROCESS_RUNNING || info.tgid != pid)
+		return 0;
+	return info.win_pid;
 }
 
 DEFINE_SYSCALL(getppid)
@@ -512,32 +877,26 @@ pid_t process_get_tgid(pid_t pid)
 {
 	if (pid == 0)
 		pid = process->pid;
-	pid_t tgid;
-	if (pid != process->pid)
-		process_lock_shared();
-	if (process_shared->processes[pid].status == PROCESS_NOTEXIST)
-		tgid = -L_ESRCH;
-	else
-		tgid = process_shared->processes[pid].tgid;
-	if (pid != process->pid)
-		process_unlock_shared();
-	return tgid;
+	if (pid < 0 || pid >= MAX_PROCESS_COUNT)
+		return -L_ESRCH;
+	struct process_info info;
+	process_info_read(pid, &info);
+	if (info.status == PROCESS_NOTEXIST)
+		return -L_ESRCH;
+	return info.tgid;
 }
 
 pid_t process_get_pgid(pid_t pid)
 {
 	if (pid == 0)
 		pid = process->pid;
-	pid_t pgid;
-	if (pid != process->pid)
-		process_lock_shared();
-	if (process_shared->processes[pid].status == PROCESS_NOTEXIST)
-		pgid = -L_ESRCH;
-	else
-		pgid = process_shared->processes[pid].pgid;
-	if (pid != process->pid)
-		process_unlock_shared();
-	return pgid;
+	if (pid < 0 || pid >= MAX_PROCESS_COUNT)
+		return -L_ESRCH;
+	struct process_info info;
+	process_info_read(pid, &info);
+	if (info.status == PROCESS_NOTEXIST)
+		return -L_ESRCH;
+	return info.pgid;
 }
 
 DEFINE_SYSCALL(getpgid, pid_t, pid)
@@ -571,14 +930,13 @@ DEFINE_SYSCALL(getsid)
 	return sid;
 }
 
+/* Only the status of each slot is read, no lock is needed */
 void procfs_pid_begin_iter(int tag)
 {
-	process_lock_shared();
 }
 
 void procfs_pid_end_iter(int tag)
 {
-	process_unlock_shared();
 }
 
 int procfs_pid_iter(int tag, int iter_index, int *type, char *name, int namelen)
@@ -592,31 +950,102 @@ int procfs_pid_iter(int tag, int iter_index, int *type, char *name, int namelen)
 	return iter_index + 1;
 }
 
-int process_get_stat(char *buf)
+/* Proc visible state of a process */
+struct process_snapshot
+{
+	pid_t pid, ppid, pgid, sid;
+	char state;
+	struct process_record record;
+	struct rusage self_rusage;
+	size_t vm_size, vm_rss;
+};
+
+static void process_get_self_snapshot(struct process_snapshot *snapshot)
+{
+	snapshot->pid = process->pid;
+	snapshot->ppid = process_get_ppid(process->pid);
+	snapshot->pgid = process_get_pgid(process->pid);
+	snapshot->sid = process_get_sid();
+	snapshot->state = 'R';
+	if (!process->record || !process_record_copy(process->record, &snapshot->record))
+		ZeroMemory(&snapshot->record, sizeof(struct process_record));
+	snapshot->record.thread_count = process->thread_count;
+	AcquireSRWLockShared(&process->child_lock);
+	snapshot->record.child_rusage = process->child_rusage;
+	ReleaseSRWLockShared(&process->child_lock);
+	process_get_self_rusage(&snapshot->self_rusage);
+	mm_get_usage(&snapshot->vm_size, &snapshot->vm_rss);
+}
+
+/* Get the state of another process from its published record and the system counters, without
+ * asking the process. Returns false if the process does not publish a record.
+ */
+static bool process_get_snapshot(pid_t pid, struct process_snapshot *snapshot)
+{
+	process_lock_shared();
+	volatile struct process_info *info = &process_shared->processes[pid];
+	if (info->status == PROCESS_NOTEXIST || !info->record || !process_record_copy(info->record, &snapshot->record))
+	{
+		process_unlock_shared();
+		return false;
+	}
+	snapshot->pid = pid;
+	snapshot->ppid = info->ppid;
+	snapshot->pgid = info->pgid;
+	snapshot->sid = info->sid;
+	snapshot->state = (info->status == PROCESS_ZOMBIE) ? 'Z' : 'R';
+	DWORD win_pid = info->win_pid;
+	process_unlock_shared();
+
+	ZeroMemory(&snapshot->self_rusage, sizeof(struct rusage));
+	snapshot->vm_size = 0;
+	snapshot->vm_rss = 0;
+	HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, win_pid);
+	if (hProcess)
+	{
+		/* Hard faults are only counted for the current process, walking the system process list
+		 * for each process is too expensive */
+		process_get_rusage(hProcess, &snapshot->self_rusage);
+		PROCESS_MEMORY_COUNTERS_EX counters;
+		if (GetProcessMemoryInfo(hProcess, (PROCESS_MEMORY_COUNTERS *)&counters, sizeof(counters)))
+		{
+			snapshot->vm_size = counters.PrivateUsage;
+			snapshot->vm_rss = counters.WorkingSetSize;
+		}
+		CloseHandle(hProcess);
+	}
+	if (snapshot->state == 'Z')
+		snapshot->record.cmdline_len = 0;
+	return true;
+}
+
+static int process_format_stat(const struct process_snapshot *snapshot, char *buf)
 {
 	char *original = buf;
-	char *comm = "hello";
-	char state = 'R';
 	int tty_nr = 0; /* TODO */
 	int tpgid = 0; /* TODO */
 	uint32_t flags = 0; /* TODO */
-	buf += ksprintf(buf, "%d ", process->pid);
-	buf += ksprintf(buf, "(%s) ", comm);
-	buf += ksprintf(buf, "%c ", state);
-	buf += ksprintf(buf, "%d ", process_get_ppid(process->pid));
-	buf += ksprintf(buf, "%d ", process_get_pgid(process->pid));
-	buf += ksprintf(buf, "%d ", process_get_sid(process->pid));
+	buf += ksprintf(buf, "%d ", snapshot->pid);
+	buf += ksprintf(buf, "(%s) ", snapshot->record.comm);
+	buf += ksprintf(buf, "%c ", snapshot->state);
+	buf += ksprintf(buf, "%d ", snapshot->ppid);
+	buf += ksprintf(buf, "%d ", snapshot->pgid);
+	buf += ksprintf(buf, "%d ", snapshot->sid);
 	buf += ksprintf(buf, "%d ", tty_nr);
 	buf += ksprintf(buf, "%d ", tpgid);
 	buf += ksprintf(buf, "%u ", flags);
-	uintptr_t minflt = 0, cminflt = 0, majflt = 0, cmajflt = 0; /* TODO */
+	const struct rusage *self_rusage = &snapshot->self_rusage, *child_rusage = &snapshot->record.child_rusage;
+	uintptr_t minflt = self_rusage->ru_minflt, cminflt = child_rusage->ru_minflt;
+	uintptr_t majflt = self_rusage->ru_majflt, cmajflt = child_rusage->ru_majflt;
 	buf += ksprintf(buf, "%lu ", minflt);
 	buf += ksprintf(buf, "%lu ", cminflt);
 	buf += ksprintf(buf, "%lu ", majflt);
 	buf += ksprintf(buf, "%lu ", cmajflt);
 
-	uintptr_t utime = 0, stime = 0;
-	intptr_t cutime = 0, cstime = 0;
+	uintptr_t utime = process_timeval_to_clock_ticks(&self_rusage->ru_utime);
+	uintptr_t stime = process_timeval_to_clock_ticks(&self_rusage->ru_stime);
+	intptr_t cutime = process_timeval_to_clock_ticks(&child_rusage->ru_utime);
+	intptr_t cstime = process_timeval_to_clock_ticks(&child_rusage->ru_stime);
 	buf += ksprintf(buf, "%lu ", utime);
 	buf += ksprintf(buf, "%lu ", stime);
 	buf += ksprintf(buf, "%ld ", cutime);
@@ -624,17 +1053,17 @@ int process_get_stat(char *buf)
 	intptr_t priority = 20, nice = 0; /* TODO */
 	buf += ksprintf(buf, "%ld ", priority);
 	buf += ksprintf(buf, "%ld ", nice);
-	intptr_t num_threads = 1; /* TODO */
+	intptr_t num_threads = snapshot->record.thread_count;
 	buf += ksprintf(buf, "%ld ", num_threads);
 	intptr_t itrealvalue = 0; /* Hard-coded in kernel */
 	buf += ksprintf(buf, "%ld ", 0);
 	uint64_t starttime = 0; /* TODO */
 	buf += ksprintf(buf, "%llu ", starttime);
 	/* Virtual Memory Size */
-	uintptr_t vsize = 0;
+	size_t vsize = snapshot->vm_size;
 	buf += ksprintf(buf, "%lu ", vsize);
 	/* Resident Set Size */
-	intptr_t rss = 0;
+	intptr_t rss = snapshot->vm_rss / PAGE_SIZE;
 	buf += ksprintf(buf, "%ld ", rss);
 	/* Current soft limit of RSS: RLIMIT_RSS */
 	uintptr_t rsslim = 0;
@@ -682,16 +1111,85 @@ int process_get_stat(char *buf)
 	return buf - original;
 }
 
+static int process_format_status(const struct process_snapshot *snapshot, char *buf)
+{
+	char *original = buf;
+	buf += ksprintf(buf, "Name:\t%s\n", snapshot->record.comm);
+	if (snapshot->state == 'Z')
+		buf += ksprintf(buf, "State:\tZ (zombie)\n");
+	else
+		buf += ksprintf(buf, "State:\tR (running)\n");
+	buf += ksprintf(buf, "Tgid:\t%d\n", snapshot->pid);
+	buf += ksprintf(buf, "Pid:\t%d\n", snapshot->pid);
+	buf += ksprintf(buf, "PPid:\t%d\n", snapshot->ppid);
+	buf += ksprintf(buf, "VmSize:\t%8lu kB\n", snapshot->vm_size / 1024);
+	buf += ksprintf(buf, "VmRSS:\t%8lu kB\n", snapshot->vm_rss / 1024);
+	buf += ksprintf(buf, "Threads:\t%d\n", snapshot->record.thread_count);
+	return buf - original;
+}
+
+static int process_format_cmdline(const struct process_snapshot *snapshot, char *buf)
+{
+	memcpy(buf, snapshot->record.cmdline, snapshot->record.cmdline_len);
+	return snapshot->record.cmdline_len;
+}
+
+static int process_format(const struct process_snapshot *snapshot, int query_type, char *buf)
+{
+	switch (query_type)
+	{
+	case PROCESS_QUERY_STAT:
+		return process_format_stat(snapshot, buf);
+
+	case PROCESS_QUERY_STATUS:
+		return process_format_status(snapshot, buf);
+
+	case PROCESS_QUERY_CMDLINE:
+		return process_format_cmdline(snapshot, buf);
+
+	default:
+		return 0;
+	}
+}
+
+
 int process_query(int query_type, char *buf)
 {
 	switch (query_type)
 	{
 	case PROCESS_QUERY_STAT:
-		return process_get_stat(buf);
+	case PROCESS_QUERY_STATUS:
+	case PROCESS_QUERY_CMDLINE:
+	{
+		struct process_snapshot snapshot;
+		process_get_self_snapshot(&snapshot);
+		return process_format(&snapshot, query_type, buf);
+	}
 
 	case PROCESS_QUERY_MAPS:
 		return mm_get_maps(buf);
 
+	case PROCESS_QUERY_DBT:
+		return dbt_get_stats(buf);
+
+	case PROCESS_QUERY_MM:
+		return mm_get_stats(buf);
+
+	case PROCESS_QUERY_SMAPS:
+		return mm_get_smaps(buf);
+
+	case PROCESS_QUERY_FORK:
+		return fork_get_stats(buf);
+
+	case PROCESS_QUERY_HEAP:
+		return heap_get_stats(buf);
+
+	case PROCESS_QUERY_SYSCALLS:
+		return syscall_get_stats(buf);
+
+	case PROCESS_QUERY_WINFS:
+		return winfs_get_stats(buf);
+
 	default:
 		return 0;
 	}
@@ -703,20 +1201,26 @@ int process_query_pid(int pid, int query_type, char *buf)
 		return -L_ENOENT;
 	if (pid == 0 || pid == process->pid)
 		return process_query(query_type, buf);
-	else
+	if (pid < 0 || pid >= MAX_PROCESS_COUNT)
+		return -L_ENOENT;
+	/* Answer from the published record if possible, which does not involve the target process */
+	if (query_type == PROCESS_QUERY_STAT || query_type == PROCESS_QUERY_STATUS || query_type == PROCESS_QUERY_CMDLINE)
+	{
+		struct process_snapshot snapshot;
+		if (process_get_snapshot(pid, &snapshot))
+			return process_format(&snapshot, query_type, buf);
+	}
+	process_lock_shared();
+	if (!process_pid_exist(pid))
 	{
-		process_lock_shared();
-		if (!process_pid_exist(pid))
-		{
-			process_unlock_shared();
-			return -L_ENOENT;
-		}
-		DWORD win_pid = process_shared->processes[pid].win_pid;
-		HANDLE sigwrite = process_shared->processes[pid].sigwrite;
-		HANDLE query_mutex = process_shared->processes[pid].query_mutex;
 		process_unlock_shared();
-		return signal_query(win_pid, sigwrite, query_mutex, query_type, buf);
+		return -L_ENOENT;
 	}
+	DWORD win_pid = process_shared->processes[pid].win_pid;
+	HANDLE sigwrite = process_shared->processes[pid].sigwrite;
+	HANDLE query_mutex = process_shared->processes[pid].query_mutex;
+	process_unlock_shared();
+	return signal_query(win_pid, sigwrite, query_mutex, query_type, buf);
 }
 
 DEFINE_SYSCALL(setsid)
@@ -869,14 +1373,19 @@ DEFINE_SYSCALL(sysinfo, struct sysinfo *, info)
 	GlobalMemoryStatusEx(&memory);
 
 	info->uptime = (intptr_t)(GetTickCount64() / 1000ULL);
-	info->loads[0] = info->loads[1] = info->loads[2] = 0; /* TODO */
+	hostinfo_get_loadavg(info->loads);
+	for (int i = 0; i < 3; i++)
+		info->loads[i] <<= SI_LOAD_SHIFT - HOSTINFO_LOAD_FSHIFT;
 	info->totalram = memory.ullTotalPhys / PAGE_SIZE;
 	info->freeram = memory.ullAvailPhys / PAGE_SIZE;
 	info->sharedram = 0;
 	info->bufferram = 0;
-	info->totalswap = memory.ullTotalPageFile / PAGE_SIZE;
-	info->freeswap = memory.ullAvailPageFile / PAGE_SIZE;
-	info->procs = 100; /* TODO */
+	/* The page file limit includes physical memory */
+	info->totalswap = (memory.ullTotalPageFile - min(memory.ullTotalPageFile, memory.ullTotalPhys)) / PAGE_SIZE;
+	info->freeswap = (memory.ullAvailPageFile - min(memory.ullAvailPageFile, memory.ullAvailPhys)) / PAGE_SIZE;
+	info->freeswap = min(info->freeswap, info->totalswap);
+	pid_t last_pid;
+	info->procs = (unsigned short)process_get_count(&last_pid);
 	info->totalhigh = 0;
 	info->freehigh = 0;
 	info->mem_unit = PAGE_SIZE;
@@ -902,8 +1411,7 @@ static int do_prlimit64(pid_t pid, int resource, const struct rlimit64 *new_limi
 			break;
 
 		case RLIMIT_NOFILE:
-			old_limit->rlim_cur = MAX_FD_COUNT;
-			old_limit->rlim_max = MAX_FD_COUNT;
+			vfs_get_nofile_limit(old_limit);
 			break;
 
 		default:
@@ -913,8 +1421,15 @@ static int do_prlimit64(pid_t pid, int resource, const struct rlimit64 *new_limi
 	}
 	if (new_limit)
 	{
-		log_error("Setting rlimit %d not supported.", resource);
-		return -L_EINVAL;
+		switch (resource)
+		{
+		case RLIMIT_NOFILE:
+			return vfs_set_nofile_limit(new_limit);
+
+		default:
+			log_error("Setting rlimit %d not supported.", resource);
+			return -L_EINVAL;
+		}
 	}
 	return 0;
 }
@@ -950,9 +1465,34 @@ DEFINE_SYSCALL(getrusage, int, who, struct rusage *, usage)
 	log_info("getrusage(%d, %p)", who, usage);
 	if (!mm_check_write(usage, sizeof(struct rusage)))
 		return -L_EFAULT;
-	ZeroMemory(usage, sizeof(struct rusage));
 	switch (who)
 	{
+	case RUSAGE_SELF:
+		process_get_self_rusage(usage);
+		return 0;
+
+	case RUSAGE_CHILDREN:
+		AcquireSRWLockShared(&process->child_lock);
+		*usage = process->child_rusage;
+		ReleaseSRWLockShared(&process->child_lock);
+		return 0;
+
+	case RUSAGE_THREAD:
+	{
+		/* Windows only counts page faults per process */
+		process_get_rusage(GetCurrentProcess(), usage);
+		usage->ru_minflt = 0;
+		FILETIME creation_time, exit_time, kernel_time, user_time;
+		if (GetThreadTimes(GetCurrentThread(), &creation_time, &exit_time, &kernel_time, &user_time))
+		{
+			process_time_to_timeval(&user_time, &usage->ru_utime);
+			process_time_to_timeval(&kernel_time, &usage->ru_stime);
+		}
+		intptr_t hard_faults;
+		process_get_system_counters(GetCurrentProcessId(), GetCurrentThreadId(), &hard_faults, &usage->ru_nvcsw);
+		return 0;
+	}
+
 	default:
 		log_error("Unhandled who: %d.", who);
 		return -L_EINVAL;
@@ -1008,10 +1548,21 @@ DEFINE_SYSCALL(prlimit64, pid_t, pid, int, resource, const struct rlimit64 *, ne
 DEFINE_SYSCALL(getcpu, unsigned int *, cpu, unsigned int *, node, void *, tcache)
 {
 	log_info("getcpu(%p, %p, %p)", cpu, node, tcache);
+	PROCESSOR_NUMBER number;
+	GetCurrentProcessorNumberEx(&number);
 	if (cpu)
-		*cpu = 0;
+	{
+		int index = hostinfo_get_cpu_index(number.Group, number.Number);
+		*cpu = index >= 0 ? index : 0;
+	}
 	if (node)
-		*node = 0;
+	{
+		USHORT node_number;
+		if (GetNumaProcessorNodeEx(&number, &node_number) && node_number != 0xFFFF)
+			*node = node_number;
+		else
+			*node = 0;
+	}
 	return 0;
 }
 
@@ -1025,31 +1576,79 @@ DEFINE_SYSCALL(sched_yield)
 DEFINE_SYSCALL(sched_getaffinity, pid_t, pid, size_t, cpusetsize, uint8_t *, mask)
 {
 	log_info("sched_getaffinity(%d, %d, %p)", pid, cpusetsize, mask);
-	if (pid != 0)
+	if (pid != 0 && pid != process->pid)
 	{
 		log_error("pid != 0.");
 		return -L_ESRCH;
 	}
-	int bytes = (cpusetsize + 7) & ~7;
-	if (!mm_check_write(mask, bytes))
+	/* The size of the kernel cpu mask, in longs */
+	int cpu_count = hostinfo_get_cpu_count();
+	size_t size = (cpu_count + sizeof(uintptr_t) * 8 - 1) / (sizeof(uintptr_t) * 8) * sizeof(uintptr_t);
+	if (cpusetsize * 8 < (size_t)cpu_count || (cpusetsize & (sizeof(uintptr_t) - 1)))
+		return -L_EINVAL;
+	size = min(size, cpusetsize);
+	if (!mm_check_write(mask, size))
 		return -L_EFAULT;
-	for (int i = 0; i < bytes; i++)
+	for (size_t i = 0; i < size; i++)
 		mask[i] = 0;
-	/* TODO: Applications (i.e. ffmpeg) use this to detect the number of cpus and enable multithreading
-	 * on cpu with multiple cores.
-	 * Since we does not support multithreading at the time, we just report back one bit to let them
-	 * think we only have one core and give up multithreading.
-	 */
-	mask[0] = 1;
-#if 0
+	/* A thread only runs on processors of a single group */
 	GROUP_AFFINITY affinity;
-	GetThreadGroupAffinity(GetCurrentThread(), &affinity);
-	int size = min(sizeof(uintptr_t), cpusetsize) * 8;
-	for (int i = 0; i < size; i++)
-		if (affinity.Mask & (1 << i))
-			mask[i / 8] |= 1 << i;
-#endif
-	return sizeof(uintptr_t);
+	if (!GetThreadGroupAffinity(GetCurrentThread(), &affinity))
+	{
+		affinity.Group = 0;
+		affinity.Mask = 1;
+	}
+	for (int i = 0; i < sizeof(KAFFINITY) * 8; i++)
+		if (affinity.Mask & ((KAFFINITY)1 << i))
+		{
+			int cpu = hostinfo_get_cpu_index(affinity.Group, i);
+			if (cpu >= 0 && (size_t)cpu < size * 8)
+				mask[cpu / 8] |= 1 << (cpu % 8);
+		}
+	return size;
+}
+
+DEFINE_SYSCALL(sched_setaffinity, pid_t, pid, size_t, cpusetsize, const uint8_t *, mask)
+{
+	log_info("sched_setaffinity(%d, %d, %p)", pid, cpusetsize, mask);
+	if (pid != 0 && pid != process->pid)
+	{
+		log_error("pid != 0.");
+		return -L_ESRCH;
+	}
+	if (!mm_check_read(mask, cpusetsize))
+		return -L_EFAULT;
+	/* A thread can only be bound to processors of a single group, use the group of the first cpu in the mask */
+	GROUP_AFFINITY affinity;
+	memset(&affinity, 0, sizeof(affinity));
+	bool found = false;
+	int cpu_count = hostinfo_get_cpu_count();
+	for (int cpu = 0; cpu < cpu_count && (size_t)cpu < cpusetsize * 8; cpu++)
+		if (mask[cpu / 8] & (1 << (cpu % 8)))
+		{
+			int group, number;
+			if (!hostinfo_get_cpu_group(cpu, &group, &number))
+				continue;
+			if (!found)
+			{
+				affinity.Group = (WORD)group;
+				found = true;
+			}
+			else if (group != affinity.Group)
+			{
+				log_warning("cpu %d is in a different processor group, ignored.", cpu);
+				continue;
+			}
+			affinity.Mask |= (KAFFINITY)1 << number;
+		}
+	if (!found)
+		return -L_EINVAL;
+	if (!SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL))
+	{
+		log_warning("SetThreadGroupAffinity() failed, error code: %d", GetLastError());
+		return -L_EINVAL;
+	}
+	return 0;
 }
 
 DEFINE_SYSCALL(set_tid_address, int *, tidptr)
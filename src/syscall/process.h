@@ -36,22 +36,42 @@ void process_afterfork_child(void *stack_base, pid_t pid);
 void process_shutdown();
 void *process_get_stack_base();
 pid_t process_init_child(DWORD win_pid, DWORD win_tid, HANDLE process_handle);
+struct child_process;
+/* Called by the signal thread when a child process terminated */
+void process_child_terminated(struct child_process *proc);
 void process_thread_entry(pid_t tid);
 pid_t process_create_thread(DWORD win_tid);
 
 __declspec(noreturn) void process_exit(int exit_code, int exit_signal);
 __declspec(noreturn) void thread_exit(int exit_code, int exit_signal);
 bool process_pid_exist(pid_t pid);
+/* Get the number of processes and threads in the session, and the last allocated pid */
+int process_get_count(pid_t *last_pid);
 pid_t process_get_pid();
-pid_t process_get_ppid();
+pid_t process_get_ppid(pid_t pid);
+/* Windows process id of a running process, 0 if it does not exist or is the virtual init */
+DWORD process_get_win_pid(pid_t pid);
 pid_t process_get_tgid(pid_t pid);
 pid_t process_get_pgid(pid_t pid);
 pid_t process_get_sid();
 
+/* Publish the executable name and the command line after a successful execve() */
+void process_set_comm(const char *filename);
+void process_set_cmdline(int argc, char *argv[]);
+
 enum
 {
 	PROCESS_QUERY_STAT,		/* /proc/[pid]/stat */
 	PROCESS_QUERY_MAPS,		/* /proc/[pid]/maps */
+	PROCESS_QUERY_DBT,		/* /proc/[pid]/flinux/dbt */
+	PROCESS_QUERY_MM,		/* /proc/[pid]/flinux/mm */
+	PROCESS_QUERY_SMAPS,	/* /proc/[pid]/smaps */
+	PROCESS_QUERY_STATUS,	/* /proc/[pid]/status */
+	PROCESS_QUERY_FORK,		/* /proc/[pid]/flinux/fork */
+	PROCESS_QUERY_HEAP,		/* /proc/[pid]/flinux/heap */
+	PROCESS_QUERY_SYSCALLS,	/* /proc/[pid]/flinux/syscalls */
+	PROCESS_QUERY_CMDLINE,	/* /proc/[pid]/cmdline */
+	PROCESS_QUERY_WINFS,	/* /proc/[pid]/flinux/winfs */
 };
 int process_query(int query_type, char *buf);
 int process_query_pid(pid_t pid, int query_type, char *buf);
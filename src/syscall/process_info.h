@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include <common/resource.h>
 #include <common/signal.h>
 #include <lib/list.h>
 #include <lib/slist.h>
@@ -29,7 +30,10 @@
 
 struct child_process
 {
+	/* Free list of child process structures */
 	struct slist list;
+	/* Queue of terminated children not yet waited for */
+	struct list_node terminated_node;
 	pid_t pid;
 	HANDLE hProcess, hPipe;
 	OVERLAPPED overlapped;
@@ -50,6 +54,12 @@ struct thread
 	pid_t *clear_tid;
 	/*********** For futex() ***********/
 	HANDLE wait_event;
+	/*********** For vfs_get() ***********/
+	/* Non zero while the thread is between reading a fd table slot and referencing the file */
+	volatile LONG vfs_reading;
+	/*********** For nanosleep() ***********/
+	/* Waitable timer, created on first use */
+	HANDLE sleep_timer;
 	/*********** Signal related information ***********/
 	/* Signal mask */
 	sigset_t sigmask;
@@ -62,6 +72,10 @@ struct thread
 	 * A thread cannot receive signals if a signal ism being delivered to the thread
 	 */
 	bool can_accept_signal;
+	/* Thread environment block, used to reach the dbt state of the thread from the signal thread */
+	void *teb;
+	/* Whether the thread is inside a syscall, see signal_syscall_enter() */
+	volatile LONG syscall_state;
 };
 
 extern __declspec(thread) struct thread *current_thread;
@@ -79,10 +93,21 @@ struct process_data
 	int thread_count;
 	struct list thread_list, thread_freelist;
 	struct thread threads[MAX_PROCESS_COUNT];
-	/* Information of child processes */
+	/* Information of child processes, guarded by child_lock */
+	SRWLOCK child_lock;
 	int child_count;
-	struct slist child_list, child_freelist;
+	struct slist child_freelist;
 	struct child_process child[MAX_CHILD_COUNT];
+	/* Child processes indexed by pid */
+	struct child_process *child_table[MAX_PROCESS_COUNT];
+	/* Terminated children in termination order, child_event is set while it is not empty */
+	struct list child_terminated;
+	HANDLE child_event;
+	/* Accumulated resource usage of waited children */
+	struct rusage child_rusage;
+	/* Published proc information of this process, writers are serialized by record_lock */
+	SRWLOCK record_lock;
+	struct process_record *record;
 	/* Mutex for process_shared_data */
 	/* You have to lock this mutex on the following scenarios:
 	* 1. When writing to shared area
@@ -96,11 +121,34 @@ struct process_data
 
 extern struct process_data *const process;
 
+#define PROCESS_COMM_MAX		16
+#define PROCESS_CMDLINE_MAX		2048
+
+/* Proc visible state a process publishes for others in the shared heap
+ * Readers in other processes copy it directly instead of querying the process. The owner makes
+ * seq odd while it updates the record, a reader retries its copy if seq is odd or has changed.
+ * The record is freed by whoever reaps the process slot.
+ */
+struct process_record
+{
+	volatile LONG seq;
+	/* Executable name, NUL terminated */
+	char comm[PROCESS_COMM_MAX];
+	/* Command line arguments, each is NUL terminated */
+	int cmdline_len;
+	char cmdline[PROCESS_CMDLINE_MAX];
+	int thread_count;
+	/* Accumulated resource usage of waited children */
+	struct rusage child_rusage;
+};
+
 #define PROCESS_NOTEXIST		0 /* The process does not exist */
 #define PROCESS_RUNNING			1 /* The process is running normally */
 #define PROCESS_ZOMBIE			2 /* The process is a zombie */
 struct process_info
 {
+	/* Sequence counter, odd while the slot is being written, see process_info_read() */
+	volatile LONG seq;
 	/* Status for current slot */
 	int status;
 	/* Exit code */
@@ -121,4 +169,6 @@ struct process_info
 	HANDLE sigwrite;
 	/* Handle to information query mutex in the process */
 	HANDLE query_mutex;
+	/* Published proc information, NULL for threads and processes not yet initialized */
+	struct process_record *record;
 };
@@ -17,6 +17,8 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_SIGNAL
+
 #include <common/errno.h>
 #include <common/sigcontext.h>
 #include <common/sigframe.h>
@@ -26,6 +28,7 @@
 #include <syscall/process_info.h>
 #include <syscall/sig.h>
 #include <syscall/syscall.h>
+#include <etw.h>
 #include <log.h>
 #include <str.h>
 
@@ -34,18 +37,24 @@
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 
+/* The signal thread is only started when it has work to do
+ * Most short lived processes never receive a signal packet, so the pipe and completion port are
+ * created at startup and the thread on the first packet sent by this process (signal_send_packet())
+ * or another process (signal_query(), which starts it with CreateRemoteThread()).
+ */
 struct signal_data
 {
+	INIT_ONCE thread_once;
 	HANDLE thread;
 	HANDLE iocp;
 	HANDLE sigread, sigwrite;
-	HANDLE process_wait_semaphore;
 	HANDLE query_mutex;
 	CRITICAL_SECTION mutex;
 
 	struct sigaction actions[_NSIG];
 	sigset_t pending;
 	siginfo_t pending_info[_NSIG]; /* siginfo which is currently pending */
+	HANDLE pending_event; /* Manual reset, set when a signal becomes pending, used by signalfd */
 };
 
 #define SIGNAL_PACKET_SHUTDOWN		0 /* Shutdown signal thread */
@@ -66,6 +75,19 @@ struct signal_packet
 
 static struct signal_data *signal;
 
+/* Cooperative signal delivery
+ * A thread inside a syscall runs our code, the signal handler can be set up when the syscall returns,
+ * which is what dbt_deliver_signal() ends up doing for such a thread anyway. Instead of suspending the
+ * thread and rewriting its context, the signal thread moves syscall_state from running to signaled
+ * and the thread checks it in signal_syscall_leave(). Both sides use interlocked operations so
+ * exactly one of them sees the transition.
+ * Threads running translated code are still suspended, they may be spinning in linked blocks which
+ * never return to the dispatcher.
+ */
+#define SYSCALL_STATE_NONE		0 /* Running translated code */
+#define SYSCALL_STATE_RUNNING	1 /* Inside a syscall */
+#define SYSCALL_STATE_SIGNALED	2 /* Inside a syscall, current_siginfo is to be delivered on return */
+
 /* Create a uni-direction, message based pipe */
 static volatile long process_pipe_count = 0;
 static bool create_pipe(HANDLE *read, HANDLE *write, bool is_duplex)
@@ -123,70 +145,129 @@ static void signal_default_handler(siginfo_t *info)
 	}
 }
 
-/* Try to deliver a signal, return true if it is successfully delivered */
-/* Caller ensures signal mutex is acquired */
-static bool signal_thread_deliver_signal(siginfo_t *info)
+/* Try to deliver a signal, return true if it is successfully delivered
+ * If thread is not NULL, only deliver the signal to that thread
+ */
+/* Caller ensures signal mutex and process rw lock are acquired */
+static bool signal_thread_deliver_signal(siginfo_t *info, struct thread *thread)
 {
 	int sig = info->si_signo;
 	if (signal->actions[sig].sa_handler == SIG_IGN)
 		return true;
-	else if (signal->actions[sig].sa_handler == SIG_DFL)
+
+	/* The default action does not need a thread to run a handler */
+	bool dfl = signal->actions[sig].sa_handler == SIG_DFL;
+	if (thread)
 	{
-		signal_default_handler(info);
-		return true;
+		if (sigismember(&thread->sigmask, sig) || !(dfl || thread->can_accept_signal))
+			return false;
 	}
-
-	/* Find a thread which can accept the signal */
-	struct thread *thread = NULL;
-	struct list_node *cur;
-	list_iterate(&process->thread_list, cur)
+	else
 	{
-		struct thread *t = list_entry(cur, struct thread, list);
-		if (!sigismember(&t->sigmask, sig) && t->can_accept_signal)
+		/* Find a thread which can accept the signal */
+		struct list_node *cur;
+		list_iterate(&process->thread_list, cur)
 		{
-			thread = t;
-			break;
+			struct thread *t = list_entry(cur, struct thread, list);
+			if (!sigismember(&t->sigmask, sig) && (dfl || t->can_accept_signal))
+			{
+				thread = t;
+				break;
+			}
 		}
+		if (!thread)
+			return false;
+	}
+
+	/* Blocked signals are left pending even with the default action, they may be consumed by signalfd */
+	if (dfl)
+	{
+		signal_default_handler(info);
+		return true;
 	}
-	if (!thread)
-		return false;
 
 	thread->can_accept_signal = false;
+	thread->current_siginfo = *info;
+	if (thread == current_thread)
+	{
+		/* We are in a syscall, the handler will be set up when it returns */
+		dbt_deliver_signal_current();
+		SetEvent(thread->sigevent);
+		return true;
+	}
+	if (InterlockedCompareExchange(&thread->syscall_state, SYSCALL_STATE_SIGNALED, SYSCALL_STATE_RUNNING) == SYSCALL_STATE_RUNNING)
+	{
+		/* The thread picks up the signal when the syscall returns, wake it if it is waiting */
+		SetEvent(thread->sigevent);
+		return true;
+	}
 	CONTEXT context;
 	context.ContextFlags = CONTEXT_INTEGER | CONTEXT_CONTROL;
 	SuspendThread(thread->handle);
 	GetThreadContext(thread->handle, &context);
-	dbt_deliver_signal(thread->handle, &context);
-	thread->current_siginfo = *info;
+	dbt_deliver_signal(thread->teb, &context);
 	SetEvent(thread->sigevent);
 	SetThreadContext(thread->handle, &context);
 	ResumeThread(thread->handle);
 	return true;
 }
 
-static void signal_thread_handle_kill(struct siginfo *info)
+/* Deliver a signal or mark it as pending if it can't be delivered now
+ * If tid is not 0, only deliver the signal to that thread, returns -L_ESRCH if it does not exist
+ */
+static int signal_deliver(struct siginfo *info, pid_t tid)
 {
 	int signo = info->si_signo;
 	EnterCriticalSection(&signal->mutex);
-	if (!signal_thread_deliver_signal(info))
+	AcquireSRWLockShared(&process->rw_lock);
+	struct thread *thread = NULL;
+	if (tid)
+	{
+		struct list_node *cur;
+		list_iterate(&process->thread_list, cur)
+		{
+			struct thread *t = list_entry(cur, struct thread, list);
+			if (t->pid == tid)
+			{
+				thread = t;
+				break;
+			}
+		}
+		if (!thread)
+		{
+			ReleaseSRWLockShared(&process->rw_lock);
+			LeaveCriticalSection(&signal->mutex);
+			return -L_ESRCH;
+		}
+	}
+	/* If the thread is blocking the signal it is left pending process wide */
+	if (!signal_thread_deliver_signal(info, thread))
 	{
 		/* Cannot deliver the signal, mark it as pending and save the info */
 		sigaddset(&signal->pending, signo);
 		signal->pending_info[signo] = *info;
+		SetEvent(signal->pending_event);
 	}
+	ReleaseSRWLockShared(&process->rw_lock);
 	LeaveCriticalSection(&signal->mutex);
+	return 0;
+}
+
+static void signal_thread_handle_kill(struct siginfo *info)
+{
+	signal_deliver(info, 0);
 }
 
 static void signal_thread_handle_child_terminated(struct child_process *proc)
 {
 	CloseHandle(proc->hPipe);
+	/* Make the child waitable before SIGCHLD arrives */
+	process_child_terminated(proc);
 	struct siginfo info;
 	info.si_signo = SIGCHLD;
 	info.si_code = SI_KERNEL;
 	info.si_errno = 0;
 	signal_thread_handle_kill(&info);
-	proc->terminated = true;
-	ReleaseSemaphore(signal->process_wait_semaphore, 1, NULL);
 }
 
 static DWORD WINAPI signal_thread(LPVOID parameter)
@@ -222,7 +303,7 @@ static DWORD WINAPI signal_thread(LPVOID parameter)
 				for (int i = 0; i < _NSIG; i++)
 					if (sigismember(&signal->pending, i))
 					{
-						if (signal_thread_deliver_signal(&signal->pending_info[i]))
+						if (signal_thread_deliver_signal(&signal->pending_info[i], NULL))
 							sigdelset(&signal->pending, i);
 					}
 				ReleaseSRWLockShared(&process->rw_lock);
@@ -301,6 +382,8 @@ static void signal_save_sigcontext(struct sigcontext *sc, struct syscall_context
 void signal_setup_handler(struct syscall_context *context)
 {
 	int sig = current_thread->current_siginfo.si_signo;
+	if (etw_enabled(ETW_KEYWORD_SIGNAL))
+		etw_signal_delivery(sig, current_thread->current_siginfo.si_code, (size_t)signal->actions[sig].sa_handler);
 	uintptr_t sp = context->esp;
 	/* TODO: Make fpstate layout the same as in Linux kernel */
 	/* Allocate fpstate space */
@@ -352,9 +435,31 @@ static void send_packet(HANDLE sigwrite, struct signal_packet *packet)
 	/* TODO: Handle error */
 }
 
-HANDLE signal_get_process_wait_semaphore()
+static BOOL CALLBACK signal_create_thread(PINIT_ONCE init_once, PVOID parameter, PVOID *context)
+{
+	signal->thread = CreateThread(NULL, 0, signal_thread, NULL, 0, NULL);
+	if (!signal->thread)
+		log_error("Signal thread creation failed, error code: %d.", GetLastError());
+	return TRUE;
+}
+
+static void signal_start_thread()
 {
-	return signal->process_wait_semaphore;
+	InitOnceExecuteOnce(&signal->thread_once, signal_create_thread, NULL, NULL);
+}
+
+/* Started in the target process by signal_query(), the executable is loaded at a fixed address */
+static DWORD WINAPI signal_start_remote(LPVOID parameter)
+{
+	signal_start_thread();
+	return 0;
+}
+
+/* Send a packet to the signal thread of current process */
+static void signal_send_packet(struct signal_packet *packet)
+{
+	signal_start_thread();
+	send_packet(signal->sigwrite, packet);
 }
 
 HANDLE signal_get_process_sigwrite()
@@ -386,7 +491,7 @@ void signal_init_child(struct child_process *proc)
 	struct signal_packet packet;
 	packet.type = SIGNAL_PACKET_ADD_PROCESS;
 	packet.proc = proc;
-	send_packet(signal->sigwrite, &packet);
+	signal_send_packet(&packet);
 }
 
 /* Deliver signal when masked pending signal is being unmasked */
@@ -397,7 +502,7 @@ static void send_pending_signal()
 	{
 		struct signal_packet packet;
 		packet.type = SIGNAL_PACKET_DELIVER;
-		send_packet(signal->sigwrite, &packet);
+		signal_send_packet(&packet);
 	}
 }
 
@@ -417,6 +522,8 @@ DEFINE_SYSCALL(rt_sigreturn, uintptr_t, bx, uintptr_t, cx, uintptr_t, dx, uintpt
 	send_pending_signal();
 	LeaveCriticalSection(&signal->mutex);
 	
+	/* dbt_sigreturn() does not return through the syscall exit path */
+	signal_syscall_leave();
 	dbt_sigreturn(&frame->uc.uc_mcontext);
 }
 
@@ -428,16 +535,15 @@ static void signal_init_private()
 		log_error("Signal pipe creation failed, error code: %d", GetLastError());
 		return;
 	}
-	signal->process_wait_semaphore = CreateSemaphoreW(NULL, 0, LONG_MAX, NULL);
 	signal->iocp = CreateIoCompletionPort(signal->sigread, NULL, 0, 1);
 	signal->query_mutex = CreateMutexW(NULL, FALSE, L"");
+	signal->pending_event = CreateEvent(NULL, TRUE, FALSE, NULL);
 
-	/* Create signal thread */
 	sigemptyset(&signal->pending);
 	InitializeCriticalSection(&signal->mutex);
-	signal->thread = CreateThread(NULL, 0, signal_thread, NULL, 0, NULL);
-	if (!signal->thread)
-		log_error("Signal thread creation failed, error code: %d.", GetLastError());
+	/* The signal thread is created on demand */
+	InitOnceInitialize(&signal->thread_once);
+	signal->thread = NULL;
 }
 
 void signal_init()
@@ -457,6 +563,13 @@ void signal_reset()
 		signal->actions[i].sa_flags = 0;
 		signal->actions[i].sa_restorer = NULL;
 	}
+	/* execve() does not return through the syscall exit path, the handler of a signal posted to
+	 * it is gone, take the default action */
+	if (InterlockedExchange(&current_thread->syscall_state, SYSCALL_STATE_NONE) == SYSCALL_STATE_SIGNALED)
+	{
+		current_thread->can_accept_signal = true;
+		signal_default_handler(&current_thread->current_siginfo);
+	}
 }
 
 void signal_afterfork_child()
@@ -478,12 +591,18 @@ void signal_afterfork_parent()
 
 void signal_shutdown()
 {
-	struct signal_packet packet;
-	packet.type = SIGNAL_PACKET_SHUTDOWN;
-	send_packet(signal->sigwrite, &packet);
-	WaitForSingleObject(signal->thread, INFINITE);
+	BOOL pending;
+	InitOnceBeginInitialize(&signal->thread_once, INIT_ONCE_CHECK_ONLY, &pending, NULL);
+	if (!pending && signal->thread)
+	{
+		struct signal_packet packet;
+		packet.type = SIGNAL_PACKET_SHUTDOWN;
+		send_packet(signal->sigwrite, &packet);
+		WaitForSingleObject(signal->thread, INFINITE);
+	}
 
 	CloseHandle(signal->query_mutex);
+	CloseHandle(signal->pending_event);
 	DeleteCriticalSection(&signal->mutex);
 	CloseHandle(signal->sigread);
 	CloseHandle(signal->sigwrite);
@@ -494,6 +613,21 @@ void signal_init_thread(struct thread *thread)
 	thread->sigevent = CreateEvent(NULL, TRUE, FALSE, NULL);
 	sigemptyset(&thread->sigmask); /* TODO: Keep signal mask on fork */
 	thread->can_accept_signal = true;
+	thread->teb = NtCurrentTeb();
+	thread->syscall_state = SYSCALL_STATE_NONE;
+}
+
+/* Called on entry of every syscall except fast ones */
+void signal_syscall_enter()
+{
+	current_thread->syscall_state = SYSCALL_STATE_RUNNING;
+}
+
+/* Called on return of every syscall entered with signal_syscall_enter() */
+void signal_syscall_leave()
+{
+	if (InterlockedExchange(&current_thread->syscall_state, SYSCALL_STATE_NONE) == SYSCALL_STATE_SIGNALED)
+		dbt_deliver_signal_current();
 }
 
 void signal_exit_thread(struct thread *thread)
@@ -506,10 +640,17 @@ int signal_kill(pid_t pid, siginfo_t *info)
 {
 	if (pid == process->pid)
 	{
+		if (current_thread)
+		{
+			/* Deliver directly instead of waking the signal thread */
+			signal_deliver(info, 0);
+			return 0;
+		}
+		/* Not called from an emulated thread, e.g. console control handler */
 		struct signal_packet packet;
 		packet.type = SIGNAL_PACKET_KILL;
 		packet.info = *info;
-		send_packet(signal->sigwrite, &packet);
+		signal_send_packet(&packet);
 		return 0;
 	}
 	else
@@ -556,7 +697,8 @@ void signal_after_pwait(const sigset_t *oldmask)
 
 int signal_query(DWORD win_pid, HANDLE sigwrite, HANDLE query_mutex, int query_type, char *buf)
 {
-	HANDLE process = OpenProcess(PROCESS_DUP_HANDLE, FALSE, win_pid);
+	HANDLE process = OpenProcess(PROCESS_DUP_HANDLE | PROCESS_CREATE_THREAD | PROCESS_QUERY_INFORMATION | PROCESS_VM_OPERATION | PROCESS_VM_READ | PROCESS_VM_WRITE,
+		FALSE, win_pid);
 	if (process == NULL)
 		return -L_ENOENT;
 	HANDLE pipe, mutex;
@@ -573,6 +715,12 @@ int signal_query(DWORD win_pid, HANDLE sigwrite, HANDLE query_mutex, int query_t
 		 */
 		__debugbreak();
 	}
+	/* Make sure the target has its signal thread running, does nothing if it is already started */
+	HANDLE thread = CreateRemoteThread(process, NULL, 0, signal_start_remote, NULL, 0, NULL);
+	if (thread)
+		CloseHandle(thread);
+	else
+		log_warning("CreateRemoteThread() failed, error code: %d", GetLastError());
 	struct signal_packet packet;
 	packet.type = SIGNAL_PACKET_QUERY;
 	packet.query_type = query_type;
@@ -613,6 +761,8 @@ DEFINE_SYSCALL(kill, pid_t, pid, int, sig)
 		info.si_signo = sig;
 		info.si_code = SI_USER;
 		info.si_errno = 0;
+		info._sifields._kill._pid = process->pid;
+		info._sifields._kill._uid = 0;
 		signal_kill(pid, &info);
 	}
 	return 0;
@@ -621,8 +771,54 @@ DEFINE_SYSCALL(kill, pid_t, pid, int, sig)
 DEFINE_SYSCALL(tgkill, pid_t, tgid, pid_t, pid, int, sig)
 {
 	log_info("tgkill(%d, %d, %d)", tgid, pid, sig);
-	log_error("tgkill() not implemented.");
-	return 0;
+	if (sig < 0 || sig >= _NSIG)
+		return -L_EINVAL;
+	if (tgid != process->pid)
+	{
+		log_error("tgkill(): Killing threads of other processes is not supported.");
+		return -L_ESRCH;
+	}
+	if (sig == 0)
+		return 0;
+	struct siginfo info;
+	info.si_signo = sig;
+	info.si_code = SI_TKILL;
+	info.si_errno = 0;
+	info._sifields._kill._pid = process->pid;
+	info._sifields._kill._uid = 0;
+	return signal_deliver(&info, pid);
+}
+
+HANDLE signal_get_pending_event()
+{
+	return signal->pending_event;
+}
+
+sigset_t signal_get_pending()
+{
+	EnterCriticalSection(&signal->mutex);
+	sigset_t pending = signal->pending;
+	LeaveCriticalSection(&signal->mutex);
+	return pending;
+}
+
+int signal_dequeue(const sigset_t *mask, siginfo_t *info)
+{
+	int sig = 0;
+	EnterCriticalSection(&signal->mutex);
+	sigset_t pending = signal->pending & *mask;
+	for (int i = 1; i < _NSIG; i++)
+		if (sigismember(&pending, i))
+		{
+			sig = i;
+			*info = signal->pending_info[i];
+			sigdelset(&signal->pending, i);
+			break;
+		}
+	if (!signal->pending)
+		ResetEvent(signal->pending_event);
+	LeaveCriticalSection(&signal->mutex);
+	return sig;
 }
 
 DEFINE_SYSCALL(personality, unsigned long, persona)
@@ -26,7 +26,6 @@
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 
-HANDLE signal_get_process_wait_semaphore();
 HANDLE signal_get_process_sigwrite();
 HANDLE signal_get_process_query_mutex();
 void signal_init_child(struct child_process *proc);
@@ -41,7 +40,15 @@ void signal_afterfork_child();
 void signal_shutdown();
 void signal_init_thread(struct thread *thread);
 void signal_exit_thread(struct thread *thread);
+void signal_syscall_enter();
+void signal_syscall_leave();
 int signal_kill(pid_t pid, siginfo_t *siginfo);
+/* For signalfd: pending signals of the process, a manual reset event set when a signal becomes pending,
+ * and dequeue a pending signal in mask, returns its number or 0 if there is none
+ */
+sigset_t signal_get_pending();
+HANDLE signal_get_pending_event();
+int signal_dequeue(const sigset_t *mask, siginfo_t *info);
 DWORD signal_wait(int count, HANDLE *handles, DWORD milliseconds);
 void signal_before_pwait(const sigset_t *sigmask, sigset_t *oldmask);
 void signal_after_pwait(const sigset_t *oldmask);
@@ -21,7 +21,7 @@
 .code
 
 PUBLIC mm_check_read_begin, mm_check_read_end, mm_check_read_fail
-mm_check_read PROC check_addr, check_size
+mm_probe_read PROC check_addr, check_size
 	mov edx, check_addr
 	mov ecx, check_size
 	jecxz SUCC
@@ -55,10 +55,10 @@ SUCC:
 mm_check_read_fail LABEL PTR
 	xor eax, eax
 	ret
-mm_check_read ENDP
+mm_probe_read ENDP
 
 PUBLIC mm_check_read_string_begin, mm_check_read_string_end, mm_check_read_string_fail
-mm_check_read_string PROC check_addr
+mm_probe_read_string PROC check_addr
 	mov edx, check_addr
 
 mm_check_read_string_begin LABEL PTR
@@ -77,10 +77,10 @@ SUCC:
 mm_check_read_string_fail LABEL PTR
 	xor eax, eax
 	ret
-mm_check_read_string ENDP
+mm_probe_read_string ENDP
 
 PUBLIC mm_check_write_begin, mm_check_write_end, mm_check_write_fail
-mm_check_write PROC check_addr, check_size
+mm_probe_write PROC check_addr, check_size
 	mov edx, check_addr
 	mov ecx, check_size
 	jecxz SUCC
@@ -116,7 +116,7 @@ SUCC:
 mm_check_write_fail LABEL PTR
 	xor eax, eax
 	ret
-mm_check_write ENDP
+mm_probe_write ENDP
 
 fpu_fxsave PROC save_area
 	mov eax, save_area
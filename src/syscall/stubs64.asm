@@ -141,7 +141,7 @@ restore_context PROC ; ctx: QWORD
 restore_context ENDP
 
 PUBLIC mm_check_read_begin, mm_check_read_end, mm_check_read_fail
-mm_check_read PROC ; check_addr: QWORD, check_size: QWORD
+mm_probe_read PROC ; check_addr: QWORD, check_size: QWORD
 	xchg rcx, rdx
 	; rcx = check_size
 	; rdx = check_addr
@@ -176,10 +176,10 @@ SUCC:
 mm_check_read_fail LABEL PTR
 	xor rax, rax
 	ret
-mm_check_read ENDP
+mm_probe_read ENDP
 
 PUBLIC mm_check_read_string_begin, mm_check_read_string_end, mm_check_read_string_fail
-mm_check_read_string PROC ; check_addr: QWORD
+mm_probe_read_string PROC ; check_addr: QWORD
 	mov rdx, rcx ; check_addr
 
 mm_check_read_string_begin LABEL PTR
@@ -198,10 +198,10 @@ SUCC:
 mm_check_read_string_fail LABEL PTR
 	xor rax, rax
 	ret
-mm_check_read_string ENDP
+mm_probe_read_string ENDP
 
 PUBLIC mm_check_write_begin, mm_check_write_end, mm_check_write_fail
-mm_check_write PROC ; check_addr: QWORD, check_size: QWORD
+mm_probe_write PROC ; check_addr: QWORD, check_size: QWORD
 	xchg rcx, rdx
 	; rcx = check_size
 	; rdx = check_addr
@@ -238,6 +238,6 @@ SUCC:
 mm_check_write_fail LABEL PTR
 	xor rax, rax
 	ret
-mm_check_write ENDP
+mm_probe_write ENDP
 
 END
@@ -23,6 +23,7 @@
 #include <syscall/tls.h>
 #include <log.h>
 #include <platform.h>
+#include <shared.h>
 
 #include <stdint.h>
 #define WIN32_LEAN_AND_MEAN
@@ -35,6 +36,24 @@ extern void *mm_check_write_begin, *mm_check_write_end, *mm_check_write_fail;
 extern int sys_gettimeofday(struct timeval *tv, struct timezone *tz);
 extern intptr_t sys_time(intptr_t *t);
 
+/* First chance handler of the common memory faults: CoW, on demand and detached blocks
+ * This is called on every such fault, anything it does not resolve goes to exception_handler()
+ */
+static LONG CALLBACK page_fault_handler(PEXCEPTION_POINTERS ep)
+{
+	if (ep->ExceptionRecord->ExceptionCode != EXCEPTION_ACCESS_VIOLATION)
+		return EXCEPTION_CONTINUE_SEARCH;
+	ULONG_PTR type = ep->ExceptionRecord->ExceptionInformation[0];
+	if (type == 8) /* DEP problem, handled in exception_handler() */
+		return EXCEPTION_CONTINUE_SEARCH;
+	void *addr = (void *)ep->ExceptionRecord->ExceptionInformation[1];
+	if (shared_handle_page_fault(addr))
+		return EXCEPTION_CONTINUE_EXECUTION;
+	if (mm_handle_page_fault(addr, type == 1? PAGE_FAULT_WRITE: PAGE_FAULT_READ))
+		return EXCEPTION_CONTINUE_EXECUTION;
+	return EXCEPTION_CONTINUE_SEARCH;
+}
+
 static LONG CALLBACK exception_handler(PEXCEPTION_POINTERS ep)
 {
 	if (ep->ExceptionRecord->ExceptionCode == DBG_CONTROL_C)
@@ -47,22 +66,18 @@ static LONG CALLBACK exception_handler(PEXCEPTION_POINTERS ep)
 		if (ep->ExceptionRecord->ExceptionInformation[0] == 8)
 		{
 			/* DEP problem */
-			if (mm_handle_page_fault(code, false))
+			if (mm_handle_page_fault(code, PAGE_FAULT_EXECUTE))
 				return EXCEPTION_CONTINUE_EXECUTION;
 			else
 			{
 				/* The problem may be actually in the next page */
-				if (mm_handle_page_fault(code + PAGE_SIZE, false))
+				if (mm_handle_page_fault(code + PAGE_SIZE, PAGE_FAULT_EXECUTE))
 					return EXCEPTION_CONTINUE_EXECUTION;
 			}
 		}
 		else
 		{
-			/* Read/write problem */
-			log_info("IP: 0x%p", ep->ContextRecord->Xip);
-			bool is_write = (ep->ExceptionRecord->ExceptionInformation[0] == 1);
-			if (mm_handle_page_fault((void *)ep->ExceptionRecord->ExceptionInformation[1], is_write))
-				return EXCEPTION_CONTINUE_EXECUTION;
+			/* Read/write problem, page_fault_handler() already failed to resolve it */
 			void *ip = (void *)ep->ContextRecord->Xip;
 			if (ip >= &mm_check_read_begin && ip <= &mm_check_read_end)
 			{
@@ -130,4 +145,7 @@ void install_syscall_handler()
 {
 	if (!AddVectoredExceptionHandler(TRUE, exception_handler))
 		log_error("AddVectoredExceptionHandler() failed.");
+	/* Added last to be called first */
+	if (!AddVectoredExceptionHandler(TRUE, page_fault_handler))
+		log_error("AddVectoredExceptionHandler() failed.");
 }
@@ -18,9 +18,14 @@
  */
 
 #include <syscall/process.h>
+#include <syscall/sig.h>
 #include <syscall/syscall.h>
 #include <syscall/syscall_dispatch.h>
+#include <syscall/timer.h>
+#include <etw.h>
+#include <flags.h>
 #include <log.h>
+#include <str.h>
 
 #include <stdint.h>
 
@@ -28,7 +33,7 @@
 
 typedef int64_t syscall_fn(int64_t rdi, int64_t rsi, int64_t rdx, int64_t r10, intptr_t r8, intptr_t r9, PCONTEXT context);
 
-#define SYSCALL_COUNT 323
+#define SYSCALL_COUNT 327
 #define SYSCALL(name) extern int64_t sys_##name(int64_t rdi, int64_t rsi, int64_t rdx, int64_t r10, intptr_t r8, intptr_t r9, PCONTEXT context);
 SYSCALL(read) /* syscall 0 */
 #include "syscall_table_x64.h"
@@ -42,11 +47,19 @@ static syscall_fn* syscall_table[SYSCALL_COUNT] =
 };
 #undef SYSCALL
 
+#define SYSCALL(name) #name,
+static const char *syscall_names[SYSCALL_COUNT] =
+{
+	SYSCALL(read) /* syscall 0 */
+#include "syscall_table_x64.h"
+};
+#undef SYSCALL
+
 #else
 
 typedef int syscall_fn(int ebx, int ecx, int edx, int esi, int edi, int ebp, PCONTEXT context);
 
-#define SYSCALL_COUNT 359
+#define SYSCALL_COUNT 378
 #define SYSCALL(name) extern int sys_##name(int ebx, int ecx, int edx, int esi, int edi, int ebp, PCONTEXT context);
 #include "syscall_table_x86.h"
 #undef SYSCALL
@@ -58,7 +71,190 @@ syscall_fn* syscall_table[SYSCALL_COUNT] =
 #include "syscall_table_x86.h"
 };
 #undef SYSCALL
+
+#define SYSCALL(name) #name,
+static const char *syscall_names[SYSCALL_COUNT] =
+{
+	SYSCALL(unimplemented) /* syscall 0 */
+#include "syscall_table_x86.h"
+};
+#undef SYSCALL
+#endif
+
+/* Per syscall counters and latency histograms of current process
+ * Every thread updates them with interlocked operations, no lock is taken on the syscall path.
+ * Syscalls called directly by translated code (see syscall_get_fast_handler()) are not counted.
+ * Histogram bucket i counts syscalls which took [2^(i-1), 2^i) microseconds, the last one all slower.
+ */
+#define SYSCALL_HISTOGRAM_BUCKETS	16
+struct syscall_stat
+{
+	volatile LONG calls;
+	volatile LONG errors;
+	volatile LONG64 total_ns;
+	volatile LONG histogram[SYSCALL_HISTOGRAM_BUCKETS];
+};
+static struct syscall_stat syscall_stats[SYSCALL_COUNT];
+
+/* The syscall in progress on current thread, -1 if none */
+static __declspec(thread) int syscall_current_id = -1;
+static __declspec(thread) uint64_t syscall_current_start;
+
+/* The stats hooks run on entry and exit of every dispatched syscall, they also tell the signal
+ * code whether the thread is inside a syscall */
+void syscall_stats_begin(int id)
+{
+	signal_syscall_enter();
+	syscall_current_id = id;
+	syscall_current_start = timer_monotonic_ns();
+	if (etw_enabled(ETW_KEYWORD_SYSCALL))
+		etw_syscall_enter(id, syscall_names[id]);
+}
+
+void syscall_stats_end(intptr_t result)
+{
+	signal_syscall_leave();
+	int id = syscall_current_id;
+	if (id < 0)
+		return;
+	syscall_current_id = -1;
+	uint64_t ns = timer_monotonic_ns() - syscall_current_start;
+	if (etw_enabled(ETW_KEYWORD_SYSCALL))
+		etw_syscall_exit(id, syscall_names[id], result, ns);
+	struct syscall_stat *stat = &syscall_stats[id];
+	InterlockedIncrement(&stat->calls);
+	if ((uintptr_t)result >= (uintptr_t)-4095)
+		InterlockedIncrement(&stat->errors);
+	InterlockedExchangeAdd64(&stat->total_ns, ns);
+	uint64_t us = ns / 1000ULL;
+	int bucket = 0;
+	while (bucket < SYSCALL_HISTOGRAM_BUCKETS - 1 && us >= (1ULL << bucket))
+		bucket++;
+	InterlockedIncrement(&stat->histogram[bucket]);
+}
+
+/* Sort called syscalls by total time, descending, returns count */
+static int syscall_stats_sort(int *order, uint64_t *total_ns)
+{
+	int count = 0;
+	*total_ns = 0;
+	for (int i = 0; i < SYSCALL_COUNT; i++)
+	{
+		if (!syscall_stats[i].calls)
+			continue;
+		uint64_t ns = syscall_stats[i].total_ns;
+		*total_ns += ns;
+		int j = count++;
+		for (; j > 0 && (uint64_t)syscall_stats[order[j - 1]].total_ns < ns; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+	return count;
+}
+
+static const char *syscall_stats_header =
+	"% time     seconds  usecs/call     calls    errors syscall";
+
+static int syscall_stats_format_line(char *buf, int id, uint64_t total_ns)
+{
+	const struct syscall_stat *stat = &syscall_stats[id];
+	uint64_t ns = stat->total_ns;
+	int permille = total_ns? (int)(ns * 1000 / total_ns): 0;
+	return ksprintf(buf, "%3d.%d %5llu.%06llu %11llu %9d %9d %s",
+		permille / 10, permille % 10, ns / 1000000000ULL, ns / 1000ULL % 1000000ULL,
+		ns / 1000ULL / stat->calls, stat->calls, stat->errors, syscall_names[id]);
+}
+
+int syscall_get_stats(char *buf)
+{
+	char *original = buf;
+	int order[SYSCALL_COUNT];
+	uint64_t total_ns;
+	int count = syscall_stats_sort(order, &total_ns);
+	buf += ksprintf(buf, "%s\n", syscall_stats_header);
+	for (int i = 0; i < count; i++)
+	{
+		buf += syscall_stats_format_line(buf, order[i], total_ns);
+		buf += ksprintf(buf, "\n");
+	}
+	buf += ksprintf(buf, "\nsyscall histogram (buckets of 2^i us)\n");
+	for (int i = 0; i < count; i++)
+	{
+		const struct syscall_stat *stat = &syscall_stats[order[i]];
+		buf += ksprintf(buf, "%s:", syscall_names[order[i]]);
+		for (int j = 0; j < SYSCALL_HISTOGRAM_BUCKETS; j++)
+			buf += ksprintf(buf, " %d", stat->histogram[j]);
+		buf += ksprintf(buf, "\n");
+	}
+	return buf - original;
+}
+
+void syscall_stats_report()
+{
+	if (!cmdline_flags->syscall_stats)
+		return;
+	int order[SYSCALL_COUNT];
+	uint64_t total_ns;
+	int count = syscall_stats_sort(order, &total_ns);
+	uint64_t total_calls = 0, total_errors = 0;
+	char line[256];
+	log_info("syscall summary:");
+	log_info("%s", syscall_stats_header);
+	for (int i = 0; i < count; i++)
+	{
+		syscall_stats_format_line(line, order[i], total_ns);
+		log_info("%s", line);
+		total_calls += syscall_stats[order[i]].calls;
+		total_errors += syscall_stats[order[i]].errors;
+	}
+	log_info("100.0 %5llu.%06llu %11llu %9llu %9llu total",
+		total_ns / 1000000000ULL, total_ns / 1000ULL % 1000000ULL,
+		total_calls? total_ns / 1000ULL / total_calls: 0, total_calls, total_errors);
+}
+
+void *syscall_get_fast_handler(int id)
+{
+#ifdef _WIN64
+	switch (id)
+	{
+	case 39: /* getpid */
+	case 96: /* gettimeofday */
+	case 102: /* getuid */
+	case 104: /* getgid */
+	case 107: /* geteuid */
+	case 108: /* getegid */
+	case 110: /* getppid */
+	case 201: /* time */
+	case 228: /* clock_gettime */
+	case 309: /* getcpu */
+		return syscall_table[id];
+	default:
+		return NULL;
+	}
+#else
+	switch (id)
+	{
+	case 13: /* time */
+	case 20: /* getpid */
+	case 24: /* getuid */
+	case 47: /* getgid */
+	case 49: /* geteuid */
+	case 50: /* getegid */
+	case 64: /* getppid */
+	case 78: /* gettimeofday */
+	case 199: /* getuid32 */
+	case 200: /* getgid32 */
+	case 201: /* geteuid32 */
+	case 202: /* getegid32 */
+	case 224: /* gettid */
+	case 265: /* clock_gettime */
+	case 318: /* getcpu */
+		return syscall_table[id];
+	default:
+		return NULL;
+	}
 #endif
+}
 
 void sys_unimplemented_imp(intptr_t id)
 {
@@ -70,6 +266,13 @@ void sys_unimplemented_imp(intptr_t id)
 void dispatch_syscall(PCONTEXT context)
 {
 #ifdef _WIN64
+	if (context->Rax >= SYSCALL_COUNT)
+	{
+		sys_unimplemented_imp(context->Rax);
+		return;
+	}
+	syscall_stats_begin((int)context->Rax);
 	context->Rax = (*syscall_table[context->Rax])(context->Rdi, context->Rsi, context->Rdx, context->R10, context->R8, context->R9, context);
+	syscall_stats_end((intptr_t)context->Rax);
 #endif
 }
@@ -21,5 +21,18 @@
 
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#include <stdint.h>
 
 void dispatch_syscall(PCONTEXT context);
+
+/* Get the handler of a syscall which does not need syscall context and could be called
+ * directly by translated code, NULL if the syscall must go through the syscall handler */
+void *syscall_get_fast_handler(int id);
+
+/* Record the start and the result of a syscall of current thread, for per syscall statistics */
+void syscall_stats_begin(int id);
+void syscall_stats_end(intptr_t result);
+/* Print per syscall counters and latency histograms of current process to buf, returns length */
+int syscall_get_stats(char *buf);
+/* Log a strace -c like summary of syscalls, only effective with --syscall-stats */
+void syscall_stats_report();
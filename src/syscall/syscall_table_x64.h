@@ -37,7 +37,7 @@ SYSCALL(unimplemented)
 SYSCALL(alarm)
 SYSCALL(setitimer)
 SYSCALL(getpid)
-SYSCALL(unimplemented)
+SYSCALL(sendfile)
 SYSCALL(socket)
 SYSCALL(connect)
 SYSCALL(accept)
@@ -200,14 +200,14 @@ SYSCALL(fremovexattr)
 SYSCALL(unimplemented)
 SYSCALL(time)
 SYSCALL(futex)
-SYSCALL(unimplemented)
+SYSCALL(sched_setaffinity)
 SYSCALL(sched_getaffinity)
 SYSCALL(unimplemented)
-SYSCALL(unimplemented)
-SYSCALL(unimplemented)
-SYSCALL(unimplemented)
-SYSCALL(unimplemented)
-SYSCALL(unimplemented)
+SYSCALL(io_setup)
+SYSCALL(io_destroy)
+SYSCALL(io_getevents)
+SYSCALL(io_submit)
+SYSCALL(io_cancel)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
 SYSCALL(epoll_create)
@@ -218,7 +218,7 @@ SYSCALL(getdents64)
 SYSCALL(set_tid_address)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
-SYSCALL(unimplemented)
+SYSCALL(fadvise64)
 SYSCALL(timer_create)
 SYSCALL(timer_settime)
 SYSCALL(timer_gettime)
@@ -227,7 +227,7 @@ SYSCALL(timer_delete)
 SYSCALL(unimplemented)
 SYSCALL(clock_gettime)
 SYSCALL(clock_getres)
-SYSCALL(fadvise64)
+SYSCALL(clock_nanosleep)
 SYSCALL(exit_group)
 SYSCALL(epoll_wait)
 SYSCALL(epoll_ctl)
@@ -272,21 +272,21 @@ SYSCALL(ppoll)
 SYSCALL(unimplemented)
 SYSCALL(set_robust_list)
 SYSCALL(unimplemented)
-SYSCALL(unimplemented)
+SYSCALL(splice)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
 SYSCALL(utimensat)
 SYSCALL(unimplemented)
-SYSCALL(unimplemented)
-SYSCALL(unimplemented)
+SYSCALL(signalfd)
+SYSCALL(timerfd_create)
 SYSCALL(unimplemented)
 SYSCALL(fallocate)
+SYSCALL(timerfd_settime)
+SYSCALL(timerfd_gettime)
 SYSCALL(unimplemented)
-SYSCALL(unimplemented)
-SYSCALL(unimplemented)
-SYSCALL(unimplemented)
+SYSCALL(signalfd4)
 SYSCALL(eventfd2)
 SYSCALL(epoll_create1)
 SYSCALL(dup3)
@@ -296,7 +296,7 @@ SYSCALL(preadv)
 SYSCALL(pwritev)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
-SYSCALL(unimplemented)
+SYSCALL(recvmmsg)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
 SYSCALL(prlimit64)
@@ -320,3 +320,7 @@ SYSCALL(unimplemented)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(copy_file_range)
@@ -184,7 +184,7 @@ SYSCALL(getcwd)
 SYSCALL(capget)
 SYSCALL(capset)
 SYSCALL(sigaltstack)
-SYSCALL(unimplemented)
+SYSCALL(sendfile)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
 SYSCALL(vfork)
@@ -236,17 +236,17 @@ SYSCALL(removexattr)
 SYSCALL(lremovexattr)
 SYSCALL(fremovexattr)
 SYSCALL(unimplemented)
-SYSCALL(unimplemented)
+SYSCALL(sendfile64)
 SYSCALL(futex)
-SYSCALL(unimplemented)
+SYSCALL(sched_setaffinity)
 SYSCALL(sched_getaffinity)
 SYSCALL(set_thread_area)
 SYSCALL(unimplemented)
-SYSCALL(unimplemented)
-SYSCALL(unimplemented)
-SYSCALL(unimplemented)
-SYSCALL(unimplemented)
-SYSCALL(unimplemented)
+SYSCALL(io_setup)
+SYSCALL(io_destroy)
+SYSCALL(io_getevents)
+SYSCALL(io_submit)
+SYSCALL(io_cancel)
 SYSCALL(fadvise64)
 SYSCALL(unimplemented)
 SYSCALL(exit_group)
@@ -264,7 +264,7 @@ SYSCALL(timer_delete)
 SYSCALL(unimplemented)
 SYSCALL(clock_gettime)
 SYSCALL(clock_getres)
-SYSCALL(unimplemented)
+SYSCALL(clock_nanosleep)
 SYSCALL(statfs64)
 SYSCALL(fstatfs64)
 SYSCALL(tgkill)
@@ -310,7 +310,7 @@ SYSCALL(ppoll)
 SYSCALL(unimplemented)
 SYSCALL(set_robust_list)
 SYSCALL(unimplemented)
-SYSCALL(unimplemented)
+SYSCALL(splice)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
@@ -318,13 +318,13 @@ SYSCALL(unimplemented)
 SYSCALL(getcpu)
 SYSCALL(unimplemented)
 SYSCALL(utimensat)
-SYSCALL(unimplemented)
-SYSCALL(unimplemented)
+SYSCALL(signalfd)
+SYSCALL(timerfd_create)
 SYSCALL(unimplemented)
 SYSCALL(fallocate)
-SYSCALL(unimplemented)
-SYSCALL(unimplemented)
-SYSCALL(unimplemented)
+SYSCALL(timerfd_settime)
+SYSCALL(timerfd_gettime)
+SYSCALL(signalfd4)
 SYSCALL(eventfd2)
 SYSCALL(epoll_create1)
 SYSCALL(dup3)
@@ -334,7 +334,7 @@ SYSCALL(preadv)
 SYSCALL(pwritev)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
-SYSCALL(unimplemented)
+SYSCALL(recvmmsg)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
 SYSCALL(prlimit64)
@@ -356,3 +356,22 @@ SYSCALL(getrandom)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
 SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(unimplemented)
+SYSCALL(copy_file_range)
@@ -0,0 +1,195 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <common/errno.h>
+#include <syscall/process.h>
+#include <syscall/timeline.h>
+#include <log.h>
+#include <shared.h>
+#include <str.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <ntdll.h>
+
+#define TIMELINE_RECORD_COUNT	1024
+#define TIMELINE_COMM_MAX		16
+/* Output limit of timeline_get_trace(), procfs generates text in a 64kB buffer */
+#define TIMELINE_TRACE_MAX		(65536 - 256)
+
+struct timeline_record
+{
+	volatile LONG sequence; /* Index of the record plus one, 0 while it is written */
+	int event;
+	pid_t pid, ppid;
+	int arg;
+	uint64_t start, duration; /* QueryPerformanceCounter() ticks */
+	char comm[TIMELINE_COMM_MAX];
+};
+
+struct timeline_data
+{
+	volatile LONG next; /* Index of the next record, the slot is index % TIMELINE_RECORD_COUNT */
+	struct timeline_record records[TIMELINE_RECORD_COUNT];
+};
+
+/* Process local state, reinitialized when the process id changes, i.e. in a forked child */
+static SRWLOCK timeline_lock = SRWLOCK_INIT;
+static DWORD timeline_pid;
+static struct timeline_data *timeline;
+static uint64_t timeline_frequency;
+
+static bool timeline_init()
+{
+	DWORD pid = GetCurrentProcessId();
+	if (timeline_pid == pid)
+		return true;
+	AcquireSRWLockExclusive(&timeline_lock);
+	if (timeline_pid != pid)
+	{
+		LARGE_INTEGER freq;
+		QueryPerformanceFrequency(&freq);
+		timeline_frequency = freq.QuadPart;
+		/* The section handle is inherited from the parent if it opened it before fork() */
+		NTSTATUS status;
+		HANDLE section;
+		if (!(section = shared_get_handle(SHARED_HANDLE_TIMELINE_SECTION)))
+		{
+			UNICODE_STRING name;
+			RtlInitUnicodeString(&name, L"timeline");
+			OBJECT_ATTRIBUTES oa;
+			InitializeObjectAttributes(&oa, &name, OBJ_INHERIT | OBJ_OPENIF, shared_get_object_directory(), NULL);
+			LARGE_INTEGER size;
+			size.QuadPart = sizeof(struct timeline_data);
+			status = NtCreateSection(&section, SECTION_MAP_READ | SECTION_MAP_WRITE, &oa, &size,
+				PAGE_READWRITE, SEC_COMMIT, NULL);
+			if (!NT_SUCCESS(status))
+			{
+				log_error("NtCreateSection() failed, status: %x", status);
+				ReleaseSRWLockExclusive(&timeline_lock);
+				return false;
+			}
+			section = shared_set_handle(SHARED_HANDLE_TIMELINE_SECTION, section);
+		}
+		PVOID view = NULL;
+		SIZE_T view_size = sizeof(struct timeline_data);
+		status = NtMapViewOfSection(section, NtCurrentProcess(), &view, 0, view_size, NULL, &view_size,
+			ViewUnmap, MEM_TOP_DOWN, PAGE_READWRITE);
+		if (!NT_SUCCESS(status))
+		{
+			log_error("NtMapViewOfSection() failed, status: %x", status);
+			ReleaseSRWLockExclusive(&timeline_lock);
+			return false;
+		}
+		timeline = (struct timeline_data *)view;
+		timeline_pid = pid;
+	}
+	ReleaseSRWLockExclusive(&timeline_lock);
+	return true;
+}
+
+uint64_t timeline_now()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+void timeline_record(int event, uint64_t start, int arg, const char *comm)
+{
+	uint64_t now = timeline_now();
+	if (!timeline_init())
+		return;
+	LONG index = InterlockedIncrement(&timeline->next) - 1;
+	struct timeline_record *record = &timeline->records[(ULONG)index % TIMELINE_RECORD_COUNT];
+	record->sequence = 0;
+	MemoryBarrier();
+	record->event = event;
+	record->pid = process_get_pid();
+	record->ppid = process_get_ppid(record->pid);
+	record->arg = arg;
+	record->start = start;
+	record->duration = now - start;
+	int len = 0;
+	if (comm)
+	{
+		/* Only keep the file name, and nothing which needs escaping in JSON */
+		for (const char *p = comm; *p; p++)
+			if (*p == '/')
+				comm = p + 1;
+		for (; len < TIMELINE_COMM_MAX - 1 && comm[len]; len++)
+			record->comm[len] = (comm[len] == '"' || comm[len] == '\\' || (unsigned char)comm[len] < 0x20) ? '_' : comm[len];
+	}
+	record->comm[len] = 0;
+	MemoryBarrier();
+	record->sequence = index + 1;
+}
+
+static const char *timeline_event_names[] =
+{
+	"fork",
+	"execve",
+	"wait",
+	"exit",
+};
+
+int timeline_get_trace(char *buf)
+{
+	if (!timeline_init())
+		return -L_EIO;
+	char *original = buf;
+	buf += ksprintf(buf, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	/* Newest first, the viewer sorts by timestamp, so the oldest records are the ones left out */
+	LONG end = timeline->next;
+	LONG begin = end > TIMELINE_RECORD_COUNT ? end - TIMELINE_RECORD_COUNT : 0;
+	bool first = true;
+	for (LONG index = end - 1; index >= begin && buf - original < TIMELINE_TRACE_MAX; index--)
+	{
+		struct timeline_record *slot = &timeline->records[(ULONG)index % TIMELINE_RECORD_COUNT];
+		struct timeline_record record = *slot;
+		MemoryBarrier();
+		/* Skip records being written or overwritten while we copied them */
+		if (record.sequence != index + 1 || slot->sequence != index + 1)
+			continue;
+		record.comm[TIMELINE_COMM_MAX - 1] = 0;
+		/* Microseconds since boot, split to not overflow */
+		uint64_t ts = record.start / timeline_frequency * 1000000ULL + record.start % timeline_frequency * 1000000ULL / timeline_frequency;
+		uint64_t dur = record.duration * 1000000ULL / timeline_frequency;
+		buf += ksprintf(buf, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%llu,", first ? "" : ",\n",
+			timeline_event_names[record.event], record.event == TIMELINE_EVENT_EXIT ? "i" : "X", ts);
+		if (record.event != TIMELINE_EVENT_EXIT)
+			buf += ksprintf(buf, "\"dur\":%llu,", dur);
+		buf += ksprintf(buf, "\"pid\":%d,\"tid\":%d,\"args\":{\"ppid\":%d", record.pid, record.pid, record.ppid);
+		if (record.event == TIMELINE_EVENT_FORK)
+			buf += ksprintf(buf, ",\"child\":%d}}", record.arg);
+		else if (record.event == TIMELINE_EVENT_WAIT)
+			buf += ksprintf(buf, ",\"pid\":%d}}", record.arg);
+		else if (record.event == TIMELINE_EVENT_EXIT)
+			buf += ksprintf(buf, ",\"code\":%d}}", record.arg);
+		else
+		{
+			/* Name the process after the program it runs */
+			buf += ksprintf(buf, ",\"comm\":\"%s\"}},\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+				record.comm, record.pid, record.comm);
+		}
+		first = false;
+	}
+	buf += ksprintf(buf, "\n]}\n");
+	return buf - original;
+}
@@ -0,0 +1,42 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <common/types.h>
+
+#include <stdint.h>
+
+/* Session wide process timeline
+ * Every process of the session appends fork(), execve(), wait and exit records to a ring in a
+ * shared section. /proc/flinux_timeline exports the ring in Chrome trace event format, which
+ * chrome://tracing and Perfetto load as a per process timeline. Old records are overwritten,
+ * only the most recent ones which fit in one procfs read are exported.
+ */
+#define TIMELINE_EVENT_FORK		0 /* arg: child pid */
+#define TIMELINE_EVENT_EXEC		1 /* comm: new executable */
+#define TIMELINE_EVENT_WAIT		2 /* arg: reaped child pid */
+#define TIMELINE_EVENT_EXIT		3 /* arg: exit code, no duration */
+
+/* Current timestamp, pass as start to timeline_record() */
+uint64_t timeline_now();
+/* Append a record of current process for an event which started at start */
+void timeline_record(int event, uint64_t start, int arg, const char *comm);
+/* Generate the Chrome trace JSON of the ring */
+int timeline_get_trace(char *buf);
@@ -17,11 +17,16 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_TIMER
+
 #include <common/errno.h>
 #include <syscall/mm.h>
+#include <syscall/process_info.h>
+#include <syscall/sig.h>
 #include <syscall/syscall.h>
 #include <syscall/timer.h>
 #include <datetime.h>
+#include <flags.h>
 #include <log.h>
 #include <win7compat.h>
 
@@ -29,6 +34,79 @@
 #include <Windows.h>
 #include <ntdll.h>
 
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION	0x00000002
+#endif
+
+/* Sleeps shorter than this raise the system timer resolution while pending when --timer-high-res is given */
+#define TIMER_SHORT_SLEEP_NS	(50ULL * 1000000ULL)
+
+/* The performance counter frequency is fixed at boot, so it is queried only once.
+ * Counter values are converted to nanoseconds as (counter / freq) * 10^9 plus a 32.32 fixed point
+ * multiplication of the remainder. As remainder < freq, remainder * multiplier < 10^9 * 2^32, so it
+ * never overflows no matter how large the frequency is.
+ */
+static uint64_t qpc_frequency;
+static uint64_t qpc_multiplier; /* (10^9 << 32) / frequency */
+static uint64_t qpc_resolution_ns;
+
+/* The system timer resolution is raised on behalf of all short sleeps currently pending in the process
+ * and restored when the last one finishes. Windows tracks the requests per process.
+ */
+static ULONG timer_fine_resolution; /* In 100ns units */
+static SRWLOCK timer_resolution_lock;
+static int timer_resolution_requests;
+
+void timer_init()
+{
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	qpc_frequency = freq.QuadPart;
+	qpc_multiplier = (NANOSECONDS_PER_SECOND << 32) / qpc_frequency;
+	qpc_resolution_ns = (NANOSECONDS_PER_SECOND + qpc_frequency - 1) / qpc_frequency;
+	ULONG coarse, actual;
+	NtQueryTimerResolution(&coarse, &timer_fine_resolution, &actual);
+	InitializeSRWLock(&timer_resolution_lock);
+	timer_resolution_requests = 0;
+}
+
+uint64_t timer_monotonic_ns()
+{
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	uint64_t sec = (uint64_t)counter.QuadPart / qpc_frequency;
+	uint64_t rem = (uint64_t)counter.QuadPart - sec * qpc_frequency;
+	return sec * NANOSECONDS_PER_SECOND + ((rem * qpc_multiplier) >> 32);
+}
+
+uint64_t timer_monotonic_ms()
+{
+	return timer_monotonic_ns() / 1000000ULL;
+}
+
+uint64_t timer_monotonic_res_ns()
+{
+	return qpc_resolution_ns;
+}
+
+int64_t timer_timespec_to_ns(const struct timespec *ts)
+{
+	if (ts->tv_sec < 0 || ts->tv_nsec < 0 || ts->tv_nsec >= (long)NANOSECONDS_PER_SECOND)
+		return -1;
+	return (int64_t)ts->tv_sec * NANOSECONDS_PER_SECOND + ts->tv_nsec;
+}
+
+int timer_timespec_to_ms(const struct timespec *ts)
+{
+	int64_t ns = timer_timespec_to_ns(ts);
+	if (ns < 0)
+		return -L_EINVAL;
+	uint64_t ms = ((uint64_t)ns + 999999ULL) / 1000000ULL;
+	if (ms > INT32_MAX)
+		return INT32_MAX;
+	return (int)ms;
+}
+
 DEFINE_SYSCALL(time, intptr_t *, c)
 {
 	log_info("time(%p)", c);
@@ -63,15 +141,129 @@ DEFINE_SYSCALL(gettimeofday, struct timeval *, tv, struct timezone *, tz)
 	return 0;
 }
 
+static void timer_request_resolution(bool raise)
+{
+	AcquireSRWLockExclusive(&timer_resolution_lock);
+	if (raise ? timer_resolution_requests++ == 0 : --timer_resolution_requests == 0)
+	{
+		ULONG actual;
+		NtSetTimerResolution(timer_fine_resolution, raise, &actual);
+	}
+	ReleaseSRWLockExclusive(&timer_resolution_lock);
+}
+
+/* Get the waitable timer of the current thread used for sleeping, created on first use
+ * High resolution timers are only available since Windows 10 1803, otherwise the timer expires at
+ * the system timer resolution.
+ */
+static HANDLE timer_get_sleep_timer()
+{
+	if (!current_thread->sleep_timer)
+	{
+		current_thread->sleep_timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+		if (!current_thread->sleep_timer)
+			current_thread->sleep_timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+		if (!current_thread->sleep_timer)
+			log_error("CreateWaitableTimerExW() failed, error code: %d", GetLastError());
+	}
+	return current_thread->sleep_timer;
+}
+
+/* Sleep until the given due time in SetWaitableTimer() format: negative for a relative interval
+ * in 100ns units, positive for an absolute FILETIME. ns is the length of the sleep for deciding whether
+ * it is short. Returns -L_EINTR if interrupted by a signal.
+ */
+static int timer_sleep(LARGE_INTEGER due_time, uint64_t ns)
+{
+	HANDLE timer = timer_get_sleep_timer();
+	if (!timer)
+		return -L_ENOMEM;
+	bool raise = cmdline_flags->timer_high_res && ns < TIMER_SHORT_SLEEP_NS;
+	if (raise)
+		timer_request_resolution(true);
+	SetWaitableTimer(timer, &due_time, 0, NULL, NULL, FALSE);
+	DWORD result = signal_wait(1, &timer, INFINITE);
+	if (raise)
+		timer_request_resolution(false);
+	if (result == WAIT_INTERRUPTED)
+	{
+		CancelWaitableTimer(timer);
+		return -L_EINTR;
+	}
+	return 0;
+}
+
+/* Relative sleep on the monotonic clock, stores the unslept time in rem on interruption */
+static int timer_sleep_relative(uint64_t ns, struct timespec *rem)
+{
+	if (ns == 0)
+		return 0;
+	uint64_t start = timer_monotonic_ns();
+	LARGE_INTEGER due_time;
+	due_time.QuadPart = -(int64_t)((ns + NANOSECONDS_PER_TICK - 1) / NANOSECONDS_PER_TICK);
+	int r = timer_sleep(due_time, ns);
+	if (r == -L_EINTR && rem)
+	{
+		uint64_t elapsed = timer_monotonic_ns() - start;
+		uint64_t left = elapsed < ns ? ns - elapsed : 0;
+		rem->tv_sec = (long)(left / NANOSECONDS_PER_SECOND);
+		rem->tv_nsec = (long)(left % NANOSECONDS_PER_SECOND);
+	}
+	return r;
+}
+
 DEFINE_SYSCALL(nanosleep, const struct timespec *, req, struct timespec *, rem)
 {
 	log_info("nanosleep(0x%p, 0x%p)", req, rem);
 	if (!mm_check_read(req, sizeof(struct timespec)) || rem && !mm_check_write(rem, sizeof(struct timespec)))
 		return -L_EFAULT;
-	LARGE_INTEGER delay_interval;
-	delay_interval.QuadPart = 0ULL - (((uint64_t)req->tv_sec * 1000000000ULL + req->tv_nsec) / 100ULL);
-	NtDelayExecution(FALSE, &delay_interval);
-	return 0;
+	int64_t ns = timer_timespec_to_ns(req);
+	if (ns < 0)
+		return -L_EINVAL;
+	return timer_sleep_relative((uint64_t)ns, rem);
+}
+
+DEFINE_SYSCALL(clock_nanosleep, int, clk_id, int, flags, const struct timespec *, req, struct timespec *, rem)
+{
+	log_info("clock_nanosleep(%d, 0x%x, 0x%p, 0x%p)", clk_id, flags, req, rem);
+	if (!mm_check_read(req, sizeof(struct timespec)))
+		return -L_EFAULT;
+	if (!(flags & TIMER_ABSTIME) && rem && !mm_check_write(rem, sizeof(struct timespec)))
+		return -L_EFAULT;
+	int64_t ns = timer_timespec_to_ns(req);
+	if (ns < 0)
+		return -L_EINVAL;
+	switch (clk_id)
+	{
+	case CLOCK_REALTIME:
+	{
+		if (!(flags & TIMER_ABSTIME))
+			return timer_sleep_relative((uint64_t)ns, rem);
+		/* An absolute due time follows changes of the system time like Linux does */
+		FILETIME due, now;
+		unix_timespec_to_filetime(req, &due);
+		win7compat_GetSystemTimePreciseAsFileTime(&now);
+		uint64_t due_ns = filetime_to_unix_nsec(&due), now_ns = filetime_to_unix_nsec(&now);
+		if (due_ns <= now_ns)
+			return 0;
+		LARGE_INTEGER due_time;
+		due_time.LowPart = due.dwLowDateTime;
+		due_time.HighPart = due.dwHighDateTime;
+		return timer_sleep(due_time, due_ns - now_ns);
+	}
+	case CLOCK_MONOTONIC:
+	case CLOCK_BOOTTIME:
+	{
+		if (!(flags & TIMER_ABSTIME))
+			return timer_sleep_relative((uint64_t)ns, rem);
+		uint64_t now = timer_monotonic_ns();
+		if ((uint64_t)ns <= now)
+			return 0;
+		return timer_sleep_relative((uint64_t)ns - now, NULL);
+	}
+	default:
+		return -L_EINVAL;
+	}
 }
 
 DEFINE_SYSCALL(clock_gettime, int, clk_id, struct timespec *, tp)
@@ -88,14 +280,18 @@ DEFINE_SYSCALL(clock_gettime, int, clk_id, struct timespec *, tp)
 		filetime_to_unix_timespec(&system_time, tp);
 		return 0;
 	}
+	case CLOCK_REALTIME_COARSE:
+	{
+		FILETIME system_time;
+		GetSystemTimeAsFileTime(&system_time);
+		filetime_to_unix_timespec(&system_time, tp);
+		return 0;
+	}
 	case CLOCK_MONOTONIC:
 	case CLOCK_MONOTONIC_COARSE:
 	case CLOCK_MONOTONIC_RAW:
 	{
-		LARGE_INTEGER freq, counter;
-		QueryPerformanceFrequency(&freq);
-		QueryPerformanceCounter(&counter);
-		uint64_t ns = (double)counter.QuadPart / (double)freq.QuadPart * NANOSECONDS_PER_SECOND;
+		uint64_t ns = timer_monotonic_ns();
 		tp->tv_sec = ns / NANOSECONDS_PER_SECOND;
 		tp->tv_nsec = ns % NANOSECONDS_PER_SECOND;
 		return 0;
@@ -125,19 +321,9 @@ DEFINE_SYSCALL(clock_getres, int, clk_id, struct timespec *, res)
 	case CLOCK_MONOTONIC_COARSE:
 	case CLOCK_MONOTONIC_RAW:
 	{
-		LARGE_INTEGER freq;
-		QueryPerformanceFrequency(&freq);
-		uint64_t ns = (double)1. / (double)freq.QuadPart;
-		if (ns == 0)
-		{
-			res->tv_sec = 0;
-			res->tv_nsec = 1;
-		}
-		else
-		{
-			res->tv_sec = ns / NANOSECONDS_PER_SECOND;
-			res->tv_nsec = ns % NANOSECONDS_PER_SECOND;
-		}
+		uint64_t ns = timer_monotonic_res_ns();
+		res->tv_sec = ns / NANOSECONDS_PER_SECOND;
+		res->tv_nsec = ns % NANOSECONDS_PER_SECOND;
 		return 0;
 	}
 	default:
@@ -18,3 +18,22 @@
  */
 
 #pragma once
+
+#include <common/time.h>
+
+#include <stdint.h>
+
+void timer_init();
+
+/* Monotonic clock based on QueryPerformanceCounter() */
+uint64_t timer_monotonic_ns();
+uint64_t timer_monotonic_ms();
+/* Resolution of the monotonic clock in nanoseconds, at least 1 */
+uint64_t timer_monotonic_res_ns();
+
+/* Convert a relative timeout to nanoseconds, -1 on invalid tv_nsec */
+int64_t timer_timespec_to_ns(const struct timespec *ts);
+/* Convert a relative timeout to milliseconds for Windows wait functions, rounded up and capped at INT32_MAX
+ * Returns -L_EINVAL for a negative or unnormalized timeout.
+ */
+int timer_timespec_to_ms(const struct timespec *ts);
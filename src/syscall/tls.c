@@ -19,6 +19,7 @@
 
 #include <common/errno.h>
 #include <common/prctl.h>
+#include <dbt/x86.h>
 #include <syscall/mm.h>
 #include <syscall/syscall.h>
 #include <syscall/tls.h>
@@ -165,7 +166,13 @@ int tls_set_thread_area(struct user_desc *u_info)
 		}
 	}
 	else
+	{
 		TlsSetValue(tls->entries[u_info->entry_number], (LPVOID)u_info->base_addr);
+		/* Refresh cached gs base if the entry is currently in use */
+		int gs = dbt_get_gs();
+		if (gs && (gs >> 3) == u_info->entry_number)
+			dbt_update_tls(gs);
+	}
 	ReleaseSRWLockExclusive(&tls->rw_lock);
 	return ret;
 }
@@ -181,12 +188,24 @@ DEFINE_SYSCALL(arch_prctl, int, code, uintptr_t, addr)
 	switch (code)
 	{
 	case ARCH_SET_FS:
+#ifdef _WIN64
+		dbt_set_fs_base(addr);
+		return 0;
+#else
 		log_error("ARCH_SET_FS not supported.");
 		return -L_EINVAL;
+#endif
 
 	case ARCH_GET_FS:
+#ifdef _WIN64
+		if (!mm_check_write((void *)addr, sizeof(size_t)))
+			return -L_EFAULT;
+		*(size_t *)addr = dbt_get_fs_base();
+		return 0;
+#else
 		log_error("ARCH_GET_FS not supported.");
 		return -L_EINVAL;
+#endif
 
 	case ARCH_SET_GS:
 		log_error("ARCH_SET_GS not supported.");
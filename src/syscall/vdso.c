@@ -0,0 +1,250 @@
+/*
+ * This file is part of Foreign Linux.
+ *
+ * Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <binfmt/elf.h>
+#include <binfmt/elf-em.h>
+#include <common/mman.h>
+#include <syscall/mm.h>
+#include <syscall/vdso.h>
+#include <log.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* vDSO image
+ * The image is a tiny ELF shared object generated at runtime. Time functions read the
+ * KUSER_SHARED_DATA page (0x7FFE0000) which Windows maps read only into every process and
+ * keeps updated, so they run entirely in user mode. Other clocks fall back to int 0x80
+ * right after a constant syscall number, which dbt turns into a direct handler call.
+ */
+
+#ifndef _WIN64
+
+static const uint8_t vdso_text[] =
+{
+	/* 0x00: __kernel_vsyscall */
+	0xCD, 0x80,							/* int 0x80 */
+	0xC3,								/* ret */
+
+	/* 0x03: __vdso_time(time_t *t) */
+	0x8B, 0x15, 0x18, 0x00, 0xFE, 0x7F,	/* 1: mov edx, ds:[0x7FFE0018] ; SystemTime.High1Time */
+	0xA1, 0x14, 0x00, 0xFE, 0x7F,		/* mov eax, ds:[0x7FFE0014] ; SystemTime.LowPart */
+	0x3B, 0x15, 0x1C, 0x00, 0xFE, 0x7F,	/* cmp edx, ds:[0x7FFE001C] ; SystemTime.High2Time */
+	0x75, 0xED,							/* jne 1b */
+	0x2D, 0x00, 0x80, 0x3E, 0xD5,		/* sub eax, 0xD53E8000 ; 1601 to 1970 */
+	0x81, 0xDA, 0xDE, 0xB1, 0x9D, 0x01,	/* sbb edx, 0x019DB1DE */
+	0xB9, 0x80, 0x96, 0x98, 0x00,		/* mov ecx, 10000000 */
+	0xF7, 0xF1,							/* div ecx */
+	0x8B, 0x4C, 0x24, 0x04,				/* mov ecx, [esp+4] */
+	0x85, 0xC9,							/* test ecx, ecx */
+	0x74, 0x02,							/* jz 2f */
+	0x89, 0x01,							/* mov [ecx], eax */
+	0xC3,								/* 2: ret */
+
+	/* 0x33: __vdso_clock_gettime(clockid_t clk_id, struct timespec *tp) */
+	0x83, 0x7C, 0x24, 0x04, 0x05,		/* cmp dword ptr [esp+4], CLOCK_REALTIME_COARSE */
+	0x75, 0x34,							/* jne 2f */
+	0x8B, 0x15, 0x18, 0x00, 0xFE, 0x7F,	/* 1: mov edx, ds:[0x7FFE0018] */
+	0xA1, 0x14, 0x00, 0xFE, 0x7F,		/* mov eax, ds:[0x7FFE0014] */
+	0x3B, 0x15, 0x1C, 0x00, 0xFE, 0x7F,	/* cmp edx, ds:[0x7FFE001C] */
+	0x75, 0xED,							/* jne 1b */
+	0x2D, 0x00, 0x80, 0x3E, 0xD5,		/* sub eax, 0xD53E8000 */
+	0x81, 0xDA, 0xDE, 0xB1, 0x9D, 0x01,	/* sbb edx, 0x019DB1DE */
+	0xB9, 0x80, 0x96, 0x98, 0x00,		/* mov ecx, 10000000 */
+	0xF7, 0xF1,							/* div ecx */
+	0x6B, 0xD2, 0x64,					/* imul edx, edx, 100 */
+	0x8B, 0x4C, 0x24, 0x08,				/* mov ecx, [esp+8] */
+	0x89, 0x01,							/* mov [ecx], eax */
+	0x89, 0x51, 0x04,					/* mov [ecx+4], edx */
+	0x31, 0xC0,							/* xor eax, eax */
+	0xC3,								/* ret */
+	0x53,								/* 2: push ebx */
+	0x8B, 0x5C, 0x24, 0x08,				/* mov ebx, [esp+8] */
+	0x8B, 0x4C, 0x24, 0x0C,				/* mov ecx, [esp+12] */
+	0xB8, 0x09, 0x01, 0x00, 0x00,		/* mov eax, 265 ; clock_gettime */
+	0xCD, 0x80,							/* int 0x80 */
+	0x5B,								/* pop ebx */
+	0xC3,								/* ret */
+
+	/* 0x80: __vdso_gettimeofday(struct timeval *tv, struct timezone *tz) */
+	0x53,								/* push ebx */
+	0x8B, 0x5C, 0x24, 0x08,				/* mov ebx, [esp+8] */
+	0x8B, 0x4C, 0x24, 0x0C,				/* mov ecx, [esp+12] */
+	0xB8, 0x4E, 0x00, 0x00, 0x00,		/* mov eax, 78 ; gettimeofday */
+	0xCD, 0x80,							/* int 0x80 */
+	0x5B,								/* pop ebx */
+	0xC3,								/* ret */
+
+	/* 0x92: __vdso_getcpu(unsigned *cpu, unsigned *node, void *tcache) */
+	0x53,								/* push ebx */
+	0x8B, 0x5C, 0x24, 0x08,				/* mov ebx, [esp+8] */
+	0x8B, 0x4C, 0x24, 0x0C,				/* mov ecx, [esp+12] */
+	0x8B, 0x54, 0x24, 0x10,				/* mov edx, [esp+16] */
+	0xB8, 0x3E, 0x01, 0x00, 0x00,		/* mov eax, 318 ; getcpu */
+	0xCD, 0x80,							/* int 0x80 */
+	0x5B,								/* pop ebx */
+	0xC3,								/* ret */
+};
+
+static const struct
+{
+	const char *name;
+	Elf32_Addr offset;
+	Elf32_Word size;
+} vdso_symbols[] =
+{
+	{ "__kernel_vsyscall", 0x00, 0x03 },
+	{ "__vdso_time", 0x03, 0x30 },
+	{ "__vdso_clock_gettime", 0x33, 0x4D },
+	{ "__vdso_gettimeofday", 0x80, 0x12 },
+	{ "__vdso_getcpu", 0x92, 0x16 },
+};
+
+#define VDSO_SONAME			"linux-gate.so.1"
+#define VDSO_SYM_COUNT		(1 + sizeof(vdso_symbols) / sizeof(vdso_symbols[0])) /* Including null symbol */
+#define VDSO_HASH_BUCKETS	3
+#define VDSO_STR_SIZE		128
+#define VDSO_DYN_COUNT		7
+
+struct vdso_image
+{
+	Elf32_Ehdr eh;
+	Elf32_Phdr ph[2];
+	Elf32_Dyn dyn[VDSO_DYN_COUNT];
+	Elf32_Word hash[2 + VDSO_HASH_BUCKETS + VDSO_SYM_COUNT];
+	Elf32_Sym sym[VDSO_SYM_COUNT];
+	char str[VDSO_STR_SIZE];
+	uint8_t text[sizeof(vdso_text)];
+};
+
+static uint32_t elf_hash(const char *name)
+{
+	uint32_t h = 0;
+	while (*name)
+	{
+		h = (h << 4) + (uint8_t)*name++;
+		uint32_t g = h & 0xF0000000;
+		if (g)
+			h ^= g >> 24;
+		h &= ~g;
+	}
+	return h;
+}
+
+/* The image is linked at virtual address 0, so offsets are used as addresses */
+#define VDSO_OFFSET(field)	((Elf32_Addr)offsetof(struct vdso_image, field))
+
+static void vdso_build(struct vdso_image *image)
+{
+	memset(image, 0, sizeof(struct vdso_image));
+	memcpy(image->text, vdso_text, sizeof(vdso_text));
+
+	/* String table */
+	int str_size = 1; /* Index 0 is the empty string */
+	int soname = str_size;
+	strcpy(image->str + str_size, VDSO_SONAME);
+	str_size += sizeof(VDSO_SONAME);
+
+	/* Symbol table and hash table */
+	Elf32_Word *buckets = &image->hash[2];
+	Elf32_Word *chains = &image->hash[2 + VDSO_HASH_BUCKETS];
+	image->hash[0] = VDSO_HASH_BUCKETS;
+	image->hash[1] = VDSO_SYM_COUNT;
+	for (int i = 1; i < VDSO_SYM_COUNT; i++)
+	{
+		const char *name = vdso_symbols[i - 1].name;
+		Elf32_Sym *sym = &image->sym[i];
+		sym->st_name = str_size;
+		strcpy(image->str + str_size, name);
+		str_size += (int)strlen(name) + 1;
+		sym->st_value = VDSO_OFFSET(text) + vdso_symbols[i - 1].offset;
+		sym->st_size = vdso_symbols[i - 1].size;
+		sym->st_info = (STB_GLOBAL << 4) | STT_FUNC;
+		sym->st_shndx = 1; /* Any defined section, SHN_ABS would not be relocated by the loader */
+		uint32_t h = elf_hash(name) % VDSO_HASH_BUCKETS;
+		chains[i] = buckets[h];
+		buckets[h] = i;
+	}
+
+	/* Dynamic section */
+	Elf32_Dyn *dyn = image->dyn;
+	dyn->d_tag = DT_HASH; dyn->d_un.d_ptr = VDSO_OFFSET(hash); dyn++;
+	dyn->d_tag = DT_STRTAB; dyn->d_un.d_ptr = VDSO_OFFSET(str); dyn++;
+	dyn->d_tag = DT_SYMTAB; dyn->d_un.d_ptr = VDSO_OFFSET(sym); dyn++;
+	dyn->d_tag = DT_STRSZ; dyn->d_un.d_val = str_size; dyn++;
+	dyn->d_tag = DT_SYMENT; dyn->d_un.d_val = sizeof(Elf32_Sym); dyn++;
+	dyn->d_tag = DT_SONAME; dyn->d_un.d_val = soname; dyn++;
+	dyn->d_tag = DT_NULL; dyn->d_un.d_val = 0;
+
+	/* Program headers */
+	image->ph[0].p_type = PT_LOAD;
+	image->ph[0].p_offset = 0;
+	image->ph[0].p_vaddr = image->ph[0].p_paddr = 0;
+	image->ph[0].p_filesz = image->ph[0].p_memsz = sizeof(struct vdso_image);
+	image->ph[0].p_flags = PF_R | PF_X;
+	image->ph[0].p_align = PAGE_SIZE;
+	image->ph[1].p_type = PT_DYNAMIC;
+	image->ph[1].p_offset = image->ph[1].p_vaddr = image->ph[1].p_paddr = VDSO_OFFSET(dyn);
+	image->ph[1].p_filesz = image->ph[1].p_memsz = sizeof(image->dyn);
+	image->ph[1].p_flags = PF_R;
+	image->ph[1].p_align = 4;
+
+	/* ELF header */
+	memcpy(image->eh.e_ident, ELFMAG, SELFMAG);
+	image->eh.e_ident[EI_CLASS] = ELFCLASS32;
+	image->eh.e_ident[EI_DATA] = ELFDATA2LSB;
+	image->eh.e_ident[EI_VERSION] = EV_CURRENT;
+	image->eh.e_type = ET_DYN;
+	image->eh.e_machine = EM_386;
+	image->eh.e_version = EV_CURRENT;
+	image->eh.e_entry = VDSO_OFFSET(text);
+	image->eh.e_phoff = VDSO_OFFSET(ph);
+	image->eh.e_ehsize = sizeof(Elf32_Ehdr);
+	image->eh.e_phentsize = sizeof(Elf32_Phdr);
+	image->eh.e_phnum = 2;
+}
+
+void *vdso_map()
+{
+	struct vdso_image *image = mm_mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_POPULATE, INTERNAL_MAP_TOPDOWN, NULL, 0);
+	if (!image || (uintptr_t)image >= (uintptr_t)-PAGE_SIZE)
+	{
+		log_error("vdso: Mapping vDSO image failed.");
+		return NULL;
+	}
+	vdso_build(image);
+	/* Writable only while being built, like the kernel's vDSO it is read only to the application */
+	if (mm_mprotect(image, PAGE_SIZE, PROT_READ | PROT_EXEC) < 0)
+		log_warning("vdso: Write protecting vDSO image failed.");
+	log_info("vdso: vDSO image mapped at %p", image);
+	return image;
+}
+
+#else
+
+void *vdso_map()
+{
+	/* TODO: vDSO for x86_64 */
+	return NULL;
+}
+
+#endif
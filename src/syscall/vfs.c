@@ -17,24 +17,35 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define LOG_CATEGORY LOG_CAT_VFS
+
 #include <common/errno.h>
 #include <common/fadvise.h>
 #include <common/fcntl.h>
+#include <common/fs.h>
 #include <common/ioctls.h>
 #include <fs/console.h>
 #include <fs/devfs.h>
 #include <fs/epollfd.h>
 #include <fs/eventfd.h>
+#include <fs/imgfs.h>
+#include <fs/overlayfs.h>
 #include <fs/pipe.h>
 #include <fs/procfs.h>
+#include <fs/pty.h>
 #include <fs/socket.h>
 #include <fs/sysfs.h>
+#include <fs/tmpfs.h>
 #include <fs/winfs.h>
 #include <syscall/mm.h>
+#include <syscall/prefetch.h>
+#include <syscall/process_info.h>
 #include <syscall/sig.h>
 #include <syscall/syscall.h>
+#include <syscall/timer.h>
 #include <syscall/vfs.h>
 #include <datetime.h>
+#include <heap.h>
 #include <log.h>
 #include <shared.h>
 #include <str.h>
@@ -59,25 +70,84 @@
    a component, the whole operation immediately fails.
 */
 
+/* The fd table is read without locking by vfs_get(), see vfs_synchronize()
+ * Writers hold vfs->rw_lock exclusively.
+ */
 struct filed
 {
-	struct file *fd;
+	struct file *volatile fd;
 	int cloexec;
 };
 
+/* The fd table grows on demand up to the RLIMIT_NOFILE soft limit
+ * A grown table replaces the old one, which is retired and freed after vfs_synchronize().
+ */
+#define FD_TABLE_INITIAL_SIZE	64
+struct fd_table
+{
+	int size; /* Number of slots, a multiple of 32 */
+	uint32_t *live; /* Bitmap of used slots, stored after filed[] */
+	struct filed filed[];
+};
+
+/* A file or fd table removed from the fd table, see vfs_unlock_exclusive() */
+struct vfs_retired
+{
+	struct vfs_retired *next;
+	struct file *f;
+	struct fd_table *table;
+};
+
 #define FS_WINFS			0
 #define FS_DEVFS			1
 #define FS_PROCFS			2
 #define FS_SYSFS			3
-#define FS_COUNT			4
+#define FS_TMPFS			4
+#define FS_IMGFS			5
+#define FS_OVERLAYFS		6
+#define FS_COUNT			7
 #define MAX_MOUNT_POINTS	64
+#define DCACHE_DIR_BUCKETS	1024
+
+/* Compiled mount table
+ * Each process keeps a private copy of the shared mount points with their file system pointers
+ * resolved, indexed by the first character of the mount path. find_mountpoint() only compares
+ * the mount points in one chain, and returns a reference into the table instead of a copy.
+ * The table is updated when vfs_shared->mount_generation changes. Mount point i of the shared
+ * area is always at mounts[i] and is never moved or removed, so references stay valid. New mount
+ * points are linked into the chains in a way that concurrent readers always see a valid chain.
+ */
+struct mount_table
+{
+	LONG generation;
+	int root; /* Index of the root mount point, 0 if not yet known */
+	/* Chains of mount points by mountpoint[1], longest mount path first, -1 terminated */
+	volatile int head[256];
+	volatile int next[MAX_MOUNT_POINTS];
+	struct mount_point mounts[MAX_MOUNT_POINTS];
+};
+
 struct vfs_data
 {
 	SRWLOCK rw_lock;
 	struct file_system *fs[FS_COUNT];
 	HANDLE mount_write_mutex;
-	struct filed filed[MAX_FD_COUNT];
+	SRWLOCK mount_table_lock;
+	struct mount_table *mount_table;
+	struct fd_table *volatile fds;
+	/* RLIMIT_NOFILE */
+	int nofile_cur, nofile_max;
+	/* Thread slots below it may be in the lockless section of vfs_get() */
+	volatile LONG reader_count;
+	/* Removed from the fd table under the exclusive lock, released after it is dropped */
+	struct vfs_retired *retired;
 	struct file *cwd;
+	/* Cached path of cwd, see vfs_get_cwd_path() */
+	SRWLOCK cwd_lock;
+	int cwd_path_len; /* 0 if not cached */
+	LONG cwd_generation;
+	ULONGLONG cwd_time;
+	char cwd_path[PATH_MAX];
 	int umask;
 };
 
@@ -85,6 +155,10 @@ struct vfs_shared_data
 {
 	volatile int mp_first;
 	volatile int max_key;
+	volatile LONG mount_generation; /* Bumped when the mount table changes, see vfs_get_mount_table() */
+	volatile LONG dcache_generation; /* Bumped when a path is removed or replaced, see dcache_invalidate() */
+	volatile LONG dcache_dir_generation[DCACHE_DIR_BUCKETS]; /* Bumped when a file is created in a directory, see dcache_created() */
+	volatile LONG winfs_generation; /* See vfs_get_winfs_generation() */
 	int root_id; /* ID of root mount point */
 	struct mount_point mounts[MAX_MOUNT_POINTS]; /* Slot 0 is unused */
 };
@@ -151,6 +225,7 @@ static int vfs_mount_unsafe(int fs_id, bool is_system, const WCHAR *win_path, co
 						vfs_shared->mp_first = i;
 					else
 						vfs_shared->mounts[prev].next = i;
+					InterlockedIncrement(&vfs_shared->mount_generation);
 					return true;
 				}
 				prev = cur;
@@ -163,25 +238,103 @@ static int vfs_mount_unsafe(int fs_id, bool is_system, const WCHAR *win_path, co
 				vfs_shared->mp_first = i;
 			else
 				vfs_shared->mounts[prev].next = i;
+			InterlockedIncrement(&vfs_shared->mount_generation);
 			return i;
 		}
 	return 0;
 }
 
-void vfs_get_root_mountpoint(struct mount_point *mp)
+static struct mount_table *mount_table_alloc()
 {
-	copy_mountpoint(&vfs_shared->mounts[vfs_shared->root_id], mp);
+	struct mount_table *table = (struct mount_table *)kmalloc(sizeof(struct mount_table));
+	table->generation = 0;
+	table->root = 0;
+	for (int i = 0; i < 256; i++)
+		table->head[i] = -1;
+	for (int i = 0; i < MAX_MOUNT_POINTS; i++)
+	{
+		table->next[i] = -1;
+		table->mounts[i].key = 0;
+	}
+	return table;
 }
 
-bool vfs_get_mountpoint(int key, struct mount_point *mp)
+/* Link mount point i into its chain, caller holds vfs->mount_table_lock exclusively */
+static void mount_table_insert(struct mount_table *table, int i)
 {
-	for (int i = vfs_shared->mp_first; i; i = vfs_shared->mounts[i].next)
+	const struct mount_point *mp = &table->mounts[i];
+	volatile int *link = &table->head[(unsigned char)mp->mountpoint[1]];
+	while (*link != -1 && table->mounts[*link].mountpoint_len >= mp->mountpoint_len)
+		link = &table->next[*link];
+	/* `next' and `head' are volatile, and in MSVC volatile means release ordering */
+	table->next[i] = *link;
+	*link = i;
+}
+
+static void mount_table_update(struct mount_table *table)
+{
+	AcquireSRWLockExclusive(&vfs->mount_table_lock);
+	LONG generation = vfs_shared->mount_generation;
+	if (table->generation != generation)
 	{
-		if (vfs_shared->mounts[i].key == key)
+		for (int i = vfs_shared->mp_first; i; i = vfs_shared->mounts[i].next)
 		{
-			copy_mountpoint(&vfs_shared->mounts[i], mp);
-			return true;
+			if (table->mounts[i].key)
+				continue;
+			copy_mountpoint(&vfs_shared->mounts[i], &table->mounts[i]);
+			if (i == vfs_shared->root_id)
+				table->root = i;
+			else
+				mount_table_insert(table, i);
 		}
+		table->generation = generation;
+	}
+	ReleaseSRWLockExclusive(&vfs->mount_table_lock);
+}
+
+static struct mount_table *vfs_get_mount_table()
+{
+	struct mount_table *table = vfs->mount_table;
+	if (table->generation != vfs_shared->mount_generation)
+		mount_table_update(table);
+	return table;
+}
+
+struct mount_point *vfs_get_root_mountpoint()
+{
+	struct mount_table *table = vfs_get_mount_table();
+	return &table->mounts[table->root];
+}
+
+struct mount_point *vfs_get_mountpoint(int key)
+{
+	struct mount_table *table = vfs_get_mount_table();
+	for (int i = 1; i < MAX_MOUNT_POINTS; i++)
+		if (table->mounts[i].key == key)
+			return &table->mounts[i];
+	return NULL;
+}
+
+volatile LONG *vfs_get_winfs_generation()
+{
+	return &vfs_shared->winfs_generation;
+}
+
+/* Check if a plain name is the last component of a mount point
+ * The file in the parent file system may then be covered, which its directory records know nothing of
+ */
+static bool is_mountpoint_name(const char *name)
+{
+	struct mount_table *table = vfs_get_mount_table();
+	int len = strlen(name);
+	for (int i = 1; i < MAX_MOUNT_POINTS; i++)
+	{
+		const struct mount_point *mp = &table->mounts[i];
+		int end = mp->mountpoint_len;
+		while (end > 1 && mp->mountpoint[end - 1] == '/')
+			end--;
+		if (mp->key && end > len && mp->mountpoint[end - len - 1] == '/' && !memcmp(mp->mountpoint + end - len, name, len))
+			return true;
 	}
 	return false;
 }
@@ -199,37 +352,206 @@ void vfs_release(struct file *f)
 		f->op_vtable->close(f);
 }
 
+static int fd_table_bytes(int size)
+{
+	return sizeof(struct fd_table) + size * sizeof(struct filed) + size / 8;
+}
+
+static struct fd_table *fd_table_alloc(int size)
+{
+	int bytes = fd_table_bytes(size);
+	struct fd_table *table = (struct fd_table *)kmalloc(bytes);
+	memset(table, 0, bytes);
+	table->size = size;
+	table->live = (uint32_t *)&table->filed[size];
+	return table;
+}
+
+/* Returns the lowest used fd not less than fd, -1 if none */
+static int fd_table_next(struct fd_table *table, int fd)
+{
+	for (int i = fd / 32; i < table->size / 32; i++)
+	{
+		uint32_t word = table->live[i];
+		if (i == fd / 32)
+			word &= ~0U << (fd % 32);
+		DWORD bit;
+		if (_BitScanForward(&bit, word))
+			return i * 32 + bit;
+	}
+	return -1;
+}
+
+#define fd_table_iterate(table, fd) \
+	for (int fd = fd_table_next((table), 0); fd != -1; fd = fd_table_next((table), fd + 1))
+
 /* Get file handle to a fd (caller locks vfs, either exclusive or shared is okay) */
 static struct file *vfs_get_internal(int fd)
 {
-	if (fd < 0 || fd >= MAX_FD_COUNT)
+	if (fd < 0 || fd >= vfs->fds->size)
 		return NULL;
-	struct file *f = vfs->filed[fd].fd;
+	struct file *f = vfs->fds->filed[fd].fd;
 	if (f)
 		vfs_ref(f);
 	return f;
 }
 
-/* Get file handle to a fd */
+/* Get file handle to a fd
+ * Guest threads do not take vfs->rw_lock here. A thread marks itself as reading, then loads the
+ * slot and references the file. A writer which removes a file from the table retires it, and
+ * after dropping vfs->rw_lock waits in vfs_synchronize() until no thread which could have seen
+ * the old pointer is still reading, before it drops the reference of the table. So the file
+ * cannot be freed under a reader.
+ */
 struct file *vfs_get(int fd)
 {
-	if (fd < 0 || fd >= MAX_FD_COUNT)
+	if (fd < 0)
 		return NULL;
-	AcquireSRWLockShared(&vfs->rw_lock);
-	struct file *f = vfs->filed[fd].fd;
-	if (f)
-		vfs_ref(f);
-	ReleaseSRWLockShared(&vfs->rw_lock);
+	struct thread *thread = current_thread;
+	if (!thread)
+	{
+		/* Not a guest thread, use the lock */
+		AcquireSRWLockShared(&vfs->rw_lock);
+		struct file *f = vfs_get_internal(fd);
+		ReleaseSRWLockShared(&vfs->rw_lock);
+		return f;
+	}
+	LONG slot = (LONG)(thread - process->threads);
+	LONG count;
+	while (slot >= (count = vfs->reader_count))
+		InterlockedCompareExchange(&vfs->reader_count, slot + 1, count);
+	InterlockedExchange(&thread->vfs_reading, 1);
+	struct fd_table *table = vfs->fds;
+	struct file *f = NULL;
+	if (fd < table->size)
+	{
+		f = table->filed[fd].fd;
+		if (f)
+			vfs_ref(f);
+	}
+	/* `vfs_reading' is volatile, and in MSVC volatile means release ordering */
+	thread->vfs_reading = 0;
 	return f;
 }
 
+/* Wait until no thread is in the lockless section of vfs_get()
+ * Called after a file is removed from the fd table, before the reference of the table is dropped.
+ * A reader may be preempted inside the section, so give up the processor after a short spin.
+ */
+static void vfs_synchronize()
+{
+	MemoryBarrier();
+	LONG count = vfs->reader_count;
+	for (LONG i = 0; i < count; i++)
+		for (int spin = 0; process->threads[i].vfs_reading; spin++)
+		{
+			if (spin < 64)
+				YieldProcessor();
+			else
+				SwitchToThread();
+		}
+}
+
+/* Queue a file or fd table removed from the fd table, caller locks vfs exclusively */
+static void vfs_retire(struct file *f, struct fd_table *table)
+{
+	struct vfs_retired *retired = (struct vfs_retired *)kmalloc(sizeof(struct vfs_retired));
+	retired->f = f;
+	retired->table = table;
+	retired->next = vfs->retired;
+	vfs->retired = retired;
+}
+
+/* Release retired files and tables once no reader can still see them */
+static void vfs_release_retired(struct vfs_retired *retired)
+{
+	if (!retired)
+		return;
+	vfs_synchronize();
+	while (retired)
+	{
+		struct vfs_retired *next = retired->next;
+		if (retired->f)
+			vfs_release(retired->f);
+		if (retired->table)
+			kfree(retired->table, fd_table_bytes(retired->table->size));
+		kfree(retired, sizeof(struct vfs_retired));
+		retired = next;
+	}
+}
+
+/* Drop the exclusive vfs lock
+ * Waiting for readers is done after the lock is released, other threads would stall on it for
+ * as long as a preempted reader does not run.
+ */
+static void vfs_unlock_exclusive()
+{
+	struct vfs_retired *retired = vfs->retired;
+	vfs->retired = NULL;
+	ReleaseSRWLockExclusive(&vfs->rw_lock);
+	vfs_release_retired(retired);
+}
+
+/* Grow the fd table to include fd, caller locks vfs exclusively
+ * Returns false if fd is beyond the RLIMIT_NOFILE soft limit.
+ */
+static bool fd_table_expand(int fd)
+{
+	struct fd_table *old = vfs->fds;
+	if (fd < old->size)
+		return true;
+	if (fd >= vfs->nofile_cur)
+		return false;
+	int size = old->size;
+	while (size <= fd)
+		size *= 2;
+	size = min(size, (int)ALIGN_TO(vfs->nofile_cur, 32));
+	struct fd_table *table = fd_table_alloc(size);
+	memcpy(table->filed, old->filed, old->size * sizeof(struct filed));
+	memcpy(table->live, old->live, old->size / 8);
+	vfs->fds = table;
+	vfs_retire(NULL, old);
+	return true;
+}
+
+/* Put a file in a free fd slot, caller locks vfs exclusively and ensures the slot exists */
+static void fd_install(int fd, struct file *f, int cloexec)
+{
+	struct fd_table *table = vfs->fds;
+	table->filed[fd].cloexec = cloexec;
+	/* `fd' is volatile, and in MSVC volatile means release ordering */
+	table->filed[fd].fd = f;
+	table->live[fd / 32] |= 1U << (fd % 32);
+}
+
+/* Find the lowest free fd and make sure its slot exists, caller locks vfs exclusively */
+static int fd_alloc()
+{
+	struct fd_table *table = vfs->fds;
+	int fd = table->size;
+	for (int i = 0; i < table->size / 32; i++)
+	{
+		DWORD bit;
+		if (_BitScanForward(&bit, ~table->live[i]))
+		{
+			fd = i * 32 + bit;
+			break;
+		}
+	}
+	if (!fd_table_expand(fd))
+		return -L_EMFILE;
+	return fd;
+}
+
 /* Close a file descriptor fd */
 static void vfs_close(int fd)
 {
-	struct file *f = vfs->filed[fd].fd;
-	vfs_release(f);
-	vfs->filed[fd].fd = NULL;
-	vfs->filed[fd].cloexec = 0;
+	struct fd_table *table = vfs->fds;
+	struct file *f = table->filed[fd].fd;
+	table->filed[fd].fd = NULL;
+	table->filed[fd].cloexec = 0;
+	table->live[fd / 32] &= ~(1U << (fd % 32));
+	vfs_retire(f, NULL);
 }
 
 static void vfs_shared_init()
@@ -264,6 +586,23 @@ static void vfs_shared_init()
 		log_error("The path of current directory is too long.");
 		process_exit(1, 0);
 	}
+	/* A packed image of /usr in the root directory is put under the usr directory, which receives the changes */
+	WCHAR usr_path[MAX_PATH + 1];
+	bool has_usr_image = false;
+	if (basedir_len + 8 < MAX_PATH)
+	{
+		int len = basedir_len - (basedir[basedir_len - 1] == L'\\');
+		wcscpy(usr_path, basedir);
+		wcscpy(usr_path + len, L"\\usr.img");
+		has_usr_image = GetFileAttributesW(usr_path) != INVALID_FILE_ATTRIBUTES;
+		usr_path[len + 4] = 0;
+		if (has_usr_image && !CreateDirectoryW(usr_path, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+		{
+			log_error("Creating %S failed, error code: %d", usr_path, GetLastError());
+			has_usr_image = false;
+		}
+		usr_path[1] = L'?';
+	}
 	basedir[1] = L'?';
 	log_info("Root directory: %S", basedir);
 	vfs_shared->root_id = vfs_mount_unsafe(FS_WINFS, true, basedir, "/");
@@ -276,6 +615,15 @@ static void vfs_shared_init()
 	vfs_mount_unsafe(FS_DEVFS, true, NULL, "/dev");
 	vfs_mount_unsafe(FS_PROCFS, true, NULL, "/proc");
 	vfs_mount_unsafe(FS_SYSFS, true, NULL, "/sys");
+	vfs_mount_unsafe(FS_TMPFS, true, NULL, "/dev/shm");
+	if (has_usr_image)
+	{
+		log_info("Mounting %S.img over %S on /usr", usr_path, usr_path);
+		vfs_mount_unsafe(FS_OVERLAYFS, true, usr_path, "/usr");
+	}
+	/* Unix domain sockets are only supported on winfs, so /tmp is not in memory by default */
+	if (cmdline_flags->tmpfs_tmp)
+		vfs_mount_unsafe(FS_TMPFS, true, NULL, "/tmp");
 	NtReleaseMutant(vfs->mount_write_mutex, NULL);
 }
 
@@ -284,13 +632,20 @@ void vfs_init()
 	log_info("vfs subsystem initializing...");
 	vfs = mm_static_alloc(sizeof(struct vfs_data));
 	InitializeSRWLock(&vfs->rw_lock);
+	InitializeSRWLock(&vfs->cwd_lock);
 	/* Create file systems */
 	vfs->fs[FS_WINFS] = winfs_alloc();
 	vfs->fs[FS_DEVFS] = devfs_alloc();
 	vfs->fs[FS_PROCFS] = procfs_alloc();
 	vfs->fs[FS_SYSFS] = sysfs_alloc();
+	vfs->fs[FS_TMPFS] = tmpfs_alloc();
+	vfs->fs[FS_IMGFS] = imgfs_alloc();
+	vfs->fs[FS_OVERLAYFS] = overlayfs_alloc(vfs->fs[FS_WINFS], vfs->fs[FS_IMGFS]);
+	InitializeSRWLock(&vfs->mount_table_lock);
+	vfs->mount_table = mount_table_alloc();
 	/* Create vfs shared area */
 	vfs_shared = shared_alloc(sizeof(struct vfs_shared_data));
+	pty_init();
 	/* Create vfs mutexex */
 	UNICODE_STRING name;
 	RtlInitUnicodeString(&name, L"vfs_mount_write_mutex");
@@ -303,9 +658,12 @@ void vfs_init()
 	console_init();
 	struct file *console = console_alloc();
 	console->ref += 2;
-	vfs->filed[0].fd = console;
-	vfs->filed[1].fd = console;
-	vfs->filed[2].fd = console;
+	vfs->nofile_cur = DEFAULT_FD_LIMIT;
+	vfs->nofile_max = MAX_FD_COUNT;
+	vfs->fds = fd_table_alloc(FD_TABLE_INITIAL_SIZE);
+	fd_install(0, console, 0);
+	fd_install(1, console, 0);
+	fd_install(2, console, 0);
 	/* Initialize CWD */
 	if (vfs_openat(AT_FDCWD, "/", O_DIRECTORY | O_PATH, 0, 0, &vfs->cwd) < 0)
 	{
@@ -320,32 +678,28 @@ void vfs_init()
 void vfs_reset()
 {
 	/* Handle O_CLOEXEC */
-	for (int i = 0; i < MAX_FD_COUNT; i++)
+	fd_table_iterate(vfs->fds, fd)
 	{
-		struct file *f = vfs->filed[i].fd;
-		if (f && vfs->filed[i].cloexec)
-			vfs_close(i);
+		if (vfs->fds->filed[fd].cloexec)
+			vfs_close(fd);
 	}
+	vfs_release_retired(vfs->retired);
+	vfs->retired = NULL;
 	vfs->umask = S_IWGRP | S_IWOTH;
 }
 
 void vfs_shutdown()
 {
-	for (int i = 0; i < MAX_FD_COUNT; i++)
-	{
-		struct file *f = vfs->filed[i].fd;
-		if (f)
-			vfs_close(i);
-	}
+	fd_table_iterate(vfs->fds, fd)
+		vfs_close(fd);
+	vfs_release_retired(vfs->retired);
+	vfs->retired = NULL;
 }
 
-static int cmpfiled(const void *a, const void *b)
+static int cmpfile(const void *a, const void *b)
 {
-	int fda = *(int *)a;
-	int fdb = *(int *)b;
-
-	struct file *filea = vfs->filed[fda].fd;
-	struct file *fileb = vfs->filed[fdb].fd;
+	struct file *filea = *(struct file **)a;
+	struct file *fileb = *(struct file **)b;
 
 	if (filea > fileb)
 	{
@@ -361,100 +715,144 @@ static int cmpfiled(const void *a, const void *b)
 	}
 }
 
+/* Collect distinct open files sorted by address, walking only used fds, returns count
+ * The caller frees *files with kfree(*files, *bytes) if *bytes is not zero.
+ */
+static int vfs_collect_files(struct file ***files, int *bytes)
+{
+	struct fd_table *table = vfs->fds;
+	int count = 0;
+	fd_table_iterate(table, fd)
+		count++;
+	*files = NULL;
+	*bytes = 0;
+	if (!count)
+		return 0;
+	*bytes = count * sizeof(struct file *);
+	struct file **list = (struct file **)kmalloc(*bytes);
+	int i = 0;
+	fd_table_iterate(table, fd)
+		list[i++] = table->filed[fd].fd;
+	qsort(list, count, sizeof(struct file *), cmpfile);
+	/* Remove duplicates */
+	int distinct = 1;
+	for (i = 1; i < count; i++)
+		if (list[i] != list[distinct - 1])
+			list[distinct++] = list[i];
+	*files = list;
+	return distinct;
+}
+
 int vfs_fork(HANDLE process, DWORD process_id)
 {
 	if (!console_fork(process))
 		return 0;
 	AcquireSRWLockShared(&vfs->rw_lock);
-	int index[MAX_FD_COUNT];
-	for (int i = 0; i < MAX_FD_COUNT; i++)
-		index[i] = i;
-	qsort(index, MAX_FD_COUNT, sizeof(int), cmpfiled);
-
-	struct file *last = NULL;
-	for (int i = 0; i < MAX_FD_COUNT; i++)
+	struct file **files;
+	int bytes;
+	int count = vfs_collect_files(&files, &bytes);
+	for (int i = 0; i < count; i++)
 	{
-		struct file *f = vfs->filed[index[i]].fd;
-		if (f && f != last)
-		{
-			if (f->op_vtable->fork)
-				f->op_vtable->fork(f, process, process_id);
-			else
-				AcquireSRWLockShared(&f->rw_lock);
-		}
-		last = f;
+		struct file *f = files[i];
+		if (f->op_vtable->fork)
+			f->op_vtable->fork(f, process, process_id);
+		else
+			AcquireSRWLockShared(&f->rw_lock);
 	}
+	if (bytes)
+		kfree(files, bytes);
+	tmpfs_fork();
 	return 1;
 }
 
 void vfs_afterfork_child()
 {
 	vfs = mm_static_alloc(sizeof(struct vfs_data));
+	tmpfs_afterfork_child(vfs->fs[FS_TMPFS]);
+	imgfs_afterfork_child(vfs->fs[FS_IMGFS]);
 	vfs_shared = shared_alloc(sizeof(struct vfs_shared_data));
+	pty_afterfork_child();
 	InitializeSRWLock(&vfs->rw_lock);
+	InitializeSRWLock(&vfs->mount_table_lock);
+	InitializeSRWLock(&vfs->cwd_lock);
+	/* Other threads of the parent do not exist here */
+	for (LONG i = 0; i < vfs->reader_count; i++)
+		process->threads[i].vfs_reading = 0;
 	console_afterfork();
 
-	int index[MAX_FD_COUNT];
-	for (int i = 0; i < MAX_FD_COUNT; i++)
-		index[i] = i;
-
-	qsort(index, MAX_FD_COUNT, sizeof(int), cmpfiled);
-
-	struct file *last = NULL;
-	for (int i = 0; i < MAX_FD_COUNT; i++)
+	struct file **files;
+	int bytes;
+	int count = vfs_collect_files(&files, &bytes);
+	for (int i = 0; i < count; i++)
 	{
-		struct file *f = vfs->filed[index[i]].fd;
-		if (f && f != last)
-		{
-			InitializeSRWLock(&f->rw_lock);
-			if (f->op_vtable->after_fork_child)
-				f->op_vtable->after_fork_child(f);
-		}
-		last = f;
+		struct file *f = files[i];
+		InitializeSRWLock(&f->rw_lock);
+		if (f->op_vtable->after_fork_child)
+			f->op_vtable->after_fork_child(f);
 	}
+	if (bytes)
+		kfree(files, bytes);
 }
 
 void vfs_afterfork_parent()
 {
-	int index[MAX_FD_COUNT];
-	for (int i = 0; i < MAX_FD_COUNT; i++)
-		index[i] = i;
-
-	qsort(index, MAX_FD_COUNT, sizeof(int), cmpfiled);
-
-	struct file *last = NULL;
-	for (int i = 0; i < MAX_FD_COUNT; i++)
+	struct file **files;
+	int bytes;
+	int count = vfs_collect_files(&files, &bytes);
+	for (int i = 0; i < count; i++)
 	{
-		struct file *f = vfs->filed[index[i]].fd;
-		if (f && f != last)
-		{
-			if (f->op_vtable->after_fork_parent)
-				f->op_vtable->after_fork_parent(f);
-			else
-				ReleaseSRWLockShared(&f->rw_lock);
-		}
-		last = f;
+		struct file *f = files[i];
+		if (f->op_vtable->after_fork_parent)
+			f->op_vtable->after_fork_parent(f);
+		else
+			ReleaseSRWLockShared(&f->rw_lock);
 	}
+	if (bytes)
+		kfree(files, bytes);
+	tmpfs_afterfork_parent();
 	ReleaseSRWLockShared(&vfs->rw_lock);
 }
 
 static int store_file_internal(struct file *f, int cloexec)
 {
-	for (int i = 0; i < MAX_FD_COUNT; i++)
-		if (vfs->filed[i].fd == NULL)
-		{
-			vfs->filed[i].fd = f;
-			vfs->filed[i].cloexec = cloexec;
-			return i;
-		}
-	return -L_EMFILE;
+	int fd = fd_alloc();
+	if (fd >= 0)
+		fd_install(fd, f, cloexec);
+	return fd;
+}
+
+void vfs_get_nofile_limit(struct rlimit64 *limit)
+{
+	AcquireSRWLockShared(&vfs->rw_lock);
+	limit->rlim_cur = vfs->nofile_cur;
+	limit->rlim_max = vfs->nofile_max;
+	ReleaseSRWLockShared(&vfs->rw_lock);
+}
+
+int vfs_set_nofile_limit(const struct rlimit64 *limit)
+{
+	if (limit->rlim_cur > limit->rlim_max)
+		return -L_EINVAL;
+	int r = 0;
+	AcquireSRWLockExclusive(&vfs->rw_lock);
+	/* Raising the hard limit needs privilege */
+	if (limit->rlim_max > (uint64_t)vfs->nofile_max)
+		r = -L_EPERM;
+	else
+	{
+		/* Lowering the soft limit does not close or move existing fds */
+		vfs->nofile_cur = (int)limit->rlim_cur;
+		vfs->nofile_max = (int)limit->rlim_max;
+	}
+	vfs_unlock_exclusive();
+	return r;
 }
 
 int vfs_store_file(struct file *f, int cloexec)
 {
 	AcquireSRWLockExclusive(&vfs->rw_lock);
 	int r = store_file_internal(f, cloexec);
-	ReleaseSRWLockExclusive(&vfs->rw_lock);
+	vfs_unlock_exclusive();
 	return r;
 }
 
@@ -464,10 +862,10 @@ DEFINE_SYSCALL(pipe2, int *, pipefd, int, flags)
 	Supported flags:
 	* O_CLOEXEC
 	o O_DIRECT
-	o O_NONBLOCK
+	* O_NONBLOCK
 	*/
 	log_info("pipe2(%p, %d)", pipefd, flags);
-	if ((flags & O_DIRECT) || (flags & O_NONBLOCK))
+	if (flags & O_DIRECT)
 	{
 		log_error("Unsupported flags combination: %x", flags);
 		return -L_EINVAL;
@@ -502,7 +900,7 @@ DEFINE_SYSCALL(pipe2, int *, pipefd, int, flags)
 	log_info("write fd: %d", wfd);
 
 out:
-	ReleaseSRWLockExclusive(&vfs->rw_lock);
+	vfs_unlock_exclusive();
 	return r;
 }
 
@@ -526,7 +924,7 @@ DEFINE_SYSCALL(eventfd2, unsigned int, count, int, flags)
 		vfs_release(eventfd);
 
 out:
-	ReleaseSRWLockExclusive(&vfs->rw_lock);
+	vfs_unlock_exclusive();
 	return r;
 }
 
@@ -541,15 +939,9 @@ static int vfs_dup(int fd, int newfd, int flags)
 	}
 	if (newfd == -1)
 	{
-		for (int i = 0; i < MAX_FD_COUNT; i++)
-			if (vfs->filed[i].fd == NULL)
-			{
-				newfd = i;
-				break;
-			}
-		if (newfd == -1)
+		newfd = fd_alloc();
+		if (newfd < 0)
 		{
-			newfd = -L_EMFILE;
 			vfs_release(f);
 			goto out;
 		}
@@ -562,14 +954,19 @@ static int vfs_dup(int fd, int newfd, int flags)
 			vfs_release(f);
 			goto out;
 		}
-		if (vfs->filed[newfd].fd)
+		if (!fd_table_expand(newfd))
+		{
+			newfd = -L_EBADF;
+			vfs_release(f);
+			goto out;
+		}
+		if (vfs->fds->filed[newfd].fd)
 			vfs_close(newfd);
 	}
-	vfs->filed[newfd].fd = f;
-	vfs->filed[newfd].cloexec = !!(flags & O_CLOEXEC);
+	fd_install(newfd, f, !!(flags & O_CLOEXEC));
 
 out:
-	ReleaseSRWLockExclusive(&vfs->rw_lock);
+	vfs_unlock_exclusive();
 	return newfd;
 }
 
@@ -677,6 +1074,8 @@ DEFINE_SYSCALL(pwrite64, int, fd, const char *, buf, size_t, count, loff_t, offs
 DEFINE_SYSCALL(readv, int, fd, const struct iovec *, iov, int, iovcnt)
 {
 	log_info("readv(%d, 0x%p, %d)", fd, iov, iovcnt);
+	if (iovcnt < 0 || iovcnt > IOV_MAX)
+		return -L_EINVAL;
 	for (int i = 0; i < iovcnt; i++)
 		if (!mm_check_write(iov[i].iov_base, iov[i].iov_len))
 			return -L_EFAULT;
@@ -691,18 +1090,25 @@ DEFINE_SYSCALL(readv, int, fd, const struct iovec *, iov, int, iovcnt)
 	}
 	else
 	{
-		r = 0;
-		for (int i = 0; i < iovcnt; i++)
+		r = -L_ENOSYS;
+		if (f->op_vtable->readv)
+			r = f->op_vtable->readv(f, iov, iovcnt);
+		if (r == -L_ENOSYS)
 		{
-			ssize_t cur = f->op_vtable->read(f, iov[i].iov_base, iov[i].iov_len);
-			if (cur < 0)
+			r = 0;
+			for (int i = 0; i < iovcnt; i++)
 			{
-				r = cur;
-				break;
+				ssize_t cur = f->op_vtable->read(f, iov[i].iov_base, iov[i].iov_len);
+				if (cur < 0)
+				{
+					if (r == 0)
+						r = cur;
+					break;
+				}
+				r += cur;
+				if (cur < iov[i].iov_len)
+					break;
 			}
-			r += cur;
-			if (cur < iov[i].iov_len)
-				break;
 		}
 	}
 	if (f)
@@ -713,6 +1119,8 @@ DEFINE_SYSCALL(readv, int, fd, const struct iovec *, iov, int, iovcnt)
 DEFINE_SYSCALL(writev, int, fd, const struct iovec *, iov, int, iovcnt)
 {
 	log_info("writev(%d, 0x%p, %d)", fd, iov, iovcnt);
+	if (iovcnt < 0 || iovcnt > IOV_MAX)
+		return -L_EINVAL;
 	for (int i = 0; i < iovcnt; i++)
 		if (!mm_check_read(iov[i].iov_base, iov[i].iov_len))
 			return -L_EFAULT;
@@ -727,18 +1135,25 @@ DEFINE_SYSCALL(writev, int, fd, const struct iovec *, iov, int, iovcnt)
 	}
 	else
 	{
-		r = 0;
-		for (int i = 0; i < iovcnt; i++)
+		r = -L_ENOSYS;
+		if (f->op_vtable->writev)
+			r = f->op_vtable->writev(f, iov, iovcnt);
+		if (r == -L_ENOSYS)
 		{
-			ssize_t cur = f->op_vtable->write(f, iov[i].iov_base, iov[i].iov_len);
-			if (cur < 0)
+			r = 0;
+			for (int i = 0; i < iovcnt; i++)
 			{
-				r = cur;
-				break;
+				ssize_t cur = f->op_vtable->write(f, iov[i].iov_base, iov[i].iov_len);
+				if (cur < 0)
+				{
+					if (r == 0)
+						r = cur;
+					break;
+				}
+				r += cur;
+				if (cur < iov[i].iov_len)
+					break;
 			}
-			r += cur;
-			if (cur < iov[i].iov_len)
-				break;
 		}
 	}
 	if (f)
@@ -749,6 +1164,8 @@ DEFINE_SYSCALL(writev, int, fd, const struct iovec *, iov, int, iovcnt)
 DEFINE_SYSCALL(preadv, int, fd, const struct iovec *, iov, int, iovcnt, off_t, offset)
 {
 	log_info("preadv(%d, 0x%p, %d, 0x%x)", fd, iov, iovcnt, offset);
+	if (iovcnt < 0 || iovcnt > IOV_MAX)
+		return -L_EINVAL;
 	for (int i = 0; i < iovcnt; i++)
 		if (!mm_check_write(iov[i].iov_base, iov[i].iov_len))
 			return -L_EFAULT;
@@ -763,19 +1180,26 @@ DEFINE_SYSCALL(preadv, int, fd, const struct iovec *, iov, int, iovcnt, off_t, o
 	}
 	else
 	{
-		r = 0;
-		for (int i = 0; i < iovcnt; i++)
+		r = -L_ENOSYS;
+		if (f->op_vtable->preadv)
+			r = f->op_vtable->preadv(f, iov, iovcnt, offset);
+		if (r == -L_ENOSYS)
 		{
-			ssize_t cur = f->op_vtable->pread(f, iov[i].iov_base, iov[i].iov_len, offset);
-			if (r < 0)
+			r = 0;
+			for (int i = 0; i < iovcnt; i++)
 			{
-				r = cur;
-				break;
+				ssize_t cur = f->op_vtable->pread(f, iov[i].iov_base, iov[i].iov_len, offset);
+				if (cur < 0)
+				{
+					if (r == 0)
+						r = cur;
+					break;
+				}
+				r += cur;
+				offset += cur;
+				if (cur < iov[i].iov_len)
+					break;
 			}
-			r += cur;
-			offset += cur;
-			if (cur < iov[i].iov_len)
-				break;
 		}
 	}
 	if (f)
@@ -786,6 +1210,8 @@ DEFINE_SYSCALL(preadv, int, fd, const struct iovec *, iov, int, iovcnt, off_t, o
 DEFINE_SYSCALL(pwritev, int, fd, const struct iovec *, iov, int, iovcnt, off_t, offset)
 {
 	log_info("pwritev(%d, 0x%p, %d, 0x%x)", fd, iov, iovcnt, offset);
+	if (iovcnt < 0 || iovcnt > IOV_MAX)
+		return -L_EINVAL;
 	for (int i = 0; i < iovcnt; i++)
 		if (!mm_check_read(iov[i].iov_base, iov[i].iov_len))
 			return -L_EFAULT;
@@ -800,19 +1226,26 @@ DEFINE_SYSCALL(pwritev, int, fd, const struct iovec *, iov, int, iovcnt, off_t,
 	}
 	else
 	{
-		r = 0;
-		for (int i = 0; i < iovcnt; i++)
+		r = -L_ENOSYS;
+		if (f->op_vtable->pwritev)
+			r = f->op_vtable->pwritev(f, iov, iovcnt, offset);
+		if (r == -L_ENOSYS)
 		{
-			ssize_t cur = f->op_vtable->pwrite(f, iov[i].iov_base, iov[i].iov_len, offset);
-			if (cur < 0)
+			r = 0;
+			for (int i = 0; i < iovcnt; i++)
 			{
-				r = cur;
-				break;
+				ssize_t cur = f->op_vtable->pwrite(f, iov[i].iov_base, iov[i].iov_len, offset);
+				if (cur < 0)
+				{
+					if (r == 0)
+						r = cur;
+					break;
+				}
+				r += cur;
+				offset += cur;
+				if (cur < iov[i].iov_len)
+					break;
 			}
-			r += cur;
-			offset += cur;
-			if (cur < iov[i].iov_len)
-				break;
 		}
 	}
 	if (f)
@@ -820,6 +1253,172 @@ DEFINE_SYSCALL(pwritev, int, fd, const struct iovec *, iov, int, iovcnt, off_t,
 	return r;
 }
 
+/* sendfile(), splice() and copy_file_range() move data between two files through a per thread
+ * kernel buffer, the data never passes through guest memory and each chunk costs one read and
+ * one write operation instead of two system calls and a memcpy() in the guest.
+ */
+#define VFS_TRANSFER_BUFFER_SIZE	BLOCK_SIZE
+
+static __declspec(thread) char *vfs_transfer_buffer;
+
+/* Transfer up to count bytes from in to out
+ * If in_offset or out_offset is not NULL, the corresponding file is accessed positionally at that
+ * offset which is advanced by the number of bytes transferred, otherwise the file pointer is used.
+ */
+static ssize_t vfs_transfer(struct file *in, loff_t *in_offset, struct file *out, loff_t *out_offset, size_t count)
+{
+	if (in_offset? !in->op_vtable->pread: !in->op_vtable->read)
+		return -L_EINVAL;
+	if (out_offset? !out->op_vtable->pwrite: !out->op_vtable->write)
+		return -L_EINVAL;
+	if (!vfs_transfer_buffer)
+	{
+		vfs_transfer_buffer = (char *)VirtualAlloc(NULL, VFS_TRANSFER_BUFFER_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		if (!vfs_transfer_buffer)
+			return -L_ENOMEM;
+	}
+	char *buf = vfs_transfer_buffer;
+	ssize_t total = 0;
+	while (count > 0)
+	{
+		size_t chunk = min(count, VFS_TRANSFER_BUFFER_SIZE);
+		ssize_t num_read;
+		if (in_offset)
+			num_read = in->op_vtable->pread(in, buf, chunk, *in_offset);
+		else
+			num_read = in->op_vtable->read(in, buf, chunk);
+		if (num_read <= 0)
+		{
+			if (total == 0)
+				total = num_read;
+			break;
+		}
+		ssize_t num_written = 0;
+		while (num_written < num_read)
+		{
+			ssize_t cur;
+			if (out_offset)
+				cur = out->op_vtable->pwrite(out, buf + num_written, num_read - num_written, *out_offset + num_written);
+			else
+				cur = out->op_vtable->write(out, buf + num_written, num_read - num_written);
+			if (cur <= 0)
+			{
+				if (total == 0 && num_written == 0)
+					total = cur;
+				break;
+			}
+			num_written += cur;
+		}
+		/* Give back what could not be written, only possible for seekable input when not positional */
+		if (!in_offset && num_written < num_read && in->op_vtable->llseek)
+		{
+			loff_t newoffset;
+			in->op_vtable->llseek(in, num_written - num_read, &newoffset, SEEK_CUR);
+		}
+		if (num_written <= 0)
+			break;
+		if (in_offset)
+			*in_offset += num_written;
+		if (out_offset)
+			*out_offset += num_written;
+		total += num_written;
+		count -= num_written;
+		if (num_written < num_read || num_read < (ssize_t)chunk)
+			break;
+	}
+	return total;
+}
+
+static ssize_t vfs_sendfile(int out_fd, int in_fd, loff_t *offset, size_t count)
+{
+	struct file *in = vfs_get(in_fd);
+	struct file *out = vfs_get(out_fd);
+	ssize_t r;
+	if (!in || !out)
+		r = -L_EBADF;
+	else if ((in->flags & O_ACCMODE) == O_WRONLY || (out->flags & O_ACCMODE) == O_RDONLY)
+		r = -L_EBADF;
+	else
+		r = vfs_transfer(in, offset, out, NULL, count);
+	if (in)
+		vfs_release(in);
+	if (out)
+		vfs_release(out);
+	return r;
+}
+
+DEFINE_SYSCALL(sendfile, int, out_fd, int, in_fd, off_t *, offset, size_t, count)
+{
+	log_info("sendfile(%d, %d, %p, %p)", out_fd, in_fd, offset, count);
+	if (!offset)
+		return vfs_sendfile(out_fd, in_fd, NULL, count);
+	if (!mm_check_write(offset, sizeof(off_t)))
+		return -L_EFAULT;
+	loff_t pos = *offset;
+	ssize_t r = vfs_sendfile(out_fd, in_fd, &pos, count);
+	if (r > 0)
+		*offset = (off_t)pos;
+	return r;
+}
+
+DEFINE_SYSCALL(sendfile64, int, out_fd, int, in_fd, loff_t *, offset, size_t, count)
+{
+	log_info("sendfile64(%d, %d, %p, %p)", out_fd, in_fd, offset, count);
+	if (offset && !mm_check_write(offset, sizeof(loff_t)))
+		return -L_EFAULT;
+	return vfs_sendfile(out_fd, in_fd, offset, count);
+}
+
+DEFINE_SYSCALL(splice, int, fd_in, loff_t *, off_in, int, fd_out, loff_t *, off_out, size_t, len, unsigned int, flags)
+{
+	log_info("splice(%d, %p, %d, %p, %p, 0x%x)", fd_in, off_in, fd_out, off_out, len, flags);
+	if (off_in && !mm_check_write(off_in, sizeof(loff_t)))
+		return -L_EFAULT;
+	if (off_out && !mm_check_write(off_out, sizeof(loff_t)))
+		return -L_EFAULT;
+	struct file *in = vfs_get(fd_in);
+	struct file *out = vfs_get(fd_out);
+	ssize_t r;
+	if (!in || !out)
+		r = -L_EBADF;
+	else if ((off_in && !in->op_vtable->pread) || (off_out && !out->op_vtable->pwrite))
+		r = -L_ESPIPE;
+	else
+		r = vfs_transfer(in, off_in, out, off_out, len);
+	if (in)
+		vfs_release(in);
+	if (out)
+		vfs_release(out);
+	return r;
+}
+
+DEFINE_SYSCALL(copy_file_range, int, fd_in, loff_t *, off_in, int, fd_out, loff_t *, off_out, size_t, len, unsigned int, flags)
+{
+	log_info("copy_file_range(%d, %p, %d, %p, %p, 0x%x)", fd_in, off_in, fd_out, off_out, len, flags);
+	if (flags)
+		return -L_EINVAL;
+	if (off_in && !mm_check_write(off_in, sizeof(loff_t)))
+		return -L_EFAULT;
+	if (off_out && !mm_check_write(off_out, sizeof(loff_t)))
+		return -L_EFAULT;
+	struct file *in = vfs_get(fd_in);
+	struct file *out = vfs_get(fd_out);
+	ssize_t r;
+	if (!in || !out)
+		r = -L_EBADF;
+	else if ((in->flags & O_ACCMODE) == O_WRONLY || (out->flags & O_ACCMODE) == O_RDONLY || (out->flags & O_APPEND))
+		r = -L_EBADF;
+	else if (!winfs_is_winfile(in) || !winfs_is_winfile(out))
+		r = -L_EINVAL; /* Only regular files are supported */
+	else
+		r = vfs_transfer(in, off_in, out, off_out, len);
+	if (in)
+		vfs_release(in);
+	if (out)
+		vfs_release(out);
+	return r;
+}
+
 DEFINE_SYSCALL(truncate, const char *, path, off_t, length)
 {
 	log_info("truncate(\"%s\", %p)", path, length);
@@ -978,38 +1577,206 @@ DEFINE_SYSCALL(llseek, int, fd, unsigned long, offset_high, unsigned long, offse
 		r = -L_EBADF;
 	else if (!f->op_vtable->llseek)
 	{
-		log_error("llseek() not implemented for the file.");
-		r = -L_EINVAL;
+		log_error("llseek() not implemented for the file.");
+		r = -L_EINVAL;
+	}
+	else
+		r = f->op_vtable->llseek(f, offset, result, whence);
+	if (f)
+		vfs_release(f);
+	return r;
+}
+
+static bool find_mountpoint(const char *path, struct mount_point **out_mp, const char **out_subpath)
+{
+	struct mount_table *table = vfs_get_mount_table();
+	const char *subpath = NULL;
+	for (int i = table->head[(unsigned char)path[1]]; i != -1; i = table->next[i])
+	{
+		struct mount_point *mp = &table->mounts[i];
+		int len = mp->mountpoint_len;
+		if (!strncmp(path, mp->mountpoint, len) && (path[len] == 0 || path[len] == '/'))
+		{
+			*out_mp = mp;
+			subpath = path + len;
+			break;
+		}
+	}
+	if (!subpath)
+	{
+		if (!table->root)
+			return false;
+		*out_mp = &table->mounts[table->root];
+		subpath = path + 1;
+	}
+	if (*subpath == '/')
+		subpath++;
+	*out_subpath = subpath;
+	return true;
+}
+
+/* Path component cache
+ * resolve_path() opens every intermediate path component on the underlying file system
+ * only to learn whether it is a directory or a symlink. For winfs this is a NtCreateFile()
+ * plus a few queries per component, which dominates the cost of path lookups in build tools.
+ * We remember the results for winfs and overlay components in a small direct mapped table.
+ *
+ * A directory or symlink can only turn into something else by being removed or renamed, so
+ * these operations bump a session wide generation counter which drops all cached entries of
+ * all processes.
+ *
+ * Missing paths are cached as negative entries, this is what makes searching lists of
+ * directories (PATH, include paths, library paths) cheap. A missing path can only appear
+ * by being created in its parent directory, so creations bump a session wide per directory
+ * counter instead (hashed into DCACHE_DIR_BUCKETS), which only drops the negative entries
+ * under the same parent.
+ *
+ * Changes seen by inotify watches are fed back through vfs_notify_change(). Other directories
+ * give no change notifications, so entries also expire after DCACHE_TTL milliseconds to pick
+ * up changes made outside.
+ *
+ * The table is allocated on first use with VirtualAlloc(), which a forked child does not inherit,
+ * so it starts with an empty cache. It is freed as a whole under memory pressure, see cache.h.
+ */
+#define DCACHE_SIZE			512
+#define DCACHE_PATH_MAX		192
+#define DCACHE_TARGET_MAX	128
+#define DCACHE_TTL			1000
+#define DCACHE_MISS			-1
+#define DCACHE_DIRECTORY	0
+#define DCACHE_SYMLINK		1
+#define DCACHE_NEGATIVE		2
+struct dcache_entry
+{
+	ULONGLONG time; /* 0 if the entry is not used */
+	LONG generation;
+	LONG dir_generation; /* Only checked for negative entries */
+	int type;
+	char path[DCACHE_PATH_MAX];
+	char target[DCACHE_TARGET_MAX];
+};
+/* Generation counters taken before querying the file system, so changes made while we are querying invalidate the result */
+struct dcache_stamp
+{
+	LONG generation;
+	LONG dir_generation;
+};
+static struct dcache_entry *dcache; /* NULL if not allocated */
+static SRWLOCK dcache_lock = SRWLOCK_INIT;
+
+/* Whether path lookups on a file system are cached, see above */
+static bool dcache_cacheable(struct file_system *fs)
+{
+	return fs == vfs->fs[FS_WINFS] || fs == vfs->fs[FS_OVERLAYFS];
+}
+
+static uint32_t dcache_hash(const char *path, const char *end)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261U;
+	for (; path < end; path++)
+		hash = (hash ^ (unsigned char)*path) * 16777619U;
+	return hash;
+}
+
+static struct dcache_entry *dcache_bucket(const char *path)
+{
+	return &dcache[dcache_hash(path, path + strlen(path)) % DCACHE_SIZE];
+}
+
+/* Get the creation counter of the parent directory of an absolute path */
+static volatile LONG *dcache_dir_generation(const char *path)
+{
+	const char *end = strrchr(path, '/');
+	return &vfs_shared->dcache_dir_generation[dcache_hash(path, end) % DCACHE_DIR_BUCKETS];
+}
+
+/* Look up a path, returns one of DCACHE_* types, target is filled for DCACHE_SYMLINK
+ * stamp receives the current generation counters for a later dcache_add() call
+ */
+static int dcache_lookup(const char *path, char *target, struct dcache_stamp *stamp)
+{
+	stamp->generation = vfs_shared->dcache_generation;
+	stamp->dir_generation = *dcache_dir_generation(path);
+	int r = DCACHE_MISS;
+	AcquireSRWLockShared(&dcache_lock);
+	struct dcache_entry *entry = dcache? dcache_bucket(path): NULL;
+	if (entry && entry->time && entry->generation == stamp->generation
+		&& GetTickCount64() - entry->time < DCACHE_TTL && !strcmp(entry->path, path))
+	{
+		r = entry->type;
+		if (r == DCACHE_SYMLINK)
+			strcpy(target, entry->target);
+		else if (r == DCACHE_NEGATIVE && entry->dir_generation != stamp->dir_generation)
+			r = DCACHE_MISS;
 	}
-	else
-		r = f->op_vtable->llseek(f, offset, result, whence);
-	if (f)
-		vfs_release(f);
+	ReleaseSRWLockShared(&dcache_lock);
 	return r;
 }
 
-static bool find_mountpoint(const char *path, struct mount_point *out_mp, const char **out_subpath)
+static void dcache_add(const char *path, int type, const char *target, const struct dcache_stamp *stamp)
 {
-	for (int i = vfs_shared->mp_first; i; i = vfs_shared->mounts[i].next)
+	if (strlen(path) >= DCACHE_PATH_MAX)
+		return;
+	if (type == DCACHE_SYMLINK && strlen(target) >= DCACHE_TARGET_MAX)
+		return;
+	AcquireSRWLockExclusive(&dcache_lock);
+	if (!dcache && !(dcache = (struct dcache_entry *)VirtualAlloc(NULL, DCACHE_SIZE * sizeof(struct dcache_entry), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE)))
 	{
-		const struct mount_point *mp = &vfs_shared->mounts[i];
-		const char *p = mp->mountpoint;
-		const char *subpath = path;
-		while (*p && *p == *subpath)
-		{
-			p++;
-			subpath++;
-		}
-		if (*p == 0 && (i == vfs_shared->root_id || *subpath == 0 || *subpath == '/'))
-		{
-			copy_mountpoint(mp, out_mp);
-			*out_subpath = subpath;
-			if (**out_subpath == '/')
-				(*out_subpath)++;
-			return true;
-		}
+		ReleaseSRWLockExclusive(&dcache_lock);
+		return;
 	}
-	return false;
+	struct dcache_entry *entry = dcache_bucket(path);
+	entry->time = GetTickCount64();
+	entry->generation = stamp->generation;
+	entry->dir_generation = stamp->dir_generation;
+	entry->type = type;
+	strcpy(entry->path, path);
+	if (type == DCACHE_SYMLINK)
+		strcpy(entry->target, target);
+	ReleaseSRWLockExclusive(&dcache_lock);
+}
+
+size_t vfs_dcache_size()
+{
+	return dcache? DCACHE_SIZE * sizeof(struct dcache_entry): 0;
+}
+
+void vfs_dcache_shrink(size_t target)
+{
+	/* The table is direct mapped, it can only be dropped as a whole */
+	if (target >= vfs_dcache_size())
+		return;
+	AcquireSRWLockExclusive(&dcache_lock);
+	if (dcache)
+	{
+		VirtualFree(dcache, 0, MEM_RELEASE);
+		dcache = NULL;
+	}
+	ReleaseSRWLockExclusive(&dcache_lock);
+}
+
+/* Drop cached path components of all processes in the session */
+static void dcache_invalidate()
+{
+	InterlockedIncrement(&vfs_shared->dcache_generation);
+}
+
+/* Drop cached negative entries in the parent directory of a newly created path */
+static void dcache_created(const char *path)
+{
+	InterlockedIncrement(dcache_dir_generation(path));
+}
+
+void vfs_notify_change(const char *path, int change)
+{
+	if (!path)
+		dcache_invalidate();
+	else if (change == VFS_CHANGE_CREATED)
+		dcache_created(path);
+	else if (change == VFS_CHANGE_REMOVED)
+		dcache_invalidate();
+	winfs_notify_change();
 }
 
 /* Resolve a given path (except the last component), output the real path
@@ -1070,15 +1837,24 @@ static int resolve_path(const char *dirpath, const char *pathname, char *realpat
 				/* Resolve component */
 				for (;;)
 				{
-					struct mount_point mp;
+					struct mount_point *mp;
 					char *subpath;
 					*realpath = 0;
-					if (!find_mountpoint(realpath_start, &mp, &subpath))
-						return -L_ENOTDIR;
-					struct file_system *fs = mp.fs;
-					if (!fs->open)
-						return -L_ENOTDIR;
-					int r = fs->open(&mp, subpath, O_PATH | O_DIRECTORY, 0, 0, NULL, target, PATH_MAX);
+					struct dcache_stamp stamp;
+					int r = dcache_lookup(realpath_start, target, &stamp);
+					if (r == DCACHE_NEGATIVE)
+						return -L_ENOENT;
+					if (r == DCACHE_MISS)
+					{
+						if (!find_mountpoint(realpath_start, &mp, &subpath))
+							return -L_ENOTDIR;
+						struct file_system *fs = mp->fs;
+						if (!fs->open)
+							return -L_ENOTDIR;
+						r = fs->open(mp, subpath, O_PATH | O_DIRECTORY, 0, 0, NULL, target, PATH_MAX);
+						if (dcache_cacheable(fs) && (r >= 0 || r == -L_ENOENT))
+							dcache_add(realpath_start, r >= 0? r: DCACHE_NEGATIVE, target, &stamp);
+					}
 					if (r < 0)
 						return r;
 					else if (r == 0) /* It is a regular file, go forward */
@@ -1130,18 +1906,53 @@ static int resolve_path(const char *dirpath, const char *pathname, char *realpat
 	return realpath - realpath_start;
 }
 
+/* Get the path of cwd, caller should have vfs->rw_lock acquired
+ * getpath() on a directory queries the file name from the host. The result is
+ * cached under the same rules as dcache entries, so a rename of cwd or one of
+ * its parents is picked up.
+ */
+static int vfs_get_cwd_path(char *buf)
+{
+	LONG generation = vfs_shared->dcache_generation;
+	ULONGLONG now = GetTickCount64();
+	AcquireSRWLockShared(&vfs->cwd_lock);
+	int len = vfs->cwd_path_len;
+	if (len > 0 && vfs->cwd_generation == generation && now - vfs->cwd_time < DCACHE_TTL)
+		memcpy(buf, vfs->cwd_path, len + 1);
+	else
+		len = 0;
+	ReleaseSRWLockShared(&vfs->cwd_lock);
+	if (len > 0)
+		return len;
+	len = vfs->cwd->op_vtable->getpath(vfs->cwd, buf);
+	if (len > 0 && len < PATH_MAX)
+	{
+		AcquireSRWLockExclusive(&vfs->cwd_lock);
+		memcpy(vfs->cwd_path, buf, len + 1);
+		vfs->cwd_path_len = len;
+		vfs->cwd_generation = generation;
+		vfs->cwd_time = now;
+		ReleaseSRWLockExclusive(&vfs->cwd_lock);
+	}
+	return len;
+}
+
 /* resolve_path(), *at() version */
 int resolve_pathat(int dirfd, const char *pathname, char *realpath, int *symlink_remain)
 {
 	char dirpath[PATH_MAX];
 	if (pathname[0] != '/')
 	{
-		struct file *f = dirfd == AT_FDCWD? vfs->cwd: vfs_get_internal(dirfd);
-		if (!f)
-			return -L_EBADF;
-		f->op_vtable->getpath(f, dirpath);
-		if (dirfd != AT_FDCWD)
+		if (dirfd == AT_FDCWD)
+			vfs_get_cwd_path(dirpath);
+		else
+		{
+			struct file *f = vfs_get_internal(dirfd);
+			if (!f)
+				return -L_EBADF;
+			f->op_vtable->getpath(f, dirpath);
 			vfs_release(f);
+		}
 	}
 	return resolve_path(dirpath, pathname, realpath, symlink_remain);
 }
@@ -1191,12 +2002,35 @@ int vfs_openat(int dirfd, const char *pathname, int flags, int internal_flags, i
 	{
 		if (r < 0)
 			return r;
-		struct mount_point mp;
+		struct mount_point *mp;
 		char *subpath;
-		if (!find_mountpoint(realpath, &mp, &subpath))
+		struct dcache_stamp stamp;
+		int type = DCACHE_MISS;
+		if (!(flags & O_CREAT))
+			type = dcache_lookup(realpath, target, &stamp);
+		if (type == DCACHE_NEGATIVE)
 			return -L_ENOENT;
-		struct file_system *fs = mp.fs;
-		int ret = fs->open(&mp, subpath, flags, internal_flags, mode, f, target, PATH_MAX);
+		int ret;
+		if (type == DCACHE_SYMLINK && !(flags & O_NOFOLLOW))
+			ret = 1; /* Follow the cached target without opening the symlink */
+		else
+		{
+			if (!find_mountpoint(realpath, &mp, &subpath))
+				return -L_ENOENT;
+			struct file_system *fs = mp->fs;
+			ret = fs->open(mp, subpath, flags, internal_flags, mode, f, target, PATH_MAX);
+			if (!(flags & O_CREAT) && dcache_cacheable(fs))
+			{
+				if (ret == -L_ENOENT)
+					dcache_add(realpath, DCACHE_NEGATIVE, NULL, &stamp);
+				else if (ret == 1)
+					dcache_add(realpath, DCACHE_SYMLINK, target, &stamp);
+			}
+			else if (ret == 0 && (flags & O_CREAT))
+				dcache_created(realpath);
+		}
+		if (ret == 0)
+			prefetch_record_open(realpath, flags, *f);
 		if (ret <= 0)
 			return ret;
 		else if (ret == 1)
@@ -1232,7 +2066,7 @@ DEFINE_SYSCALL(openat, int, dirfd, const char *, pathname, int, flags, int, mode
 		else
 			log_info("openat() file descriptor id: %d", r);
 	}
-	ReleaseSRWLockExclusive(&vfs->rw_lock);
+	vfs_unlock_exclusive();
 	return r;
 }
 
@@ -1253,11 +2087,11 @@ DEFINE_SYSCALL(close, int, fd)
 	log_info("close(%d)", fd);
 	int r = 0;
 	AcquireSRWLockExclusive(&vfs->rw_lock);
-	if (!vfs->filed[fd].fd)
+	if (fd < 0 || fd >= vfs->fds->size || !vfs->fds->filed[fd].fd)
 		r = -L_EBADF;
 	else
 		vfs_close(fd);
-	ReleaseSRWLockExclusive(&vfs->rw_lock);
+	vfs_unlock_exclusive();
 	return r;
 }
 
@@ -1304,17 +2138,19 @@ DEFINE_SYSCALL(linkat, int, olddirfd, const char *, oldpath, int, newdirfd, cons
 	r = resolve_pathat(newdirfd, newpath, realpath, &symlink_remain);
 	if (r < 0)
 		goto out;
-	struct mount_point mp;
+	struct mount_point *mp;
 	char *subpath;
 	if (!find_mountpoint(realpath, &mp, &subpath))
 		r = -L_ENOENT;
 	else
 	{
-		struct file_system *fs = mp.fs;
+		struct file_system *fs = mp->fs;
 		if (!fs->link)
 			r = -L_EXDEV;
 		else
-			r = fs->link(&mp, f, subpath);
+			r = fs->link(mp, f, subpath);
+		if (r == 0)
+			dcache_created(realpath);
 	}
 	vfs_release(f);
 out:
@@ -1340,27 +2176,29 @@ DEFINE_SYSCALL(unlinkat, int, dirfd, const char *, pathname, int, flags)
 	int r = resolve_pathat(dirfd, pathname, realpath, &symlink_remain);
 	if (r >= 0)
 	{
-		struct mount_point mp;
+		struct mount_point *mp;
 		char *subpath;
 		if (!find_mountpoint(realpath, &mp, &subpath))
 			r = -L_ENOENT;
 		else
 		{
-			struct file_system *fs = mp.fs;
+			struct file_system *fs = mp->fs;
 			if (flags & AT_REMOVEDIR)
 			{
 				if (!fs->rmdir)
 					r = -L_EPERM;
 				else
-					r = fs->rmdir(&mp, subpath);
+					r = fs->rmdir(mp, subpath);
 			}
 			else
 			{
 				if (!fs->unlink)
 					r = -L_EPERM;
 				else
-					r = fs->unlink(&mp, subpath);
+					r = fs->unlink(mp, subpath);
 			}
+			if (r == 0)
+				dcache_invalidate();
 		}
 	}
 	ReleaseSRWLockShared(&vfs->rw_lock);
@@ -1384,17 +2222,19 @@ DEFINE_SYSCALL(symlinkat, const char *, target, int, newdirfd, const char *, lin
 	int r = resolve_pathat(newdirfd, linkpath, realpath, &symlink_remain);
 	if (r >= 0)
 	{
-		struct mount_point mp;
+		struct mount_point *mp;
 		char *subpath;
 		if (!find_mountpoint(realpath, &mp, &subpath))
 			r = -L_ENOTDIR;
 		else
 		{
-			struct file_system *fs = mp.fs;
+			struct file_system *fs = mp->fs;
 			if (!fs->symlink)
 				r = -L_EPERM;
 			else
-				r = fs->symlink(&mp, target, subpath);
+				r = fs->symlink(mp, target, subpath);
+			if (r == 0)
+				dcache_created(realpath);
 		}
 	}
 	ReleaseSRWLockShared(&vfs->rw_lock);
@@ -1451,7 +2291,7 @@ DEFINE_SYSCALL(renameat2, int, olddirfd, const char *, oldpath, int, newdirfd, c
 	int r = vfs_openat(olddirfd, oldpath, O_PATH | O_NOFOLLOW, INTERNAL_O_DELETE | INTERNAL_O_NOINHERIT, 0, &f);
 	if (r < 0)
 		goto out;
-	if (!winfs_is_winfile(f))
+	if (!winfs_is_winfile(f) && !tmpfs_is_tmpfile(f))
 	{
 		r = -L_EPERM;
 		goto out;
@@ -1461,17 +2301,21 @@ DEFINE_SYSCALL(renameat2, int, olddirfd, const char *, oldpath, int, newdirfd, c
 	r = resolve_pathat(newdirfd, newpath, realpath, &symlink_remain);
 	if (r < 0)
 		goto out;
-	struct mount_point mp;
+	struct mount_point *mp;
 	char *subpath;
 	if (!find_mountpoint(realpath, &mp, &subpath))
 		r = -L_EXDEV;
 	else
 	{
-		struct file_system *fs = mp.fs;
-		if (!fs->rename)
+		struct file_system *fs = mp->fs;
+		if (!fs->rename || winfs_is_winfile(f) != (fs == vfs->fs[FS_WINFS] || fs == vfs->fs[FS_OVERLAYFS]))
 			r = -L_EXDEV;
 		else
-			r = fs->rename(&mp, f, subpath);
+		{
+			r = fs->rename(mp, f, subpath);
+			if (r == 0)
+				dcache_invalidate();
+		}
 	}
 	vfs_release(f);
 out:
@@ -1515,17 +2359,19 @@ DEFINE_SYSCALL(mkdirat, int, dirfd, const char *, pathname, int, mode)
 		r = resolve_pathat(dirfd, pathname, realpath, &symlink_remain);
 	if (r >= 0)
 	{
-		struct mount_point mp;
+		struct mount_point *mp;
 		char *subpath;
 		if (!find_mountpoint(realpath, &mp, &subpath))
 			r = -L_ENOTDIR;
 		else
 		{
-			struct file_system *fs = mp.fs;
+			struct file_system *fs = mp->fs;
 			if (!fs->mkdir)
 				r = -L_EPERM;
 			else
-				r = fs->mkdir(&mp, subpath, mode);
+				r = fs->mkdir(mp, subpath, mode);
+			if (r == 0)
+				dcache_created(realpath);
 		}
 	}
 	ReleaseSRWLockShared(&vfs->rw_lock);
@@ -1693,7 +2539,7 @@ static int stat64_from_newstat(struct stat64 *stat, const struct newstat *newsta
 	return 0;
 }
 
-static int vfs_statat(int dirfd, const char *pathname, struct newstat *stat, int flags)
+int vfs_statat(int dirfd, const char *pathname, struct newstat *stat, int flags)
 {
 	int r = 0;
 	AcquireSRWLockShared(&vfs->rw_lock);
@@ -1715,10 +2561,46 @@ static int vfs_statat(int dirfd, const char *pathname, struct newstat *stat, int
 	}
 	else
 	{
+		/* A plain name may be served from the entries recorded by the last getdents() on the directory */
+		if (*pathname && !strchr(pathname, '/') && strcmp(pathname, ".") && strcmp(pathname, "..") && !is_mountpoint_name(pathname))
+		{
+			struct file *dir = dirfd == AT_FDCWD? vfs->cwd: vfs_get_internal(dirfd);
+			if (dir)
+			{
+				r = winfs_stat_dirent(dir, pathname, stat);
+				if (dirfd != AT_FDCWD)
+					vfs_release(dir);
+				if (r != -L_ENOSYS)
+					goto out;
+			}
+		}
+		/* Try querying the file system by name, which saves opening the file */
+		char realpath[PATH_MAX], target[PATH_MAX];
+		int symlink_remain = MAX_SYMLINK_LEVEL;
+		r = resolve_pathat(dirfd, pathname, realpath, &symlink_remain);
+		if (r < 0)
+			goto out;
+		struct dcache_stamp stamp;
+		int type = dcache_lookup(realpath, target, &stamp);
+		if (type == DCACHE_NEGATIVE)
+		{
+			r = -L_ENOENT;
+			goto out;
+		}
+		struct mount_point *mp;
+		char *subpath;
+		if (type != DCACHE_SYMLINK && find_mountpoint(realpath, &mp, &subpath) && mp->fs->stat)
+		{
+			r = mp->fs->stat(mp, subpath, stat);
+			if (r == -L_ENOENT && dcache_cacheable(mp->fs))
+				dcache_add(realpath, DCACHE_NEGATIVE, NULL, &stamp);
+			if (r != -L_ENOSYS)
+				goto out;
+		}
 		int openflags = O_PATH;
 		if (flags & AT_SYMLINK_NOFOLLOW)
 			openflags |= O_NOFOLLOW;
-		r = vfs_openat(dirfd, pathname, openflags, INTERNAL_O_NOINHERIT, 0, &f);
+		r = vfs_openat(AT_FDCWD, realpath, openflags, INTERNAL_O_NOINHERIT, 0, &f);
 		if (r < 0)
 			goto out;
 	}
@@ -1967,9 +2849,8 @@ DEFINE_SYSCALL(statfs64, const char *, pathname, size_t, sz, struct statfs64 *,
 DEFINE_SYSCALL(fadvise64_64, int, fd, loff_t, offset, loff_t, len, int, advice)
 {
 	log_info("fadvise64_64(%d, %lld, %lld, %d)", fd, offset, len, advice);
-	/* It seems windows does not support any of the fadvise semantics
-	 * We simply check the validity of parameters and return
-	 */
+	if (len < 0)
+		return -L_EINVAL;
 	int r;
 	struct file *f = vfs_get(fd);
 	if (!f)
@@ -1984,7 +2865,10 @@ DEFINE_SYSCALL(fadvise64_64, int, fd, loff_t, offset, loff_t, len, int, advice)
 		case POSIX_FADV_WILLNEED:
 		case POSIX_FADV_DONTNEED:
 		case POSIX_FADV_NOREUSE:
+			/* Only a hint, files without support simply ignore it */
 			r = 0;
+			if (f->op_vtable->fadvise)
+				r = f->op_vtable->fadvise(f, offset, len, advice);
 			break;
 
 		default:
@@ -2166,8 +3050,9 @@ DEFINE_SYSCALL(chdir, const char *, pathname)
 		goto out;
 	vfs_release(vfs->cwd);
 	vfs->cwd = f;
+	vfs->cwd_path_len = 0;
 out:
-	ReleaseSRWLockExclusive(&vfs->rw_lock);
+	vfs_unlock_exclusive();
 	return r;
 }
 
@@ -2184,8 +3069,9 @@ DEFINE_SYSCALL(fchdir, int, fd)
 	}
 	vfs_release(vfs->cwd);
 	vfs->cwd = f;
+	vfs->cwd_path_len = 0;
 out:
-	ReleaseSRWLockExclusive(&vfs->rw_lock);
+	vfs_unlock_exclusive();
 	return r;
 }
 
@@ -2196,7 +3082,7 @@ DEFINE_SYSCALL(getcwd, char *, buf, size_t, size)
 		return -L_EFAULT;
 	AcquireSRWLockShared(&vfs->rw_lock);
 	char cwd[PATH_MAX];
-	intptr_t r = vfs->cwd->op_vtable->getpath(vfs->cwd, cwd);
+	intptr_t r = vfs_get_cwd_path(cwd);
 	if (size < r + 1)
 		r = -L_ERANGE;
 	else
@@ -2209,7 +3095,124 @@ DEFINE_SYSCALL(getcwd, char *, buf, size_t, size)
 	return r;
 }
 
-DEFINE_SYSCALL(fcntl, int, fd, int, cmd, int, arg)
+/* Resolve a fcntl() lock request to an absolute range and pass it to the file
+ * lock64 tells whether arg points to a struct flock64 or a struct flock.
+ */
+static int vfs_fcntl_lock(struct file *f, int cmd, void *arg, bool lock64)
+{
+	struct flock64 lock;
+	if (lock64)
+	{
+		if (!mm_check_read(arg, sizeof(struct flock64)))
+			return -L_EFAULT;
+		lock = *(struct flock64 *)arg;
+	}
+	else
+	{
+		if (!mm_check_read(arg, sizeof(struct flock)))
+			return -L_EFAULT;
+		struct flock *l = (struct flock *)arg;
+		lock.l_type = l->l_type;
+		lock.l_whence = l->l_whence;
+		lock.l_start = l->l_start;
+		lock.l_len = l->l_len;
+		lock.l_pid = l->l_pid;
+	}
+	int lock_cmd;
+	switch (cmd)
+	{
+	case F_OFD_GETLK:
+	case F_OFD_SETLK:
+	case F_OFD_SETLKW:
+		if (lock.l_pid != 0)
+			return -L_EINVAL;
+		/* Fall through */
+	default:
+		if (cmd == F_GETLK || cmd == F_GETLK64 || cmd == F_OFD_GETLK)
+			lock_cmd = F_GETLK;
+		else if (cmd == F_SETLKW || cmd == F_SETLKW64 || cmd == F_OFD_SETLKW)
+			lock_cmd = F_SETLKW;
+		else
+			lock_cmd = F_SETLK;
+	}
+	log_info("lock: type %d, whence %d, start %lld, len %lld", lock.l_type, lock.l_whence, lock.l_start, lock.l_len);
+	if (f->flags & O_PATH)
+		return -L_EBADF;
+	if (lock.l_type != F_RDLCK && lock.l_type != F_WRLCK && (lock.l_type != F_UNLCK || lock_cmd == F_GETLK))
+		return -L_EINVAL;
+	if (lock_cmd != F_GETLK)
+	{
+		if ((lock.l_type == F_RDLCK && (f->flags & O_ACCMODE) == O_WRONLY)
+			|| (lock.l_type == F_WRLCK && (f->flags & O_ACCMODE) == O_RDONLY))
+			return -L_EBADF;
+	}
+	loff_t base;
+	switch (lock.l_whence)
+	{
+	case SEEK_SET:
+		base = 0;
+		break;
+	case SEEK_CUR:
+	{
+		if (!f->op_vtable->llseek || f->op_vtable->llseek(f, 0, &base, SEEK_CUR) < 0)
+			return -L_EINVAL;
+		break;
+	}
+	case SEEK_END:
+	{
+		struct newstat st;
+		if (!f->op_vtable->stat || f->op_vtable->stat(f, &st) < 0)
+			return -L_EINVAL;
+		base = st.st_size;
+		break;
+	}
+	default:
+		return -L_EINVAL;
+	}
+	lock.l_start += base;
+	if (lock.l_len < 0)
+	{
+		lock.l_start += lock.l_len;
+		lock.l_len = -lock.l_len;
+	}
+	if (lock.l_start < 0)
+		return -L_EINVAL;
+	lock.l_whence = SEEK_SET;
+	int r;
+	if (!f->op_vtable->lock)
+	{
+		/* Nothing to coordinate with for files which cannot be shared with other processes */
+		log_info("Locking not supported for the file, ignored.");
+		lock.l_type = F_UNLCK;
+		r = 0;
+	}
+	else
+		r = f->op_vtable->lock(f, lock_cmd, &lock);
+	if (r < 0 || lock_cmd != F_GETLK)
+		return r;
+	if (lock64)
+	{
+		if (!mm_check_write(arg, sizeof(struct flock64)))
+			return -L_EFAULT;
+		*(struct flock64 *)arg = lock;
+	}
+	else
+	{
+		if (!mm_check_write(arg, sizeof(struct flock)))
+			return -L_EFAULT;
+		if (lock.l_start != (off_t)lock.l_start || lock.l_len != (off_t)lock.l_len)
+			return -L_EOVERFLOW;
+		struct flock *l = (struct flock *)arg;
+		l->l_type = lock.l_type;
+		l->l_whence = lock.l_whence;
+		l->l_start = (off_t)lock.l_start;
+		l->l_len = (off_t)lock.l_len;
+		l->l_pid = lock.l_pid;
+	}
+	return 0;
+}
+
+DEFINE_SYSCALL(fcntl, int, fd, int, cmd, intptr_t, arg)
 {
 	log_info("fcntl(%d, %d)", fd, cmd);
 	if (cmd == F_DUPFD)
@@ -2220,12 +3223,14 @@ DEFINE_SYSCALL(fcntl, int, fd, int, cmd, int, arg)
 		r = -L_EBADF;
 	else
 	{
-		/* TODO: Whether we need locking on reading/writing cloexec flag? */
+		/* The fd table may be replaced when it grows, lock it to access the cloexec flag */
 		switch (cmd)
 		{
 		case F_GETFD:
 		{
-			int cloexec = vfs->filed[fd].cloexec;
+			AcquireSRWLockShared(&vfs->rw_lock);
+			int cloexec = vfs->fds->filed[fd].cloexec;
+			ReleaseSRWLockShared(&vfs->rw_lock);
 			log_info("F_GETFD: CLOEXEC: %d", cloexec);
 			r = cloexec? FD_CLOEXEC: 0;
 			break;
@@ -2234,7 +3239,9 @@ DEFINE_SYSCALL(fcntl, int, fd, int, cmd, int, arg)
 		{
 			int cloexec = (arg & FD_CLOEXEC)? 1: 0;
 			log_info("F_SETFD: CLOEXEC: %d", cloexec);
-			vfs->filed[fd].cloexec = cloexec;
+			AcquireSRWLockShared(&vfs->rw_lock);
+			vfs->fds->filed[fd].cloexec = cloexec;
+			ReleaseSRWLockShared(&vfs->rw_lock);
 			break;
 		}
 		case F_GETFL:
@@ -2252,6 +3259,39 @@ DEFINE_SYSCALL(fcntl, int, fd, int, cmd, int, arg)
 				f->flags = (f->flags & ~O_NONBLOCK) | (arg & O_NONBLOCK);
 			break;
 		}
+		case F_SETPIPE_SZ:
+		case F_GETPIPE_SZ:
+		{
+			log_info("F_%sPIPE_SZ: %d", cmd == F_SETPIPE_SZ? "SET": "GET", arg);
+			r = pipe_fcntl(f, cmd, (int)arg);
+			break;
+		}
+		case F_GETLK:
+		case F_SETLK:
+		case F_SETLKW:
+		{
+			/* struct flock is the same as struct flock64 on x86_64 */
+			r = vfs_fcntl_lock(f, cmd, (void *)arg, sizeof(off_t) == sizeof(loff_t));
+			break;
+		}
+		case F_GETLK64:
+		case F_SETLK64:
+		case F_SETLKW64:
+		case F_OFD_GETLK:
+		case F_OFD_SETLK:
+		case F_OFD_SETLKW:
+		{
+#ifdef _WIN64
+			if (cmd == F_GETLK64 || cmd == F_SETLK64 || cmd == F_SETLKW64)
+			{
+				log_error("Unsupported command: %d", cmd);
+				r = -L_EINVAL;
+				break;
+			}
+#endif
+			r = vfs_fcntl_lock(f, cmd, (void *)arg, true);
+			break;
+		}
 		default:
 			log_error("Unsupported command: %d", cmd);
 			r = -L_EINVAL;
@@ -2262,7 +3302,7 @@ DEFINE_SYSCALL(fcntl, int, fd, int, cmd, int, arg)
 	return r;
 }
 
-DEFINE_SYSCALL(fcntl64, int, fd, int, cmd, int, arg)
+DEFINE_SYSCALL(fcntl64, int, fd, int, cmd, intptr_t, arg)
 {
 	return sys_fcntl(fd, cmd, arg);
 }
@@ -2360,16 +3400,125 @@ DEFINE_SYSCALL(lchown, const char *, pathname, uid_t, owner, gid_t, group)
 	return sys_fchownat(AT_FDCWD, pathname, owner, group, AT_SYMLINK_NOFOLLOW);
 }
 
+/* Waiting on an arbitrary number of poll handles
+ * Up to POLL_WAIT_DIRECT_MAX handles are waited on directly. Beyond this WaitForMultipleObjects()
+ * cannot take them all, instead each handle gets a one shot thread pool wait which flags its slot
+ * and signals a single event. A slot is armed again when the next wait starts after it was reported.
+ */
+#define POLL_WAIT_DIRECT_MAX	(MAXIMUM_WAIT_OBJECTS - 1) /* signal_wait() takes one for the signal event */
+
+struct poll_wait_slot
+{
+	HANDLE wait;
+	HANDLE event;
+	volatile LONG fired;
+};
+
+struct poll_wait
+{
+	int count;
+	HANDLE *handles;
+	HANDLE event; /* NULL if the handles are waited on directly */
+	struct poll_wait_slot *slots;
+};
+
+static VOID CALLBACK poll_wait_callback(PVOID parameter, BOOLEAN timer_or_wait_fired)
+{
+	struct poll_wait_slot *slot = (struct poll_wait_slot *)parameter;
+	slot->fired = 1;
+	SetEvent(slot->event);
+}
+
+static bool poll_wait_arm(struct poll_wait *w, int i)
+{
+	if (!RegisterWaitForSingleObject(&w->slots[i].wait, w->handles[i], poll_wait_callback, &w->slots[i], INFINITE, WT_EXECUTEONLYONCE))
+	{
+		log_error("RegisterWaitForSingleObject() failed, error code: %d", GetLastError());
+		w->slots[i].wait = NULL;
+		return false;
+	}
+	return true;
+}
+
+static void poll_wait_destroy(struct poll_wait *w)
+{
+	if (!w->event)
+		return;
+	for (int i = 0; i < w->count; i++)
+		if (w->slots[i].wait)
+			UnregisterWaitEx(w->slots[i].wait, INVALID_HANDLE_VALUE);
+	CloseHandle(w->event);
+}
+
+/* slots must have room for count entries when count > POLL_WAIT_DIRECT_MAX */
+static bool poll_wait_init(struct poll_wait *w, int count, HANDLE *handles, struct poll_wait_slot *slots)
+{
+	w->count = count;
+	w->handles = handles;
+	w->event = NULL;
+	w->slots = slots;
+	if (count <= POLL_WAIT_DIRECT_MAX)
+		return true;
+	if (!(w->event = CreateEventW(NULL, FALSE, FALSE, NULL)))
+	{
+		log_error("CreateEventW() failed, error code: %d", GetLastError());
+		return false;
+	}
+	for (int i = 0; i < count; i++)
+	{
+		slots[i].event = w->event;
+		slots[i].fired = 0;
+		slots[i].wait = NULL;
+	}
+	for (int i = 0; i < count; i++)
+		if (!poll_wait_arm(w, i))
+		{
+			poll_wait_destroy(w);
+			return false;
+		}
+	return true;
+}
+
+/* Same return values as signal_wait() on the whole handle array */
+static DWORD poll_wait(struct poll_wait *w, DWORD milliseconds)
+{
+	if (!w->event)
+		return signal_wait(w->count, w->handles, milliseconds);
+	for (;;)
+	{
+		for (int i = 0; i < w->count; i++)
+		{
+			struct poll_wait_slot *slot = &w->slots[i];
+			if (InterlockedExchange(&slot->fired, 0))
+			{
+				/* The one shot wait has completed, release it and arm again on the next call */
+				UnregisterWaitEx(slot->wait, NULL);
+				slot->wait = NULL;
+				return WAIT_OBJECT_0 + i;
+			}
+			if (!slot->wait && !poll_wait_arm(w, i))
+				return WAIT_FAILED;
+		}
+		DWORD result = signal_wait(1, &w->event, milliseconds);
+		if (result != WAIT_OBJECT_0)
+			return result;
+	}
+}
+
 static int vfs_ppoll(struct linux_pollfd *fds, int nfds, int timeout, const sigset_t *sigmask)
 {
 	/* Count of handles to be waited on */
 	int cnt = 0;
+	int arrays_size = nfds * (sizeof(struct file *) + sizeof(HANDLE) + sizeof(int));
+	char *arrays = (char *)kmalloc(arrays_size);
+	if (!arrays)
+		return -L_ENOMEM;
 	/* File structures */
-	struct file **files = (struct file **)alloca(nfds * sizeof(struct file *));
+	struct file **files = (struct file **)arrays;
 	/* Handles to be waited on */
-	HANDLE *handles = (HANDLE *)alloca(nfds * sizeof(HANDLE));
+	HANDLE *handles = (HANDLE *)(files + nfds);
 	/* Indices of handles in the original fds[] array */
-	int *indices = (int *)alloca(nfds * sizeof(int));
+	int *indices = (int *)(handles + nfds);
 
 	if (timeout < 0)
 		timeout = INFINITE;
@@ -2424,30 +3573,46 @@ static int vfs_ppoll(struct linux_pollfd *fds, int nfds, int timeout, const sigs
 	}
 	if (cnt && !done)
 	{
+		struct poll_wait wait;
+		struct poll_wait_slot *slots = NULL;
+		if (cnt > POLL_WAIT_DIRECT_MAX)
+		{
+			slots = (struct poll_wait_slot *)kmalloc(cnt * sizeof(struct poll_wait_slot));
+			if (!slots)
+			{
+				num_result = -L_ENOMEM;
+				goto out;
+			}
+		}
+		if (!poll_wait_init(&wait, cnt, handles, slots))
+		{
+			if (slots)
+				kfree(slots, cnt * sizeof(struct poll_wait_slot));
+			num_result = -L_ENOMEM;
+			goto out;
+		}
 		sigset_t oldmask;
 		if (sigmask)
 			signal_before_pwait(sigmask, &oldmask);
-		LARGE_INTEGER frequency, start;
-		QueryPerformanceFrequency(&frequency);
-		QueryPerformanceCounter(&start);
+		uint64_t start = timer_monotonic_ms();
 		int remain = timeout;
 		for (;;)
 		{
-			DWORD result = signal_wait(cnt, handles, remain);
+			DWORD result = poll_wait(&wait, remain);
 			if (result == WAIT_TIMEOUT)
 			{
 				num_result = 0;
-				goto out;
+				break;
 			}
 			else if (result == WAIT_INTERRUPTED)
 			{
 				num_result = -L_EINTR;
-				goto out;
+				break;
 			}
 			else if (result < WAIT_OBJECT_0 || result >= WAIT_OBJECT_0 + cnt)
 			{
 				num_result = -L_ENOMEM; /* TODO: Find correct errno */
-				goto out;
+				break;
 			}
 			else
 			{
@@ -2471,11 +3636,9 @@ static int vfs_ppoll(struct linux_pollfd *fds, int nfds, int timeout, const sigs
 				}
 				if ((e & fds[id].events) == 0)
 				{
-					LARGE_INTEGER current;
-					QueryPerformanceCounter(&current);
 					if (timeout != INFINITE)
 					{
-						remain = timeout - (current.QuadPart - start.QuadPart) / (frequency.QuadPart * 1000LL);
+						remain = timeout - (int)(timer_monotonic_ms() - start);
 						if (remain < 0)
 							break;
 					}
@@ -2486,6 +3649,9 @@ static int vfs_ppoll(struct linux_pollfd *fds, int nfds, int timeout, const sigs
 				break;
 			}
 		}
+		poll_wait_destroy(&wait);
+		if (slots)
+			kfree(slots, cnt * sizeof(struct poll_wait_slot));
 		if (sigmask)
 			signal_after_pwait(&oldmask);
 	}
@@ -2493,12 +3659,106 @@ out:
 	for (int i = 0; i < nfds; i++)
 		if (files[i])
 			vfs_release(files[i]);
+	kfree(arrays, arrays_size);
+	return num_result;
+}
+
+/* Fast path of select(), check the current status of the fds in the sets without waiting
+ * Set bits are walked directly instead of building a pollfd array for vfs_ppoll(), the status comes
+ * from get_poll_status() of each file. If any fd is ready the sets are rewritten and the number of
+ * ready fds is returned. Otherwise the sets are untouched and 0 is returned, complete is set to false
+ * if the status of some fd (invalid fds, files with only a poll handle) is left to vfs_ppoll().
+ */
+static int vfs_select_ready(int nfds, struct fdset *readfds, struct fdset *writefds, struct fdset *exceptfds, bool *complete)
+{
+	struct fdset result[3];
+	int words = (nfds + LINUX_FD_BITPERLONG - 1) / LINUX_FD_BITPERLONG;
+	int num_result = 0;
+	*complete = true;
+	for (int i = 0; i < words; i++)
+	{
+		unsigned long r = readfds ? readfds->fds_bits[i] : 0;
+		unsigned long w = writefds ? writefds->fds_bits[i] : 0;
+		unsigned long x = exceptfds ? exceptfds->fds_bits[i] : 0;
+		unsigned long pending = r | w | x;
+		if (i == words - 1 && nfds % LINUX_FD_BITPERLONG)
+			pending &= (1UL << (nfds % LINUX_FD_BITPERLONG)) - 1;
+		result[0].fds_bits[i] = result[1].fds_bits[i] = result[2].fds_bits[i] = 0;
+		DWORD bit;
+		while (_BitScanForward(&bit, pending))
+		{
+			unsigned long mask = 1UL << bit;
+			pending &= ~mask;
+			struct file *f = vfs_get(i * LINUX_FD_BITPERLONG + bit);
+			if (!f)
+			{
+				/* vfs_ppoll() reports it as POLLNVAL */
+				*complete = false;
+				return 0;
+			}
+			if (!f->op_vtable->get_poll_status)
+			{
+				vfs_release(f);
+				*complete = false;
+				continue;
+			}
+			int e = f->op_vtable->get_poll_status(f);
+			vfs_release(f);
+			int ready = 0;
+			if ((r & mask) && (e & LINUX_POLLIN))
+			{
+				result[0].fds_bits[i] |= mask;
+				ready = 1;
+			}
+			if ((w & mask) && (e & LINUX_POLLOUT))
+			{
+				result[1].fds_bits[i] |= mask;
+				ready = 1;
+			}
+			if ((x & mask) && (e & LINUX_POLLERR))
+			{
+				result[2].fds_bits[i] |= mask;
+				ready = 1;
+			}
+			num_result += ready;
+		}
+	}
+	if (num_result == 0)
+		return 0;
+	for (int i = 0; i < words; i++)
+	{
+		if (readfds)
+			readfds->fds_bits[i] = result[0].fds_bits[i];
+		if (writefds)
+			writefds->fds_bits[i] = result[1].fds_bits[i];
+		if (exceptfds)
+			exceptfds->fds_bits[i] = result[2].fds_bits[i];
+	}
 	return num_result;
 }
 
 static int vfs_pselect6(int nfds, struct fdset *readfds, struct fdset *writefds, struct fdset *exceptfds,
 	int timeout, const sigset_t *sigmask)
 {
+	bool complete = false;
+	if (nfds >= 0 && nfds <= LINUX_FD_SETSIZE)
+	{
+		int r = vfs_select_ready(nfds, readfds, writefds, exceptfds, &complete);
+		if (r > 0)
+			return r;
+	}
+	if (complete && timeout == 0)
+	{
+		/* Nothing is ready and there is nothing to wait for */
+		if (readfds)
+			LINUX_FD_ZERO(nfds, readfds);
+		if (writefds)
+			LINUX_FD_ZERO(nfds, writefds);
+		if (exceptfds)
+			LINUX_FD_ZERO(nfds, exceptfds);
+		return 0;
+	}
+	/* Slow path, wait on the poll handles */
 	int cnt = 0;
 	struct linux_pollfd *fds = (struct linux_pollfd *)alloca(sizeof(struct linux_pollfd) * nfds);
 	for (int i = 0; i < nfds; i++)
@@ -2559,7 +3819,9 @@ DEFINE_SYSCALL(ppoll, struct linux_pollfd *, fds, int, nfds, const struct timesp
 		return -L_EFAULT;
 	if (sigmask && !mm_check_read(sigmask, sizeof(sigset_t)))
 		return -L_EFAULT;
-	int timeout = timeout_ts == NULL ? -1 : (timeout_ts->tv_sec * 1000 + timeout_ts->tv_nsec / 1000000);
+	int timeout = timeout_ts == NULL ? -1 : timer_timespec_to_ms(timeout_ts);
+	if (timeout < -1)
+		return timeout;
 	return vfs_ppoll(fds, nfds, timeout, sigmask);
 }
 
@@ -2600,7 +3862,9 @@ DEFINE_SYSCALL(pselect6, int, nfds, struct fdset *, readfds, struct fdset *, wri
 		|| (timeout_ts && !mm_check_read(timeout_ts, sizeof(struct timespec)))
 		|| (sigmask && !mm_check_read(sigmask, sizeof(sigset_t))))
 		return -L_EFAULT;
-	int timeout = timeout_ts == NULL ? -1 : (timeout_ts->tv_sec * 1000 + timeout_ts->tv_nsec / 1000000);
+	int timeout = timeout_ts == NULL ? -1 : timer_timespec_to_ms(timeout_ts);
+	if (timeout < -1)
+		return timeout;
 	return vfs_pselect6(nfds, readfds, writefds, exceptfds, timeout, sigmask);
 }
 
@@ -2618,7 +3882,7 @@ DEFINE_SYSCALL(epoll_create1, int, flags)
 		vfs_release(epollfd);
 
 out:
-	ReleaseSRWLockExclusive(&vfs->rw_lock);
+	vfs_unlock_exclusive();
 	return r;
 }
 
@@ -2633,41 +3897,43 @@ DEFINE_SYSCALL(epoll_create, int, size)
 DEFINE_SYSCALL(epoll_ctl, int, epfd, int, op, int, fd, struct epoll_event *, event)
 {
 	log_info("epoll_ctl(epfd=%d, op=%d, fd=%d, epoll_event=%p)", epfd, op, fd, event);
-	if (!mm_check_read(event, sizeof(struct epoll_event)))
-		return -L_EINVAL;
-	if ((event->events & EPOLLET))
-	{
-		log_error("Edge triggered epoll is not supported.");
-		return -L_EINVAL;
-	}
+	/* The event is ignored by EPOLL_CTL_DEL */
+	if (op != EPOLL_CTL_DEL && !mm_check_read(event, sizeof(struct epoll_event)))
+		return -L_EFAULT;
 	int r = 0;
+	struct file *mf = NULL;
 	struct file *f = vfs_get(epfd);
 	if (!f || !epollfd_is_epollfd(f))
 	{
 		r = -L_EBADF;
 		goto out;
 	}
-	struct file *mf = vfs_get(fd);
+	mf = vfs_get(fd);
 	if (!mf)
 	{
 		r = -L_EBADF;
 		goto out;
 	}
+	if (mf == f)
+	{
+		r = -L_EINVAL;
+		goto out;
+	}
 	switch (op)
 	{
 	case EPOLL_CTL_ADD:
 	{
-		r = epollfd_ctl_add(f, fd, event);
+		r = epollfd_ctl_add(f, fd, mf, event);
 		break;
 	}
 	case EPOLL_CTL_DEL:
 	{
-		r = epollfd_ctl_del(f, fd);
+		r = epollfd_ctl_del(f, fd, mf);
 		break;
 	}
 	case EPOLL_CTL_MOD:
 	{
-		r = epollfd_ctl_mod(f, fd, event);
+		r = epollfd_ctl_mod(f, fd, mf, event);
 		break;
 	}
 	default:
@@ -2684,6 +3950,8 @@ out:
 DEFINE_SYSCALL(epoll_pwait, int, epfd, struct epoll_event *, events, int, maxevents, int, timeout, const sigset_t *, sigmask)
 {
 	log_info("epoll_pwait(%d, %p, %d, %d, %p)", epfd, events, maxevents, timeout, sigmask);
+	if (maxevents <= 0)
+		return -L_EINVAL;
 	if (!mm_check_write(events, sizeof(struct epoll_event) * maxevents))
 		return -L_EFAULT;
 	if (sigmask && !mm_check_read(sigmask, sizeof(sigset_t)))
@@ -2695,13 +3963,7 @@ DEFINE_SYSCALL(epoll_pwait, int, epfd, struct epoll_event *, events, int, maxeve
 		r = -L_EBADF;
 		goto out;
 	}
-	int nfds = epollfd_get_nfds(f);
-	struct linux_pollfd *pollfds = (struct linux_pollfd *)alloca(sizeof(struct linux_pollfd) * nfds);
-	epollfd_to_pollfds(f, pollfds);
-	r = vfs_ppoll(pollfds, nfds, timeout, sigmask);
-	if (r < 0)
-		goto out;
-	r = epollfd_to_events(f, pollfds, events, maxevents);
+	r = epollfd_wait(f, events, maxevents, timeout, sigmask);
 out:
 	if (f)
 		vfs_release(f);
@@ -2797,16 +4059,47 @@ DEFINE_SYSCALL(fremovexattr, int, fd, const char *, name)
 	return -L_EOPNOTSUPP;
 }
 
-DEFINE_SYSCALL(fallocate, int, fd, int, mode, loff_t, offset, loff_t, len) 
+DEFINE_SYSCALL(fallocate, int, fd, int, mode, loff_t, offset, loff_t, len)
 {
-	log_info("fallocate(%d, %d, %d, %d)", fd, mode, offset, len);
-	log_warning("fallocate() not implemented.");
-	return -L_EOPNOTSUPP;
+	log_info("fallocate(%d, %d, %lld, %lld)", fd, mode, offset, len);
+	if (offset < 0 || len <= 0)
+		return -L_EINVAL;
+	if (offset > INT64_MAX - len)
+		return -L_EFBIG;
+	struct file *f = vfs_get(fd);
+	int r;
+	if (!f)
+		r = -L_EBADF;
+	else if ((f->flags & O_ACCMODE) == O_RDONLY)
+		r = -L_EBADF;
+	else if (!f->op_vtable->fallocate)
+	{
+		log_warning("fallocate() not implemented for the file.");
+		r = -L_EOPNOTSUPP;
+	}
+	else
+		r = f->op_vtable->fallocate(f, mode, offset, len);
+	if (f)
+		vfs_release(f);
+	return r;
 }
 
 DEFINE_SYSCALL(flock, int, fd, int, operation)
 {
 	log_info("flock(%d, %d)", fd, operation);
-	log_error("flock() not implemented.");
-	return 0;
+	struct file *f = vfs_get(fd);
+	int r;
+	if (!f || (f->flags & O_PATH))
+		r = -L_EBADF;
+	else if (!f->op_vtable->flock)
+	{
+		/* Nothing to coordinate with for files which cannot be shared with other processes */
+		log_info("flock() not supported for the file, ignored.");
+		r = 0;
+	}
+	else
+		r = f->op_vtable->flock(f, operation);
+	if (f)
+		vfs_release(f);
+	return r;
 }
@@ -21,6 +21,7 @@
 
 #include <common/stat.h>
 #include <common/dirent.h>
+#include <common/resource.h>
 #include <common/poll.h>
 #include <common/select.h>
 #include <common/uio.h>
@@ -31,7 +32,8 @@
 #include <stdint.h>
 
 #define PATH_MAX			4096
-#define MAX_FD_COUNT		1024
+#define MAX_FD_COUNT		65536	/* Ceiling of RLIMIT_NOFILE */
+#define DEFAULT_FD_LIMIT	1024	/* Initial RLIMIT_NOFILE soft limit */
 #define MAX_SYMLINK_LEVEL	8
 
 void vfs_init();
@@ -41,10 +43,26 @@ int vfs_fork(HANDLE process, DWORD process_id);
 void vfs_afterfork_parent();
 void vfs_afterfork_child();
 int vfs_store_file(struct file *f, int cloexec);
+void vfs_get_nofile_limit(struct rlimit64 *limit);
+int vfs_set_nofile_limit(const struct rlimit64 *limit);
 
 int vfs_openat(int dirfd, const char *pathname, int flags, int internal_flags, int mode, struct file **f);
+int vfs_statat(int dirfd, const char *pathname, struct newstat *stat, int flags);
 struct file *vfs_get(int fd);
 void vfs_ref(struct file *f);
 void vfs_release(struct file *f);
-void vfs_get_root_mountpoint(struct mount_point *mp);
-bool vfs_get_mountpoint(int key, struct mount_point *mp);
+/* Mount points are owned by vfs and stay valid, do not modify them */
+struct mount_point *vfs_get_root_mountpoint();
+/* Drop cached lookups after a change to the file system was observed, which may be made outside flinux
+ * path is NULL if the changed paths are unknown
+ */
+#define VFS_CHANGE_CREATED	0
+#define VFS_CHANGE_REMOVED	1
+#define VFS_CHANGE_MODIFIED	2
+void vfs_notify_change(const char *path, int change);
+struct mount_point *vfs_get_mountpoint(int key);
+/* Memory held by the path component cache, see cache.h */
+size_t vfs_dcache_size();
+void vfs_dcache_shrink(size_t target);
+/* Session wide change counter of winfs, bumped on every modification made through it in any process */
+volatile LONG *vfs_get_winfs_generation();
@@ -23,6 +23,22 @@
 typedef ULONGLONG (NTAPI RtlGetSystemTimePrecise_t)();
 static RtlGetSystemTimePrecise_t *pfnRtlGetSystemTimePrecise;
 
+typedef DWORD (WINAPI DiscardVirtualMemory_t)(PVOID VirtualAddress, SIZE_T Size);
+static DiscardVirtualMemory_t *pfnDiscardVirtualMemory;
+
+/* Same layout as WIN32_MEMORY_RANGE_ENTRY, which is only declared for Windows 8 targets */
+struct memory_range_entry
+{
+	PVOID VirtualAddress;
+	SIZE_T NumberOfBytes;
+};
+typedef BOOL (WINAPI PrefetchVirtualMemory_t)(HANDLE hProcess, ULONG_PTR NumberOfEntries, struct memory_range_entry *VirtualAddresses, ULONG Flags);
+static PrefetchVirtualMemory_t *pfnPrefetchVirtualMemory;
+
+typedef NTSTATUS (NTAPI NtQueryInformationByName_t)(POBJECT_ATTRIBUTES ObjectAttributes, PIO_STATUS_BLOCK IoStatusBlock,
+	PVOID FileInformation, ULONG Length, FILE_INFORMATION_CLASS FileInformationClass);
+static NtQueryInformationByName_t *pfnNtQueryInformationByName;
+
 void win7compat_GetSystemTimePreciseAsFileTime(LPFILETIME lpSystemTimePreciseAsFileTime)
 {
 	if (pfnRtlGetSystemTimePrecise)
@@ -35,6 +51,33 @@ void win7compat_GetSystemTimePreciseAsFileTime(LPFILETIME lpSystemTimePreciseAsF
 		GetSystemTimeAsFileTime(lpSystemTimePreciseAsFileTime);
 }
 
+DWORD win7compat_DiscardVirtualMemory(PVOID VirtualAddress, SIZE_T Size)
+{
+	if (pfnDiscardVirtualMemory)
+		return pfnDiscardVirtualMemory(VirtualAddress, Size);
+	if (!VirtualAlloc(VirtualAddress, Size, MEM_RESET, PAGE_NOACCESS))
+		return GetLastError();
+	return ERROR_SUCCESS;
+}
+
+BOOL win7compat_PrefetchVirtualMemory(PVOID VirtualAddress, SIZE_T NumberOfBytes)
+{
+	if (!pfnPrefetchVirtualMemory)
+		return FALSE;
+	struct memory_range_entry entry;
+	entry.VirtualAddress = VirtualAddress;
+	entry.NumberOfBytes = NumberOfBytes;
+	return pfnPrefetchVirtualMemory(GetCurrentProcess(), 1, &entry, 0);
+}
+
+NTSTATUS win7compat_NtQueryInformationByName(POBJECT_ATTRIBUTES ObjectAttributes, PIO_STATUS_BLOCK IoStatusBlock,
+	PVOID FileInformation, ULONG Length, int FileInformationClass)
+{
+	if (!pfnNtQueryInformationByName)
+		return STATUS_NOT_IMPLEMENTED;
+	return pfnNtQueryInformationByName(ObjectAttributes, IoStatusBlock, FileInformation, Length, (FILE_INFORMATION_CLASS)FileInformationClass);
+}
+
 void win7compat_init()
 {
 	HANDLE ntdll_handle;
@@ -46,4 +89,16 @@ void win7compat_init()
 	ANSI_STRING function_name;
 	RtlInitAnsiString(&function_name, "RtlGetSystemTimePrecise");
 	LdrGetProcedureAddress(ntdll_handle, &function_name, 0, (PVOID *)&pfnRtlGetSystemTimePrecise);
+	RtlInitAnsiString(&function_name, "NtQueryInformationByName");
+	LdrGetProcedureAddress(ntdll_handle, &function_name, 0, (PVOID *)&pfnNtQueryInformationByName);
+
+	HANDLE kernel32_handle;
+	RtlInitUnicodeString(&module_file_name, L"kernel32.dll");
+	status = LdrLoadDll(NULL, 0, &module_file_name, &kernel32_handle);
+	if (!NT_SUCCESS(status))
+		return;
+	RtlInitAnsiString(&function_name, "DiscardVirtualMemory");
+	LdrGetProcedureAddress(kernel32_handle, &function_name, 0, (PVOID *)&pfnDiscardVirtualMemory);
+	RtlInitAnsiString(&function_name, "PrefetchVirtualMemory");
+	LdrGetProcedureAddress(kernel32_handle, &function_name, 0, (PVOID *)&pfnPrefetchVirtualMemory);
 }
@@ -23,4 +23,13 @@
 #include <Windows.h>
 
 void win7compat_GetSystemTimePreciseAsFileTime(LPFILETIME lpSystemTimePreciseAsFileTime);
+/* Falls back to VirtualAlloc(MEM_RESET) before Windows 8.1 */
+DWORD win7compat_DiscardVirtualMemory(PVOID VirtualAddress, SIZE_T Size);
+/* Does nothing and returns FALSE before Windows 8 */
+BOOL win7compat_PrefetchVirtualMemory(PVOID VirtualAddress, SIZE_T NumberOfBytes);
+/* Returns STATUS_NOT_IMPLEMENTED before Windows 10 1709 */
+struct _OBJECT_ATTRIBUTES;
+struct _IO_STATUS_BLOCK;
+LONG win7compat_NtQueryInformationByName(struct _OBJECT_ATTRIBUTES *ObjectAttributes, struct _IO_STATUS_BLOCK *IoStatusBlock,
+	PVOID FileInformation, ULONG Length, int FileInformationClass);
 void win7compat_init();
@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+#
+# This file is part of Foreign Linux.
+#
+# Copyright (C) 2014, 2015 Xiangyan Sun <wishstudio@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+
+# Pack a directory tree into a read-only image for imgfs, see src/fs/imgfs.c for the format.
+# Run it under flinux so symlinks in the tree are seen the way flinux sees them:
+#   python3 mkimgfs.py /usr /usr.img
+# An image named usr.img in the root directory is mounted on /usr on next start, with the usr
+# directory next to it as a writable layer on top, see src/fs/overlayfs.c.
+
+import os
+import stat
+import struct
+import sys
+
+MAGIC = 0x53464D49
+VERSION = 1
+BLOCK_SIZE = 0x10000
+HEADER = struct.Struct('<IIIIQQQQQ')
+INODE = struct.Struct('<IIIIqIIQQ')
+DIRENT = struct.Struct('<III')
+
+
+def align(x, a):
+	return (x + a - 1) // a * a
+
+
+def main():
+	if len(sys.argv) != 3:
+		sys.exit('usage: mkimgfs.py <directory> <image>')
+	root, image = sys.argv[1], sys.argv[2]
+
+	inodes = [] # [st, path, parent, entries or target]
+	ino_map = {} # (st_dev, st_ino) -> inode number, for hard links
+	strings = bytearray()
+	string_map = {}
+
+	def add_string(s):
+		if s not in string_map:
+			string_map[s] = len(strings)
+			strings.extend(s)
+		return string_map[s]
+
+	def add_inode(path, parent):
+		st = os.lstat(path)
+		if not stat.S_ISDIR(st.st_mode) and st.st_nlink > 1 and (st.st_dev, st.st_ino) in ino_map:
+			return ino_map[(st.st_dev, st.st_ino)]
+		ino = len(inodes)
+		inodes.append([st, path, parent, None])
+		if not stat.S_ISDIR(st.st_mode):
+			ino_map[(st.st_dev, st.st_ino)] = ino
+		return ino
+
+	# Breadth first, so the entries of a directory are contiguous
+	add_inode(root, 0)
+	dirents = []
+	i = 0
+	while i < len(inodes):
+		st, path, parent, _ = inodes[i]
+		if stat.S_ISDIR(st.st_mode):
+			names = sorted(os.fsencode(n) for n in os.listdir(path))
+			first = len(dirents)
+			dirents.extend([None] * len(names))
+			for j, name in enumerate(names):
+				child = add_inode(os.path.join(os.fsencode(path), name), i)
+				dirents[first + j] = (child, add_string(name), len(name))
+			inodes[i][3] = (first, len(names))
+		elif stat.S_ISLNK(st.st_mode):
+			target = os.readlink(os.fsencode(path))
+			inodes[i][3] = (add_string(target), len(target))
+		i += 1
+
+	inode_table = HEADER.size
+	dirent_table = inode_table + INODE.size * len(inodes)
+	string_table = dirent_table + DIRENT.size * len(dirents)
+	data = align(string_table + len(strings), 4096)
+
+	# Lay out file data, large files block aligned so they can be mapped directly
+	offset = data
+	layout = {}
+	for ino, (st, path, parent, _) in enumerate(inodes):
+		if stat.S_ISREG(st.st_mode):
+			offset = align(offset, BLOCK_SIZE if st.st_size >= BLOCK_SIZE else 16)
+			layout[ino] = offset
+			offset += st.st_size
+
+	with open(image, 'wb') as f:
+		f.write(HEADER.pack(MAGIC, VERSION, len(inodes), len(dirents), inode_table, dirent_table, string_table, len(strings), data))
+		for ino, (st, path, parent, extra) in enumerate(inodes):
+			mode = st.st_mode
+			if stat.S_ISDIR(mode):
+				size, off = extra[1], extra[0]
+			elif stat.S_ISLNK(mode):
+				size, off = extra[1], extra[0]
+			elif stat.S_ISREG(mode):
+				size, off = st.st_size, layout[ino]
+			else:
+				print('Skipping special file %s' % path, file=sys.stderr)
+				mode, size, off = stat.S_IFREG | 0o644, 0, 0
+			f.write(INODE.pack(mode, st.st_uid, st.st_gid, st.st_nlink, int(st.st_mtime), st.st_mtime_ns % 1000000000,
+				parent, size, off))
+		for dirent in dirents:
+			f.write(DIRENT.pack(*dirent))
+		f.write(strings)
+		for ino, (st, path, parent, _) in enumerate(inodes):
+			if ino in layout:
+				f.seek(layout[ino])
+				with open(path, 'rb') as src:
+					remain = st.st_size
+					while remain > 0:
+						buf = src.read(min(remain, 1 << 20))
+						if not buf:
+							sys.exit('%s: File shrunk while packing' % path)
+						f.write(buf)
+						remain -= len(buf)
+		f.truncate(max(offset, data))
+
+
+if __name__ == '__main__':
+	main()